@@ -28,12 +28,52 @@
 #include "hw/boards.h"
 #include "sysemu/arch_init.h"
 #include "sysemu/sysemu.h"
+#include "qapi/error.h"
+#include "qapi/visitor.h"
 #include "qom/object.h"
 
+static void accel_get_halt_poll_max_ns(Object *obj, Visitor *v,
+                                       const char *name, void *opaque,
+                                       Error **errp)
+{
+    AccelState *accel = ACCEL(obj);
+
+    visit_type_uint64(v, name, &accel->halt_poll_max_ns, errp);
+}
+
+static void accel_set_halt_poll_max_ns(Object *obj, Visitor *v,
+                                       const char *name, void *opaque,
+                                       Error **errp)
+{
+    AccelState *accel = ACCEL(obj);
+    uint64_t value;
+
+    if (!visit_type_uint64(v, name, &value, errp)) {
+        return;
+    }
+    if (value > INT64_MAX) {
+        error_setg(errp, "halt-poll-max-ns must not exceed %" PRId64,
+                   INT64_MAX);
+        return;
+    }
+    accel->halt_poll_max_ns = value;
+}
+
+static void accel_class_init(ObjectClass *oc, void *data)
+{
+    object_class_property_add(oc, "halt-poll-max-ns", "uint64",
+        accel_get_halt_poll_max_ns, accel_set_halt_poll_max_ns,
+        NULL, NULL);
+    object_class_property_set_description(oc, "halt-poll-max-ns",
+        "Maximum time an idle vCPU polls for work before sleeping, "
+        "in nanoseconds (0 = disabled)");
+}
+
 static const TypeInfo accel_type = {
     .name = TYPE_ACCEL,
     .parent = TYPE_OBJECT,
     .class_size = sizeof(AccelClass),
+    .class_init = accel_class_init,
     .instance_size = sizeof(AccelState),
 };
 
@@ -57,6 +57,7 @@
 #include "sysemu/hvf_int.h"
 #include "sysemu/runstate.h"
 #include "qemu/guest-random.h"
+#include "qemu/stats.h"
 
 #ifdef __aarch64__
 #define HV_VM_DEFAULT NULL
@@ -204,12 +205,12 @@ static void hvf_set_dirty_tracking(MemoryRegionSection *section, bool on)
     if (on) {
         slot->flags |= HVF_SLOT_LOG;
         hv_vm_protect((uintptr_t)slot->start, (size_t)slot->size,
-                      HV_MEMORY_READ);
+                      HV_MEMORY_READ | HV_MEMORY_EXEC);
     /* stop tracking region*/
     } else {
         slot->flags &= ~HVF_SLOT_LOG;
         hv_vm_protect((uintptr_t)slot->start, (size_t)slot->size,
-                      HV_MEMORY_READ | HV_MEMORY_WRITE);
+                      HV_MEMORY_READ | HV_MEMORY_WRITE | HV_MEMORY_EXEC);
     }
 }
 
@@ -237,8 +238,9 @@ static void hvf_log_sync(MemoryListener *listener,
                          MemoryRegionSection *section)
 {
     /*
-     * sync of dirty pages is handled elsewhere; just make sure we keep
-     * tracking the region.
+     * Pages are marked dirty as their first write faults, see
+     * ept_emulation_fault(); write-protect the region again so that
+     * writes after this sync are caught too.
      */
     hvf_set_dirty_tracking(section, 1);
 }
@@ -301,11 +303,54 @@ static void hvf_cpu_synchronize_pre_loadvm(CPUState *cpu)
     run_on_cpu(cpu, do_hvf_cpu_synchronize_set_dirty, RUN_ON_CPU_NULL);
 }
 
+static const StatsDesc hvf_vcpu_stats_desc[HVF_VCPU_STAT__MAX] = {
+    [HVF_VCPU_STAT_EXITS] = {
+        .name = "exits", .type = STATS_TYPE_CUMULATIVE },
+    [HVF_VCPU_STAT_MMIO_EXITS] = {
+        .name = "mmio_exits", .type = STATS_TYPE_CUMULATIVE },
+    [HVF_VCPU_STAT_IO_EXITS] = {
+        .name = "io_exits", .type = STATS_TYPE_CUMULATIVE },
+    [HVF_VCPU_STAT_DIRTY_LOG_EXITS] = {
+        .name = "dirty_log_exits", .type = STATS_TYPE_CUMULATIVE },
+    [HVF_VCPU_STAT_APIC_ACCESS_EXITS] = {
+        .name = "apic_access_exits", .type = STATS_TYPE_CUMULATIVE },
+    [HVF_VCPU_STAT_HLT_EXITS] = {
+        .name = "hlt_exits", .type = STATS_TYPE_CUMULATIVE },
+    [HVF_VCPU_STAT_IRQ_WINDOW_EXITS] = {
+        .name = "irq_window_exits", .type = STATS_TYPE_CUMULATIVE },
+};
+
+static char *hvf_vcpu_stats_get_id(void *opaque)
+{
+    return object_get_canonical_path(OBJECT(opaque));
+}
+
+static void hvf_vcpu_stats_read(void *opaque, uint64_t *values)
+{
+    CPUState *cpu = opaque;
+    int i;
+
+    for (i = 0; i < HVF_VCPU_STAT__MAX; i++) {
+        values[i] = stat64_get(&cpu->hvf->stats[i]);
+    }
+}
+
+static const StatsGroup hvf_vcpu_stats_group = {
+    .provider = STATS_PROVIDER_HVF,
+    .target = STATS_TARGET_VCPU,
+    .stats = hvf_vcpu_stats_desc,
+    .nr_stats = HVF_VCPU_STAT__MAX,
+    .get_id = hvf_vcpu_stats_get_id,
+    .read = hvf_vcpu_stats_read,
+};
+
 static void hvf_vcpu_destroy(CPUState *cpu)
 {
     hv_return_t ret = hv_vcpu_destroy(cpu->hvf->fd);
     assert_hvf_ok(ret);
 
+    stats_unregister(cpu->hvf->stats_source);
+
     hvf_arch_vcpu_destroy(cpu);
     free(cpu->hvf);
     cpu->hvf = NULL;
@@ -339,6 +384,8 @@ static int hvf_init_vcpu(CPUState *cpu)
     cpu->vcpu_dirty = 1;
     assert_hvf_ok(r);
 
+    cpu->hvf->stats_source = stats_register(&hvf_vcpu_stats_group, cpu);
+
     return hvf_arch_init_vcpu(cpu);
 }
 
@@ -45,6 +45,7 @@
 #include "qapi/qapi-visit-common.h"
 #include "sysemu/reset.h"
 #include "qemu/guest-random.h"
+#include "qemu/stats.h"
 #include "sysemu/hw_accel.h"
 #include "kvm-cpus.h"
 
@@ -75,6 +76,8 @@
 struct KVMParkedVcpu {
     unsigned long vcpu_id;
     int kvm_fd;
+    /* KVM keeps the dirty ring of the vcpu, and where we are in it */
+    uint32_t kvm_fetch_index;
     QLIST_ENTRY(KVMParkedVcpu) node;
 };
 
@@ -104,6 +107,11 @@ struct KVMState
     OnOffAuto kernel_irqchip_split;
     bool sync_mmu;
     uint64_t manual_dirty_log_protect;
+    /* Number of entries of each vcpu dirty ring, 0 if not used */
+    uint32_t kvm_dirty_ring_size;
+    QemuThread dirty_ring_reaper;
+    /* Set while global dirty logging is on, the reaper waits for it */
+    QemuEvent dirty_ring_reaper_event;
     /* The man page (and posix) say ioctl numbers are signed int, but
      * they're not.  Linux, glibc and *BSD all treat ioctl numbers as
      * unsigned, and treating them as signed here can break things */
@@ -176,8 +184,17 @@ typedef struct KVMResampleFd KVMResampleFd;
 static QLIST_HEAD(, KVMResampleFd) kvm_resample_fd_list =
     QLIST_HEAD_INITIALIZER(kvm_resample_fd_list);
 
-#define kvm_slots_lock(kml)      qemu_mutex_lock(&(kml)->slots_lock)
-#define kvm_slots_unlock(kml)    qemu_mutex_unlock(&(kml)->slots_lock)
+/*
+ * Protects the slots of all the KVMMemoryListeners and all inside them.
+ * A single lock lets the dirty ring, which holds entries for any address
+ * space, be harvested in one go.
+ */
+static QemuMutex kml_slots_lock;
+
+#define kvm_slots_lock()      qemu_mutex_lock(&kml_slots_lock)
+#define kvm_slots_unlock()    qemu_mutex_unlock(&kml_slots_lock)
+
+static uint64_t kvm_dirty_ring_reap_locked(KVMState *s);
 
 static inline void kvm_resample_fd_remove(int gsi)
 {
@@ -242,7 +259,7 @@ int kvm_memcrypt_encrypt_data(uint8_t *ptr, uint64_t len)
     return 1;
 }
 
-/* Called with KVMMemoryListener.slots_lock held */
+/* Called with kml_slots_lock held */
 static KVMSlot *kvm_get_free_slot(KVMMemoryListener *kml)
 {
     KVMState *s = kvm_state;
@@ -263,14 +280,14 @@ bool kvm_has_free_slot(MachineState *ms)
     bool result;
     KVMMemoryListener *kml = &s->memory_listener;
 
-    kvm_slots_lock(kml);
+    kvm_slots_lock();
     result = !!kvm_get_free_slot(kml);
-    kvm_slots_unlock(kml);
+    kvm_slots_unlock();
 
     return result;
 }
 
-/* Called with KVMMemoryListener.slots_lock held */
+/* Called with kml_slots_lock held */
 static KVMSlot *kvm_alloc_slot(KVMMemoryListener *kml)
 {
     KVMSlot *slot = kvm_get_free_slot(kml);
@@ -331,7 +348,7 @@ int kvm_physical_memory_addr_from_host(KVMState *s, void *ram,
     KVMMemoryListener *kml = &s->memory_listener;
     int i, ret = 0;
 
-    kvm_slots_lock(kml);
+    kvm_slots_lock();
     for (i = 0; i < s->nr_slots; i++) {
         KVMSlot *mem = &kml->slots[i];
 
@@ -341,7 +358,7 @@ int kvm_physical_memory_addr_from_host(KVMState *s, void *ram,
             break;
         }
     }
-    kvm_slots_unlock(kml);
+    kvm_slots_unlock();
 
     return ret;
 }
@@ -381,6 +398,69 @@ err:
     return ret;
 }
 
+/* Counted by the vCPU thread, see kvm_cpu_exec() */
+enum {
+    KVM_VCPU_STAT_EXITS,
+    KVM_VCPU_STAT_IO_EXITS,
+    KVM_VCPU_STAT_MMIO_EXITS,
+    KVM_VCPU_STAT_IRQ_WINDOW_EXITS,
+    KVM_VCPU_STAT_DIRTY_RING_FULL_EXITS,
+    KVM_VCPU_STAT_ARCH_EXITS,
+    KVM_VCPU_STAT_SIGNAL_EXITS,
+    KVM_VCPU_STAT__MAX,
+};
+
+struct KVMVCPUStats {
+    Stat64 counters[KVM_VCPU_STAT__MAX];
+    StatsSource *source;
+};
+
+static const StatsDesc kvm_vcpu_stats_desc[KVM_VCPU_STAT__MAX] = {
+    [KVM_VCPU_STAT_EXITS] = {
+        .name = "exits", .type = STATS_TYPE_CUMULATIVE },
+    [KVM_VCPU_STAT_IO_EXITS] = {
+        .name = "io_exits", .type = STATS_TYPE_CUMULATIVE },
+    [KVM_VCPU_STAT_MMIO_EXITS] = {
+        .name = "mmio_exits", .type = STATS_TYPE_CUMULATIVE },
+    [KVM_VCPU_STAT_IRQ_WINDOW_EXITS] = {
+        .name = "irq_window_exits", .type = STATS_TYPE_CUMULATIVE },
+    [KVM_VCPU_STAT_DIRTY_RING_FULL_EXITS] = {
+        .name = "dirty_ring_full_exits", .type = STATS_TYPE_CUMULATIVE },
+    [KVM_VCPU_STAT_ARCH_EXITS] = {
+        .name = "arch_exits", .type = STATS_TYPE_CUMULATIVE },
+    [KVM_VCPU_STAT_SIGNAL_EXITS] = {
+        .name = "signal_exits", .type = STATS_TYPE_CUMULATIVE },
+};
+
+static char *kvm_vcpu_stats_get_id(void *opaque)
+{
+    return object_get_canonical_path(OBJECT(opaque));
+}
+
+static void kvm_vcpu_stats_read(void *opaque, uint64_t *values)
+{
+    CPUState *cpu = opaque;
+    int i;
+
+    for (i = 0; i < KVM_VCPU_STAT__MAX; i++) {
+        values[i] = stat64_get(&cpu->kvm_stats->counters[i]);
+    }
+}
+
+static const StatsGroup kvm_vcpu_stats_group = {
+    .provider = STATS_PROVIDER_KVM,
+    .target = STATS_TARGET_VCPU,
+    .stats = kvm_vcpu_stats_desc,
+    .nr_stats = KVM_VCPU_STAT__MAX,
+    .get_id = kvm_vcpu_stats_get_id,
+    .read = kvm_vcpu_stats_read,
+};
+
+static inline void kvm_vcpu_stat_inc(CPUState *cpu, int stat)
+{
+    stat64_add_single_writer(&cpu->kvm_stats->counters[stat], 1);
+}
+
 static int do_kvm_destroy_vcpu(CPUState *cpu)
 {
     KVMState *s = kvm_state;
@@ -390,6 +470,12 @@ static int do_kvm_destroy_vcpu(CPUState *cpu)
 
     DPRINTF("kvm_destroy_vcpu\n");
 
+    if (cpu->kvm_stats) {
+        stats_unregister(cpu->kvm_stats->source);
+        g_free(cpu->kvm_stats);
+        cpu->kvm_stats = NULL;
+    }
+
     ret = kvm_arch_destroy_vcpu(cpu);
     if (ret < 0) {
         goto err;
@@ -407,9 +493,27 @@ static int do_kvm_destroy_vcpu(CPUState *cpu)
         goto err;
     }
 
+    if (cpu->kvm_dirty_gfns) {
+        struct kvm_dirty_gfn *dirty_gfns;
+
+        /* Keep the pages that the vcpu dirtied before it went away */
+        kvm_slots_lock();
+        kvm_dirty_ring_reap_locked(s);
+        dirty_gfns = cpu->kvm_dirty_gfns;
+        cpu->kvm_dirty_gfns = NULL;
+        kvm_slots_unlock();
+
+        ret = munmap(dirty_gfns, s->kvm_dirty_ring_size *
+                                 sizeof(struct kvm_dirty_gfn));
+        if (ret < 0) {
+            goto err;
+        }
+    }
+
     vcpu = g_malloc0(sizeof(*vcpu));
     vcpu->vcpu_id = kvm_arch_vcpu_id(cpu);
     vcpu->kvm_fd = cpu->kvm_fd;
+    vcpu->kvm_fetch_index = cpu->kvm_fetch_index;
     QLIST_INSERT_HEAD(&kvm_state->kvm_parked_vcpus, vcpu, node);
 err:
     return ret;
@@ -423,7 +527,8 @@ void kvm_destroy_vcpu(CPUState *cpu)
     }
 }
 
-static int kvm_get_vcpu(KVMState *s, unsigned long vcpu_id)
+static int kvm_get_vcpu(KVMState *s, unsigned long vcpu_id,
+                        uint32_t *fetch_index)
 {
     struct KVMParkedVcpu *cpu;
 
@@ -433,11 +538,13 @@ static int kvm_get_vcpu(KVMState *s, unsigned long vcpu_id)
 
             QLIST_REMOVE(cpu, node);
             kvm_fd = cpu->kvm_fd;
+            *fetch_index = cpu->kvm_fetch_index;
             g_free(cpu);
             return kvm_fd;
         }
     }
 
+    *fetch_index = 0;
     return kvm_vm_ioctl(s, KVM_CREATE_VCPU, (void *)vcpu_id);
 }
 
@@ -449,7 +556,7 @@ int kvm_init_vcpu(CPUState *cpu, Error **errp)
 
     trace_kvm_init_vcpu(cpu->cpu_index, kvm_arch_vcpu_id(cpu));
 
-    ret = kvm_get_vcpu(s, kvm_arch_vcpu_id(cpu));
+    ret = kvm_get_vcpu(s, kvm_arch_vcpu_id(cpu), &cpu->kvm_fetch_index);
     if (ret < 0) {
         error_setg_errno(errp, -ret, "kvm_init_vcpu: kvm_get_vcpu failed (%lu)",
                          kvm_arch_vcpu_id(cpu));
@@ -483,12 +590,35 @@ int kvm_init_vcpu(CPUState *cpu, Error **errp)
             (void *)cpu->kvm_run + s->coalesced_mmio * PAGE_SIZE;
     }
 
+    if (s->kvm_dirty_ring_size) {
+        void *dirty_gfns;
+
+        dirty_gfns = mmap(NULL, s->kvm_dirty_ring_size *
+                                sizeof(struct kvm_dirty_gfn),
+                          PROT_READ | PROT_WRITE, MAP_SHARED, cpu->kvm_fd,
+                          PAGE_SIZE * KVM_DIRTY_LOG_PAGE_OFFSET);
+        if (dirty_gfns == MAP_FAILED) {
+            ret = -errno;
+            error_setg_errno(errp, -ret,
+                             "kvm_init_vcpu: mmap'ing dirty ring failed (%lu)",
+                             kvm_arch_vcpu_id(cpu));
+            goto err;
+        }
+        kvm_slots_lock();
+        cpu->kvm_dirty_gfns = dirty_gfns;
+        kvm_slots_unlock();
+    }
+
     ret = kvm_arch_init_vcpu(cpu);
     if (ret < 0) {
         error_setg_errno(errp, -ret,
                          "kvm_init_vcpu: kvm_arch_init_vcpu failed (%lu)",
                          kvm_arch_vcpu_id(cpu));
+        goto err;
     }
+
+    cpu->kvm_stats = g_new0(KVMVCPUStats, 1);
+    cpu->kvm_stats->source = stats_register(&kvm_vcpu_stats_group, cpu);
 err:
     return ret;
 }
@@ -511,7 +641,7 @@ static int kvm_mem_flags(MemoryRegion *mr)
     return flags;
 }
 
-/* Called with KVMMemoryListener.slots_lock held */
+/* Called with kml_slots_lock held */
 static int kvm_slot_update_flags(KVMMemoryListener *kml, KVMSlot *mem,
                                  MemoryRegion *mr)
 {
@@ -537,7 +667,7 @@ static int kvm_section_update_flags(KVMMemoryListener *kml,
         return 0;
     }
 
-    kvm_slots_lock(kml);
+    kvm_slots_lock();
 
     while (size && !ret) {
         slot_size = MIN(kvm_max_slot_size, size);
@@ -553,7 +683,7 @@ static int kvm_section_update_flags(KVMMemoryListener *kml,
     }
 
 out:
-    kvm_slots_unlock(kml);
+    kvm_slots_unlock();
     return ret;
 }
 
@@ -626,13 +756,184 @@ static void kvm_memslot_init_dirty_bitmap(KVMSlot *mem)
     mem->dirty_bmap = g_malloc0(bitmap_size);
 }
 
+/*
+ * Dirty ring.  Each vcpu pushes the pages that it dirties to its own
+ * ring, so that collecting them costs O(dirty pages) rather than
+ * O(guest RAM) like KVM_GET_DIRTY_LOG does.
+ */
+
+/* Called with kml_slots_lock held */
+static KVMSlot *kvm_dirty_ring_find_slot(KVMState *s, uint32_t slot_id)
+{
+    int as_id = slot_id >> 16;
+    int id = slot_id & 0xffff;
+    int i;
+
+    if (id >= s->nr_slots) {
+        return NULL;
+    }
+    for (i = 0; i < s->nr_as; i++) {
+        if (s->as[i].ml && s->as[i].ml->as_id == as_id) {
+            return &s->as[i].ml->slots[id];
+        }
+    }
+    return NULL;
+}
+
+/* Called with kml_slots_lock held */
+static void kvm_dirty_ring_mark_page(KVMState *s, uint32_t slot_id,
+                                     uint64_t offset)
+{
+    KVMSlot *mem = kvm_dirty_ring_find_slot(s, slot_id);
+    uint8_t clients = DIRTY_CLIENTS_NOCODE;
+
+    if (!mem || offset >= mem->memory_size / qemu_real_host_page_size) {
+        /* The slot went away after the page was pushed to the ring */
+        return;
+    }
+    if (!global_dirty_log) {
+        clients &= ~(1 << DIRTY_MEMORY_MIGRATION);
+    }
+    cpu_physical_memory_set_dirty_range(mem->ram_start_offset +
+                                        offset * qemu_real_host_page_size,
+                                        qemu_real_host_page_size, clients);
+}
+
+/* Called with kml_slots_lock held */
+static uint32_t kvm_dirty_ring_reap_one(KVMState *s, CPUState *cpu)
+{
+    struct kvm_dirty_gfn *dirty_gfns = cpu->kvm_dirty_gfns;
+    uint32_t ring_size = s->kvm_dirty_ring_size;
+    uint32_t fetch = cpu->kvm_fetch_index;
+    uint32_t count = 0;
+
+    if (!dirty_gfns) {
+        /* The vcpu is not fully created, or it is going away */
+        return 0;
+    }
+
+    for (;;) {
+        struct kvm_dirty_gfn *cur = &dirty_gfns[fetch & (ring_size - 1)];
+
+        /* Entries have to be collected in order, stop at the first hole */
+        if (qatomic_load_acquire(&cur->flags) != KVM_DIRTY_GFN_F_DIRTY) {
+            break;
+        }
+        kvm_dirty_ring_mark_page(s, cur->slot, cur->offset);
+        qatomic_store_release(&cur->flags, KVM_DIRTY_GFN_F_RESET);
+        fetch++;
+        count++;
+    }
+    cpu->kvm_fetch_index = fetch;
+    stat64_add(&cpu->dirty_pages, count);
+
+    return count;
+}
+
+/**
+ * kvm_dirty_ring_reap_locked - Collect the dirty pages of all vcpu rings
+ *
+ * The pages go straight to the global dirty bitmaps, where the next
+ * bitmap sync of migration picks them up.  The collected entries are
+ * then handed back to KVM, which write protects the pages again.
+ *
+ * NOTE: caller must be with kml_slots_lock held.
+ *
+ * @s: the KVM state
+ */
+static uint64_t kvm_dirty_ring_reap_locked(KVMState *s)
+{
+    CPUState *cpu;
+    uint64_t total = 0;
+    int ret;
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        CPU_FOREACH(cpu) {
+            total += kvm_dirty_ring_reap_one(s, cpu);
+        }
+    }
+
+    if (total) {
+        ret = kvm_vm_ioctl(s, KVM_RESET_DIRTY_RINGS);
+        if (ret < 0) {
+            error_report("%s: KVM_RESET_DIRTY_RINGS failed: %s",
+                         __func__, strerror(-ret));
+            abort();
+        }
+        trace_kvm_dirty_ring_reap(total);
+    }
+
+    return total;
+}
+
+static uint64_t kvm_dirty_ring_reap(KVMState *s)
+{
+    uint64_t total;
+
+    kvm_slots_lock();
+    total = kvm_dirty_ring_reap_locked(s);
+    kvm_slots_unlock();
+
+    return total;
+}
+
+static void do_kvm_cpu_synchronize_kick(CPUState *cpu, run_on_cpu_data arg)
+{
+    /* Returning to userspace was all that was needed */
+}
+
+/**
+ * kvm_dirty_ring_flush - Collect all pages dirtied until now
+ *
+ * A vcpu can hold dirty pages that are not in its ring yet, for example
+ * in the PML buffer of the processor.  They are pushed to the ring when
+ * the vcpu exits to userspace, so kick every vcpu out and wait for it
+ * before collecting the rings.
+ *
+ * NOTE: caller must hold the BQL, and not kml_slots_lock, which a vcpu
+ * may need to handle a full ring.
+ *
+ * @s: the KVM state
+ */
+static void kvm_dirty_ring_flush(KVMState *s)
+{
+    CPUState *cpu;
+
+    assert(qemu_mutex_iothread_locked());
+    CPU_FOREACH(cpu) {
+        run_on_cpu(cpu, do_kvm_cpu_synchronize_kick, RUN_ON_CPU_NULL);
+    }
+    kvm_dirty_ring_reap(s);
+}
+
+/*
+ * Collect the rings in the background too while migration tracks dirty
+ * pages, so that vcpus rarely exit because their ring is full and bitmap
+ * syncs find little work left.
+ */
+static void *kvm_dirty_ring_reaper_thread(void *opaque)
+{
+    KVMState *s = opaque;
+
+    rcu_register_thread();
+
+    while (true) {
+        qemu_event_wait(&s->dirty_ring_reaper_event);
+        sleep(1);
+        kvm_dirty_ring_reap(s);
+    }
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
 /**
  * kvm_physical_sync_dirty_bitmap - Sync dirty bitmap from kernel space
  *
  * This function will first try to fetch dirty bitmap from the kernel,
  * and then updates qemu's dirty bitmap.
  *
- * NOTE: caller must be with kml->slots_lock held.
+ * NOTE: caller must be with kml_slots_lock held.
  *
  * @kml: the KVM memory listener object
  * @section: the memory section to sync the dirty bitmap with
@@ -824,7 +1125,7 @@ static int kvm_physical_log_clear(KVMMemoryListener *kml,
         return ret;
     }
 
-    kvm_slots_lock(kml);
+    kvm_slots_lock();
 
     for (i = 0; i < s->nr_slots; i++) {
         mem = &kml->slots[i];
@@ -850,7 +1151,7 @@ static int kvm_physical_log_clear(KVMMemoryListener *kml,
         }
     }
 
-    kvm_slots_unlock(kml);
+    kvm_slots_unlock();
 
     return ret;
 }
@@ -1134,6 +1435,7 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
     MemoryRegion *mr = section->mr;
     bool writeable = !mr->readonly && !mr->rom_device;
     hwaddr start_addr, size, slot_size;
+    ram_addr_t ram_start_offset;
     void *ram;
 
     if (!memory_region_is_ram(mr)) {
@@ -1154,8 +1456,11 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
     /* use aligned delta to align the ram address */
     ram = memory_region_get_ram_ptr(mr) + section->offset_within_region +
           (start_addr - section->offset_within_address_space);
+    ram_start_offset = memory_region_get_ram_addr(mr) +
+                       section->offset_within_region +
+                       (start_addr - section->offset_within_address_space);
 
-    kvm_slots_lock(kml);
+    kvm_slots_lock();
 
     if (!add) {
         do {
@@ -1165,7 +1470,16 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
                 goto out;
             }
             if (mem->flags & KVM_MEM_LOG_DIRTY_PAGES) {
-                kvm_physical_sync_dirty_bitmap(kml, section);
+                if (kvm_state->kvm_dirty_ring_size) {
+                    /*
+                     * Pages that a running vcpu has not pushed to its
+                     * ring yet will refer to a removed slot and are
+                     * dropped; those of the stopped vcpus are all there.
+                     */
+                    kvm_dirty_ring_reap_locked(kvm_state);
+                } else {
+                    kvm_physical_sync_dirty_bitmap(kml, section);
+                }
             }
 
             /* unregister the slot */
@@ -1192,9 +1506,11 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
         mem->memory_size = slot_size;
         mem->start_addr = start_addr;
         mem->ram = ram;
+        mem->ram_start_offset = ram_start_offset;
         mem->flags = kvm_mem_flags(mr);
 
-        if (mem->flags & KVM_MEM_LOG_DIRTY_PAGES) {
+        if (mem->flags & KVM_MEM_LOG_DIRTY_PAGES &&
+            !kvm_state->kvm_dirty_ring_size) {
             /*
              * Reallocate the bmap; it means it doesn't disappear in
              * middle of a migrate.
@@ -1208,12 +1524,13 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
             abort();
         }
         start_addr += slot_size;
+        ram_start_offset += slot_size;
         ram += slot_size;
         size -= slot_size;
     } while (size);
 
 out:
-    kvm_slots_unlock(kml);
+    kvm_slots_unlock();
 }
 
 static void kvm_region_add(MemoryListener *listener,
@@ -1240,14 +1557,30 @@ static void kvm_log_sync(MemoryListener *listener,
     KVMMemoryListener *kml = container_of(listener, KVMMemoryListener, listener);
     int r;
 
-    kvm_slots_lock(kml);
+    kvm_slots_lock();
     r = kvm_physical_sync_dirty_bitmap(kml, section);
-    kvm_slots_unlock(kml);
+    kvm_slots_unlock();
     if (r < 0) {
         abort();
     }
 }
 
+/* The rings hold the pages of all slots, they are synced all at once */
+static void kvm_log_sync_global(MemoryListener *listener)
+{
+    kvm_dirty_ring_flush(kvm_state);
+}
+
+static void kvm_log_global_start(MemoryListener *listener)
+{
+    qemu_event_set(&kvm_state->dirty_ring_reaper_event);
+}
+
+static void kvm_log_global_stop(MemoryListener *listener)
+{
+    qemu_event_reset(&kvm_state->dirty_ring_reaper_event);
+}
+
 static void kvm_log_clear(MemoryListener *listener,
                           MemoryRegionSection *section)
 {
@@ -1342,7 +1675,6 @@ void kvm_memory_listener_register(KVMState *s, KVMMemoryListener *kml,
 {
     int i;
 
-    qemu_mutex_init(&kml->slots_lock);
     kml->slots = g_malloc0(s->nr_slots * sizeof(KVMSlot));
     kml->as_id = as_id;
 
@@ -1354,7 +1686,14 @@ void kvm_memory_listener_register(KVMState *s, KVMMemoryListener *kml,
     kml->listener.region_del = kvm_region_del;
     kml->listener.log_start = kvm_log_start;
     kml->listener.log_stop = kvm_log_stop;
-    kml->listener.log_sync = kvm_log_sync;
+    if (!s->kvm_dirty_ring_size) {
+        kml->listener.log_sync = kvm_log_sync;
+    } else if (as_id == 0) {
+        /* The rings cover every address space, one listener is enough */
+        kml->listener.log_sync_global = kvm_log_sync_global;
+        kml->listener.log_global_start = kvm_log_global_start;
+        kml->listener.log_global_stop = kvm_log_global_stop;
+    }
     kml->listener.log_clear = kvm_log_clear;
     kml->listener.priority = 10;
 
@@ -2018,6 +2357,8 @@ static int kvm_init(MachineState *ms)
 
     s = KVM_STATE(ms->accelerator);
 
+    qemu_mutex_init(&kml_slots_lock);
+
     /*
      * On systems where the kernel can support different base page
      * sizes, host page size may be different from TARGET_PAGE_SIZE,
@@ -2140,20 +2481,52 @@ static int kvm_init(MachineState *ms)
     s->coalesced_pio = s->coalesced_mmio &&
                        kvm_check_extension(s, KVM_CAP_COALESCED_PIO);
 
-    dirty_log_manual_caps =
-        kvm_check_extension(s, KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2);
-    dirty_log_manual_caps &= (KVM_DIRTY_LOG_MANUAL_PROTECT_ENABLE |
-                              KVM_DIRTY_LOG_INITIALLY_SET);
-    s->manual_dirty_log_protect = dirty_log_manual_caps;
-    if (dirty_log_manual_caps) {
-        ret = kvm_vm_enable_cap(s, KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2, 0,
-                                   dirty_log_manual_caps);
-        if (ret) {
-            warn_report("Trying to enable capability %"PRIu64" of "
-                        "KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2 but failed. "
-                        "Falling back to the legacy mode. ",
-                        dirty_log_manual_caps);
-            s->manual_dirty_log_protect = 0;
+    /*
+     * The dirty ring has to be enabled before any vcpu is created.  It
+     * replaces the dirty bitmap, so the manual protection of the latter
+     * is not needed with it.
+     */
+    if (s->kvm_dirty_ring_size) {
+        uint64_t ring_bytes = (uint64_t)s->kvm_dirty_ring_size *
+                              sizeof(struct kvm_dirty_gfn);
+        int max_ring_bytes = kvm_vm_check_extension(s, KVM_CAP_DIRTY_LOG_RING);
+
+        if (max_ring_bytes <= 0) {
+            warn_report("KVM dirty ring not available, "
+                        "falling back to the dirty bitmap");
+            s->kvm_dirty_ring_size = 0;
+        } else if (ring_bytes > max_ring_bytes) {
+            error_report("KVM dirty ring size %" PRIu32 " too big "
+                         "(maximum is %zu)", s->kvm_dirty_ring_size,
+                         max_ring_bytes / sizeof(struct kvm_dirty_gfn));
+            ret = -EINVAL;
+            goto err;
+        } else {
+            ret = kvm_vm_enable_cap(s, KVM_CAP_DIRTY_LOG_RING, 0, ring_bytes);
+            if (ret) {
+                error_report("Enabling of KVM dirty ring failed: %s",
+                             strerror(-ret));
+                goto err;
+            }
+        }
+    }
+
+    if (!s->kvm_dirty_ring_size) {
+        dirty_log_manual_caps =
+            kvm_check_extension(s, KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2);
+        dirty_log_manual_caps &= (KVM_DIRTY_LOG_MANUAL_PROTECT_ENABLE |
+                                  KVM_DIRTY_LOG_INITIALLY_SET);
+        s->manual_dirty_log_protect = dirty_log_manual_caps;
+        if (dirty_log_manual_caps) {
+            ret = kvm_vm_enable_cap(s, KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2, 0,
+                                    dirty_log_manual_caps);
+            if (ret) {
+                warn_report("Trying to enable capability %"PRIu64" of "
+                            "KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2 but failed. "
+                            "Falling back to the legacy mode. ",
+                            dirty_log_manual_caps);
+                s->manual_dirty_log_protect = 0;
+            }
         }
     }
 
@@ -2254,6 +2627,13 @@ static int kvm_init(MachineState *ms)
         assert(!ret);
     }
 
+    if (s->kvm_dirty_ring_size) {
+        qemu_event_init(&s->dirty_ring_reaper_event, false);
+        qemu_thread_create(&s->dirty_ring_reaper, "kvm-reaper",
+                           kvm_dirty_ring_reaper_thread, s,
+                           QEMU_THREAD_DETACHED);
+    }
+
     cpus_register_accel(&kvm_cpus);
     return 0;
 
@@ -2505,6 +2885,7 @@ int kvm_cpu_exec(CPUState *cpu)
         if (run_ret < 0) {
             if (run_ret == -EINTR || run_ret == -EAGAIN) {
                 DPRINTF("io window exit\n");
+                kvm_vcpu_stat_inc(cpu, KVM_VCPU_STAT_SIGNAL_EXITS);
                 kvm_eat_signals(cpu);
                 ret = EXCP_INTERRUPT;
                 break;
@@ -2524,9 +2905,11 @@ int kvm_cpu_exec(CPUState *cpu)
         }
 
         trace_kvm_run_exit(cpu->cpu_index, run->exit_reason);
+        kvm_vcpu_stat_inc(cpu, KVM_VCPU_STAT_EXITS);
         switch (run->exit_reason) {
         case KVM_EXIT_IO:
             DPRINTF("handle_io\n");
+            kvm_vcpu_stat_inc(cpu, KVM_VCPU_STAT_IO_EXITS);
             /* Called outside BQL */
             kvm_handle_io(run->io.port, attrs,
                           (uint8_t *)run + run->io.data_offset,
@@ -2537,6 +2920,7 @@ int kvm_cpu_exec(CPUState *cpu)
             break;
         case KVM_EXIT_MMIO:
             DPRINTF("handle_mmio\n");
+            kvm_vcpu_stat_inc(cpu, KVM_VCPU_STAT_MMIO_EXITS);
             /* Called outside BQL */
             address_space_rw(&address_space_memory,
                              run->mmio.phys_addr, attrs,
@@ -2547,8 +2931,19 @@ int kvm_cpu_exec(CPUState *cpu)
             break;
         case KVM_EXIT_IRQ_WINDOW_OPEN:
             DPRINTF("irq_window_open\n");
+            kvm_vcpu_stat_inc(cpu, KVM_VCPU_STAT_IRQ_WINDOW_EXITS);
             ret = EXCP_INTERRUPT;
             break;
+        case KVM_EXIT_DIRTY_RING_FULL:
+            /*
+             * The vcpu cannot dirty more pages until its ring has been
+             * collected; we are outside the BQL, so just do it here.
+             */
+            trace_kvm_dirty_ring_full(cpu->cpu_index);
+            kvm_vcpu_stat_inc(cpu, KVM_VCPU_STAT_DIRTY_RING_FULL_EXITS);
+            kvm_dirty_ring_reap(kvm_state);
+            ret = 0;
+            break;
         case KVM_EXIT_SHUTDOWN:
             DPRINTF("shutdown\n");
             qemu_system_reset_request(SHUTDOWN_CAUSE_GUEST_RESET);
@@ -2587,6 +2982,7 @@ int kvm_cpu_exec(CPUState *cpu)
             break;
         default:
             DPRINTF("kvm_arch_handle_exit\n");
+            kvm_vcpu_stat_inc(cpu, KVM_VCPU_STAT_ARCH_EXITS);
             ret = kvm_arch_handle_exit(cpu, run);
             break;
         }
@@ -2732,6 +3128,11 @@ bool kvm_has_sync_mmu(void)
     return kvm_state->sync_mmu;
 }
 
+bool kvm_dirty_ring_enabled(void)
+{
+    return kvm_state && kvm_state->kvm_dirty_ring_size;
+}
+
 int kvm_has_vcpu_events(void)
 {
     return kvm_state->vcpu_events;
@@ -3145,6 +3546,34 @@ static void kvm_set_kvm_shadow_mem(Object *obj, Visitor *v,
     s->kvm_shadow_mem = value;
 }
 
+static void kvm_get_dirty_ring_size(Object *obj, Visitor *v,
+                                    const char *name, void *opaque,
+                                    Error **errp)
+{
+    KVMState *s = KVM_STATE(obj);
+    uint32_t value = s->kvm_dirty_ring_size;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void kvm_set_dirty_ring_size(Object *obj, Visitor *v,
+                                    const char *name, void *opaque,
+                                    Error **errp)
+{
+    KVMState *s = KVM_STATE(obj);
+    uint32_t value;
+
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+    if (value & (value - 1)) {
+        error_setg(errp, "dirty-ring-size must be a power of two");
+        return;
+    }
+
+    s->kvm_dirty_ring_size = value;
+}
+
 static void kvm_set_kernel_irqchip(Object *obj, Visitor *v,
                                    const char *name, void *opaque,
                                    Error **errp)
@@ -3222,6 +3651,12 @@ static void kvm_accel_class_init(ObjectClass *oc, void *data)
         NULL, NULL);
     object_class_property_set_description(oc, "kvm-shadow-mem",
         "KVM shadow MMU size");
+
+    object_class_property_add(oc, "dirty-ring-size", "uint32",
+        kvm_get_dirty_ring_size, kvm_set_dirty_ring_size,
+        NULL, NULL);
+    object_class_property_set_description(oc, "dirty-ring-size",
+        "Size of the KVM dirty ring of each vcpu, in entries (0 = disabled)");
 }
 
 static const TypeInfo kvm_accel_type = {
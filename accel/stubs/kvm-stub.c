@@ -45,6 +45,11 @@ bool kvm_has_sync_mmu(void)
     return false;
 }
 
+bool kvm_dirty_ring_enabled(void)
+{
+    return false;
+}
+
 int kvm_has_many_ioeventfds(void)
 {
     return 0;
@@ -304,6 +304,151 @@ static void flush_all_helper(CPUState *src, run_on_cpu_func fn,
     }
 }
 
+/*
+ * Synchronisation of the _synced flushes with MTTCG.
+ *
+ * Rather than stopping every vCPU with safe work, the other vCPUs get
+ * ordinary work that acknowledges the flush once it is done, and the work
+ * queued on the source vCPU waits for all the acknowledgements before the
+ * source can go back to executing guest code.  A vCPU only runs its work
+ * between TBs, so once a flush is acknowledged that vCPU cannot use the
+ * stale entries anymore.
+ *
+ * The acknowledgements can be held up, for example when two vCPUs wait for
+ * each other's flush, both with the other's work queued behind their own.
+ * After TLB_FLUSH_SYNC_TIMEOUT_MS the source stops waiting and queues safe
+ * work, which recreates the synchronisation point of the exclusive
+ * protocol: every other vCPU runs its queued work before executing again.
+ *
+ * Round-robin TCG runs all the vCPUs in one thread, so the source could
+ * never see the acknowledgements; it keeps using safe work directly.
+ */
+#define TLB_FLUSH_SYNC_TIMEOUT_MS 10
+
+typedef struct TLBFlushSync {
+    QemuSemaphore acked;
+    int n_queued;
+    int refs;
+} TLBFlushSync;
+
+typedef struct TLBFlushSyncWork {
+    TLBFlushSync *sync;
+    run_on_cpu_func fn;
+    run_on_cpu_data d;
+} TLBFlushSyncWork;
+
+static TLBFlushSync *tlb_flush_sync_begin(void)
+{
+    TLBFlushSync *s;
+
+    if (!qemu_tcg_mttcg_enabled()) {
+        return NULL;
+    }
+    s = g_new0(TLBFlushSync, 1);
+    qemu_sem_init(&s->acked, 0);
+    s->refs = 1;
+    return s;
+}
+
+static void tlb_flush_sync_unref(TLBFlushSync *s)
+{
+    if (qatomic_fetch_dec(&s->refs) == 1) {
+        qemu_sem_destroy(&s->acked);
+        g_free(s);
+    }
+}
+
+static void tlb_flush_sync_work(CPUState *cpu, run_on_cpu_data data)
+{
+    TLBFlushSyncWork *w = data.host_ptr;
+
+    w->fn(cpu, w->d);
+    qemu_sem_post(&w->sync->acked);
+    tlb_flush_sync_unref(w->sync);
+    g_free(w);
+}
+
+static void tlb_flush_sync_nop(CPUState *cpu, run_on_cpu_data data)
+{
+}
+
+static void tlb_flush_sync_wait_work(CPUState *cpu, run_on_cpu_data data)
+{
+    TLBFlushSyncWork *w = data.host_ptr;
+    TLBFlushSync *s = w->sync;
+    bool locked = qemu_mutex_iothread_locked();
+    int i;
+
+    w->fn(cpu, w->d);
+
+    /* The other vCPUs need the BQL to get to their queued work.  */
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
+    for (i = 0; i < s->n_queued; i++) {
+        if (qemu_sem_timedwait(&s->acked, TLB_FLUSH_SYNC_TIMEOUT_MS) < 0) {
+            tlb_debug("timed out, %d of %d flushes acknowledged\n",
+                      i, s->n_queued);
+            async_safe_run_on_cpu(cpu, tlb_flush_sync_nop, RUN_ON_CPU_NULL);
+            break;
+        }
+    }
+    if (locked) {
+        qemu_mutex_lock_iothread();
+    }
+
+    tlb_flush_sync_unref(s);
+    g_free(w);
+}
+
+/* Queue @fn on @cpu, acknowledging it to @s if not NULL */
+static void tlb_flush_sync_queue(TLBFlushSync *s, CPUState *cpu,
+                                 run_on_cpu_func fn, run_on_cpu_data d)
+{
+    TLBFlushSyncWork *w;
+
+    if (!s) {
+        async_run_on_cpu(cpu, fn, d);
+        return;
+    }
+    w = g_new(TLBFlushSyncWork, 1);
+    w->sync = s;
+    w->fn = fn;
+    w->d = d;
+    s->n_queued++;
+    qatomic_inc(&s->refs);
+    async_run_on_cpu(cpu, tlb_flush_sync_work, RUN_ON_CPU_HOST_PTR(w));
+}
+
+/* Queue @fn on @src, which must not execute again before @s is complete */
+static void tlb_flush_sync_end(TLBFlushSync *s, CPUState *src,
+                               run_on_cpu_func fn, run_on_cpu_data d)
+{
+    TLBFlushSyncWork *w;
+
+    if (!s) {
+        async_safe_run_on_cpu(src, fn, d);
+        return;
+    }
+    w = g_new(TLBFlushSyncWork, 1);
+    w->sync = s;
+    w->fn = fn;
+    w->d = d;
+    async_run_on_cpu(src, tlb_flush_sync_wait_work, RUN_ON_CPU_HOST_PTR(w));
+}
+
+static void flush_all_helper_synced(TLBFlushSync *s, CPUState *src,
+                                    run_on_cpu_func fn, run_on_cpu_data d)
+{
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        if (cpu != src) {
+            tlb_flush_sync_queue(s, cpu, fn, d);
+        }
+    }
+}
+
 void tlb_flush_counts(size_t *pfull, size_t *ppart, size_t *pelide)
 {
     CPUState *cpu;
@@ -397,11 +542,12 @@ void tlb_flush_all_cpus(CPUState *src_cpu)
 void tlb_flush_by_mmuidx_all_cpus_synced(CPUState *src_cpu, uint16_t idxmap)
 {
     const run_on_cpu_func fn = tlb_flush_by_mmuidx_async_work;
+    TLBFlushSync *s = tlb_flush_sync_begin();
 
     tlb_debug("mmu_idx: 0x%"PRIx16"\n", idxmap);
 
-    flush_all_helper(src_cpu, fn, RUN_ON_CPU_HOST_INT(idxmap));
-    async_safe_run_on_cpu(src_cpu, fn, RUN_ON_CPU_HOST_INT(idxmap));
+    flush_all_helper_synced(s, src_cpu, fn, RUN_ON_CPU_HOST_INT(idxmap));
+    tlb_flush_sync_end(s, src_cpu, fn, RUN_ON_CPU_HOST_INT(idxmap));
 }
 
 void tlb_flush_all_cpus_synced(CPUState *src_cpu)
@@ -475,6 +621,52 @@ static inline void tlb_flush_vtlb_page_locked(CPUArchState *env, int mmu_idx,
     tlb_flush_vtlb_page_mask_locked(env, mmu_idx, page, -1);
 }
 
+/*
+ * Flush all the entries within the large page region of @midx.  Large
+ * pages are entered into the tlb one TARGET_PAGE_SIZE page at a time, so
+ * the entries of a large page can only be at the indexes of its pages.
+ * Visit either those indexes or the whole table, whichever is smaller,
+ * rather than throwing away the entries outside the region as well.
+ */
+static void tlb_flush_large_page_locked(CPUArchState *env, int midx)
+{
+    CPUTLBDesc *d = &env_tlb(env)->d[midx];
+    CPUTLBDescFast *f = &env_tlb(env)->f[midx];
+    target_ulong lp_addr = d->large_page_addr;
+    target_ulong lp_mask = d->large_page_mask;
+    target_ulong n_pages = (~lp_mask >> TARGET_PAGE_BITS) + 1;
+    size_t n_entries = tlb_n_entries(f);
+
+    tlb_debug("flushing large pages midx %d ("
+              TARGET_FMT_lx "/" TARGET_FMT_lx ")\n",
+              midx, lp_addr, lp_mask);
+
+    if (n_pages < n_entries) {
+        target_ulong i;
+
+        for (i = 0; i < n_pages; i++) {
+            target_ulong page = lp_addr + (i << TARGET_PAGE_BITS);
+
+            if (tlb_flush_entry_locked(tlb_entry(env, midx, page), page)) {
+                tlb_n_used_entries_dec(env, midx);
+            }
+        }
+    } else {
+        size_t i;
+
+        for (i = 0; i < n_entries; i++) {
+            if (tlb_flush_entry_mask_locked(&f->table[i], lp_addr, lp_mask)) {
+                tlb_n_used_entries_dec(env, midx);
+            }
+        }
+    }
+    tlb_flush_vtlb_page_mask_locked(env, midx, lp_addr, lp_mask);
+
+    /* No entry from a large page is left.  */
+    d->large_page_addr = -1;
+    d->large_page_mask = -1;
+}
+
 static void tlb_flush_page_locked(CPUArchState *env, int midx,
                                   target_ulong page)
 {
@@ -483,10 +675,7 @@ static void tlb_flush_page_locked(CPUArchState *env, int midx,
 
     /* Check if we need to flush due to large pages.  */
     if ((page & lp_mask) == lp_addr) {
-        tlb_debug("forcing full flush midx %d ("
-                  TARGET_FMT_lx "/" TARGET_FMT_lx ")\n",
-                  midx, lp_addr, lp_mask);
-        tlb_flush_one_mmuidx_locked(env, midx, get_clock_realtime());
+        tlb_flush_large_page_locked(env, midx);
     } else {
         if (tlb_flush_entry_locked(tlb_entry(env, midx, page), page)) {
             tlb_n_used_entries_dec(env, midx);
@@ -647,6 +836,8 @@ void tlb_flush_page_by_mmuidx_all_cpus_synced(CPUState *src_cpu,
                                               target_ulong addr,
                                               uint16_t idxmap)
 {
+    TLBFlushSync *s = tlb_flush_sync_begin();
+
     tlb_debug("addr: "TARGET_FMT_lx" mmu_idx:%"PRIx16"\n", addr, idxmap);
 
     /* This should already be page aligned */
@@ -657,10 +848,10 @@ void tlb_flush_page_by_mmuidx_all_cpus_synced(CPUState *src_cpu,
      * See tlb_flush_page_by_mmuidx for details.
      */
     if (idxmap < TARGET_PAGE_SIZE) {
-        flush_all_helper(src_cpu, tlb_flush_page_by_mmuidx_async_1,
-                         RUN_ON_CPU_TARGET_PTR(addr | idxmap));
-        async_safe_run_on_cpu(src_cpu, tlb_flush_page_by_mmuidx_async_1,
-                              RUN_ON_CPU_TARGET_PTR(addr | idxmap));
+        flush_all_helper_synced(s, src_cpu, tlb_flush_page_by_mmuidx_async_1,
+                                RUN_ON_CPU_TARGET_PTR(addr | idxmap));
+        tlb_flush_sync_end(s, src_cpu, tlb_flush_page_by_mmuidx_async_1,
+                           RUN_ON_CPU_TARGET_PTR(addr | idxmap));
     } else {
         CPUState *dst_cpu;
         TLBFlushPageByMMUIdxData *d;
@@ -671,16 +862,17 @@ void tlb_flush_page_by_mmuidx_all_cpus_synced(CPUState *src_cpu,
                 d = g_new(TLBFlushPageByMMUIdxData, 1);
                 d->addr = addr;
                 d->idxmap = idxmap;
-                async_run_on_cpu(dst_cpu, tlb_flush_page_by_mmuidx_async_2,
-                                 RUN_ON_CPU_HOST_PTR(d));
+                tlb_flush_sync_queue(s, dst_cpu,
+                                     tlb_flush_page_by_mmuidx_async_2,
+                                     RUN_ON_CPU_HOST_PTR(d));
             }
         }
 
         d = g_new(TLBFlushPageByMMUIdxData, 1);
         d->addr = addr;
         d->idxmap = idxmap;
-        async_safe_run_on_cpu(src_cpu, tlb_flush_page_by_mmuidx_async_2,
-                              RUN_ON_CPU_HOST_PTR(d));
+        tlb_flush_sync_end(s, src_cpu, tlb_flush_page_by_mmuidx_async_2,
+                           RUN_ON_CPU_HOST_PTR(d));
     }
 }
 
@@ -714,11 +906,7 @@ static void tlb_flush_page_bits_locked(CPUArchState *env, int midx,
 
     /* Check if we need to flush due to large pages.  */
     if ((page & d->large_page_mask) == d->large_page_addr) {
-        tlb_debug("forcing full flush midx %d ("
-                  TARGET_FMT_lx "/" TARGET_FMT_lx ")\n",
-                  midx, d->large_page_addr, d->large_page_mask);
-        tlb_flush_one_mmuidx_locked(env, midx, get_clock_realtime());
-        return;
+        tlb_flush_large_page_locked(env, midx);
     }
 
     if (tlb_flush_entry_mask_locked(tlb_entry(env, midx, page), page, mask)) {
@@ -881,6 +1069,7 @@ void tlb_flush_page_bits_by_mmuidx_all_cpus_synced(CPUState *src_cpu,
 {
     TLBFlushPageBitsByMMUIdxData d;
     run_on_cpu_data runon;
+    TLBFlushSync *s;
 
     /* If all bits are significant, this devolves to tlb_flush_page. */
     if (bits >= TARGET_LONG_BITS) {
@@ -898,10 +1087,12 @@ void tlb_flush_page_bits_by_mmuidx_all_cpus_synced(CPUState *src_cpu,
     d.idxmap = idxmap;
     d.bits = bits;
 
+    s = tlb_flush_sync_begin();
     if (encode_pbm_to_runon(&runon, d)) {
-        flush_all_helper(src_cpu, tlb_flush_page_bits_by_mmuidx_async_1, runon);
-        async_safe_run_on_cpu(src_cpu, tlb_flush_page_bits_by_mmuidx_async_1,
-                              runon);
+        flush_all_helper_synced(s, src_cpu,
+                                tlb_flush_page_bits_by_mmuidx_async_1, runon);
+        tlb_flush_sync_end(s, src_cpu, tlb_flush_page_bits_by_mmuidx_async_1,
+                           runon);
     } else {
         CPUState *dst_cpu;
         TLBFlushPageBitsByMMUIdxData *p;
@@ -911,15 +1102,16 @@ void tlb_flush_page_bits_by_mmuidx_all_cpus_synced(CPUState *src_cpu,
             if (dst_cpu != src_cpu) {
                 p = g_new(TLBFlushPageBitsByMMUIdxData, 1);
                 *p = d;
-                async_run_on_cpu(dst_cpu, tlb_flush_page_bits_by_mmuidx_async_2,
-                                 RUN_ON_CPU_HOST_PTR(p));
+                tlb_flush_sync_queue(s, dst_cpu,
+                                     tlb_flush_page_bits_by_mmuidx_async_2,
+                                     RUN_ON_CPU_HOST_PTR(p));
             }
         }
 
         p = g_new(TLBFlushPageBitsByMMUIdxData, 1);
         *p = d;
-        async_safe_run_on_cpu(src_cpu, tlb_flush_page_bits_by_mmuidx_async_2,
-                              RUN_ON_CPU_HOST_PTR(p));
+        tlb_flush_sync_end(s, src_cpu, tlb_flush_page_bits_by_mmuidx_async_2,
+                           RUN_ON_CPU_HOST_PTR(p));
     }
 }
 
@@ -1048,7 +1240,7 @@ void tlb_set_dirty(CPUState *cpu, target_ulong vaddr)
 }
 
 /* Our TLB does not support large pages, so remember the area covered by
-   large pages and trigger a full TLB flush if these are invalidated.  */
+   large pages and flush all of it if any of these is invalidated.  */
 static void tlb_add_large_page(CPUArchState *env, int mmu_idx,
                                target_ulong vaddr, target_ulong size)
 {
@@ -1310,7 +1502,7 @@ static uint64_t io_readx(CPUArchState *env, CPUIOTLBEntry *iotlbentry,
         cpu_io_recompile(cpu, retaddr);
     }
 
-    if (!qemu_mutex_iothread_locked()) {
+    if (mr->global_locking && !qemu_mutex_iothread_locked()) {
         qemu_mutex_lock_iothread();
         locked = true;
     }
@@ -1371,7 +1563,7 @@ static void io_writex(CPUArchState *env, CPUIOTLBEntry *iotlbentry,
      */
     save_iotlb_data(cpu, iotlbentry->addr, section, mr_offset);
 
-    if (!qemu_mutex_iothread_locked()) {
+    if (mr->global_locking && !qemu_mutex_iothread_locked()) {
         qemu_mutex_lock_iothread();
         locked = true;
     }
@@ -0,0 +1,248 @@
+/*
+ * Linux perf perf-<pid>.map and jit-<pid>.dump integration
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Both files let "perf report" attribute the time spent in the code
+ * buffer to guest code: each range of host code is named after the guest
+ * symbol it was translated from, or after the guest PC if the symbol is
+ * unknown.  perf-<pid>.map is a text file that is read when the report is
+ * made, so it only describes the last use of each range of the buffer;
+ * jit-<pid>.dump records every translation along with its code, and must
+ * be merged into the profile with "perf inject --jit".
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/error-report.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+#include "disas/disas.h"
+#include "tcg/tcg.h"
+#include "perf.h"
+
+/* Serializes the writes to both files */
+static QemuMutex perf_lock;
+static FILE *perfmap;
+static FILE *jitdump;
+static void *jitdump_marker;
+static uint64_t jitdump_code_index;
+
+#define JITDUMP_MAGIC   0x4A695444  /* "JiTD" */
+#define JITDUMP_VERSION 1
+#define JIT_CODE_LOAD   0
+
+/* See tools/perf/Documentation/jitdump-specification.txt in Linux */
+struct jitheader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t total_size;
+    uint32_t elf_mach;
+    uint32_t pad1;
+    uint32_t pid;
+    uint64_t timestamp;
+    uint64_t flags;
+};
+
+struct jr_prefix {
+    uint32_t id;
+    uint32_t total_size;
+    uint64_t timestamp;
+};
+
+struct jr_code_load {
+    struct jr_prefix p;
+    uint32_t pid;
+    uint32_t tid;
+    uint64_t vma;
+    uint64_t code_addr;
+    uint64_t code_size;
+    uint64_t code_index;
+};
+
+static FILE *perf_open(const char *fmt)
+{
+    g_autofree char *path = g_strdup_printf(fmt, (int)getpid());
+    FILE *f = fopen(path, "w+");
+
+    if (!f) {
+        warn_report("Could not open %s: %s", path, strerror(errno));
+    }
+    return f;
+}
+
+static void perf_close(void)
+{
+    WITH_QEMU_LOCK_GUARD(&perf_lock) {
+        if (perfmap) {
+            fclose(perfmap);
+            perfmap = NULL;
+        }
+        if (jitdump) {
+            munmap(jitdump_marker, qemu_real_host_page_size);
+            fclose(jitdump);
+            jitdump = NULL;
+        }
+    }
+}
+
+static void perf_init(void)
+{
+    static bool initialized;
+
+    if (!initialized) {
+        qemu_mutex_init(&perf_lock);
+        atexit(perf_close);
+        initialized = true;
+    }
+}
+
+void perf_enable_perfmap(void)
+{
+    perf_init();
+    perfmap = perf_open("/tmp/perf-%d.map");
+}
+
+/* The ELF machine of the host, which perf needs to disassemble the code */
+static uint32_t perf_host_elf_machine(void)
+{
+    uint8_t ehdr[20];
+    uint32_t ret = 0;
+    FILE *f = fopen("/proc/self/exe", "r");
+
+    if (f) {
+        if (fread(ehdr, sizeof(ehdr), 1, f) == 1 &&
+            !memcmp(ehdr, "\x7f" "ELF", 4)) {
+            /* e_machine is at the same offset for 32 and 64-bit ELF */
+            memcpy(&ret, ehdr + 18, 2);
+            ret = (uint16_t)ret;
+        }
+        fclose(f);
+    }
+    return ret;
+}
+
+static uint64_t perf_timestamp(void)
+{
+    struct timespec ts;
+
+    /* perf must be told to use the same clock, with "perf record -k 1" */
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NANOSECONDS_PER_SECOND + ts.tv_nsec;
+}
+
+void perf_enable_jitdump(void)
+{
+    struct jitheader header = {
+        .magic = JITDUMP_MAGIC,
+        .version = JITDUMP_VERSION,
+        .total_size = sizeof(header),
+        .pid = getpid(),
+    };
+
+    header.elf_mach = perf_host_elf_machine();
+    if (!header.elf_mach) {
+        warn_report("Could not find the host ELF machine, "
+                    "jitdump disabled");
+        return;
+    }
+
+    perf_init();
+    jitdump = perf_open("/tmp/jit-%d.dump");
+    if (!jitdump) {
+        return;
+    }
+
+    /* perf notices the dump file through an executable mapping of it */
+    jitdump_marker = mmap(NULL, qemu_real_host_page_size,
+                          PROT_READ | PROT_EXEC, MAP_PRIVATE,
+                          fileno(jitdump), 0);
+    if (jitdump_marker == MAP_FAILED) {
+        warn_report("Could not map the jitdump file: %s", strerror(errno));
+        fclose(jitdump);
+        jitdump = NULL;
+        return;
+    }
+
+    header.timestamp = perf_timestamp();
+    fwrite(&header, sizeof(header), 1, jitdump);
+    fflush(jitdump);
+}
+
+static void perf_write_locked(const void *start, size_t size,
+                              const char *name)
+{
+    if (perfmap) {
+        fprintf(perfmap, "%" PRIxPTR " %zx %s\n",
+                (uintptr_t)start, size, name);
+    }
+    if (jitdump) {
+        struct jr_code_load rec = {
+            .p.id = JIT_CODE_LOAD,
+            .p.total_size = sizeof(rec) + strlen(name) + 1 + size,
+            .p.timestamp = perf_timestamp(),
+            .pid = getpid(),
+            .tid = qemu_get_thread_id(),
+            .vma = (uintptr_t)start,
+            .code_addr = (uintptr_t)start,
+            .code_size = size,
+            .code_index = jitdump_code_index++,
+        };
+
+        fwrite(&rec, sizeof(rec), 1, jitdump);
+        fwrite(name, strlen(name) + 1, 1, jitdump);
+        fwrite(start, size, 1, jitdump);
+    }
+}
+
+void perf_report_prologue(const void *start, size_t size)
+{
+    if (!perfmap && !jitdump) {
+        return;
+    }
+    WITH_QEMU_LOCK_GUARD(&perf_lock) {
+        perf_write_locked(start, size, "tcg-prologue-buffer");
+    }
+}
+
+void perf_report_code(const TranslationBlock *tb)
+{
+    const void *start = tb->tc.ptr;
+    size_t offset = 0;
+    int i, j;
+
+    if (!perfmap && !jitdump) {
+        return;
+    }
+
+    /*
+     * Name each run of guest instructions that belong to the same symbol.
+     * The code after the last instruction (slow paths, constant pool)
+     * is accounted to the last run.
+     */
+    QEMU_LOCK_GUARD(&perf_lock);
+    for (i = 0; i < tb->icount; i = j) {
+        target_ulong pc = tcg_ctx->gen_insn_data[i][0];
+        const char *sym = lookup_symbol(pc);
+        g_autofree char *name = NULL;
+        size_t end;
+
+        for (j = i + 1; j < tb->icount; j++) {
+            if (strcmp(lookup_symbol(tcg_ctx->gen_insn_data[j][0]), sym)) {
+                break;
+            }
+        }
+        end = j == tb->icount ? tb->tc.size : tcg_ctx->gen_insn_end_off[j - 1];
+        if (end <= offset) {
+            continue;
+        }
+
+        if (sym[0]) {
+            name = g_strdup(sym);
+        } else {
+            name = g_strdup_printf("guest-0x" TARGET_FMT_lx, pc);
+        }
+        perf_write_locked(start + offset, end - offset, name);
+        offset = end;
+    }
+}
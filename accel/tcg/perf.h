@@ -0,0 +1,29 @@
+/*
+ * Linux perf perf-<pid>.map and jit-<pid>.dump integration
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef ACCEL_TCG_PERF_H
+#define ACCEL_TCG_PERF_H
+
+#include "exec/exec-all.h"
+
+/* Start writing perf-<pid>.map in /tmp */
+void perf_enable_perfmap(void);
+
+/* Start writing jit-<pid>.dump in /tmp */
+void perf_enable_jitdump(void);
+
+/* Describe the TCG prologue to the profiler */
+void perf_report_prologue(const void *start, size_t size);
+
+/*
+ * Describe the host code of @tb, which has just been generated, to the
+ * profiler.  Must be called in the thread that translated @tb, before it
+ * translates anything else.
+ */
+void perf_report_code(const TranslationBlock *tb);
+
+#endif
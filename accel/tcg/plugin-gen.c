@@ -126,20 +126,34 @@ static void gen_empty_udata_cb(void)
 }
 
 /*
- * For now we only support addi_i64.
- * When we support more ops, we can generate one empty inline cb for each.
+ * The same template serves all inline ops. The element of the executing
+ * vCPU is at ptr + cpu_index * stride, where ptr is loaded from the
+ * scoreboard; a global counter skips the address computation. The add is
+ * turned into a mov for stores.
  */
 static void gen_empty_inline_cb(void)
 {
+    TCGv_i32 cpu_index = tcg_temp_new_i32();
+    TCGv_ptr cpu_offset = tcg_temp_new_ptr();
     TCGv_i64 val = tcg_temp_new_i64();
     TCGv_ptr ptr = tcg_const_ptr(NULL); /* overwritten later */
 
+    tcg_gen_ld_ptr(ptr, ptr, 0);
+    tcg_gen_ld_i32(cpu_index, cpu_env,
+                   -offsetof(ArchCPU, env) + offsetof(CPUState, cpu_index));
+    /* the stride is overwritten later; make sure we get a mul_i32 */
+    tcg_gen_muli_i32(cpu_index, cpu_index, 0xdeadbeef);
+    tcg_gen_extu_i32_ptr(cpu_offset, cpu_index);
+    tcg_gen_add_ptr(ptr, ptr, cpu_offset);
+
     tcg_gen_ld_i64(val, ptr, 0);
     /* pass an immediate != 0 so that it doesn't get optimized away */
     tcg_gen_addi_i64(val, val, 0xdeadface);
     tcg_gen_st_i64(val, ptr, 0);
     tcg_temp_free_ptr(ptr);
     tcg_temp_free_i64(val);
+    tcg_temp_free_ptr(cpu_offset);
+    tcg_temp_free_i32(cpu_index);
 }
 
 static void gen_empty_mem_cb(TCGv addr, uint32_t info)
@@ -353,28 +367,77 @@ static TCGOp *copy_extu_tl_i64(TCGOp **begin_op, TCGOp *op)
     return op;
 }
 
-static TCGOp *copy_ld_i64(TCGOp **begin_op, TCGOp *op)
+static void skip_op(TCGOp **begin_op, TCGOpcode opc)
+{
+    *begin_op = QTAILQ_NEXT(*begin_op, link);
+    tcg_debug_assert(*begin_op && (*begin_op)->opc == opc);
+}
+
+/* ld/st offsets are in args[2]; @offset is added to them */
+static TCGOp *copy_ld_i64(TCGOp **begin_op, TCGOp *op, intptr_t offset)
 {
     if (TCG_TARGET_REG_BITS == 32) {
         /* 2x ld_i32 */
         op = copy_op(begin_op, op, INDEX_op_ld_i32);
+        op->args[2] += offset;
         op = copy_op(begin_op, op, INDEX_op_ld_i32);
+        op->args[2] += offset;
     } else {
         /* ld_i64 */
         op = copy_op(begin_op, op, INDEX_op_ld_i64);
+        op->args[2] += offset;
     }
     return op;
 }
 
-static TCGOp *copy_st_i64(TCGOp **begin_op, TCGOp *op)
+static TCGOp *copy_st_i64(TCGOp **begin_op, TCGOp *op, intptr_t offset)
 {
     if (TCG_TARGET_REG_BITS == 32) {
         /* 2x st_i32 */
         op = copy_op(begin_op, op, INDEX_op_st_i32);
+        op->args[2] += offset;
         op = copy_op(begin_op, op, INDEX_op_st_i32);
+        op->args[2] += offset;
     } else {
         /* st_i64 */
         op = copy_op(begin_op, op, INDEX_op_st_i64);
+        op->args[2] += offset;
+    }
+    return op;
+}
+
+static TCGOp *copy_ld_ptr(TCGOp **begin_op, TCGOp *op)
+{
+    if (UINTPTR_MAX == UINT32_MAX) {
+        /* ld_i32 */
+        op = copy_op(begin_op, op, INDEX_op_ld_i32);
+    } else {
+        /* ld_i64 */
+        op = copy_op(begin_op, op, INDEX_op_ld_i64);
+    }
+    return op;
+}
+
+static TCGOp *copy_extu_i32_ptr(TCGOp **begin_op, TCGOp *op)
+{
+    if (UINTPTR_MAX == UINT32_MAX) {
+        /* mov_i32 */
+        op = copy_op(begin_op, op, INDEX_op_mov_i32);
+    } else {
+        /* extu_i32_i64 */
+        op = copy_op(begin_op, op, INDEX_op_extu_i32_i64);
+    }
+    return op;
+}
+
+static TCGOp *copy_add_ptr(TCGOp **begin_op, TCGOp *op)
+{
+    if (UINTPTR_MAX == UINT32_MAX) {
+        /* add_i32 */
+        op = copy_op(begin_op, op, INDEX_op_add_i32);
+    } else {
+        /* add_i64 */
+        op = copy_op(begin_op, op, INDEX_op_add_i64);
     }
     return op;
 }
@@ -391,6 +454,27 @@ static TCGOp *copy_add_i64(TCGOp **begin_op, TCGOp *op)
     return op;
 }
 
+/* turn the template's add_i64 into a mov of its second operand */
+static TCGOp *copy_add_i64_as_mov(TCGOp **begin_op, TCGOp *op)
+{
+    if (TCG_TARGET_REG_BITS == 32) {
+        /* add2_i32 rl, rh, al, ah, bl, bh -> 2x mov_i32 */
+        skip_op(begin_op, INDEX_op_add2_i32);
+        op = tcg_op_insert_after(tcg_ctx, op, INDEX_op_mov_i32);
+        op->args[0] = (*begin_op)->args[0];
+        op->args[1] = (*begin_op)->args[4];
+        op = tcg_op_insert_after(tcg_ctx, op, INDEX_op_mov_i32);
+        op->args[0] = (*begin_op)->args[1];
+        op->args[1] = (*begin_op)->args[5];
+    } else {
+        skip_op(begin_op, INDEX_op_add_i64);
+        op = tcg_op_insert_after(tcg_ctx, op, INDEX_op_mov_i64);
+        op->args[0] = (*begin_op)->args[0];
+        op->args[1] = (*begin_op)->args[2];
+    }
+    return op;
+}
+
 static TCGOp *copy_st_ptr(TCGOp **begin_op, TCGOp *op)
 {
     if (UINTPTR_MAX == UINT32_MAX) {
@@ -398,7 +482,7 @@ static TCGOp *copy_st_ptr(TCGOp **begin_op, TCGOp *op)
         op = copy_op(begin_op, op, INDEX_op_st_i32);
     } else {
         /* st_i64 */
-        op = copy_st_i64(begin_op, op);
+        op = copy_st_i64(begin_op, op, 0);
     }
     return op;
 }
@@ -461,20 +545,68 @@ static TCGOp *append_inline_cb(const struct qemu_plugin_dyn_cb *cb,
                                TCGOp *begin_op, TCGOp *op,
                                int *unused)
 {
-    /* const_ptr */
-    op = copy_const_ptr(&begin_op, op, cb->userp);
+    struct qemu_plugin_scoreboard *score = cb->inline_insn.entry.score;
+    intptr_t offset = cb->inline_insn.entry.offset;
+
+    if (score) {
+        /* const_ptr; the scoreboard may be reallocated, so load it */
+        op = copy_const_ptr(&begin_op, op, &score->data);
+
+        /* ld_ptr */
+        op = copy_ld_ptr(&begin_op, op);
+
+        /* ld_i32 */
+        op = copy_op(&begin_op, op, INDEX_op_ld_i32);
+
+        /* const_i32 == movi_i32 (the stride) */
+        op = copy_op(&begin_op, op, INDEX_op_movi_i32);
+        op->args[1] = score->element_size;
+
+        /* mul_i32 */
+        op = copy_op(&begin_op, op, INDEX_op_mul_i32);
+
+        /* extu_i32_ptr */
+        op = copy_extu_i32_ptr(&begin_op, op);
+
+        /* add_ptr */
+        op = copy_add_ptr(&begin_op, op);
+    } else {
+        /* const_ptr */
+        op = copy_const_ptr(&begin_op, op, cb->userp);
+
+        /* skip ld_ptr, ld_i32, movi_i32, mul_i32, extu_i32_ptr, add_ptr */
+        skip_op(&begin_op, UINTPTR_MAX == UINT32_MAX ?
+                INDEX_op_ld_i32 : INDEX_op_ld_i64);
+        skip_op(&begin_op, INDEX_op_ld_i32);
+        skip_op(&begin_op, INDEX_op_movi_i32);
+        skip_op(&begin_op, INDEX_op_mul_i32);
+        skip_op(&begin_op, UINTPTR_MAX == UINT32_MAX ?
+                INDEX_op_mov_i32 : INDEX_op_extu_i32_i64);
+        skip_op(&begin_op, UINTPTR_MAX == UINT32_MAX ?
+                INDEX_op_add_i32 : INDEX_op_add_i64);
+    }
 
     /* ld_i64 */
-    op = copy_ld_i64(&begin_op, op);
+    op = copy_ld_i64(&begin_op, op, offset);
 
     /* const_i64 */
     op = copy_const_i64(&begin_op, op, cb->inline_insn.imm);
 
-    /* add_i64 */
-    op = copy_add_i64(&begin_op, op);
+    switch (cb->inline_insn.op) {
+    case QEMU_PLUGIN_INLINE_ADD_U64:
+        /* add_i64 */
+        op = copy_add_i64(&begin_op, op);
+        break;
+    case QEMU_PLUGIN_INLINE_STORE_U64:
+        /* mov_i64; the load is left dead */
+        op = copy_add_i64_as_mov(&begin_op, op);
+        break;
+    default:
+        g_assert_not_reached();
+    }
 
     /* st_i64 */
-    op = copy_st_i64(&begin_op, op);
+    op = copy_st_i64(&begin_op, op, offset);
 
     return op;
 }
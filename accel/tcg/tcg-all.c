@@ -27,18 +27,23 @@
 #include "qemu-common.h"
 #include "sysemu/tcg.h"
 #include "sysemu/cpu-timers.h"
+#include "sysemu/replay.h"
 #include "tcg/tcg.h"
 #include "qapi/error.h"
 #include "qemu/error-report.h"
 #include "hw/boards.h"
 #include "qapi/qapi-builtin-visit.h"
 #include "tcg-cpus.h"
+#include "perf.h"
 
 struct TCGState {
     AccelState parent_obj;
 
     bool mttcg_enabled;
     int splitwx_enabled;
+    bool tb_profile;
+    bool perf_map;
+    bool jitdump;
     unsigned long tb_size;
 };
 typedef struct TCGState TCGState;
@@ -110,6 +115,13 @@ static int tcg_init(MachineState *ms)
 {
     TCGState *s = TCG_STATE(current_accel());
 
+    tb_profile_enabled = s->tb_profile;
+    if (s->perf_map) {
+        perf_enable_perfmap();
+    }
+    if (s->jitdump) {
+        perf_enable_jitdump();
+    }
     tcg_exec_init(s->tb_size * 1024 * 1024, s->splitwx_enabled);
     mttcg_enabled = s->mttcg_enabled;
     cpus_register_accel(&tcg_cpus);
@@ -131,8 +143,8 @@ static void tcg_set_thread(Object *obj, const char *value, Error **errp)
     if (strcmp(value, "multi") == 0) {
         if (TCG_OVERSIZED_GUEST) {
             error_setg(errp, "No MTTCG when guest word size > hosts");
-        } else if (icount_enabled()) {
-            error_setg(errp, "No MTTCG when icount is enabled");
+        } else if (replay_mode != REPLAY_MODE_NONE) {
+            error_setg(errp, "No MTTCG when record/replay is enabled");
         } else {
 #ifndef TARGET_SUPPORTS_MTTCG
             warn_report("Guest not yet converted to MTTCG - "
@@ -188,6 +200,42 @@ static void tcg_set_splitwx(Object *obj, bool value, Error **errp)
     s->splitwx_enabled = value;
 }
 
+static bool tcg_get_tb_profile(Object *obj, Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    return s->tb_profile;
+}
+
+static void tcg_set_tb_profile(Object *obj, bool value, Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    s->tb_profile = value;
+}
+
+static bool tcg_get_perf_map(Object *obj, Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    return s->perf_map;
+}
+
+static void tcg_set_perf_map(Object *obj, bool value, Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    s->perf_map = value;
+}
+
+static bool tcg_get_jitdump(Object *obj, Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    return s->jitdump;
+}
+
+static void tcg_set_jitdump(Object *obj, bool value, Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    s->jitdump = value;
+}
+
 static void tcg_accel_class_init(ObjectClass *oc, void *data)
 {
     AccelClass *ac = ACCEL_CLASS(oc);
@@ -209,6 +257,21 @@ static void tcg_accel_class_init(ObjectClass *oc, void *data)
         tcg_get_splitwx, tcg_set_splitwx);
     object_class_property_set_description(oc, "split-wx",
         "Map jit pages into separate RW and RX regions");
+
+    object_class_property_add_bool(oc, "tb-profile",
+        tcg_get_tb_profile, tcg_set_tb_profile);
+    object_class_property_set_description(oc, "tb-profile",
+        "Count translation block executions (see \"info jit\")");
+
+    object_class_property_add_bool(oc, "perf-map",
+        tcg_get_perf_map, tcg_set_perf_map);
+    object_class_property_set_description(oc, "perf-map",
+        "Describe the generated code in /tmp/perf-<pid>.map");
+
+    object_class_property_add_bool(oc, "jitdump",
+        tcg_get_jitdump, tcg_set_jitdump);
+    object_class_property_set_description(oc, "jitdump",
+        "Describe the generated code in /tmp/jit-<pid>.dump");
 }
 
 static const TypeInfo tcg_accel_type = {
@@ -133,11 +133,13 @@ static void qemu_tcg_rr_wait_io_event(void)
     }
 }
 
-static int64_t tcg_get_icount_limit(void)
+static int64_t tcg_get_icount_limit(CPUState *cpu)
 {
     int64_t deadline;
 
-    if (replay_mode != REPLAY_MODE_PLAY) {
+    if (qemu_tcg_mttcg_enabled()) {
+        return icount_quantum_budget(cpu);
+    } else if (replay_mode != REPLAY_MODE_PLAY) {
         /*
          * Include all the timers, because they may need an attention.
          * Too long CPU execution may create unnecessary delay in UI.
@@ -198,7 +200,7 @@ static void prepare_icount_for_run(CPUState *cpu)
         g_assert(cpu_neg(cpu)->icount_decr.u16.low == 0);
         g_assert(cpu->icount_extra == 0);
 
-        cpu->icount_budget = tcg_get_icount_limit();
+        cpu->icount_budget = tcg_get_icount_limit(cpu);
         insns_left = MIN(0xffff, cpu->icount_budget);
         cpu_neg(cpu)->icount_decr.u16.low = insns_left;
         cpu->icount_extra = cpu->icount_budget - insns_left;
@@ -396,14 +398,45 @@ static void *tcg_rr_cpu_thread_fn(void *arg)
  * In the multi-threaded case each vCPU has its own thread. The TLS
  * variable current_cpu can be used deep in the code to find the
  * current CPUState for a given thread.
+ *
+ * With icount the vCPUs run in lockstep quanta, see softmmu/icount.c:
+ * a vCPU that reached the end of the quantum waits for the others
+ * before it executes more instructions.
  */
 
+static bool tcg_icount_quantum_done(CPUState *cpu)
+{
+    return icount_enabled() && icount_quantum_budget(cpu) == 0;
+}
+
+static void tcg_icount_quantum_wait(CPUState *cpu)
+{
+    if (!icount_enabled()) {
+        return;
+    }
+
+    if (all_cpu_threads_idle()) {
+        /* Wake up the main loop in order to start the warp timer */
+        qemu_notify_event();
+    }
+
+    /* This vCPU may be the last one that the quantum was waiting for */
+    icount_quantum_advance();
+
+    while (tcg_icount_quantum_done(cpu)) {
+        if (cpu->stop || cpu->unplug || !cpu_work_list_empty(cpu)) {
+            break;
+        }
+        qemu_cond_wait_iothread(cpu->halt_cond);
+        icount_quantum_advance();
+    }
+}
+
 static void *tcg_cpu_thread_fn(void *arg)
 {
     CPUState *cpu = arg;
 
     assert(tcg_enabled());
-    g_assert(!icount_enabled());
 
     rcu_register_thread();
     tcg_register_thread();
@@ -421,10 +454,13 @@ static void *tcg_cpu_thread_fn(void *arg)
     cpu->exit_request = 1;
 
     do {
-        if (cpu_can_run(cpu)) {
+        if (cpu_can_run(cpu) && !tcg_icount_quantum_done(cpu)) {
             int r;
+            icount_account_warp_timer();
+            prepare_icount_for_run(cpu);
             qemu_mutex_unlock_iothread();
             r = tcg_cpu_exec(cpu);
+            process_icount_data(cpu);
             qemu_mutex_lock_iothread();
             switch (r) {
             case EXCP_DEBUG:
@@ -452,6 +488,7 @@ static void *tcg_cpu_thread_fn(void *arg)
         }
 
         qatomic_mb_set(&cpu->exit_request, 0);
+        tcg_icount_quantum_wait(cpu);
         qemu_wait_io_event(cpu);
     } while (!cpu->unplug || cpu_can_run(cpu));
 
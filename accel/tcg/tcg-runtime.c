@@ -145,14 +145,21 @@ uint64_t HELPER(ctpop_i64)(uint64_t arg)
     return ctpop64(arg);
 }
 
-const void *HELPER(lookup_tb_ptr)(CPUArchState *env)
+/*
+ * @site is the TB doing the indirect jump.  Its last destination is
+ * tried before the jump cache, which pays off for the many indirect
+ * jumps that nearly always go to the same place.
+ */
+const void *HELPER(lookup_tb_ptr)(CPUArchState *env, void *site)
 {
     CPUState *cpu = env_cpu(env);
+    TranslationBlock *src = site;
     TranslationBlock *tb;
     target_ulong cs_base, pc;
     uint32_t flags;
 
-    tb = tb_lookup__cpu_state(cpu, &pc, &cs_base, &flags, curr_cflags());
+    tb = tb_lookup__cpu_state_hint(cpu, &src->ind_next, &pc, &cs_base,
+                                   &flags, curr_cflags());
     if (tb == NULL) {
         return tcg_code_gen_epilogue;
     }
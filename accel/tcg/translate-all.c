@@ -53,6 +53,7 @@
 #include "exec/cputlb.h"
 #include "exec/tb-hash.h"
 #include "translate-all.h"
+#include "perf.h"
 #include "qemu/bitmap.h"
 #include "qemu/error-report.h"
 #include "qemu/qemu-print.h"
@@ -228,6 +229,17 @@ TCGContext tcg_init_ctx;
 __thread TCGContext *tcg_ctx;
 TBContext tb_ctx;
 bool parallel_cpus;
+bool tb_profile_enabled;
+
+/*
+ * Execution counters of the profiled TBs.  They are kept out of the code
+ * buffer so that the increments do not dirty the cache lines holding the
+ * code, and are handed out in order until the next flush.
+ */
+#define TB_PROFILE_SLOTS (64 * 1024)
+#define TB_PROFILE_TOP 10
+static uint64_t *tb_exec_counts;
+static unsigned int tb_exec_counts_used;
 
 static void page_table_config_init(void)
 {
@@ -1345,6 +1357,10 @@ void tcg_exec_init(unsigned long tb_size, int splitwx)
                                splitwx, &error_fatal);
     assert(ok);
 
+    if (tb_profile_enabled) {
+        tb_exec_counts = g_new0(uint64_t, TB_PROFILE_SLOTS);
+    }
+
     tb_exec_unlock();
 #if defined(CONFIG_SOFTMMU)
     /* There's no guest base to take into account, so go ahead and
@@ -1438,6 +1454,11 @@ static void do_tb_flush(CPUState *cpu, run_on_cpu_data tb_flush_count)
     qht_reset_size(&tb_ctx.htable, CODE_GEN_HTABLE_SIZE);
     page_flush_tb();
 
+    if (tb_exec_counts) {
+        memset(tb_exec_counts, 0, TB_PROFILE_SLOTS * sizeof(uint64_t));
+        qatomic_set(&tb_exec_counts_used, 0);
+    }
+
     tcg_region_reset_all();
     /* XXX: flush processor icache at this point if cache flush is
        expensive */
@@ -1450,6 +1471,67 @@ done:
     }
 }
 
+static gboolean tb_evict_hint_iter(gpointer key, gpointer value,
+                                   gpointer data)
+{
+    TranslationBlock *tb = value;
+    void **bounds = data;
+    void *next = tb->ind_next;
+
+    if (next >= bounds[0] && next < bounds[1]) {
+        tb->ind_next = NULL;
+    }
+    return false;
+}
+
+/*
+ * The code buffer is full: evict a single region if possible, and only
+ * flush everything if not.
+ */
+static void do_tb_evict(CPUState *cpu, run_on_cpu_data tb_flush_count)
+{
+    void *bounds[2];
+    CPUState *other;
+    bool evicted;
+
+    mmap_lock();
+    /* The buffer was flushed, or another vCPU made room already */
+    if (tb_ctx.tb_flush_count != tb_flush_count.host_int ||
+        tcg_region_available()) {
+        mmap_unlock();
+        return;
+    }
+    evicted = tcg_region_evict(&bounds[0], &bounds[1]);
+    if (evicted) {
+        /*
+         * The memory of the evicted TBs is going to be reused, so drop
+         * every pointer to them that invalidation leaves behind.
+         */
+        tcg_tb_foreach(tb_evict_hint_iter, bounds);
+        CPU_FOREACH(other) {
+            cpu_tb_jmp_cache_clear(other);
+        }
+        qatomic_set(&tb_ctx.tb_evict_count, tb_ctx.tb_evict_count + 1);
+    }
+    mmap_unlock();
+
+    if (!evicted) {
+        do_tb_flush(cpu, tb_flush_count);
+    }
+}
+
+static void tb_evict(CPUState *cpu)
+{
+    unsigned tb_flush_count = qatomic_mb_read(&tb_ctx.tb_flush_count);
+
+    if (cpu_in_exclusive_context(cpu)) {
+        do_tb_evict(cpu, RUN_ON_CPU_HOST_INT(tb_flush_count));
+    } else {
+        async_safe_run_on_cpu(cpu, do_tb_evict,
+                              RUN_ON_CPU_HOST_INT(tb_flush_count));
+    }
+}
+
 void tb_flush(CPUState *cpu)
 {
     if (tcg_enabled()) {
@@ -1623,6 +1705,7 @@ static void do_tb_phys_invalidate(TranslationBlock *tb, bool rm_from_page_list)
     uint32_t h;
     tb_page_addr_t phys_pc;
     bool code_gen_locked;
+    int i;
 
     assert_memory_lock();
     code_gen_locked = tb_exec_is_locked();
@@ -1656,10 +1739,12 @@ static void do_tb_phys_invalidate(TranslationBlock *tb, bool rm_from_page_list)
     }
 
     /* remove the TB from the hash list */
-    h = tb_jmp_cache_hash_func(tb->pc);
+    h = tb_jmp_cache_hash_func(tb->pc) * TB_JMP_CACHE_WAYS;
     CPU_FOREACH(cpu) {
-        if (qatomic_read(&cpu->tb_jmp_cache[h]) == tb) {
-            qatomic_set(&cpu->tb_jmp_cache[h], NULL);
+        for (i = 0; i < TB_JMP_CACHE_WAYS; i++) {
+            if (qatomic_read(&cpu->tb_jmp_cache[h + i]) == tb) {
+                qatomic_set(&cpu->tb_jmp_cache[h + i], NULL);
+            }
         }
     }
 
@@ -1863,6 +1948,26 @@ tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
     return tb;
 }
 
+/*
+ * Return a zeroed execution counter for a new TB, or NULL if profiling
+ * is off or the table is full.  Nothing is returned to the table before
+ * the next flush, so aborted translations just waste a slot.
+ */
+static uint64_t *tb_alloc_exec_count(uint32_t cflags)
+{
+    unsigned int slot;
+
+    if (!tb_exec_counts || (cflags & CF_NOCACHE) ||
+        qatomic_read(&tb_exec_counts_used) >= TB_PROFILE_SLOTS) {
+        return NULL;
+    }
+    slot = qatomic_fetch_inc(&tb_exec_counts_used);
+    if (slot >= TB_PROFILE_SLOTS) {
+        return NULL;
+    }
+    return &tb_exec_counts[slot];
+}
+
 /* Called with mmap_lock held for user mode emulation.  */
 TranslationBlock *tb_gen_code(CPUState *cpu,
                               target_ulong pc, target_ulong cs_base,
@@ -1906,8 +2011,8 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
  buffer_overflow:
     tb = tcg_tb_alloc(tcg_ctx);
     if (unlikely(!tb)) {
-        /* flush must be done */
-        tb_flush(cpu);
+        /* make room, flushing if needed */
+        tb_evict(cpu);
         mmap_unlock();
         /* Make the execution loop process the flush as soon as possible.  */
         cpu->exception_index = EXCP_INTERRUPT;
@@ -1922,7 +2027,10 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     tb->cflags = cflags;
     tb->orig_tb = NULL;
     tb->trace_vcpu_dstate = *cpu->trace_dstate;
+    tb->exec_count = tb_alloc_exec_count(cflags);
+    tb->ind_next = NULL;
     tcg_ctx->tb_cflags = cflags;
+    tcg_ctx->gen_tb = tb;
  tb_overflow:
 
 #ifdef CONFIG_PROFILER
@@ -2108,6 +2216,7 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
         return existing_tb;
     }
     tcg_tb_insert(tb);
+    perf_report_code(tb);
     return tb;
 }
 
@@ -2472,9 +2581,10 @@ void cpu_io_recompile(CPUState *cpu, uintptr_t retaddr)
 
 static void tb_jmp_cache_clear_page(CPUState *cpu, target_ulong page_addr)
 {
-    unsigned int i, i0 = tb_jmp_cache_hash_page(page_addr);
+    unsigned int i, i0;
 
-    for (i = 0; i < TB_JMP_PAGE_SIZE; i++) {
+    i0 = tb_jmp_cache_hash_page(page_addr) * TB_JMP_CACHE_WAYS;
+    for (i = 0; i < TB_JMP_PAGE_SIZE * TB_JMP_CACHE_WAYS; i++) {
         qatomic_set(&cpu->tb_jmp_cache[i0 + i], NULL);
     }
 }
@@ -2557,11 +2667,83 @@ static gboolean tb_tree_stats_iter(gpointer key, gpointer value, gpointer data)
     return false;
 }
 
+struct tb_profile_top {
+    const TranslationBlock *tb[TB_PROFILE_TOP];
+    size_t nb;
+};
+
+static uint64_t tb_exec_count_read(const TranslationBlock *tb)
+{
+    return tb->exec_count ? qatomic_read__nocheck(tb->exec_count) : 0;
+}
+
+static gboolean tb_profile_top_iter(gpointer key, gpointer value,
+                                    gpointer data)
+{
+    const TranslationBlock *tb = value;
+    struct tb_profile_top *top = data;
+    uint64_t count = tb_exec_count_read(tb);
+    size_t i;
+
+    if (!count) {
+        return false;
+    }
+    if (top->nb == TB_PROFILE_TOP) {
+        if (count <= tb_exec_count_read(top->tb[top->nb - 1])) {
+            return false;
+        }
+        top->nb--;
+    }
+    /* insertion sort, hottest first */
+    for (i = top->nb; i > 0 && tb_exec_count_read(top->tb[i - 1]) < count;
+         i--) {
+        top->tb[i] = top->tb[i - 1];
+    }
+    top->tb[i] = tb;
+    top->nb++;
+    return false;
+}
+
+/*
+ * Print the hottest TBs together with the TBs they are chained to, which
+ * is where retranslating several blocks as one region would pay off.
+ */
+static void dump_tb_profile(void)
+{
+    struct tb_profile_top top = {};
+    size_t i;
+    int n;
+
+    tcg_tb_foreach(tb_profile_top_iter, &top);
+
+    qemu_printf("\nHottest TBs (%u/%u counters in use):\n",
+                MIN(qatomic_read(&tb_exec_counts_used), TB_PROFILE_SLOTS),
+                TB_PROFILE_SLOTS);
+    for (i = 0; i < top.nb; i++) {
+        const TranslationBlock *tb = top.tb[i];
+
+        qemu_printf("pc=" TARGET_FMT_lx " size=%u count=%" PRIu64 "\n",
+                    tb->pc, tb->size, tb_exec_count_read(tb));
+        for (n = 0; n < 2; n++) {
+            const TranslationBlock *dst;
+
+            dst = (const TranslationBlock *)
+                (qatomic_read(&tb->jmp_dest[n]) & ~(uintptr_t)1);
+            if (dst) {
+                qemu_printf("    -> pc=" TARGET_FMT_lx " count=%" PRIu64 "\n",
+                            dst->pc, tb_exec_count_read(dst));
+            }
+        }
+    }
+}
+
 void dump_exec_info(void)
 {
     struct tb_tree_stats tst = {};
     struct qht_stats hst;
     size_t nb_tbs, flush_full, flush_part, flush_elide;
+    uint64_t jc_hits = 0, jc_misses = 0;
+    CPUState *cpu;
 
     tcg_tb_foreach(tb_tree_stats_iter, &tst);
     nb_tbs = tst.nb_tbs;
@@ -2596,13 +2778,28 @@ void dump_exec_info(void)
     qemu_printf("\nStatistics:\n");
     qemu_printf("TB flush count      %u\n",
                 qatomic_read(&tb_ctx.tb_flush_count));
+    qemu_printf("TB region evictions %u\n",
+                qatomic_read(&tb_ctx.tb_evict_count));
     qemu_printf("TB invalidate count %zu\n",
                 tcg_tb_phys_invalidate_count());
 
+    CPU_FOREACH(cpu) {
+        jc_hits += qatomic_read__nocheck(&cpu->tb_jmp_cache_hits);
+        jc_misses += qatomic_read__nocheck(&cpu->tb_jmp_cache_misses);
+    }
+    qemu_printf("TB jump cache hits  %" PRIu64 " (%" PRIu64 "%%)\n", jc_hits,
+                jc_hits + jc_misses ? jc_hits * 100 / (jc_hits + jc_misses)
+                                    : 0);
+    qemu_printf("TB jump cache miss  %" PRIu64 "\n", jc_misses);
+
     tlb_flush_counts(&flush_full, &flush_part, &flush_elide);
     qemu_printf("TLB full flushes    %zu\n", flush_full);
     qemu_printf("TLB partial flushes %zu\n", flush_part);
     qemu_printf("TLB elided flushes  %zu\n", flush_elide);
+
+    if (tb_exec_counts) {
+        dump_tb_profile();
+    }
     tcg_dump_info();
 }
 
@@ -2748,7 +2945,7 @@ int page_get_flags(target_ulong address)
    on PAGE_WRITE.  The mmap_lock should already be held.  */
 void page_set_flags(target_ulong start, target_ulong end, int flags)
 {
-    target_ulong addr, len;
+    target_ulong addr, len, step;
 
     /* This function should never be called with addresses outside the
        guest address space.  If this assert fires, it probably indicates
@@ -2766,14 +2963,27 @@ void page_set_flags(target_ulong start, target_ulong end, int flags)
 
     for (addr = start, len = end - start;
          len != 0;
-         len -= TARGET_PAGE_SIZE, addr += TARGET_PAGE_SIZE) {
-        PageDesc *p = page_find_alloc(addr >> TARGET_PAGE_BITS, 1);
+         len -= step, addr += step) {
+        PageDesc *p = page_find_alloc(addr >> TARGET_PAGE_BITS, flags != 0);
+
+        if (!p) {
+            /*
+             * When clearing, there is nothing to do in a leaf table that
+             * was never allocated: skip it instead of allocating it,
+             * which keeps the munmap of large reservations cheap.
+             */
+            target_ulong next = (addr | ((target_ulong)V_L2_SIZE *
+                                         TARGET_PAGE_SIZE - 1)) + 1;
+            step = MIN(next - addr, len);
+            continue;
+        }
+        step = TARGET_PAGE_SIZE;
 
-        /* If the write protection bit is set, then we invalidate
-           the code inside.  */
-        if (!(p->flags & PAGE_WRITE) &&
-            (flags & PAGE_WRITE) &&
-            p->first_tb) {
+        /* If the write protection bit is set, or the page goes away,
+           then we invalidate the code inside.  */
+        if (p->first_tb &&
+            (!(flags & PAGE_VALID) ||
+             (!(p->flags & PAGE_WRITE) && (flags & PAGE_WRITE)))) {
             tb_invalidate_phys_page(addr, 0);
         }
         p->flags = flags;
@@ -2782,7 +2992,7 @@ void page_set_flags(target_ulong start, target_ulong end, int flags)
 
 int page_check_range(target_ulong start, target_ulong len, int flags)
 {
-    PageDesc *p;
+    PageDesc *p = NULL;
     target_ulong end;
     target_ulong addr;
 
@@ -2808,9 +3018,21 @@ int page_check_range(target_ulong start, target_ulong len, int flags)
     for (addr = start, len = end - start;
          len != 0;
          len -= TARGET_PAGE_SIZE, addr += TARGET_PAGE_SIZE) {
-        p = page_find(addr >> TARGET_PAGE_BITS);
-        if (!p) {
-            return -1;
+        tb_page_addr_t index = addr >> TARGET_PAGE_BITS;
+
+        /*
+         * The descriptors of a leaf table are contiguous, and leaves are
+         * never freed in user mode, so only walk the tables when entering
+         * a new leaf. This keeps lock_user() of large syscall buffers
+         * cheap.
+         */
+        if (p && (index & (V_L2_SIZE - 1))) {
+            p++;
+        } else {
+            p = page_find(index);
+            if (!p) {
+                return -1;
+            }
         }
         if (!(p->flags & PAGE_VALID)) {
             return -1;
@@ -2848,6 +3070,27 @@ int page_unprotect(target_ulong address, uintptr_t pc)
     PageDesc *p;
     target_ulong host_start, host_end, addr;
 
+    /*
+     * Threads writing to the same page often fault on it together: only
+     * the first one has to invalidate the code and change the protection,
+     * the others can go on without waiting for the mmap_lock as soon as
+     * the page is writable again.  The unlocked check below gives the
+     * same answer as the locked one further down for such pages.
+     */
+    p = page_find(address >> TARGET_PAGE_BITS);
+    if (p && (qatomic_read(&p->flags) & PAGE_WRITE)) {
+        current_tb_invalidated = false;
+#ifdef TARGET_HAS_PRECISE_SMC
+        {
+            TranslationBlock *current_tb = tcg_tb_lookup(pc);
+            if (current_tb) {
+                current_tb_invalidated = tb_cflags(current_tb) & CF_INVALID;
+            }
+        }
+#endif
+        return current_tb_invalidated ? 2 : 1;
+    }
+
     /* Technically this isn't safe inside a signal handler.  However we
        know this only ever happens in a synchronous SEGV handler, so in
        practice it seems to be ok.  */
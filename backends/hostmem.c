@@ -230,7 +230,8 @@ static void host_memory_backend_set_prealloc(Object *obj, bool value,
         void *ptr = memory_region_get_ram_ptr(&backend->mr);
         uint64_t sz = memory_region_size(&backend->mr);
 
-        os_mem_prealloc(fd, ptr, sz, backend->prealloc_threads, &local_err);
+        os_mem_prealloc_nodes(fd, ptr, sz, backend->prealloc_threads,
+                              backend->host_nodes, MAX_NODES, &local_err);
         if (local_err) {
             error_propagate(errp, local_err);
             return;
@@ -390,8 +391,9 @@ host_memory_backend_memory_complete(UserCreatable *uc, Error **errp)
          * specified NUMA policy in place.
          */
         if (backend->prealloc) {
-            os_mem_prealloc(memory_region_get_fd(&backend->mr), ptr, sz,
-                            backend->prealloc_threads, &local_err);
+            os_mem_prealloc_nodes(memory_region_get_fd(&backend->mr), ptr, sz,
+                                  backend->prealloc_threads,
+                                  backend->host_nodes, MAX_NODES, &local_err);
             if (local_err) {
                 goto out;
             }
@@ -67,6 +67,9 @@
 static QTAILQ_HEAD(, BlockDriverState) graph_bdrv_states =
     QTAILQ_HEAD_INITIALIZER(graph_bdrv_states);
 
+/* Index of graph_bdrv_states by node name, created on first use */
+static GHashTable *graph_bdrv_names;
+
 static QTAILQ_HEAD(, BlockDriverState) all_bdrv_states =
     QTAILQ_HEAD_INITIALIZER(all_bdrv_states);
 
@@ -387,6 +390,10 @@ BlockDriverState *bdrv_new(void)
 
     qemu_co_queue_init(&bs->flush_queue);
 
+    for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+        log_histogram_init(&bs->latency[i]);
+    }
+
     for (i = 0; i < bdrv_drain_all_count; i++) {
         bdrv_drained_begin(bs);
     }
@@ -1437,6 +1444,10 @@ static void bdrv_assign_node_name(BlockDriverState *bs,
     /* copy node name into the bs and insert it into the graph list */
     pstrcpy(bs->node_name, sizeof(bs->node_name), node_name);
     QTAILQ_INSERT_TAIL(&graph_bdrv_states, bs, node_list);
+    if (!graph_bdrv_names) {
+        graph_bdrv_names = g_hash_table_new(g_str_hash, g_str_equal);
+    }
+    g_hash_table_insert(graph_bdrv_names, bs->node_name, bs);
 out:
     g_free(gen_node_name);
 }
@@ -4690,6 +4701,7 @@ static void bdrv_delete(BlockDriverState *bs)
     /* remove from list, if necessary */
     if (bs->node_name[0] != '\0') {
         QTAILQ_REMOVE(&graph_bdrv_states, bs, node_list);
+        g_hash_table_remove(graph_bdrv_names, bs->node_name);
     }
     QTAILQ_REMOVE(&all_bdrv_states, bs, bs_list);
 
@@ -5222,16 +5234,12 @@ void bdrv_iterate_format(void (*it)(void *opaque, const char *name),
 /* This function is to find a node in the bs graph */
 BlockDriverState *bdrv_find_node(const char *node_name)
 {
-    BlockDriverState *bs;
-
     assert(node_name);
 
-    QTAILQ_FOREACH(bs, &graph_bdrv_states, node_list) {
-        if (!strcmp(node_name, bs->node_name)) {
-            return bs;
-        }
+    if (!graph_bdrv_names) {
+        return NULL;
     }
-    return NULL;
+    return g_hash_table_lookup(graph_bdrv_names, node_name);
 }
 
 /* Put this QMP function here so it can access the static graph_bdrv_states. */
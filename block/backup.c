@@ -24,6 +24,7 @@
 #include "qapi/qmp/qerror.h"
 #include "qemu/ratelimit.h"
 #include "qemu/cutils.h"
+#include "qemu/units.h"
 #include "sysemu/block-backend.h"
 #include "qemu/bitmap.h"
 #include "qemu/error-report.h"
@@ -31,6 +32,8 @@
 #include "block/backup-top.h"
 
 #define BACKUP_CLUSTER_SIZE_DEFAULT (1 << 16)
+/* Upper bound of the area handed to block-copy in one go */
+#define BACKUP_LOOP_MAX_BYTES (64 * MiB)
 
 typedef struct BackupBlockJob {
     BlockJob common;
@@ -189,11 +192,18 @@ static int coroutine_fn backup_loop(BackupBlockJob *job)
 
     bdbi = bdrv_dirty_iter_new(block_copy_dirty_bitmap(job->bcs));
     while ((offset = bdrv_dirty_iter_next(bdbi)) != -1) {
+        /*
+         * Let block-copy merge clusters into large requests and run them in
+         * parallel, unless we need small steps to respect a rate limit.
+         */
+        int64_t bytes = job->common.speed ? job->cluster_size :
+                        MIN(job->len - offset, BACKUP_LOOP_MAX_BYTES);
+
         do {
             if (yield_and_check(job)) {
                 goto out;
             }
-            ret = backup_do_cow(job, offset, job->cluster_size, &error_is_read);
+            ret = backup_do_cow(job, offset, bytes, &error_is_read);
             if (ret < 0 && backup_error_action(job, error_is_read, -ret) ==
                            BLOCK_ERROR_ACTION_REPORT)
             {
@@ -275,6 +285,11 @@ static int coroutine_fn backup_run(Job *job, Error **errp)
         ret = backup_loop(s);
     }
 
+    /* Old data that guest writes left in memory is part of the backup */
+    if (ret >= 0) {
+        ret = block_copy_wait_async(s->bcs);
+    }
+
  out:
     return ret;
 }
@@ -334,6 +349,7 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
                   MirrorSyncMode sync_mode, BdrvDirtyBitmap *sync_bitmap,
                   BitmapSyncMode bitmap_mode,
                   bool compress,
+                  int64_t cbw_buffer_size,
                   const char *filter_node_name,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
@@ -378,6 +394,21 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
         return NULL;
     }
 
+    if (cbw_buffer_size < 0) {
+        error_setg(errp, "Invalid parameter 'x-cbw-buffer-size'");
+        return NULL;
+    }
+
+    /*
+     * An image fleecing reader (see below) would read the new data through
+     * the backing chain of the target until the old one is written.
+     */
+    if (cbw_buffer_size && bdrv_chain_contains(target, bs)) {
+        error_setg(errp, "'x-cbw-buffer-size' is not supported when the "
+                   "source is in the backing chain of the target");
+        return NULL;
+    }
+
     if (bdrv_op_is_blocked(bs, BLOCK_OP_TYPE_BACKUP_SOURCE, errp)) {
         return NULL;
     }
@@ -467,6 +498,7 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
 
     block_copy_set_progress_callback(bcs, backup_progress_bytes_callback, job);
     block_copy_set_progress_meter(bcs, &job->common.job.progress);
+    block_copy_set_async_write(bcs, backup_top, cbw_buffer_size);
 
     /* Required permissions are already taken by backup-top target */
     block_job_add_bdrv(&job->common, "target", target, 0, BLK_PERM_ALL,
@@ -25,6 +25,7 @@
 #include "qemu/id.h"
 #include "qemu/main-loop.h"
 #include "qemu/option.h"
+#include "qemu/stats.h"
 #include "trace.h"
 #include "migration/misc.h"
 
@@ -35,6 +36,11 @@
 
 static AioContext *blk_aiocb_get_aio_context(BlockAIOCB *acb);
 
+/* Maximum number of requests held back for merging while plugged */
+#define BLK_MERGE_MAX_REQS 32
+
+typedef struct BlkMergeReq BlkMergeReq;
+
 typedef struct BlockBackendAioNotifier {
     void (*attached_aio_context)(AioContext *new_context, void *opaque);
     void (*detach_aio_context)(void *opaque);
@@ -67,6 +73,7 @@ struct BlockBackend {
 
     /* I/O stats (display with "info blockstats"). */
     BlockAcctStats stats;
+    StatsSource *stats_source;
 
     BlockdevOnError on_read_error, on_write_error;
     bool iostatus_enabled;
@@ -95,8 +102,36 @@ struct BlockBackend {
      * Accessed with atomic ops.
      */
     unsigned int in_flight;
+
+    /*
+     * Requests submitted between blk_io_plug() and the matching
+     * blk_io_unplug() are held back here when merge_requests is set, so
+     * that adjacent ones can be submitted as a single request.
+     */
+    bool merge_requests;
+    unsigned int plug_depth;
+    BlkMergeReq *merge_queue[BLK_MERGE_MAX_REQS];
+    int merge_queue_len;
+};
+
+struct BlkMergeReq {
+    Coroutine *co;
+    bool is_write;
+    int64_t offset;
+    unsigned int bytes;
+    QEMUIOVector *qiov;
+    size_t qiov_offset;
+    BdrvRequestFlags flags;
+    bool done;
+    int ret;
 };
 
+typedef struct BlkMergeBatch {
+    BlockBackend *blk;
+    BlkMergeReq **reqs;
+    int nr_reqs;
+} BlkMergeBatch;
+
 typedef struct BlockBackendAIOCB {
     BlockAIOCB common;
     BlockBackend *blk;
@@ -120,6 +155,9 @@ static QTAILQ_HEAD(, BlockBackend) block_backends =
 static QTAILQ_HEAD(, BlockBackend) monitor_block_backends =
     QTAILQ_HEAD_INITIALIZER(monitor_block_backends);
 
+/* Index of monitor_block_backends by name, created on first use */
+static GHashTable *monitor_block_backend_names;
+
 static void blk_root_inherit_options(BdrvChildRole role, bool parent_is_format,
                                      int *child_flags, QDict *child_options,
                                      int parent_flags, QDict *parent_options)
@@ -320,6 +358,96 @@ static const BdrvChildClass child_root = {
     .set_aio_ctx        = blk_root_set_aio_ctx,
 };
 
+enum {
+    BLK_STAT_RD_BYTES,
+    BLK_STAT_WR_BYTES,
+    BLK_STAT_RD_OPERATIONS,
+    BLK_STAT_WR_OPERATIONS,
+    BLK_STAT_FLUSH_OPERATIONS,
+    BLK_STAT_FAILED_RD_OPERATIONS,
+    BLK_STAT_FAILED_WR_OPERATIONS,
+    BLK_STAT_RD_TOTAL_TIME_NS,
+    BLK_STAT_WR_TOTAL_TIME_NS,
+    BLK_STAT_FLUSH_TOTAL_TIME_NS,
+    BLK_STAT__MAX,
+};
+
+/* Same names as in BlockDeviceStats */
+static const StatsDesc blk_stats_desc[BLK_STAT__MAX] = {
+    [BLK_STAT_RD_BYTES] = {
+        .name = "rd_bytes", .type = STATS_TYPE_CUMULATIVE,
+        .has_unit = true, .unit = STATS_UNIT_BYTES },
+    [BLK_STAT_WR_BYTES] = {
+        .name = "wr_bytes", .type = STATS_TYPE_CUMULATIVE,
+        .has_unit = true, .unit = STATS_UNIT_BYTES },
+    [BLK_STAT_RD_OPERATIONS] = {
+        .name = "rd_operations", .type = STATS_TYPE_CUMULATIVE },
+    [BLK_STAT_WR_OPERATIONS] = {
+        .name = "wr_operations", .type = STATS_TYPE_CUMULATIVE },
+    [BLK_STAT_FLUSH_OPERATIONS] = {
+        .name = "flush_operations", .type = STATS_TYPE_CUMULATIVE },
+    [BLK_STAT_FAILED_RD_OPERATIONS] = {
+        .name = "failed_rd_operations", .type = STATS_TYPE_CUMULATIVE },
+    [BLK_STAT_FAILED_WR_OPERATIONS] = {
+        .name = "failed_wr_operations", .type = STATS_TYPE_CUMULATIVE },
+    [BLK_STAT_RD_TOTAL_TIME_NS] = {
+        .name = "rd_total_time_ns", .type = STATS_TYPE_CUMULATIVE,
+        .has_unit = true, .unit = STATS_UNIT_NANOSECONDS },
+    [BLK_STAT_WR_TOTAL_TIME_NS] = {
+        .name = "wr_total_time_ns", .type = STATS_TYPE_CUMULATIVE,
+        .has_unit = true, .unit = STATS_UNIT_NANOSECONDS },
+    [BLK_STAT_FLUSH_TOTAL_TIME_NS] = {
+        .name = "flush_total_time_ns", .type = STATS_TYPE_CUMULATIVE,
+        .has_unit = true, .unit = STATS_UNIT_NANOSECONDS },
+};
+
+/* Backends that neither have a name nor a device are internal, skip them */
+static char *blk_stats_get_id(void *opaque)
+{
+    BlockBackend *blk = opaque;
+    char *id;
+
+    if (blk->name) {
+        return g_strdup(blk->name);
+    }
+    id = blk_get_attached_dev_id(blk);
+    if (!*id) {
+        g_free(id);
+        return NULL;
+    }
+    return id;
+}
+
+static void blk_stats_read(void *opaque, uint64_t *values)
+{
+    BlockBackend *blk = opaque;
+    BlockAcctStats *stats = &blk->stats;
+
+    qemu_mutex_lock(&stats->lock);
+    values[BLK_STAT_RD_BYTES] = stats->nr_bytes[BLOCK_ACCT_READ];
+    values[BLK_STAT_WR_BYTES] = stats->nr_bytes[BLOCK_ACCT_WRITE];
+    values[BLK_STAT_RD_OPERATIONS] = stats->nr_ops[BLOCK_ACCT_READ];
+    values[BLK_STAT_WR_OPERATIONS] = stats->nr_ops[BLOCK_ACCT_WRITE];
+    values[BLK_STAT_FLUSH_OPERATIONS] = stats->nr_ops[BLOCK_ACCT_FLUSH];
+    values[BLK_STAT_FAILED_RD_OPERATIONS] = stats->failed_ops[BLOCK_ACCT_READ];
+    values[BLK_STAT_FAILED_WR_OPERATIONS] =
+        stats->failed_ops[BLOCK_ACCT_WRITE];
+    values[BLK_STAT_RD_TOTAL_TIME_NS] = stats->total_time_ns[BLOCK_ACCT_READ];
+    values[BLK_STAT_WR_TOTAL_TIME_NS] = stats->total_time_ns[BLOCK_ACCT_WRITE];
+    values[BLK_STAT_FLUSH_TOTAL_TIME_NS] =
+        stats->total_time_ns[BLOCK_ACCT_FLUSH];
+    qemu_mutex_unlock(&stats->lock);
+}
+
+static const StatsGroup blk_stats_group = {
+    .provider = STATS_PROVIDER_BLOCK,
+    .target = STATS_TARGET_BLOCK,
+    .stats = blk_stats_desc,
+    .nr_stats = BLK_STAT__MAX,
+    .get_id = blk_stats_get_id,
+    .read = blk_stats_read,
+};
+
 /*
  * Create a new BlockBackend with a reference count of one.
  *
@@ -346,6 +474,7 @@ BlockBackend *blk_new(AioContext *ctx, uint64_t perm, uint64_t shared_perm)
     blk->on_write_error = BLOCKDEV_ON_ERROR_ENOSPC;
 
     block_acct_init(&blk->stats);
+    blk->stats_source = stats_register(&blk_stats_group, blk);
 
     qemu_co_queue_init(&blk->queued_requests);
     notifier_list_init(&blk->remove_bs_notifiers);
@@ -455,6 +584,7 @@ static void blk_delete(BlockBackend *blk)
     assert(QLIST_EMPTY(&blk->aio_notifiers));
     QTAILQ_REMOVE(&block_backends, blk, link);
     drive_info_del(blk->legacy_dinfo);
+    stats_unregister(blk->stats_source);
     block_acct_cleanup(&blk->stats);
     g_free(blk);
 }
@@ -662,6 +792,11 @@ bool monitor_add_blk(BlockBackend *blk, const char *name, Error **errp)
 
     blk->name = g_strdup(name);
     QTAILQ_INSERT_TAIL(&monitor_block_backends, blk, monitor_link);
+    if (!monitor_block_backend_names) {
+        monitor_block_backend_names = g_hash_table_new(g_str_hash,
+                                                       g_str_equal);
+    }
+    g_hash_table_insert(monitor_block_backend_names, blk->name, blk);
     return true;
 }
 
@@ -676,6 +811,7 @@ void monitor_remove_blk(BlockBackend *blk)
     }
 
     QTAILQ_REMOVE(&monitor_block_backends, blk, monitor_link);
+    g_hash_table_remove(monitor_block_backend_names, blk->name);
     g_free(blk->name);
     blk->name = NULL;
 }
@@ -695,15 +831,12 @@ const char *blk_name(const BlockBackend *blk)
  */
 BlockBackend *blk_by_name(const char *name)
 {
-    BlockBackend *blk = NULL;
-
     assert(name);
-    while ((blk = blk_next(blk)) != NULL) {
-        if (!strcmp(name, blk->name)) {
-            return blk;
-        }
+
+    if (!monitor_block_backend_names) {
+        return NULL;
     }
-    return NULL;
+    return g_hash_table_lookup(monitor_block_backend_names, name);
 }
 
 /*
@@ -1181,6 +1314,175 @@ static void coroutine_fn blk_wait_while_drained(BlockBackend *blk)
     }
 }
 
+static bool blk_merge_allowed(BlockBackend *blk, unsigned int bytes,
+                              QEMUIOVector *qiov)
+{
+    return blk->merge_requests && blk->plug_depth && !blk->quiesce_counter &&
+           qiov && bytes;
+}
+
+static void coroutine_fn blk_merge_co_entry(void *opaque)
+{
+    BlkMergeBatch *batch = opaque;
+    BlockBackend *blk = batch->blk;
+    BlkMergeReq *first = batch->reqs[0];
+    QEMUIOVector merged_qiov;
+    QEMUIOVector *qiov = first->qiov;
+    size_t qiov_offset = first->qiov_offset;
+    int64_t bytes = 0;
+    int niov = 0;
+    int ret, i;
+
+    for (i = 0; i < batch->nr_reqs; i++) {
+        bytes += batch->reqs[i]->bytes;
+        niov += batch->reqs[i]->qiov->niov;
+    }
+
+    if (batch->nr_reqs > 1) {
+        qemu_iovec_init(&merged_qiov, niov);
+        for (i = 0; i < batch->nr_reqs; i++) {
+            BlkMergeReq *req = batch->reqs[i];
+            qemu_iovec_concat(&merged_qiov, req->qiov, req->qiov_offset,
+                              req->bytes);
+        }
+        qiov = &merged_qiov;
+        qiov_offset = 0;
+
+        block_acct_merge_done(&blk->stats,
+                              first->is_write ? BLOCK_ACCT_WRITE
+                                              : BLOCK_ACCT_READ,
+                              batch->nr_reqs - 1);
+    }
+
+    trace_blk_merge_submit(blk, first->is_write, first->offset, bytes,
+                           batch->nr_reqs);
+    if (first->is_write) {
+        ret = bdrv_co_pwritev_part(blk->root, first->offset, bytes, qiov,
+                                   qiov_offset, first->flags);
+    } else {
+        ret = bdrv_co_preadv_part(blk->root, first->offset, bytes, qiov,
+                                  qiov_offset, first->flags);
+    }
+
+    if (batch->nr_reqs > 1) {
+        qemu_iovec_destroy(&merged_qiov);
+    }
+
+    for (i = 0; i < batch->nr_reqs; i++) {
+        BlkMergeReq *req = batch->reqs[i];
+        req->ret = ret;
+        req->done = true;
+        aio_co_wake(req->co);
+    }
+
+    g_free(batch->reqs);
+    g_free(batch);
+}
+
+static int blk_merge_compare(const void *a, const void *b)
+{
+    const BlkMergeReq *req1 = *(BlkMergeReq * const *)a;
+    const BlkMergeReq *req2 = *(BlkMergeReq * const *)b;
+
+    if (req1->is_write != req2->is_write) {
+        return req1->is_write - req2->is_write;
+    }
+    if (req1->offset != req2->offset) {
+        return req1->offset < req2->offset ? -1 : 1;
+    }
+    return 0;
+}
+
+/*
+ * Submit the requests held back while plugged.  Requests of the same type
+ * and flags that are contiguous on disk are combined into a single request
+ * as long as the result stays within the transfer and iovec limits of the
+ * node; each combined request runs in its own coroutine and completes all
+ * the requests it is made of.
+ */
+static void blk_merge_flush(BlockBackend *blk)
+{
+    BlkMergeReq *reqs[BLK_MERGE_MAX_REQS];
+    int nr_reqs = blk->merge_queue_len;
+    int64_t max_bytes;
+    int max_iov;
+    int start, i;
+
+    if (!nr_reqs) {
+        return;
+    }
+
+    memcpy(reqs, blk->merge_queue, nr_reqs * sizeof(reqs[0]));
+    blk->merge_queue_len = 0;
+
+    max_bytes = MIN(blk_get_max_transfer(blk), BDRV_REQUEST_MAX_BYTES);
+    max_iov = blk_get_max_iov(blk);
+
+    qsort(reqs, nr_reqs, sizeof(reqs[0]), blk_merge_compare);
+
+    for (start = 0; start < nr_reqs; start = i) {
+        BlkMergeReq *first = reqs[start];
+        int64_t end = first->offset + first->bytes;
+        int niov = first->qiov->niov;
+        BlkMergeBatch *batch;
+        Coroutine *co;
+
+        for (i = start + 1; i < nr_reqs; i++) {
+            BlkMergeReq *req = reqs[i];
+
+            if (req->is_write != first->is_write ||
+                req->flags != first->flags ||
+                req->offset != end ||
+                end + req->bytes - first->offset > max_bytes ||
+                niov + req->qiov->niov > max_iov) {
+                break;
+            }
+            end += req->bytes;
+            niov += req->qiov->niov;
+        }
+
+        batch = g_new(BlkMergeBatch, 1);
+        *batch = (BlkMergeBatch) {
+            .blk        = blk,
+            .reqs       = g_memdup(&reqs[start], (i - start) * sizeof(reqs[0])),
+            .nr_reqs    = i - start,
+        };
+        co = qemu_coroutine_create(blk_merge_co_entry, batch);
+        aio_co_enter(blk_get_aio_context(blk), co);
+    }
+}
+
+/*
+ * Hold back a request until the BlockBackend is unplugged, and return its
+ * result once the (possibly merged) request has completed.
+ */
+static int coroutine_fn blk_merge_co_queue(BlockBackend *blk, bool is_write,
+                                           int64_t offset, unsigned int bytes,
+                                           QEMUIOVector *qiov,
+                                           size_t qiov_offset,
+                                           BdrvRequestFlags flags)
+{
+    BlkMergeReq req = {
+        .co             = qemu_coroutine_self(),
+        .is_write       = is_write,
+        .offset         = offset,
+        .bytes          = bytes,
+        .qiov           = qiov,
+        .qiov_offset    = qiov_offset,
+        .flags          = flags,
+    };
+
+    blk->merge_queue[blk->merge_queue_len++] = &req;
+    if (blk->merge_queue_len == BLK_MERGE_MAX_REQS) {
+        blk_merge_flush(blk);
+    }
+
+    while (!req.done) {
+        qemu_coroutine_yield();
+    }
+    return req.ret;
+}
+
 /* To be called between exactly one pair of blk_inc/dec_in_flight() */
 static int coroutine_fn
 blk_do_preadv(BlockBackend *blk, int64_t offset, unsigned int bytes,
@@ -1208,7 +1510,11 @@ blk_do_preadv(BlockBackend *blk, int64_t offset, unsigned int bytes,
                 bytes, false);
     }
 
-    ret = bdrv_co_preadv(blk->root, offset, bytes, qiov, flags);
+    if (blk_merge_allowed(blk, bytes, qiov)) {
+        ret = blk_merge_co_queue(blk, false, offset, bytes, qiov, 0, flags);
+    } else {
+        ret = bdrv_co_preadv(blk->root, offset, bytes, qiov, flags);
+    }
     bdrv_dec_in_flight(bs);
     return ret;
 }
@@ -1257,8 +1563,13 @@ blk_do_pwritev_part(BlockBackend *blk, int64_t offset, unsigned int bytes,
         flags |= BDRV_REQ_FUA;
     }
 
-    ret = bdrv_co_pwritev_part(blk->root, offset, bytes, qiov, qiov_offset,
-                               flags);
+    if (blk_merge_allowed(blk, bytes, qiov)) {
+        ret = blk_merge_co_queue(blk, true, offset, bytes, qiov, qiov_offset,
+                                 flags);
+    } else {
+        ret = bdrv_co_pwritev_part(blk->root, offset, bytes, qiov,
+                                   qiov_offset, flags);
+    }
     bdrv_dec_in_flight(bs);
     return ret;
 }
@@ -1635,6 +1946,101 @@ BlockAIOCB *blk_aio_pdiscard(BlockBackend *blk,
                         cb, opaque);
 }
 
+/* Maximum number of discard requests in flight for blk_aio_pdiscard_ranges */
+#define BLK_DISCARD_RANGES_WORKERS 8
+
+typedef struct BlkDiscardRangesState {
+    BlockBackend *blk;
+    const BlkDiscardRange *ranges;
+    int nr_ranges;
+    int next;
+    int workers;
+    int ret;
+    Coroutine *co;
+    bool waiting;
+} BlkDiscardRangesState;
+
+static void coroutine_fn blk_discard_ranges_worker(void *opaque)
+{
+    BlkDiscardRangesState *s = opaque;
+
+    while (s->ret == 0 && s->next < s->nr_ranges) {
+        const BlkDiscardRange *range = &s->ranges[s->next++];
+        int64_t offset = range->offset;
+        int64_t bytes = range->bytes;
+
+        while (s->ret == 0 && bytes > 0) {
+            int num = MIN(bytes, BDRV_REQUEST_MAX_BYTES);
+            int ret;
+
+            ret = blk_check_byte_request(s->blk, offset, num);
+            if (ret == 0) {
+                ret = bdrv_co_pdiscard(s->blk->root, offset, num);
+            }
+
+            if (ret < 0 && s->ret == 0) {
+                s->ret = ret;
+            }
+            offset += num;
+            bytes -= num;
+        }
+    }
+
+    if (--s->workers == 0 && s->waiting) {
+        aio_co_wake(s->co);
+    }
+}
+
+static void blk_aio_pdiscard_ranges_entry(void *opaque)
+{
+    BlkAioEmAIOCB *acb = opaque;
+    BlkRwCo *rwco = &acb->rwco;
+    BlkDiscardRangesState s = {
+        .blk        = rwco->blk,
+        .ranges     = rwco->iobuf,
+        .nr_ranges  = acb->bytes,
+        .co         = qemu_coroutine_self(),
+    };
+    int i, nr_workers;
+
+    /*
+     * The whole list counts as a single request for draining, so wait here
+     * once rather than in each worker.
+     */
+    blk_wait_while_drained(s.blk);
+
+    nr_workers = MIN(s.nr_ranges, BLK_DISCARD_RANGES_WORKERS);
+    s.workers = nr_workers;
+    for (i = 0; i < nr_workers; i++) {
+        Coroutine *co = qemu_coroutine_create(blk_discard_ranges_worker, &s);
+        qemu_coroutine_enter(co);
+    }
+
+    s.waiting = true;
+    while (s.workers > 0) {
+        qemu_coroutine_yield();
+    }
+
+    rwco->ret = s.ret;
+    blk_aio_complete(acb);
+}
+
+/*
+ * Discard a list of byte ranges, with up to BLK_DISCARD_RANGES_WORKERS
+ * requests in flight at once.  The first error stops the submission of new
+ * requests and is returned once those already in flight have completed.
+ * @ranges must stay valid until @cb is called.
+ */
+BlockAIOCB *blk_aio_pdiscard_ranges(BlockBackend *blk,
+                                    const BlkDiscardRange *ranges,
+                                    int nr_ranges,
+                                    BlockCompletionFunc *cb, void *opaque)
+{
+    /* The number of ranges is passed in place of the byte count */
+    return blk_aio_prwv(blk, 0, nr_ranges, (void *)ranges,
+                        blk_aio_pdiscard_ranges_entry, 0, cb, opaque);
+}
+
 int coroutine_fn blk_co_pdiscard(BlockBackend *blk, int64_t offset, int bytes)
 {
     int ret;
@@ -1858,6 +2264,19 @@ void blk_set_enable_write_cache(BlockBackend *blk, bool wce)
     blk->enable_write_cache = wce;
 }
 
+/*
+ * Sets whether read and write requests submitted while the BlockBackend is
+ * plugged are held back until blk_io_unplug() so that adjacent requests can
+ * be merged.
+ */
+void blk_set_merge_requests(BlockBackend *blk, bool enable)
+{
+    blk->merge_requests = enable;
+    if (!enable) {
+        blk_merge_flush(blk);
+    }
+}
+
 void blk_invalidate_cache(BlockBackend *blk, Error **errp)
 {
     BlockDriverState *bs = blk_bs(blk);
@@ -2134,6 +2553,7 @@ void blk_io_plug(BlockBackend *blk)
 {
     BlockDriverState *bs = blk_bs(blk);
 
+    blk->plug_depth++;
     if (bs) {
         bdrv_io_plug(bs);
     }
@@ -2143,6 +2563,10 @@ void blk_io_unplug(BlockBackend *blk)
 {
     BlockDriverState *bs = blk_bs(blk);
 
+    assert(blk->plug_depth > 0);
+    if (--blk->plug_depth == 0) {
+        blk_merge_flush(blk);
+    }
     if (bs) {
         bdrv_io_unplug(bs);
     }
@@ -2354,6 +2778,9 @@ static void blk_root_drained_begin(BdrvChild *child)
         }
     }
 
+    /* Held back requests must not wait for an unplug during the drain */
+    blk_merge_flush(blk);
+
     /* Note that blk->root may not be accessible here yet if we are just
      * attaching to a BlockDriverState that is drained. Use child instead. */
 
@@ -2416,6 +2843,21 @@ int coroutine_fn blk_co_copy_range(BlockBackend *blk_in, int64_t off_in,
                               bytes, read_flags, write_flags);
 }
 
+/* Like blk_co_copy_range(), but the data is read from a node's child */
+int coroutine_fn blk_co_copy_range_from(BdrvChild *src, int64_t off_in,
+                                        BlockBackend *blk_out, int64_t off_out,
+                                        int bytes, BdrvRequestFlags read_flags,
+                                        BdrvRequestFlags write_flags)
+{
+    int r;
+    r = blk_check_byte_request(blk_out, off_out, bytes);
+    if (r) {
+        return r;
+    }
+    return bdrv_co_copy_range(src, off_in, blk_out->root, off_out,
+                              bytes, read_flags, write_flags);
+}
+
 const BdrvChild *blk_root(BlockBackend *blk)
 {
     return blk->root;
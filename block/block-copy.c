@@ -26,12 +26,15 @@
 #define BLOCK_COPY_MAX_BUFFER (1 * MiB)
 #define BLOCK_COPY_MAX_MEM (128 * MiB)
 #define BLOCK_COPY_MAX_WORKERS 64
+#define BLOCK_COPY_MIN_WORKERS 4
+#define BLOCK_COPY_INITIAL_WORKERS 16
 
 static coroutine_fn int block_copy_task_entry(AioTask *task);
 
 typedef struct BlockCopyCallState {
     bool failed;
     bool error_is_read;
+    bool before_write;
 } BlockCopyCallState;
 
 typedef struct BlockCopyTask {
@@ -42,6 +45,7 @@ typedef struct BlockCopyTask {
     int64_t offset;
     int64_t bytes;
     bool zeroes;
+    void *buf;      /* old data of a detached task, see block_copy_detach() */
     QLIST_ENTRY(BlockCopyTask) list;
     CoQueue wait_queue; /* coroutines blocked on this task */
 } BlockCopyTask;
@@ -91,6 +95,30 @@ typedef struct BlockCopyState {
     void *progress_opaque;
 
     SharedResource *mem;
+
+    /*
+     * Number of tasks that one block_copy() call runs in parallel.  It is
+     * tuned from the latency of the tasks, expressed in ns per MiB: the lowest
+     * cost seen approximates the latency of an idle backend, and an average
+     * well above it means that requests are queueing up.
+     */
+    int max_workers;
+    uint64_t cost_min;
+    uint64_t cost_avg;
+
+    /*
+     * Asynchronous copy-before-write: block_copy_before_write() returns as
+     * soon as the old data is read, and the write to the target completes in
+     * background as long as no more than async_max_bytes are pending.
+     * async_bs is kept in flight meanwhile, so that draining it waits for
+     * the writes.  A failed write cannot be retried because the source has
+     * been overwritten already; it is reported by block_copy_wait_async().
+     */
+    BlockDriverState *async_bs;
+    int64_t async_max_bytes;
+    int64_t async_bytes;
+    int async_ret;
+    CoQueue async_queue;
 } BlockCopyState;
 
 static BlockCopyTask *find_conflicting_task(BlockCopyState *s,
@@ -99,6 +127,10 @@ static BlockCopyTask *find_conflicting_task(BlockCopyState *s,
     BlockCopyTask *t;
 
     QLIST_FOREACH(t, &s->tasks, list) {
+        if (t->buf) {
+            /* The old data is safe in memory, nobody has to wait for it */
+            continue;
+        }
         if (offset + bytes > t->offset && offset < t->offset + t->bytes) {
             return t;
         }
@@ -217,6 +249,23 @@ static uint32_t block_copy_max_transfer(BdrvChild *source, BdrvChild *target)
                                      target->bs->bl.max_transfer));
 }
 
+/*
+ * Size of buffered copy tasks: adjacent dirty clusters are merged up to
+ * BLOCK_COPY_MAX_BUFFER, or up to the target's optimal transfer length if it
+ * prefers larger requests.
+ */
+static int64_t block_copy_buffer_size(BdrvChild *target, int64_t cluster_size)
+{
+    int64_t size = MAX(cluster_size, BLOCK_COPY_MAX_BUFFER);
+    uint32_t opt_transfer = target->bs->bl.opt_transfer;
+
+    if (opt_transfer > size) {
+        size = MIN(QEMU_ALIGN_UP(opt_transfer, cluster_size),
+                   MAX(cluster_size, BLOCK_COPY_MAX_COPY_RANGE));
+    }
+    return size;
+}
+
 BlockCopyState *block_copy_state_new(BdrvChild *source, BdrvChild *target,
                                      int64_t cluster_size,
                                      BdrvRequestFlags write_flags, Error **errp)
@@ -240,6 +289,7 @@ BlockCopyState *block_copy_state_new(BdrvChild *source, BdrvChild *target,
         .len = bdrv_dirty_bitmap_size(copy_bitmap),
         .write_flags = write_flags,
         .mem = shres_create(BLOCK_COPY_MAX_MEM),
+        .max_workers = BLOCK_COPY_INITIAL_WORKERS,
     };
 
     if (block_copy_max_transfer(source, target) < cluster_size) {
@@ -261,10 +311,11 @@ BlockCopyState *block_copy_state_new(BdrvChild *source, BdrvChild *target,
          * successful copy_range (look at block_copy_do_copy).
          */
         s->use_copy_range = true;
-        s->copy_size = MAX(s->cluster_size, BLOCK_COPY_MAX_BUFFER);
+        s->copy_size = block_copy_buffer_size(target, s->cluster_size);
     }
 
     QLIST_INIT(&s->tasks);
+    qemu_co_queue_init(&s->async_queue);
 
     return s;
 }
@@ -283,6 +334,13 @@ void block_copy_set_progress_meter(BlockCopyState *s, ProgressMeter *pm)
     s->progress = pm;
 }
 
+void block_copy_set_async_write(BlockCopyState *s, BlockDriverState *bs,
+                                int64_t max_bytes)
+{
+    s->async_bs = max_bytes ? bs : NULL;
+    s->async_max_bytes = max_bytes;
+}
+
 /*
  * Takes ownership of @task
  *
@@ -357,7 +415,7 @@ static int coroutine_fn block_copy_do_copy(BlockCopyState *s,
         if (ret < 0) {
             trace_block_copy_copy_range_fail(s, offset, ret);
             s->use_copy_range = false;
-            s->copy_size = MAX(s->cluster_size, BLOCK_COPY_MAX_BUFFER);
+            s->copy_size = block_copy_buffer_size(s->target, s->cluster_size);
             /* Fallback to read+write with allocated buffer */
         } else {
             if (s->use_copy_range) {
@@ -412,14 +470,44 @@ out:
     return ret;
 }
 
+/*
+ * Grow the number of workers while the tasks complete about as fast as they
+ * can, and shrink it when the latency shows that the backend is saturated.
+ */
+static void block_copy_account_task(BlockCopyState *s, int64_t bytes,
+                                    int64_t ns)
+{
+    uint64_t cost = muldiv64(ns, MiB, bytes);
+
+    /* Let an unusually fast request (e.g. a cache hit) be forgotten */
+    s->cost_min += s->cost_min / 64;
+    if (!s->cost_min || cost < s->cost_min) {
+        s->cost_min = cost;
+    }
+    s->cost_avg = s->cost_avg ? (s->cost_avg * 7 + cost) / 8 : cost;
+
+    if (s->cost_avg < s->cost_min * 2) {
+        s->max_workers = MIN(s->max_workers + 1, BLOCK_COPY_MAX_WORKERS);
+    } else if (s->cost_avg > s->cost_min * 4) {
+        s->max_workers = MAX(s->max_workers - 1, BLOCK_COPY_MIN_WORKERS);
+    }
+    trace_block_copy_task_latency(s, bytes, ns, s->max_workers);
+}
+
 static coroutine_fn int block_copy_task_entry(AioTask *task)
 {
     BlockCopyTask *t = container_of(task, BlockCopyTask, task);
     bool error_is_read = false;
+    int64_t start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     int ret;
 
     ret = block_copy_do_copy(t->s, t->offset, t->bytes, t->zeroes,
                              &error_is_read);
+    if (ret >= 0 && !t->zeroes) {
+        block_copy_account_task(t->s, t->bytes,
+                                qemu_clock_get_ns(QEMU_CLOCK_REALTIME) -
+                                start_ns);
+    }
     if (ret < 0 && !t->call_state->failed) {
         t->call_state->failed = true;
         t->call_state->error_is_read = error_is_read;
@@ -433,6 +521,70 @@ static coroutine_fn int block_copy_task_entry(AioTask *task)
     return ret;
 }
 
+static void coroutine_fn block_copy_async_write_entry(void *opaque)
+{
+    BlockCopyTask *t = opaque;
+    BlockCopyState *s = t->s;
+    BlockDriverState *bs = s->async_bs;
+    int64_t nbytes = MIN(task_end(t), s->len) - t->offset;
+    int ret;
+
+    ret = bdrv_co_pwrite(s->target, t->offset, nbytes, t->buf, s->write_flags);
+    if (ret < 0) {
+        trace_block_copy_write_fail(s, t->offset, ret);
+        if (!s->async_ret) {
+            s->async_ret = ret;
+        }
+    } else {
+        progress_work_done(s->progress, t->bytes);
+        s->progress_bytes_callback(t->bytes, s->progress_opaque);
+    }
+
+    qemu_vfree(t->buf);
+    co_put_to_shres(s->mem, t->bytes);
+    s->async_bytes -= t->bytes;
+    /* Never set the dirty bits back, the source has new data now */
+    block_copy_task_end(t, 0);
+    g_free(t);
+    qemu_co_queue_restart_all(&s->async_queue);
+
+    bdrv_dec_in_flight(bs);
+}
+
+/*
+ * Takes ownership of @task
+ *
+ * Read the old data of the task and leave the write to the target to a
+ * background coroutine.
+ */
+static int coroutine_fn block_copy_detach(BlockCopyTask *task)
+{
+    BlockCopyState *s = task->s;
+    int64_t nbytes = MIN(task_end(task), s->len) - task->offset;
+    void *buf = qemu_blockalign(s->source->bs, nbytes);
+    Coroutine *co;
+    int ret;
+
+    ret = bdrv_co_pread(s->source, task->offset, nbytes, buf, 0);
+    if (ret < 0) {
+        trace_block_copy_read_fail(s, task->offset, ret);
+        qemu_vfree(buf);
+        co_put_to_shres(s->mem, task->bytes);
+        block_copy_task_end(task, ret);
+        g_free(task);
+        return ret;
+    }
+
+    trace_block_copy_async_write(s, task->offset, task->bytes);
+    task->buf = buf;
+    s->async_bytes += task->bytes;
+    bdrv_inc_in_flight(s->async_bs);
+    co = qemu_coroutine_create(block_copy_async_write_entry, task);
+    qemu_coroutine_enter(co);
+
+    return 0;
+}
+
 static int block_copy_block_status(BlockCopyState *s, int64_t offset,
                                    int64_t bytes, int64_t *pnum)
 {
@@ -546,13 +698,16 @@ int64_t block_copy_reset_unallocated(BlockCopyState *s,
  */
 static int coroutine_fn block_copy_dirty_clusters(BlockCopyState *s,
                                                   int64_t offset, int64_t bytes,
+                                                  bool before_write,
                                                   bool *error_is_read)
 {
     int ret = 0;
     bool found_dirty = false;
     int64_t end = offset + bytes;
     AioTaskPool *aio = NULL;
-    BlockCopyCallState call_state = {false, false};
+    BlockCopyCallState call_state = {
+        .before_write = before_write && s->async_bs,
+    };
 
     /*
      * block_copy() user is responsible for keeping source and target in same
@@ -606,8 +761,22 @@ static int coroutine_fn block_copy_dirty_clusters(BlockCopyState *s,
         offset = task_end(task);
         bytes = end - offset;
 
-        if (!aio && bytes) {
-            aio = aio_task_pool_new(BLOCK_COPY_MAX_WORKERS);
+        if (call_state.before_write) {
+            /*
+             * Copy-before-write requests are small, run their tasks one
+             * by one and return without waiting for the target if possible.
+             */
+            if (!task->zeroes &&
+                s->async_bytes + task->bytes <= s->async_max_bytes) {
+                ret = block_copy_detach(task);
+                if (ret < 0) {
+                    call_state.error_is_read = true;
+                    goto out;
+                }
+                continue;
+            }
+        } else if (!aio && bytes) {
+            aio = aio_task_pool_new(s->max_workers);
         }
 
         ret = block_copy_task_run(aio, task);
@@ -649,13 +818,15 @@ out:
  * it means that some I/O operation failed in context of _this_ block_copy call,
  * not some parallel operation.
  */
-int coroutine_fn block_copy(BlockCopyState *s, int64_t offset, int64_t bytes,
-                            bool *error_is_read)
+static int coroutine_fn block_copy_common(BlockCopyState *s, int64_t offset,
+                                          int64_t bytes, bool before_write,
+                                          bool *error_is_read)
 {
     int ret;
 
     do {
-        ret = block_copy_dirty_clusters(s, offset, bytes, error_is_read);
+        ret = block_copy_dirty_clusters(s, offset, bytes, before_write,
+                                        error_is_read);
 
         if (ret == 0) {
             ret = block_copy_wait_one(s, offset, bytes);
@@ -675,6 +846,36 @@ int coroutine_fn block_copy(BlockCopyState *s, int64_t offset, int64_t bytes,
     return ret;
 }
 
+int coroutine_fn block_copy(BlockCopyState *s, int64_t offset, int64_t bytes,
+                            bool *error_is_read)
+{
+    return block_copy_common(s, offset, bytes, false, error_is_read);
+}
+
+/*
+ * block_copy_before_write
+ *
+ * Like block_copy(), but called before a write to the source: if enabled
+ * with block_copy_set_async_write(), return as soon as the old data is read.
+ */
+int coroutine_fn block_copy_before_write(BlockCopyState *s, int64_t offset,
+                                         int64_t bytes, bool *error_is_read)
+{
+    return block_copy_common(s, offset, bytes, true, error_is_read);
+}
+
+/*
+ * Wait for the background writes started by block_copy_before_write().
+ * Returns the error of the first one that failed, if any.
+ */
+int coroutine_fn block_copy_wait_async(BlockCopyState *s)
+{
+    while (s->async_bytes) {
+        qemu_co_queue_wait(&s->async_queue, NULL);
+    }
+    return s->async_ret;
+}
+
 BdrvDirtyBitmap *block_copy_dirty_bitmap(BlockCopyState *s)
 {
     return s->copy_bitmap;
@@ -16,6 +16,7 @@
 #include "qemu/cutils.h"
 #include "trace.h"
 #include "block/block_int.h"
+#include "block/aio_task.h"
 #include "block/blockjob_int.h"
 #include "qapi/error.h"
 #include "qapi/qmp/qerror.h"
@@ -29,8 +30,17 @@ enum {
      * contiguous regions of the image is efficient.
      */
     COMMIT_BUFFER_SIZE = 512 * 1024, /* in bytes */
+
+    /* Number of buffers copied in parallel */
+    COMMIT_MAX_WORKERS = 8,
 };
 
+typedef struct CommitRetry {
+    int64_t offset;
+    int64_t bytes;
+    QSIMPLEQ_ENTRY(CommitRetry) next;
+} CommitRetry;
+
 typedef struct CommitBlockJob {
     BlockJob common;
     BlockDriverState *commit_top_bs;
@@ -42,6 +52,9 @@ typedef struct CommitBlockJob {
     bool base_read_only;
     bool chain_frozen;
     char *backing_file_str;
+
+    /* Ranges whose copy failed and that must be copied again */
+    QSIMPLEQ_HEAD(, CommitRetry) retry;
 } CommitBlockJob;
 
 static int commit_prepare(Job *job)
@@ -112,16 +125,88 @@ static void commit_clean(Job *job)
     blk_unref(s->top);
 }
 
+typedef struct CommitTask {
+    AioTask task;
+    CommitBlockJob *s;
+    int64_t offset;
+    int64_t bytes;
+} CommitTask;
+
+static void commit_retry(CommitBlockJob *s, int64_t offset, int64_t bytes)
+{
+    CommitRetry *r = g_new(CommitRetry, 1);
+
+    r->offset = offset;
+    r->bytes = bytes;
+    QSIMPLEQ_INSERT_TAIL(&s->retry, r, next);
+}
+
+static int coroutine_fn commit_task_entry(AioTask *task)
+{
+    CommitTask *t = container_of(task, CommitTask, task);
+    CommitBlockJob *s = t->s;
+    bool error_in_source = true;
+    void *buf;
+    int ret;
+
+    assert(t->bytes < SIZE_MAX);
+    buf = blk_blockalign(s->top, t->bytes);
+    ret = blk_co_pread(s->top, t->offset, t->bytes, buf, 0);
+    if (ret >= 0) {
+        ret = blk_co_pwrite(s->base, t->offset, t->bytes, buf, 0);
+        if (ret < 0) {
+            error_in_source = false;
+        }
+    }
+    qemu_vfree(buf);
+
+    if (ret < 0) {
+        BlockErrorAction action =
+            block_job_error_action(&s->common, s->on_error,
+                                   error_in_source, -ret);
+        if (action == BLOCK_ERROR_ACTION_REPORT) {
+            return ret;
+        }
+        /* Copied again by commit_run() once the job is resumed */
+        commit_retry(s, t->offset, t->bytes);
+        return 0;
+    }
+
+    /* Publish progress */
+    job_progress_update(&s->common.job, t->bytes);
+    return 0;
+}
+
+static void coroutine_fn commit_start_task(AioTaskPool *pool,
+                                           CommitBlockJob *s,
+                                           int64_t offset, int64_t bytes)
+{
+    CommitTask *t = g_new(CommitTask, 1);
+
+    *t = (CommitTask) {
+        .task.func = commit_task_entry,
+        .s = s,
+        .offset = offset,
+        .bytes = bytes,
+    };
+    aio_task_pool_wait_slot(pool);
+    aio_task_pool_start_task(pool, &t->task);
+}
+
 static int coroutine_fn commit_run(Job *job, Error **errp)
 {
     CommitBlockJob *s = container_of(job, CommitBlockJob, common.job);
-    int64_t offset;
+    AioTaskPool *pool = NULL;
+    CommitRetry *r;
+    int64_t offset = 0;
+    int64_t status_end = 0;
+    bool status_copy = false;
     uint64_t delay_ns = 0;
     int ret = 0;
-    int64_t n = 0; /* bytes */
-    void *buf = NULL;
     int64_t len, base_len;
 
+    QSIMPLEQ_INIT(&s->retry);
+
     ret = len = blk_getlength(s->top);
     if (len < 0) {
         goto out;
@@ -140,60 +225,84 @@ static int coroutine_fn commit_run(Job *job, Error **errp)
         }
     }
 
-    buf = blk_blockalign(s->top, COMMIT_BUFFER_SIZE);
+    ret = 0;
+    pool = aio_task_pool_new(COMMIT_MAX_WORKERS);
 
-    for (offset = 0; offset < len; offset += n) {
-        bool copy;
-        bool error_in_source = true;
+    for (;;) {
+        int64_t chunk_offset, n;
 
         /* Note that even when no rate limit is applied we need to yield
          * with no pending I/O here so that bdrv_drain_all() returns.
          */
         job_sleep_ns(&s->common.job, delay_ns);
-        if (job_is_cancelled(&s->common.job)) {
+        if (job_is_cancelled(&s->common.job) ||
+            aio_task_pool_status(pool) < 0) {
             break;
         }
-        /* Copy if allocated above the base */
-        ret = bdrv_is_allocated_above(blk_bs(s->top), s->base_overlay, true,
-                                      offset, COMMIT_BUFFER_SIZE, &n);
-        copy = (ret > 0);
-        trace_commit_one_iteration(s, offset, n, ret);
-        if (copy) {
-            assert(n < SIZE_MAX);
-
-            ret = blk_co_pread(s->top, offset, n, buf, 0);
-            if (ret >= 0) {
-                ret = blk_co_pwrite(s->base, offset, n, buf, 0);
+
+        r = QSIMPLEQ_FIRST(&s->retry);
+        if (r) {
+            QSIMPLEQ_REMOVE_HEAD(&s->retry, next);
+            chunk_offset = r->offset;
+            n = r->bytes;
+            g_free(r);
+        } else if (offset < len) {
+            if (offset == status_end) {
+                /*
+                 * Copy if allocated above the base.  Ask for the rest of
+                 * the image at once, and hand out the answer in pieces.
+                 */
+                ret = bdrv_is_allocated_above(blk_bs(s->top), s->base_overlay,
+                                              true, offset, len - offset, &n);
+                trace_commit_one_iteration(s, offset, n, ret);
                 if (ret < 0) {
-                    error_in_source = false;
+                    BlockErrorAction action =
+                        block_job_error_action(&s->common, s->on_error,
+                                               true, -ret);
+                    if (action == BLOCK_ERROR_ACTION_REPORT) {
+                        break;
+                    }
+                    ret = 0;
+                    delay_ns = 0;
+                    continue;
+                }
+                status_copy = (ret > 0);
+                status_end = offset + n;
+                ret = 0;
+                if (!status_copy) {
+                    job_progress_update(&s->common.job, n);
+                    offset = status_end;
+                    delay_ns = 0;
+                    continue;
                 }
             }
-        }
-        if (ret < 0) {
-            BlockErrorAction action =
-                block_job_error_action(&s->common, s->on_error,
-                                       error_in_source, -ret);
-            if (action == BLOCK_ERROR_ACTION_REPORT) {
-                goto out;
-            } else {
-                n = 0;
-                continue;
-            }
-        }
-        /* Publish progress */
-        job_progress_update(&s->common.job, n);
-
-        if (copy) {
-            delay_ns = block_job_ratelimit_get_delay(&s->common, n);
-        } else {
+            chunk_offset = offset;
+            n = MIN(status_end - offset, COMMIT_BUFFER_SIZE);
+            offset += n;
+        } else if (!aio_task_pool_empty(pool)) {
+            /* A request still in flight may have to be retried */
+            aio_task_pool_wait_one(pool);
             delay_ns = 0;
+            continue;
+        } else {
+            break;
         }
+
+        commit_start_task(pool, s, chunk_offset, n);
+        delay_ns = block_job_ratelimit_get_delay(&s->common, n);
     }
 
-    ret = 0;
+    aio_task_pool_wait_all(pool);
+    if (ret == 0) {
+        ret = aio_task_pool_status(pool);
+    }
 
 out:
-    qemu_vfree(buf);
+    aio_task_pool_free(pool);
+    while ((r = QSIMPLEQ_FIRST(&s->retry))) {
+        QSIMPLEQ_REMOVE_HEAD(&s->retry, next);
+        g_free(r);
+    }
 
     return ret;
 }
@@ -22,6 +22,8 @@
 
 #include "block/block_int.h"
 #include "block/qdict.h"
+#include "block/aio_task.h"
+#include "block/thread-pool.h"
 #include "sysemu/block-backend.h"
 #include "crypto/block.h"
 #include "qapi/opts-visitor.h"
@@ -35,9 +37,20 @@
 
 typedef struct BlockCrypto BlockCrypto;
 
+#define BLOCK_CRYPTO_MAX_WORKERS 8
+#define BLOCK_CRYPTO_MAX_THREADS 8
+
 struct BlockCrypto {
     QCryptoBlock *block;
     bool updating_keys;
+
+    /* Number of encryption/decryption jobs in the thread pool */
+    int nb_threads;
+    CoQueue thread_task_queue;
+
+    /* Idle bounce buffers, BLOCK_CRYPTO_MAX_IO_SIZE bytes each */
+    void *free_buffers[BLOCK_CRYPTO_MAX_WORKERS];
+    unsigned int nb_free_buffers;
 };
 
 
@@ -294,7 +307,7 @@ static int block_crypto_open_generic(QCryptoBlockFormat format,
                                        block_crypto_read_func,
                                        bs,
                                        cflags,
-                                       1,
+                                       BLOCK_CRYPTO_MAX_THREADS,
                                        errp);
 
     if (!crypto->block) {
@@ -303,6 +316,7 @@ static int block_crypto_open_generic(QCryptoBlockFormat format,
     }
 
     bs->encrypted = true;
+    qemu_co_queue_init(&crypto->thread_task_queue);
 
     ret = 0;
  cleanup:
@@ -377,9 +391,17 @@ block_crypto_co_truncate(BlockDriverState *bs, int64_t offset, bool exact,
     return bdrv_co_truncate(bs->file, offset, exact, prealloc, 0, errp);
 }
 
+static void block_crypto_free_bounce_buffers(BlockCrypto *crypto)
+{
+    while (crypto->nb_free_buffers) {
+        qemu_vfree(crypto->free_buffers[--crypto->nb_free_buffers]);
+    }
+}
+
 static void block_crypto_close(BlockDriverState *bs)
 {
     BlockCrypto *crypto = bs->opaque;
+    block_crypto_free_bounce_buffers(crypto);
     qcrypto_block_free(crypto->block);
 }
 
@@ -396,131 +418,288 @@ static int block_crypto_reopen_prepare(BDRVReopenState *state,
  */
 #define BLOCK_CRYPTO_MAX_IO_SIZE (1024 * 1024)
 
-static coroutine_fn int
-block_crypto_co_preadv(BlockDriverState *bs, uint64_t offset, uint64_t bytes,
-                       QEMUIOVector *qiov, int flags)
+/*
+ * Requests are split in up to BLOCK_CRYPTO_MAX_WORKERS tasks, each doing
+ * its own I/O, so that large requests are encrypted or decrypted by
+ * several threads at once.  Tasks are not made smaller than
+ * BLOCK_CRYPTO_MIN_TASK_SIZE so that the cost of dispatching them to the
+ * thread pool stays small relative to the cipher work.
+ */
+#define BLOCK_CRYPTO_MIN_TASK_SIZE (64 * 1024)
+
+typedef int (*BlockCryptoEncDecFunc)(QCryptoBlock *block, uint64_t offset,
+                                     uint8_t *buf, size_t len, Error **errp);
+
+typedef struct BlockCryptoEncDecData {
+    QCryptoBlock *block;
+    uint64_t offset;
+    uint8_t *buf;
+    size_t len;
+
+    BlockCryptoEncDecFunc func;
+} BlockCryptoEncDecData;
+
+static int block_crypto_encdec_pool_func(void *opaque)
 {
-    BlockCrypto *crypto = bs->opaque;
-    uint64_t cur_bytes; /* number of bytes in current iteration */
-    uint64_t bytes_done = 0;
-    uint8_t *cipher_data = NULL;
-    QEMUIOVector hd_qiov;
-    int ret = 0;
-    uint64_t sector_size = qcrypto_block_get_sector_size(crypto->block);
-    uint64_t payload_offset = qcrypto_block_get_payload_offset(crypto->block);
+    BlockCryptoEncDecData *data = opaque;
 
-    assert(!flags);
-    assert(payload_offset < INT64_MAX);
-    assert(QEMU_IS_ALIGNED(offset, sector_size));
-    assert(QEMU_IS_ALIGNED(bytes, sector_size));
+    return data->func(data->block, data->offset, data->buf, data->len, NULL);
+}
 
-    qemu_iovec_init(&hd_qiov, qiov->niov);
+static int coroutine_fn
+block_crypto_co_encdec(BlockDriverState *bs, uint64_t offset, void *buf,
+                       size_t len, BlockCryptoEncDecFunc func)
+{
+    BlockCrypto *crypto = bs->opaque;
+    ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    BlockCryptoEncDecData arg = {
+        .block = crypto->block,
+        .offset = offset,
+        .buf = buf,
+        .len = len,
+        .func = func,
+    };
+    int ret;
 
-    /* Bounce buffer because we don't wish to expose cipher text
-     * in qiov which points to guest memory.
-     */
-    cipher_data =
-        qemu_try_blockalign(bs->file->bs, MIN(BLOCK_CRYPTO_MAX_IO_SIZE,
-                                              qiov->size));
-    if (cipher_data == NULL) {
-        ret = -ENOMEM;
-        goto cleanup;
+    /* Each thread needs one of the ciphers allocated by qcrypto_block_open */
+    while (crypto->nb_threads >= BLOCK_CRYPTO_MAX_THREADS) {
+        qemu_co_queue_wait(&crypto->thread_task_queue, NULL);
     }
+    crypto->nb_threads++;
 
-    while (bytes) {
-        cur_bytes = MIN(bytes, BLOCK_CRYPTO_MAX_IO_SIZE);
+    ret = thread_pool_submit_co(pool, block_crypto_encdec_pool_func, &arg);
 
-        qemu_iovec_reset(&hd_qiov);
-        qemu_iovec_add(&hd_qiov, cipher_data, cur_bytes);
+    crypto->nb_threads--;
+    qemu_co_queue_next(&crypto->thread_task_queue);
 
-        ret = bdrv_co_preadv(bs->file, payload_offset + offset + bytes_done,
-                             cur_bytes, &hd_qiov, 0);
-        if (ret < 0) {
-            goto cleanup;
-        }
+    return ret < 0 ? -EIO : 0;
+}
 
-        if (qcrypto_block_decrypt(crypto->block, offset + bytes_done,
-                                  cipher_data, cur_bytes, NULL) < 0) {
-            ret = -EIO;
-            goto cleanup;
-        }
+/*
+ * Bounce buffers are always BLOCK_CRYPTO_MAX_IO_SIZE bytes long, and up to
+ * BLOCK_CRYPTO_MAX_WORKERS of them are kept around between requests.
+ */
+static void *block_crypto_get_bounce_buffer(BlockDriverState *bs)
+{
+    BlockCrypto *crypto = bs->opaque;
 
-        qemu_iovec_from_buf(qiov, bytes_done, cipher_data, cur_bytes);
+    if (crypto->nb_free_buffers) {
+        return crypto->free_buffers[--crypto->nb_free_buffers];
+    }
+    return qemu_try_blockalign(bs->file->bs, BLOCK_CRYPTO_MAX_IO_SIZE);
+}
 
-        bytes -= cur_bytes;
-        bytes_done += cur_bytes;
+static void block_crypto_put_bounce_buffer(BlockDriverState *bs, void *buf)
+{
+    BlockCrypto *crypto = bs->opaque;
+
+    if (crypto->nb_free_buffers < ARRAY_SIZE(crypto->free_buffers)) {
+        crypto->free_buffers[crypto->nb_free_buffers++] = buf;
+    } else {
+        qemu_vfree(buf);
     }
+}
 
- cleanup:
-    qemu_iovec_destroy(&hd_qiov);
-    qemu_vfree(cipher_data);
+static uint64_t block_crypto_task_size(BlockCrypto *crypto, uint64_t bytes)
+{
+    uint64_t sector_size = qcrypto_block_get_sector_size(crypto->block);
+    uint64_t size;
 
-    return ret;
+    size = QEMU_ALIGN_UP(DIV_ROUND_UP(bytes, BLOCK_CRYPTO_MAX_WORKERS),
+                         sector_size);
+    return MIN(MAX(size, BLOCK_CRYPTO_MIN_TASK_SIZE), BLOCK_CRYPTO_MAX_IO_SIZE);
 }
 
+typedef struct BlockCryptoAioTask {
+    AioTask task;
 
-static coroutine_fn int
-block_crypto_co_pwritev(BlockDriverState *bs, uint64_t offset, uint64_t bytes,
-                        QEMUIOVector *qiov, int flags)
+    BlockDriverState *bs;
+    uint64_t offset;
+    uint64_t bytes;
+    QEMUIOVector *qiov;
+    size_t qiov_offset;
+    int flags;
+} BlockCryptoAioTask;
+
+static coroutine_fn int block_crypto_co_preadv_task_entry(AioTask *task)
 {
+    BlockCryptoAioTask *t = container_of(task, BlockCryptoAioTask, task);
+    BlockDriverState *bs = t->bs;
     BlockCrypto *crypto = bs->opaque;
-    uint64_t cur_bytes; /* number of bytes in current iteration */
-    uint64_t bytes_done = 0;
-    uint8_t *cipher_data = NULL;
-    QEMUIOVector hd_qiov;
-    int ret = 0;
-    uint64_t sector_size = qcrypto_block_get_sector_size(crypto->block);
     uint64_t payload_offset = qcrypto_block_get_payload_offset(crypto->block);
+    uint8_t *cipher_data;
+    int ret;
 
-    assert(!(flags & ~BDRV_REQ_FUA));
-    assert(payload_offset < INT64_MAX);
-    assert(QEMU_IS_ALIGNED(offset, sector_size));
-    assert(QEMU_IS_ALIGNED(bytes, sector_size));
+    /*
+     * Bounce buffer because we don't wish to expose cipher text
+     * in qiov which points to guest memory.
+     */
+    cipher_data = block_crypto_get_bounce_buffer(bs);
+    if (cipher_data == NULL) {
+        return -ENOMEM;
+    }
+
+    ret = bdrv_co_pread(bs->file, payload_offset + t->offset, t->bytes,
+                        cipher_data, 0);
+    if (ret < 0) {
+        goto cleanup;
+    }
+
+    ret = block_crypto_co_encdec(bs, t->offset, cipher_data, t->bytes,
+                                 qcrypto_block_decrypt);
+    if (ret < 0) {
+        goto cleanup;
+    }
 
-    qemu_iovec_init(&hd_qiov, qiov->niov);
+    qemu_iovec_from_buf(t->qiov, t->qiov_offset, cipher_data, t->bytes);
 
-    /* Bounce buffer because we're not permitted to touch
+ cleanup:
+    block_crypto_put_bounce_buffer(bs, cipher_data);
+    return ret;
+}
+
+static coroutine_fn int block_crypto_co_pwritev_task_entry(AioTask *task)
+{
+    BlockCryptoAioTask *t = container_of(task, BlockCryptoAioTask, task);
+    BlockDriverState *bs = t->bs;
+    BlockCrypto *crypto = bs->opaque;
+    uint64_t payload_offset = qcrypto_block_get_payload_offset(crypto->block);
+    uint8_t *cipher_data;
+    int ret;
+
+    /*
+     * Bounce buffer because we're not permitted to touch
      * contents of qiov - it points to guest memory.
      */
-    cipher_data =
-        qemu_try_blockalign(bs->file->bs, MIN(BLOCK_CRYPTO_MAX_IO_SIZE,
-                                              qiov->size));
+    cipher_data = block_crypto_get_bounce_buffer(bs);
     if (cipher_data == NULL) {
-        ret = -ENOMEM;
+        return -ENOMEM;
+    }
+
+    qemu_iovec_to_buf(t->qiov, t->qiov_offset, cipher_data, t->bytes);
+
+    ret = block_crypto_co_encdec(bs, t->offset, cipher_data, t->bytes,
+                                 qcrypto_block_encrypt);
+    if (ret < 0) {
         goto cleanup;
     }
 
-    while (bytes) {
-        cur_bytes = MIN(bytes, BLOCK_CRYPTO_MAX_IO_SIZE);
+    ret = bdrv_co_pwrite(bs->file, payload_offset + t->offset, t->bytes,
+                         cipher_data, t->flags);
+
+ cleanup:
+    block_crypto_put_bounce_buffer(bs, cipher_data);
+    return ret;
+}
 
-        qemu_iovec_to_buf(qiov, bytes_done, cipher_data, cur_bytes);
+static coroutine_fn int block_crypto_add_task(BlockDriverState *bs,
+                                              AioTaskPool *pool,
+                                              AioTaskFunc func,
+                                              uint64_t offset,
+                                              uint64_t bytes,
+                                              QEMUIOVector *qiov,
+                                              size_t qiov_offset,
+                                              int flags)
+{
+    BlockCryptoAioTask local_task;
+    BlockCryptoAioTask *task = pool ? g_new(BlockCryptoAioTask, 1)
+                                    : &local_task;
+
+    *task = (BlockCryptoAioTask) {
+        .task.func = func,
+        .bs = bs,
+        .offset = offset,
+        .bytes = bytes,
+        .qiov = qiov,
+        .qiov_offset = qiov_offset,
+        .flags = flags,
+    };
 
-        if (qcrypto_block_encrypt(crypto->block, offset + bytes_done,
-                                  cipher_data, cur_bytes, NULL) < 0) {
-            ret = -EIO;
-            goto cleanup;
-        }
+    if (!pool) {
+        return func(&task->task);
+    }
+
+    aio_task_pool_start_task(pool, &task->task);
+
+    return 0;
+}
+
+/*
+ * Every sector is encrypted with its own IV, which only depends on the
+ * sector number, so the tasks are independent of each other.
+ */
+static coroutine_fn int
+block_crypto_co_rw(BlockDriverState *bs, uint64_t offset, uint64_t bytes,
+                   QEMUIOVector *qiov, int flags, AioTaskFunc func)
+{
+    BlockCrypto *crypto = bs->opaque;
+    uint64_t task_size = block_crypto_task_size(crypto, bytes);
+    uint64_t bytes_done = 0;
+    AioTaskPool *aio = NULL;
+    int ret = 0;
 
-        qemu_iovec_reset(&hd_qiov);
-        qemu_iovec_add(&hd_qiov, cipher_data, cur_bytes);
+    while (bytes && aio_task_pool_status(aio) == 0) {
+        uint64_t cur_bytes = MIN(bytes, task_size);
 
-        ret = bdrv_co_pwritev(bs->file, payload_offset + offset + bytes_done,
-                              cur_bytes, &hd_qiov, flags);
+        if (!aio && cur_bytes != bytes) {
+            aio = aio_task_pool_new(BLOCK_CRYPTO_MAX_WORKERS);
+        }
+        ret = block_crypto_add_task(bs, aio, func, offset + bytes_done,
+                                    cur_bytes, qiov, bytes_done, flags);
         if (ret < 0) {
-            goto cleanup;
+            break;
         }
 
         bytes -= cur_bytes;
         bytes_done += cur_bytes;
     }
 
- cleanup:
-    qemu_iovec_destroy(&hd_qiov);
-    qemu_vfree(cipher_data);
+    if (aio) {
+        aio_task_pool_wait_all(aio);
+        if (ret == 0) {
+            ret = aio_task_pool_status(aio);
+        }
+        aio_task_pool_free(aio);
+    }
 
     return ret;
 }
 
+static coroutine_fn int
+block_crypto_co_preadv(BlockDriverState *bs, uint64_t offset, uint64_t bytes,
+                       QEMUIOVector *qiov, int flags)
+{
+    BlockCrypto *crypto = bs->opaque;
+    uint64_t sector_size = qcrypto_block_get_sector_size(crypto->block);
+    uint64_t payload_offset = qcrypto_block_get_payload_offset(crypto->block);
+
+    assert(!flags);
+    assert(payload_offset < INT64_MAX);
+    assert(QEMU_IS_ALIGNED(offset, sector_size));
+    assert(QEMU_IS_ALIGNED(bytes, sector_size));
+
+    return block_crypto_co_rw(bs, offset, bytes, qiov, 0,
+                              block_crypto_co_preadv_task_entry);
+}
+
+
+static coroutine_fn int
+block_crypto_co_pwritev(BlockDriverState *bs, uint64_t offset, uint64_t bytes,
+                        QEMUIOVector *qiov, int flags)
+{
+    BlockCrypto *crypto = bs->opaque;
+    uint64_t sector_size = qcrypto_block_get_sector_size(crypto->block);
+    uint64_t payload_offset = qcrypto_block_get_payload_offset(crypto->block);
+
+    assert(!(flags & ~BDRV_REQ_FUA));
+    assert(payload_offset < INT64_MAX);
+    assert(QEMU_IS_ALIGNED(offset, sector_size));
+    assert(QEMU_IS_ALIGNED(bytes, sector_size));
+
+    return block_crypto_co_rw(bs, offset, bytes, qiov, flags,
+                              block_crypto_co_pwritev_task_entry);
+}
+
 static void block_crypto_refresh_limits(BlockDriverState *bs, Error **errp)
 {
     BlockCrypto *crypto = bs->opaque;
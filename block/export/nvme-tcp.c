@@ -0,0 +1,1355 @@
+/*
+ * NVMe/TCP block export
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "block/block.h"
+#include "block/nvme.h"
+#include "io/channel-socket.h"
+#include "io/net-listener.h"
+#include "qapi/error.h"
+#include "qemu/bitops.h"
+#include "qemu/cutils.h"
+#include "qemu/error-report.h"
+#include "qemu/uuid.h"
+#include "sysemu/block-backend.h"
+#include "util/block-helpers.h"
+#include "nvme-tcp.h"
+
+/*
+ * Theory of operation:
+ *
+ * The export is a single NVM subsystem with one namespace, the exported
+ * node, and any number of dynamic controllers.  Each TCP connection is one
+ * queue pair: the host creates a controller with a Fabrics Connect command
+ * on a new connection (the admin queue) and then opens one more connection
+ * per I/O queue, naming that controller in their own Connect.
+ *
+ * A connection is served by the nvme_tcp_conn_trip() coroutine, which reads
+ * the PDUs and starts one coroutine per command.  Data that the host sends
+ * in the command capsule, or in H2C data PDUs after a ready-to-transfer
+ * PDU, is read straight into the buffer of the request, and data for the
+ * host is sent straight from it.  Everything runs in the AioContext of the
+ * exported node; the queues spread the requests over several connections,
+ * not over several threads.
+ *
+ * Header and data digests are not supported.
+ */
+
+#define NVME_TCP_SUBNQN_PREFIX "nqn.2019-08.org.qemu:"
+
+enum {
+    /* Entries per queue, advertised in CAP.MQES */
+    NVME_TCP_QUEUE_SIZE = 128,
+
+    /* Largest transfer; MDTS is in units of the minimum page size */
+    NVME_TCP_MDTS = 8,
+    NVME_TCP_MAX_XFER = 4096 << NVME_TCP_MDTS,
+
+    /* Largest data accepted in a command capsule */
+    NVME_TCP_INLINE_MAX = 8192,
+
+    NVME_TCP_NUM_QUEUES_DEFAULT = 4,
+};
+
+/* PDU types */
+enum {
+    NVME_TCP_PDU_ICREQ          = 0x00,
+    NVME_TCP_PDU_ICRESP         = 0x01,
+    NVME_TCP_PDU_H2C_TERM_REQ   = 0x02,
+    NVME_TCP_PDU_C2H_TERM_REQ   = 0x03,
+    NVME_TCP_PDU_CAPSULE_CMD    = 0x04,
+    NVME_TCP_PDU_CAPSULE_RESP   = 0x05,
+    NVME_TCP_PDU_H2C_DATA       = 0x06,
+    NVME_TCP_PDU_C2H_DATA       = 0x07,
+    NVME_TCP_PDU_R2T            = 0x09,
+};
+
+/* PDU flags */
+enum {
+    NVME_TCP_F_HDGST            = 1 << 0,
+    NVME_TCP_F_DDGST            = 1 << 1,
+    NVME_TCP_F_DATA_LAST        = 1 << 2,
+    NVME_TCP_F_DATA_SUCCESS     = 1 << 3,
+};
+
+typedef struct QEMU_PACKED NvmeTcpHdr {
+    uint8_t     type;
+    uint8_t     flags;
+    uint8_t     hlen;
+    uint8_t     pdo;
+    uint32_t    plen;
+} NvmeTcpHdr;
+
+typedef struct QEMU_PACKED NvmeTcpICReq {
+    NvmeTcpHdr  hdr;
+    uint16_t    pfv;
+    uint8_t     hpda;
+    uint8_t     digest;
+    uint32_t    maxr2t;
+    uint8_t     rsvd[112];
+} NvmeTcpICReq;
+
+typedef struct QEMU_PACKED NvmeTcpICResp {
+    NvmeTcpHdr  hdr;
+    uint16_t    pfv;
+    uint8_t     cpda;
+    uint8_t     digest;
+    uint32_t    maxh2cdata;
+    uint8_t     rsvd[112];
+} NvmeTcpICResp;
+
+typedef struct QEMU_PACKED NvmeTcpCmdPdu {
+    NvmeTcpHdr  hdr;
+    NvmeCmd     cmd;
+} NvmeTcpCmdPdu;
+
+typedef struct QEMU_PACKED NvmeTcpRspPdu {
+    NvmeTcpHdr  hdr;
+    NvmeCqe     cqe;
+} NvmeTcpRspPdu;
+
+/* H2C and C2H data PDUs */
+typedef struct QEMU_PACKED NvmeTcpDataPdu {
+    NvmeTcpHdr  hdr;
+    uint16_t    cccid;
+    uint16_t    ttag;
+    uint32_t    datao;
+    uint32_t    datal;
+    uint8_t     rsvd[4];
+} NvmeTcpDataPdu;
+
+typedef struct QEMU_PACKED NvmeTcpR2TPdu {
+    NvmeTcpHdr  hdr;
+    uint16_t    cccid;
+    uint16_t    ttag;
+    uint32_t    r2to;
+    uint32_t    r2tl;
+    uint8_t     rsvd[4];
+} NvmeTcpR2TPdu;
+
+/* Fabrics commands */
+#define NVME_FABRICS_CMD            0x7f
+#define NVME_ADM_CMD_KEEP_ALIVE     0x18
+
+enum {
+    NVMF_FCTYPE_PROP_SET        = 0x00,
+    NVMF_FCTYPE_CONNECT         = 0x01,
+    NVMF_FCTYPE_PROP_GET        = 0x04,
+};
+
+/* Command specific status of Connect */
+enum {
+    NVMF_CONNECT_INCOMPAT_FMT   = 0x0180,
+    NVMF_CONNECT_INVALID_PARAM  = 0x0182,
+};
+
+/* Connect attributes */
+#define NVMF_CATTR_DISABLE_SQFLOW   (1 << 2)
+
+typedef struct QEMU_PACKED NvmfConnectCmd {
+    uint8_t     opcode;
+    uint8_t     rsvd1;
+    uint16_t    cid;
+    uint8_t     fctype;
+    uint8_t     rsvd2[19];
+    NvmeSglDescriptor sgl;
+    uint16_t    recfmt;
+    uint16_t    qid;
+    uint16_t    sqsize;
+    uint8_t     cattr;
+    uint8_t     rsvd3;
+    uint32_t    kato;
+    uint8_t     rsvd4[12];
+} NvmfConnectCmd;
+
+typedef struct QEMU_PACKED NvmfConnectData {
+    uint8_t     hostid[16];
+    uint16_t    cntlid;
+    uint8_t     rsvd18[238];
+    char        subnqn[256];
+    char        hostnqn[256];
+    uint8_t     rsvd768[256];
+} NvmfConnectData;
+
+typedef struct QEMU_PACKED NvmfPropCmd {
+    uint8_t     opcode;
+    uint8_t     rsvd1;
+    uint16_t    cid;
+    uint8_t     fctype;
+    uint8_t     rsvd2[35];
+    uint8_t     attrib;
+    uint8_t     rsvd3[3];
+    uint32_t    offset;
+    uint64_t    value;
+    uint8_t     rsvd4[8];
+} NvmfPropCmd;
+
+/* Controller properties, at the offsets of the PCIe registers */
+enum {
+    NVMF_PROP_CAP   = 0x00,
+    NVMF_PROP_VS    = 0x08,
+    NVMF_PROP_CC    = 0x14,
+    NVMF_PROP_CSTS  = 0x1c,
+};
+
+#define NVME_TCP_CC_EN          (1 << 0)
+#define NVME_TCP_CC_SHN_MASK    (3 << 14)
+#define NVME_TCP_CSTS_RDY       (1 << 0)
+#define NVME_TCP_CSTS_SHST_DONE (2 << 2)
+
+/* Data transfer direction, from the low bits of the opcode */
+enum {
+    NVME_XFER_NONE          = 0,
+    NVME_XFER_TO_CTRL       = 1,
+    NVME_XFER_FROM_CTRL     = 2,
+};
+
+/* SGL descriptor types used by NVMe/TCP */
+#define NVME_TCP_SGL_INLINE     0x01 /* data block, offset in the capsule */
+#define NVME_TCP_SGL_TRANSPORT  0x5a /* transport data block */
+
+typedef struct NvmeTcpExport NvmeTcpExport;
+
+typedef struct NvmeTcpCtrl {
+    NvmeTcpExport *exp;
+    int refcount;
+    uint16_t cntlid;
+    uint32_t cc;
+    uint32_t csts;
+    uint16_t nr_io_queues;
+    QTAILQ_ENTRY(NvmeTcpCtrl) next;
+} NvmeTcpCtrl;
+
+typedef struct NvmeTcpReq NvmeTcpReq;
+
+typedef struct NvmeTcpConn {
+    NvmeTcpExport *exp;
+    int refcount;
+    bool closing;
+    QIOChannelSocket *sioc;
+    QIOChannel *ioc;
+    Coroutine *recv_co;
+    Coroutine *send_co;
+    CoMutex send_lock;
+
+    /*
+     * Set while recv_co or send_co is in a read or write on the channel;
+     * outside of the coroutines this means that they yielded there, and
+     * not, say, on send_lock.
+     */
+    bool reading;
+    bool writing;
+
+    /* Set by Connect */
+    NvmeTcpCtrl *ctrl;
+    uint16_t qid;
+    uint16_t sqsize;
+    uint16_t sqhd;
+    bool sqflow_disabled;
+
+    /* Commands received but not completed, at most sqsize + 1 */
+    unsigned int nr_reqs;
+
+    /* Requests waiting for their H2C data, and the tags they use */
+    QTAILQ_HEAD(, NvmeTcpReq) r2t_reqs;
+    DECLARE_BITMAP(ttags, NVME_TCP_QUEUE_SIZE);
+
+    QTAILQ_ENTRY(NvmeTcpConn) next;
+} NvmeTcpConn;
+
+struct NvmeTcpReq {
+    NvmeTcpConn *conn;
+    NvmeCmd cmd;
+    NvmeCqe cqe;
+    int xfer;
+    void *buf;
+    uint32_t len;
+    uint32_t received;
+    uint16_t ttag;
+    bool outstanding;   /* counted in conn->nr_reqs */
+    QTAILQ_ENTRY(NvmeTcpReq) next;
+};
+
+struct NvmeTcpExport {
+    BlockExport export;
+    QIONetListener *listener;
+    char *subnqn;
+    uint32_t blk_size;
+    uint16_t num_queues;
+    QemuUUID uuid;
+    uint16_t next_cntlid;
+    QTAILQ_HEAD(, NvmeTcpCtrl) ctrls;
+    QTAILQ_HEAD(, NvmeTcpConn) conns;
+};
+
+static void nvme_tcp_ctrl_put(NvmeTcpCtrl *ctrl)
+{
+    if (--ctrl->refcount == 0) {
+        QTAILQ_REMOVE(&ctrl->exp->ctrls, ctrl, next);
+        g_free(ctrl);
+    }
+}
+
+static void nvme_tcp_conn_get(NvmeTcpConn *conn)
+{
+    conn->refcount++;
+}
+
+static void nvme_tcp_conn_put(NvmeTcpConn *conn)
+{
+    if (--conn->refcount == 0) {
+        NvmeTcpExport *exp = conn->exp;
+
+        assert(conn->closing);
+        assert(QTAILQ_EMPTY(&conn->r2t_reqs));
+
+        qio_channel_detach_aio_context(conn->ioc);
+        object_unref(OBJECT(conn->sioc));
+        object_unref(OBJECT(conn->ioc));
+        if (conn->ctrl) {
+            nvme_tcp_ctrl_put(conn->ctrl);
+        }
+        QTAILQ_REMOVE(&exp->conns, conn, next);
+        g_free(conn);
+        blk_exp_unref(&exp->export);
+    }
+}
+
+static void nvme_tcp_conn_close(NvmeTcpConn *conn)
+{
+    if (conn->closing) {
+        return;
+    }
+
+    /* Requests in flight fail to send their response and drop their ref */
+    conn->closing = true;
+    qio_channel_shutdown(conn->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+}
+
+static NvmeTcpReq *nvme_tcp_req_new(NvmeTcpConn *conn, const NvmeCmd *cmd)
+{
+    NvmeTcpReq *req = g_new0(NvmeTcpReq, 1);
+
+    nvme_tcp_conn_get(conn);
+    conn->nr_reqs++;
+    req->outstanding = true;
+    req->conn = conn;
+    req->cmd = *cmd;
+    req->cqe.cid = cmd->cid;
+    return req;
+}
+
+/*
+ * The host may reuse the queue slot of @req as soon as it sees the
+ * completion, so this is called before the completion is sent.
+ */
+static void nvme_tcp_req_retire(NvmeTcpReq *req)
+{
+    if (req->outstanding) {
+        req->outstanding = false;
+        req->conn->nr_reqs--;
+    }
+}
+
+static void nvme_tcp_req_free(NvmeTcpReq *req)
+{
+    NvmeTcpConn *conn = req->conn;
+
+    nvme_tcp_req_retire(req);
+    qemu_vfree(req->buf);
+    g_free(req);
+    nvme_tcp_conn_put(conn);
+}
+
+static int coroutine_fn nvme_tcp_send_iov(NvmeTcpConn *conn,
+                                          struct iovec *iov, unsigned niov)
+{
+    int ret;
+
+    qemu_co_mutex_lock(&conn->send_lock);
+    conn->send_co = qemu_coroutine_self();
+
+    conn->writing = true;
+    ret = qio_channel_writev_all(conn->ioc, iov, niov, NULL) < 0 ? -EIO : 0;
+    conn->writing = false;
+
+    conn->send_co = NULL;
+    qemu_co_mutex_unlock(&conn->send_lock);
+
+    return ret;
+}
+
+static void nvme_tcp_set_hdr(NvmeTcpHdr *hdr, uint8_t type, uint8_t flags,
+                             size_t hlen, size_t plen)
+{
+    hdr->type = type;
+    hdr->flags = flags;
+    hdr->hlen = hlen;
+    hdr->pdo = plen > hlen ? hlen : 0;
+    hdr->plen = cpu_to_le32(plen);
+}
+
+/*
+ * Sends the data of @req if it has data for the host, and its completion.
+ * When SQ flow control is disabled the completion of a successful command
+ * is folded into the last data PDU.
+ */
+static int coroutine_fn nvme_tcp_complete(NvmeTcpReq *req, uint16_t status)
+{
+    NvmeTcpConn *conn = req->conn;
+    NvmeTcpDataPdu data = { 0 };
+    NvmeTcpRspPdu rsp = { 0 };
+    struct iovec iov[3];
+    unsigned niov = 0;
+    bool send_rsp = true;
+
+    nvme_tcp_req_retire(req);
+
+    if (req->xfer == NVME_XFER_FROM_CTRL && req->len &&
+        status == NVME_SUCCESS) {
+        uint8_t flags = NVME_TCP_F_DATA_LAST;
+
+        if (conn->sqflow_disabled && !req->cqe.result && !req->cqe.rsvd) {
+            flags |= NVME_TCP_F_DATA_SUCCESS;
+            send_rsp = false;
+        }
+        nvme_tcp_set_hdr(&data.hdr, NVME_TCP_PDU_C2H_DATA, flags,
+                         sizeof(data), sizeof(data) + req->len);
+        data.cccid = req->cmd.cid;
+        data.datal = cpu_to_le32(req->len);
+        iov[niov++] = (struct iovec) { &data, sizeof(data) };
+        iov[niov++] = (struct iovec) { req->buf, req->len };
+    }
+
+    if (send_rsp) {
+        nvme_tcp_set_hdr(&rsp.hdr, NVME_TCP_PDU_CAPSULE_RESP, 0,
+                         sizeof(rsp), sizeof(rsp));
+        rsp.cqe = req->cqe;
+        rsp.cqe.sq_id = cpu_to_le16(conn->qid);
+        rsp.cqe.sq_head = cpu_to_le16(conn->sqhd);
+        rsp.cqe.status = cpu_to_le16(status << 1);
+        iov[niov++] = (struct iovec) { &rsp, sizeof(rsp) };
+    }
+
+    return nvme_tcp_send_iov(conn, iov, niov);
+}
+
+/* Copies @len bytes of @data for the host, up to the length of the SGL */
+static uint16_t nvme_tcp_copy_to_host(NvmeTcpReq *req, const void *data,
+                                      size_t len)
+{
+    if (req->xfer != NVME_XFER_FROM_CTRL) {
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+    req->len = MIN(req->len, len);
+    req->buf = qemu_memalign(8, MAX(req->len, 1));
+    memcpy(req->buf, data, req->len);
+    return NVME_SUCCESS;
+}
+
+static uint64_t nvme_tcp_cap(void)
+{
+    return (NVME_TCP_QUEUE_SIZE - 1) |  /* MQES */
+           1ull << 16 |                 /* CQR */
+           15ull << 24 |                /* TO, 7.5 seconds */
+           1ull << 37;                  /* CSS, NVM command set */
+}
+
+static uint16_t nvme_tcp_connect(NvmeTcpReq *req)
+{
+    NvmeTcpConn *conn = req->conn;
+    NvmeTcpExport *exp = conn->exp;
+    NvmfConnectCmd *c = (NvmfConnectCmd *)&req->cmd;
+    NvmfConnectData *data = req->buf;
+    uint16_t qid = le16_to_cpu(c->qid);
+    uint16_t sqsize = le16_to_cpu(c->sqsize);
+    NvmeTcpCtrl *ctrl;
+
+    if (conn->ctrl) {
+        return NVME_CMD_SEQ_ERROR | NVME_DNR;
+    }
+    if (req->len != sizeof(*data)) {
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+    if (le16_to_cpu(c->recfmt) != 0) {
+        return NVMF_CONNECT_INCOMPAT_FMT | NVME_DNR;
+    }
+    if (strncmp(data->subnqn, exp->subnqn, sizeof(data->subnqn)) ||
+        sqsize == 0 || sqsize >= NVME_TCP_QUEUE_SIZE) {
+        return NVMF_CONNECT_INVALID_PARAM | NVME_DNR;
+    }
+
+    if (qid == 0) {
+        if (le16_to_cpu(data->cntlid) != 0xffff) {
+            return NVMF_CONNECT_INVALID_PARAM | NVME_DNR;
+        }
+        ctrl = g_new0(NvmeTcpCtrl, 1);
+        ctrl->exp = exp;
+        ctrl->cntlid = exp->next_cntlid;
+        exp->next_cntlid = exp->next_cntlid % 0xffef + 1;
+        QTAILQ_INSERT_TAIL(&exp->ctrls, ctrl, next);
+    } else {
+        QTAILQ_FOREACH(ctrl, &exp->ctrls, next) {
+            if (ctrl->cntlid == le16_to_cpu(data->cntlid)) {
+                break;
+            }
+        }
+        if (!ctrl || !(ctrl->csts & NVME_TCP_CSTS_RDY) ||
+            qid > ctrl->nr_io_queues) {
+            return NVMF_CONNECT_INVALID_PARAM | NVME_DNR;
+        }
+    }
+
+    ctrl->refcount++;
+    conn->ctrl = ctrl;
+    conn->qid = qid;
+    conn->sqsize = sqsize;
+    conn->sqflow_disabled = c->cattr & NVMF_CATTR_DISABLE_SQFLOW;
+
+    req->cqe.result = cpu_to_le32(ctrl->cntlid);
+    return NVME_SUCCESS;
+}
+
+static uint16_t coroutine_fn nvme_tcp_prop_set(NvmeTcpReq *req)
+{
+    NvmeTcpCtrl *ctrl = req->conn->ctrl;
+    NvmfPropCmd *c = (NvmfPropCmd *)&req->cmd;
+    uint32_t cc = le64_to_cpu(c->value);
+
+    if (le32_to_cpu(c->offset) != NVMF_PROP_CC) {
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    if (!(cc & NVME_TCP_CC_EN)) {
+        ctrl->csts = 0;
+    } else if (!(ctrl->cc & NVME_TCP_CC_EN)) {
+        ctrl->csts = NVME_TCP_CSTS_RDY;
+    }
+    if (cc & NVME_TCP_CC_SHN_MASK) {
+        blk_co_flush(ctrl->exp->export.blk);
+        ctrl->csts |= NVME_TCP_CSTS_SHST_DONE;
+    }
+    ctrl->cc = cc;
+    return NVME_SUCCESS;
+}
+
+static uint16_t nvme_tcp_prop_get(NvmeTcpReq *req)
+{
+    NvmeTcpCtrl *ctrl = req->conn->ctrl;
+    NvmfPropCmd *c = (NvmfPropCmd *)&req->cmd;
+    uint64_t value;
+
+    switch (le32_to_cpu(c->offset)) {
+    case NVMF_PROP_CAP:
+        value = nvme_tcp_cap();
+        break;
+    case NVMF_PROP_VS:
+        value = 0x10300;
+        break;
+    case NVMF_PROP_CC:
+        value = ctrl->cc;
+        break;
+    case NVMF_PROP_CSTS:
+        value = ctrl->csts;
+        break;
+    default:
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    /* Bit 0 of the attributes selects an 8-byte property */
+    if (!(c->attrib & 1)) {
+        value = (uint32_t)value;
+    }
+    req->cqe.result = cpu_to_le32(value);
+    req->cqe.rsvd = cpu_to_le32(value >> 32);
+    return NVME_SUCCESS;
+}
+
+static uint16_t coroutine_fn nvme_tcp_fabrics_cmd(NvmeTcpReq *req)
+{
+    uint8_t fctype = ((NvmfPropCmd *)&req->cmd)->fctype;
+
+    if (fctype == NVMF_FCTYPE_CONNECT) {
+        return nvme_tcp_connect(req);
+    }
+    if (!req->conn->ctrl || req->conn->qid != 0) {
+        return NVME_CMD_SEQ_ERROR | NVME_DNR;
+    }
+
+    switch (fctype) {
+    case NVMF_FCTYPE_PROP_SET:
+        return nvme_tcp_prop_set(req);
+    case NVMF_FCTYPE_PROP_GET:
+        return nvme_tcp_prop_get(req);
+    default:
+        return NVME_INVALID_OPCODE | NVME_DNR;
+    }
+}
+
+static uint16_t nvme_tcp_identify_ctrl(NvmeTcpReq *req)
+{
+    NvmeTcpConn *conn = req->conn;
+    NvmeTcpExport *exp = conn->exp;
+    g_autofree NvmeIdCtrl *id = g_new0(NvmeIdCtrl, 1);
+    uint8_t *fabrics = id->rsvd1024 + 768;
+
+    id->vid = cpu_to_le16(0x1b36);            /* Red Hat */
+    id->ssvid = cpu_to_le16(0x1af4);
+    strpadcpy((char *)id->sn, sizeof(id->sn), exp->export.id, ' ');
+    strpadcpy((char *)id->mn, sizeof(id->mn), "QEMU NVMe/TCP Ctrl", ' ');
+    strpadcpy((char *)id->fr, sizeof(id->fr), "1.0", ' ');
+    id->mdts = NVME_TCP_MDTS;
+    id->cntlid = cpu_to_le16(conn->ctrl->cntlid);
+    id->ver = cpu_to_le32(0x10300);
+    id->rsvd100[11] = 1;                            /* CNTRLTYPE, I/O */
+    id->aerl = 3;
+    id->kas = cpu_to_le16(1);
+    id->sqes = (0x6 << 4) | 0x6;
+    id->cqes = (0x4 << 4) | 0x4;
+    id->maxcmd = cpu_to_le16(NVME_TCP_QUEUE_SIZE);
+    id->nn = cpu_to_le32(1);
+    if (!blk_is_read_only(exp->export.blk)) {
+        id->oncs = cpu_to_le16(NVME_ONCS_DSM | NVME_ONCS_WRITE_ZEROES);
+    }
+    id->vwc = 1;
+    id->sgls = cpu_to_le32(NVME_CTRL_SGLS_SUPPORT_NO_ALIGN |
+                           NVME_CTRL_SGLS_ADDR_OFFSET);
+    pstrcpy((char *)id->subnqn, sizeof(id->subnqn), exp->subnqn);
+
+    /* IOCCSZ, IORCSZ and MSDBD; ICDOFF and FCATT are zero */
+    stl_le_p(fabrics, (sizeof(NvmeCmd) + NVME_TCP_INLINE_MAX) / 16);
+    stl_le_p(fabrics + 4, sizeof(NvmeCqe) / 16);
+    fabrics[11] = 1;
+
+    return nvme_tcp_copy_to_host(req, id, sizeof(*id));
+}
+
+static uint16_t nvme_tcp_identify_ns(NvmeTcpReq *req)
+{
+    NvmeTcpExport *exp = req->conn->exp;
+    g_autofree NvmeIdNs *id = g_new0(NvmeIdNs, 1);
+    int64_t nsze = blk_getlength(exp->export.blk) / exp->blk_size;
+
+    if (le32_to_cpu(req->cmd.nsid) != 1) {
+        return NVME_INVALID_NSID | NVME_DNR;
+    }
+
+    id->nsze = id->ncap = id->nuse = cpu_to_le64(MAX(nsze, 0));
+    id->nsfeat = 1;                         /* thin provisioning */
+    id->lbaf[0].ds = ctz32(exp->blk_size);
+    memcpy(id->nguid, exp->uuid.data, sizeof(id->nguid));
+
+    return nvme_tcp_copy_to_host(req, id, sizeof(*id));
+}
+
+static uint16_t nvme_tcp_identify(NvmeTcpReq *req)
+{
+    uint8_t list[NVME_IDENTIFY_DATA_SIZE] = { 0 };
+    NvmeIdNsDescr *descr = (NvmeIdNsDescr *)list;
+
+    switch (le32_to_cpu(req->cmd.cdw10) & 0xff) {
+    case NVME_ID_CNS_CTRL:
+        return nvme_tcp_identify_ctrl(req);
+    case NVME_ID_CNS_NS:
+        return nvme_tcp_identify_ns(req);
+    case NVME_ID_CNS_NS_ACTIVE_LIST:
+        if (le32_to_cpu(req->cmd.nsid) < 1) {
+            stl_le_p(list, 1);
+        }
+        return nvme_tcp_copy_to_host(req, list, sizeof(list));
+    case NVME_ID_CNS_NS_DESCR_LIST:
+        if (le32_to_cpu(req->cmd.nsid) != 1) {
+            return NVME_INVALID_NSID | NVME_DNR;
+        }
+        descr->nidt = NVME_NIDT_UUID;
+        descr->nidl = NVME_NIDT_UUID_LEN;
+        memcpy(descr + 1, req->conn->exp->uuid.data, NVME_NIDT_UUID_LEN);
+        return nvme_tcp_copy_to_host(req, list, sizeof(list));
+    default:
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+}
+
+static uint16_t nvme_tcp_get_log_page(NvmeTcpReq *req)
+{
+    uint8_t log[sizeof(NvmeSmartLog)] = { 0 };
+
+    switch (le32_to_cpu(req->cmd.cdw10) & 0xff) {
+    case NVME_LOG_ERROR_INFO:
+    case NVME_LOG_SMART_INFO:
+    case NVME_LOG_FW_SLOT_INFO:
+        /* Nothing to report */
+        return nvme_tcp_copy_to_host(req, log, sizeof(log));
+    default:
+        return NVME_INVALID_LOG_ID | NVME_DNR;
+    }
+}
+
+static uint16_t nvme_tcp_features(NvmeTcpReq *req, bool set)
+{
+    NvmeTcpConn *conn = req->conn;
+    NvmeTcpCtrl *ctrl = conn->ctrl;
+    BlockBackend *blk = conn->exp->export.blk;
+    uint32_t dw11 = le32_to_cpu(req->cmd.cdw11);
+    uint32_t result = 0;
+
+    switch (NVME_GETSETFEAT_FID(le32_to_cpu(req->cmd.cdw10))) {
+    case NVME_NUMBER_OF_QUEUES:
+        if (set) {
+            uint32_t nr = MIN(extract32(dw11, 0, 16), extract32(dw11, 16, 16));
+
+            if (nr == 0xffff) {
+                return NVME_INVALID_FIELD | NVME_DNR;
+            }
+            ctrl->nr_io_queues = MIN(nr + 1, conn->exp->num_queues);
+        }
+        result = ctrl->nr_io_queues ? ctrl->nr_io_queues - 1 : 0;
+        result |= result << 16;
+        break;
+    case NVME_VOLATILE_WRITE_CACHE:
+        if (set) {
+            blk_set_enable_write_cache(blk, dw11 & 1);
+        }
+        result = blk_enable_write_cache(blk);
+        break;
+    case NVME_ARBITRATION:
+    case NVME_POWER_MANAGEMENT:
+    case NVME_ERROR_RECOVERY:
+    case NVME_ASYNCHRONOUS_EVENT_CONF:
+    case 0x0f: /* Keep Alive Timer */
+        break;
+    default:
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    req->cqe.result = cpu_to_le32(result);
+    return NVME_SUCCESS;
+}
+
+static uint16_t nvme_tcp_admin_cmd(NvmeTcpReq *req)
+{
+    switch (req->cmd.opcode) {
+    case NVME_ADM_CMD_IDENTIFY:
+        return nvme_tcp_identify(req);
+    case NVME_ADM_CMD_GET_LOG_PAGE:
+        return nvme_tcp_get_log_page(req);
+    case NVME_ADM_CMD_SET_FEATURES:
+        return nvme_tcp_features(req, true);
+    case NVME_ADM_CMD_GET_FEATURES:
+        return nvme_tcp_features(req, false);
+    case NVME_ADM_CMD_ASYNC_EV_REQ:
+        /* There are no events; the host aborts the request on reset */
+        return NVME_NO_COMPLETE;
+    case NVME_ADM_CMD_ABORT:
+        /* Bit 0 set: the command was not aborted */
+        req->cqe.result = cpu_to_le32(1);
+        return NVME_SUCCESS;
+    case NVME_ADM_CMD_KEEP_ALIVE:
+        return NVME_SUCCESS;
+    default:
+        return NVME_INVALID_OPCODE | NVME_DNR;
+    }
+}
+
+/* Checks an LBA range and converts it to bytes */
+static uint16_t nvme_tcp_check_range(NvmeTcpExport *exp, uint64_t slba,
+                                     uint32_t nlb, int64_t *offset,
+                                     int64_t *bytes)
+{
+    int64_t len = blk_getlength(exp->export.blk);
+    uint64_t nsze = len < 0 ? 0 : len / exp->blk_size;
+
+    if (slba >= nsze || nlb > nsze - slba) {
+        return NVME_LBA_RANGE | NVME_DNR;
+    }
+    *offset = slba * exp->blk_size;
+    *bytes = (int64_t)nlb * exp->blk_size;
+    return NVME_SUCCESS;
+}
+
+static uint16_t coroutine_fn nvme_tcp_rw(NvmeTcpReq *req, bool is_write)
+{
+    NvmeTcpExport *exp = req->conn->exp;
+    NvmeRwCmd *rw = (NvmeRwCmd *)&req->cmd;
+    uint16_t control = le16_to_cpu(rw->control);
+    int64_t offset, bytes;
+    uint16_t status;
+    int ret;
+
+    status = nvme_tcp_check_range(exp, le64_to_cpu(rw->slba),
+                                  le16_to_cpu(rw->nlb) + 1, &offset, &bytes);
+    if (status) {
+        return status;
+    }
+    if (bytes != req->len) {
+        return NVME_DATA_SGL_LEN_INVALID | NVME_DNR;
+    }
+
+    if (is_write) {
+        if (blk_is_read_only(exp->export.blk)) {
+            return NVME_WRITE_TO_RO | NVME_DNR;
+        }
+        ret = blk_co_pwrite(exp->export.blk, offset, bytes, req->buf,
+                            control & NVME_RW_FUA ? BDRV_REQ_FUA : 0);
+        return ret < 0 ? NVME_WRITE_FAULT : NVME_SUCCESS;
+    }
+
+    req->buf = blk_blockalign(exp->export.blk, bytes);
+    ret = blk_co_pread(exp->export.blk, offset, bytes, req->buf, 0);
+    return ret < 0 ? NVME_UNRECOVERED_READ : NVME_SUCCESS;
+}
+
+static uint16_t coroutine_fn nvme_tcp_write_zeroes(NvmeTcpReq *req)
+{
+    NvmeTcpExport *exp = req->conn->exp;
+    NvmeRwCmd *rw = (NvmeRwCmd *)&req->cmd;
+    BdrvRequestFlags flags = 0;
+    int64_t offset, bytes;
+    uint16_t status;
+
+    status = nvme_tcp_check_range(exp, le64_to_cpu(rw->slba),
+                                  le16_to_cpu(rw->nlb) + 1, &offset, &bytes);
+    if (status) {
+        return status;
+    }
+    if (blk_is_read_only(exp->export.blk)) {
+        return NVME_WRITE_TO_RO | NVME_DNR;
+    }
+
+    /* Deallocate */
+    if (le16_to_cpu(rw->control) & (1 << 9)) {
+        flags |= BDRV_REQ_MAY_UNMAP;
+    }
+    if (blk_co_pwrite_zeroes(exp->export.blk, offset, bytes, flags) < 0) {
+        return NVME_WRITE_FAULT;
+    }
+    return NVME_SUCCESS;
+}
+
+static uint16_t coroutine_fn nvme_tcp_dsm(NvmeTcpReq *req)
+{
+    NvmeTcpExport *exp = req->conn->exp;
+    NvmeDsmCmd *dsm = (NvmeDsmCmd *)&req->cmd;
+    uint32_t nr = (le32_to_cpu(dsm->nr) & 0xff) + 1;
+    NvmeDsmRange *range = req->buf;
+    uint16_t status = NVME_SUCCESS;
+    uint32_t i;
+
+    if (req->len < nr * sizeof(*range)) {
+        return NVME_DATA_SGL_LEN_INVALID | NVME_DNR;
+    }
+    if (!(le32_to_cpu(dsm->attributes) & NVME_DSMGMT_AD)) {
+        return NVME_SUCCESS;
+    }
+    if (blk_is_read_only(exp->export.blk)) {
+        return NVME_WRITE_TO_RO | NVME_DNR;
+    }
+
+    for (i = 0; i < nr; i++) {
+        int64_t offset, bytes;
+
+        status = nvme_tcp_check_range(exp, le64_to_cpu(range[i].slba),
+                                      le32_to_cpu(range[i].nlb),
+                                      &offset, &bytes);
+        if (status) {
+            break;
+        }
+        while (bytes > 0) {
+            int n = MIN(bytes, BDRV_REQUEST_MAX_BYTES);
+
+            if (blk_co_pdiscard(exp->export.blk, offset, n) < 0) {
+                return NVME_INTERNAL_DEV_ERROR;
+            }
+            offset += n;
+            bytes -= n;
+        }
+    }
+    return status;
+}
+
+static uint16_t coroutine_fn nvme_tcp_io_cmd(NvmeTcpReq *req)
+{
+    uint32_t nsid = le32_to_cpu(req->cmd.nsid);
+
+    if (nsid != 1 &&
+        !(req->cmd.opcode == NVME_CMD_FLUSH && nsid == NVME_NSID_BROADCAST)) {
+        return NVME_INVALID_NSID | NVME_DNR;
+    }
+
+    switch (req->cmd.opcode) {
+    case NVME_CMD_FLUSH:
+        return blk_co_flush(req->conn->exp->export.blk) < 0 ?
+               NVME_INTERNAL_DEV_ERROR : NVME_SUCCESS;
+    case NVME_CMD_WRITE:
+        return nvme_tcp_rw(req, true);
+    case NVME_CMD_READ:
+        return nvme_tcp_rw(req, false);
+    case NVME_CMD_WRITE_ZEROES:
+        return nvme_tcp_write_zeroes(req);
+    case NVME_CMD_DSM:
+        return nvme_tcp_dsm(req);
+    default:
+        return NVME_INVALID_OPCODE | NVME_DNR;
+    }
+}
+
+static void coroutine_fn nvme_tcp_req_co(void *opaque)
+{
+    NvmeTcpReq *req = opaque;
+    NvmeTcpConn *conn = req->conn;
+    uint16_t status;
+
+    if (req->cmd.opcode == NVME_FABRICS_CMD) {
+        status = nvme_tcp_fabrics_cmd(req);
+    } else if (!conn->ctrl) {
+        status = NVME_CMD_SEQ_ERROR | NVME_DNR;
+    } else if (conn->qid == 0) {
+        status = nvme_tcp_admin_cmd(req);
+    } else {
+        status = nvme_tcp_io_cmd(req);
+    }
+
+    if (status != NVME_NO_COMPLETE && !conn->closing) {
+        if (nvme_tcp_complete(req, status) < 0) {
+            nvme_tcp_conn_close(conn);
+        }
+    }
+    nvme_tcp_req_free(req);
+}
+
+static void nvme_tcp_req_start(NvmeTcpReq *req)
+{
+    Coroutine *co = qemu_coroutine_create(nvme_tcp_req_co, req);
+
+    qemu_coroutine_enter(co);
+}
+
+static int coroutine_fn nvme_tcp_read(NvmeTcpConn *conn, void *buf,
+                                      size_t len, Error **errp)
+{
+    int ret;
+
+    conn->reading = true;
+    ret = qio_channel_read_all(conn->ioc, buf, len, errp);
+    conn->reading = false;
+    return ret;
+}
+
+/* Like nvme_tcp_read(), but returns 0 on EOF before anything was read */
+static int coroutine_fn nvme_tcp_read_eof(NvmeTcpConn *conn, void *buf,
+                                          size_t len, Error **errp)
+{
+    int ret;
+
+    conn->reading = true;
+    ret = qio_channel_read_all_eof(conn->ioc, buf, len, errp);
+    conn->reading = false;
+    return ret;
+}
+
+/* The tags are only used by requests on r2t_reqs, so there are enough */
+static void nvme_tcp_r2t_add(NvmeTcpConn *conn, NvmeTcpReq *req)
+{
+    unsigned long ttag = find_first_zero_bit(conn->ttags,
+                                             NVME_TCP_QUEUE_SIZE);
+
+    assert(ttag < NVME_TCP_QUEUE_SIZE);
+    set_bit(ttag, conn->ttags);
+    req->ttag = ttag;
+    QTAILQ_INSERT_TAIL(&conn->r2t_reqs, req, next);
+}
+
+static void nvme_tcp_r2t_remove(NvmeTcpConn *conn, NvmeTcpReq *req)
+{
+    QTAILQ_REMOVE(&conn->r2t_reqs, req, next);
+    clear_bit(req->ttag, conn->ttags);
+}
+
+static int coroutine_fn nvme_tcp_send_r2t(NvmeTcpReq *req)
+{
+    NvmeTcpR2TPdu r2t = { 0 };
+    struct iovec iov = { &r2t, sizeof(r2t) };
+
+    nvme_tcp_set_hdr(&r2t.hdr, NVME_TCP_PDU_R2T, 0, sizeof(r2t), sizeof(r2t));
+    r2t.cccid = req->cmd.cid;
+    r2t.ttag = cpu_to_le16(req->ttag);
+    r2t.r2tl = cpu_to_le32(req->len);
+    return nvme_tcp_send_iov(req->conn, &iov, 1);
+}
+
+static int coroutine_fn nvme_tcp_recv_cmd(NvmeTcpConn *conn,
+                                          NvmeTcpHdr *hdr, Error **errp)
+{
+    BlockBackend *blk = conn->exp->export.blk;
+    uint32_t plen = le32_to_cpu(hdr->plen);
+    uint32_t inline_len = 0;
+    NvmeSglDescriptor *sgl;
+    NvmeTcpReq *req;
+    NvmeCmd cmd;
+    uint8_t op;
+
+    if (hdr->hlen != sizeof(NvmeTcpCmdPdu) || plen < hdr->hlen) {
+        error_setg(errp, "Invalid command capsule header");
+        return -EINVAL;
+    }
+    if (plen > hdr->hlen) {
+        if (hdr->pdo != hdr->hlen || plen - hdr->pdo > NVME_TCP_INLINE_MAX) {
+            error_setg(errp, "Invalid in-capsule data");
+            return -EINVAL;
+        }
+        inline_len = plen - hdr->pdo;
+    }
+    if (nvme_tcp_read(conn, &cmd, sizeof(cmd), errp) < 0) {
+        return -EIO;
+    }
+
+    /*
+     * The host must not send more commands than the queue holds.  This
+     * also bounds the buffers of the requests that wait for their data.
+     * Before Connect, only Connect itself may be outstanding.
+     */
+    if (conn->nr_reqs > conn->sqsize) {
+        error_setg(errp, "Submission queue overflow");
+        return -EINVAL;
+    }
+
+    req = nvme_tcp_req_new(conn, &cmd);
+    conn->sqhd = (conn->sqhd + 1) % (conn->sqsize + 1);
+
+    op = cmd.opcode == NVME_FABRICS_CMD ? ((NvmfPropCmd *)&cmd)->fctype
+                                        : cmd.opcode;
+    req->xfer = op & 3;
+    sgl = &cmd.dptr.sgl;
+    if (req->xfer != NVME_XFER_NONE) {
+        req->len = le32_to_cpu(sgl->len);
+    }
+
+    if (inline_len) {
+        if (req->xfer != NVME_XFER_TO_CTRL || inline_len != req->len ||
+            sgl->type != NVME_TCP_SGL_INLINE) {
+            error_setg(errp, "Unexpected in-capsule data");
+            nvme_tcp_req_free(req);
+            return -EINVAL;
+        }
+        req->buf = blk_blockalign(blk, req->len);
+        if (nvme_tcp_read(conn, req->buf, req->len, errp) < 0) {
+            nvme_tcp_req_free(req);
+            return -EIO;
+        }
+    } else if (req->len &&
+               (req->len > NVME_TCP_MAX_XFER ||
+                sgl->type != NVME_TCP_SGL_TRANSPORT)) {
+        uint16_t status = req->len > NVME_TCP_MAX_XFER ?
+                          NVME_INVALID_FIELD : NVME_SGL_DESCR_TYPE_INVALID;
+
+        /* Complete with an error before anything is transferred */
+        req->xfer = NVME_XFER_NONE;
+        if (nvme_tcp_complete(req, status | NVME_DNR) < 0) {
+            nvme_tcp_req_free(req);
+            return -EIO;
+        }
+        nvme_tcp_req_free(req);
+        return 0;
+    } else if (req->xfer == NVME_XFER_TO_CTRL && req->len) {
+        /* Ask for the data; the request starts when all of it is here */
+        req->buf = blk_blockalign(blk, req->len);
+        nvme_tcp_r2t_add(conn, req);
+        return nvme_tcp_send_r2t(req);
+    }
+
+    nvme_tcp_req_start(req);
+    return 0;
+}
+
+static int coroutine_fn nvme_tcp_recv_h2c_data(NvmeTcpConn *conn,
+                                               NvmeTcpHdr *hdr, Error **errp)
+{
+    NvmeTcpDataPdu pdu;
+    NvmeTcpReq *req;
+    uint32_t datao, datal;
+
+    pdu.hdr = *hdr;
+    if (hdr->hlen != sizeof(pdu) || hdr->pdo != sizeof(pdu)) {
+        error_setg(errp, "Invalid H2C data header");
+        return -EINVAL;
+    }
+    if (nvme_tcp_read(conn, &pdu.hdr + 1, sizeof(pdu) - sizeof(*hdr),
+                      errp) < 0) {
+        return -EIO;
+    }
+
+    QTAILQ_FOREACH(req, &conn->r2t_reqs, next) {
+        if (req->ttag == le16_to_cpu(pdu.ttag)) {
+            break;
+        }
+    }
+    datao = le32_to_cpu(pdu.datao);
+    datal = le32_to_cpu(pdu.datal);
+    if (!req || req->cmd.cid != pdu.cccid || datao != req->received ||
+        datal > req->len - req->received ||
+        datal != le32_to_cpu(hdr->plen) - hdr->pdo) {
+        error_setg(errp, "Unexpected H2C data");
+        return -EINVAL;
+    }
+
+    if (nvme_tcp_read(conn, req->buf + datao, datal, errp) < 0) {
+        return -EIO;
+    }
+    req->received += datal;
+    if (req->received == req->len) {
+        nvme_tcp_r2t_remove(conn, req);
+        nvme_tcp_req_start(req);
+    }
+    return 0;
+}
+
+static int coroutine_fn nvme_tcp_negotiate(NvmeTcpConn *conn, Error **errp)
+{
+    NvmeTcpICReq icreq;
+    NvmeTcpICResp icresp = { 0 };
+    struct iovec iov = { &icresp, sizeof(icresp) };
+    int ret;
+
+    ret = nvme_tcp_read_eof(conn, &icreq, sizeof(icreq), errp);
+    if (ret <= 0) {
+        return -EIO;
+    }
+    if (icreq.hdr.type != NVME_TCP_PDU_ICREQ ||
+        icreq.hdr.hlen != sizeof(icreq) ||
+        le32_to_cpu(icreq.hdr.plen) != sizeof(icreq) ||
+        le16_to_cpu(icreq.pfv) != 0) {
+        error_setg(errp, "Invalid connection request");
+        return -EINVAL;
+    }
+    if (icreq.hpda != 0) {
+        error_setg(errp, "Host PDU data alignment is not supported");
+        return -EINVAL;
+    }
+
+    /* Digests stay disabled even if the host asked for them */
+    nvme_tcp_set_hdr(&icresp.hdr, NVME_TCP_PDU_ICRESP, 0,
+                     sizeof(icresp), sizeof(icresp));
+    icresp.maxh2cdata = cpu_to_le32(NVME_TCP_MAX_XFER);
+    return nvme_tcp_send_iov(conn, &iov, 1);
+}
+
+static void coroutine_fn nvme_tcp_conn_trip(void *opaque)
+{
+    NvmeTcpConn *conn = opaque;
+    Error *local_err = NULL;
+    NvmeTcpReq *req;
+    int ret;
+
+    ret = nvme_tcp_negotiate(conn, &local_err);
+    while (ret >= 0 && !conn->closing) {
+        NvmeTcpHdr hdr;
+
+        ret = nvme_tcp_read_eof(conn, &hdr, sizeof(hdr), &local_err);
+        if (ret <= 0) {
+            break;
+        }
+        if (hdr.flags & (NVME_TCP_F_HDGST | NVME_TCP_F_DDGST)) {
+            error_setg(&local_err, "Digests were not negotiated");
+            break;
+        }
+
+        switch (hdr.type) {
+        case NVME_TCP_PDU_CAPSULE_CMD:
+            ret = nvme_tcp_recv_cmd(conn, &hdr, &local_err);
+            break;
+        case NVME_TCP_PDU_H2C_DATA:
+            ret = nvme_tcp_recv_h2c_data(conn, &hdr, &local_err);
+            break;
+        case NVME_TCP_PDU_H2C_TERM_REQ:
+            error_setg(&local_err, "Connection terminated by the host");
+            ret = -ECONNRESET;
+            break;
+        default:
+            error_setg(&local_err, "Unexpected PDU type 0x%x", hdr.type);
+            ret = -EINVAL;
+            break;
+        }
+    }
+
+    if (local_err && !conn->closing) {
+        error_reportf_err(local_err, "Disconnect NVMe/TCP client: ");
+    } else {
+        error_free(local_err);
+    }
+
+    nvme_tcp_conn_close(conn);
+    while ((req = QTAILQ_FIRST(&conn->r2t_reqs))) {
+        nvme_tcp_r2t_remove(conn, req);
+        nvme_tcp_req_free(req);
+    }
+    conn->recv_co = NULL;
+    nvme_tcp_conn_put(conn);
+}
+
+static void nvme_tcp_accept(QIONetListener *listener, QIOChannelSocket *sioc,
+                            gpointer opaque)
+{
+    NvmeTcpExport *exp = opaque;
+    AioContext *ctx = exp->export.ctx;
+    NvmeTcpConn *conn;
+
+    conn = g_new0(NvmeTcpConn, 1);
+    conn->exp = exp;
+    conn->refcount = 1;
+    conn->sioc = sioc;
+    object_ref(OBJECT(conn->sioc));
+    conn->ioc = QIO_CHANNEL(sioc);
+    object_ref(OBJECT(conn->ioc));
+    qemu_co_mutex_init(&conn->send_lock);
+    QTAILQ_INIT(&conn->r2t_reqs);
+
+    qio_channel_set_name(conn->ioc, "nvme-tcp-server");
+    qio_channel_set_blocking(conn->ioc, false, NULL);
+    qio_channel_set_delay(conn->ioc, false);
+
+    aio_context_acquire(ctx);
+    blk_exp_ref(&exp->export);
+    QTAILQ_INSERT_TAIL(&exp->conns, conn, next);
+    qio_channel_attach_aio_context(conn->ioc, ctx);
+    conn->recv_co = qemu_coroutine_create(nvme_tcp_conn_trip, conn);
+    aio_co_schedule(ctx, conn->recv_co);
+    aio_context_release(ctx);
+}
+
+static void blk_aio_attached(AioContext *ctx, void *opaque)
+{
+    NvmeTcpExport *exp = opaque;
+    NvmeTcpConn *conn;
+
+    exp->export.ctx = ctx;
+
+    /*
+     * Only restart the coroutines that yielded on the channel, whose fd
+     * handlers went away with the old context.  recv_co may be the one
+     * that sends, or wait for send_lock, and then it must not be entered
+     * a second time, or at all.
+     */
+    QTAILQ_FOREACH(conn, &exp->conns, next) {
+        qio_channel_attach_aio_context(conn->ioc, ctx);
+        if (conn->reading) {
+            aio_co_schedule(ctx, conn->recv_co);
+        }
+        if (conn->writing) {
+            aio_co_schedule(ctx, conn->send_co);
+        }
+    }
+}
+
+static void blk_aio_detach(void *opaque)
+{
+    NvmeTcpExport *exp = opaque;
+    NvmeTcpConn *conn;
+
+    QTAILQ_FOREACH(conn, &exp->conns, next) {
+        qio_channel_detach_aio_context(conn->ioc);
+    }
+
+    exp->export.ctx = NULL;
+}
+
+static int nvme_tcp_exp_create(BlockExport *exp, BlockExportOptions *opts,
+                               Error **errp)
+{
+    NvmeTcpExport *nexp = container_of(exp, NvmeTcpExport, export);
+    BlockExportOptionsNvmeTcp *nvme_opts = &opts->u.nvme_tcp;
+    Error *local_err = NULL;
+    uint64_t logical_block_size = BDRV_SECTOR_SIZE;
+
+    if (nvme_opts->has_logical_block_size) {
+        logical_block_size = nvme_opts->logical_block_size;
+    }
+    check_block_size(exp->id, "logical-block-size", logical_block_size,
+                     &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return -EINVAL;
+    }
+    nexp->blk_size = logical_block_size;
+    blk_set_guest_block_size(exp->blk, logical_block_size);
+
+    nexp->num_queues = NVME_TCP_NUM_QUEUES_DEFAULT;
+    if (nvme_opts->has_num_queues) {
+        nexp->num_queues = nvme_opts->num_queues;
+    }
+    if (nexp->num_queues == 0 || nexp->num_queues >= 0xffff) {
+        error_setg(errp, "num-queues must be between 1 and 65534");
+        return -EINVAL;
+    }
+
+    if (nvme_opts->has_subnqn) {
+        if (strlen(nvme_opts->subnqn) >= sizeof(((NvmeIdCtrl *)0)->subnqn)) {
+            error_setg(errp, "subnqn is too long");
+            return -EINVAL;
+        }
+        nexp->subnqn = g_strdup(nvme_opts->subnqn);
+    } else {
+        nexp->subnqn = g_strdup_printf(NVME_TCP_SUBNQN_PREFIX "%.200s",
+                                       exp->id);
+    }
+
+    qemu_uuid_generate(&nexp->uuid);
+    nexp->next_cntlid = 1;
+    QTAILQ_INIT(&nexp->ctrls);
+    QTAILQ_INIT(&nexp->conns);
+
+    nexp->listener = qio_net_listener_new();
+    qio_net_listener_set_name(nexp->listener, "nvme-tcp-listener");
+    if (qio_net_listener_open_sync(nexp->listener, nvme_opts->addr, 1,
+                                   errp) < 0) {
+        object_unref(OBJECT(nexp->listener));
+        nexp->listener = NULL;
+        g_free(nexp->subnqn);
+        return -EADDRNOTAVAIL;
+    }
+
+    blk_add_aio_context_notifier(exp->blk, blk_aio_attached, blk_aio_detach,
+                                 nexp);
+    qio_net_listener_set_client_func(nexp->listener, nvme_tcp_accept, nexp,
+                                     NULL);
+    return 0;
+}
+
+static void nvme_tcp_exp_request_shutdown(BlockExport *exp)
+{
+    NvmeTcpExport *nexp = container_of(exp, NvmeTcpExport, export);
+    NvmeTcpConn *conn;
+
+    if (nexp->listener) {
+        qio_net_listener_disconnect(nexp->listener);
+        object_unref(OBJECT(nexp->listener));
+        nexp->listener = NULL;
+    }
+
+    QTAILQ_FOREACH(conn, &nexp->conns, next) {
+        nvme_tcp_conn_close(conn);
+    }
+}
+
+static void nvme_tcp_exp_delete(BlockExport *exp)
+{
+    NvmeTcpExport *nexp = container_of(exp, NvmeTcpExport, export);
+
+    assert(QTAILQ_EMPTY(&nexp->conns));
+    assert(QTAILQ_EMPTY(&nexp->ctrls));
+
+    blk_remove_aio_context_notifier(exp->blk, blk_aio_attached, blk_aio_detach,
+                                    nexp);
+    g_free(nexp->subnqn);
+}
+
+const BlockExportDriver blk_exp_nvme_tcp = {
+    .type               = BLOCK_EXPORT_TYPE_NVME_TCP,
+    .instance_size      = sizeof(NvmeTcpExport),
+    .create             = nvme_tcp_exp_create,
+    .delete             = nvme_tcp_exp_delete,
+    .request_shutdown   = nvme_tcp_exp_request_shutdown,
+};
@@ -0,0 +1,16 @@
+/*
+ * NVMe/TCP block export
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef NVME_TCP_EXPORT_H
+#define NVME_TCP_EXPORT_H
+
+#include "block/export.h"
+
+/* For block/export/export.c */
+extern const BlockExportDriver blk_exp_nvme_tcp;
+
+#endif /* NVME_TCP_EXPORT_H */
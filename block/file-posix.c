@@ -160,6 +160,7 @@ typedef struct BDRVRawState {
     bool discard_zeroes:1;
     bool use_linux_aio:1;
     bool use_linux_io_uring:1;
+    bool use_io_uring_fixed_file:1;
     bool page_cache_inconsistent:1;
     bool has_fallocate;
     bool needs_alignment;
@@ -171,6 +172,21 @@ typedef struct BDRVRawState {
         uint64_t discard_bytes_ok;
     } stats;
 
+    /*
+     * The last data extent and the last hole that raw_co_block_status()
+     * found with lseek(), as [start, end) byte ranges, so that repeated
+     * queries need no system call.  Writes only invalidate holes, since a
+     * range that is reported as data wrongly is merely not optimized;
+     * discard, write zeroes and truncation invalidate both.
+     */
+    struct {
+        int64_t data_start;
+        int64_t data_end;
+        int64_t hole_start;
+        int64_t hole_end;
+        unsigned int writes_in_flight;
+    } bsc;
+
     PRManager *pr_mgr;
 } BDRVRawState;
 
@@ -522,6 +538,13 @@ static QemuOptsList raw_runtime_opts = {
             .type = QEMU_OPT_STRING,
             .help = "host AIO implementation (threads, native, io_uring)",
         },
+#ifdef CONFIG_LINUX_IO_URING
+        {
+            .name = "io-uring-fixed-file",
+            .type = QEMU_OPT_BOOL,
+            .help = "register the file with io_uring (default: off)",
+        },
+#endif
         {
             .name = "locking",
             .type = QEMU_OPT_STRING,
@@ -550,6 +573,35 @@ static QemuOptsList raw_runtime_opts = {
 
 static const char *const mutable_opts[] = { "x-check-cache-dropped", NULL };
 
+/*
+ * Add s->fd to the registered file table of the io_uring instance of the
+ * node's AioContext.  Must be undone with raw_io_uring_forget_fd() before
+ * s->fd is closed or the node moves to another AioContext.
+ */
+static void raw_io_uring_register_fd(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    BDRVRawState *s = bs->opaque;
+
+    if (s->use_linux_io_uring && s->use_io_uring_fixed_file && s->fd >= 0) {
+        luring_register_fd(aio_get_linux_io_uring(bdrv_get_aio_context(bs)),
+                           s->fd);
+    }
+#endif
+}
+
+static void raw_io_uring_forget_fd(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    BDRVRawState *s = bs->opaque;
+
+    if (s->use_linux_io_uring && s->use_io_uring_fixed_file && s->fd >= 0) {
+        luring_unregister_fd(aio_get_linux_io_uring(bdrv_get_aio_context(bs)),
+                             s->fd);
+    }
+#endif
+}
+
 static int raw_open_common(BlockDriverState *bs, QDict *options,
                            int bdrv_flags, int open_flags,
                            bool device, Error **errp)
@@ -599,6 +651,13 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     s->use_linux_aio = (aio == BLOCKDEV_AIO_OPTIONS_NATIVE);
 #ifdef CONFIG_LINUX_IO_URING
     s->use_linux_io_uring = (aio == BLOCKDEV_AIO_OPTIONS_IO_URING);
+    s->use_io_uring_fixed_file = qemu_opt_get_bool(opts, "io-uring-fixed-file",
+                                                   false);
+    if (s->use_io_uring_fixed_file && !s->use_linux_io_uring) {
+        error_setg(errp, "io-uring-fixed-file requires aio=io_uring");
+        ret = -EINVAL;
+        goto fail;
+    }
 #endif
 
     locking = qapi_enum_parse(&OnOffAuto_lookup,
@@ -787,6 +846,7 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
         /* When extending regular files, we get zeros from the OS */
         bs->supported_truncate_flags = BDRV_REQ_ZERO_WRITE;
     }
+    raw_io_uring_register_fd(bs);
     ret = 0;
 fail:
     if (ret < 0 && s->fd != -1) {
@@ -1145,8 +1205,10 @@ static void raw_reopen_commit(BDRVReopenState *state)
     s->check_cache_dropped = rs->check_cache_dropped;
     s->open_flags = rs->open_flags;
 
+    raw_io_uring_forget_fd(state->bs);
     qemu_close(s->fd);
     s->fd = rs->fd;
+    raw_io_uring_register_fd(state->bs);
 
     g_free(state->opaque);
     state->opaque = NULL;
@@ -2002,6 +2064,45 @@ static int coroutine_fn raw_thread_pool_submit(BlockDriverState *bs,
     return thread_pool_submit_co(pool, func, arg);
 }
 
+static inline bool raw_bsc_overlaps(int64_t start, int64_t end,
+                                    int64_t offset, int64_t bytes)
+{
+    return start < end && offset < end && offset + bytes > start;
+}
+
+/* Forgets the cached holes that overlap a range before it is written */
+static void raw_bsc_write_begin(BDRVRawState *s, int64_t offset, int64_t bytes)
+{
+    s->bsc.writes_in_flight++;
+    if (raw_bsc_overlaps(s->bsc.hole_start, s->bsc.hole_end,
+                         offset, bytes)) {
+        s->bsc.hole_end = s->bsc.hole_start;
+    }
+}
+
+static void raw_bsc_write_end(BDRVRawState *s)
+{
+    assert(s->bsc.writes_in_flight > 0);
+    s->bsc.writes_in_flight--;
+}
+
+/*
+ * Forgets everything cached about a range whose allocation changes for
+ * another reason than a write (INT64_MAX bytes for everything).
+ */
+static void raw_bsc_invalidate(BDRVRawState *s, int64_t offset, int64_t bytes)
+{
+    bytes = MIN(bytes, INT64_MAX - offset);
+    if (raw_bsc_overlaps(s->bsc.data_start, s->bsc.data_end,
+                         offset, bytes)) {
+        s->bsc.data_end = s->bsc.data_start;
+    }
+    if (raw_bsc_overlaps(s->bsc.hole_start, s->bsc.hole_end,
+                         offset, bytes)) {
+        s->bsc.hole_end = s->bsc.hole_start;
+    }
+}
+
 static int coroutine_fn raw_co_prw(BlockDriverState *bs, uint64_t offset,
                                    uint64_t bytes, QEMUIOVector *qiov, int type)
 {
@@ -2060,8 +2161,14 @@ static int coroutine_fn raw_co_pwritev(BlockDriverState *bs, uint64_t offset,
                                        uint64_t bytes, QEMUIOVector *qiov,
                                        int flags)
 {
+    BDRVRawState *s = bs->opaque;
+    int ret;
+
     assert(flags == 0);
-    return raw_co_prw(bs, offset, bytes, qiov, QEMU_AIO_WRITE);
+    raw_bsc_write_begin(s, offset, bytes);
+    ret = raw_co_prw(bs, offset, bytes, qiov, QEMU_AIO_WRITE);
+    raw_bsc_write_end(s);
+    return ret;
 }
 
 static void raw_aio_plug(BlockDriverState *bs)
@@ -2148,12 +2255,19 @@ static void raw_aio_attach_aio_context(BlockDriverState *bs,
         }
     }
 #endif
+    raw_io_uring_register_fd(bs);
+}
+
+static void raw_aio_detach_aio_context(BlockDriverState *bs)
+{
+    raw_io_uring_forget_fd(bs);
 }
 
 static void raw_close(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
 
+    raw_io_uring_forget_fd(bs);
     if (s->fd >= 0) {
         qemu_close(s->fd);
         s->fd = -1;
@@ -2200,6 +2314,8 @@ static int coroutine_fn raw_co_truncate(BlockDriverState *bs, int64_t offset,
         return ret;
     }
 
+    raw_bsc_invalidate(s, 0, INT64_MAX);
+
     if (S_ISREG(st.st_mode)) {
         /* Always resizes to the exact @offset */
         return raw_regular_truncate(bs, s->fd, offset, prealloc, errp);
@@ -2727,7 +2843,9 @@ static int coroutine_fn raw_co_block_status(BlockDriverState *bs,
                                             int64_t *map,
                                             BlockDriverState **file)
 {
+    BDRVRawState *s = bs->opaque;
     off_t data = 0, hole = 0;
+    bool cache_hole;
     int ret;
 
     assert(QEMU_IS_ALIGNED(offset | bytes, bs->bl.request_alignment));
@@ -2744,11 +2862,34 @@ static int coroutine_fn raw_co_block_status(BlockDriverState *bs,
         return BDRV_BLOCK_DATA | BDRV_BLOCK_OFFSET_VALID;
     }
 
+    *map = offset;
+    *file = bs;
+    if (offset >= s->bsc.data_start && offset < s->bsc.data_end) {
+        *pnum = MIN(bytes, s->bsc.data_end - offset);
+        return BDRV_BLOCK_DATA | BDRV_BLOCK_OFFSET_VALID;
+    }
+    if (offset >= s->bsc.hole_start && offset < s->bsc.hole_end) {
+        *pnum = MIN(bytes, s->bsc.hole_end - offset);
+        return BDRV_BLOCK_ZERO | BDRV_BLOCK_OFFSET_VALID;
+    }
+
+    /*
+     * A write that is in flight may have allocated blocks that lseek() does
+     * not report yet, and other users may write to the file behind our
+     * back, so holes are only cached when neither can happen.
+     */
+    cache_hole = !s->bsc.writes_in_flight &&
+                 !(s->shared_perm & BLK_PERM_WRITE);
+
     ret = find_allocation(bs, offset, &data, &hole);
     if (ret == -ENXIO) {
         /* Trailing hole */
         *pnum = bytes;
         ret = BDRV_BLOCK_ZERO;
+        if (cache_hole) {
+            s->bsc.hole_start = offset;
+            s->bsc.hole_end = INT64_MAX;
+        }
     } else if (ret < 0) {
         /* No info available, so pretend there are no holes */
         *pnum = bytes;
@@ -2771,15 +2912,21 @@ static int coroutine_fn raw_co_block_status(BlockDriverState *bs,
             *pnum = ROUND_UP(*pnum, bs->bl.request_alignment);
         }
 
+        /* A partial block at EOF is left out */
+        s->bsc.data_start = offset;
+        s->bsc.data_end = QEMU_ALIGN_DOWN(hole, bs->bl.request_alignment);
+
         ret = BDRV_BLOCK_DATA;
     } else {
         /* On a hole, compute bytes to the beginning of the next extent.  */
         assert(hole == offset);
         *pnum = MIN(bytes, data - offset);
         ret = BDRV_BLOCK_ZERO;
+        if (cache_hole) {
+            s->bsc.hole_start = offset;
+            s->bsc.hole_end = data;
+        }
     }
-    *map = offset;
-    *file = bs;
     return ret | BDRV_BLOCK_OFFSET_VALID;
 }
 
@@ -2865,6 +3012,9 @@ static void coroutine_fn raw_co_invalidate_cache(BlockDriverState *bs,
         return;
     }
 
+    /* Another process may have written to the image while we were inactive */
+    raw_bsc_invalidate(s, 0, INT64_MAX);
+
     if (!s->drop_cache) {
         return;
     }
@@ -2914,6 +3064,78 @@ static void raw_account_discard(BDRVRawState *s, uint64_t nbytes, int ret)
     }
 }
 
+#ifdef CONFIG_LINUX_IO_URING_FALLOCATE
+/*
+ * Whether fallocate() on a regular file can be submitted to io_uring rather
+ * than run in the thread pool.
+ */
+static bool raw_use_luring_fallocate(BlockDriverState *bs, bool blkdev)
+{
+    BDRVRawState *s = bs->opaque;
+
+    return s->use_linux_io_uring && !blkdev &&
+        luring_has_fallocate(aio_get_linux_io_uring(bdrv_get_aio_context(bs)));
+}
+
+static int coroutine_fn raw_co_luring_fallocate(BlockDriverState *bs,
+                                                int mode, int64_t offset,
+                                                int bytes)
+{
+    BDRVRawState *s = bs->opaque;
+    LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+
+    return translate_err(luring_co_fallocate(bs, aio, s->fd, mode,
+                                             offset, bytes));
+}
+
+/*
+ * The first steps of handle_aiocb_write_zeroes_unmap() and
+ * handle_aiocb_write_zeroes() for regular files, submitted to io_uring.
+ * Returns -EAGAIN if the request must go on to the thread pool fallbacks.
+ */
+static int coroutine_fn raw_co_luring_write_zeroes(BlockDriverState *bs,
+                                                   int64_t offset, int bytes,
+                                                   BdrvRequestFlags flags)
+{
+    BDRVRawState *s = bs->opaque;
+    int ret;
+
+#ifdef CONFIG_FALLOCATE_PUNCH_HOLE
+    if (flags & BDRV_REQ_MAY_UNMAP) {
+        ret = raw_co_luring_fallocate(bs, FALLOC_FL_PUNCH_HOLE |
+                                      FALLOC_FL_KEEP_SIZE, offset, bytes);
+        switch (ret) {
+        case -ENOTSUP:
+        case -EINVAL:
+        case -EBUSY:
+            break;
+        default:
+            return ret;
+        }
+    }
+#endif
+
+#ifdef CONFIG_FALLOCATE_ZERO_RANGE
+    if (s->has_write_zeroes) {
+        ret = raw_co_luring_fallocate(bs, FALLOC_FL_ZERO_RANGE, offset, bytes);
+        if (ret == -EINVAL) {
+            /*
+             * Allow falling back to pwrite for file systems that
+             * do not support fallocate() for an unaligned byte range.
+             */
+            return -ENOTSUP;
+        }
+        if (ret == 0 || ret != -ENOTSUP) {
+            return ret;
+        }
+        s->has_write_zeroes = false;
+    }
+#endif
+
+    return -EAGAIN;
+}
+#endif
+
 static coroutine_fn int
 raw_do_pdiscard(BlockDriverState *bs, int64_t offset, int bytes, bool blkdev)
 {
@@ -2921,6 +3143,8 @@ raw_do_pdiscard(BlockDriverState *bs, int64_t offset, int bytes, bool blkdev)
     RawPosixAIOData acb;
     int ret;
 
+    raw_bsc_invalidate(s, offset, bytes);
+
     acb = (RawPosixAIOData) {
         .bs             = bs,
         .aio_fildes     = s->fd,
@@ -2933,6 +3157,24 @@ raw_do_pdiscard(BlockDriverState *bs, int64_t offset, int bytes, bool blkdev)
         acb.aio_type |= QEMU_AIO_BLKDEV;
     }
 
+#if defined(CONFIG_LINUX_IO_URING_FALLOCATE) && \
+    defined(CONFIG_FALLOCATE_PUNCH_HOLE)
+    if (raw_use_luring_fallocate(bs, blkdev)) {
+        if (!s->has_discard) {
+            ret = -ENOTSUP;
+        } else {
+            ret = raw_co_luring_fallocate(bs, FALLOC_FL_PUNCH_HOLE |
+                                          FALLOC_FL_KEEP_SIZE,
+                                          offset, bytes);
+            if (ret == -ENOTSUP) {
+                s->has_discard = false;
+            }
+        }
+        raw_account_discard(s, bytes, ret);
+        return ret;
+    }
+#endif
+
     ret = raw_thread_pool_submit(bs, handle_aiocb_discard, &acb);
     raw_account_discard(s, bytes, ret);
     return ret;
@@ -2952,6 +3194,8 @@ raw_do_pwrite_zeroes(BlockDriverState *bs, int64_t offset, int bytes,
     RawPosixAIOData acb;
     ThreadPoolFunc *handler;
 
+    raw_bsc_invalidate(s, offset, bytes);
+
 #ifdef CONFIG_FALLOCATE
     if (offset + bytes > bs->total_sectors * BDRV_SECTOR_SIZE) {
         BdrvTrackedRequest *req;
@@ -3002,6 +3246,18 @@ raw_do_pwrite_zeroes(BlockDriverState *bs, int64_t offset, int bytes,
         acb.aio_type |= QEMU_AIO_NO_FALLBACK;
     }
 
+#ifdef CONFIG_LINUX_IO_URING_FALLOCATE
+    if (raw_use_luring_fallocate(bs, blkdev)) {
+        int ret = raw_co_luring_write_zeroes(bs, offset, bytes, flags);
+
+        if (ret != -EAGAIN) {
+            return ret;
+        }
+        /* Unmapping was tried already, go on with the other fallbacks */
+        return raw_thread_pool_submit(bs, handle_aiocb_write_zeroes, &acb);
+    }
+#endif
+
     if (flags & BDRV_REQ_MAY_UNMAP) {
         acb.aio_type |= QEMU_AIO_DISCARD;
         handler = handle_aiocb_write_zeroes_unmap;
@@ -3160,15 +3416,20 @@ static void raw_set_perm(BlockDriverState *bs, uint64_t perm, uint64_t shared)
     /* For reopen, we have already switched to the new fd (.bdrv_set_perm is
      * called after .bdrv_reopen_commit) */
     if (s->perm_change_fd && s->fd != s->perm_change_fd) {
+        raw_io_uring_forget_fd(bs);
         qemu_close(s->fd);
         s->fd = s->perm_change_fd;
         s->open_flags = s->perm_change_flags;
+        raw_io_uring_register_fd(bs);
     }
     s->perm_change_fd = 0;
 
     raw_handle_perm_lock(bs, RAW_PL_COMMIT, perm, shared, NULL);
     s->perm = perm;
     s->shared_perm = shared;
+    if (shared & BLK_PERM_WRITE) {
+        raw_bsc_invalidate(s, 0, INT64_MAX);
+    }
 }
 
 static void raw_abort_perm_update(BlockDriverState *bs)
@@ -3206,6 +3467,7 @@ static int coroutine_fn raw_co_copy_range_to(BlockDriverState *bs,
     RawPosixAIOData acb;
     BDRVRawState *s = bs->opaque;
     BDRVRawState *src_s;
+    int ret;
 
     assert(dst->bs == bs);
     if (src->bs->drv->bdrv_co_copy_range_to != raw_co_copy_range_to) {
@@ -3229,7 +3491,12 @@ static int coroutine_fn raw_co_copy_range_to(BlockDriverState *bs,
         },
     };
 
-    return raw_thread_pool_submit(bs, handle_aiocb_copy_range, &acb);
+    /* copy_file_range() may share extents, holes included */
+    raw_bsc_invalidate(s, dst_offset, bytes);
+    raw_bsc_write_begin(s, dst_offset, bytes);
+    ret = raw_thread_pool_submit(bs, handle_aiocb_copy_range, &acb);
+    raw_bsc_write_end(s);
+    return ret;
 }
 
 BlockDriver bdrv_file = {
@@ -3262,6 +3529,7 @@ BlockDriver bdrv_file = {
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
 
     .bdrv_co_truncate = raw_co_truncate,
     .bdrv_getlength = raw_getlength,
@@ -3628,6 +3896,7 @@ static BlockDriver bdrv_host_device = {
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
 
     .bdrv_co_truncate       = raw_co_truncate,
     .bdrv_getlength	= raw_getlength,
@@ -3752,6 +4021,7 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
 
     .bdrv_co_truncate    = raw_co_truncate,
     .bdrv_getlength      = raw_getlength,
@@ -3882,6 +4152,7 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
 
     .bdrv_co_truncate    = raw_co_truncate,
     .bdrv_getlength      = raw_getlength,
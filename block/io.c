@@ -688,6 +688,19 @@ void bdrv_drain_all(void)
  */
 static void tracked_request_end(BdrvTrackedRequest *req)
 {
+    static const enum BlockAcctType acct_type[] = {
+        [BDRV_TRACKED_READ]     = BLOCK_ACCT_READ,
+        [BDRV_TRACKED_WRITE]    = BLOCK_ACCT_WRITE,
+        [BDRV_TRACKED_DISCARD]  = BLOCK_ACCT_UNMAP,
+        [BDRV_TRACKED_TRUNCATE] = BLOCK_ACCT_NONE,
+    };
+
+    if (acct_type[req->type] != BLOCK_ACCT_NONE) {
+        log_histogram_add(&req->bs->latency[acct_type[req->type]],
+                          qemu_clock_get_ns(QEMU_CLOCK_REALTIME) -
+                          req->start_ns);
+    }
+
     if (req->serialising) {
         qatomic_dec(&req->bs->serialising_in_flight);
     }
@@ -714,6 +727,7 @@ static void tracked_request_begin(BdrvTrackedRequest *req,
         .offset         = offset,
         .bytes          = bytes,
         .type           = type,
+        .start_ns       = qemu_clock_get_ns(QEMU_CLOCK_REALTIME),
         .co             = qemu_coroutine_self(),
         .serialising    = false,
         .overlap_offset = offset,
@@ -811,13 +825,20 @@ BdrvTrackedRequest *coroutine_fn bdrv_co_get_self_request(BlockDriverState *bs)
     BdrvTrackedRequest *req;
     Coroutine *self = qemu_coroutine_self();
 
+    /*
+     * Take reqs_lock like every other user of tracked_requests, so that
+     * concurrent requests submitted from other threads cannot modify the
+     * list while we walk it.
+     */
+    qemu_co_mutex_lock(&bs->reqs_lock);
     QLIST_FOREACH(req, &bs->tracked_requests, list) {
         if (req->co == self) {
-            return req;
+            break;
         }
     }
+    qemu_co_mutex_unlock(&bs->reqs_lock);
 
-    return NULL;
+    return req;
 }
 
 /**
@@ -2655,6 +2676,7 @@ int coroutine_fn bdrv_co_flush(BlockDriverState *bs)
     BdrvChild *primary_child = bdrv_primary_child(bs);
     BdrvChild *child;
     int current_gen;
+    int64_t start_ns;
     int ret = 0;
 
     bdrv_inc_in_flight(bs);
@@ -2664,6 +2686,8 @@ int coroutine_fn bdrv_co_flush(BlockDriverState *bs)
         goto early_exit;
     }
 
+    start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
     qemu_co_mutex_lock(&bs->reqs_lock);
     current_gen = qatomic_read(&bs->write_gen);
 
@@ -2768,6 +2792,9 @@ out:
     qemu_co_queue_next(&bs->flush_queue);
     qemu_co_mutex_unlock(&bs->reqs_lock);
 
+    log_histogram_add(&bs->latency[BLOCK_ACCT_FLUSH],
+                      qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start_ns);
+
 early_exit:
     bdrv_dec_in_flight(bs);
     return ret;
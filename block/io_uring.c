@@ -22,6 +22,9 @@
 /* io_uring ring size */
 #define MAX_ENTRIES 128
 
+/* Number of slots in the registered (fixed) file table */
+#define MAX_FIXED_FILES 64
+
 typedef struct LuringAIOCB {
     Coroutine *co;
     struct io_uring_sqe sqeq;
@@ -30,6 +33,10 @@ typedef struct LuringAIOCB {
     bool is_read;
     QSIMPLEQ_ENTRY(LuringAIOCB) next;
 
+    /* fallocate() mode and length for QEMU_AIO_FALLOCATE */
+    int mode;
+    uint64_t len;
+
     /*
      * Buffered reads may require resubmission, see
      * luring_resubmit_short_read().
@@ -54,6 +61,20 @@ typedef struct LuringState {
     /* io queue for submit at batch.  Protected by AioContext lock. */
     LuringQueue io_q;
 
+    /*
+     * Registered file table: fd that occupies each slot, or -1 if the slot
+     * is free.  Protected by AioContext lock.
+     */
+    int fixed_fds[MAX_FIXED_FILES];
+    bool fixed_files_registered;
+    bool fixed_files_unsupported;
+
+    /* Requests are picked up by a kernel SQ polling thread */
+    bool sqpoll;
+
+    /* The kernel supports IORING_OP_FALLOCATE */
+    bool has_fallocate;
+
     /* I/O completion processing.  Only runs in I/O thread.  */
     QEMUBH *completion_bh;
 } LuringState;
@@ -312,6 +333,101 @@ void luring_io_unplug(BlockDriverState *bs, LuringState *s)
     }
 }
 
+static int luring_fixed_file_index(LuringState *s, int fd)
+{
+    int i;
+
+    if (!s->fixed_files_registered) {
+        return -1;
+    }
+    for (i = 0; i < MAX_FIXED_FILES; i++) {
+        if (s->fixed_fds[i] == fd) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * luring_register_fd:
+ * @s: AIO state
+ * @fd: file descriptor to register
+ *
+ * Add @fd to the ring's registered file table so that requests on it can
+ * use IOSQE_FIXED_FILE and the kernel does not need to look up and
+ * reference count the file for every request.  This is an optimization
+ * only: if the kernel does not support it or the table is full, requests
+ * on @fd are submitted as usual.
+ *
+ * The caller must call luring_unregister_fd() before closing @fd.
+ */
+void luring_register_fd(LuringState *s, int fd)
+{
+    int slot;
+    int ret;
+
+    if (s->fixed_files_unsupported || luring_fixed_file_index(s, fd) >= 0) {
+        return;
+    }
+
+    if (!s->fixed_files_registered) {
+        for (slot = 0; slot < MAX_FIXED_FILES; slot++) {
+            s->fixed_fds[slot] = -1;
+        }
+        s->fixed_fds[0] = fd;
+        ret = io_uring_register_files(&s->ring, s->fixed_fds, MAX_FIXED_FILES);
+        if (ret < 0) {
+            trace_luring_register_fd_failed(s, fd, ret);
+            s->fixed_files_unsupported = true;
+            return;
+        }
+        s->fixed_files_registered = true;
+        trace_luring_register_fd(s, fd, 0);
+        return;
+    }
+
+    slot = luring_fixed_file_index(s, -1);
+    if (slot < 0) {
+        return;
+    }
+    ret = io_uring_register_files_update(&s->ring, slot, &fd, 1);
+    if (ret < 0) {
+        trace_luring_register_fd_failed(s, fd, ret);
+        return;
+    }
+    s->fixed_fds[slot] = fd;
+    trace_luring_register_fd(s, fd, slot);
+}
+
+/**
+ * luring_unregister_fd:
+ * @s: AIO state
+ * @fd: file descriptor previously passed to luring_register_fd()
+ *
+ * Remove @fd from the registered file table.  Requests that are already in
+ * flight keep their own reference to the file.
+ */
+void luring_unregister_fd(LuringState *s, int fd)
+{
+    int slot = luring_fixed_file_index(s, fd);
+    int unused = -1;
+
+    if (slot < 0) {
+        return;
+    }
+    trace_luring_unregister_fd(s, fd, slot);
+    s->fixed_fds[slot] = -1;
+    if (io_uring_register_files_update(&s->ring, slot, &unused, 1) < 0) {
+        /*
+         * The ring would keep the file open, and a new file might get the
+         * same fd number; stop using the table altogether.
+         */
+        io_uring_unregister_files(&s->ring);
+        s->fixed_files_registered = false;
+        s->fixed_files_unsupported = true;
+    }
+}
+
 /**
  * luring_do_submit:
  * @fd: file descriptor for I/O
@@ -327,6 +443,7 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
                             uint64_t offset, int type)
 {
     int ret;
+    int fixed_index;
     struct io_uring_sqe *sqes = &luringcb->sqeq;
 
     switch (type) {
@@ -341,6 +458,12 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
     case QEMU_AIO_FLUSH:
         io_uring_prep_fsync(sqes, fd, IORING_FSYNC_DATASYNC);
         break;
+#ifdef CONFIG_LINUX_IO_URING_FALLOCATE
+    case QEMU_AIO_FALLOCATE:
+        io_uring_prep_fallocate(sqes, fd, luringcb->mode, offset,
+                                luringcb->len);
+        break;
+#endif
     default:
         fprintf(stderr, "%s: invalid AIO request type, aborting 0x%x.\n",
                         __func__, type);
@@ -348,6 +471,12 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
     }
     io_uring_sqe_set_data(sqes, luringcb);
 
+    fixed_index = luring_fixed_file_index(s, fd);
+    if (fixed_index >= 0) {
+        sqes->fd = fixed_index;
+        sqes->flags |= IOSQE_FIXED_FILE;
+    }
+
     QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
     s->io_q.in_queue++;
     trace_luring_do_submit(s, s->io_q.blocked, s->io_q.plugged,
@@ -386,6 +515,42 @@ int coroutine_fn luring_co_submit(BlockDriverState *bs, LuringState *s, int fd,
     return luringcb.ret;
 }
 
+#ifdef CONFIG_LINUX_IO_URING_FALLOCATE
+bool luring_has_fallocate(LuringState *s)
+{
+    return s->has_fallocate;
+}
+
+/*
+ * Calls fallocate() on @fd from the ring instead of a worker thread.  The
+ * caller must check luring_has_fallocate() first.
+ */
+int coroutine_fn luring_co_fallocate(BlockDriverState *bs, LuringState *s,
+                                     int fd, int mode, uint64_t offset,
+                                     uint64_t len)
+{
+    int ret;
+    LuringAIOCB luringcb = {
+        .co         = qemu_coroutine_self(),
+        .ret        = -EINPROGRESS,
+        .mode       = mode,
+        .len        = len,
+    };
+
+    assert(s->has_fallocate);
+    trace_luring_co_fallocate(bs, s, &luringcb, fd, mode, offset, len);
+    ret = luring_do_submit(fd, &luringcb, s, offset, QEMU_AIO_FALLOCATE);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (luringcb.ret == -EINPROGRESS) {
+        qemu_coroutine_yield();
+    }
+    return luringcb.ret;
+}
+#endif
+
 void luring_detach_aio_context(LuringState *s, AioContext *old_context)
 {
     aio_set_fd_handler(old_context, s->ring.ring_fd, false, NULL, NULL, NULL,
@@ -402,21 +567,81 @@ void luring_attach_aio_context(LuringState *s, AioContext *new_context)
                        qemu_luring_completion_cb, NULL, qemu_luring_poll_cb, s);
 }
 
-LuringState *luring_init(Error **errp)
+/*
+ * Ring whose kernel SQ polling thread is shared by all rings created with
+ * IORING_SETUP_SQPOLL, or -1.  Protected by BQL.
+ */
+static int luring_sqpoll_wq_fd = -1;
+
+static int luring_init_sqpoll(LuringState *s, int64_t sqpoll_idle)
 {
+    struct io_uring_params params = {
+        .flags = IORING_SETUP_SQPOLL,
+        .sq_thread_idle = MIN(sqpoll_idle, UINT32_MAX),
+    };
     int rc;
+
+    if (luring_sqpoll_wq_fd >= 0) {
+        params.flags |= IORING_SETUP_ATTACH_WQ;
+        params.wq_fd = luring_sqpoll_wq_fd;
+    }
+
+    rc = io_uring_queue_init_params(MAX_ENTRIES, &s->ring, &params);
+    if (rc < 0 && (params.flags & IORING_SETUP_ATTACH_WQ)) {
+        /* Older kernels cannot share the SQ thread, use one for each ring */
+        params = (struct io_uring_params) {
+            .flags = IORING_SETUP_SQPOLL,
+            .sq_thread_idle = MIN(sqpoll_idle, UINT32_MAX),
+        };
+        rc = io_uring_queue_init_params(MAX_ENTRIES, &s->ring, &params);
+    }
+    if (rc < 0) {
+        return rc;
+    }
+
+    s->sqpoll = true;
+    if (luring_sqpoll_wq_fd < 0) {
+        luring_sqpoll_wq_fd = s->ring.ring_fd;
+    }
+    return 0;
+}
+
+LuringState *luring_init(int64_t sqpoll_idle, Error **errp)
+{
+    int rc = -1;
     LuringState *s = g_new0(LuringState, 1);
     struct io_uring *ring = &s->ring;
 
     trace_luring_init_state(s, sizeof(*s));
 
-    rc = io_uring_queue_init(MAX_ENTRIES, ring, 0);
+    if (sqpoll_idle) {
+        rc = luring_init_sqpoll(s, sqpoll_idle);
+        trace_luring_init_sqpoll(s, sqpoll_idle, rc);
+    }
+    if (rc < 0) {
+        /*
+         * SQ polling needs CAP_SYS_ADMIN before Linux 5.11, fall back to
+         * submitting requests with io_uring_enter().
+         */
+        rc = io_uring_queue_init(MAX_ENTRIES, ring, 0);
+    }
     if (rc < 0) {
         error_setg_errno(errp, errno, "failed to init linux io_uring ring");
         g_free(s);
         return NULL;
     }
 
+#ifdef CONFIG_LINUX_IO_URING_FALLOCATE
+    {
+        struct io_uring_probe *probe = io_uring_get_probe_ring(ring);
+
+        /* IORING_OP_FALLOCATE is new in Linux 5.6 */
+        s->has_fallocate = probe &&
+            io_uring_opcode_supported(probe, IORING_OP_FALLOCATE);
+        free(probe);
+    }
+#endif
+
     ioq_init(&s->io_q);
     return s;
 
@@ -424,6 +649,9 @@ LuringState *luring_init(Error **errp)
 
 void luring_cleanup(LuringState *s)
 {
+    if (s->sqpoll && luring_sqpoll_wq_fd == s->ring.ring_fd) {
+        luring_sqpoll_wq_fd = -1;
+    }
     io_uring_queue_exit(&s->ring);
     trace_luring_cleanup_state(s);
     g_free(s);
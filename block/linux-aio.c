@@ -15,6 +15,7 @@
 #include "qemu/event_notifier.h"
 #include "qemu/coroutine.h"
 #include "qapi/error.h"
+#include "trace.h"
 
 #include <libaio.h>
 
@@ -28,6 +29,12 @@
  */
 #define MAX_EVENTS 1024
 
+/*
+ * Maximum number of requests that are held back to be submitted together.
+ * Larger batches add latency without saving much more in io_submit().
+ */
+#define MAX_BATCH 32
+
 struct qemu_laiocb {
     Coroutine *co;
     LinuxAioState *ctx;
@@ -47,6 +54,13 @@ typedef struct {
     QSIMPLEQ_HEAD(, qemu_laiocb) pending;
 } LaioQueue;
 
+typedef struct {
+    uint64_t submits;       /* io_submit() calls */
+    uint64_t requests;      /* requests that io_submit() accepted */
+    uint64_t deferred;      /* requests held back for submit_bh */
+    unsigned int max_batch; /* largest number of requests in one call */
+} LaioStats;
+
 struct LinuxAioState {
     AioContext *aio_context;
 
@@ -60,6 +74,11 @@ struct LinuxAioState {
     QEMUBH *completion_bh;
     int event_idx;
     int event_max;
+
+    /* Submits the requests that were held back while others were running */
+    QEMUBH *submit_bh;
+
+    LaioStats stats;
 };
 
 static void ioq_submit(LinuxAioState *s);
@@ -297,6 +316,8 @@ static void ioq_submit(LinuxAioState *s)
         }
 
         ret = io_submit(s->ctx, len, iocbs);
+        trace_laio_io_submit(s, len, ret, s->io_q.in_flight);
+        s->stats.submits++;
         if (ret == -EAGAIN) {
             break;
         }
@@ -312,6 +333,8 @@ static void ioq_submit(LinuxAioState *s)
 
         s->io_q.in_flight += ret;
         s->io_q.in_queue  -= ret;
+        s->stats.requests += ret;
+        s->stats.max_batch = MAX(s->stats.max_batch, ret);
         aiocb = container_of(iocbs[ret - 1], struct qemu_laiocb, iocb);
         QSIMPLEQ_SPLIT_AFTER(&s->io_q.pending, aiocb, next, &completed);
     } while (ret == len && !QSIMPLEQ_EMPTY(&s->io_q.pending));
@@ -331,6 +354,18 @@ static void ioq_submit(LinuxAioState *s)
     }
 }
 
+static void qemu_laio_submit_bh(void *opaque)
+{
+    LinuxAioState *s = opaque;
+
+    aio_context_acquire(s->aio_context);
+    if (!s->io_q.plugged && !s->io_q.blocked &&
+        !QSIMPLEQ_EMPTY(&s->io_q.pending)) {
+        ioq_submit(s);
+    }
+    aio_context_release(s->aio_context);
+}
+
 void laio_io_plug(BlockDriverState *bs, LinuxAioState *s)
 {
     s->io_q.plugged++;
@@ -369,10 +404,27 @@ static int laio_do_submit(int fd, struct qemu_laiocb *laiocb, off_t offset,
 
     QSIMPLEQ_INSERT_TAIL(&s->io_q.pending, laiocb, next);
     s->io_q.in_queue++;
-    if (!s->io_q.blocked &&
-        (!s->io_q.plugged ||
-         s->io_q.in_flight + s->io_q.in_queue >= MAX_EVENTS)) {
+    if (s->io_q.blocked) {
+        return 0;
+    }
+
+    if (s->io_q.in_flight + s->io_q.in_queue >= MAX_EVENTS ||
+        s->io_q.in_queue >= MAX_BATCH) {
         ioq_submit(s);
+    } else if (!s->io_q.plugged) {
+        /*
+         * An idle queue submits right away.  Under load, requests that
+         * arrive in the same event loop iteration (for example from other
+         * virtqueues) are held back and submitted together, but never more
+         * than there are requests in flight, so that the delay stays small
+         * compared to the time the queue takes to drain.
+         */
+        if (s->io_q.in_queue > s->io_q.in_flight) {
+            ioq_submit(s);
+        } else {
+            s->stats.deferred++;
+            qemu_bh_schedule(s->submit_bh);
+        }
     }
 
     return 0;
@@ -406,6 +458,7 @@ void laio_detach_aio_context(LinuxAioState *s, AioContext *old_context)
 {
     aio_set_event_notifier(old_context, &s->e, false, NULL, NULL);
     qemu_bh_delete(s->completion_bh);
+    qemu_bh_delete(s->submit_bh);
     s->aio_context = NULL;
 }
 
@@ -413,6 +466,7 @@ void laio_attach_aio_context(LinuxAioState *s, AioContext *new_context)
 {
     s->aio_context = new_context;
     s->completion_bh = aio_bh_new(new_context, qemu_laio_completion_bh, s);
+    s->submit_bh = aio_bh_new(new_context, qemu_laio_submit_bh, s);
     aio_set_event_notifier(new_context, &s->e, false,
                            qemu_laio_completion_cb,
                            qemu_laio_poll_cb);
@@ -449,6 +503,8 @@ out_free_state:
 
 void laio_cleanup(LinuxAioState *s)
 {
+    trace_laio_cleanup_stats(s, s->stats.submits, s->stats.requests,
+                             s->stats.deferred, s->stats.max_batch);
     event_notifier_cleanup(&s->e);
 
     if (io_destroy(s->ctx) != 0) {
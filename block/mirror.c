@@ -28,6 +28,14 @@
 #define MAX_IO_BYTES (1 << 20) /* 1 Mb */
 #define DEFAULT_MIRROR_BUF_SIZE (MAX_IN_FLIGHT * MAX_IO_BYTES)
 
+/*
+ * MAX_IN_FLIGHT is only the initial limit on background operations; the job
+ * then adjusts it within these bounds, based on the throughput it observes.
+ */
+#define MIN_IN_FLIGHT_LIMIT 4
+#define MAX_IN_FLIGHT_LIMIT 128
+#define IN_FLIGHT_TUNE_INTERVAL_NS (100 * SCALE_MS)
+
 /* The mirroring buffer is a list of granularity-sized chunks.
  * Free chunks are organized in a list.
  */
@@ -74,7 +82,15 @@ typedef struct MirrorBlockJob {
     uint64_t last_pause_ns;
     unsigned long *in_flight_bitmap;
     int in_flight;
+    int max_in_flight;
     int64_t bytes_in_flight;
+    /* Throughput measurement for tuning max_in_flight */
+    int64_t tune_start_ns;
+    uint64_t tune_bytes;
+    uint64_t tune_last_bps;
+    bool tune_grow;
+    /* Cleared after the first failed copy offload */
+    bool use_copy_range;
     QTAILQ_HEAD(, MirrorOp) ops_in_flight;
     int ret;
     bool unmap;
@@ -82,6 +98,8 @@ typedef struct MirrorBlockJob {
     int max_iov;
     bool initial_zeroing_ongoing;
     int in_active_write_counter;
+    /* Flushes that wait for pending writes in write-coalescing mode */
+    int coalesce_barriers;
     bool prepared;
     bool in_drain;
 } MirrorBlockJob;
@@ -165,6 +183,45 @@ static void coroutine_fn mirror_wait_on_conflicts(MirrorOp *self,
     }
 }
 
+/*
+ * Hill climbing: keep changing max_in_flight in the same direction as long as
+ * the throughput improves, and turn around when it does not.  Time spent with
+ * nothing in flight is not measured, since the source was clean then.
+ */
+static void mirror_tune_in_flight(MirrorBlockJob *s, uint64_t bytes)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int64_t elapsed = now - s->tune_start_ns;
+    uint64_t bps;
+
+    /* With a rate limit, the depth is not what bounds the throughput */
+    if (s->common.speed) {
+        return;
+    }
+
+    s->tune_bytes += bytes;
+    if (elapsed >= IN_FLIGHT_TUNE_INTERVAL_NS) {
+        bps = muldiv64(s->tune_bytes, NANOSECONDS_PER_SECOND, elapsed);
+        if (bps < s->tune_last_bps + s->tune_last_bps / 16) {
+            s->tune_grow = !s->tune_grow;
+        }
+        if (s->tune_grow) {
+            s->max_in_flight = MIN(s->max_in_flight + s->max_in_flight / 4,
+                                   MAX_IN_FLIGHT_LIMIT);
+        } else {
+            s->max_in_flight = MAX(s->max_in_flight - s->max_in_flight / 4,
+                                   MIN_IN_FLIGHT_LIMIT);
+        }
+        trace_mirror_tune_in_flight(s, bps, s->max_in_flight);
+        s->tune_last_bps = bps;
+        s->tune_bytes = 0;
+        s->tune_start_ns = now;
+    } else if (s->in_flight == 0) {
+        s->tune_bytes = 0;
+        s->tune_start_ns = now;
+    }
+}
+
 static void coroutine_fn mirror_iteration_done(MirrorOp *op, int ret)
 {
     MirrorBlockJob *s = op->s;
@@ -194,6 +251,9 @@ static void coroutine_fn mirror_iteration_done(MirrorOp *op, int ret)
         }
         if (!s->initial_zeroing_ongoing) {
             job_progress_update(&s->common.job, op->bytes);
+            if (!op->is_active_write) {
+                mirror_tune_in_flight(s, op->bytes);
+            }
         }
     }
     qemu_iovec_destroy(&op->qiov);
@@ -325,7 +385,7 @@ static void coroutine_fn mirror_co_read(void *opaque)
     MirrorOp *op = opaque;
     MirrorBlockJob *s = op->s;
     int nb_chunks;
-    uint64_t ret;
+    int ret;
     uint64_t max_bytes;
 
     max_bytes = s->granularity * s->max_iov;
@@ -350,6 +410,28 @@ static void coroutine_fn mirror_co_read(void *opaque)
     assert(QEMU_IS_ALIGNED(op->bytes, BDRV_SECTOR_SIZE));
     nb_chunks = DIV_ROUND_UP(op->bytes, s->granularity);
 
+    /* Try to let the storage copy the data, without going through s->buf */
+    if (s->use_copy_range) {
+        s->in_flight++;
+        s->bytes_in_flight += op->bytes;
+        op->is_in_flight = true;
+        trace_mirror_one_iteration(s, op->offset, op->bytes);
+
+        ret = blk_co_copy_range_from(s->mirror_top_bs->backing, op->offset,
+                                     s->target, op->offset, op->bytes, 0, 0);
+        if (ret >= 0) {
+            mirror_write_complete(op, ret);
+            return;
+        }
+
+        /* Fall back to read+write, for this and all further requests */
+        trace_mirror_copy_range_fail(s, op->offset, ret);
+        s->use_copy_range = false;
+        s->in_flight--;
+        s->bytes_in_flight -= op->bytes;
+        op->is_in_flight = false;
+    }
+
     while (s->buf_free_count < nb_chunks) {
         trace_mirror_yield_in_flight(s, op->offset, s->in_flight);
         mirror_wait_for_free_in_flight_slot(s);
@@ -560,7 +642,7 @@ static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
             }
         }
 
-        while (s->in_flight >= MAX_IN_FLIGHT) {
+        while (s->in_flight >= s->max_in_flight) {
             trace_mirror_yield_in_flight(s, offset, s->in_flight);
             mirror_wait_for_free_in_flight_slot(s);
         }
@@ -812,7 +894,7 @@ static int coroutine_fn mirror_dirty_init(MirrorBlockJob *s)
                 return 0;
             }
 
-            if (s->in_flight >= MAX_IN_FLIGHT) {
+            if (s->in_flight >= s->max_in_flight) {
                 trace_mirror_yield(s, UINT64_MAX, s->buf_free_count,
                                    s->in_flight);
                 mirror_wait_for_free_in_flight_slot(s);
@@ -876,6 +958,7 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
     bool need_drain = true;
     int64_t length;
     int64_t target_length;
+    uint32_t max_transfer;
     BlockDriverInfo bdi;
     char backing_filename[2]; /* we only need 2 characters because we are only
                                  checking for a NULL string */
@@ -946,6 +1029,17 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
     }
     s->max_iov = MIN(bs->bl.max_iov, target_bs->bl.max_iov);
 
+    /*
+     * copy_range does not split requests according to max_transfer; only use
+     * it if every background copy fits in a single request.
+     */
+    max_transfer = MIN_NON_ZERO(bs->bl.max_transfer,
+                                target_bs->bl.max_transfer);
+    s->use_copy_range = !max_transfer || max_transfer >= s->buf_size;
+    s->max_in_flight = MAX_IN_FLIGHT;
+    s->tune_start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    s->tune_grow = true;
+
     s->buf = qemu_try_blockalign(bs, s->buf_size);
     if (s->buf == NULL) {
         ret = -ENOMEM;
@@ -995,7 +1089,7 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
         delta = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - s->last_pause_ns;
         if (delta < BLOCK_JOB_SLICE_TIME &&
             s->common.iostatus == BLOCK_DEVICE_IO_STATUS_OK) {
-            if (s->in_flight >= MAX_IN_FLIGHT || s->buf_free_count == 0 ||
+            if (s->in_flight >= s->max_in_flight || s->buf_free_count == 0 ||
                 (cnt == 0 && s->in_flight > 0)) {
                 trace_mirror_yield(s, cnt, s->buf_free_count, s->in_flight);
                 mirror_wait_for_free_in_flight_slot(s);
@@ -1020,7 +1114,7 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
                  */
                 job_transition_to_ready(&s->common.job);
                 s->synced = true;
-                if (s->copy_mode != MIRROR_COPY_MODE_BACKGROUND) {
+                if (s->copy_mode == MIRROR_COPY_MODE_WRITE_BLOCKING) {
                     s->actively_synced = true;
                 }
             }
@@ -1371,6 +1465,118 @@ static void coroutine_fn active_write_settle(MirrorOp *op)
     g_free(op);
 }
 
+/*
+ * Whether a write to the source must be copied to the target before it
+ * completes.  In write-coalescing mode this is only the case until the job
+ * is ready, while a flush waits for the pending data, or once more than
+ * buf_size bytes are pending; the background copy takes care of the rest.
+ */
+static bool mirror_write_to_target(MirrorBlockJob *s)
+{
+    if (s->ret < 0) {
+        return false;
+    }
+
+    switch (s->copy_mode) {
+    case MIRROR_COPY_MODE_BACKGROUND:
+        return false;
+    case MIRROR_COPY_MODE_WRITE_BLOCKING:
+        return true;
+    case MIRROR_COPY_MODE_WRITE_COALESCING:
+        return !s->synced || s->coalesce_barriers ||
+               bdrv_get_dirty_count(s->dirty_bitmap) >= s->buf_size;
+    default:
+        abort();
+    }
+}
+
+/* Copy a dirty area from the source to the target, on behalf of a flush */
+static int coroutine_fn mirror_sync_dirty_area(MirrorBlockJob *s,
+                                               int64_t offset, int64_t bytes)
+{
+    MirrorOp *op;
+    QEMUIOVector qiov;
+    void *buf;
+    int ret;
+
+    op = active_write_prepare(s, offset, bytes);
+
+    /* A background operation might have copied (part of) it meanwhile */
+    bdrv_reset_dirty_bitmap(s->dirty_bitmap, offset, bytes);
+
+    buf = qemu_try_blockalign(s->mirror_top_bs, bytes);
+    if (!buf) {
+        bdrv_set_dirty_bitmap(s->dirty_bitmap, offset, bytes);
+        active_write_settle(op);
+        return -ENOMEM;
+    }
+    qemu_iovec_init_buf(&qiov, buf, bytes);
+
+    ret = bdrv_co_preadv(s->mirror_top_bs->backing, offset, bytes, &qiov, 0);
+    if (ret >= 0) {
+        ret = blk_co_pwritev(s->target, offset, bytes, &qiov, 0);
+        if (ret < 0) {
+            mirror_error_action(s, false, -ret);
+        }
+    } else {
+        mirror_error_action(s, true, -ret);
+    }
+
+    if (ret >= 0) {
+        job_progress_update(&s->common.job, bytes);
+    } else {
+        bdrv_set_dirty_bitmap(s->dirty_bitmap, offset, bytes);
+    }
+    qemu_vfree(buf);
+    active_write_settle(op);
+    return ret;
+}
+
+/*
+ * Write all the data that is pending in write-coalescing mode to the target,
+ * and flush it.  Failures are left to the error handling of the job, and the
+ * data stays dirty so that it is copied again.
+ */
+static void coroutine_fn mirror_coalesce_barrier(MirrorBlockJob *s)
+{
+    int64_t offset, bytes;
+    int ret;
+
+    /* From now on guest writes are synchronous again, so we do not starve */
+    s->coalesce_barriers++;
+
+    do {
+        offset = 0;
+        while (bdrv_dirty_bitmap_next_dirty_area(s->dirty_bitmap, offset,
+                                                 s->bdev_length, s->buf_size,
+                                                 &offset, &bytes)) {
+            if (mirror_sync_dirty_area(s, offset, bytes) < 0) {
+                goto out;
+            }
+            offset += bytes;
+        }
+
+        /* Wait for background operations that have cleared dirty bits */
+        while (s->in_flight > 0) {
+            mirror_wait_for_free_in_flight_slot(s);
+        }
+    } while (s->ret >= 0 && bdrv_get_dirty_count(s->dirty_bitmap));
+
+    if (s->ret >= 0) {
+        ret = blk_co_flush(s->target);
+        if (ret < 0) {
+            BlockErrorAction action = mirror_error_action(s, false, -ret);
+
+            if (action == BLOCK_ERROR_ACTION_REPORT && s->ret >= 0) {
+                s->ret = ret;
+            }
+        }
+    }
+
+out:
+    s->coalesce_barriers--;
+}
+
 static int coroutine_fn bdrv_mirror_top_preadv(BlockDriverState *bs,
     uint64_t offset, uint64_t bytes, QEMUIOVector *qiov, int flags)
 {
@@ -1386,8 +1592,7 @@ static int coroutine_fn bdrv_mirror_top_do_write(BlockDriverState *bs,
     int ret = 0;
     bool copy_to_target;
 
-    copy_to_target = s->job->ret >= 0 &&
-                     s->job->copy_mode == MIRROR_COPY_MODE_WRITE_BLOCKING;
+    copy_to_target = mirror_write_to_target(s->job);
 
     if (copy_to_target) {
         op = active_write_prepare(s->job, offset, bytes);
@@ -1434,8 +1639,7 @@ static int coroutine_fn bdrv_mirror_top_pwritev(BlockDriverState *bs,
     int ret = 0;
     bool copy_to_target;
 
-    copy_to_target = s->job->ret >= 0 &&
-                     s->job->copy_mode == MIRROR_COPY_MODE_WRITE_BLOCKING;
+    copy_to_target = mirror_write_to_target(s->job);
 
     if (copy_to_target) {
         /* The guest might concurrently modify the data to write; but
@@ -1463,10 +1667,17 @@ static int coroutine_fn bdrv_mirror_top_pwritev(BlockDriverState *bs,
 
 static int coroutine_fn bdrv_mirror_top_flush(BlockDriverState *bs)
 {
+    MirrorBDSOpaque *s = bs->opaque;
+
     if (bs->backing == NULL) {
         /* we can be here after failed bdrv_append in mirror_start_job */
         return 0;
     }
+    if (s->job && !s->stop &&
+        s->job->copy_mode == MIRROR_COPY_MODE_WRITE_COALESCING &&
+        s->job->synced && s->job->ret >= 0) {
+        mirror_coalesce_barrier(s->job);
+    }
     return bdrv_co_flush(bs->backing->bs);
 }
 
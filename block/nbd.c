@@ -46,6 +46,7 @@
 
 #define EN_OPTSTR ":exportname="
 #define MAX_NBD_REQUESTS    16
+#define MAX_NBD_CONNECTIONS 16
 
 #define HANDLE_TO_INDEX(bs, handle) ((handle) ^ (uint64_t)(intptr_t)(bs))
 #define INDEX_TO_HANDLE(bs, index)  ((index)  ^ (uint64_t)(intptr_t)(bs))
@@ -139,16 +140,38 @@ typedef struct BDRVNBDState {
 
     bool wait_connect;
     NBDConnectThread *connect_thread;
+
+    /*
+     * All connections to the server, including this one.  Only used in
+     * bs->opaque, which is conns[0]; the other connections have their own
+     * BDRVNBDState that is not attached to any node.
+     */
+    struct BDRVNBDState **conns;
+    unsigned nr_conns;
+
+    /*
+     * Block status extents from the last NBD_CMD_BLOCK_STATUS reply, so that
+     * the following block status queries need no round trip.  Only used in
+     * bs->opaque.  The range of a write request is dropped from the cache
+     * both when the request is sent, so that it isn't looked up while the
+     * write is in flight, and when it completes.  bs_cache_gen is
+     * incremented each time, so replies that may predate the write are not
+     * put into the cache.
+     */
+    uint64_t bs_cache_offset;
+    NBDExtent *bs_cache;
+    unsigned bs_cache_nr;
+    uint64_t bs_cache_gen;
 } BDRVNBDState;
 
 static QIOChannelSocket *nbd_establish_connection(SocketAddress *saddr,
                                                   Error **errp);
-static QIOChannelSocket *nbd_co_establish_connection(BlockDriverState *bs,
+static QIOChannelSocket *nbd_co_establish_connection(BDRVNBDState *s,
                                                      Error **errp);
-static void nbd_co_establish_connection_cancel(BlockDriverState *bs,
-                                               bool detach);
-static int nbd_client_handshake(BlockDriverState *bs, QIOChannelSocket *sioc,
+static void nbd_co_establish_connection_cancel(BDRVNBDState *s, bool detach);
+static int nbd_client_handshake(BDRVNBDState *s, QIOChannelSocket *sioc,
                                 Error **errp);
+static void nbd_close(BlockDriverState *bs);
 
 static void nbd_clear_bdrvstate(BDRVNBDState *s)
 {
@@ -230,17 +253,22 @@ static void reconnect_delay_timer_init(BDRVNBDState *s, uint64_t expire_time_ns)
 
 static void nbd_client_detach_aio_context(BlockDriverState *bs)
 {
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    BDRVNBDState *bs_state = (BDRVNBDState *)bs->opaque;
+    unsigned i;
 
-    /* Timer is deleted in nbd_client_co_drain_begin() */
-    assert(!s->reconnect_delay_timer);
-    qio_channel_detach_aio_context(QIO_CHANNEL(s->ioc));
+    for (i = 0; i < bs_state->nr_conns; i++) {
+        BDRVNBDState *s = bs_state->conns[i];
+
+        /* Timer is deleted in nbd_client_co_drain_begin() */
+        assert(!s->reconnect_delay_timer);
+        qio_channel_detach_aio_context(QIO_CHANNEL(s->ioc));
+    }
 }
 
 static void nbd_client_attach_aio_context_bh(void *opaque)
 {
-    BlockDriverState *bs = opaque;
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    BDRVNBDState *s = opaque;
+    BlockDriverState *bs = s->bs;
 
     /*
      * The node is still drained, so we know the coroutine has yielded in
@@ -255,59 +283,73 @@ static void nbd_client_attach_aio_context_bh(void *opaque)
 static void nbd_client_attach_aio_context(BlockDriverState *bs,
                                           AioContext *new_context)
 {
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    BDRVNBDState *bs_state = (BDRVNBDState *)bs->opaque;
+    unsigned i;
 
-    /*
-     * s->connection_co is either yielded from nbd_receive_reply or from
-     * nbd_co_reconnect_loop()
-     */
-    if (s->state == NBD_CLIENT_CONNECTED) {
-        qio_channel_attach_aio_context(QIO_CHANNEL(s->ioc), new_context);
-    }
+    for (i = 0; i < bs_state->nr_conns; i++) {
+        BDRVNBDState *s = bs_state->conns[i];
 
-    bdrv_inc_in_flight(bs);
+        /*
+         * s->connection_co is either yielded from nbd_receive_reply or from
+         * nbd_co_reconnect_loop()
+         */
+        if (s->state == NBD_CLIENT_CONNECTED) {
+            qio_channel_attach_aio_context(QIO_CHANNEL(s->ioc), new_context);
+        }
 
-    /*
-     * Need to wait here for the BH to run because the BH must run while the
-     * node is still drained.
-     */
-    aio_wait_bh_oneshot(new_context, nbd_client_attach_aio_context_bh, bs);
+        bdrv_inc_in_flight(bs);
+
+        /*
+         * Need to wait here for the BH to run because the BH must run while
+         * the node is still drained.
+         */
+        aio_wait_bh_oneshot(new_context, nbd_client_attach_aio_context_bh, s);
+    }
 }
 
 static void coroutine_fn nbd_client_co_drain_begin(BlockDriverState *bs)
 {
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    BDRVNBDState *bs_state = (BDRVNBDState *)bs->opaque;
+    unsigned i;
 
-    s->drained = true;
-    if (s->connection_co_sleep_ns_state) {
-        qemu_co_sleep_wake(s->connection_co_sleep_ns_state);
-    }
+    for (i = 0; i < bs_state->nr_conns; i++) {
+        BDRVNBDState *s = bs_state->conns[i];
 
-    nbd_co_establish_connection_cancel(bs, false);
+        s->drained = true;
+        if (s->connection_co_sleep_ns_state) {
+            qemu_co_sleep_wake(s->connection_co_sleep_ns_state);
+        }
 
-    reconnect_delay_timer_del(s);
+        nbd_co_establish_connection_cancel(s, false);
 
-    if (s->state == NBD_CLIENT_CONNECTING_WAIT) {
-        s->state = NBD_CLIENT_CONNECTING_NOWAIT;
-        qemu_co_queue_restart_all(&s->free_sema);
+        reconnect_delay_timer_del(s);
+
+        if (s->state == NBD_CLIENT_CONNECTING_WAIT) {
+            s->state = NBD_CLIENT_CONNECTING_NOWAIT;
+            qemu_co_queue_restart_all(&s->free_sema);
+        }
     }
 }
 
 static void coroutine_fn nbd_client_co_drain_end(BlockDriverState *bs)
 {
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    BDRVNBDState *bs_state = (BDRVNBDState *)bs->opaque;
+    unsigned i;
 
-    s->drained = false;
-    if (s->wait_drained_end) {
-        s->wait_drained_end = false;
-        aio_co_wake(s->connection_co);
+    for (i = 0; i < bs_state->nr_conns; i++) {
+        BDRVNBDState *s = bs_state->conns[i];
+
+        s->drained = false;
+        if (s->wait_drained_end) {
+            s->wait_drained_end = false;
+            aio_co_wake(s->connection_co);
+        }
     }
 }
 
 
-static void nbd_teardown_connection(BlockDriverState *bs)
+static void nbd_teardown_connection(BDRVNBDState *s)
 {
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
 
     if (s->ioc) {
         /* finish any pending coroutines */
@@ -323,7 +365,7 @@ static void nbd_teardown_connection(BlockDriverState *bs)
         if (s->connection_co_sleep_ns_state) {
             qemu_co_sleep_wake(s->connection_co_sleep_ns_state);
         }
-        nbd_co_establish_connection_cancel(bs, true);
+        nbd_co_establish_connection_cancel(s, true);
     }
     if (qemu_in_coroutine()) {
         s->teardown_co = qemu_coroutine_self();
@@ -331,7 +373,7 @@ static void nbd_teardown_connection(BlockDriverState *bs)
         qemu_coroutine_yield();
         s->teardown_co = NULL;
     } else {
-        BDRV_POLL_WHILE(bs, s->connection_co);
+        BDRV_POLL_WHILE(s->bs, s->connection_co);
     }
     assert(!s->connection_co);
 }
@@ -425,10 +467,9 @@ static void *connect_thread_func(void *opaque)
 }
 
 static QIOChannelSocket *coroutine_fn
-nbd_co_establish_connection(BlockDriverState *bs, Error **errp)
+nbd_co_establish_connection(BDRVNBDState *s, Error **errp)
 {
     QemuThread thread;
-    BDRVNBDState *s = bs->opaque;
     QIOChannelSocket *res;
     NBDConnectThread *thr = s->connect_thread;
 
@@ -520,10 +561,8 @@ nbd_co_establish_connection(BlockDriverState *bs, Error **errp)
  * to CONNECT_THREAD_RUNNING_DETACHED state). s->connect_thread becomes NULL if
  * detach is true.
  */
-static void nbd_co_establish_connection_cancel(BlockDriverState *bs,
-                                               bool detach)
+static void nbd_co_establish_connection_cancel(BDRVNBDState *s, bool detach)
 {
-    BDRVNBDState *s = bs->opaque;
     NBDConnectThread *thr = s->connect_thread;
     bool wake = false;
     bool do_free = false;
@@ -600,7 +639,7 @@ static coroutine_fn void nbd_reconnect_attempt(BDRVNBDState *s)
         s->ioc = NULL;
     }
 
-    sioc = nbd_co_establish_connection(s->bs, &local_err);
+    sioc = nbd_co_establish_connection(s, &local_err);
     if (!sioc) {
         ret = -ECONNREFUSED;
         goto out;
@@ -608,7 +647,7 @@ static coroutine_fn void nbd_reconnect_attempt(BDRVNBDState *s)
 
     bdrv_dec_in_flight(s->bs);
 
-    ret = nbd_client_handshake(s->bs, sioc, &local_err);
+    ret = nbd_client_handshake(s, sioc, &local_err);
 
     if (s->drained) {
         s->wait_drained_end = true;
@@ -765,11 +804,36 @@ static coroutine_fn void nbd_connection_entry(void *opaque)
     aio_wait_kick();
 }
 
-static int nbd_co_send_request(BlockDriverState *bs,
+/*
+ * Pick the connection for a new request: the connected one with the fewest
+ * requests in flight.  Requests that need a reply are received on the same
+ * connection.
+ */
+static BDRVNBDState *nbd_get_conn(BlockDriverState *bs)
+{
+    BDRVNBDState *bs_state = (BDRVNBDState *)bs->opaque;
+    BDRVNBDState *best = bs_state;
+    unsigned i;
+
+    for (i = 1; i < bs_state->nr_conns; i++) {
+        BDRVNBDState *s = bs_state->conns[i];
+
+        if (s->state != NBD_CLIENT_CONNECTED) {
+            continue;
+        }
+        if (best->state != NBD_CLIENT_CONNECTED ||
+            s->in_flight < best->in_flight) {
+            best = s;
+        }
+    }
+
+    return best;
+}
+
+static int nbd_co_send_request(BDRVNBDState *s,
                                NBDRequest *request,
                                QEMUIOVector *qiov)
 {
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
     int rc, i = -1;
 
     qemu_co_mutex_lock(&s->send_mutex);
@@ -887,18 +951,21 @@ static int nbd_parse_offset_hole_payload(BDRVNBDState *s,
 
 /*
  * nbd_parse_blockstatus_payload
- * Based on our request, we expect only one extent in reply, for the
- * base:allocation context.
+ * Parse the extents, for the base:allocation context, covering at most
+ * @orig_length bytes.  They are returned in a new array @extents.
  */
 static int nbd_parse_blockstatus_payload(BDRVNBDState *s,
                                          NBDStructuredReplyChunk *chunk,
                                          uint8_t *payload, uint64_t orig_length,
-                                         NBDExtent *extent, Error **errp)
+                                         NBDExtent **extents,
+                                         unsigned *nr_extents, Error **errp)
 {
     uint32_t context_id;
+    unsigned max_extents, i;
+    uint64_t total = 0;
 
     /* The server succeeded, so it must have sent [at least] one extent */
-    if (chunk->length < sizeof(context_id) + sizeof(*extent)) {
+    if (chunk->length < sizeof(context_id) + sizeof(NBDExtent)) {
         error_setg(errp, "Protocol error: invalid payload for "
                          "NBD_REPLY_TYPE_BLOCK_STATUS");
         return -EINVAL;
@@ -913,65 +980,76 @@ static int nbd_parse_blockstatus_payload(BDRVNBDState *s,
         return -EINVAL;
     }
 
-    extent->length = payload_advance32(&payload);
-    extent->flags = payload_advance32(&payload);
+    max_extents = (chunk->length - sizeof(context_id)) / sizeof(NBDExtent);
+    *extents = g_new(NBDExtent, max_extents);
 
-    if (extent->length == 0) {
-        error_setg(errp, "Protocol error: server sent status chunk with "
-                   "zero length");
-        return -EINVAL;
-    }
+    for (i = 0; i < max_extents && total < orig_length; i++) {
+        NBDExtent *extent = &(*extents)[i];
 
-    /*
-     * A server sending unaligned block status is in violation of the
-     * protocol, but as qemu-nbd 3.1 is such a server (at least for
-     * POSIX files that are not a multiple of 512 bytes, since qemu
-     * rounds files up to 512-byte multiples but lseek(SEEK_HOLE)
-     * still sees an implicit hole beyond the real EOF), it's nicer to
-     * work around the misbehaving server. If the request included
-     * more than the final unaligned block, truncate it back to an
-     * aligned result; if the request was only the final block, round
-     * up to the full block and change the status to fully-allocated
-     * (always a safe status, even if it loses information).
-     */
-    if (s->info.min_block && !QEMU_IS_ALIGNED(extent->length,
-                                                   s->info.min_block)) {
-        trace_nbd_parse_blockstatus_compliance("extent length is unaligned");
-        if (extent->length > s->info.min_block) {
-            extent->length = QEMU_ALIGN_DOWN(extent->length,
-                                             s->info.min_block);
-        } else {
-            extent->length = s->info.min_block;
-            extent->flags = 0;
+        extent->length = payload_advance32(&payload);
+        extent->flags = payload_advance32(&payload);
+
+        if (extent->length == 0) {
+            error_setg(errp, "Protocol error: server sent status chunk with "
+                       "zero length");
+            g_free(*extents);
+            *extents = NULL;
+            return -EINVAL;
         }
-    }
 
-    /*
-     * We used NBD_CMD_FLAG_REQ_ONE, so the server should not have
-     * sent us any more than one extent, nor should it have included
-     * status beyond our request in that extent. However, it's easy
-     * enough to ignore the server's noncompliance without killing the
-     * connection; just ignore trailing extents, and clamp things to
-     * the length of our request.
-     */
-    if (chunk->length > sizeof(context_id) + sizeof(*extent)) {
-        trace_nbd_parse_blockstatus_compliance("more than one extent");
-    }
-    if (extent->length > orig_length) {
-        extent->length = orig_length;
-        trace_nbd_parse_blockstatus_compliance("extent length too large");
-    }
+        /*
+         * The server should not have included status beyond our request.
+         * However, it's easy enough to ignore the server's noncompliance
+         * without killing the connection; just clamp things to the length
+         * of our request.
+         */
+        if (extent->length > orig_length - total) {
+            extent->length = orig_length - total;
+            trace_nbd_parse_blockstatus_compliance("extent length too large");
+        }
 
-    /*
-     * HACK: if we are using x-dirty-bitmaps to access
-     * qemu:allocation-depth, treat all depths > 2 the same as 2,
-     * since nbd_client_co_block_status is only expecting the low two
-     * bits to be set.
-     */
-    if (s->alloc_depth && extent->flags > 2) {
-        extent->flags = 2;
+        /*
+         * HACK: if we are using x-dirty-bitmaps to access
+         * qemu:allocation-depth, treat all depths > 2 the same as 2,
+         * since nbd_client_co_block_status is only expecting the low two
+         * bits to be set.
+         */
+        if (s->alloc_depth && extent->flags > 2) {
+            extent->flags = 2;
+        }
+
+        /*
+         * A server sending unaligned block status is in violation of the
+         * protocol, but as qemu-nbd 3.1 is such a server (at least for
+         * POSIX files that are not a multiple of 512 bytes, since qemu
+         * rounds files up to 512-byte multiples but lseek(SEEK_HOLE)
+         * still sees an implicit hole beyond the real EOF), it's nicer to
+         * work around the misbehaving server. If the extent is more than
+         * the final unaligned block, truncate it back to an aligned
+         * result; if it was only the final block, round up to the full
+         * block and change the status to fully-allocated (always a safe
+         * status, even if it loses information).  Either way, ignore the
+         * following extents, which are unaligned as well.
+         */
+        if (s->info.min_block && !QEMU_IS_ALIGNED(extent->length,
+                                                  s->info.min_block)) {
+            trace_nbd_parse_blockstatus_compliance(
+                "extent length is unaligned");
+            if (extent->length > s->info.min_block) {
+                extent->length = QEMU_ALIGN_DOWN(extent->length,
+                                                 s->info.min_block);
+            } else {
+                extent->length = s->info.min_block;
+                extent->flags = 0;
+            }
+            i++;
+            break;
+        }
+
+        total += extent->length;
     }
 
+    *nr_extents = i;
     return 0;
 }
 
@@ -1417,7 +1495,8 @@ static int nbd_co_receive_cmdread_reply(BDRVNBDState *s, uint64_t handle,
 
 static int nbd_co_receive_blockstatus_reply(BDRVNBDState *s,
                                             uint64_t handle, uint64_t length,
-                                            NBDExtent *extent,
+                                            NBDExtent **extents,
+                                            unsigned *nr_extents,
                                             int *request_ret, Error **errp)
 {
     NBDReplyChunkIter iter;
@@ -1426,7 +1505,8 @@ static int nbd_co_receive_blockstatus_reply(BDRVNBDState *s,
     Error *local_err = NULL;
     bool received = false;
 
-    assert(!extent->length);
+    *extents = NULL;
+    *nr_extents = 0;
     NBD_FOREACH_REPLY_CHUNK(s, iter, handle, false, NULL, &reply, &payload) {
         int ret;
         NBDStructuredReplyChunk *chunk = &reply.structured;
@@ -1442,9 +1522,10 @@ static int nbd_co_receive_blockstatus_reply(BDRVNBDState *s,
             }
             received = true;
 
+            g_free(*extents);
             ret = nbd_parse_blockstatus_payload(s, &reply.structured,
-                                                payload, length, extent,
-                                                &local_err);
+                                                payload, length, extents,
+                                                nr_extents, &local_err);
             if (ret < 0) {
                 nbd_channel_error(s, ret);
                 nbd_iter_channel_error(&iter, ret, &local_err);
@@ -1465,7 +1546,7 @@ static int nbd_co_receive_blockstatus_reply(BDRVNBDState *s,
         payload = NULL;
     }
 
-    if (!extent->length && !iter.request_ret) {
+    if (!*nr_extents && !iter.request_ret) {
         error_setg(&local_err, "Server did not reply with any status extents");
         nbd_iter_channel_error(&iter, -EIO, &local_err);
     }
@@ -1480,7 +1561,7 @@ static int nbd_co_request(BlockDriverState *bs, NBDRequest *request,
 {
     int ret, request_ret;
     Error *local_err = NULL;
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    BDRVNBDState *s = nbd_get_conn(bs);
 
     assert(request->type != NBD_CMD_READ);
     if (write_qiov) {
@@ -1491,7 +1572,7 @@ static int nbd_co_request(BlockDriverState *bs, NBDRequest *request,
     }
 
     do {
-        ret = nbd_co_send_request(bs, request, write_qiov);
+        ret = nbd_co_send_request(s, request, write_qiov);
         if (ret < 0) {
             continue;
         }
@@ -1512,12 +1593,70 @@ static int nbd_co_request(BlockDriverState *bs, NBDRequest *request,
     return ret ? ret : request_ret;
 }
 
+/*
+ * Find the cached extent containing @offset.  On success, @extent is set to
+ * the part of it that starts at @offset.
+ */
+static bool nbd_block_status_cache_lookup(BlockDriverState *bs,
+                                          uint64_t offset, NBDExtent *extent)
+{
+    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    uint64_t start = s->bs_cache_offset;
+    unsigned i;
+
+    if (offset < start) {
+        return false;
+    }
+
+    for (i = 0; i < s->bs_cache_nr; i++) {
+        uint64_t end = start + s->bs_cache[i].length;
+
+        if (offset < end) {
+            extent->length = end - offset;
+            extent->flags = s->bs_cache[i].flags;
+            return true;
+        }
+        start = end;
+    }
+
+    return false;
+}
+
+static void nbd_block_status_cache_set(BlockDriverState *bs, uint64_t offset,
+                                       NBDExtent *extents, unsigned nr_extents)
+{
+    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+
+    g_free(s->bs_cache);
+    s->bs_cache_offset = offset;
+    s->bs_cache = extents;
+    s->bs_cache_nr = nr_extents;
+}
+
+/* Called when one of our requests may change the data at @offset */
+static void nbd_block_status_cache_invalidate(BlockDriverState *bs,
+                                              uint64_t offset, uint64_t bytes)
+{
+    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    uint64_t cache_end = s->bs_cache_offset;
+    unsigned i;
+
+    s->bs_cache_gen++;
+
+    for (i = 0; i < s->bs_cache_nr; i++) {
+        cache_end += s->bs_cache[i].length;
+    }
+    if (offset < cache_end && offset + bytes > s->bs_cache_offset) {
+        nbd_block_status_cache_set(bs, 0, NULL, 0);
+    }
+}
+
 static int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
                                 uint64_t bytes, QEMUIOVector *qiov, int flags)
 {
     int ret, request_ret;
     Error *local_err = NULL;
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    BDRVNBDState *s = nbd_get_conn(bs);
     NBDRequest request = {
         .type = NBD_CMD_READ,
         .from = offset,
@@ -1550,7 +1689,7 @@ static int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
     }
 
     do {
-        ret = nbd_co_send_request(bs, &request, NULL);
+        ret = nbd_co_send_request(s, &request, NULL);
         if (ret < 0) {
             continue;
         }
@@ -1573,6 +1712,7 @@ static int nbd_client_co_preadv(BlockDriverState *bs, uint64_t offset,
 static int nbd_client_co_pwritev(BlockDriverState *bs, uint64_t offset,
                                  uint64_t bytes, QEMUIOVector *qiov, int flags)
 {
+    int ret;
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
     NBDRequest request = {
         .type = NBD_CMD_WRITE,
@@ -1591,12 +1731,16 @@ static int nbd_client_co_pwritev(BlockDriverState *bs, uint64_t offset,
     if (!bytes) {
         return 0;
     }
-    return nbd_co_request(bs, &request, qiov);
+    nbd_block_status_cache_invalidate(bs, offset, bytes);
+    ret = nbd_co_request(bs, &request, qiov);
+    nbd_block_status_cache_invalidate(bs, offset, bytes);
+    return ret;
 }
 
 static int nbd_client_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
                                        int bytes, BdrvRequestFlags flags)
 {
+    int ret;
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
     NBDRequest request = {
         .type = NBD_CMD_WRITE_ZEROES,
@@ -1624,7 +1768,10 @@ static int nbd_client_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
     if (!bytes) {
         return 0;
     }
-    return nbd_co_request(bs, &request, NULL);
+    nbd_block_status_cache_invalidate(bs, offset, bytes);
+    ret = nbd_co_request(bs, &request, NULL);
+    nbd_block_status_cache_invalidate(bs, offset, bytes);
+    return ret;
 }
 
 static int nbd_client_co_flush(BlockDriverState *bs)
@@ -1645,6 +1792,7 @@ static int nbd_client_co_flush(BlockDriverState *bs)
 static int nbd_client_co_pdiscard(BlockDriverState *bs, int64_t offset,
                                   int bytes)
 {
+    int ret;
     BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
     NBDRequest request = {
         .type = NBD_CMD_TRIM,
@@ -1657,7 +1805,10 @@ static int nbd_client_co_pdiscard(BlockDriverState *bs, int64_t offset,
         return 0;
     }
 
-    return nbd_co_request(bs, &request, NULL);
+    nbd_block_status_cache_invalidate(bs, offset, bytes);
+    ret = nbd_co_request(bs, &request, NULL);
+    nbd_block_status_cache_invalidate(bs, offset, bytes);
+    return ret;
 }
 
 static int coroutine_fn nbd_client_co_block_status(
@@ -1666,15 +1817,22 @@ static int coroutine_fn nbd_client_co_block_status(
 {
     int ret, request_ret;
     NBDExtent extent = { 0 };
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    NBDExtent *extents = NULL;
+    unsigned nr_extents = 0;
+    BDRVNBDState *bs_state = (BDRVNBDState *)bs->opaque;
+    BDRVNBDState *s = nbd_get_conn(bs);
+    uint64_t cache_gen;
     Error *local_err = NULL;
 
+    /*
+     * Don't use NBD_CMD_FLAG_REQ_ONE: the extents after the first one are
+     * cached, because callers usually go on to query the following ranges.
+     */
     NBDRequest request = {
         .type = NBD_CMD_BLOCK_STATUS,
         .from = offset,
         .len = MIN(QEMU_ALIGN_DOWN(INT_MAX, bs->bl.request_alignment),
                    MIN(bytes, s->info.size - offset)),
-        .flags = NBD_CMD_FLAG_REQ_ONE,
     };
 
     if (!s->info.base_allocation) {
@@ -1698,18 +1856,25 @@ static int coroutine_fn nbd_client_co_block_status(
         return BDRV_BLOCK_ZERO;
     }
 
+    if (nbd_block_status_cache_lookup(bs, offset, &extent)) {
+        goto done;
+    }
+
     if (s->info.min_block) {
         assert(QEMU_IS_ALIGNED(request.len, s->info.min_block));
     }
+    cache_gen = bs_state->bs_cache_gen;
     do {
-        ret = nbd_co_send_request(bs, &request, NULL);
+        g_free(extents);
+        extents = NULL;
+        ret = nbd_co_send_request(s, &request, NULL);
         if (ret < 0) {
             continue;
         }
 
         ret = nbd_co_receive_blockstatus_reply(s, request.handle, bytes,
-                                               &extent, &request_ret,
-                                               &local_err);
+                                               &extents, &nr_extents,
+                                               &request_ret, &local_err);
         if (local_err) {
             trace_nbd_co_request_fail(request.from, request.len, request.handle,
                                       request.flags, request.type,
@@ -1721,11 +1886,20 @@ static int coroutine_fn nbd_client_co_block_status(
     } while (ret < 0 && nbd_client_connecting_wait(s));
 
     if (ret < 0 || request_ret < 0) {
+        g_free(extents);
         return ret ? ret : request_ret;
     }
 
-    assert(extent.length);
-    *pnum = extent.length;
+    assert(nr_extents && extents[0].length);
+    extent = extents[0];
+    if (nr_extents > 1 && bs_state->bs_cache_gen == cache_gen) {
+        nbd_block_status_cache_set(bs, offset, extents, nr_extents);
+    } else {
+        g_free(extents);
+    }
+
+done:
+    *pnum = MIN(extent.length, bytes);
     *map = offset;
     *file = bs;
     return (extent.flags & NBD_STATE_HOLE ? 0 : BDRV_BLOCK_DATA) |
@@ -1747,14 +1921,19 @@ static int nbd_client_reopen_prepare(BDRVReopenState *state,
 
 static void nbd_client_close(BlockDriverState *bs)
 {
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    BDRVNBDState *bs_state = (BDRVNBDState *)bs->opaque;
     NBDRequest request = { .type = NBD_CMD_DISC };
+    unsigned i;
 
-    if (s->ioc) {
-        nbd_send_request(s->ioc, &request);
-    }
+    for (i = 0; i < bs_state->nr_conns; i++) {
+        BDRVNBDState *s = bs_state->conns[i];
+
+        if (s->ioc) {
+            nbd_send_request(s->ioc, &request);
+        }
 
-    nbd_teardown_connection(bs);
+        nbd_teardown_connection(s);
+    }
 }
 
 static QIOChannelSocket *nbd_establish_connection(SocketAddress *saddr,
@@ -1778,10 +1957,10 @@ static QIOChannelSocket *nbd_establish_connection(SocketAddress *saddr,
 }
 
 /* nbd_client_handshake takes ownership on sioc. On failure it is unref'ed. */
-static int nbd_client_handshake(BlockDriverState *bs, QIOChannelSocket *sioc,
+static int nbd_client_handshake(BDRVNBDState *s, QIOChannelSocket *sioc,
                                 Error **errp)
 {
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    BlockDriverState *bs = s->bs;
     AioContext *aio_context = bdrv_get_aio_context(bs);
     int ret;
 
@@ -1839,6 +2018,9 @@ static int nbd_client_handshake(BlockDriverState *bs, QIOChannelSocket *sioc,
         object_ref(OBJECT(s->ioc));
     }
 
+    /* The export may have changed while we were disconnected */
+    nbd_block_status_cache_invalidate(bs, 0, UINT64_MAX);
+
     trace_nbd_client_handshake_success(s->export);
 
     return 0;
@@ -2174,6 +2356,13 @@ static QemuOptsList nbd_runtime_opts = {
                     "future requests before a successful reconnect will "
                     "immediately fail. Default 0",
         },
+        {
+            .name = "connections",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of connections to the server that requests are "
+                    "distributed across (requires a server that supports "
+                    "multiple connections). Default 1",
+        },
         { /* end of list */ }
     },
 };
@@ -2230,6 +2419,13 @@ static int nbd_process_options(BlockDriverState *bs, QDict *options,
 
     s->reconnect_delay = qemu_opt_get_number(opts, "reconnect-delay", 0);
 
+    s->nr_conns = qemu_opt_get_number(opts, "connections", 1);
+    if (s->nr_conns < 1 || s->nr_conns > MAX_NBD_CONNECTIONS) {
+        error_setg(errp, "connections must be between 1 and %d",
+                   MAX_NBD_CONNECTIONS);
+        goto error;
+    }
+
     ret = 0;
 
  error:
@@ -2240,19 +2436,15 @@ static int nbd_process_options(BlockDriverState *bs, QDict *options,
     return ret;
 }
 
-static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
-                    Error **errp)
+/*
+ * Connect @s to the server and start its connection coroutine.  On failure,
+ * the caller must still free the connection parameters in @s.
+ */
+static int nbd_open_conn(BDRVNBDState *s, Error **errp)
 {
-    int ret;
-    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
     QIOChannelSocket *sioc;
+    int ret;
 
-    ret = nbd_process_options(bs, options, errp);
-    if (ret < 0) {
-        return ret;
-    }
-
-    s->bs = bs;
     qemu_co_mutex_init(&s->send_mutex);
     qemu_co_queue_init(&s->free_sema);
 
@@ -2265,9 +2457,8 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
         return -ECONNREFUSED;
     }
 
-    ret = nbd_client_handshake(bs, sioc, errp);
+    ret = nbd_client_handshake(s, sioc, errp);
     if (ret < 0) {
-        nbd_clear_bdrvstate(s);
         return ret;
     }
     /* successfully connected */
@@ -2276,12 +2467,90 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
     nbd_init_connect_thread(s);
 
     s->connection_co = qemu_coroutine_create(nbd_connection_entry, s);
-    bdrv_inc_in_flight(bs);
-    aio_co_schedule(bdrv_get_aio_context(bs), s->connection_co);
+    bdrv_inc_in_flight(s->bs);
+    aio_co_schedule(bdrv_get_aio_context(s->bs), s->connection_co);
 
     return 0;
 }
 
+/* Create the state for an additional connection with the same parameters */
+static BDRVNBDState *nbd_new_conn(BDRVNBDState *s)
+{
+    BDRVNBDState *conn = g_new0(BDRVNBDState, 1);
+
+    conn->bs = s->bs;
+    conn->reconnect_delay = s->reconnect_delay;
+    conn->saddr = QAPI_CLONE(SocketAddress, s->saddr);
+    conn->export = g_strdup(s->export);
+    conn->tlscredsid = g_strdup(s->tlscredsid);
+    if (s->tlscreds) {
+        conn->tlscreds = s->tlscreds;
+        object_ref(OBJECT(conn->tlscreds));
+        conn->hostname = conn->saddr->u.inet.host;
+    }
+    conn->x_dirty_bitmap = g_strdup(s->x_dirty_bitmap);
+
+    return conn;
+}
+
+static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
+                    Error **errp)
+{
+    int ret;
+    BDRVNBDState *s = (BDRVNBDState *)bs->opaque;
+    unsigned nr_conns, i;
+
+    ret = nbd_process_options(bs, options, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->bs = bs;
+    nr_conns = s->nr_conns;
+    s->conns = g_new0(BDRVNBDState *, nr_conns);
+    s->conns[0] = s;
+    s->nr_conns = 1;
+
+    ret = nbd_open_conn(s, errp);
+    if (ret < 0) {
+        nbd_clear_bdrvstate(s);
+        g_free(s->conns);
+        return ret;
+    }
+
+    if (nr_conns > 1 && !(s->info.flags & NBD_FLAG_CAN_MULTI_CONN)) {
+        error_setg(errp, "The server does not support multiple connections "
+                   "to export '%s'", s->export ?: "");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    for (i = 1; i < nr_conns; i++) {
+        BDRVNBDState *conn = nbd_new_conn(s);
+
+        /* Add it first, so that nbd_close() cleans up after failures */
+        s->conns[s->nr_conns++] = conn;
+
+        ret = nbd_open_conn(conn, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+        if (conn->info.size != s->info.size ||
+            conn->info.flags != s->info.flags) {
+            error_setg(errp, "The server reported a different export size or "
+                       "flags on an additional connection");
+            ret = -EIO;
+            goto fail;
+        }
+    }
+
+    return 0;
+
+fail:
+    nbd_close(bs);
+    return ret;
+}
+
 static int nbd_co_flush(BlockDriverState *bs)
 {
     return nbd_client_co_flush(bs);
@@ -2324,9 +2593,18 @@ static void nbd_refresh_limits(BlockDriverState *bs, Error **errp)
 static void nbd_close(BlockDriverState *bs)
 {
     BDRVNBDState *s = bs->opaque;
+    unsigned i;
 
     nbd_client_close(bs);
+    for (i = 1; i < s->nr_conns; i++) {
+        nbd_clear_bdrvstate(s->conns[i]);
+        g_free(s->conns[i]);
+    }
     nbd_clear_bdrvstate(s);
+    g_free(s->conns);
+    s->conns = NULL;
+    s->nr_conns = 0;
+    nbd_block_status_cache_set(bs, 0, NULL, 0);
 }
 
 /*
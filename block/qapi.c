@@ -528,8 +528,20 @@ static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
                                  &ds->flush_latency_histogram);
 }
 
+static BlockNodeLatencyStats *bdrv_query_node_latency(BlockDriverState *bs)
+{
+    BlockNodeLatencyStats *s = g_new0(BlockNodeLatencyStats, 1);
+
+    s->read = log_histogram_get_percentiles(&bs->latency[BLOCK_ACCT_READ]);
+    s->write = log_histogram_get_percentiles(&bs->latency[BLOCK_ACCT_WRITE]);
+    s->flush = log_histogram_get_percentiles(&bs->latency[BLOCK_ACCT_FLUSH]);
+    s->discard = log_histogram_get_percentiles(&bs->latency[BLOCK_ACCT_UNMAP]);
+
+    return s;
+}
+
 static BlockStats *bdrv_query_bds_stats(BlockDriverState *bs,
-                                        bool blk_level)
+                                        bool blk_level, bool node_latency)
 {
     BdrvChild *parent_child;
     BlockDriverState *filter_or_cow_bs;
@@ -556,6 +568,11 @@ static BlockStats *bdrv_query_bds_stats(BlockDriverState *bs,
 
     s->stats->wr_highest_offset = stat64_get(&bs->wr_highest_offset);
 
+    if (node_latency) {
+        s->has_node_latency = true;
+        s->node_latency = bdrv_query_node_latency(bs);
+    }
+
     s->driver_specific = bdrv_get_specific_stats(bs);
     if (s->driver_specific) {
         s->has_driver_specific = true;
@@ -589,7 +606,8 @@ static BlockStats *bdrv_query_bds_stats(BlockDriverState *bs,
     }
     if (parent_child) {
         s->has_parent = true;
-        s->parent = bdrv_query_bds_stats(parent_child->bs, blk_level);
+        s->parent = bdrv_query_bds_stats(parent_child->bs, blk_level,
+                                         node_latency);
     }
 
     filter_or_cow_bs = bdrv_filter_or_cow_bs(bs);
@@ -600,7 +618,8 @@ static BlockStats *bdrv_query_bds_stats(BlockDriverState *bs,
          * be either)
          */
         s->has_backing = true;
-        s->backing = bdrv_query_bds_stats(filter_or_cow_bs, blk_level);
+        s->backing = bdrv_query_bds_stats(filter_or_cow_bs, blk_level,
+                                          node_latency);
     }
 
     return s;
@@ -637,6 +656,8 @@ BlockInfoList *qmp_query_block(Error **errp)
 
 BlockStatsList *qmp_query_blockstats(bool has_query_nodes,
                                      bool query_nodes,
+                                     bool has_node_latency,
+                                     bool node_latency,
                                      Error **errp)
 {
     BlockStatsList *head = NULL, **p_next = &head;
@@ -650,7 +671,9 @@ BlockStatsList *qmp_query_blockstats(bool has_query_nodes,
             AioContext *ctx = bdrv_get_aio_context(bs);
 
             aio_context_acquire(ctx);
-            info->value = bdrv_query_bds_stats(bs, false);
+            info->value = bdrv_query_bds_stats(bs, false,
+                                               has_node_latency &&
+                                               node_latency);
             aio_context_release(ctx);
 
             *p_next = info;
@@ -668,7 +691,8 @@ BlockStatsList *qmp_query_blockstats(bool has_query_nodes,
             }
 
             aio_context_acquire(ctx);
-            s = bdrv_query_bds_stats(blk_bs(blk), true);
+            s = bdrv_query_bds_stats(blk_bs(blk), true,
+                                     has_node_latency && node_latency);
             s->has_device = true;
             s->device = g_strdup(blk_name(blk));
 
@@ -28,6 +28,8 @@
 #include "qemu/range.h"
 #include "qemu/bswap.h"
 #include "qemu/cutils.h"
+#include "qemu/units.h"
+#include "block/aio_task.h"
 #include "trace.h"
 
 static int64_t alloc_clusters_noref(BlockDriverState *bs, uint64_t size,
@@ -962,12 +964,69 @@ int qcow2_update_cluster_refcount(BlockDriverState *bs,
 
 
 
+/*
+ * Count the free clusters starting at @cluster_index, looking at no more than
+ * @max clusters and at most up to the end of the refcount block that covers
+ * @cluster_index.  *@used is set to true if the count stopped at a cluster
+ * that is in use.
+ *
+ * This looks up the refcount block only once instead of once per cluster.
+ */
+static int count_free_clusters(BlockDriverState *bs, uint64_t cluster_index,
+                               uint64_t max, uint64_t *nb_free, bool *used)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t refcount_table_index = cluster_index >> s->refcount_block_bits;
+    uint64_t block_index = cluster_index & (s->refcount_block_size - 1);
+    uint64_t limit = MIN(max, s->refcount_block_size - block_index);
+    int64_t refcount_block_offset;
+    void *refcount_block;
+    uint64_t i;
+    int ret;
+
+    *used = false;
+
+    if (refcount_table_index >= s->refcount_table_size ||
+        !(s->refcount_table[refcount_table_index] & REFT_OFFSET_MASK))
+    {
+        *nb_free = limit;
+        return 0;
+    }
+
+    refcount_block_offset =
+        s->refcount_table[refcount_table_index] & REFT_OFFSET_MASK;
+    if (offset_into_cluster(s, refcount_block_offset)) {
+        qcow2_signal_corruption(bs, true, -1, -1, "Refblock offset %#" PRIx64
+                                " unaligned (reftable index: %#" PRIx64 ")",
+                                refcount_block_offset, refcount_table_index);
+        return -EIO;
+    }
+
+    ret = qcow2_cache_get(bs, s->refcount_block_cache, refcount_block_offset,
+                          &refcount_block);
+    if (ret < 0) {
+        return ret;
+    }
+
+    for (i = 0; i < limit; i++) {
+        if (s->get_refcount(refcount_block, block_index + i) != 0) {
+            *used = true;
+            break;
+        }
+    }
+
+    qcow2_cache_put(s->refcount_block_cache, &refcount_block);
+
+    *nb_free = i;
+    return 0;
+}
+
 /* return < 0 if error */
 static int64_t alloc_clusters_noref(BlockDriverState *bs, uint64_t size,
                                     uint64_t max)
 {
     BDRVQcow2State *s = bs->opaque;
-    uint64_t i, nb_clusters, refcount;
+    uint64_t nb_clusters, run_start, found;
     int ret;
 
     /* We can't allocate clusters if they may still be queued for discard. */
@@ -976,17 +1035,27 @@ static int64_t alloc_clusters_noref(BlockDriverState *bs, uint64_t size,
     }
 
     nb_clusters = size_to_clusters(s, size);
-retry:
-    for(i = 0; i < nb_clusters; i++) {
-        uint64_t next_cluster_index = s->free_cluster_index++;
-        ret = qcow2_get_refcount(bs, next_cluster_index, &refcount);
-
+    run_start = s->free_cluster_index;
+    found = 0;
+    while (found < nb_clusters) {
+        uint64_t nb_free;
+        bool used;
+
+        ret = count_free_clusters(bs, run_start + found, nb_clusters - found,
+                                  &nb_free, &used);
         if (ret < 0) {
+            s->free_cluster_index = run_start + found;
             return ret;
-        } else if (refcount != 0) {
-            goto retry;
+        }
+
+        found += nb_free;
+        if (used) {
+            /* Restart after the cluster that is in use */
+            run_start += found + 1;
+            found = 0;
         }
     }
+    s->free_cluster_index = run_start + nb_clusters;
 
     /* Make sure that all offsets in the "allocated" range are representable
      * in the requested max */
@@ -1589,8 +1658,8 @@ enum {
 
 /*
  * Increases the refcount in the given refcount table for the all clusters
- * referenced in the L2 table. While doing so, performs some checks on L2
- * entries.
+ * referenced in the L2 table, which the caller read from l2_offset. While
+ * doing so, performs some checks on L2 entries.
  *
  * Returns the number of errors found by the checks or -errno if an internal
  * error occurred.
@@ -1598,23 +1667,13 @@ enum {
 static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                               void **refcount_table,
                               int64_t *refcount_table_size, int64_t l2_offset,
+                              uint64_t *l2_table,
                               int flags, BdrvCheckMode fix, bool active)
 {
     BDRVQcow2State *s = bs->opaque;
-    uint64_t *l2_table, l2_entry;
+    uint64_t l2_entry;
     uint64_t next_contiguous_offset = 0;
-    int i, l2_size, nb_csectors, ret;
-
-    /* Read L2 table from disk */
-    l2_size = s->l2_size * l2_entry_size(s);
-    l2_table = g_malloc(l2_size);
-
-    ret = bdrv_pread(bs->file, l2_offset, l2_table, l2_size);
-    if (ret < 0) {
-        fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
-        res->check_errors++;
-        goto fail;
-    }
+    int i, nb_csectors, ret;
 
     /* Do the actual checks */
     for(i = 0; i < s->l2_size; i++) {
@@ -1647,7 +1706,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                 l2_entry & QCOW2_COMPRESSED_SECTOR_MASK,
                 nb_csectors * QCOW2_COMPRESSED_SECTOR_SIZE);
             if (ret < 0) {
-                goto fail;
+                return ret;
             }
 
             if (flags & CHECK_FRAG_INFO) {
@@ -1702,7 +1761,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                             res->check_errors++;
                             /* Something is seriously wrong, so abort checking
                              * this L2 table */
-                            goto fail;
+                            return ret;
                         }
 
                         ret = bdrv_pwrite_sync(bs->file, l2e_offset,
@@ -1743,7 +1802,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                                                refcount_table_size,
                                                offset, s->cluster_size);
                 if (ret < 0) {
-                    goto fail;
+                    return ret;
                 }
             }
             break;
@@ -1758,12 +1817,71 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
         }
     }
 
-    g_free(l2_table);
     return 0;
+}
 
-fail:
-    g_free(l2_table);
-    return ret;
+/* L2 tables that check_refcounts_l1() reads ahead at most, and their size */
+#define QCOW2_CHECK_L2_WINDOW       64
+#define QCOW2_CHECK_L2_WINDOW_BYTES (16 * MiB)
+/* Read requests that are in flight at once while reading ahead */
+#define QCOW2_CHECK_L2_INFLIGHT     16
+
+typedef struct Qcow2CheckL2Task {
+    AioTask task;
+    BlockDriverState *bs;
+    uint64_t l2_offset;
+    uint64_t *l2_table;
+    int *ret;
+} Qcow2CheckL2Task;
+
+static int coroutine_fn qcow2_check_l2_read_task(AioTask *task)
+{
+    Qcow2CheckL2Task *t = container_of(task, Qcow2CheckL2Task, task);
+    BDRVQcow2State *s = t->bs->opaque;
+
+    *t->ret = bdrv_co_pread(t->bs->file, t->l2_offset,
+                            s->l2_size * l2_entry_size(s), t->l2_table, 0);
+    return 0;
+}
+
+/*
+ * Read the @n L2 tables at @l2_offsets into @l2_tables.  In coroutine
+ * context the reads are issued in parallel.  The result of each read is
+ * stored in @rets, so that errors are reported in the same order as if
+ * the tables had been read one by one.
+ */
+static void check_read_l2_tables(BlockDriverState *bs,
+                                 const uint64_t *l2_offsets, int n,
+                                 uint64_t **l2_tables, int *rets)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int l2_size = s->l2_size * l2_entry_size(s);
+    AioTaskPool *pool;
+    int i;
+
+    if (n == 1 || !qemu_in_coroutine()) {
+        for (i = 0; i < n; i++) {
+            rets[i] = bdrv_pread(bs->file, l2_offsets[i], l2_tables[i],
+                                 l2_size);
+        }
+        return;
+    }
+
+    pool = aio_task_pool_new(QCOW2_CHECK_L2_INFLIGHT);
+    for (i = 0; i < n; i++) {
+        Qcow2CheckL2Task *t = g_new(Qcow2CheckL2Task, 1);
+
+        *t = (Qcow2CheckL2Task) {
+            .task.func = qcow2_check_l2_read_task,
+            .bs = bs,
+            .l2_offset = l2_offsets[i],
+            .l2_table = l2_tables[i],
+            .ret = &rets[i],
+        };
+        aio_task_pool_start_task(pool, &t->task);
+    }
+    aio_task_pool_wait_all(pool);
+    aio_task_pool_free(pool);
 }
 
 /*
@@ -1783,7 +1901,11 @@ static int check_refcounts_l1(BlockDriverState *bs,
 {
     BDRVQcow2State *s = bs->opaque;
     uint64_t *l1_table = NULL, l2_offset, l1_size2;
-    int i, ret;
+    uint64_t l2_offsets[QCOW2_CHECK_L2_WINDOW];
+    uint64_t *l2_tables[QCOW2_CHECK_L2_WINDOW] = { NULL };
+    int rets[QCOW2_CHECK_L2_WINDOW];
+    int l2_size = s->l2_size * l2_entry_size(s);
+    int window, i, j, n, ret;
 
     l1_size2 = l1_size * L1E_SIZE;
 
@@ -1812,12 +1934,39 @@ static int check_refcounts_l1(BlockDriverState *bs,
             be64_to_cpus(&l1_table[i]);
     }
 
+    /*
+     * Read the L2 tables ahead in windows, so that many reads are in flight
+     * at once.  When repairing, an L2 table can be rewritten while checking
+     * an earlier one if the image is corrupted, so read them one by one.
+     */
+    window = MIN(QCOW2_CHECK_L2_WINDOW,
+                 MAX(1, QCOW2_CHECK_L2_WINDOW_BYTES / l2_size));
+    if (fix & BDRV_FIX_ERRORS) {
+        window = 1;
+    }
+    for (j = 0; j < window; j++) {
+        l2_tables[j] = qemu_try_blockalign(bs->file->bs, l2_size);
+        if (!l2_tables[j]) {
+            ret = -ENOMEM;
+            res->check_errors++;
+            goto fail;
+        }
+    }
+
     /* Do the actual checks */
-    for(i = 0; i < l1_size; i++) {
-        l2_offset = l1_table[i];
-        if (l2_offset) {
+    for (i = 0; i < l1_size; i += n) {
+        int nr_tables = 0;
+
+        for (n = 0; i + n < l1_size && nr_tables < window; n++) {
+            if (l1_table[i + n]) {
+                l2_offsets[nr_tables++] = l1_table[i + n] & L1E_OFFSET_MASK;
+            }
+        }
+        check_read_l2_tables(bs, l2_offsets, nr_tables, l2_tables, rets);
+
+        for (j = 0; j < nr_tables; j++) {
             /* Mark L2 table as used */
-            l2_offset &= L1E_OFFSET_MASK;
+            l2_offset = l2_offsets[j];
             ret = qcow2_inc_refcounts_imrt(bs, res,
                                            refcount_table, refcount_table_size,
                                            l2_offset, s->cluster_size);
@@ -1832,19 +1981,28 @@ static int check_refcounts_l1(BlockDriverState *bs,
                 res->corruptions++;
             }
 
+            if (rets[j] < 0) {
+                fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
+                res->check_errors++;
+                ret = rets[j];
+                goto fail;
+            }
+
             /* Process and check L2 entries */
             ret = check_refcounts_l2(bs, res, refcount_table,
-                                     refcount_table_size, l2_offset, flags,
-                                     fix, active);
+                                     refcount_table_size, l2_offset,
+                                     l2_tables[j], flags, fix, active);
             if (ret < 0) {
                 goto fail;
             }
         }
     }
-    g_free(l1_table);
-    return 0;
+    ret = 0;
 
 fail:
+    for (j = 0; j < QCOW2_CHECK_L2_WINDOW; j++) {
+        qemu_vfree(l2_tables[j]);
+    }
     g_free(l1_table);
     return ret;
 }
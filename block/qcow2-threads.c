@@ -37,8 +37,14 @@
 #include "block/thread-pool.h"
 #include "crypto.h"
 
+/*
+ * Run @func in the thread pool, or in the calling coroutine if @offload
+ * is false.  Either way it takes one of the QCOW2_MAX_THREADS slots,
+ * because the image's crypto ciphers are allocated for that many users.
+ */
 static int coroutine_fn
-qcow2_co_process(BlockDriverState *bs, ThreadPoolFunc *func, void *arg)
+qcow2_co_process(BlockDriverState *bs, ThreadPoolFunc *func, void *arg,
+                 bool offload)
 {
     int ret;
     BDRVQcow2State *s = bs->opaque;
@@ -51,7 +57,7 @@ qcow2_co_process(BlockDriverState *bs, ThreadPoolFunc *func, void *arg)
     s->nb_threads++;
     qemu_co_mutex_unlock(&s->lock);
 
-    ret = thread_pool_submit_co(pool, func, arg);
+    ret = offload ? thread_pool_submit_co(pool, func, arg) : func(arg);
 
     qemu_co_mutex_lock(&s->lock);
     s->nb_threads--;
@@ -67,12 +73,14 @@ qcow2_co_process(BlockDriverState *bs, ThreadPoolFunc *func, void *arg)
  */
 
 typedef ssize_t (*Qcow2CompressFunc)(void *dest, size_t dest_size,
-                                     const void *src, size_t src_size);
+                                     const void *src, size_t src_size,
+                                     int level);
 typedef struct Qcow2CompressData {
     void *dest;
     size_t dest_size;
     const void *src;
     size_t src_size;
+    int level;
     ssize_t ret;
 
     Qcow2CompressFunc func;
@@ -85,20 +93,22 @@ typedef struct Qcow2CompressData {
  *
  * @dest - destination buffer, @dest_size bytes
  * @src - source buffer, @src_size bytes
+ * @level - zlib compression level, 0 for the zlib default
  *
  * Returns: compressed size on success
  *          -ENOMEM destination buffer is not enough to store compressed data
  *          -EIO    on any other error
  */
 static ssize_t qcow2_zlib_compress(void *dest, size_t dest_size,
-                                   const void *src, size_t src_size)
+                                   const void *src, size_t src_size,
+                                   int level)
 {
     ssize_t ret;
     z_stream strm;
 
     /* best compression, small window, no zlib header */
     memset(&strm, 0, sizeof(strm));
-    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+    ret = deflateInit2(&strm, level ?: Z_DEFAULT_COMPRESSION, Z_DEFLATED,
                        -12, 9, Z_DEFAULT_STRATEGY);
     if (ret != Z_OK) {
         return -EIO;
@@ -133,12 +143,14 @@ static ssize_t qcow2_zlib_compress(void *dest, size_t dest_size,
  *
  * @dest - destination buffer, @dest_size bytes
  * @src - source buffer, @src_size bytes
+ * @level - unused
  *
  * Returns: 0 on success
  *          -EIO on fail
  */
 static ssize_t qcow2_zlib_decompress(void *dest, size_t dest_size,
-                                     const void *src, size_t src_size)
+                                     const void *src, size_t src_size,
+                                     int level)
 {
     int ret;
     z_stream strm;
@@ -180,13 +192,15 @@ static ssize_t qcow2_zlib_decompress(void *dest, size_t dest_size,
  *
  * @dest - destination buffer, @dest_size bytes
  * @src - source buffer, @src_size bytes
+ * @level - zstd compression level, 0 for the zstd default
  *
  * Returns: compressed size on success
  *          -ENOMEM destination buffer is not enough to store compressed data
  *          -EIO    on any other error
  */
 static ssize_t qcow2_zstd_compress(void *dest, size_t dest_size,
-                                   const void *src, size_t src_size)
+                                   const void *src, size_t src_size,
+                                   int level)
 {
     ssize_t ret;
     size_t zstd_ret;
@@ -205,6 +219,12 @@ static ssize_t qcow2_zstd_compress(void *dest, size_t dest_size,
     if (!cctx) {
         return -EIO;
     }
+    if (level &&
+        ZSTD_isError(ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel,
+                                            level))) {
+        ret = -EIO;
+        goto out;
+    }
     /*
      * Use the zstd streamed interface for symmetry with decompression,
      * where streaming is essential since we don't record the exact
@@ -249,12 +269,14 @@ out:
  *
  * @dest - destination buffer, @dest_size bytes
  * @src - source buffer, @src_size bytes
+ * @level - unused
  *
  * Returns: 0 on success
  *          -EIO on any error
  */
 static ssize_t qcow2_zstd_decompress(void *dest, size_t dest_size,
-                                     const void *src, size_t src_size)
+                                     const void *src, size_t src_size,
+                                     int level)
 {
     size_t zstd_ret = 0;
     ssize_t ret = 0;
@@ -330,24 +352,26 @@ static int qcow2_compress_pool_func(void *opaque)
     Qcow2CompressData *data = opaque;
 
     data->ret = data->func(data->dest, data->dest_size,
-                           data->src, data->src_size);
+                           data->src, data->src_size, data->level);
 
     return 0;
 }
 
 static ssize_t coroutine_fn
 qcow2_co_do_compress(BlockDriverState *bs, void *dest, size_t dest_size,
-                     const void *src, size_t src_size, Qcow2CompressFunc func)
+                     const void *src, size_t src_size, int level,
+                     Qcow2CompressFunc func)
 {
     Qcow2CompressData arg = {
         .dest = dest,
         .dest_size = dest_size,
         .src = src,
         .src_size = src_size,
+        .level = level,
         .func = func,
     };
 
-    qcow2_co_process(bs, qcow2_compress_pool_func, &arg);
+    qcow2_co_process(bs, qcow2_compress_pool_func, &arg, true);
 
     return arg.ret;
 }
@@ -385,7 +409,29 @@ qcow2_co_compress(BlockDriverState *bs, void *dest, size_t dest_size,
         abort();
     }
 
-    return qcow2_co_do_compress(bs, dest, dest_size, src, src_size, fn);
+    return qcow2_co_do_compress(bs, dest, dest_size, src, src_size,
+                                s->compression_level, fn);
+}
+
+/*
+ * qcow2_max_compression_level()
+ *
+ * Returns the highest compression level that can be configured for the
+ * image's compression type
+ */
+int qcow2_max_compression_level(BDRVQcow2State *s)
+{
+    switch (s->compression_type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+        return Z_BEST_COMPRESSION;
+
+#ifdef CONFIG_ZSTD
+    case QCOW2_COMPRESSION_TYPE_ZSTD:
+        return ZSTD_maxCLevel();
+#endif
+    default:
+        abort();
+    }
 }
 
 /*
@@ -422,7 +468,7 @@ qcow2_co_decompress(BlockDriverState *bs, void *dest, size_t dest_size,
         abort();
     }
 
-    return qcow2_co_do_compress(bs, dest, dest_size, src, src_size, fn);
+    return qcow2_co_do_compress(bs, dest, dest_size, src, src_size, 0, fn);
 }
 
 
@@ -430,6 +476,9 @@ qcow2_co_decompress(BlockDriverState *bs, void *dest, size_t dest_size,
  * Cryptography
  */
 
+/* Largest request that is encrypted or decrypted without offloading */
+#define QCOW2_CRYPT_INLINE_MAX 4096
+
 /*
  * Qcow2EncDecFunc: common prototype of qcrypto_block_encrypt() and
  * qcrypto_block_decrypt() functions.
@@ -475,7 +524,16 @@ qcow2_co_encdec(BlockDriverState *bs, uint64_t host_offset,
     assert(QEMU_IS_ALIGNED(host_offset, sector_size));
     assert(QEMU_IS_ALIGNED(len, sector_size));
 
-    return len == 0 ? 0 : qcow2_co_process(bs, qcow2_encdec_pool_func, &arg);
+    if (len == 0) {
+        return 0;
+    }
+
+    /*
+     * Ciphering a few sectors takes less time than a round trip to
+     * the thread pool, so do it right away.
+     */
+    return qcow2_co_process(bs, qcow2_encdec_pool_func, &arg,
+                            len > QCOW2_CRYPT_INLINE_MAX);
 }
 
 /*
@@ -525,3 +583,45 @@ qcow2_co_decrypt(BlockDriverState *bs, uint64_t host_offset,
     return qcow2_co_encdec(bs, host_offset, guest_offset, buf, len,
                            qcrypto_block_decrypt);
 }
+
+/*
+ * qcow2_crypt_buf_get()
+ *
+ * Returns a bounce buffer of at least @len bytes for encrypted I/O,
+ * or NULL if it cannot be allocated.  Buffers of up to
+ * QCOW2_CRYPT_BUF_SIZE bytes are recycled by qcow2_crypt_buf_put(),
+ * so that most requests do not need to allocate memory.
+ */
+void *qcow2_crypt_buf_get(BlockDriverState *bs, size_t len)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (len > QCOW2_CRYPT_BUF_SIZE) {
+        return qemu_try_blockalign(s->data_file->bs, len);
+    }
+    if (s->nb_crypt_bufs) {
+        return s->crypt_bufs[--s->nb_crypt_bufs];
+    }
+    return qemu_try_blockalign(s->data_file->bs, QCOW2_CRYPT_BUF_SIZE);
+}
+
+void qcow2_crypt_buf_put(BlockDriverState *bs, void *buf, size_t len)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (len <= QCOW2_CRYPT_BUF_SIZE &&
+        s->nb_crypt_bufs < ARRAY_SIZE(s->crypt_bufs)) {
+        s->crypt_bufs[s->nb_crypt_bufs++] = buf;
+    } else {
+        qemu_vfree(buf);
+    }
+}
+
+void qcow2_crypt_bufs_free(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    while (s->nb_crypt_bufs) {
+        qemu_vfree(s->crypt_bufs[--s->nb_crypt_bufs]);
+    }
+}
@@ -697,6 +697,7 @@ static const char *const mutable_opts[] = {
     QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
     QCOW2_OPT_REFCOUNT_CACHE_SIZE,
     QCOW2_OPT_CACHE_CLEAN_INTERVAL,
+    QCOW2_OPT_COMPRESSION_LEVEL,
     NULL
 };
 
@@ -808,6 +809,18 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "Clean unused cache entries after this time (in seconds)",
         },
+        {
+            .name = QCOW2_OPT_COMPRESSION_LEVEL,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Compression level for compressed writes "
+                    "(0 = default of the compression method)",
+        },
+        {
+            .name = QCOW2_OPT_L2_CACHE_PREFETCH,
+            .type = QEMU_OPT_BOOL,
+            .help = "Fill the L2 table cache in the background after "
+                    "opening the image",
+        },
         BLOCK_CRYPTO_OPT_DEF_KEY_SECRET("encrypt.",
             "ID of secret providing qcow2 AES key or LUKS passphrase"),
         { /* end of list */ }
@@ -836,6 +849,65 @@ static void cache_clean_timer_cb(void *opaque)
               (int64_t) s->cache_clean_interval * 1000);
 }
 
+/*
+ * Load L2 slices into the cache, in guest offset order, until the cache is
+ * full.  This is only a hint, so errors simply stop the prefetch, and so does
+ * draining the node so that the prefetch never delays a drained section for
+ * longer than one slice read.
+ */
+static void coroutine_fn qcow2_prefetch_l2_entry(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t slice_bytes = s->l2_slice_size * l2_entry_size(s);
+    int slices_per_table = s->cluster_size / slice_bytes;
+    int max_slices = qcow2_cache_get_num_tables(s->l2_table_cache);
+    int loaded = 0;
+    int i, j;
+
+    for (i = 0; i < s->l1_size && loaded < max_slices; i++) {
+        for (j = 0; j < slices_per_table && loaded < max_slices; j++) {
+            uint64_t l2_offset;
+            void *l2_slice;
+            int ret;
+
+            if (qatomic_read(&bs->quiesce_counter)) {
+                goto out;
+            }
+
+            qemu_co_mutex_lock(&s->lock);
+            /* The L1 table may have been changed while we were waiting */
+            l2_offset = i < s->l1_size ? s->l1_table[i] & L1E_OFFSET_MASK : 0;
+            if (!l2_offset || offset_into_cluster(s, l2_offset)) {
+                qemu_co_mutex_unlock(&s->lock);
+                break;
+            }
+            ret = qcow2_cache_get(bs, s->l2_table_cache,
+                                  l2_offset + j * slice_bytes, &l2_slice);
+            if (ret == 0) {
+                qcow2_cache_put(s->l2_table_cache, &l2_slice);
+            }
+            qemu_co_mutex_unlock(&s->lock);
+            if (ret < 0) {
+                goto out;
+            }
+            loaded++;
+        }
+    }
+
+out:
+    trace_qcow2_l2_prefetch_done(bs, loaded);
+    bdrv_dec_in_flight(bs);
+}
+
+static void qcow2_start_l2_prefetch(BlockDriverState *bs)
+{
+    Coroutine *co = qemu_coroutine_create(qcow2_prefetch_l2_entry, bs);
+
+    bdrv_inc_in_flight(bs);
+    aio_co_enter(bdrv_get_aio_context(bs), co);
+}
+
 static void cache_clean_timer_init(BlockDriverState *bs, AioContext *context)
 {
     BDRVQcow2State *s = bs->opaque;
@@ -967,6 +1039,8 @@ typedef struct Qcow2ReopenState {
     int overlap_check;
     bool discard_passthrough[QCOW2_DISCARD_MAX];
     uint64_t cache_clean_interval;
+    int compression_level;
+    bool l2_cache_prefetch;
     QCryptoBlockOpenOptions *crypto_opts; /* Disk encryption runtime options */
 } Qcow2ReopenState;
 
@@ -980,6 +1054,7 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
     const char *opt_overlap_check, *opt_overlap_check_template;
     int overlap_check_template = 0;
     uint64_t l2_cache_size, l2_cache_entry_size, refcount_cache_size;
+    uint64_t compression_level;
     int i;
     const char *encryptfmt;
     QDict *encryptopts = NULL;
@@ -1071,6 +1146,20 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         goto fail;
     }
 
+    compression_level =
+        qemu_opt_get_number(opts, QCOW2_OPT_COMPRESSION_LEVEL, 0);
+    if (compression_level > qcow2_max_compression_level(s)) {
+        error_setg(errp, QCOW2_OPT_COMPRESSION_LEVEL " must be between 0 and "
+                   "%d for this image's compression type",
+                   qcow2_max_compression_level(s));
+        ret = -EINVAL;
+        goto fail;
+    }
+    r->compression_level = compression_level;
+
+    r->l2_cache_prefetch = qemu_opt_get_bool(opts, QCOW2_OPT_L2_CACHE_PREFETCH,
+                                             false);
+
     /* lazy-refcounts; flush if going from enabled to disabled */
     r->use_lazy_refcounts = qemu_opt_get_bool(opts, QCOW2_OPT_LAZY_REFCOUNTS,
         (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS));
@@ -1210,6 +1299,8 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
 
     s->overlap_check = r->overlap_check;
     s->use_lazy_refcounts = r->use_lazy_refcounts;
+    s->compression_level = r->compression_level;
+    s->l2_cache_prefetch = r->l2_cache_prefetch;
 
     for (i = 0; i < QCOW2_DISCARD_MAX; i++) {
         s->discard_passthrough[i] = r->discard_passthrough[i];
@@ -1833,6 +1924,10 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
 
     qemu_co_queue_init(&s->thread_task_queue);
 
+    if (s->l2_cache_prefetch && !(flags & BDRV_O_INACTIVE)) {
+        qcow2_start_l2_prefetch(bs);
+    }
+
     return ret;
 
  fail:
@@ -2146,7 +2241,7 @@ qcow2_co_preadv_encrypted(BlockDriverState *bs,
      * encrypted nature of the virtual disk.
      */
 
-    buf = qemu_try_blockalign(s->data_file->bs, bytes);
+    buf = qcow2_crypt_buf_get(bs, bytes);
     if (buf == NULL) {
         return -ENOMEM;
     }
@@ -2165,7 +2260,7 @@ qcow2_co_preadv_encrypted(BlockDriverState *bs,
     qemu_iovec_from_buf(qiov, qiov_offset, buf, bytes);
 
 fail:
-    qemu_vfree(buf);
+    qcow2_crypt_buf_put(bs, buf, bytes);
 
     return ret;
 }
@@ -2279,6 +2374,43 @@ static coroutine_fn int qcow2_co_preadv_task_entry(AioTask *task)
                                 t->qiov, t->qiov_offset);
 }
 
+/*
+ * Check whether the extent returned by qcow2_get_host_offset() for @offset
+ * can be read with the same request as the preceding, still unsubmitted
+ * extent.  This is the case if both are read from the data file at adjacent
+ * host offsets, or if both are read from the backing file.
+ *
+ * qcow2_get_host_offset() never crosses an L2 slice boundary, so without
+ * this, a sequential read of an image whose clusters are contiguous in the
+ * host file is still split into one request per L2 slice.
+ */
+static bool qcow2_can_merge_read(BlockDriverState *bs,
+                                 QCow2SubclusterType prev_type,
+                                 uint64_t prev_host_offset,
+                                 uint64_t prev_offset, uint64_t prev_bytes,
+                                 QCow2SubclusterType type,
+                                 uint64_t host_offset, uint64_t offset)
+{
+    if (prev_offset + prev_bytes != offset) {
+        return false;
+    }
+
+    switch (type) {
+    case QCOW2_SUBCLUSTER_NORMAL:
+        /* Encrypted reads are bounced through a buffer of limited size */
+        return !bs->encrypted && prev_type == QCOW2_SUBCLUSTER_NORMAL &&
+               prev_host_offset + prev_bytes == host_offset;
+
+    case QCOW2_SUBCLUSTER_UNALLOCATED_PLAIN:
+    case QCOW2_SUBCLUSTER_UNALLOCATED_ALLOC:
+        return prev_type == QCOW2_SUBCLUSTER_UNALLOCATED_PLAIN ||
+               prev_type == QCOW2_SUBCLUSTER_UNALLOCATED_ALLOC;
+
+    default:
+        return false;
+    }
+}
+
 static coroutine_fn int qcow2_co_preadv_part(BlockDriverState *bs,
                                              uint64_t offset, uint64_t bytes,
                                              QEMUIOVector *qiov,
@@ -2290,6 +2422,10 @@ static coroutine_fn int qcow2_co_preadv_part(BlockDriverState *bs,
     uint64_t host_offset = 0;
     QCow2SubclusterType type;
     AioTaskPool *aio = NULL;
+    /* Data that has been looked up, but not submitted yet */
+    QCow2SubclusterType pending_type = QCOW2_SUBCLUSTER_NORMAL;
+    uint64_t pending_host_offset = 0, pending_offset = 0, pending_bytes = 0;
+    size_t pending_qiov_offset = 0;
 
     while (bytes != 0 && aio_task_pool_status(aio) == 0) {
         /* prepare next request */
@@ -2313,16 +2449,31 @@ static coroutine_fn int qcow2_co_preadv_part(BlockDriverState *bs,
             (type == QCOW2_SUBCLUSTER_UNALLOCATED_ALLOC && !bs->backing))
         {
             qemu_iovec_memset(qiov, qiov_offset, 0, cur_bytes);
+        } else if (pending_bytes &&
+                   qcow2_can_merge_read(bs, pending_type, pending_host_offset,
+                                        pending_offset, pending_bytes,
+                                        type, host_offset, offset))
+        {
+            pending_bytes += cur_bytes;
         } else {
-            if (!aio && cur_bytes != bytes) {
-                aio = aio_task_pool_new(QCOW2_MAX_WORKERS);
-            }
-            ret = qcow2_add_task(bs, aio, qcow2_co_preadv_task_entry, type,
-                                 host_offset, offset, cur_bytes,
-                                 qiov, qiov_offset, NULL);
-            if (ret < 0) {
-                goto out;
+            if (pending_bytes) {
+                /* There will be at least one more task after this one */
+                if (!aio) {
+                    aio = aio_task_pool_new(QCOW2_MAX_WORKERS);
+                }
+                ret = qcow2_add_task(bs, aio, qcow2_co_preadv_task_entry,
+                                     pending_type, pending_host_offset,
+                                     pending_offset, pending_bytes,
+                                     qiov, pending_qiov_offset, NULL);
+                if (ret < 0) {
+                    goto out;
+                }
             }
+            pending_type = type;
+            pending_host_offset = host_offset;
+            pending_offset = offset;
+            pending_bytes = cur_bytes;
+            pending_qiov_offset = qiov_offset;
         }
 
         bytes -= cur_bytes;
@@ -2330,6 +2481,13 @@ static coroutine_fn int qcow2_co_preadv_part(BlockDriverState *bs,
         qiov_offset += cur_bytes;
     }
 
+    if (pending_bytes && aio_task_pool_status(aio) == 0) {
+        ret = qcow2_add_task(bs, aio, qcow2_co_preadv_task_entry,
+                             pending_type, pending_host_offset,
+                             pending_offset, pending_bytes,
+                             qiov, pending_qiov_offset, NULL);
+    }
+
 out:
     if (aio) {
         aio_task_pool_wait_all(aio);
@@ -2498,7 +2656,7 @@ static coroutine_fn int qcow2_co_pwritev_task(BlockDriverState *bs,
     if (bs->encrypted) {
         assert(s->crypto);
         assert(bytes <= QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size);
-        crypt_buf = qemu_try_blockalign(bs->file->bs, bytes);
+        crypt_buf = qcow2_crypt_buf_get(bs, bytes);
         if (crypt_buf == NULL) {
             ret = -ENOMEM;
             goto out_unlocked;
@@ -2549,7 +2707,9 @@ out_locked:
     qcow2_handle_l2meta(bs, &l2meta, false);
     qemu_co_mutex_unlock(&s->lock);
 
-    qemu_vfree(crypt_buf);
+    if (crypt_buf) {
+        qcow2_crypt_buf_put(bs, crypt_buf, bytes);
+    }
 
     return ret;
 }
@@ -2700,6 +2860,7 @@ static void qcow2_close(BlockDriverState *bs)
     qcrypto_block_free(s->crypto);
     s->crypto = NULL;
     qapi_free_QCryptoBlockOpenOptions(s->crypto_opts);
+    qcow2_crypt_bufs_free(bs);
 
     g_free(s->unknown_header_fields);
     cleanup_unknown_header_ext(bs);
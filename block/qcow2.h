@@ -150,6 +150,8 @@
 #define QCOW2_OPT_L2_CACHE_ENTRY_SIZE "l2-cache-entry-size"
 #define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
 #define QCOW2_OPT_CACHE_CLEAN_INTERVAL "cache-clean-interval"
+#define QCOW2_OPT_COMPRESSION_LEVEL "compression-level"
+#define QCOW2_OPT_L2_CACHE_PREFETCH "l2-cache-prefetch"
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -324,6 +326,12 @@ typedef struct Qcow2BitmapHeaderExt {
 
 #define QCOW2_MAX_THREADS 4
 
+/*
+ * Size of the bounce buffers kept around for encrypted I/O; larger
+ * requests allocate their own buffer.
+ */
+#define QCOW2_CRYPT_BUF_SIZE (1 * MiB)
+
 typedef struct BDRVQcow2State {
     int cluster_bits;
     int cluster_size;
@@ -409,6 +417,10 @@ typedef struct BDRVQcow2State {
     CoQueue thread_task_queue;
     int nb_threads;
 
+    /* Idle bounce buffers for encrypted I/O, QCOW2_CRYPT_BUF_SIZE bytes */
+    void *crypt_bufs[QCOW2_MAX_WORKERS];
+    int nb_crypt_bufs;
+
     BdrvChild *data_file;
 
     bool metadata_preallocation_checked;
@@ -420,6 +432,10 @@ typedef struct BDRVQcow2State {
      * is to convert the image with the desired compression type set.
      */
     Qcow2CompressionType compression_type;
+    /* Level passed to the compression library, 0 for its default */
+    int compression_level;
+    /* Fill the L2 cache in the background after opening the image */
+    bool l2_cache_prefetch;
 } BDRVQcow2State;
 
 typedef struct Qcow2COWRegion {
@@ -973,6 +989,7 @@ int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 void qcow2_cache_put(Qcow2Cache *c, void **table);
 void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset);
 void qcow2_cache_discard(Qcow2Cache *c, void *table);
+int qcow2_cache_get_num_tables(Qcow2Cache *c);
 
 /* qcow2-bitmap.c functions */
 int qcow2_check_bitmaps_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
@@ -1000,6 +1017,7 @@ uint64_t qcow2_get_persistent_dirty_bitmap_size(BlockDriverState *bs,
 ssize_t coroutine_fn
 qcow2_co_compress(BlockDriverState *bs, void *dest, size_t dest_size,
                   const void *src, size_t src_size);
+int qcow2_max_compression_level(BDRVQcow2State *s);
 ssize_t coroutine_fn
 qcow2_co_decompress(BlockDriverState *bs, void *dest, size_t dest_size,
                     const void *src, size_t src_size);
@@ -1009,5 +1027,8 @@ qcow2_co_encrypt(BlockDriverState *bs, uint64_t host_offset,
 int coroutine_fn
 qcow2_co_decrypt(BlockDriverState *bs, uint64_t host_offset,
                  uint64_t guest_offset, void *buf, size_t len);
+void *qcow2_crypt_buf_get(BlockDriverState *bs, size_t len);
+void qcow2_crypt_buf_put(BlockDriverState *bs, void *buf, size_t len);
+void qcow2_crypt_bufs_free(BlockDriverState *bs);
 
 #endif
@@ -0,0 +1,743 @@
+/*
+ * QEMU block QoS filter driver (mClock scheduling)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 or
+ * (at your option) version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The nodes of this driver share a qos-group object, which stands for the
+ * storage they compete for.  The group lets at most max-in-flight requests
+ * through at the same time and decides which request goes next using the
+ * mClock algorithm (Gulati et al., OSDI 2010).  Each member has
+ *
+ *  - a reservation: the number of requests per second it gets even if
+ *    the other members are busy,
+ *  - a limit: the number of requests per second it never exceeds, and
+ *  - a weight: how the remaining capacity is shared.
+ *
+ * Every request is tagged with three timestamps on arrival, which are
+ * spaced 1/reservation, 1/limit and 1/weight seconds apart for consecutive
+ * requests of one member.  Requests whose reservation tag is due are
+ * served first, in tag order.  Otherwise, the request with the lowest
+ * weight tag among those whose limit tag is due is served, and the
+ * reservation tags of its member are moved back so such requests do not
+ * count against the reservation.
+ *
+ * All requests count as one unit, independent of their size.
+ */
+
+#include "qemu/osdep.h"
+#include "block/block_int.h"
+#include "qapi/error.h"
+#include "qapi/visitor.h"
+#include "qemu/coroutine.h"
+#include "qemu/main-loop.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qom/object.h"
+#include "qom/object_interfaces.h"
+
+#define QOS_OPT_GROUP       "qos-group"
+#define QOS_OPT_WEIGHT      "weight"
+#define QOS_OPT_RESERVATION "reservation"
+#define QOS_OPT_LIMIT       "limit"
+
+#define QOS_DEFAULT_WEIGHT          100
+#define QOS_DEFAULT_MAX_IN_FLIGHT   16
+
+#define TYPE_QOS_GROUP "qos-group"
+OBJECT_DECLARE_SIMPLE_TYPE(QosGroup, QOS_GROUP)
+
+typedef struct BDRVQosState BDRVQosState;
+
+typedef struct QosRequest {
+    Coroutine *co;
+    int64_t reservation_tag;
+    int64_t limit_tag;
+    int64_t weight_tag;
+    bool picked;
+    QTAILQ_ENTRY(QosRequest) next;
+} QosRequest;
+
+typedef QTAILQ_HEAD(, QosRequest) QosRequestList;
+
+struct QosGroup {
+    Object parent_obj;
+
+    /* Constant after the object is complete */
+    uint32_t max_in_flight;
+    bool is_initialized;
+
+    QemuMutex lock; /* protects the following fields and the members' state */
+    QLIST_HEAD(, BDRVQosState) members;
+    unsigned in_flight;
+    QEMUTimer *timer; /* wakes up the scheduler for requests over the limit */
+};
+
+struct BDRVQosState {
+    QosGroup *group;
+
+    /* Requests per second, 0 means none; protected by group->lock */
+    uint32_t weight;
+    uint32_t reservation;
+    uint32_t limit;
+
+    /* The tags of the latest request; protected by group->lock */
+    int64_t reservation_tag;
+    int64_t limit_tag;
+    int64_t weight_tag;
+
+    QosRequestList queue;
+    QLIST_ENTRY(BDRVQosState) next;
+
+    /* Nonzero while the node is drained; accessed with atomic operations */
+    unsigned int disabled;
+};
+
+typedef struct QosReopenState {
+    uint32_t weight;
+    uint32_t reservation;
+    uint32_t limit;
+} QosReopenState;
+
+static QemuOptsList qos_runtime_opts = {
+    .name = "qos",
+    .head = QTAILQ_HEAD_INITIALIZER(qos_runtime_opts.head),
+    .desc = {
+        {
+            .name = QOS_OPT_GROUP,
+            .type = QEMU_OPT_STRING,
+            .help = "ID of the qos-group object",
+        },
+        {
+            .name = QOS_OPT_WEIGHT,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Share of the spare capacity (default: 100)",
+        },
+        {
+            .name = QOS_OPT_RESERVATION,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Guaranteed requests per second (default: none)",
+        },
+        {
+            .name = QOS_OPT_LIMIT,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Maximum requests per second (default: none)",
+        },
+        { /* end of list */ }
+    },
+};
+
+static int64_t qos_interval(uint32_t rate)
+{
+    return NANOSECONDS_PER_SECOND / rate;
+}
+
+/*
+ * Pick the next request to run, or return NULL if none can run now.  In
+ * that case, *next_ns is set to the time at which a request that is only
+ * held back by its limit becomes ready, or INT64_MAX.
+ *
+ * This assumes that group->lock is held.
+ */
+static QosRequest *qos_group_pick(QosGroup *g, int64_t now, int64_t *next_ns,
+                                  BDRVQosState **owner)
+{
+    BDRVQosState *s;
+    QosRequest *req, *pick = NULL;
+
+    *next_ns = INT64_MAX;
+
+    /* Constraint phase: requests with a due reservation */
+    QLIST_FOREACH(s, &g->members, next) {
+        req = QTAILQ_FIRST(&s->queue);
+        if (req && s->reservation && req->reservation_tag <= now &&
+            (!pick || req->reservation_tag < pick->reservation_tag)) {
+            pick = req;
+            *owner = s;
+        }
+    }
+    if (pick) {
+        return pick;
+    }
+
+    /* Weight phase: lowest weight tag among the requests within the limit */
+    QLIST_FOREACH(s, &g->members, next) {
+        req = QTAILQ_FIRST(&s->queue);
+        if (!req) {
+            continue;
+        }
+        if (req->limit_tag > now) {
+            *next_ns = MIN(*next_ns, req->limit_tag);
+            continue;
+        }
+        if (!pick || req->weight_tag < pick->weight_tag) {
+            pick = req;
+            *owner = s;
+        }
+    }
+
+    if (pick && (*owner)->reservation) {
+        /* This request does not count against the reservation */
+        int64_t interval = qos_interval((*owner)->reservation);
+
+        QTAILQ_FOREACH(req, &(*owner)->queue, next) {
+            req->reservation_tag -= interval;
+        }
+        (*owner)->reservation_tag -= interval;
+    }
+
+    return pick;
+}
+
+/*
+ * Start as many queued requests as the group allows, by moving them to
+ * @ready.  The caller wakes them up with qos_wake_requests() once it has
+ * dropped the lock, because a woken request can run right away and finish,
+ * and qos_co_end() takes the lock again.
+ *
+ * This assumes that group->lock is held.
+ */
+static void qos_group_schedule(QosGroup *g, QosRequestList *ready)
+{
+    while (g->in_flight < g->max_in_flight) {
+        int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        int64_t next_ns;
+        BDRVQosState *s;
+        QosRequest *req;
+
+        req = qos_group_pick(g, now, &next_ns, &s);
+        if (!req) {
+            if (next_ns != INT64_MAX) {
+                timer_mod(g->timer, next_ns);
+            }
+            break;
+        }
+
+        QTAILQ_REMOVE(&s->queue, req, next);
+        QTAILQ_INSERT_TAIL(ready, req, next);
+        req->picked = true;
+        g->in_flight++;
+    }
+}
+
+/* Wake up the requests that qos_group_schedule() picked */
+static void qos_wake_requests(QosRequestList *ready)
+{
+    QosRequest *req, *next_req;
+
+    /* The request lives on the stack of its coroutine, don't touch it after */
+    QTAILQ_FOREACH_SAFE(req, ready, next, next_req) {
+        aio_co_wake(req->co);
+    }
+}
+
+static void qos_group_timer_cb(void *opaque)
+{
+    QosGroup *g = opaque;
+    QosRequestList ready = QTAILQ_HEAD_INITIALIZER(ready);
+
+    qemu_mutex_lock(&g->lock);
+    qos_group_schedule(g, &ready);
+    qemu_mutex_unlock(&g->lock);
+
+    qos_wake_requests(&ready);
+}
+
+/* Wait until the group lets a request of this node run */
+static void coroutine_fn qos_co_start(BDRVQosState *s)
+{
+    QosGroup *g = s->group;
+    QosRequestList ready = QTAILQ_HEAD_INITIALIZER(ready);
+    int64_t now;
+    QosRequest req;
+    bool queued;
+
+    qemu_mutex_lock(&g->lock);
+
+    if (qatomic_read(&s->disabled)) {
+        g->in_flight++;
+        qemu_mutex_unlock(&g->lock);
+        return;
+    }
+
+    now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    req = (QosRequest) {
+        .co = qemu_coroutine_self(),
+        .reservation_tag = s->reservation ?
+            MAX(s->reservation_tag + qos_interval(s->reservation), now) : 0,
+        .limit_tag = s->limit ?
+            MAX(s->limit_tag + qos_interval(s->limit), now) : 0,
+        .weight_tag = MAX(s->weight_tag + qos_interval(s->weight), now),
+    };
+    s->reservation_tag = req.reservation_tag;
+    s->limit_tag = req.limit_tag;
+    s->weight_tag = req.weight_tag;
+
+    QTAILQ_INSERT_TAIL(&s->queue, &req, next);
+    qos_group_schedule(g, &ready);
+
+    /* We may have been picked right away, together with others */
+    queued = !req.picked;
+    if (!queued) {
+        QTAILQ_REMOVE(&ready, &req, next);
+    }
+    qemu_mutex_unlock(&g->lock);
+
+    qos_wake_requests(&ready);
+    if (queued) {
+        /* qos_wake_requests() of someone else will wake us up */
+        qemu_coroutine_yield();
+    }
+}
+
+static void qos_co_end(BDRVQosState *s)
+{
+    QosGroup *g = s->group;
+    QosRequestList ready = QTAILQ_HEAD_INITIALIZER(ready);
+
+    qemu_mutex_lock(&g->lock);
+    g->in_flight--;
+    qos_group_schedule(g, &ready);
+    qemu_mutex_unlock(&g->lock);
+
+    qos_wake_requests(&ready);
+}
+
+/* Let all queued requests of a node run, ignoring the group's rules */
+static void qos_release_all(BDRVQosState *s)
+{
+    QosGroup *g = s->group;
+    QosRequestList ready = QTAILQ_HEAD_INITIALIZER(ready);
+    QosRequest *req;
+
+    qemu_mutex_lock(&g->lock);
+    while ((req = QTAILQ_FIRST(&s->queue))) {
+        QTAILQ_REMOVE(&s->queue, req, next);
+        QTAILQ_INSERT_TAIL(&ready, req, next);
+        g->in_flight++;
+    }
+    qemu_mutex_unlock(&g->lock);
+
+    qos_wake_requests(&ready);
+}
+
+static QosGroup *qos_group_find(const char *id, Error **errp)
+{
+    Object *obj;
+    QosGroup *g;
+
+    obj = object_resolve_path_component(object_get_objects_root(), id);
+    if (!obj) {
+        error_setg(errp, "QoS group '%s' does not exist", id);
+        return NULL;
+    }
+    g = (QosGroup *)object_dynamic_cast(obj, TYPE_QOS_GROUP);
+    if (!g) {
+        error_setg(errp, "Object '%s' is not a qos-group", id);
+        return NULL;
+    }
+
+    return g;
+}
+
+static int qos_parse_options(QDict *options, const char **group,
+                             QosReopenState *rs, Error **errp)
+{
+    QemuOpts *opts;
+    uint64_t weight, reservation, limit;
+    int ret = -EINVAL;
+
+    opts = qemu_opts_create(&qos_runtime_opts, NULL, 0, &error_abort);
+    if (!qemu_opts_absorb_qdict(opts, options, errp)) {
+        goto fail;
+    }
+
+    if (group) {
+        *group = qemu_opt_get(opts, QOS_OPT_GROUP);
+        if (!*group) {
+            error_setg(errp, "Please specify a QoS group");
+            goto fail;
+        }
+        *group = g_strdup(*group);
+    }
+
+    weight = qemu_opt_get_number(opts, QOS_OPT_WEIGHT, QOS_DEFAULT_WEIGHT);
+    reservation = qemu_opt_get_number(opts, QOS_OPT_RESERVATION, 0);
+    limit = qemu_opt_get_number(opts, QOS_OPT_LIMIT, 0);
+
+    if (weight < 1 || weight > NANOSECONDS_PER_SECOND) {
+        error_setg(errp, "weight must be between 1 and %" PRIu64,
+                   (uint64_t)NANOSECONDS_PER_SECOND);
+        goto fail;
+    }
+    if (reservation > NANOSECONDS_PER_SECOND ||
+        limit > NANOSECONDS_PER_SECOND) {
+        error_setg(errp, "reservation and limit must not exceed %" PRIu64,
+                   (uint64_t)NANOSECONDS_PER_SECOND);
+        goto fail;
+    }
+    if (limit && reservation > limit) {
+        error_setg(errp, "reservation must not exceed limit");
+        goto fail;
+    }
+
+    *rs = (QosReopenState) {
+        .weight = weight,
+        .reservation = reservation,
+        .limit = limit,
+    };
+    ret = 0;
+
+fail:
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static int qos_open(BlockDriverState *bs, QDict *options, int flags,
+                    Error **errp)
+{
+    BDRVQosState *s = bs->opaque;
+    QosReopenState rs;
+    const char *group_name = NULL;
+    QosGroup *g;
+    int ret;
+
+    bs->file = bdrv_open_child(NULL, options, "file", bs, &child_of_bds,
+                               BDRV_CHILD_FILTERED | BDRV_CHILD_PRIMARY,
+                               false, errp);
+    if (!bs->file) {
+        return -EINVAL;
+    }
+    bs->supported_write_flags = bs->file->bs->supported_write_flags |
+                                BDRV_REQ_WRITE_UNCHANGED;
+    bs->supported_zero_flags = bs->file->bs->supported_zero_flags |
+                               BDRV_REQ_WRITE_UNCHANGED;
+
+    ret = qos_parse_options(options, &group_name, &rs, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    g = qos_group_find(group_name, errp);
+    g_free((char *)group_name);
+    if (!g) {
+        return -EINVAL;
+    }
+
+    object_ref(OBJECT(g));
+    s->group = g;
+    s->weight = rs.weight;
+    s->reservation = rs.reservation;
+    s->limit = rs.limit;
+    QTAILQ_INIT(&s->queue);
+
+    qemu_mutex_lock(&g->lock);
+    QLIST_INSERT_HEAD(&g->members, s, next);
+    qemu_mutex_unlock(&g->lock);
+
+    return 0;
+}
+
+static void qos_close(BlockDriverState *bs)
+{
+    BDRVQosState *s = bs->opaque;
+    QosGroup *g = s->group;
+
+    /* The node is drained, so there are no queued requests */
+    assert(QTAILQ_EMPTY(&s->queue));
+
+    qemu_mutex_lock(&g->lock);
+    QLIST_REMOVE(s, next);
+    qemu_mutex_unlock(&g->lock);
+
+    object_unref(OBJECT(g));
+}
+
+static int64_t qos_getlength(BlockDriverState *bs)
+{
+    return bdrv_getlength(bs->file->bs);
+}
+
+static int coroutine_fn qos_co_preadv(BlockDriverState *bs,
+                                      uint64_t offset, uint64_t bytes,
+                                      QEMUIOVector *qiov, int flags)
+{
+    BDRVQosState *s = bs->opaque;
+    int ret;
+
+    qos_co_start(s);
+    ret = bdrv_co_preadv(bs->file, offset, bytes, qiov, flags);
+    qos_co_end(s);
+
+    return ret;
+}
+
+static int coroutine_fn qos_co_pwritev(BlockDriverState *bs,
+                                       uint64_t offset, uint64_t bytes,
+                                       QEMUIOVector *qiov, int flags)
+{
+    BDRVQosState *s = bs->opaque;
+    int ret;
+
+    qos_co_start(s);
+    ret = bdrv_co_pwritev(bs->file, offset, bytes, qiov, flags);
+    qos_co_end(s);
+
+    return ret;
+}
+
+static int coroutine_fn qos_co_pwrite_zeroes(BlockDriverState *bs,
+                                             int64_t offset, int bytes,
+                                             BdrvRequestFlags flags)
+{
+    BDRVQosState *s = bs->opaque;
+    int ret;
+
+    qos_co_start(s);
+    ret = bdrv_co_pwrite_zeroes(bs->file, offset, bytes, flags);
+    qos_co_end(s);
+
+    return ret;
+}
+
+static int coroutine_fn qos_co_pdiscard(BlockDriverState *bs,
+                                        int64_t offset, int bytes)
+{
+    BDRVQosState *s = bs->opaque;
+    int ret;
+
+    qos_co_start(s);
+    ret = bdrv_co_pdiscard(bs->file, offset, bytes);
+    qos_co_end(s);
+
+    return ret;
+}
+
+static int coroutine_fn qos_co_pwritev_compressed(BlockDriverState *bs,
+                                                  uint64_t offset,
+                                                  uint64_t bytes,
+                                                  QEMUIOVector *qiov)
+{
+    return qos_co_pwritev(bs, offset, bytes, qiov, BDRV_REQ_WRITE_COMPRESSED);
+}
+
+static int qos_co_flush(BlockDriverState *bs)
+{
+    return bdrv_co_flush(bs->file->bs);
+}
+
+static int qos_reopen_prepare(BDRVReopenState *reopen_state,
+                              BlockReopenQueue *queue, Error **errp)
+{
+    BDRVQosState *s = reopen_state->bs->opaque;
+    QosReopenState *rs;
+    const char *group_name = NULL;
+    int ret;
+
+    rs = g_new0(QosReopenState, 1);
+    ret = qos_parse_options(reopen_state->options, &group_name, rs, errp);
+    if (ret < 0) {
+        g_free(rs);
+        return ret;
+    }
+
+    if (strcmp(group_name,
+               object_get_canonical_path_component(OBJECT(s->group)))) {
+        error_setg(errp, "Cannot change the QoS group of a node");
+        g_free((char *)group_name);
+        g_free(rs);
+        return -EINVAL;
+    }
+    g_free((char *)group_name);
+
+    reopen_state->opaque = rs;
+    return 0;
+}
+
+static void qos_reopen_commit(BDRVReopenState *reopen_state)
+{
+    BDRVQosState *s = reopen_state->bs->opaque;
+    QosReopenState *rs = reopen_state->opaque;
+
+    qemu_mutex_lock(&s->group->lock);
+    s->weight = rs->weight;
+    s->reservation = rs->reservation;
+    s->limit = rs->limit;
+    qemu_mutex_unlock(&s->group->lock);
+
+    g_free(reopen_state->opaque);
+    reopen_state->opaque = NULL;
+}
+
+static void qos_reopen_abort(BDRVReopenState *reopen_state)
+{
+    g_free(reopen_state->opaque);
+    reopen_state->opaque = NULL;
+}
+
+static void coroutine_fn qos_co_drain_begin(BlockDriverState *bs)
+{
+    BDRVQosState *s = bs->opaque;
+
+    if (qatomic_fetch_inc(&s->disabled) == 0) {
+        qos_release_all(s);
+    }
+}
+
+static void coroutine_fn qos_co_drain_end(BlockDriverState *bs)
+{
+    BDRVQosState *s = bs->opaque;
+
+    assert(s->disabled);
+    qatomic_dec(&s->disabled);
+}
+
+static const char *const qos_strong_runtime_opts[] = {
+    QOS_OPT_GROUP,
+
+    NULL
+};
+
+static BlockDriver bdrv_qos = {
+    .format_name                        =   "qos",
+    .instance_size                      =   sizeof(BDRVQosState),
+
+    .bdrv_open                          =   qos_open,
+    .bdrv_close                         =   qos_close,
+    .bdrv_co_flush                      =   qos_co_flush,
+
+    .bdrv_child_perm                    =   bdrv_default_perms,
+
+    .bdrv_getlength                     =   qos_getlength,
+
+    .bdrv_co_preadv                     =   qos_co_preadv,
+    .bdrv_co_pwritev                    =   qos_co_pwritev,
+
+    .bdrv_co_pwrite_zeroes              =   qos_co_pwrite_zeroes,
+    .bdrv_co_pdiscard                   =   qos_co_pdiscard,
+    .bdrv_co_pwritev_compressed         =   qos_co_pwritev_compressed,
+
+    .bdrv_reopen_prepare                =   qos_reopen_prepare,
+    .bdrv_reopen_commit                 =   qos_reopen_commit,
+    .bdrv_reopen_abort                  =   qos_reopen_abort,
+
+    .bdrv_co_drain_begin                =   qos_co_drain_begin,
+    .bdrv_co_drain_end                  =   qos_co_drain_end,
+
+    .is_filter                          =   true,
+    .strong_runtime_opts                =   qos_strong_runtime_opts,
+};
+
+static void qos_group_get_max_in_flight(Object *obj, Visitor *v,
+                                        const char *name, void *opaque,
+                                        Error **errp)
+{
+    QosGroup *g = QOS_GROUP(obj);
+
+    visit_type_uint32(v, name, &g->max_in_flight, errp);
+}
+
+static void qos_group_set_max_in_flight(Object *obj, Visitor *v,
+                                        const char *name, void *opaque,
+                                        Error **errp)
+{
+    QosGroup *g = QOS_GROUP(obj);
+    uint32_t value;
+
+    if (g->is_initialized) {
+        error_setg(errp, "Property cannot be set after initialization");
+        return;
+    }
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+    if (!value) {
+        error_setg(errp, "max-in-flight must be at least 1");
+        return;
+    }
+    g->max_in_flight = value;
+}
+
+static void qos_group_obj_init(Object *obj)
+{
+    QosGroup *g = QOS_GROUP(obj);
+
+    g->max_in_flight = QOS_DEFAULT_MAX_IN_FLIGHT;
+    qemu_mutex_init(&g->lock);
+    QLIST_INIT(&g->members);
+    g->timer = aio_timer_new(qemu_get_aio_context(), QEMU_CLOCK_REALTIME,
+                             SCALE_NS, qos_group_timer_cb, g);
+}
+
+static void qos_group_obj_complete(UserCreatable *obj, Error **errp)
+{
+    QosGroup *g = QOS_GROUP(obj);
+
+    g->is_initialized = true;
+}
+
+static void qos_group_obj_finalize(Object *obj)
+{
+    QosGroup *g = QOS_GROUP(obj);
+
+    assert(QLIST_EMPTY(&g->members));
+    timer_free(g->timer);
+    qemu_mutex_destroy(&g->lock);
+}
+
+static bool qos_group_can_be_deleted(UserCreatable *uc)
+{
+    return OBJECT(uc)->ref == 1;
+}
+
+static void qos_group_obj_class_init(ObjectClass *klass, void *class_data)
+{
+    UserCreatableClass *ucc = USER_CREATABLE_CLASS(klass);
+
+    ucc->complete = qos_group_obj_complete;
+    ucc->can_be_deleted = qos_group_can_be_deleted;
+
+    object_class_property_add(klass, "max-in-flight", "uint32",
+                              qos_group_get_max_in_flight,
+                              qos_group_set_max_in_flight,
+                              NULL, NULL);
+}
+
+static const TypeInfo qos_group_info = {
+    .name = TYPE_QOS_GROUP,
+    .parent = TYPE_OBJECT,
+    .class_init = qos_group_obj_class_init,
+    .instance_size = sizeof(QosGroup),
+    .instance_init = qos_group_obj_init,
+    .instance_finalize = qos_group_obj_finalize,
+    .interfaces = (InterfaceInfo[]) {
+        { TYPE_USER_CREATABLE },
+        { }
+    },
+};
+
+static void qos_group_register_types(void)
+{
+    type_register_static(&qos_group_info);
+}
+
+type_init(qos_group_register_types);
+
+static void bdrv_qos_init(void)
+{
+    bdrv_register(&bdrv_qos);
+}
+
+block_init(bdrv_qos_init);
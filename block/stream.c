@@ -14,6 +14,7 @@
 #include "qemu/osdep.h"
 #include "trace.h"
 #include "block/block_int.h"
+#include "block/aio_task.h"
 #include "block/blockjob_int.h"
 #include "qapi/error.h"
 #include "qapi/qmp/qerror.h"
@@ -27,8 +28,17 @@ enum {
      * that populating contiguous regions of the image is efficient.
      */
     STREAM_CHUNK = 512 * 1024, /* in bytes */
+
+    /* Number of chunks populated in parallel */
+    STREAM_MAX_WORKERS = 8,
 };
 
+typedef struct StreamRetry {
+    int64_t offset;
+    int64_t bytes;
+    QSIMPLEQ_ENTRY(StreamRetry) next;
+} StreamRetry;
+
 typedef struct StreamBlockJob {
     BlockJob common;
     BlockDriverState *base_overlay; /* COW overlay (stream from this) */
@@ -37,6 +47,11 @@ typedef struct StreamBlockJob {
     char *backing_file_str;
     bool bs_read_only;
     bool chain_frozen;
+
+    /* First error that was reported or ignored */
+    int error;
+    /* Chunks whose copy failed and that must be populated again */
+    QSIMPLEQ_HEAD(, StreamRetry) retry;
 } StreamBlockJob;
 
 static int coroutine_fn stream_populate(BlockBackend *blk,
@@ -106,6 +121,74 @@ static void stream_clean(Job *job)
     g_free(s->backing_file_str);
 }
 
+typedef struct StreamTask {
+    AioTask task;
+    StreamBlockJob *s;
+    int64_t offset;
+    int64_t bytes;
+} StreamTask;
+
+static void stream_retry(StreamBlockJob *s, int64_t offset, int64_t bytes)
+{
+    StreamRetry *r = g_new(StreamRetry, 1);
+
+    r->offset = offset;
+    r->bytes = bytes;
+    QSIMPLEQ_INSERT_TAIL(&s->retry, r, next);
+}
+
+static BlockErrorAction stream_error_action(StreamBlockJob *s, int ret)
+{
+    BlockErrorAction action =
+        block_job_error_action(&s->common, s->on_error, true, -ret);
+
+    if (action != BLOCK_ERROR_ACTION_STOP && s->error == 0) {
+        s->error = ret;
+    }
+    return action;
+}
+
+static int coroutine_fn stream_task_entry(AioTask *task)
+{
+    StreamTask *t = container_of(task, StreamTask, task);
+    StreamBlockJob *s = t->s;
+    int ret;
+
+    ret = stream_populate(s->common.blk, t->offset, t->bytes);
+    if (ret < 0) {
+        BlockErrorAction action = stream_error_action(s, ret);
+
+        if (action == BLOCK_ERROR_ACTION_STOP) {
+            /* Populated again by stream_run() once the job is resumed */
+            stream_retry(s, t->offset, t->bytes);
+            return 0;
+        }
+        if (action == BLOCK_ERROR_ACTION_REPORT) {
+            return ret;
+        }
+    }
+
+    /* Publish progress */
+    job_progress_update(&s->common.job, t->bytes);
+    return 0;
+}
+
+static void coroutine_fn stream_start_task(AioTaskPool *pool,
+                                           StreamBlockJob *s,
+                                           int64_t offset, int64_t bytes)
+{
+    StreamTask *t = g_new(StreamTask, 1);
+
+    *t = (StreamTask) {
+        .task.func = stream_task_entry,
+        .s = s,
+        .offset = offset,
+        .bytes = bytes,
+    };
+    aio_task_pool_wait_slot(pool);
+    aio_task_pool_start_task(pool, &t->task);
+}
+
 static int coroutine_fn stream_run(Job *job, Error **errp)
 {
     StreamBlockJob *s = container_of(job, StreamBlockJob, common.job);
@@ -113,11 +196,16 @@ static int coroutine_fn stream_run(Job *job, Error **errp)
     BlockDriverState *bs = blk_bs(blk);
     BlockDriverState *unfiltered_bs = bdrv_skip_filters(bs);
     bool enable_cor = !bdrv_cow_child(s->base_overlay);
+    AioTaskPool *pool;
+    StreamRetry *r;
     int64_t len;
     int64_t offset = 0;
+    int64_t status_end = 0;
+    bool status_copy = false;
     uint64_t delay_ns = 0;
-    int error = 0;
-    int64_t n = 0; /* bytes */
+
+    QSIMPLEQ_INIT(&s->retry);
+    s->error = 0;
 
     if (unfiltered_bs == s->base_overlay) {
         /* Nothing to stream */
@@ -139,62 +227,100 @@ static int coroutine_fn stream_run(Job *job, Error **errp)
         bdrv_enable_copy_on_read(bs);
     }
 
-    for ( ; offset < len; offset += n) {
-        bool copy;
-        int ret;
+    pool = aio_task_pool_new(STREAM_MAX_WORKERS);
+
+    for (;;) {
+        int64_t chunk_offset, n;
 
         /* Note that even when no rate limit is applied we need to yield
          * with no pending I/O here so that bdrv_drain_all() returns.
          */
         job_sleep_ns(&s->common.job, delay_ns);
-        if (job_is_cancelled(&s->common.job)) {
+        if (job_is_cancelled(&s->common.job) ||
+            aio_task_pool_status(pool) < 0) {
             break;
         }
 
-        copy = false;
-
-        ret = bdrv_is_allocated(unfiltered_bs, offset, STREAM_CHUNK, &n);
-        if (ret == 1) {
-            /* Allocated in the top, no need to copy.  */
-        } else if (ret >= 0) {
-            /* Copy if allocated in the intermediate images.  Limit to the
-             * known-unallocated area [offset, offset+n*BDRV_SECTOR_SIZE).  */
-            ret = bdrv_is_allocated_above(bdrv_cow_bs(unfiltered_bs),
-                                          s->base_overlay, true,
-                                          offset, n, &n);
-            /* Finish early if end of backing file has been reached */
-            if (ret == 0 && n == 0) {
-                n = len - offset;
-            }
-
-            copy = (ret > 0);
-        }
-        trace_stream_one_iteration(s, offset, n, ret);
-        if (copy) {
-            ret = stream_populate(blk, offset, n);
-        }
-        if (ret < 0) {
-            BlockErrorAction action =
-                block_job_error_action(&s->common, s->on_error, true, -ret);
-            if (action == BLOCK_ERROR_ACTION_STOP) {
-                n = 0;
-                continue;
+        r = QSIMPLEQ_FIRST(&s->retry);
+        if (r) {
+            QSIMPLEQ_REMOVE_HEAD(&s->retry, next);
+            chunk_offset = r->offset;
+            n = r->bytes;
+            g_free(r);
+        } else if (offset < len) {
+            if (offset == status_end) {
+                int ret;
+
+                /*
+                 * Ask for the rest of the image at once, and hand out the
+                 * answer in STREAM_CHUNK pieces.
+                 */
+                ret = bdrv_is_allocated(unfiltered_bs, offset, len - offset,
+                                        &n);
+                status_copy = false;
+                if (ret == 1) {
+                    /* Allocated in the top, no need to copy.  */
+                } else if (ret >= 0) {
+                    /*
+                     * Copy if allocated in the intermediate images.  Limit
+                     * to the known-unallocated area [offset, offset+n).
+                     */
+                    ret = bdrv_is_allocated_above(bdrv_cow_bs(unfiltered_bs),
+                                                  s->base_overlay, true,
+                                                  offset, n, &n);
+                    /* Finish early if end of backing file has been reached */
+                    if (ret == 0 && n == 0) {
+                        n = len - offset;
+                    }
+                    status_copy = (ret > 0);
+                }
+                trace_stream_one_iteration(s, offset, n, ret);
+                if (ret < 0) {
+                    BlockErrorAction action = stream_error_action(s, ret);
+
+                    if (action == BLOCK_ERROR_ACTION_REPORT) {
+                        break;
+                    }
+                    if (action == BLOCK_ERROR_ACTION_IGNORE) {
+                        /* Skip one chunk */
+                        n = MIN(len - offset, STREAM_CHUNK);
+                        job_progress_update(&s->common.job, n);
+                        offset += n;
+                        status_end = offset;
+                    }
+                    delay_ns = 0;
+                    continue;
+                }
+                status_end = offset + n;
+                if (!status_copy) {
+                    /* Publish progress */
+                    job_progress_update(&s->common.job, n);
+                    offset = status_end;
+                    delay_ns = 0;
+                    continue;
+                }
             }
-            if (error == 0) {
-                error = ret;
-            }
-            if (action == BLOCK_ERROR_ACTION_REPORT) {
-                break;
-            }
-        }
-
-        /* Publish progress */
-        job_progress_update(&s->common.job, n);
-        if (copy) {
-            delay_ns = block_job_ratelimit_get_delay(&s->common, n);
-        } else {
+            chunk_offset = offset;
+            n = MIN(status_end - offset, STREAM_CHUNK);
+            offset += n;
+        } else if (!aio_task_pool_empty(pool)) {
+            /* A request still in flight may have to be retried */
+            aio_task_pool_wait_one(pool);
             delay_ns = 0;
+            continue;
+        } else {
+            break;
         }
+
+        stream_start_task(pool, s, chunk_offset, n);
+        delay_ns = block_job_ratelimit_get_delay(&s->common, n);
+    }
+
+    aio_task_pool_wait_all(pool);
+    aio_task_pool_free(pool);
+    while ((r = QSIMPLEQ_FIRST(&s->retry))) {
+        QSIMPLEQ_REMOVE_HEAD(&s->retry, next);
+        g_free(r);
     }
 
     if (enable_cor) {
@@ -202,7 +328,7 @@ static int coroutine_fn stream_run(Job *job, Error **errp)
     }
 
     /* Do not remove the backing file if an error was there but ignored. */
-    return error;
+    return s->error;
 }
 
 static const BlockJobDriver stream_job_driver = {
@@ -39,6 +39,11 @@ static void throttle_group_obj_init(Object *obj);
 static void throttle_group_obj_complete(UserCreatable *obj, Error **errp);
 static void timer_cb(ThrottleGroupMember *tgm, bool is_write);
 
+/* Share of the group's throughput, in nanoseconds of its rate, that the
+ * members of a group can account in advance (see
+ * throttle_group_co_io_limits_intercept()). */
+#define THROTTLE_GROUP_CACHE_NS (10 * SCALE_MS)
+
 /* The ThrottleGroup structure (with its ThrottleState) is shared
  * among different ThrottleGroupMembers and it's independent from
  * AioContext, so in order to use it from different threads it needs
@@ -62,6 +67,14 @@ static void timer_cb(ThrottleGroupMember *tgm, bool is_write);
  * blk_set_aio_context()). Therefore in this file a thread will
  * access some other ThrottleGroupMember's timers only after verifying that
  * that ThrottleGroupMember has throttled requests in the queue.
+ *
+ * To avoid taking the lock for every request when many members share a
+ * group, a member that passes the throttling check while nothing is queued
+ * in the group also accounts a small budget in advance and keeps it in the
+ * ThrottleGroupMember.  Subsequent requests are charged against this budget
+ * without taking the lock, as long as no request of the same type is
+ * waiting anywhere in the group (so round robin fairness is not affected)
+ * and the configuration has not changed in the meantime (cache_gen).
  */
 struct ThrottleGroup {
     Object parent_obj;
@@ -76,6 +89,12 @@ struct ThrottleGroup {
     ThrottleGroupMember *tokens[2];
     bool any_timer_armed[2];
     QEMUClockType clock_type;
+    unsigned nr_members;
+
+    /* These fields are written under the lock but also read without it,
+     * so they are accessed with atomic operations */
+    unsigned pending_reqs[2];
+    unsigned cache_gen;
 
     /* This field is protected by the global QEMU mutex */
     QTAILQ_ENTRY(ThrottleGroup) list;
@@ -349,6 +368,124 @@ static void schedule_next_request(ThrottleGroupMember *tgm, bool is_write)
     }
 }
 
+/* Try to charge a request against the budget that a ThrottleGroupMember
+ * has accounted in advance. This does not take the group lock.
+ *
+ * @tgm:       the current ThrottleGroupMember
+ * @bytes:     the number of bytes for this I/O
+ * @is_write:  the type of operation (read/write)
+ * @ret:       whether the request could be charged
+ */
+static bool throttle_group_use_cache(ThrottleGroupMember *tgm,
+                                     unsigned int bytes, bool is_write)
+{
+    ThrottleGroup *tg = container_of(tgm->throttle_state, ThrottleGroup, ts);
+    double *units = &tgm->cached_units[is_write];
+    double *size = &tgm->cached_bytes[is_write];
+    double needed_units = 1.0;
+
+    if (tgm->cache_gen != qatomic_read(&tg->cache_gen) ||
+        qatomic_read(&tg->pending_reqs[is_write])) {
+        return false;
+    }
+
+    if (tgm->cached_op_size && bytes > tgm->cached_op_size) {
+        needed_units = (double) bytes / tgm->cached_op_size;
+    }
+    if ((*units >= 0 && *units < needed_units) ||
+        (*size >= 0 && *size < bytes)) {
+        return false;
+    }
+
+    if (*units >= 0) {
+        *units -= needed_units;
+    }
+    if (*size >= 0) {
+        *size -= bytes;
+    }
+    return true;
+}
+
+/* Return the budget that a member may account in advance for one of the
+ * limits in @types, or a negative value if none of them is set.
+ *
+ * This assumes that tg->lock is held.
+ */
+static double throttle_group_cache_budget(ThrottleGroup *tg,
+                                          const BucketType types[2])
+{
+    double avg = 0;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        double bkt_avg = tg->ts.cfg.buckets[types[i]].avg;
+        if (bkt_avg && (!avg || bkt_avg < avg)) {
+            avg = bkt_avg;
+        }
+    }
+    if (!avg) {
+        return -1;
+    }
+
+    return avg * THROTTLE_GROUP_CACHE_NS / NANOSECONDS_PER_SECOND /
+           tg->nr_members;
+}
+
+/* Account a budget in advance for a ThrottleGroupMember whose request has
+ * just passed the throttling check without waiting.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @tgm:       the current ThrottleGroupMember
+ * @bytes:     the number of bytes for this I/O
+ * @is_write:  the type of operation (read/write)
+ */
+static void throttle_group_fill_cache(ThrottleGroupMember *tgm,
+                                      unsigned int bytes, bool is_write)
+{
+    static const BucketType units_types[2][2] = {
+        { THROTTLE_OPS_TOTAL, THROTTLE_OPS_READ },
+        { THROTTLE_OPS_TOTAL, THROTTLE_OPS_WRITE }
+    };
+    static const BucketType bytes_types[2][2] = {
+        { THROTTLE_BPS_TOTAL, THROTTLE_BPS_READ },
+        { THROTTLE_BPS_TOTAL, THROTTLE_BPS_WRITE }
+    };
+    ThrottleState *ts = tgm->throttle_state;
+    ThrottleGroup *tg = container_of(ts, ThrottleGroup, ts);
+    double units, size;
+
+    /* Keep the accounting exact for qtest, which uses a virtual clock */
+    if (tg->clock_type != QEMU_CLOCK_REALTIME || tg->pending_reqs[is_write]) {
+        return;
+    }
+
+    units = throttle_group_cache_budget(tg, units_types[is_write]);
+    size = throttle_group_cache_budget(tg, bytes_types[is_write]);
+
+    /* Only worth it if the budget covers a few requests like this one */
+    if ((units >= 0 && units < 2 * throttle_units(ts, bytes)) ||
+        (size >= 0 && size < 2.0 * bytes)) {
+        return;
+    }
+
+    throttle_account_units(ts, is_write, MAX(units, 0), MAX(size, 0));
+    tgm->cached_units[is_write] = units;
+    tgm->cached_bytes[is_write] = size;
+    tgm->cached_op_size = ts->cfg.op_size;
+    tgm->cache_gen = tg->cache_gen;
+}
+
+/* Invalidate the budgets that all members of a group accounted in advance.
+ * This must be called whenever the configuration of the group changes.
+ *
+ * This assumes that tg->lock is held.
+ */
+static void throttle_group_invalidate_cache(ThrottleGroup *tg)
+{
+    qatomic_inc(&tg->cache_gen);
+}
+
 /* Check if an I/O request needs to be throttled, wait and set a timer
  * if necessary, and schedule the next request using a round robin
  * algorithm.
@@ -361,9 +498,14 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
                                                         unsigned int bytes,
                                                         bool is_write)
 {
-    bool must_wait;
+    bool must_wait, waited = false;
     ThrottleGroupMember *token;
     ThrottleGroup *tg = container_of(tgm->throttle_state, ThrottleGroup, ts);
+
+    if (throttle_group_use_cache(tgm, bytes, is_write)) {
+        return;
+    }
+
     qemu_mutex_lock(&tg->lock);
 
     /* First we check if this I/O has to be throttled. */
@@ -373,6 +515,7 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
     /* Wait if there's a timer set or queued requests of this type */
     if (must_wait || tgm->pending_reqs[is_write]) {
         tgm->pending_reqs[is_write]++;
+        qatomic_inc(&tg->pending_reqs[is_write]);
         qemu_mutex_unlock(&tg->lock);
         qemu_co_mutex_lock(&tgm->throttled_reqs_lock);
         qemu_co_queue_wait(&tgm->throttled_reqs[is_write],
@@ -380,10 +523,15 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
         qemu_co_mutex_unlock(&tgm->throttled_reqs_lock);
         qemu_mutex_lock(&tg->lock);
         tgm->pending_reqs[is_write]--;
+        qatomic_dec(&tg->pending_reqs[is_write]);
+        waited = true;
     }
 
     /* The I/O will be executed, so do the accounting */
     throttle_account(tgm->throttle_state, is_write, bytes);
+    if (!waited && !qatomic_read(&tgm->io_limits_disabled)) {
+        throttle_group_fill_cache(tgm, bytes, is_write);
+    }
 
     /* Schedule the next request */
     schedule_next_request(tgm, is_write);
@@ -472,6 +620,7 @@ void throttle_group_config(ThrottleGroupMember *tgm, ThrottleConfig *cfg)
     ThrottleGroup *tg = container_of(ts, ThrottleGroup, ts);
     qemu_mutex_lock(&tg->lock);
     throttle_config(ts, tg->clock_type, cfg);
+    throttle_group_invalidate_cache(tg);
     qemu_mutex_unlock(&tg->lock);
 
     throttle_group_restart_tgm(tgm);
@@ -555,6 +704,9 @@ void throttle_group_register_tgm(ThrottleGroupMember *tgm,
     }
 
     QLIST_INSERT_HEAD(&tg->head, tgm, round_robin);
+    tg->nr_members++;
+    tgm->cached_units[0] = tgm->cached_units[1] = 0;
+    tgm->cached_bytes[0] = tgm->cached_bytes[1] = 0;
 
     throttle_timers_init(&tgm->throttle_timers,
                          tgm->aio_context,
@@ -611,6 +763,7 @@ void throttle_group_unregister_tgm(ThrottleGroupMember *tgm)
 
     /* remove the current tgm from the list */
     QLIST_REMOVE(tgm, round_robin);
+    tg->nr_members--;
     throttle_timers_destroy(&tgm->throttle_timers);
     qemu_mutex_unlock(&tg->lock);
 
@@ -899,6 +1052,7 @@ static void throttle_group_set_limits(Object *obj, Visitor *v,
         goto unlock;
     }
     throttle_config(&tg->ts, tg->clock_type, &cfg);
+    throttle_group_invalidate_cache(tg);
 
 unlock:
     qemu_mutex_unlock(&tg->lock);
@@ -0,0 +1,1113 @@
+/*
+ * Persistent write cache block driver
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * Guest writes go to the "cache-file" child, a fast device such as a local
+ * NVMe drive or a file on a DAX file system, and are copied to the slower
+ * "file" child (for example an rbd, iscsi or nbd node) in the background.
+ * This works like dm-writecache in its SSD mode.
+ *
+ * The cache child is formatted as follows, in units of 4k blocks:
+ *
+ *  - a header with the magic, the geometry and the sequence number of the
+ *    last commit,
+ *  - an array of slot descriptors, each holding the block of the file that
+ *    the slot caches and the sequence number of the commit it belongs to,
+ *  - the slots themselves.
+ *
+ * Data is written to the slots immediately, but the descriptors are only
+ * written on commit, which happens when the guest flushes.  A commit
+ * writes the descriptors that changed and flushes the cache child, then
+ * writes the header with the new sequence number and flushes again.
+ * When the cache is opened, descriptors whose sequence number is newer
+ * than the one in the header are dropped, so the cache goes back to the
+ * state of the last completed flush after a crash.
+ *
+ * Once a block is committed it can be written back: contiguous blocks are
+ * merged into one request to the file child, which is then flushed.  The
+ * slot is then free, but because its descriptor on disk still points to
+ * the block, the slot is only reused after the next commit.  A committed
+ * slot is never overwritten either: writing to a block again uses a new
+ * slot.  The old one is superseded, but its descriptor must stay on disk
+ * until the commit of the new one is complete, because the new
+ * descriptor is dropped if that commit does not complete.  So it is only
+ * freed once that commit is done, and reused after the commit after it.
+ * If both descriptors are found when the cache is opened, the newer one
+ * wins.
+ *
+ * Write zeroes and discard requests drop the blocks from the cache, commit
+ * and then go straight to the file child.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "block/block_int.h"
+#include "qemu/bitmap.h"
+#include "qemu/coroutine.h"
+#include "qemu/cutils.h"
+#include "qemu/error-report.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qemu/timer.h"
+
+#define WC_MAGIC            0x4857434b51454d55ULL /* "QEMUKCWH" */
+#define WC_VERSION          1
+#define WC_BLOCK_SIZE       4096
+#define WC_BLOCK_BITS       12
+#define WC_MIN_SLOTS        64
+
+/* Number of slots that are written back at a time */
+#define WC_WRITEBACK_BATCH  256
+
+/* Slots that are free, or whose descriptor is to be cleared */
+#define WC_FREE             UINT64_MAX
+
+#define WC_OPT_WRITEBACK_INTERVAL "writeback-interval"
+
+typedef struct QEMU_PACKED WritecacheHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t nr_slots;
+    uint64_t seq;
+} WritecacheHeader;
+
+typedef struct QEMU_PACKED WritecacheDesc {
+    uint64_t block;
+    uint64_t seq;
+} WritecacheDesc;
+
+#define WC_DESCS_PER_BLOCK  (WC_BLOCK_SIZE / sizeof(WritecacheDesc))
+
+typedef struct WritecacheSlot {
+    uint64_t block;
+    uint64_t seq;
+    bool writeback;
+    /* Replaced by a newer slot whose descriptor is not committed yet */
+    bool superseded;
+
+    /* Free, pending free, superseded or dirty list; not linked while in use */
+    QTAILQ_ENTRY(WritecacheSlot) next;
+} WritecacheSlot;
+
+typedef QTAILQ_HEAD(, WritecacheSlot) WritecacheSlotList;
+
+typedef struct BDRVWritecacheState {
+    BlockDriverState *bs;
+    BdrvChild *cache;
+
+    uint64_t nr_slots;
+    uint64_t desc_blocks;
+    uint64_t data_offset;
+    WritecacheSlot *slots;
+
+    /* Maps blocks of the file to the slot that caches them */
+    GHashTable *map;
+
+    WritecacheSlotList free;
+    uint64_t nr_free;
+    /* Free, but the descriptor on disk is only cleared by the next commit */
+    WritecacheSlotList pending_free;
+    /* Still committed on disk, freed once the next commit is complete */
+    WritecacheSlotList superseded;
+    /* Oldest first, so the committed slots come before the others */
+    WritecacheSlotList dirty;
+
+    /* Descriptor blocks that must be written on the next commit */
+    unsigned long *dirty_descs;
+    bool need_commit;
+
+    /* Sequence number of the next commit */
+    uint64_t seq;
+
+    /*
+     * Taken shared by reads and writes, so that a commit (taken exclusive)
+     * never runs while a slot is being accessed.  Slots are only handed
+     * out again after a commit, so a slot that is being read cannot be
+     * reused under the reader's feet.
+     */
+    CoRwlock lock;
+
+    /*
+     * Serializes writeback with write zeroes and discard, which must not
+     * be overtaken by older data that is written back.
+     */
+    CoMutex writeback_lock;
+
+    /* Writers that wait for a free slot */
+    CoQueue free_queue;
+    int writeback_ret;
+
+    bool writeback_running;
+    bool writeback_all;
+    bool closing;
+    QEMUTimer *writeback_timer;
+    int64_t writeback_interval_ns;
+} BDRVWritecacheState;
+
+static QemuOptsList runtime_opts = {
+    .name = "writecache",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = WC_OPT_WRITEBACK_INTERVAL,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Milliseconds between two writebacks of committed data",
+        },
+        { /* end of list */ }
+    },
+};
+
+static void coroutine_fn writecache_writeback_entry(void *opaque);
+
+static inline uint64_t writecache_slot_index(BDRVWritecacheState *s,
+                                             WritecacheSlot *slot)
+{
+    return slot - s->slots;
+}
+
+static inline uint64_t writecache_slot_offset(BDRVWritecacheState *s,
+                                              WritecacheSlot *slot)
+{
+    return s->data_offset +
+           (writecache_slot_index(s, slot) << WC_BLOCK_BITS);
+}
+
+static WritecacheSlot *writecache_lookup(BDRVWritecacheState *s,
+                                         uint64_t block)
+{
+    return g_hash_table_lookup(s->map, &block);
+}
+
+static void writecache_set_desc_dirty(BDRVWritecacheState *s,
+                                      WritecacheSlot *slot)
+{
+    set_bit(writecache_slot_index(s, slot) / WC_DESCS_PER_BLOCK,
+            s->dirty_descs);
+    s->need_commit = true;
+}
+
+/*
+ * Takes @slot, which must not be mapped any more, out of use.  If it is
+ * being written back, the writeback puts it on the pending free list.
+ */
+static void writecache_release_slot(BDRVWritecacheState *s,
+                                    WritecacheSlot *slot)
+{
+    slot->block = WC_FREE;
+    slot->seq = 0;
+    writecache_set_desc_dirty(s, slot);
+    if (!slot->writeback) {
+        QTAILQ_INSERT_TAIL(&s->pending_free, slot, next);
+    }
+}
+
+/* Removes the mapping of @slot, which must be on the dirty list */
+static void writecache_drop_slot(BDRVWritecacheState *s,
+                                 WritecacheSlot *slot)
+{
+    g_hash_table_remove(s->map, &slot->block);
+    if (!slot->writeback) {
+        QTAILQ_REMOVE(&s->dirty, slot, next);
+    }
+    writecache_release_slot(s, slot);
+}
+
+/*
+ * Removes the mapping of the committed @slot, which a newer slot replaces,
+ * but leaves its descriptor alone until the new slot is committed.  If it
+ * is being written back, the writeback puts it on the superseded list.
+ */
+static void writecache_supersede_slot(BDRVWritecacheState *s,
+                                      WritecacheSlot *slot)
+{
+    g_hash_table_remove(s->map, &slot->block);
+    slot->superseded = true;
+    if (!slot->writeback) {
+        QTAILQ_REMOVE(&s->dirty, slot, next);
+        QTAILQ_INSERT_TAIL(&s->superseded, slot, next);
+    }
+}
+
+static void writecache_kick(BDRVWritecacheState *s)
+{
+    Coroutine *co;
+
+    if (s->writeback_running) {
+        return;
+    }
+    s->writeback_running = true;
+    bdrv_inc_in_flight(s->bs);
+    co = qemu_coroutine_create(writecache_writeback_entry, s);
+    aio_co_enter(bdrv_get_aio_context(s->bs), co);
+}
+
+static void writecache_writeback_timer_cb(void *opaque)
+{
+    BDRVWritecacheState *s = opaque;
+
+    s->writeback_all = true;
+    writecache_kick(s);
+}
+
+static void writecache_start_timer(BDRVWritecacheState *s)
+{
+    if (s->writeback_timer && !timer_pending(s->writeback_timer)) {
+        timer_mod(s->writeback_timer,
+                  qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                  s->writeback_interval_ns);
+    }
+}
+
+/* Called with s->lock held exclusively */
+static int coroutine_fn writecache_do_commit(BDRVWritecacheState *s)
+{
+    WritecacheDesc *descs;
+    WritecacheHeader *header;
+    int64_t i;
+    uint64_t j;
+    int ret = 0;
+
+    if (!s->need_commit) {
+        return 0;
+    }
+
+    descs = qemu_blockalign(s->cache->bs, WC_BLOCK_SIZE);
+    for (i = find_first_bit(s->dirty_descs, s->desc_blocks);
+         i < s->desc_blocks;
+         i = find_next_bit(s->dirty_descs, s->desc_blocks, i + 1)) {
+        memset(descs, 0, WC_BLOCK_SIZE);
+        for (j = 0; j < WC_DESCS_PER_BLOCK; j++) {
+            uint64_t n = i * WC_DESCS_PER_BLOCK + j;
+
+            if (n >= s->nr_slots) {
+                break;
+            }
+            descs[j].block = cpu_to_le64(s->slots[n].block);
+            descs[j].seq = cpu_to_le64(s->slots[n].seq);
+        }
+        ret = bdrv_co_pwrite(s->cache, (1 + i) << WC_BLOCK_BITS,
+                             WC_BLOCK_SIZE, descs, 0);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
+    /* The data and the descriptors must be stable before the header */
+    ret = bdrv_co_flush(s->cache->bs);
+    if (ret < 0) {
+        goto out;
+    }
+
+    header = (WritecacheHeader *)descs;
+    memset(descs, 0, WC_BLOCK_SIZE);
+    *header = (WritecacheHeader) {
+        .magic      = cpu_to_le64(WC_MAGIC),
+        .version    = cpu_to_le32(WC_VERSION),
+        .block_size = cpu_to_le32(WC_BLOCK_SIZE),
+        .nr_slots   = cpu_to_le64(s->nr_slots),
+        .seq        = cpu_to_le64(s->seq),
+    };
+    ret = bdrv_co_pwrite(s->cache, 0, WC_BLOCK_SIZE, descs, 0);
+    if (ret < 0) {
+        goto out;
+    }
+    ret = bdrv_co_flush(s->cache->bs);
+    if (ret < 0) {
+        goto out;
+    }
+
+    bitmap_zero(s->dirty_descs, s->desc_blocks);
+    s->need_commit = false;
+    s->seq++;
+
+    while (!QTAILQ_EMPTY(&s->pending_free)) {
+        WritecacheSlot *slot = QTAILQ_FIRST(&s->pending_free);
+
+        QTAILQ_REMOVE(&s->pending_free, slot, next);
+        QTAILQ_INSERT_TAIL(&s->free, slot, next);
+        s->nr_free++;
+    }
+
+    /* The slots that they replace are free now, from the next commit on */
+    while (!QTAILQ_EMPTY(&s->superseded)) {
+        WritecacheSlot *slot = QTAILQ_FIRST(&s->superseded);
+
+        QTAILQ_REMOVE(&s->superseded, slot, next);
+        slot->superseded = false;
+        writecache_release_slot(s, slot);
+    }
+    qemu_co_queue_restart_all(&s->free_queue);
+
+out:
+    qemu_vfree(descs);
+    return ret;
+}
+
+static int coroutine_fn writecache_commit(BDRVWritecacheState *s)
+{
+    int ret;
+
+    qemu_co_rwlock_wrlock(&s->lock);
+    ret = writecache_do_commit(s);
+    qemu_co_rwlock_unlock(&s->lock);
+    return ret;
+}
+
+static int writecache_slot_cmp(const void *a, const void *b)
+{
+    const WritecacheSlot *sa = *(WritecacheSlot * const *)a;
+    const WritecacheSlot *sb = *(WritecacheSlot * const *)b;
+
+    return sa->block < sb->block ? -1 : sa->block > sb->block;
+}
+
+/*
+ * Copies up to WC_WRITEBACK_BATCH committed slots to the file child.
+ * Returns the number of slots that were written back, or -errno.
+ */
+static int coroutine_fn writecache_writeback_batch(BDRVWritecacheState *s)
+{
+    WritecacheSlot *batch[WC_WRITEBACK_BATCH];
+    WritecacheSlot *slot;
+    uint8_t *buf;
+    int i, j, n = 0;
+    int ret = 0;
+
+    while (n < WC_WRITEBACK_BATCH) {
+        slot = QTAILQ_FIRST(&s->dirty);
+        if (!slot || slot->seq == s->seq) {
+            break;
+        }
+        QTAILQ_REMOVE(&s->dirty, slot, next);
+        slot->writeback = true;
+        batch[n++] = slot;
+    }
+    if (!n) {
+        return 0;
+    }
+
+    qsort(batch, n, sizeof(batch[0]), writecache_slot_cmp);
+    buf = qemu_blockalign(s->bs, n * WC_BLOCK_SIZE);
+
+    /* Read runs of adjacent slots, then write runs of adjacent blocks */
+    for (i = 0; i < n && ret >= 0; i = j) {
+        for (j = i + 1; j < n && batch[j] == batch[j - 1] + 1; j++) {
+            /* nothing */
+        }
+        ret = bdrv_co_pread(s->cache, writecache_slot_offset(s, batch[i]),
+                            (j - i) * WC_BLOCK_SIZE,
+                            buf + i * WC_BLOCK_SIZE, 0);
+    }
+    for (i = 0; i < n && ret >= 0; i = j) {
+        for (j = i + 1;
+             j < n && batch[j]->block == batch[j - 1]->block + 1;
+             j++) {
+            /* nothing */
+        }
+        ret = bdrv_co_pwrite(s->bs->file, batch[i]->block << WC_BLOCK_BITS,
+                             (j - i) * WC_BLOCK_SIZE,
+                             buf + i * WC_BLOCK_SIZE, 0);
+    }
+    if (ret >= 0) {
+        ret = bdrv_co_flush(s->bs->file->bs);
+    }
+    qemu_vfree(buf);
+
+    for (i = 0; i < n; i++) {
+        slot = batch[i];
+        slot->writeback = false;
+        if (slot->superseded) {
+            /* Overwritten in the meantime */
+            if (s->need_commit) {
+                QTAILQ_INSERT_TAIL(&s->superseded, slot, next);
+            } else {
+                /* The slot that replaces it is committed already */
+                slot->superseded = false;
+                writecache_release_slot(s, slot);
+            }
+        } else if (slot->block == WC_FREE) {
+            /* Discarded in the meantime */
+            QTAILQ_INSERT_TAIL(&s->pending_free, slot, next);
+        } else if (ret < 0) {
+            QTAILQ_INSERT_HEAD(&s->dirty, slot, next);
+        } else {
+            g_hash_table_remove(s->map, &slot->block);
+            writecache_release_slot(s, slot);
+        }
+    }
+
+    return ret < 0 ? ret : n;
+}
+
+static void coroutine_fn writecache_writeback_entry(void *opaque)
+{
+    BDRVWritecacheState *s = opaque;
+    BlockDriverState *bs = s->bs;
+    int ret = 0;
+
+    for (;;) {
+        bool waiters = !qemu_co_queue_empty(&s->free_queue);
+        bool low = s->nr_free < s->nr_slots / 4;
+
+        /* Free and superseded slots can only be reused after a commit */
+        if (waiters && (!QTAILQ_EMPTY(&s->pending_free) ||
+                        !QTAILQ_EMPTY(&s->superseded))) {
+            ret = writecache_commit(s);
+            if (ret < 0) {
+                break;
+            }
+            continue;
+        }
+
+        if (!waiters && !s->closing &&
+            (bs->quiesce_counter || (!low && !s->writeback_all))) {
+            break;
+        }
+
+        qemu_co_mutex_lock(&s->writeback_lock);
+        ret = writecache_writeback_batch(s);
+        qemu_co_mutex_unlock(&s->writeback_lock);
+        if (ret < 0) {
+            break;
+        }
+
+        if (ret == 0) {
+            /* Nothing committed is left, commit what the guest wrote */
+            if (s->need_commit && (waiters || low || s->closing)) {
+                ret = writecache_commit(s);
+                if (ret < 0) {
+                    break;
+                }
+                continue;
+            }
+            break;
+        }
+    }
+
+    if (ret < 0) {
+        /* Let the writers that wait for a slot fail */
+        error_report("writecache: writeback failed: %s", strerror(-ret));
+        s->writeback_ret = ret;
+        qemu_co_queue_restart_all(&s->free_queue);
+    }
+
+    s->writeback_all = false;
+    s->writeback_running = false;
+    if (!QTAILQ_EMPTY(&s->dirty)) {
+        writecache_start_timer(s);
+    }
+    bdrv_dec_in_flight(bs);
+}
+
+static int writecache_load(BDRVWritecacheState *s, uint64_t committed,
+                           Error **errp)
+{
+    WritecacheDesc *descs;
+    uint64_t i;
+    int ret = 0;
+
+    descs = qemu_blockalign(s->cache->bs, WC_BLOCK_SIZE);
+    for (i = 0; i < s->nr_slots; i++) {
+        WritecacheSlot *slot = &s->slots[i];
+        WritecacheSlot *old;
+        uint64_t block, seq;
+
+        if (i % WC_DESCS_PER_BLOCK == 0) {
+            ret = bdrv_pread(s->cache, (1 + i / WC_DESCS_PER_BLOCK) <<
+                             WC_BLOCK_BITS, descs, WC_BLOCK_SIZE);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "Could not read the cache "
+                                 "descriptors");
+                goto out;
+            }
+        }
+
+        block = le64_to_cpu(descs[i % WC_DESCS_PER_BLOCK].block);
+        seq = le64_to_cpu(descs[i % WC_DESCS_PER_BLOCK].seq);
+        if (block == WC_FREE || seq == 0 || seq > committed) {
+            /* Free slots, and slots of a commit that did not complete */
+            if (block != WC_FREE || seq != 0) {
+                writecache_set_desc_dirty(s, slot);
+            }
+            QTAILQ_INSERT_TAIL(&s->free, slot, next);
+            s->nr_free++;
+            continue;
+        }
+
+        slot->block = block;
+        slot->seq = seq;
+        old = writecache_lookup(s, block);
+        if (old && old->seq > seq) {
+            writecache_release_slot(s, slot);
+            continue;
+        }
+        if (old) {
+            writecache_drop_slot(s, old);
+        }
+        g_hash_table_insert(s->map, &slot->block, slot);
+        QTAILQ_INSERT_TAIL(&s->dirty, slot, next);
+    }
+    ret = 0;
+
+out:
+    qemu_vfree(descs);
+    return ret;
+}
+
+static int writecache_format(BDRVWritecacheState *s, Error **errp)
+{
+    WritecacheHeader *header;
+    int ret;
+
+    ret = bdrv_pwrite_zeroes(s->cache, WC_BLOCK_SIZE,
+                             s->desc_blocks << WC_BLOCK_BITS, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not clear the cache descriptors");
+        return ret;
+    }
+
+    header = qemu_blockalign0(s->cache->bs, WC_BLOCK_SIZE);
+    *header = (WritecacheHeader) {
+        .magic      = cpu_to_le64(WC_MAGIC),
+        .version    = cpu_to_le32(WC_VERSION),
+        .block_size = cpu_to_le32(WC_BLOCK_SIZE),
+        .nr_slots   = cpu_to_le64(s->nr_slots),
+        .seq        = 0,
+    };
+    ret = bdrv_pwrite(s->cache, 0, header, WC_BLOCK_SIZE);
+    qemu_vfree(header);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write the cache header");
+        return ret;
+    }
+
+    ret = bdrv_flush(s->cache->bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not flush the cache");
+        return ret;
+    }
+    return 0;
+}
+
+static int writecache_open_cache(BDRVWritecacheState *s, Error **errp)
+{
+    WritecacheHeader header;
+    int64_t len;
+    uint64_t blocks;
+    int ret;
+
+    len = bdrv_getlength(s->cache->bs);
+    if (len < 0) {
+        error_setg_errno(errp, -len, "Could not get the cache size");
+        return len;
+    }
+
+    ret = bdrv_pread(s->cache, 0, &header, sizeof(header));
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read the cache header");
+        return ret;
+    }
+
+    blocks = len >> WC_BLOCK_BITS;
+    if (!buffer_is_zero(&header, sizeof(header))) {
+        if (le64_to_cpu(header.magic) != WC_MAGIC) {
+            error_setg(errp, "The cache node does not contain a write cache");
+            return -EINVAL;
+        }
+        if (le32_to_cpu(header.version) != WC_VERSION ||
+            le32_to_cpu(header.block_size) != WC_BLOCK_SIZE) {
+            error_setg(errp, "Unsupported write cache version %" PRIu32,
+                       le32_to_cpu(header.version));
+            return -ENOTSUP;
+        }
+        s->nr_slots = le64_to_cpu(header.nr_slots);
+        s->desc_blocks = DIV_ROUND_UP(s->nr_slots, WC_DESCS_PER_BLOCK);
+        if (s->nr_slots < WC_MIN_SLOTS ||
+            1 + s->desc_blocks + s->nr_slots > blocks) {
+            error_setg(errp, "The write cache is larger than the cache node");
+            return -EINVAL;
+        }
+    } else {
+        if (blocks < WC_MIN_SLOTS + 2) {
+            error_setg(errp, "The cache node must hold at least %d blocks "
+                       "of %d bytes", WC_MIN_SLOTS + 2, WC_BLOCK_SIZE);
+            return -EINVAL;
+        }
+        s->nr_slots = (blocks - 1) * WC_DESCS_PER_BLOCK /
+                      (WC_DESCS_PER_BLOCK + 1);
+        s->desc_blocks = DIV_ROUND_UP(s->nr_slots, WC_DESCS_PER_BLOCK);
+        while (1 + s->desc_blocks + s->nr_slots > blocks) {
+            s->nr_slots--;
+            s->desc_blocks = DIV_ROUND_UP(s->nr_slots, WC_DESCS_PER_BLOCK);
+        }
+    }
+
+    s->data_offset = (1 + s->desc_blocks) << WC_BLOCK_BITS;
+    s->slots = g_new0(WritecacheSlot, s->nr_slots);
+    s->dirty_descs = bitmap_new(s->desc_blocks);
+
+    if (buffer_is_zero(&header, sizeof(header))) {
+        ret = writecache_format(s, errp);
+        s->seq = 1;
+    } else {
+        ret = writecache_load(s, le64_to_cpu(header.seq), errp);
+        s->seq = le64_to_cpu(header.seq) + 1;
+    }
+    return ret;
+}
+
+static void writecache_detach_aio_context(BlockDriverState *bs)
+{
+    BDRVWritecacheState *s = bs->opaque;
+
+    if (s->writeback_timer) {
+        timer_del(s->writeback_timer);
+        timer_free(s->writeback_timer);
+        s->writeback_timer = NULL;
+    }
+}
+
+static void writecache_attach_aio_context(BlockDriverState *bs,
+                                          AioContext *new_context)
+{
+    BDRVWritecacheState *s = bs->opaque;
+
+    s->writeback_timer = aio_timer_new(new_context, QEMU_CLOCK_VIRTUAL,
+                                       SCALE_NS,
+                                       writecache_writeback_timer_cb, s);
+    if (!QTAILQ_EMPTY(&s->dirty)) {
+        writecache_start_timer(s);
+    }
+}
+
+static void writecache_free_state(BDRVWritecacheState *s)
+{
+    if (s->map) {
+        g_hash_table_destroy(s->map);
+        s->map = NULL;
+    }
+    g_free(s->slots);
+    s->slots = NULL;
+    g_free(s->dirty_descs);
+    s->dirty_descs = NULL;
+}
+
+static int writecache_open(BlockDriverState *bs, QDict *options, int flags,
+                           Error **errp)
+{
+    BDRVWritecacheState *s = bs->opaque;
+    QemuOpts *opts;
+    int ret;
+
+    s->bs = bs;
+    QTAILQ_INIT(&s->free);
+    QTAILQ_INIT(&s->pending_free);
+    QTAILQ_INIT(&s->superseded);
+    QTAILQ_INIT(&s->dirty);
+    qemu_co_rwlock_init(&s->lock);
+    qemu_co_mutex_init(&s->writeback_lock);
+    qemu_co_queue_init(&s->free_queue);
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    if (!qemu_opts_absorb_qdict(opts, options, errp)) {
+        ret = -EINVAL;
+        goto fail;
+    }
+    s->writeback_interval_ns =
+        qemu_opt_get_number(opts, WC_OPT_WRITEBACK_INTERVAL, 1000) *
+        SCALE_MS;
+
+    if (!(flags & BDRV_O_RDWR)) {
+        error_setg(errp, "The writecache driver does not support read-only "
+                   "nodes");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    /*
+     * Both children are written even when the guest does not write, and
+     * nobody else may write to them, so they count as metadata.
+     */
+    bs->file = bdrv_open_child(NULL, options, "file", bs, &child_of_bds,
+                               BDRV_CHILD_DATA | BDRV_CHILD_METADATA |
+                               BDRV_CHILD_PRIMARY, false, errp);
+    if (!bs->file) {
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    s->cache = bdrv_open_child(NULL, options, "cache-file", bs, &child_of_bds,
+                               BDRV_CHILD_DATA | BDRV_CHILD_METADATA, false,
+                               errp);
+    if (!s->cache) {
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    s->map = g_hash_table_new(g_int64_hash, g_int64_equal);
+    ret = writecache_open_cache(s, errp);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    bs->supported_write_flags = BDRV_REQ_FUA;
+    writecache_attach_aio_context(bs, bdrv_get_aio_context(bs));
+    qemu_opts_del(opts);
+    return 0;
+
+fail:
+    writecache_free_state(s);
+    bdrv_unref_child(bs, s->cache);
+    s->cache = NULL;
+    bdrv_unref_child(bs, bs->file);
+    bs->file = NULL;
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static void writecache_close(BlockDriverState *bs)
+{
+    BDRVWritecacheState *s = bs->opaque;
+
+    /*
+     * Write everything back, so that the file child is up to date once
+     * the cache is removed.
+     */
+    s->closing = true;
+    writecache_kick(s);
+    BDRV_POLL_WHILE(bs, s->writeback_running);
+
+    writecache_detach_aio_context(bs);
+    writecache_free_state(s);
+    bdrv_unref_child(bs, s->cache);
+    s->cache = NULL;
+}
+
+static int64_t writecache_getlength(BlockDriverState *bs)
+{
+    return bdrv_getlength(bs->file->bs);
+}
+
+static void writecache_refresh_limits(BlockDriverState *bs, Error **errp)
+{
+    bs->bl.request_alignment = WC_BLOCK_SIZE;
+}
+
+static int coroutine_fn writecache_co_preadv(BlockDriverState *bs,
+                                             uint64_t offset, uint64_t bytes,
+                                             QEMUIOVector *qiov, int flags)
+{
+    BDRVWritecacheState *s = bs->opaque;
+    uint64_t block = offset >> WC_BLOCK_BITS;
+    uint64_t nb_blocks = bytes >> WC_BLOCK_BITS;
+    uint64_t i, j;
+    int ret = 0;
+
+    assert(QEMU_IS_ALIGNED(offset | bytes, WC_BLOCK_SIZE));
+
+    qemu_co_rwlock_rdlock(&s->lock);
+    for (i = 0; i < nb_blocks && ret >= 0; i = j) {
+        WritecacheSlot *slot = writecache_lookup(s, block + i);
+        size_t qiov_offset = i << WC_BLOCK_BITS;
+
+        if (!slot) {
+            for (j = i + 1;
+                 j < nb_blocks && !writecache_lookup(s, block + j);
+                 j++) {
+                /* nothing */
+            }
+            ret = bdrv_co_preadv_part(bs->file, (block + i) << WC_BLOCK_BITS,
+                                      (j - i) << WC_BLOCK_BITS, qiov,
+                                      qiov_offset, 0);
+        } else {
+            for (j = i + 1;
+                 j < nb_blocks &&
+                 writecache_lookup(s, block + j) == slot + (j - i);
+                 j++) {
+                /* nothing */
+            }
+            ret = bdrv_co_preadv_part(s->cache,
+                                      writecache_slot_offset(s, slot),
+                                      (j - i) << WC_BLOCK_BITS, qiov,
+                                      qiov_offset, 0);
+        }
+    }
+    qemu_co_rwlock_unlock(&s->lock);
+
+    return ret < 0 ? ret : 0;
+}
+
+/*
+ * Returns the slot to write @block to, or NULL if no slot is free.
+ * Blocks that were written since the last commit are overwritten in place.
+ */
+static WritecacheSlot *writecache_get_slot(BDRVWritecacheState *s,
+                                           uint64_t block)
+{
+    WritecacheSlot *slot = writecache_lookup(s, block);
+
+    if (slot && slot->seq == s->seq) {
+        return slot;
+    }
+
+    slot = QTAILQ_FIRST(&s->free);
+    if (slot) {
+        QTAILQ_REMOVE(&s->free, slot, next);
+        s->nr_free--;
+        slot->block = WC_FREE;
+    }
+    return slot;
+}
+
+/* Makes the newly written @slot the cached copy of @block */
+static void writecache_map_slot(BDRVWritecacheState *s, uint64_t block,
+                                WritecacheSlot *slot)
+{
+    WritecacheSlot *old;
+
+    if (slot->block == block) {
+        return;
+    }
+
+    old = writecache_lookup(s, block);
+    if (old) {
+        writecache_supersede_slot(s, old);
+    }
+    slot->block = block;
+    slot->seq = s->seq;
+    g_hash_table_insert(s->map, &slot->block, slot);
+    QTAILQ_INSERT_TAIL(&s->dirty, slot, next);
+    writecache_set_desc_dirty(s, slot);
+}
+
+static int coroutine_fn writecache_co_pwritev(BlockDriverState *bs,
+                                              uint64_t offset, uint64_t bytes,
+                                              QEMUIOVector *qiov, int flags)
+{
+    BDRVWritecacheState *s = bs->opaque;
+    uint64_t block = offset >> WC_BLOCK_BITS;
+    uint64_t nb_blocks = bytes >> WC_BLOCK_BITS;
+    g_autofree WritecacheSlot **slots = NULL;
+    uint64_t i, j, n;
+    int ret = 0;
+
+    assert(QEMU_IS_ALIGNED(offset | bytes, WC_BLOCK_SIZE));
+
+    slots = g_new(WritecacheSlot *, MIN(nb_blocks, s->nr_slots));
+
+    qemu_co_rwlock_rdlock(&s->lock);
+    for (i = 0; i < nb_blocks; i += n) {
+        /*
+         * Write as many blocks as there are free slots, so that waiting
+         * for more slots never holds slots that others could write back.
+         */
+        for (n = 0; i + n < nb_blocks && n < s->nr_slots; n++) {
+            slots[n] = writecache_get_slot(s, block + i + n);
+            if (!slots[n]) {
+                break;
+            }
+        }
+
+        if (!n) {
+            if (s->writeback_ret < 0) {
+                ret = s->writeback_ret;
+                s->writeback_ret = 0;
+                break;
+            }
+            qemu_co_rwlock_unlock(&s->lock);
+            writecache_kick(s);
+            qemu_co_queue_wait(&s->free_queue, NULL);
+            qemu_co_rwlock_rdlock(&s->lock);
+            continue;
+        }
+
+        for (j = 0; j < n && ret >= 0; j++) {
+            uint64_t k = j;
+
+            while (k + 1 < n && slots[k + 1] == slots[k] + 1) {
+                k++;
+            }
+            ret = bdrv_co_pwritev_part(s->cache,
+                                       writecache_slot_offset(s, slots[j]),
+                                       (k - j + 1) << WC_BLOCK_BITS, qiov,
+                                       (i + j) << WC_BLOCK_BITS, 0);
+            j = k;
+        }
+
+        for (j = 0; j < n; j++) {
+            if (ret >= 0) {
+                writecache_map_slot(s, block + i + j, slots[j]);
+            } else if (slots[j]->block == WC_FREE) {
+                QTAILQ_INSERT_HEAD(&s->free, slots[j], next);
+                s->nr_free++;
+            }
+        }
+        if (ret < 0) {
+            break;
+        }
+    }
+    qemu_co_rwlock_unlock(&s->lock);
+
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (s->nr_free < s->nr_slots / 4 ||
+        !qemu_co_queue_empty(&s->free_queue)) {
+        writecache_kick(s);
+    } else {
+        writecache_start_timer(s);
+    }
+
+    if (flags & BDRV_REQ_FUA) {
+        ret = writecache_commit(s);
+    }
+    return ret;
+}
+
+/* Drops the cached copies of a range, before it is changed in the file */
+static int coroutine_fn writecache_invalidate(BDRVWritecacheState *s,
+                                              uint64_t offset, uint64_t bytes)
+{
+    uint64_t start = offset >> WC_BLOCK_BITS;
+    uint64_t end = DIV_ROUND_UP(offset + bytes, WC_BLOCK_SIZE);
+    WritecacheSlot *slot, *next_slot;
+    uint64_t i;
+
+    if (end - start > s->nr_slots) {
+        for (i = 0; i < s->nr_slots; i++) {
+            slot = &s->slots[i];
+
+            if (slot->block >= start && slot->block < end &&
+                writecache_lookup(s, slot->block) == slot) {
+                writecache_drop_slot(s, slot);
+            }
+        }
+    } else {
+        for (i = start; i < end; i++) {
+            slot = writecache_lookup(s, i);
+
+            if (slot) {
+                writecache_drop_slot(s, slot);
+            }
+        }
+    }
+
+    /*
+     * Older copies must not come back either.  The caller holds
+     * writeback_lock, so none of them is being written back.
+     */
+    QTAILQ_FOREACH_SAFE(slot, &s->superseded, next, next_slot) {
+        if (slot->block >= start && slot->block < end) {
+            QTAILQ_REMOVE(&s->superseded, slot, next);
+            slot->superseded = false;
+            writecache_release_slot(s, slot);
+        }
+    }
+
+    return writecache_commit(s);
+}
+
+static int coroutine_fn writecache_co_pwrite_zeroes(BlockDriverState *bs,
+                                                    int64_t offset, int bytes,
+                                                    BdrvRequestFlags flags)
+{
+    BDRVWritecacheState *s = bs->opaque;
+    int ret;
+
+    qemu_co_mutex_lock(&s->writeback_lock);
+    ret = writecache_invalidate(s, offset, bytes);
+    if (ret >= 0) {
+        ret = bdrv_co_pwrite_zeroes(bs->file, offset, bytes, flags);
+    }
+    qemu_co_mutex_unlock(&s->writeback_lock);
+
+    return ret;
+}
+
+static int coroutine_fn writecache_co_pdiscard(BlockDriverState *bs,
+                                               int64_t offset, int bytes)
+{
+    BDRVWritecacheState *s = bs->opaque;
+    int ret;
+
+    qemu_co_mutex_lock(&s->writeback_lock);
+    ret = writecache_invalidate(s, offset, bytes);
+    if (ret >= 0) {
+        ret = bdrv_co_pdiscard(bs->file, offset, bytes);
+    }
+    qemu_co_mutex_unlock(&s->writeback_lock);
+
+    return ret;
+}
+
+/*
+ * Committed data is stable in the cache, so there is no need to flush the
+ * file child, which writeback does on its own.
+ */
+static int coroutine_fn writecache_co_flush(BlockDriverState *bs)
+{
+    BDRVWritecacheState *s = bs->opaque;
+
+    return writecache_commit(s);
+}
+
+static void coroutine_fn writecache_co_drain_begin(BlockDriverState *bs)
+{
+    BDRVWritecacheState *s = bs->opaque;
+
+    if (s->writeback_timer) {
+        timer_del(s->writeback_timer);
+    }
+}
+
+static void coroutine_fn writecache_co_drain_end(BlockDriverState *bs)
+{
+    BDRVWritecacheState *s = bs->opaque;
+
+    if (!QTAILQ_EMPTY(&s->dirty)) {
+        writecache_start_timer(s);
+    }
+}
+
+static const char *const writecache_strong_runtime_opts[] = {
+    "cache-file",
+
+    NULL
+};
+
+static BlockDriver bdrv_writecache = {
+    .format_name                = "writecache",
+    .instance_size              = sizeof(BDRVWritecacheState),
+
+    .bdrv_open                  = writecache_open,
+    .bdrv_close                 = writecache_close,
+    .bdrv_getlength             = writecache_getlength,
+    .bdrv_child_perm            = bdrv_default_perms,
+    .bdrv_refresh_limits        = writecache_refresh_limits,
+
+    .bdrv_co_preadv             = writecache_co_preadv,
+    .bdrv_co_pwritev            = writecache_co_pwritev,
+    .bdrv_co_pwrite_zeroes      = writecache_co_pwrite_zeroes,
+    .bdrv_co_pdiscard           = writecache_co_pdiscard,
+    .bdrv_co_flush              = writecache_co_flush,
+
+    .bdrv_detach_aio_context    = writecache_detach_aio_context,
+    .bdrv_attach_aio_context    = writecache_attach_aio_context,
+    .bdrv_co_drain_begin        = writecache_co_drain_begin,
+    .bdrv_co_drain_end          = writecache_co_drain_end,
+
+    .strong_runtime_opts        = writecache_strong_runtime_opts,
+};
+
+static void bdrv_writecache_init(void)
+{
+    bdrv_register(&bdrv_writecache);
+}
+
+block_init(bdrv_writecache_init);
@@ -41,6 +41,13 @@ static int fd_chr_write(Chardev *chr, const uint8_t *buf, int len)
     return io_channel_send(s->ioc_out, buf, len);
 }
 
+static int fd_chr_writev(Chardev *chr, const struct iovec *iov, int iovcnt)
+{
+    FDChardev *s = FD_CHARDEV(chr);
+
+    return io_channel_sendv_full(s->ioc_out, iov, iovcnt, NULL, 0);
+}
+
 static gboolean fd_chr_read(QIOChannel *chan, GIOCondition cond, void *opaque)
 {
     Chardev *chr = CHARDEV(opaque);
@@ -150,6 +157,7 @@ static void char_fd_class_init(ObjectClass *oc, void *data)
 
     cc->chr_add_watch = fd_chr_add_watch;
     cc->chr_write = fd_chr_write;
+    cc->chr_writev = fd_chr_writev;
     cc->chr_update_read_handler = fd_chr_update_read_handler;
 }
 
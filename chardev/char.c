@@ -39,6 +39,7 @@
 #include "qemu/option.h"
 #include "qemu/id.h"
 #include "qemu/coroutine.h"
+#include "qemu/timer.h"
 
 #include "chardev-internal.h"
 
@@ -107,7 +108,11 @@ static void qemu_chr_write_log(Chardev *s, const uint8_t *buf, size_t len)
     }
 }
 
-static int qemu_chr_write_buffer(Chardev *s,
+/* Output that qemu_chr_write_coalesced() queues before writing it out */
+#define CHR_OUTBUF_MAX 65536
+
+/* Called with chr_write_lock held */
+static int qemu_chr_write_locked(Chardev *s,
                                  const uint8_t *buf, int len,
                                  int *offset, bool write_all)
 {
@@ -115,7 +120,6 @@ static int qemu_chr_write_buffer(Chardev *s,
     int res = 0;
     *offset = 0;
 
-    qemu_mutex_lock(&s->chr_write_lock);
     while (*offset < len) {
     retry:
         res = cc->chr_write(s, buf + *offset, len - *offset);
@@ -137,6 +141,17 @@ static int qemu_chr_write_buffer(Chardev *s,
             break;
         }
     }
+    return res;
+}
+
+static int qemu_chr_write_buffer(Chardev *s,
+                                 const uint8_t *buf, int len,
+                                 int *offset, bool write_all)
+{
+    int res;
+
+    qemu_mutex_lock(&s->chr_write_lock);
+    res = qemu_chr_write_locked(s, buf, len, offset, write_all);
     if (*offset > 0) {
         /*
          * If some data was written by backend, we should
@@ -158,11 +173,133 @@ static int qemu_chr_write_buffer(Chardev *s,
     return res;
 }
 
+/*
+ * Write out the data that qemu_chr_write_coalesced() queued.  Data that
+ * the backend refuses with an error other than EAGAIN is dropped.
+ * Called with chr_write_lock held.
+ */
+static void qemu_chr_flush_locked(Chardev *s, bool write_all)
+{
+    int offset;
+    int res;
+
+    if (!s->outbuf->len) {
+        return;
+    }
+
+    res = qemu_chr_write_locked(s, s->outbuf->data, s->outbuf->len,
+                                &offset, write_all);
+    if (res < 0 && errno != EAGAIN) {
+        g_byte_array_set_size(s->outbuf, 0);
+    } else {
+        g_byte_array_remove_range(s->outbuf, 0, offset);
+    }
+}
+
+static void qemu_chr_flush_timer(void *opaque)
+{
+    Chardev *s = opaque;
+
+    qemu_mutex_lock(&s->chr_write_lock);
+    qemu_chr_flush_locked(s, false);
+    if (s->outbuf->len) {
+        timer_mod(s->flush_timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+                                  s->flush_delay);
+    }
+    qemu_mutex_unlock(&s->chr_write_lock);
+}
+
+/*
+ * With flush-delay set, small writes are queued and written out
+ * together when the timer fires, so that a frontend that writes a byte
+ * at a time does not cost a system call per byte.
+ */
+static int qemu_chr_write_coalesced(Chardev *s, const uint8_t *buf, int len,
+                                    bool write_all)
+{
+    int offset;
+    int res;
+
+    qemu_mutex_lock(&s->chr_write_lock);
+    if (s->outbuf->len + len > CHR_OUTBUF_MAX) {
+        qemu_chr_flush_locked(s, write_all);
+        if (s->outbuf->len) {
+            /* Only possible without write_all, let the frontend retry */
+            qemu_mutex_unlock(&s->chr_write_lock);
+            errno = EAGAIN;
+            return -1;
+        }
+        if (len > CHR_OUTBUF_MAX) {
+            qemu_mutex_unlock(&s->chr_write_lock);
+            res = qemu_chr_write_buffer(s, buf, len, &offset, write_all);
+            return res < 0 ? res : offset;
+        }
+    }
+
+    if (!s->outbuf->len) {
+        timer_mod(s->flush_timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+                                  s->flush_delay);
+    }
+    g_byte_array_append(s->outbuf, buf, len);
+    qemu_chr_write_log(s, buf, len);
+    qemu_mutex_unlock(&s->chr_write_lock);
+    return len;
+}
+
+int qemu_chr_writev(Chardev *s, const struct iovec *iov, int iovcnt)
+{
+    ChardevClass *cc = CHARDEV_GET_CLASS(s);
+    int done = 0;
+    int res = 0;
+    int i;
+
+    if (!cc->chr_writev || s->outbuf || qemu_chr_replay(s)) {
+        for (i = 0; i < iovcnt; i++) {
+            res = qemu_chr_write(s, iov[i].iov_base, iov[i].iov_len, false);
+            if (res < 0) {
+                return done ? done : res;
+            }
+            done += res;
+            if (res < iov[i].iov_len) {
+                break;
+            }
+        }
+        return done;
+    }
+
+    qemu_mutex_lock(&s->chr_write_lock);
+    res = cc->chr_writev(s, iov, iovcnt);
+    for (i = 0; i < iovcnt && done < res; i++) {
+        size_t len = MIN(iov[i].iov_len, res - done);
+
+        qemu_chr_write_log(s, iov[i].iov_base, len);
+        done += len;
+    }
+    qemu_mutex_unlock(&s->chr_write_lock);
+    return res;
+}
+
+void qemu_chr_flush(Chardev *s)
+{
+    if (!s->outbuf) {
+        return;
+    }
+
+    qemu_mutex_lock(&s->chr_write_lock);
+    timer_del(s->flush_timer);
+    qemu_chr_flush_locked(s, true);
+    qemu_mutex_unlock(&s->chr_write_lock);
+}
+
 int qemu_chr_write(Chardev *s, const uint8_t *buf, int len, bool write_all)
 {
     int offset = 0;
     int res;
 
+    if (s->outbuf && !qemu_chr_replay(s)) {
+        return qemu_chr_write_coalesced(s, buf, len, write_all);
+    }
+
     if (qemu_chr_replay(s) && replay_mode == REPLAY_MODE_PLAY) {
         replay_char_write_event_load(&res, &offset);
         assert(offset <= len);
@@ -257,6 +394,13 @@ static void qemu_char_open(Chardev *chr, ChardevBackend *backend,
         }
     }
 
+    if (common && common->has_flush_delay && common->flush_delay) {
+        chr->flush_delay = common->flush_delay;
+        chr->outbuf = g_byte_array_new();
+        chr->flush_timer = timer_new_ms(QEMU_CLOCK_REALTIME,
+                                        qemu_chr_flush_timer, chr);
+    }
+
     if (cc->open) {
         cc->open(chr, backend, be_opened, errp);
     }
@@ -284,10 +428,17 @@ static int null_chr_write(Chardev *chr, const uint8_t *buf, int len)
     return len;
 }
 
+static void char_unparent(Object *obj)
+{
+    /* Write out queued data while the backend is still open */
+    qemu_chr_flush(CHARDEV(obj));
+}
+
 static void char_class_init(ObjectClass *oc, void *data)
 {
     ChardevClass *cc = CHARDEV_CLASS(oc);
 
+    oc->unparent = char_unparent;
     cc->chr_write = null_chr_write;
     cc->chr_be_event = chr_be_event;
 }
@@ -304,6 +455,10 @@ static void char_finalize(Object *obj)
     if (chr->logfd != -1) {
         close(chr->logfd);
     }
+    if (chr->outbuf) {
+        timer_free(chr->flush_timer);
+        g_byte_array_unref(chr->outbuf);
+    }
     qemu_mutex_destroy(&chr->chr_write_lock);
 }
 
@@ -503,6 +658,9 @@ void qemu_chr_parse_common(QemuOpts *opts, ChardevCommon *backend)
 
     backend->has_logappend = true;
     backend->logappend = qemu_opt_get_bool(opts, "logappend", false);
+
+    backend->has_flush_delay = qemu_opt_get(opts, "flush-delay") != NULL;
+    backend->flush_delay = qemu_opt_get_number(opts, "flush-delay", 0);
 }
 
 static const ChardevClass *char_get_class(const char *driver, Error **errp)
@@ -928,6 +1086,9 @@ QemuOptsList qemu_chardev_opts = {
         },{
             .name = "logappend",
             .type = QEMU_OPT_BOOL,
+        },{
+            .name = "flush-delay",
+            .type = QEMU_OPT_NUMBER,
 #ifdef CONFIG_LINUX
         },{
             .name = "tight",
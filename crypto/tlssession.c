@@ -32,6 +32,18 @@
 
 #include <gnutls/x509.h>
 
+#ifdef CONFIG_LINUX_KTLS
+#include <netinet/tcp.h>
+#include <linux/tls.h>
+
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+#endif
+
 
 struct QCryptoTLSSession {
     QCryptoTLSCreds *creds;
@@ -548,6 +560,137 @@ qcrypto_tls_session_get_peer_name(QCryptoTLSSession *session)
 }
 
 
+#ifdef CONFIG_LINUX_KTLS
+/*
+ * TLS 1.2 GCM records carry an explicit nonce, which starts out as the
+ * sequence number; TLS 1.3 derives the whole nonce from the static IV.
+ */
+#define QCRYPTO_KTLS_FILL_INFO(ci, ver, cipher, tls13, ivd, keyd, seq)      \
+    do {                                                                    \
+        (ci).info.version = (ver);                                          \
+        (ci).info.cipher_type = (cipher);                                   \
+        memcpy((ci).salt, (ivd)->data, sizeof((ci).salt));                  \
+        if (tls13) {                                                        \
+            memcpy((ci).iv, (ivd)->data + sizeof((ci).salt),                \
+                   sizeof((ci).iv));                                        \
+        } else {                                                            \
+            memcpy((ci).iv, (seq), sizeof((ci).iv));                        \
+        }                                                                   \
+        memcpy((ci).key, (keyd)->data, sizeof((ci).key));                   \
+        memcpy((ci).rec_seq, (seq), sizeof((ci).rec_seq));                  \
+    } while (0)
+
+int
+qcrypto_tls_session_enable_ktls_tx(QCryptoTLSSession *session,
+                                   int fd,
+                                   Error **errp)
+{
+    union {
+        struct tls12_crypto_info_aes_gcm_128 aes128;
+        struct tls12_crypto_info_aes_gcm_256 aes256;
+    } info;
+    gnutls_datum_t mac_key, iv, cipher_key;
+    unsigned char seq[8];
+    gnutls_protocol_t proto;
+    bool tls13 = false;
+    int version;
+    size_t len;
+    int ret;
+
+    if (!session->creds->ktls) {
+        return 0;
+    }
+
+    assert(session->handshakeComplete);
+
+    proto = gnutls_protocol_get_version(session->handle);
+    switch (proto) {
+    case GNUTLS_TLS1_2:
+        version = TLS_1_2_VERSION;
+        break;
+#if defined(TLS_1_3_VERSION) && GNUTLS_VERSION_NUMBER >= 0x030603
+    case GNUTLS_TLS1_3:
+        version = TLS_1_3_VERSION;
+        tls13 = true;
+        break;
+#endif
+    default:
+        error_setg(errp, "Kernel TLS does not support %s",
+                   gnutls_protocol_get_name(proto));
+        return -1;
+    }
+
+    ret = gnutls_record_get_state(session->handle, 0, &mac_key, &iv,
+                                  &cipher_key, seq);
+    if (ret < 0) {
+        error_setg(errp, "Cannot get TLS session keys: %s",
+                   gnutls_strerror(ret));
+        return -1;
+    }
+
+    memset(&info, 0, sizeof(info));
+    switch (gnutls_cipher_get(session->handle)) {
+    case GNUTLS_CIPHER_AES_128_GCM:
+        if (iv.size < sizeof(info.aes128.salt) +
+                      (tls13 ? sizeof(info.aes128.iv) : 0) ||
+            cipher_key.size != sizeof(info.aes128.key)) {
+            goto bad_cipher;
+        }
+        QCRYPTO_KTLS_FILL_INFO(info.aes128, version, TLS_CIPHER_AES_GCM_128,
+                               tls13, &iv, &cipher_key, seq);
+        len = sizeof(info.aes128);
+        break;
+    case GNUTLS_CIPHER_AES_256_GCM:
+        if (iv.size < sizeof(info.aes256.salt) +
+                      (tls13 ? sizeof(info.aes256.iv) : 0) ||
+            cipher_key.size != sizeof(info.aes256.key)) {
+            goto bad_cipher;
+        }
+        QCRYPTO_KTLS_FILL_INFO(info.aes256, version, TLS_CIPHER_AES_GCM_256,
+                               tls13, &iv, &cipher_key, seq);
+        len = sizeof(info.aes256);
+        break;
+    default:
+        goto bad_cipher;
+    }
+
+    if (setsockopt(fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) < 0) {
+        error_setg_errno(errp, errno, "Cannot enable kernel TLS");
+        ret = -1;
+    } else if (setsockopt(fd, SOL_TLS, TLS_TX, &info, len) < 0) {
+        error_setg_errno(errp, errno, "Cannot set kernel TLS keys");
+        ret = -1;
+    } else {
+        ret = 1;
+    }
+
+    /* Do not leave session keys around on the stack */
+    memset(&info, 0, sizeof(info));
+    return ret;
+
+ bad_cipher:
+    error_setg(errp, "Kernel TLS does not support cipher %s",
+               gnutls_cipher_get_name(gnutls_cipher_get(session->handle)));
+    return -1;
+}
+
+#else /* ! CONFIG_LINUX_KTLS */
+
+int
+qcrypto_tls_session_enable_ktls_tx(QCryptoTLSSession *session,
+                                   int fd,
+                                   Error **errp)
+{
+    if (!session->creds->ktls) {
+        return 0;
+    }
+
+    error_setg(errp, "Kernel TLS is not supported on this host");
+    return -1;
+}
+#endif /* ! CONFIG_LINUX_KTLS */
+
+
 #else /* ! CONFIG_GNUTLS */
 
 
@@ -639,4 +782,13 @@ qcrypto_tls_session_get_peer_name(QCryptoTLSSession *sess)
     return NULL;
 }
 
+
+int
+qcrypto_tls_session_enable_ktls_tx(QCryptoTLSSession *sess,
+                                   int fd,
+                                   Error **errp)
+{
+    return 0;
+}
+
 #endif
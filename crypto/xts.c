@@ -99,6 +99,60 @@ static inline void xts_tweak_encdec(const void *ctx,
 }
 
 
+/*
+ * Number of blocks passed to the cipher function at once, so that
+ * implementations that can pipeline several blocks get to do so.
+ */
+#define XTS_PARALLEL_BLOCKS 8
+
+/**
+ * xts_tweak_encdec_blocks:
+ * @param ctxt: the cipher context
+ * @param func: the cipher function
+ * @src: buffer providing the input text of @nblocks * XTS_BLOCK_SIZE bytes
+ * @dst: buffer to output the output text of @nblocks * XTS_BLOCK_SIZE bytes
+ * @iv: the initialization vector tweak of XTS_BLOCK_SIZE bytes
+ * @nblocks: the number of blocks
+ *
+ * Encrypt/decrypt consecutive blocks with a tweak.  @src and @dst need
+ * not be aligned and may be the same buffer.
+ */
+static void xts_tweak_encdec_blocks(const void *ctx,
+                                    xts_cipher_func *func,
+                                    const uint8_t *src,
+                                    uint8_t *dst,
+                                    xts_uint128 *iv,
+                                    unsigned long nblocks)
+{
+    xts_uint128 T[XTS_PARALLEL_BLOCKS];
+    xts_uint128 D[XTS_PARALLEL_BLOCKS];
+    unsigned long i, n;
+
+    while (nblocks) {
+        n = MIN(nblocks, XTS_PARALLEL_BLOCKS);
+
+        /* The tweaks are a serial chain, but cheap to compute */
+        for (i = 0; i < n; i++) {
+            memcpy(&D[i], src + i * XTS_BLOCK_SIZE, XTS_BLOCK_SIZE);
+            T[i] = *iv;
+            xts_uint128_xor(&D[i], &D[i], &T[i]);
+            xts_mult_x(iv);
+        }
+
+        func(ctx, n * XTS_BLOCK_SIZE, D[0].b, D[0].b);
+
+        for (i = 0; i < n; i++) {
+            xts_uint128_xor(&D[i], &D[i], &T[i]);
+            memcpy(dst + i * XTS_BLOCK_SIZE, &D[i], XTS_BLOCK_SIZE);
+        }
+
+        src += n * XTS_BLOCK_SIZE;
+        dst += n * XTS_BLOCK_SIZE;
+        nblocks -= n;
+    }
+}
+
+
 void xts_decrypt(const void *datactx,
                  const void *tweakctx,
                  xts_cipher_func *encfunc,
@@ -127,24 +181,9 @@ void xts_decrypt(const void *datactx,
     /* encrypt the iv */
     encfunc(tweakctx, XTS_BLOCK_SIZE, T.b, iv);
 
-    if (QEMU_PTR_IS_ALIGNED(src, sizeof(uint64_t)) &&
-        QEMU_PTR_IS_ALIGNED(dst, sizeof(uint64_t))) {
-        xts_uint128 *S = (xts_uint128 *)src;
-        xts_uint128 *D = (xts_uint128 *)dst;
-        for (i = 0; i < lim; i++, S++, D++) {
-            xts_tweak_encdec(datactx, decfunc, S, D, &T);
-        }
-    } else {
-        xts_uint128 D;
-
-        for (i = 0; i < lim; i++) {
-            memcpy(&D, src, XTS_BLOCK_SIZE);
-            xts_tweak_encdec(datactx, decfunc, &D, &D, &T);
-            memcpy(dst, &D, XTS_BLOCK_SIZE);
-            src += XTS_BLOCK_SIZE;
-            dst += XTS_BLOCK_SIZE;
-        }
-    }
+    xts_tweak_encdec_blocks(datactx, decfunc, src, dst, &T, lim);
+    src += lim * XTS_BLOCK_SIZE;
+    dst += lim * XTS_BLOCK_SIZE;
 
     /* if length is not a multiple of XTS_BLOCK_SIZE then */
     if (mo > 0) {
@@ -203,25 +242,9 @@ void xts_encrypt(const void *datactx,
     /* encrypt the iv */
     encfunc(tweakctx, XTS_BLOCK_SIZE, T.b, iv);
 
-    if (QEMU_PTR_IS_ALIGNED(src, sizeof(uint64_t)) &&
-        QEMU_PTR_IS_ALIGNED(dst, sizeof(uint64_t))) {
-        xts_uint128 *S = (xts_uint128 *)src;
-        xts_uint128 *D = (xts_uint128 *)dst;
-        for (i = 0; i < lim; i++, S++, D++) {
-            xts_tweak_encdec(datactx, encfunc, S, D, &T);
-        }
-    } else {
-        xts_uint128 D;
-
-        for (i = 0; i < lim; i++) {
-            memcpy(&D, src, XTS_BLOCK_SIZE);
-            xts_tweak_encdec(datactx, encfunc, &D, &D, &T);
-            memcpy(dst, &D, XTS_BLOCK_SIZE);
-
-            dst += XTS_BLOCK_SIZE;
-            src += XTS_BLOCK_SIZE;
-        }
-    }
+    xts_tweak_encdec_blocks(datactx, encfunc, src, dst, &T, lim);
+    src += lim * XTS_BLOCK_SIZE;
+    dst += lim * XTS_BLOCK_SIZE;
 
     /* if length is not a multiple of XTS_BLOCK_SIZE then */
     if (mo > 0) {
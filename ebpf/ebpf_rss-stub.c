@@ -0,0 +1,33 @@
+/*
+ * eBPF RSS stub when eBPF support is not compiled in
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "ebpf/ebpf_rss.h"
+
+void ebpf_rss_init(EBPFRSSContext *ctx)
+{
+}
+
+bool ebpf_rss_is_loaded(EBPFRSSContext *ctx)
+{
+    return false;
+}
+
+bool ebpf_rss_load(EBPFRSSContext *ctx)
+{
+    return false;
+}
+
+bool ebpf_rss_set_all(EBPFRSSContext *ctx, EBPFRSSConfig *config,
+                      uint16_t *indirections_table, uint8_t *toeplitz_key)
+{
+    return false;
+}
+
+void ebpf_rss_unload(EBPFRSSContext *ctx)
+{
+}
@@ -0,0 +1,160 @@
+/*
+ * eBPF RSS loader
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * The object file compiled from tools/ebpf/rss.bpf.c is embedded in QEMU
+ * and loaded with libbpf.  Once loaded, the program is attached to the tap
+ * device by the net backend and configured by virtio-net through its maps.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/error-report.h"
+#include <bpf/libbpf.h>
+#include <bpf/bpf.h>
+
+#include "ebpf/ebpf_rss.h"
+#include "trace.h"
+#include "ebpf/rss.bpf.h"
+
+/* Layout of the Toeplitz key map, see tools/ebpf/rss.bpf.c */
+typedef struct EBPFRSSToeplitzKey {
+    uint32_t leftmost_32_bits;
+    uint8_t next_byte[EBPF_RSS_KEY_SIZE - 4];
+} EBPFRSSToeplitzKey;
+
+void ebpf_rss_init(EBPFRSSContext *ctx)
+{
+    if (ctx) {
+        ctx->obj = NULL;
+        ctx->program_fd = -1;
+    }
+}
+
+bool ebpf_rss_is_loaded(EBPFRSSContext *ctx)
+{
+    return ctx && ctx->obj;
+}
+
+bool ebpf_rss_load(EBPFRSSContext *ctx)
+{
+    struct bpf_object *obj;
+    struct bpf_program *prog;
+    int err;
+
+    if (ebpf_rss_is_loaded(ctx)) {
+        return false;
+    }
+
+    obj = bpf_object__open_mem(ebpf_rss_bpf_obj, sizeof(ebpf_rss_bpf_obj),
+                               NULL);
+    err = libbpf_get_error(obj);
+    if (err) {
+        trace_ebpf_rss_error("failed to open the program", -err);
+        return false;
+    }
+
+    prog = bpf_object__find_program_by_name(obj, "tun_rss_steering_prog");
+    if (!prog) {
+        trace_ebpf_rss_error("program not found", ENOENT);
+        goto error;
+    }
+    /* The tun steering hook runs socket filters */
+    bpf_program__set_socket_filter(prog);
+
+    err = bpf_object__load(obj);
+    if (err) {
+        trace_ebpf_rss_error("failed to load the program", -err);
+        goto error;
+    }
+
+    ctx->program_fd = bpf_program__fd(prog);
+    ctx->map_configuration =
+        bpf_object__find_map_fd_by_name(obj, "tap_rss_map_configurations");
+    ctx->map_toeplitz_key =
+        bpf_object__find_map_fd_by_name(obj, "tap_rss_map_toeplitz_key");
+    ctx->map_indirections_table =
+        bpf_object__find_map_fd_by_name(obj, "tap_rss_map_indirection_table");
+    if (ctx->map_configuration < 0 || ctx->map_toeplitz_key < 0 ||
+        ctx->map_indirections_table < 0) {
+        trace_ebpf_rss_error("map not found", ENOENT);
+        goto error;
+    }
+
+    ctx->obj = obj;
+    return true;
+
+error:
+    bpf_object__close(obj);
+    ctx->program_fd = -1;
+    return false;
+}
+
+static bool ebpf_rss_set_config(EBPFRSSContext *ctx, EBPFRSSConfig *config)
+{
+    uint32_t map_key = 0;
+
+    return !bpf_map_update_elem(ctx->map_configuration, &map_key, config, 0);
+}
+
+static bool ebpf_rss_set_indirections_table(EBPFRSSContext *ctx,
+                                            uint16_t *indirections_table,
+                                            size_t len)
+{
+    uint32_t i;
+
+    if (len > EBPF_RSS_INDIRECTION_TABLE_SIZE) {
+        return false;
+    }
+
+    for (i = 0; i < len; i++) {
+        if (bpf_map_update_elem(ctx->map_indirections_table, &i,
+                                &indirections_table[i], 0)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool ebpf_rss_set_toeplitz_key(EBPFRSSContext *ctx,
+                                      uint8_t *toeplitz_key)
+{
+    EBPFRSSToeplitzKey key;
+    uint32_t map_key = 0;
+
+    /* The program expects the first four bytes as a host-endian word */
+    key.leftmost_32_bits = ldl_be_p(toeplitz_key);
+    memcpy(key.next_byte, toeplitz_key + 4, sizeof(key.next_byte));
+
+    return !bpf_map_update_elem(ctx->map_toeplitz_key, &map_key, &key, 0);
+}
+
+bool ebpf_rss_set_all(EBPFRSSContext *ctx, EBPFRSSConfig *config,
+                      uint16_t *indirections_table, uint8_t *toeplitz_key)
+{
+    if (!ebpf_rss_is_loaded(ctx) || !config || !indirections_table ||
+        !toeplitz_key) {
+        return false;
+    }
+
+    /*
+     * The configuration goes last: with a new table length, the program
+     * must not index entries that are not written yet.
+     */
+    return ebpf_rss_set_indirections_table(ctx, indirections_table,
+                                           config->indirections_len) &&
+           ebpf_rss_set_toeplitz_key(ctx, toeplitz_key) &&
+           ebpf_rss_set_config(ctx, config);
+}
+
+void ebpf_rss_unload(EBPFRSSContext *ctx)
+{
+    if (!ebpf_rss_is_loaded(ctx)) {
+        return;
+    }
+
+    bpf_object__close(ctx->obj);
+    ctx->obj = NULL;
+    ctx->program_fd = -1;
+}
@@ -0,0 +1,51 @@
+/*
+ * eBPF RSS loader
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_EBPF_RSS_H
+#define QEMU_EBPF_RSS_H
+
+#define EBPF_RSS_INDIRECTION_TABLE_SIZE 128
+#define EBPF_RSS_KEY_SIZE               40
+
+typedef struct EBPFRSSContext {
+    void *obj;
+    int program_fd;
+    int map_configuration;
+    int map_toeplitz_key;
+    int map_indirections_table;
+} EBPFRSSContext;
+
+/* Layout of the configuration map, see tools/ebpf/rss.bpf.c */
+typedef struct EBPFRSSConfig {
+    uint8_t redirect;
+    uint8_t populate_hash;
+    uint32_t hash_types;
+    uint16_t indirections_len;
+    uint16_t default_queue;
+} QEMU_PACKED EBPFRSSConfig;
+
+void ebpf_rss_init(EBPFRSSContext *ctx);
+
+bool ebpf_rss_is_loaded(EBPFRSSContext *ctx);
+
+/*
+ * Load the RSS program and create its maps.  Returns false if eBPF RSS is
+ * not available, in which case RSS has to be done in QEMU.
+ */
+bool ebpf_rss_load(EBPFRSSContext *ctx);
+
+/*
+ * Update the maps of a loaded program with a new RSS configuration.
+ * @indirections_table has config->indirections_len entries and @toeplitz_key
+ * EBPF_RSS_KEY_SIZE bytes.
+ */
+bool ebpf_rss_set_all(EBPFRSSContext *ctx, EBPFRSSConfig *config,
+                      uint16_t *indirections_table, uint8_t *toeplitz_key);
+
+void ebpf_rss_unload(EBPFRSSContext *ctx);
+
+#endif /* QEMU_EBPF_RSS_H */
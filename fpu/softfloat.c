@@ -401,6 +401,96 @@ float64_gen2(float64 xa, float64 xb, float_status *s,
     return soft(ua.s, ub.s, s);
 }
 
+/*
+ * Array versions of float{32,64}_gen2, for vector helpers.  Elements
+ * are handled in chunks.  The host results and the checks for a whole
+ * chunk are computed in a branch-free loop that the compiler can
+ * vectorize.  Only the elements that fail the checks are then redone
+ * in softfloat, and overflow is raised once per chunk.  All inputs of a
+ * chunk are read before any result is stored, so D may alias A or B.
+ */
+#define GEN2_ARRAY_CHUNK 16
+
+static inline void
+float32_gen2_array(float32 *d, const float32 *a, const float32 *b,
+                   size_t n, float_status *s,
+                   hard_f32_op2_fn hard, soft_f32_op2_fn soft,
+                   f32_check_fn pre, f32_check_fn post)
+{
+    union_float32 ua[GEN2_ARRAY_CHUNK], ub[GEN2_ARRAY_CHUNK];
+    union_float32 ur[GEN2_ARRAY_CHUNK];
+    bool ok[GEN2_ARRAY_CHUNK];
+    size_t i, j, len;
+
+    for (i = 0; i < n; i += len) {
+        bool overflow = false;
+
+        len = MIN(n - i, GEN2_ARRAY_CHUNK);
+        if (unlikely(!can_use_fpu(s))) {
+            for (j = 0; j < len; j++) {
+                d[i + j] = soft(a[i + j], b[i + j], s);
+            }
+            continue;
+        }
+
+        for (j = 0; j < len; j++) {
+            ua[j].s = a[i + j];
+            ub[j].s = b[i + j];
+            float32_input_flush2(&ua[j].s, &ub[j].s, s);
+            ur[j].h = hard(ua[j].h, ub[j].h);
+            ok[j] = pre(ua[j], ub[j]) &&
+                    !(fabsf(ur[j].h) <= FLT_MIN && post(ua[j], ub[j]));
+            overflow |= ok[j] && f32_is_inf(ur[j]);
+        }
+        if (unlikely(overflow)) {
+            s->float_exception_flags |= float_flag_overflow;
+        }
+        for (j = 0; j < len; j++) {
+            d[i + j] = likely(ok[j]) ? ur[j].s : soft(ua[j].s, ub[j].s, s);
+        }
+    }
+}
+
+static inline void
+float64_gen2_array(float64 *d, const float64 *a, const float64 *b,
+                   size_t n, float_status *s,
+                   hard_f64_op2_fn hard, soft_f64_op2_fn soft,
+                   f64_check_fn pre, f64_check_fn post)
+{
+    union_float64 ua[GEN2_ARRAY_CHUNK], ub[GEN2_ARRAY_CHUNK];
+    union_float64 ur[GEN2_ARRAY_CHUNK];
+    bool ok[GEN2_ARRAY_CHUNK];
+    size_t i, j, len;
+
+    for (i = 0; i < n; i += len) {
+        bool overflow = false;
+
+        len = MIN(n - i, GEN2_ARRAY_CHUNK);
+        if (unlikely(!can_use_fpu(s))) {
+            for (j = 0; j < len; j++) {
+                d[i + j] = soft(a[i + j], b[i + j], s);
+            }
+            continue;
+        }
+
+        for (j = 0; j < len; j++) {
+            ua[j].s = a[i + j];
+            ub[j].s = b[i + j];
+            float64_input_flush2(&ua[j].s, &ub[j].s, s);
+            ur[j].h = hard(ua[j].h, ub[j].h);
+            ok[j] = pre(ua[j], ub[j]) &&
+                    !(fabs(ur[j].h) <= DBL_MIN && post(ua[j], ub[j]));
+            overflow |= ok[j] && f64_is_inf(ur[j]);
+        }
+        if (unlikely(overflow)) {
+            s->float_exception_flags |= float_flag_overflow;
+        }
+        for (j = 0; j < len; j++) {
+            d[i + j] = likely(ok[j]) ? ur[j].s : soft(ua[j].s, ub[j].s, s);
+        }
+    }
+}
+
 /*----------------------------------------------------------------------------
 | Returns the fraction bits of the single-precision floating-point value `a'.
 *----------------------------------------------------------------------------*/
@@ -1885,6 +1975,74 @@ float64_div(float64 a, float64 b, float_status *s)
                         f64_div_pre, f64_div_post);
 }
 
+/*
+ * Apply the operation to N pairs of elements, as if calling the
+ * scalar function on each of them in order.
+ */
+void QEMU_FLATTEN
+float32_add_array(float32 *d, const float32 *a, const float32 *b,
+                  size_t n, float_status *s)
+{
+    float32_gen2_array(d, a, b, n, s, hard_f32_add, soft_f32_add,
+                       f32_is_zon2, f32_addsubmul_post);
+}
+
+void QEMU_FLATTEN
+float32_sub_array(float32 *d, const float32 *a, const float32 *b,
+                  size_t n, float_status *s)
+{
+    float32_gen2_array(d, a, b, n, s, hard_f32_sub, soft_f32_sub,
+                       f32_is_zon2, f32_addsubmul_post);
+}
+
+void QEMU_FLATTEN
+float32_mul_array(float32 *d, const float32 *a, const float32 *b,
+                  size_t n, float_status *s)
+{
+    float32_gen2_array(d, a, b, n, s, hard_f32_mul, soft_f32_mul,
+                       f32_is_zon2, f32_addsubmul_post);
+}
+
+void QEMU_FLATTEN
+float32_div_array(float32 *d, const float32 *a, const float32 *b,
+                  size_t n, float_status *s)
+{
+    float32_gen2_array(d, a, b, n, s, hard_f32_div, soft_f32_div,
+                       f32_div_pre, f32_div_post);
+}
+
+void QEMU_FLATTEN
+float64_add_array(float64 *d, const float64 *a, const float64 *b,
+                  size_t n, float_status *s)
+{
+    float64_gen2_array(d, a, b, n, s, hard_f64_add, soft_f64_add,
+                       f64_is_zon2, f64_addsubmul_post);
+}
+
+void QEMU_FLATTEN
+float64_sub_array(float64 *d, const float64 *a, const float64 *b,
+                  size_t n, float_status *s)
+{
+    float64_gen2_array(d, a, b, n, s, hard_f64_sub, soft_f64_sub,
+                       f64_is_zon2, f64_addsubmul_post);
+}
+
+void QEMU_FLATTEN
+float64_mul_array(float64 *d, const float64 *a, const float64 *b,
+                  size_t n, float_status *s)
+{
+    float64_gen2_array(d, a, b, n, s, hard_f64_mul, soft_f64_mul,
+                       f64_is_zon2, f64_addsubmul_post);
+}
+
+void QEMU_FLATTEN
+float64_div_array(float64 *d, const float64 *a, const float64 *b,
+                  size_t n, float_status *s)
+{
+    float64_gen2_array(d, a, b, n, s, hard_f64_div, soft_f64_div,
+                       f64_div_pre, f64_div_post);
+}
+
 /*
  * Returns the result of dividing the bfloat16
  * value `a' by the corresponding value `b'.
@@ -2007,15 +2165,47 @@ float16 float64_to_float16(float64 a, bool ieee, float_status *s)
     return float16a_round_pack_canonical(pr, s, fmt16);
 }
 
-float32 float64_to_float32(float64 a, float_status *s)
+static float32 QEMU_SOFTFLOAT_ATTR
+soft_float64_to_float32(float64 a, float_status *s)
 {
     FloatParts p = float64_unpack_canonical(a, s);
     FloatParts pr = float_to_float(p, &float32_params, s);
     return float32_round_pack_canonical(pr, s);
 }
 
+float32 float64_to_float32(float64 a, float_status *s)
+{
+    union_float64 ua;
+    union_float32 ur;
+
+    ua.s = a;
+    if (unlikely(!can_use_fpu(s))) {
+        goto soft;
+    }
+    if (float64_is_zero(ua.s)) {
+        return float32_set_sign(float32_zero, float64_is_neg(ua.s));
+    }
+    if (unlikely(!float64_is_normal(ua.s))) {
+        goto soft;
+    }
+    /* Narrowing can overflow or underflow; let softfloat raise those.  */
+    ur.h = ua.h;
+    if (unlikely(isinf(ur.h) || fabsf(ur.h) <= FLT_MIN)) {
+        goto soft;
+    }
+    return ur.s;
+
+ soft:
+    return soft_float64_to_float32(ua.s, s);
+}
+
 float32 bfloat16_to_float32(bfloat16 a, float_status *s)
 {
+    if (likely(bfloat16_is_zero_or_normal(a))) {
+        /* bfloat16 is the high half of float32: this is exact.  */
+        return make_float32((uint32_t)a << 16);
+    }
+
     FloatParts p = bfloat16_unpack_canonical(a, s);
     FloatParts pr = float_to_float(p, &float32_params, s);
     return float32_round_pack_canonical(pr, s);
@@ -2157,20 +2347,113 @@ float16 float16_round_to_int(float16 a, float_status *s)
     return float16_round_pack_canonical(pr, s);
 }
 
-float32 float32_round_to_int(float32 a, float_status *s)
+/*
+ * Rounding a finite number to an integer raises at most inexact, so
+ * the host can do it for every rounding mode except round-to-odd.
+ * Each mode has its own libm function, which avoids switching the host
+ * rounding mode; rint() relies on the host using round-to-nearest-even,
+ * as the rest of hardfloat does.
+ */
+static float32 QEMU_SOFTFLOAT_ATTR
+soft_f32_round_to_int(float32 a, float_status *s)
 {
     FloatParts pa = float32_unpack_canonical(a, s);
     FloatParts pr = round_to_int(pa, s->float_rounding_mode, 0, s);
     return float32_round_pack_canonical(pr, s);
 }
 
-float64 float64_round_to_int(float64 a, float_status *s)
+float32 QEMU_FLATTEN float32_round_to_int(float32 a, float_status *s)
+{
+    union_float32 ua, ur;
+
+    ua.s = a;
+    if (QEMU_NO_HARDFLOAT || unlikely(!float32_is_zero_or_normal(ua.s))) {
+        goto soft;
+    }
+    /* Zero and anything with no fraction bits are already integers.  */
+    if (extract32(float32_val(ua.s), 23, 8) >= 0x7f + 23 ||
+        float32_is_zero(ua.s)) {
+        return ua.s;
+    }
+
+    switch (s->float_rounding_mode) {
+    case float_round_nearest_even:
+        ur.h = rintf(ua.h);
+        break;
+    case float_round_down:
+        ur.h = floorf(ua.h);
+        break;
+    case float_round_up:
+        ur.h = ceilf(ua.h);
+        break;
+    case float_round_to_zero:
+        ur.h = truncf(ua.h);
+        break;
+    case float_round_ties_away:
+        ur.h = roundf(ua.h);
+        break;
+    default:
+        goto soft;
+    }
+    if (ur.h != ua.h) {
+        float_raise(float_flag_inexact, s);
+    }
+    return ur.s;
+
+ soft:
+    return soft_f32_round_to_int(ua.s, s);
+}
+
+static float64 QEMU_SOFTFLOAT_ATTR
+soft_f64_round_to_int(float64 a, float_status *s)
 {
     FloatParts pa = float64_unpack_canonical(a, s);
     FloatParts pr = round_to_int(pa, s->float_rounding_mode, 0, s);
     return float64_round_pack_canonical(pr, s);
 }
 
+float64 QEMU_FLATTEN float64_round_to_int(float64 a, float_status *s)
+{
+    union_float64 ua, ur;
+
+    ua.s = a;
+    if (QEMU_NO_HARDFLOAT || unlikely(!float64_is_zero_or_normal(ua.s))) {
+        goto soft;
+    }
+    /* Zero and anything with no fraction bits are already integers.  */
+    if (extract64(float64_val(ua.s), 52, 11) >= 0x3ff + 52 ||
+        float64_is_zero(ua.s)) {
+        return ua.s;
+    }
+
+    switch (s->float_rounding_mode) {
+    case float_round_nearest_even:
+        ur.h = rint(ua.h);
+        break;
+    case float_round_down:
+        ur.h = floor(ua.h);
+        break;
+    case float_round_up:
+        ur.h = ceil(ua.h);
+        break;
+    case float_round_to_zero:
+        ur.h = trunc(ua.h);
+        break;
+    case float_round_ties_away:
+        ur.h = round(ua.h);
+        break;
+    default:
+        goto soft;
+    }
+    if (ur.h != ua.h) {
+        float_raise(float_flag_inexact, s);
+    }
+    return ur.s;
+
+ soft:
+    return soft_f64_round_to_int(ua.s, s);
+}
+
 /*
  * Rounds the bfloat16 value `a' to an integer, and returns the
  * result as a bfloat16 value.
@@ -2827,13 +3110,27 @@ float32 int16_to_float32_scalbn(int16_t a, int scale, float_status *status)
     return int64_to_float32_scalbn(a, scale, status);
 }
 
+/*
+ * Integer to float conversions raise at most inexact, which is already
+ * set when can_use_fpu(), so the host conversion gives the same result.
+ */
 float32 int64_to_float32(int64_t a, float_status *status)
 {
+    if (likely(can_use_fpu(status))) {
+        union_float32 ur;
+        ur.h = a;
+        return ur.s;
+    }
     return int64_to_float32_scalbn(a, 0, status);
 }
 
 float32 int32_to_float32(int32_t a, float_status *status)
 {
+    if (likely(can_use_fpu(status))) {
+        union_float32 ur;
+        ur.h = a;
+        return ur.s;
+    }
     return int64_to_float32_scalbn(a, 0, status);
 }
 
@@ -2860,12 +3157,20 @@ float64 int16_to_float64_scalbn(int16_t a, int scale, float_status *status)
 
 float64 int64_to_float64(int64_t a, float_status *status)
 {
+    if (likely(can_use_fpu(status))) {
+        union_float64 ur;
+        ur.h = a;
+        return ur.s;
+    }
     return int64_to_float64_scalbn(a, 0, status);
 }
 
 float64 int32_to_float64(int32_t a, float_status *status)
 {
-    return int64_to_float64_scalbn(a, 0, status);
+    /* This is always exact.  */
+    union_float64 ur;
+    ur.h = a;
+    return ur.s;
 }
 
 float64 int16_to_float64(int16_t a, float_status *status)
@@ -3161,10 +3466,36 @@ static FloatParts minmax_floats(FloatParts a, FloatParts b, bool ismin,
     }
 }
 
+/*
+ * When neither input is a NaN, an infinity or a denormal that might be
+ * flushed, min/max raises no flags and returns one of the inputs, which
+ * we can pick by comparing the sign-magnitude encodings directly.  This
+ * mirrors the non-NaN half of minmax_floats().  Returns true to pick B.
+ */
+static inline bool minmax_pick_b(uint64_t a, uint64_t b, uint64_t sign,
+                                 bool ismin, bool ismag)
+{
+    uint64_t ma = a & ~sign, mb = b & ~sign;
+    bool a_sign = a & sign, b_sign = b & sign;
+
+    if (ismag && ma != mb) {
+        return (ma < mb) ^ ismin;
+    }
+    if (a_sign == b_sign) {
+        return a_sign ^ (ma < mb) ^ ismin;
+    }
+    return a_sign ^ ismin;
+}
+
 #define MINMAX(sz, name, ismin, isiee, ismag)                           \
 float ## sz float ## sz ## _ ## name(float ## sz a, float ## sz b,      \
                                      float_status *s)                   \
 {                                                                       \
+    if (likely(float ## sz ## _is_zero_or_normal(a) &&                  \
+               float ## sz ## _is_zero_or_normal(b))) {                 \
+        return minmax_pick_b(float ## sz ## _val(a), float ## sz ## _val(b), \
+                             1ull << (sz - 1), ismin, ismag) ? b : a;   \
+    }                                                                   \
     FloatParts pa = float ## sz ## _unpack_canonical(a, s);             \
     FloatParts pb = float ## sz ## _unpack_canonical(b, s);             \
     FloatParts pr = minmax_floats(pa, pb, ismin, isiee, ismag, s);      \
@@ -3198,6 +3529,10 @@ MINMAX(64, maxnummag, false, true, true)
 #define BF16_MINMAX(name, ismin, isiee, ismag)                          \
 bfloat16 bfloat16_ ## name(bfloat16 a, bfloat16 b, float_status *s)     \
 {                                                                       \
+    if (likely(bfloat16_is_zero_or_normal(a) &&                         \
+               bfloat16_is_zero_or_normal(b))) {                        \
+        return minmax_pick_b(a, b, 0x8000, ismin, ismag) ? b : a;       \
+    }                                                                   \
     FloatParts pa = bfloat16_unpack_canonical(a, s);                    \
     FloatParts pb = bfloat16_unpack_canonical(b, s);                    \
     FloatParts pr = minmax_floats(pa, pb, ismin, isiee, ismag, s);      \
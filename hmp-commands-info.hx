@@ -715,6 +715,20 @@ SRST
     Show iothread's identifiers.
 ERST
 
+    {
+        .name       = "stats",
+        .args_type  = "target:s?",
+        .params     = "[vcpu|block|net|iothread]",
+        .help       = "show runtime statistics",
+        .cmd        = hmp_info_stats,
+    },
+
+SRST
+  ``info stats`` [*target*]
+    Show the statistics returned by ``query-stats``, optionally only
+    those of one kind of object.
+ERST
+
     {
         .name       = "rocker",
         .args_type  = "name:s",
@@ -290,7 +290,7 @@ SRST
   changes status of a trace event
 ERST
 
-#if defined(CONFIG_TRACE_SIMPLE)
+#if defined(CONFIG_TRACE_SIMPLE) || defined(CONFIG_TRACE_RING)
     {
         .name       = "trace-file",
         .args_type  = "op:s?,arg:F?",
@@ -302,7 +302,9 @@ ERST
 SRST
 ``trace-file on|off|flush``
   Open, close, or flush the trace file.  If no argument is given, the
-  status of the trace file is displayed.
+  status of the trace file is displayed.  With the ring backend in
+  flight recorder mode, ``off`` and ``on`` pause and resume recording,
+  and ``flush`` dumps the rings into the trace file.
 ERST
 #endif
 
@@ -615,16 +617,20 @@ ERST
     {
         .name       = "sync-profile",
         .args_type  = "op:s?",
-        .params     = "[on|off|reset]",
+        .params     = "[on|sampled|off|reset]",
         .help       = "enable, disable or reset synchronization profiling. "
+                      "'sampled' only profiles some of the contended "
+                      "acquisitions. "
                       "With no arguments, prints whether profiling is on or off.",
         .cmd        = hmp_sync_profile,
     },
 
 SRST
-``sync-profile [on|off|reset]``
+``sync-profile [on|sampled|off|reset]``
   Enable, disable or reset synchronization profiling. With no arguments, prints
-  whether profiling is on or off.
+  whether profiling is on or off. ``sampled`` profiles only one in 16 of the
+  contended lock acquisitions and condition variable waits; its overhead is
+  low enough to leave it enabled.
 ERST
 
     {
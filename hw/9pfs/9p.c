@@ -955,23 +955,6 @@ static int stat_to_qid(V9fsPDU *pdu, const struct stat *stbuf, V9fsQID *qidp)
     return 0;
 }
 
-static int coroutine_fn fid_to_qid(V9fsPDU *pdu, V9fsFidState *fidp,
-                                   V9fsQID *qidp)
-{
-    struct stat stbuf;
-    int err;
-
-    err = v9fs_co_lstat(pdu, &fidp->path, &stbuf);
-    if (err < 0) {
-        return err;
-    }
-    err = stat_to_qid(pdu, &stbuf, qidp);
-    if (err < 0) {
-        return err;
-    }
-    return 0;
-}
-
 V9fsPDU *pdu_alloc(V9fsState *s)
 {
     V9fsPDU *pdu = NULL;
@@ -1383,6 +1366,7 @@ static void coroutine_fn v9fs_attach(void *opaque)
     V9fsFidState *fidp;
     size_t offset = 7;
     V9fsQID qid;
+    struct stat stbuf;
     ssize_t err;
 
     v9fs_string_init(&uname);
@@ -1406,7 +1390,13 @@ static void coroutine_fn v9fs_attach(void *opaque)
         clunk_fid(s, fid);
         goto out;
     }
-    err = fid_to_qid(pdu, fidp, &qid);
+    err = v9fs_co_lstat(pdu, &fidp->path, &stbuf);
+    if (err < 0) {
+        err = -EINVAL;
+        clunk_fid(s, fid);
+        goto out;
+    }
+    err = stat_to_qid(pdu, &stbuf, &qid);
     if (err < 0) {
         err = -EINVAL;
         clunk_fid(s, fid);
@@ -1439,6 +1429,7 @@ static void coroutine_fn v9fs_attach(void *opaque)
     err += offset;
 
     memcpy(&s->root_qid, &qid, sizeof(qid));
+    memcpy(&s->root_st, &stbuf, sizeof(stbuf));
     trace_v9fs_attach_return(pdu->tag, pdu->id,
                              qid.type, qid.version, qid.path);
 out:
@@ -1689,12 +1680,9 @@ static bool name_is_illegal(const char *name)
     return !*name || strchr(name, '/') != NULL;
 }
 
-static bool not_same_qid(const V9fsQID *qid1, const V9fsQID *qid2)
+static bool same_stat_id(const struct stat *a, const struct stat *b)
 {
-    return
-        qid1->type != qid2->type ||
-        qid1->version != qid2->version ||
-        qid1->path != qid2->path;
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino;
 }
 
 static void coroutine_fn v9fs_walk(void *opaque)
@@ -1704,7 +1692,8 @@ static void coroutine_fn v9fs_walk(void *opaque)
     int i, err = 0;
     V9fsPath dpath, path;
     uint16_t nwnames;
-    struct stat stbuf;
+    struct stat stbuf, fidst;
+    struct stat *stbufs = NULL;
     size_t offset = 7;
     int32_t fid, newfid;
     V9fsString *wnames = NULL;
@@ -1750,38 +1739,71 @@ static void coroutine_fn v9fs_walk(void *opaque)
     v9fs_path_init(&dpath);
     v9fs_path_init(&path);
 
-    err = fid_to_qid(pdu, fidp, &qid);
-    if (err < 0) {
-        goto out;
-    }
-
     /*
-     * Both dpath and path initially poin to fidp.
-     * Needed to handle request with nwnames == 0
+     * dpath initially points to fidp and ends up pointing to the last path
+     * component; this handles requests with nwnames == 0 too.
      */
     v9fs_path_copy(&dpath, &fidp->path);
-    v9fs_path_copy(&path, &fidp->path);
-    for (name_idx = 0; name_idx < nwnames; name_idx++) {
-        if (not_same_qid(&pdu->s->root_qid, &qid) ||
-            strcmp("..", wnames[name_idx].data)) {
-            err = v9fs_co_name_to_path(pdu, &dpath, wnames[name_idx].data,
-                                       &path);
-            if (err < 0) {
-                goto out;
-            }
+    if (nwnames) {
+        stbufs = g_new0(struct stat, nwnames);
+    }
 
-            err = v9fs_co_lstat(pdu, &path, &stbuf);
-            if (err < 0) {
-                goto out;
+    /*
+     * Resolve the whole walk with a single dispatch to the worker threads,
+     * rather than with two filesystem round trips per path component.  The
+     * QIDs are computed afterwards, because the QID tables may only be used
+     * from the main thread.
+     */
+    if (v9fs_request_cancelled(pdu)) {
+        err = -EINTR;
+        goto out;
+    }
+    v9fs_path_read_lock(s);
+    v9fs_co_run_in_worker({
+        err = s->ops->lstat(&s->ctx, &dpath, &fidst);
+        if (err < 0) {
+            err = -errno;
+        }
+        stbuf = fidst;
+        for (name_idx = 0; err == 0 && name_idx < nwnames; name_idx++) {
+            if (v9fs_request_cancelled(pdu)) {
+                err = -EINTR;
+                break;
             }
-            err = stat_to_qid(pdu, &stbuf, &qid);
-            if (err < 0) {
-                goto out;
+            if (!same_stat_id(&s->root_st, &stbuf) ||
+                strcmp("..", wnames[name_idx].data)) {
+                err = s->ops->name_to_path(&s->ctx, &dpath,
+                                           wnames[name_idx].data, &path);
+                if (err < 0) {
+                    err = -errno;
+                    break;
+                }
+                err = s->ops->lstat(&s->ctx, &path, &stbuf);
+                if (err < 0) {
+                    err = -errno;
+                    break;
+                }
+                v9fs_path_copy(&dpath, &path);
             }
-            v9fs_path_copy(&dpath, &path);
+            stbufs[name_idx] = stbuf;
+        }
+    });
+    v9fs_path_unlock(s);
+    if (err < 0) {
+        goto out;
+    }
+
+    err = stat_to_qid(pdu, &fidst, &qid);
+    if (err < 0) {
+        goto out;
+    }
+    for (name_idx = 0; name_idx < nwnames; name_idx++) {
+        err = stat_to_qid(pdu, &stbufs[name_idx], &qids[name_idx]);
+        if (err < 0) {
+            goto out;
         }
-        memcpy(&qids[name_idx], &qid, sizeof(qid));
     }
+    v9fs_path_copy(&path, &dpath);
     if (fid == newfid) {
         if (fidp->fid_type != P9_FID_NONE) {
             err = -EINVAL;
@@ -1808,6 +1830,7 @@ out:
     }
     v9fs_path_free(&dpath);
     v9fs_path_free(&path);
+    g_free(stbufs);
 out_nofid:
     pdu_complete(pdu, err);
     if (nwnames && nwnames <= P9_MAXWELEM) {
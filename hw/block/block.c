@@ -171,6 +171,7 @@ bool blkconf_apply_backend_options(BlockConf *conf, bool readonly,
 
     blk_set_enable_write_cache(blk, wce);
     blk_set_on_error(blk, rerror, werror);
+    blk_set_merge_requests(blk, conf->merge_requests);
 
     return true;
 }
@@ -22,7 +22,7 @@
  *              [pmrdev=<mem_backend_file_id>,] \
  *              max_ioqpairs=<N[optional]>, \
  *              aerl=<N[optional]>, aer_max_queued=<N[optional]>, \
- *              mdts=<N[optional]>
+ *              mdts=<N[optional]>, ioeventfd=<on|off[optional]>
  *      -device nvme-ns,drive=<drive_id>,bus=bus_name,nsid=<nsid>
  *
  * Note cmb_size_mb denotes size of CMB in MB. CMB is assumed to be at
@@ -49,6 +49,12 @@
  *   completion when there are no oustanding AERs. When the maximum number of
  *   enqueued events are reached, subsequent events will be dropped.
  *
+ * - `ioeventfd`
+ *   Once the host has set up shadow doorbells with the Doorbell Buffer
+ *   Config command, deliver the doorbell writes of the I/O queues through
+ *   eventfds instead of trapping them as MMIO writes. The new doorbell
+ *   values are then read from the shadow doorbell buffer.
+ *
  */
 
 #include "qemu/osdep.h"
@@ -196,6 +202,60 @@ static uint8_t nvme_sq_empty(NvmeSQueue *sq)
     return sq->head == sq->tail;
 }
 
+static void nvme_update_cq_head(NvmeCQueue *cq)
+{
+    uint32_t v;
+
+    if (pci_dma_read(&cq->ctrl->parent_obj, cq->db_addr, &v, sizeof(v))) {
+        return;
+    }
+
+    v = le32_to_cpu(v);
+    if (unlikely(v >= cq->size)) {
+        NVME_GUEST_ERR(pci_nvme_ub_dbbuf_invalid_cqhead,
+                       "shadow completion queue doorbell value beyond"
+                       " queue size, cqid=%"PRIu16", new_head=%"PRIu32","
+                       " ignoring", cq->cqid, v);
+        return;
+    }
+
+    cq->head = v;
+}
+
+static void nvme_update_cq_eventidx(NvmeCQueue *cq)
+{
+    uint32_t v = cpu_to_le32(cq->head);
+
+    pci_dma_write(&cq->ctrl->parent_obj, cq->ei_addr, &v, sizeof(v));
+}
+
+static void nvme_update_sq_tail(NvmeSQueue *sq)
+{
+    uint32_t v;
+
+    if (pci_dma_read(&sq->ctrl->parent_obj, sq->db_addr, &v, sizeof(v))) {
+        return;
+    }
+
+    v = le32_to_cpu(v);
+    if (unlikely(v >= sq->size)) {
+        NVME_GUEST_ERR(pci_nvme_ub_dbbuf_invalid_sqtail,
+                       "shadow submission queue doorbell value beyond"
+                       " queue size, sqid=%"PRIu16", new_tail=%"PRIu32","
+                       " ignoring", sq->sqid, v);
+        return;
+    }
+
+    sq->tail = v;
+}
+
+static void nvme_update_sq_eventidx(NvmeSQueue *sq)
+{
+    uint32_t v = cpu_to_le32(sq->tail);
+
+    pci_dma_write(&sq->ctrl->parent_obj, sq->ei_addr, &v, sizeof(v));
+}
+
 static void nvme_irq_check(NvmeCtrl *n)
 {
     if (msix_enabled(&(n->parent_obj))) {
@@ -731,6 +791,11 @@ static void nvme_post_cqes(void *opaque)
     NvmeRequest *req, *next;
     int ret;
 
+    if (n->dbbuf_enabled) {
+        nvme_update_cq_eventidx(cq);
+        nvme_update_cq_head(cq);
+    }
+
     QTAILQ_FOREACH_SAFE(req, &cq->req_list, entry, next) {
         NvmeSQueue *sq;
         hwaddr addr;
@@ -1052,6 +1117,12 @@ static uint16_t nvme_io_cmd(NvmeCtrl *n, NvmeRequest *req)
 static void nvme_free_sq(NvmeSQueue *sq, NvmeCtrl *n)
 {
     n->sq[sq->sqid] = NULL;
+    if (sq->ioeventfd_enabled) {
+        memory_region_del_eventfd(&n->iomem, 0x1000 + (sq->sqid << 3), 4,
+                                  false, 0, &sq->notifier);
+        event_notifier_set_handler(&sq->notifier, NULL);
+        event_notifier_cleanup(&sq->notifier);
+    }
     timer_del(sq->timer);
     timer_free(sq->timer);
     g_free(sq->io_req);
@@ -1098,6 +1169,44 @@ static uint16_t nvme_del_sq(NvmeCtrl *n, NvmeRequest *req)
     return NVME_SUCCESS;
 }
 
+static void nvme_sq_notifier(EventNotifier *e)
+{
+    NvmeSQueue *sq = container_of(e, NvmeSQueue, notifier);
+
+    if (!event_notifier_test_and_clear(e)) {
+        return;
+    }
+
+    nvme_process_sq(sq);
+}
+
+static void nvme_init_sq_ioeventfd(NvmeSQueue *sq)
+{
+    NvmeCtrl *n = sq->ctrl;
+
+    /* Keep trapping the doorbell writes if no eventfd can be set up */
+    if (event_notifier_init(&sq->notifier, 0) < 0) {
+        return;
+    }
+
+    event_notifier_set_handler(&sq->notifier, nvme_sq_notifier);
+    memory_region_add_eventfd(&n->iomem, 0x1000 + (sq->sqid << 3), 4,
+                              false, 0, &sq->notifier);
+    sq->ioeventfd_enabled = true;
+}
+
+static void nvme_init_sq_dbbuf(NvmeSQueue *sq)
+{
+    NvmeCtrl *n = sq->ctrl;
+
+    sq->db_addr = n->dbbuf_dbs + (sq->sqid << 3);
+    sq->ei_addr = n->dbbuf_eis + (sq->sqid << 3);
+
+    if (sq->sqid && n->params.ioeventfd && !sq->ioeventfd_enabled) {
+        nvme_init_sq_ioeventfd(sq);
+    }
+}
+
 static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
                          uint16_t sqid, uint16_t cqid, uint16_t size)
 {
@@ -1124,6 +1233,10 @@ static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
     cq = n->cq[cqid];
     QTAILQ_INSERT_TAIL(&(cq->sq_list), sq, entry);
     n->sq[sqid] = sq;
+
+    if (n->dbbuf_enabled) {
+        nvme_init_sq_dbbuf(sq);
+    }
 }
 
 static uint16_t nvme_create_sq(NvmeCtrl *n, NvmeRequest *req)
@@ -1334,6 +1447,13 @@ static uint16_t nvme_get_log(NvmeCtrl *n, NvmeRequest *req)
 static void nvme_free_cq(NvmeCQueue *cq, NvmeCtrl *n)
 {
     n->cq[cq->cqid] = NULL;
+    if (cq->ioeventfd_enabled) {
+        memory_region_del_eventfd(&n->iomem,
+                                  0x1000 + (cq->cqid << 3) + (1 << 2), 4,
+                                  false, 0, &cq->notifier);
+        event_notifier_set_handler(&cq->notifier, NULL);
+        event_notifier_cleanup(&cq->notifier);
+    }
     timer_del(cq->timer);
     timer_free(cq->timer);
     msix_vector_unuse(&n->parent_obj, cq->vector);
@@ -1364,6 +1484,64 @@ static uint16_t nvme_del_cq(NvmeCtrl *n, NvmeRequest *req)
     return NVME_SUCCESS;
 }
 
+/* Resume the submission queues and completions held up by a full queue */
+static void nvme_restart_cq(NvmeCQueue *cq)
+{
+    NvmeSQueue *sq;
+
+    QTAILQ_FOREACH(sq, &cq->sq_list, entry) {
+        timer_mod(sq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+    }
+    timer_mod(cq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+}
+
+static void nvme_cq_notifier(EventNotifier *e)
+{
+    NvmeCQueue *cq = container_of(e, NvmeCQueue, notifier);
+    NvmeCtrl *n = cq->ctrl;
+    bool start_sqs;
+
+    if (!event_notifier_test_and_clear(e)) {
+        return;
+    }
+
+    start_sqs = nvme_cq_full(cq);
+    nvme_update_cq_head(cq);
+    if (start_sqs) {
+        nvme_restart_cq(cq);
+    }
+
+    if (cq->tail == cq->head) {
+        nvme_irq_deassert(n, cq);
+    }
+}
+
+static void nvme_init_cq_ioeventfd(NvmeCQueue *cq)
+{
+    NvmeCtrl *n = cq->ctrl;
+
+    if (event_notifier_init(&cq->notifier, 0) < 0) {
+        return;
+    }
+
+    event_notifier_set_handler(&cq->notifier, nvme_cq_notifier);
+    memory_region_add_eventfd(&n->iomem, 0x1000 + (cq->cqid << 3) + (1 << 2),
+                              4, false, 0, &cq->notifier);
+    cq->ioeventfd_enabled = true;
+}
+
+static void nvme_init_cq_dbbuf(NvmeCQueue *cq)
+{
+    NvmeCtrl *n = cq->ctrl;
+
+    cq->db_addr = n->dbbuf_dbs + (cq->cqid << 3) + (1 << 2);
+    cq->ei_addr = n->dbbuf_eis + (cq->cqid << 3) + (1 << 2);
+
+    if (cq->cqid && n->params.ioeventfd && !cq->ioeventfd_enabled) {
+        nvme_init_cq_ioeventfd(cq);
+    }
+}
+
 static void nvme_init_cq(NvmeCQueue *cq, NvmeCtrl *n, uint64_t dma_addr,
                          uint16_t cqid, uint16_t vector, uint16_t size,
                          uint16_t irq_enabled)
@@ -1384,6 +1562,10 @@ static void nvme_init_cq(NvmeCQueue *cq, NvmeCtrl *n, uint64_t dma_addr,
     QTAILQ_INIT(&cq->sq_list);
     n->cq[cqid] = cq;
     cq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_post_cqes, cq);
+
+    if (n->dbbuf_enabled) {
+        nvme_init_cq_dbbuf(cq);
+    }
 }
 
 static uint16_t nvme_create_cq(NvmeCtrl *n, NvmeRequest *req)
@@ -1902,6 +2084,36 @@ static uint16_t nvme_aer(NvmeCtrl *n, NvmeRequest *req)
     return NVME_NO_COMPLETE;
 }
 
+static uint16_t nvme_dbbuf_config(NvmeCtrl *n, NvmeRequest *req)
+{
+    uint64_t dbs_addr = le64_to_cpu(req->cmd.dptr.prp1);
+    uint64_t eis_addr = le64_to_cpu(req->cmd.dptr.prp2);
+    int i;
+
+    trace_pci_nvme_dbbuf_config(dbs_addr, eis_addr);
+
+    /* Both buffers are a single page and must be page aligned */
+    if (!dbs_addr || !eis_addr ||
+        (dbs_addr & (n->page_size - 1)) || (eis_addr & (n->page_size - 1))) {
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    n->dbbuf_dbs = dbs_addr;
+    n->dbbuf_eis = eis_addr;
+    n->dbbuf_enabled = true;
+
+    for (i = 0; i < n->params.max_ioqpairs + 1; i++) {
+        if (n->sq[i]) {
+            nvme_init_sq_dbbuf(n->sq[i]);
+        }
+        if (n->cq[i]) {
+            nvme_init_cq_dbbuf(n->cq[i]);
+        }
+    }
+
+    return NVME_SUCCESS;
+}
+
 static uint16_t nvme_admin_cmd(NvmeCtrl *n, NvmeRequest *req)
 {
     trace_pci_nvme_admin_cmd(nvme_cid(req), nvme_sqid(req), req->cmd.opcode,
@@ -1928,12 +2140,32 @@ static uint16_t nvme_admin_cmd(NvmeCtrl *n, NvmeRequest *req)
         return nvme_get_feature(n, req);
     case NVME_ADM_CMD_ASYNC_EV_REQ:
         return nvme_aer(n, req);
+    case NVME_ADM_CMD_DBBUF_CONFIG:
+        return nvme_dbbuf_config(n, req);
     default:
         trace_pci_nvme_err_invalid_admin_opc(req->cmd.opcode);
         return NVME_INVALID_OPCODE | NVME_DNR;
     }
 }
 
+static void nvme_io_plug(NvmeCtrl *n, bool plug)
+{
+    int i;
+
+    for (i = 1; i <= n->num_namespaces; i++) {
+        NvmeNamespace *ns = nvme_ns(n, i);
+        if (!ns) {
+            continue;
+        }
+
+        if (plug) {
+            blk_io_plug(ns->blkconf.blk);
+        } else {
+            blk_io_unplug(ns->blkconf.blk);
+        }
+    }
+}
+
 static void nvme_process_sq(void *opaque)
 {
     NvmeSQueue *sq = opaque;
@@ -1945,6 +2177,15 @@ static void nvme_process_sq(void *opaque)
     NvmeCmd cmd;
     NvmeRequest *req;
 
+    /* Let the block layer batch the I/O commands that are already queued */
+    if (sq->sqid) {
+        nvme_io_plug(n, true);
+    }
+
+    if (n->dbbuf_enabled) {
+        nvme_update_sq_tail(sq);
+    }
+
     while (!(nvme_sq_empty(sq) || QTAILQ_EMPTY(&sq->req_list))) {
         addr = sq->dma_addr + sq->head * n->sqe_size;
         if (nvme_addr_read(n, addr, (void *)&cmd, sizeof(cmd))) {
@@ -1968,6 +2209,21 @@ static void nvme_process_sq(void *opaque)
             req->status = status;
             nvme_enqueue_req_completion(cq, req);
         }
+
+        if (n->dbbuf_enabled) {
+            nvme_update_sq_eventidx(sq);
+            /*
+             * Publish how far the queue has been consumed before looking
+             * for new entries, so that the host rings the doorbell for any
+             * entry that is added after the tail has been read.
+             */
+            smp_mb();
+            nvme_update_sq_tail(sq);
+        }
+    }
+
+    if (sq->sqid) {
+        nvme_io_plug(n, false);
     }
 }
 
@@ -2006,6 +2262,10 @@ static void nvme_clear_ctrl(NvmeCtrl *n)
     n->outstanding_aers = 0;
     n->qs_created = false;
 
+    n->dbbuf_enabled = false;
+    n->dbbuf_dbs = 0;
+    n->dbbuf_eis = 0;
+
     for (i = 1; i <= n->num_namespaces; i++) {
         ns = nvme_ns(n, i);
         if (!ns) {
@@ -2381,12 +2641,16 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
 
         start_sqs = nvme_cq_full(cq) ? 1 : 0;
         cq->head = new_head;
+        if (!qid && n->dbbuf_enabled) {
+            /*
+             * Hosts only use the shadow doorbells for the I/O queues, keep
+             * the one of the admin queue in sync with the register.
+             */
+            uint32_t v = cpu_to_le32(cq->head);
+            pci_dma_write(&n->parent_obj, cq->db_addr, &v, sizeof(v));
+        }
         if (start_sqs) {
-            NvmeSQueue *sq;
-            QTAILQ_FOREACH(sq, &cq->sq_list, entry) {
-                timer_mod(sq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
-            }
-            timer_mod(cq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+            nvme_restart_cq(cq);
         }
 
         if (cq->tail == cq->head) {
@@ -2434,6 +2698,10 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
         trace_pci_nvme_mmio_doorbell_sq(sq->sqid, new_tail);
 
         sq->tail = new_tail;
+        if (!qid && n->dbbuf_enabled) {
+            uint32_t v = cpu_to_le32(sq->tail);
+            pci_dma_write(&n->parent_obj, sq->db_addr, &v, sizeof(v));
+        }
         timer_mod(sq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
     }
 }
@@ -2707,7 +2975,7 @@ static void nvme_init_ctrl(NvmeCtrl *n, PCIDevice *pci_dev)
     id->ieee[2] = 0xb3;
     id->mdts = n->params.mdts;
     id->ver = cpu_to_le32(NVME_SPEC_VER);
-    id->oacs = cpu_to_le16(0);
+    id->oacs = cpu_to_le16(NVME_OACS_DBBUF);
 
     /*
      * Because the controller always completes the Abort command immediately,
@@ -2826,6 +3094,7 @@ static Property nvme_props[] = {
     DEFINE_PROP_UINT32("aer_max_queued", NvmeCtrl, params.aer_max_queued, 64),
     DEFINE_PROP_UINT8("mdts", NvmeCtrl, params.mdts, 7),
     DEFINE_PROP_BOOL("use-intel-id", NvmeCtrl, params.use_intel_id, false),
+    DEFINE_PROP_BOOL("ioeventfd", NvmeCtrl, params.ioeventfd, false),
     DEFINE_PROP_END_OF_LIST(),
 };
 
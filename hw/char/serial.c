@@ -227,10 +227,46 @@ static gboolean serial_watch_cb(GIOChannel *chan, GIOCondition cond,
     return FALSE;
 }
 
+/*
+ * Write as many bytes as possible from the transmit FIFO with a single
+ * call into the chardev.  Returns false if nothing was written, in which
+ * case serial_xmit() sends the next byte on its own and retries it.
+ */
+static bool serial_xmit_fifo(SerialState *s)
+{
+    uint32_t num;
+    int rc;
+
+    if (!(s->fcr & UART_FCR_FE) || (s->mcr & UART_MCR_LOOP) ||
+        s->xmit_fifo.num < 2) {
+        return false;
+    }
+
+    num = MIN(s->xmit_fifo.num, s->xmit_fifo.capacity - s->xmit_fifo.head);
+    rc = qemu_chr_fe_write(&s->chr, &s->xmit_fifo.data[s->xmit_fifo.head],
+                           num);
+    if (rc <= 0) {
+        return false;
+    }
+
+    s->tsr = fifo8_pop_buf(&s->xmit_fifo, rc, &num)[num - 1];
+    if (!s->xmit_fifo.num) {
+        s->lsr |= UART_LSR_THRE;
+        if (!s->thr_ipending) {
+            s->thr_ipending = 1;
+            serial_update_irq(s);
+        }
+    }
+    return true;
+}
+
 static void serial_xmit(SerialState *s)
 {
     do {
         assert(!(s->lsr & UART_LSR_TEMT));
+        if (s->tsr_retry == 0 && serial_xmit_fifo(s)) {
+            continue;
+        }
         if (s->tsr_retry == 0) {
             assert(!(s->lsr & UART_LSR_THRE));
 
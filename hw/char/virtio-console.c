@@ -13,6 +13,7 @@
 #include "qemu/osdep.h"
 #include "chardev/char-fe.h"
 #include "qemu/error-report.h"
+#include "qemu/iov.h"
 #include "qemu/module.h"
 #include "trace.h"
 #include "hw/qdev-properties.h"
@@ -48,10 +49,11 @@ static gboolean chr_write_unblocked(GIOChannel *chan, GIOCondition cond,
 }
 
 /* Callback function that's called when the guest sends us data */
-static ssize_t flush_buf(VirtIOSerialPort *port,
-                         const uint8_t *buf, ssize_t len)
+static ssize_t flush_iov(VirtIOSerialPort *port,
+                         const struct iovec *iov, int iovcnt)
 {
     VirtConsole *vcon = VIRTIO_CONSOLE(port);
+    ssize_t len = iov_size(iov, iovcnt);
     ssize_t ret;
 
     if (!qemu_chr_fe_backend_connected(&vcon->chr)) {
@@ -59,7 +61,7 @@ static ssize_t flush_buf(VirtIOSerialPort *port,
         return len;
     }
 
-    ret = qemu_chr_fe_write(&vcon->chr, buf, len);
+    ret = qemu_chr_fe_writev(&vcon->chr, iov, iovcnt);
     trace_virtio_console_flush_buf(port->id, len, ret);
 
     if (ret < len) {
@@ -106,6 +108,17 @@ static ssize_t flush_buf(VirtIOSerialPort *port,
     return ret;
 }
 
+static ssize_t flush_buf(VirtIOSerialPort *port,
+                         const uint8_t *buf, ssize_t len)
+{
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len = len,
+    };
+
+    return flush_iov(port, &iov, 1);
+}
+
 /* Callback function that's called when the guest opens/closes the port */
 static void set_guest_connected(VirtIOSerialPort *port, int guest_connected)
 {
@@ -286,6 +299,7 @@ static void virtserialport_class_init(ObjectClass *klass, void *data)
     k->realize = virtconsole_realize;
     k->unrealize = virtconsole_unrealize;
     k->have_data = flush_buf;
+    k->have_data_iov = flush_iov;
     k->set_guest_connected = set_guest_connected;
     k->enable_backend = virtconsole_enable_backend;
     k->guest_writable = guest_writable;
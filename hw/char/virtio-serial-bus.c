@@ -149,6 +149,19 @@ static void discard_vq_data(VirtQueue *vq, VirtIODevice *vdev)
     virtio_notify(vdev, vq);
 }
 
+/*
+ * Completes the elements that do_flush_queued_data() filled.  This must
+ * happen before anything else is pushed to the ovq, which happens when the
+ * port is closed or unplugged from within one of the have_data calls.
+ */
+static void flush_filled_data(VirtIOSerialPort *port)
+{
+    if (port->ovq_filled) {
+        virtqueue_flush(port->ovq, port->ovq_filled);
+        port->ovq_filled = 0;
+    }
+}
+
 static void discard_throttle_data(VirtIOSerialPort *port)
 {
     if (port->elem) {
@@ -158,6 +171,37 @@ static void discard_throttle_data(VirtIOSerialPort *port)
     }
 }
 
+/*
+ * Hand the rest of port->elem to the port with a single have_data_iov
+ * call, and advance iov_idx and iov_offset past what it consumed.
+ */
+static void flush_elem_iov(VirtIOSerialPort *port, VirtIOSerialPortClass *vsc)
+{
+    VirtQueueElement *elem = port->elem;
+    struct iovec *sg = &elem->out_sg[port->iov_idx];
+    struct iovec first = *sg;
+    size_t pos;
+    ssize_t ret;
+
+    sg->iov_base += port->iov_offset;
+    sg->iov_len -= port->iov_offset;
+    ret = vsc->have_data_iov(port, sg, elem->out_num - port->iov_idx);
+    if (port->elem != elem) { /* bail if we got disconnected */
+        return;
+    }
+    *sg = first;
+
+    if (port->throttled) {
+        pos = port->iov_offset + MAX(ret, 0);
+        while (port->iov_idx < elem->out_num &&
+               pos >= elem->out_sg[port->iov_idx].iov_len) {
+            pos -= elem->out_sg[port->iov_idx].iov_len;
+            port->iov_idx++;
+        }
+        port->iov_offset = pos;
+    }
+}
+
 static void do_flush_queued_data(VirtIOSerialPort *port, VirtQueue *vq,
                                  VirtIODevice *vdev)
 {
@@ -181,34 +225,45 @@ static void do_flush_queued_data(VirtIOSerialPort *port, VirtQueue *vq,
             port->iov_offset = 0;
         }
 
-        for (i = port->iov_idx; i < port->elem->out_num; i++) {
-            size_t buf_size;
-            ssize_t ret;
-
-            buf_size = port->elem->out_sg[i].iov_len - port->iov_offset;
-            ret = vsc->have_data(port,
-                                  port->elem->out_sg[i].iov_base
-                                  + port->iov_offset,
-                                  buf_size);
-            if (!port->elem) { /* bail if we got disconnected */
-                return;
+        if (vsc->have_data_iov) {
+            if (port->iov_idx < port->elem->out_num) {
+                flush_elem_iov(port, vsc);
+                if (!port->elem) { /* bail if we got disconnected */
+                    return;
+                }
             }
-            if (port->throttled) {
-                port->iov_idx = i;
-                if (ret > 0) {
-                    port->iov_offset += ret;
+        } else {
+            for (i = port->iov_idx; i < port->elem->out_num; i++) {
+                size_t buf_size;
+                ssize_t ret;
+
+                buf_size = port->elem->out_sg[i].iov_len - port->iov_offset;
+                ret = vsc->have_data(port,
+                                      port->elem->out_sg[i].iov_base
+                                      + port->iov_offset,
+                                      buf_size);
+                if (!port->elem) { /* bail if we got disconnected */
+                    return;
                 }
-                break;
+                if (port->throttled) {
+                    port->iov_idx = i;
+                    if (ret > 0) {
+                        port->iov_offset += ret;
+                    }
+                    break;
+                }
+                port->iov_offset = 0;
             }
-            port->iov_offset = 0;
         }
         if (port->throttled) {
             break;
         }
-        virtqueue_push(vq, port->elem, 0);
+        /* Complete the requests together, see flush_filled_data() below */
+        virtqueue_fill(vq, port->elem, 0, port->ovq_filled++);
         g_free(port->elem);
         port->elem = NULL;
     }
+    flush_filled_data(port);
     virtio_notify(vdev, vq);
 }
 
@@ -283,6 +338,7 @@ int virtio_serial_close(VirtIOSerialPort *port)
      * consume, reset the throttling flag and discard the data.
      */
     port->throttled = false;
+    flush_filled_data(port);
     discard_throttle_data(port);
     discard_vq_data(port->ovq, VIRTIO_DEVICE(port->vser));
 
@@ -923,6 +979,7 @@ static void remove_port(VirtIOSerial *vser, uint32_t port_id)
     assert(port);
 
     /* Flush out any unconsumed buffers first */
+    flush_filled_data(port);
     discard_throttle_data(port);
     discard_vq_data(port->ovq, VIRTIO_DEVICE(port->vser));
 
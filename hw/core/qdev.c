@@ -39,6 +39,7 @@
 #include "hw/sysbus.h"
 #include "hw/qdev-clock.h"
 #include "migration/vmstate.h"
+#include "qemu/timer.h"
 #include "trace.h"
 
 bool qdev_hotplug = false;
@@ -883,10 +884,15 @@ static void device_set_realized(Object *obj, bool value, Error **errp)
         }
 
         if (dc->realize) {
+            int64_t start = get_clock();
+
             dc->realize(dev, &local_err);
             if (local_err != NULL) {
                 goto fail;
             }
+            trace_qdev_realize(obj, object_get_typename(obj),
+                               dev->id ? dev->id : "",
+                               (get_clock() - start) / SCALE_US);
         }
 
         DEVICE_LISTENER_CALL(realize, Forward, dev);
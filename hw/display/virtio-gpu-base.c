@@ -140,10 +140,15 @@ virtio_gpu_base_device_realize(DeviceState *qdev,
     g->use_virgl_renderer = false;
     if (virtio_gpu_virgl_enabled(g->conf)) {
         error_setg(&g->migration_blocker, "virgl is not yet migratable");
-        if (migrate_add_blocker(g->migration_blocker, errp) < 0) {
-            error_free(g->migration_blocker);
-            return false;
-        }
+    } else if (virtio_gpu_blob_enabled(g->conf)) {
+        error_setg(&g->migration_blocker, "blob resources are not yet"
+                   " migratable");
+    }
+    if (g->migration_blocker &&
+        migrate_add_blocker(g->migration_blocker, errp) < 0) {
+        error_free(g->migration_blocker);
+        g->migration_blocker = NULL;
+        return false;
     }
 
     g->virtio_config.num_scanouts = cpu_to_le32(g->conf.max_outputs);
@@ -188,6 +193,9 @@ virtio_gpu_base_get_features(VirtIODevice *vdev, uint64_t features,
     if (virtio_gpu_edid_enabled(g->conf)) {
         features |= (1 << VIRTIO_GPU_F_EDID);
     }
+    if (virtio_gpu_blob_enabled(g->conf)) {
+        features |= (1 << VIRTIO_GPU_F_RESOURCE_BLOB);
+    }
 
     return features;
 }
@@ -255,6 +263,8 @@ QEMU_BUILD_BUG_ON(sizeof(struct virtio_gpu_mem_entry)               != 16);
 QEMU_BUILD_BUG_ON(sizeof(struct virtio_gpu_resource_attach_backing) != 32);
 QEMU_BUILD_BUG_ON(sizeof(struct virtio_gpu_resource_detach_backing) != 32);
 QEMU_BUILD_BUG_ON(sizeof(struct virtio_gpu_resp_display_info)       != 408);
+QEMU_BUILD_BUG_ON(sizeof(struct virtio_gpu_resource_create_blob)    != 56);
+QEMU_BUILD_BUG_ON(sizeof(struct virtio_gpu_set_scanout_blob)        != 96);
 
 QEMU_BUILD_BUG_ON(sizeof(struct virtio_gpu_transfer_host_3d)        != 72);
 QEMU_BUILD_BUG_ON(sizeof(struct virtio_gpu_resource_create_3d)      != 72);
@@ -0,0 +1,27 @@
+/*
+ * Virtio GPU Device: udmabuf stubs for non-Linux hosts
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "hw/virtio/virtio-gpu.h"
+
+bool virtio_gpu_have_udmabuf(void)
+{
+    return false;
+}
+
+void virtio_gpu_init_udmabuf(struct virtio_gpu_simple_resource *res)
+{
+    res->dmabuf_fd = -1;
+    if (res->iov_cnt == 1) {
+        res->blob = res->iov[0].iov_base;
+    }
+}
+
+void virtio_gpu_fini_udmabuf(struct virtio_gpu_simple_resource *res)
+{
+    /* nothing (stub) */
+}
@@ -0,0 +1,141 @@
+/*
+ * Virtio GPU Device: blob resources backed by udmabuf
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/error-report.h"
+#include "qemu/log.h"
+#include "qemu/memfd.h"
+#include "qemu/rcu.h"
+#include "qom/object.h"
+#include "sysemu/hostmem.h"
+#include "exec/memory.h"
+#include "hw/virtio/virtio-gpu.h"
+#include <linux/udmabuf.h>
+
+static int udmabuf_fd = -1;
+
+static int virtio_gpu_get_udmabuf_fd(void)
+{
+    static bool tried;
+
+    if (!tried) {
+        udmabuf_fd = open("/dev/udmabuf", O_RDWR);
+        tried = true;
+    }
+    return udmabuf_fd;
+}
+
+static int virtio_gpu_check_memfd(Object *obj, void *opaque)
+{
+    bool *found = opaque;
+    HostMemoryBackend *backend;
+    int fd, seals;
+
+    backend = (HostMemoryBackend *)object_dynamic_cast(obj,
+                                                       TYPE_MEMORY_BACKEND);
+    if (!backend || !host_memory_backend_mr_inited(backend)) {
+        return 0;
+    }
+
+    fd = memory_region_get_fd(host_memory_backend_get_memory(backend));
+    if (fd < 0) {
+        return 0;
+    }
+    seals = fcntl(fd, F_GET_SEALS);
+    if (seals >= 0 && (seals & F_SEAL_SHRINK)) {
+        *found = true;
+    }
+    return 0;
+}
+
+bool virtio_gpu_have_udmabuf(void)
+{
+    bool found = false;
+
+    if (virtio_gpu_get_udmabuf_fd() < 0) {
+        return false;
+    }
+    object_child_foreach(object_get_objects_root(),
+                         virtio_gpu_check_memfd, &found);
+    return found;
+}
+
+static void virtio_gpu_create_udmabuf(struct virtio_gpu_simple_resource *res)
+{
+    g_autofree struct udmabuf_create_list *list = NULL;
+    MemoryRegion *mr;
+    ram_addr_t offset;
+    int i;
+
+    list = g_malloc0(sizeof(*list) +
+                     sizeof(struct udmabuf_create_item) * res->iov_cnt);
+
+    for (i = 0; i < res->iov_cnt; i++) {
+        rcu_read_lock();
+        mr = memory_region_from_host(res->iov[i].iov_base, &offset);
+        rcu_read_unlock();
+
+        if (!mr || memory_region_get_fd(mr) < 0) {
+            qemu_log_mask(LOG_GUEST_ERROR, "%s: blob backing is not in"
+                          " fd-backed guest RAM\n", __func__);
+            return;
+        }
+
+        list->list[i].memfd = memory_region_get_fd(mr);
+        list->list[i].offset = offset;
+        list->list[i].size = res->iov[i].iov_len;
+    }
+
+    list->count = res->iov_cnt;
+    list->flags = UDMABUF_FLAGS_CLOEXEC;
+
+    res->dmabuf_fd = ioctl(virtio_gpu_get_udmabuf_fd(), UDMABUF_CREATE_LIST,
+                           list);
+    if (res->dmabuf_fd < 0) {
+        warn_report("%s: UDMABUF_CREATE_LIST: %s", __func__,
+                    strerror(errno));
+    }
+}
+
+void virtio_gpu_init_udmabuf(struct virtio_gpu_simple_resource *res)
+{
+    void *pdata = NULL;
+
+    res->dmabuf_fd = -1;
+    if (virtio_gpu_get_udmabuf_fd() >= 0) {
+        virtio_gpu_create_udmabuf(res);
+    }
+
+    if (res->iov_cnt == 1) {
+        /* Already contiguous, use the guest mapping directly */
+        pdata = res->iov[0].iov_base;
+    } else if (res->dmabuf_fd >= 0) {
+        /* Scattered pages, let the dmabuf stitch them together */
+        res->remapped = mmap(NULL, res->blob_size, PROT_READ, MAP_SHARED,
+                             res->dmabuf_fd, 0);
+        if (res->remapped == MAP_FAILED) {
+            warn_report("%s: dmabuf mmap failed: %s", __func__,
+                        strerror(errno));
+            res->remapped = NULL;
+        }
+        pdata = res->remapped;
+    }
+
+    res->blob = pdata;
+}
+
+void virtio_gpu_fini_udmabuf(struct virtio_gpu_simple_resource *res)
+{
+    if (res->remapped) {
+        munmap(res->remapped, res->blob_size);
+        res->remapped = NULL;
+    }
+    if (res->dmabuf_fd >= 0) {
+        close(res->dmabuf_fd);
+        res->dmabuf_fd = -1;
+    }
+}
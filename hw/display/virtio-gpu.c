@@ -64,7 +64,7 @@ static void update_cursor_data_simple(VirtIOGPU *g,
     uint32_t pixels;
 
     res = virtio_gpu_find_resource(g, resource_id);
-    if (!res) {
+    if (!res || !res->image) {
         return;
     }
 
@@ -321,6 +321,78 @@ static void virtio_gpu_resource_create_2d(VirtIOGPU *g,
     g->hostmem += res->hostmem;
 }
 
+static void virtio_gpu_resource_create_blob(VirtIOGPU *g,
+                                            struct virtio_gpu_ctrl_command *cmd)
+{
+    struct virtio_gpu_simple_resource *res;
+    struct virtio_gpu_resource_create_blob cblob;
+    size_t total = 0;
+    int i, ret;
+
+    VIRTIO_GPU_FILL_CMD(cblob);
+    virtio_gpu_create_blob_bswap(&cblob);
+    trace_virtio_gpu_cmd_res_create_blob(cblob.resource_id, cblob.size);
+
+    if (cblob.resource_id == 0) {
+        qemu_log_mask(LOG_GUEST_ERROR, "%s: resource id 0 is not allowed\n",
+                      __func__);
+        cmd->error = VIRTIO_GPU_RESP_ERR_INVALID_RESOURCE_ID;
+        return;
+    }
+
+    if (virtio_gpu_find_resource(g, cblob.resource_id)) {
+        qemu_log_mask(LOG_GUEST_ERROR, "%s: resource already exists %d\n",
+                      __func__, cblob.resource_id);
+        cmd->error = VIRTIO_GPU_RESP_ERR_INVALID_RESOURCE_ID;
+        return;
+    }
+
+    if (cblob.blob_mem != VIRTIO_GPU_BLOB_MEM_GUEST || !cblob.size) {
+        qemu_log_mask(LOG_GUEST_ERROR, "%s: invalid blob memory %d size %"
+                      PRIu64 "\n", __func__, cblob.blob_mem, cblob.size);
+        cmd->error = VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER;
+        return;
+    }
+
+    res = g_new0(struct virtio_gpu_simple_resource, 1);
+    res->resource_id = cblob.resource_id;
+    res->blob_size = cblob.size;
+    res->dmabuf_fd = -1;
+
+    ret = virtio_gpu_create_mapping_iov(g, cblob.nr_entries, sizeof(cblob),
+                                        cmd, &res->addrs, &res->iov);
+    if (ret != 0) {
+        cmd->error = VIRTIO_GPU_RESP_ERR_UNSPEC;
+        g_free(res);
+        return;
+    }
+    res->iov_cnt = cblob.nr_entries;
+
+    for (i = 0; i < res->iov_cnt; i++) {
+        total += res->iov[i].iov_len;
+    }
+    if (total < res->blob_size) {
+        qemu_log_mask(LOG_GUEST_ERROR, "%s: backing of %zu bytes is too"
+                      " small for blob of %" PRIu64 " bytes\n",
+                      __func__, total, res->blob_size);
+        cmd->error = VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER;
+        virtio_gpu_cleanup_mapping(g, res);
+        g_free(res);
+        return;
+    }
+
+    virtio_gpu_init_udmabuf(res);
+    if (!res->blob) {
+        cmd->error = VIRTIO_GPU_RESP_ERR_UNSPEC;
+        virtio_gpu_fini_udmabuf(res);
+        virtio_gpu_cleanup_mapping(g, res);
+        g_free(res);
+        return;
+    }
+
+    QTAILQ_INSERT_HEAD(&g->reslist, res, next);
+}
+
 static void virtio_gpu_disable_scanout(VirtIOGPU *g, int scanout_id)
 {
     struct virtio_gpu_scanout *scanout = &g->parent_obj.scanout[scanout_id];
@@ -336,6 +408,11 @@ static void virtio_gpu_disable_scanout(VirtIOGPU *g, int scanout_id)
         res->scanout_bitmask &= ~(1 << scanout_id);
     }
 
+    if (scanout->dmabuf_active) {
+        dpy_gl_release_dmabuf(scanout->con, &scanout->dmabuf);
+        scanout->dmabuf_active = false;
+    }
+
     if (scanout_id == 0) {
         /* primary head */
         ds = qemu_create_message_surface(scanout->width  ?: 640,
@@ -362,7 +439,12 @@ static void virtio_gpu_resource_destroy(VirtIOGPU *g,
         }
     }
 
-    pixman_image_unref(res->image);
+    if (res->image) {
+        pixman_image_unref(res->image);
+    }
+    if (res->blob_size) {
+        virtio_gpu_fini_udmabuf(res);
+    }
     virtio_gpu_cleanup_mapping(g, res);
     QTAILQ_REMOVE(&g->reslist, res, next);
     g->hostmem -= res->hostmem;
@@ -411,6 +493,11 @@ static void virtio_gpu_transfer_to_host_2d(VirtIOGPU *g,
         return;
     }
 
+    if (res->blob) {
+        /* The scanout already points to the guest memory */
+        return;
+    }
+
     if (t2d.r.x > res->width ||
         t2d.r.y > res->height ||
         t2d.r.width > res->width ||
@@ -469,12 +556,13 @@ static void virtio_gpu_resource_flush(VirtIOGPU *g,
         return;
     }
 
-    if (rf.r.x > res->width ||
-        rf.r.y > res->height ||
-        rf.r.width > res->width ||
-        rf.r.height > res->height ||
-        rf.r.x + rf.r.width > res->width ||
-        rf.r.y + rf.r.height > res->height) {
+    if (!res->blob &&
+        (rf.r.x > res->width ||
+         rf.r.y > res->height ||
+         rf.r.width > res->width ||
+         rf.r.height > res->height ||
+         rf.r.x + rf.r.width > res->width ||
+         rf.r.y + rf.r.height > res->height)) {
         qemu_log_mask(LOG_GUEST_ERROR, "%s: flush bounds outside resource"
                       " bounds for resource %d: %d %d %d %d vs %d %d\n",
                       __func__, rf.resource_id, rf.r.x, rf.r.y,
@@ -503,10 +591,17 @@ static void virtio_gpu_resource_flush(VirtIOGPU *g,
         pixman_region_translate(&finalregion, -scanout->x, -scanout->y);
         extents = pixman_region_extents(&finalregion);
         /* work out the area we need to update for each console */
-        dpy_gfx_update(g->parent_obj.scanout[i].con,
-                       extents->x1, extents->y1,
-                       extents->x2 - extents->x1,
-                       extents->y2 - extents->y1);
+        if (scanout->dmabuf_active) {
+            dpy_gl_update(scanout->con,
+                          extents->x1, extents->y1,
+                          extents->x2 - extents->x1,
+                          extents->y2 - extents->y1);
+        } else {
+            dpy_gfx_update(scanout->con,
+                           extents->x1, extents->y1,
+                           extents->x2 - extents->x1,
+                           extents->y2 - extents->y1);
+        }
 
         pixman_region_fini(&region);
         pixman_region_fini(&finalregion);
@@ -519,10 +614,45 @@ static void virtio_unref_resource(pixman_image_t *image, void *data)
     pixman_image_unref(data);
 }
 
+static void virtio_gpu_update_scanout(VirtIOGPU *g, uint32_t scanout_id,
+                                      struct virtio_gpu_simple_resource *res,
+                                      struct virtio_gpu_rect *r)
+{
+    struct virtio_gpu_scanout *scanout = &g->parent_obj.scanout[scanout_id];
+    struct virtio_gpu_simple_resource *ores;
+
+    ores = virtio_gpu_find_resource(g, scanout->resource_id);
+    if (ores) {
+        ores->scanout_bitmask &= ~(1 << scanout_id);
+    }
+
+    res->scanout_bitmask |= (1 << scanout_id);
+    scanout->resource_id = res->resource_id;
+    scanout->x = r->x;
+    scanout->y = r->y;
+    scanout->width = r->width;
+    scanout->height = r->height;
+}
+
+static bool virtio_gpu_replace_surface(struct virtio_gpu_scanout *scanout,
+                                       pixman_image_t *rect)
+{
+    scanout->ds = qemu_create_displaysurface_pixman(rect);
+    if (!scanout->ds) {
+        return false;
+    }
+    if (scanout->dmabuf_active) {
+        dpy_gl_release_dmabuf(scanout->con, &scanout->dmabuf);
+        scanout->dmabuf_active = false;
+    }
+    dpy_gfx_replace_surface(scanout->con, scanout->ds);
+    return true;
+}
+
 static void virtio_gpu_set_scanout(VirtIOGPU *g,
                                    struct virtio_gpu_ctrl_command *cmd)
 {
-    struct virtio_gpu_simple_resource *res, *ores;
+    struct virtio_gpu_simple_resource *res;
     struct virtio_gpu_scanout *scanout;
     pixman_format_code_t format;
     uint32_t offset;
@@ -549,7 +679,7 @@ static void virtio_gpu_set_scanout(VirtIOGPU *g,
 
     /* create a surface for this scanout */
     res = virtio_gpu_find_resource(g, ss.resource_id);
-    if (!res) {
+    if (!res || res->blob) {
         qemu_log_mask(LOG_GUEST_ERROR, "%s: illegal resource specified %d\n",
                       __func__, ss.resource_id);
         cmd->error = VIRTIO_GPU_RESP_ERR_INVALID_RESOURCE_ID;
@@ -589,31 +719,137 @@ static void virtio_gpu_set_scanout(VirtIOGPU *g,
         pixman_image_set_destroy_function(rect, virtio_unref_resource,
                                           res->image);
         /* realloc the surface ptr */
-        scanout->ds = qemu_create_displaysurface_pixman(rect);
-        if (!scanout->ds) {
+        if (!virtio_gpu_replace_surface(scanout, rect)) {
+            pixman_image_unref(rect);
             cmd->error = VIRTIO_GPU_RESP_ERR_UNSPEC;
             return;
         }
         pixman_image_unref(rect);
-        dpy_gfx_replace_surface(g->parent_obj.scanout[ss.scanout_id].con,
-                                scanout->ds);
     }
 
-    ores = virtio_gpu_find_resource(g, scanout->resource_id);
-    if (ores) {
-        ores->scanout_bitmask &= ~(1 << ss.scanout_id);
+    virtio_gpu_update_scanout(g, ss.scanout_id, res, &ss.r);
+}
+
+static void virtio_gpu_set_scanout_blob(VirtIOGPU *g,
+                                        struct virtio_gpu_ctrl_command *cmd)
+{
+    struct virtio_gpu_simple_resource *res;
+    struct virtio_gpu_scanout *scanout;
+    struct virtio_gpu_set_scanout_blob ss;
+    pixman_format_code_t format;
+    uint64_t offset, end;
+    uint32_t bpp, stride;
+
+    VIRTIO_GPU_FILL_CMD(ss);
+    virtio_gpu_bswap_32(&ss, sizeof(ss));
+    trace_virtio_gpu_cmd_set_scanout_blob(ss.scanout_id, ss.resource_id,
+                                          ss.r.width, ss.r.height,
+                                          ss.r.x, ss.r.y);
+
+    if (ss.scanout_id >= g->parent_obj.conf.max_outputs) {
+        qemu_log_mask(LOG_GUEST_ERROR, "%s: illegal scanout id specified %d",
+                      __func__, ss.scanout_id);
+        cmd->error = VIRTIO_GPU_RESP_ERR_INVALID_SCANOUT_ID;
+        return;
+    }
+
+    g->parent_obj.enable = 1;
+    if (ss.resource_id == 0) {
+        virtio_gpu_disable_scanout(g, ss.scanout_id);
+        return;
+    }
+
+    res = virtio_gpu_find_resource(g, ss.resource_id);
+    if (!res || !res->blob) {
+        qemu_log_mask(LOG_GUEST_ERROR, "%s: illegal resource specified %d\n",
+                      __func__, ss.resource_id);
+        cmd->error = VIRTIO_GPU_RESP_ERR_INVALID_RESOURCE_ID;
+        return;
+    }
+
+    format = virtio_gpu_get_pixman_format(ss.format);
+    if (!format) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "%s: host couldn't handle guest format %d\n",
+                      __func__, ss.format);
+        cmd->error = VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER;
+        return;
+    }
+
+    bpp = DIV_ROUND_UP(PIXMAN_FORMAT_BPP(format), 8);
+    stride = ss.strides[0];
+    offset = ss.offsets[0] + (uint64_t)ss.r.x * bpp +
+             (uint64_t)ss.r.y * stride;
+    end = offset + (uint64_t)(ss.r.height - 1) * stride +
+          (uint64_t)ss.r.width * bpp;
+    if (ss.r.width < 16 || ss.r.height < 16 ||
+        (uint64_t)ss.r.x + ss.r.width > ss.width ||
+        (uint64_t)ss.r.y + ss.r.height > ss.height ||
+        stride < (uint64_t)ss.width * bpp || stride % sizeof(uint32_t) ||
+        end > res->blob_size) {
+        qemu_log_mask(LOG_GUEST_ERROR, "%s: illegal scanout %d bounds for"
+                      " blob resource %d, (%d,%d)+%d,%d in %dx%d stride %d"
+                      " offset %d vs size %" PRIu64 "\n",
+                      __func__, ss.scanout_id, ss.resource_id, ss.r.x, ss.r.y,
+                      ss.r.width, ss.r.height, ss.width, ss.height, stride,
+                      ss.offsets[0], res->blob_size);
+        cmd->error = VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER;
+        return;
+    }
+
+    scanout = &g->parent_obj.scanout[ss.scanout_id];
+
+    if (console_has_gl(scanout->con) && res->dmabuf_fd >= 0 && !offset &&
+        qemu_pixman_to_drm_format(format)) {
+        /* Let the display import the guest memory directly */
+        if (scanout->dmabuf_active) {
+            dpy_gl_release_dmabuf(scanout->con, &scanout->dmabuf);
+        }
+        scanout->dmabuf = (QemuDmaBuf) {
+            .fd = res->dmabuf_fd,
+            .width = ss.r.width,
+            .height = ss.r.height,
+            .stride = stride,
+            .fourcc = qemu_pixman_to_drm_format(format),
+            .y0_top = false,
+        };
+        scanout->dmabuf_active = true;
+        if (scanout->ds) {
+            /* The old surface may point into a blob that goes away */
+            dpy_gfx_replace_surface(scanout->con,
+                                    qemu_create_displaysurface(ss.r.width,
+                                                               ss.r.height));
+            scanout->ds = NULL;
+        }
+        dpy_gl_scanout_dmabuf(scanout->con, &scanout->dmabuf);
+    } else if (!scanout->ds ||
+               surface_data(scanout->ds) != (uint8_t *)res->blob + offset ||
+               surface_stride(scanout->ds) != stride ||
+               surface_format(scanout->ds) != format ||
+               scanout->width != ss.r.width ||
+               scanout->height != ss.r.height) {
+        pixman_image_t *rect;
+
+        /* The surface is the guest memory, no copy is needed */
+        rect = pixman_image_create_bits(format, ss.r.width, ss.r.height,
+                                        (uint32_t *)((uint8_t *)res->blob +
+                                                     offset),
+                                        stride);
+        if (!rect || !virtio_gpu_replace_surface(scanout, rect)) {
+            if (rect) {
+                pixman_image_unref(rect);
+            }
+            cmd->error = VIRTIO_GPU_RESP_ERR_UNSPEC;
+            return;
+        }
+        pixman_image_unref(rect);
     }
 
-    res->scanout_bitmask |= (1 << ss.scanout_id);
-    scanout->resource_id = ss.resource_id;
-    scanout->x = ss.r.x;
-    scanout->y = ss.r.y;
-    scanout->width = ss.r.width;
-    scanout->height = ss.r.height;
+    virtio_gpu_update_scanout(g, ss.scanout_id, res, &ss.r);
 }
 
 int virtio_gpu_create_mapping_iov(VirtIOGPU *g,
-                                  struct virtio_gpu_resource_attach_backing *ab,
+                                  uint32_t nr_entries, uint32_t offset,
                                   struct virtio_gpu_ctrl_command *cmd,
                                   uint64_t **addr, struct iovec **iov)
 {
@@ -621,17 +857,17 @@ int virtio_gpu_create_mapping_iov(VirtIOGPU *g,
     size_t esize, s;
     int i;
 
-    if (ab->nr_entries > 16384) {
+    if (nr_entries > 16384) {
         qemu_log_mask(LOG_GUEST_ERROR,
                       "%s: nr_entries is too big (%d > 16384)\n",
-                      __func__, ab->nr_entries);
+                      __func__, nr_entries);
         return -1;
     }
 
-    esize = sizeof(*ents) * ab->nr_entries;
+    esize = sizeof(*ents) * nr_entries;
     ents = g_malloc(esize);
     s = iov_to_buf(cmd->elem.out_sg, cmd->elem.out_num,
-                   sizeof(*ab), ents, esize);
+                   offset, ents, esize);
     if (s != esize) {
         qemu_log_mask(LOG_GUEST_ERROR,
                       "%s: command data size incorrect %zu vs %zu\n",
@@ -640,11 +876,11 @@ int virtio_gpu_create_mapping_iov(VirtIOGPU *g,
         return -1;
     }
 
-    *iov = g_malloc0(sizeof(struct iovec) * ab->nr_entries);
+    *iov = g_malloc0(sizeof(struct iovec) * nr_entries);
     if (addr) {
-        *addr = g_malloc0(sizeof(uint64_t) * ab->nr_entries);
+        *addr = g_malloc0(sizeof(uint64_t) * nr_entries);
     }
-    for (i = 0; i < ab->nr_entries; i++) {
+    for (i = 0; i < nr_entries; i++) {
         uint64_t a = le64_to_cpu(ents[i].addr);
         uint32_t l = le32_to_cpu(ents[i].length);
         hwaddr len = l;
@@ -656,8 +892,7 @@ int virtio_gpu_create_mapping_iov(VirtIOGPU *g,
         }
         if (!(*iov)[i].iov_base || len != l) {
             qemu_log_mask(LOG_GUEST_ERROR, "%s: failed to map MMIO memory for"
-                          " resource %d element %d\n",
-                          __func__, ab->resource_id, i);
+                          " element %d\n", __func__, i);
             if ((*iov)[i].iov_base) {
                 i++; /* cleanup the 'i'th map */
             }
@@ -724,7 +959,8 @@ virtio_gpu_resource_attach_backing(VirtIOGPU *g,
         return;
     }
 
-    ret = virtio_gpu_create_mapping_iov(g, &ab, cmd, &res->addrs, &res->iov);
+    ret = virtio_gpu_create_mapping_iov(g, ab.nr_entries, sizeof(ab), cmd,
+                                        &res->addrs, &res->iov);
     if (ret != 0) {
         cmd->error = VIRTIO_GPU_RESP_ERR_UNSPEC;
         return;
@@ -745,7 +981,7 @@ virtio_gpu_resource_detach_backing(VirtIOGPU *g,
     trace_virtio_gpu_cmd_res_back_detach(detach.resource_id);
 
     res = virtio_gpu_find_resource(g, detach.resource_id);
-    if (!res || !res->iov) {
+    if (!res || !res->iov || res->blob_size) {
         qemu_log_mask(LOG_GUEST_ERROR, "%s: illegal resource specified %d\n",
                       __func__, detach.resource_id);
         cmd->error = VIRTIO_GPU_RESP_ERR_INVALID_RESOURCE_ID;
@@ -788,6 +1024,20 @@ static void virtio_gpu_simple_process_cmd(VirtIOGPU *g,
     case VIRTIO_GPU_CMD_RESOURCE_DETACH_BACKING:
         virtio_gpu_resource_detach_backing(g, cmd);
         break;
+    case VIRTIO_GPU_CMD_RESOURCE_CREATE_BLOB:
+        if (!virtio_gpu_blob_enabled(g->parent_obj.conf)) {
+            cmd->error = VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER;
+            break;
+        }
+        virtio_gpu_resource_create_blob(g, cmd);
+        break;
+    case VIRTIO_GPU_CMD_SET_SCANOUT_BLOB:
+        if (!virtio_gpu_blob_enabled(g->parent_obj.conf)) {
+            cmd->error = VIRTIO_GPU_RESP_ERR_INVALID_PARAMETER;
+            break;
+        }
+        virtio_gpu_set_scanout_blob(g, cmd);
+        break;
     default:
         cmd->error = VIRTIO_GPU_RESP_ERR_UNSPEC;
         break;
@@ -1127,6 +1377,19 @@ static void virtio_gpu_device_realize(DeviceState *qdev, Error **errp)
 #endif
     }
 
+    if (virtio_gpu_blob_enabled(g->parent_obj.conf)) {
+        if (virtio_gpu_virgl_enabled(g->parent_obj.conf)) {
+            error_setg(errp, "blobs and virgl are not compatible (yet)");
+            return;
+        }
+        if (!virtio_gpu_have_udmabuf()) {
+            error_setg(errp, "cannot enable blob resources without udmabuf");
+            error_append_hint(errp, "blob resources need /dev/udmabuf and"
+                              " guest RAM from a memory-backend-memfd\n");
+            return;
+        }
+    }
+
     if (!virtio_gpu_base_device_realize(qdev,
                                         virtio_gpu_handle_ctrl_cb,
                                         virtio_gpu_handle_cursor_cb,
@@ -1237,6 +1500,8 @@ static Property virtio_gpu_properties[] = {
     VIRTIO_GPU_BASE_PROPERTIES(VirtIOGPU, parent_obj.conf),
     DEFINE_PROP_SIZE("max_hostmem", VirtIOGPU, conf_max_hostmem,
                      256 * MiB),
+    DEFINE_PROP_BIT("blob", VirtIOGPU, parent_obj.conf.flags,
+                    VIRTIO_GPU_FLAG_BLOB_ENABLED, false),
 #ifdef CONFIG_VIRGL
     DEFINE_PROP_BIT("virgl", VirtIOGPU, parent_obj.conf.flags,
                     VIRTIO_GPU_FLAG_VIRGL_ENABLED, true),
@@ -719,6 +719,14 @@ bool vmbus_channel_is_open(VMBusChannel *chan)
     return chan->is_open;
 }
 
+AioContext *vmbus_channel_get_aio_context(VMBusChannel *chan)
+{
+    if (chan->dev->iothread) {
+        return iothread_get_aio_context(chan->dev->iothread);
+    }
+    return qemu_get_aio_context();
+}
+
 /*
  * Notify the guest side about the data to work on in the channel ring buffer.
  * The notification is done by signaling a dedicated per-channel SynIC event
@@ -1388,6 +1396,42 @@ static void channel_event_cb(EventNotifier *e)
     }
 }
 
+static void channel_iothread_event_cb(EventNotifier *e)
+{
+    VMBusChannel *chan = container_of(e, VMBusChannel, notifier);
+    AioContext *ctx = vmbus_channel_get_aio_context(chan);
+
+    aio_context_acquire(ctx);
+    channel_event_cb(e);
+    aio_context_release(ctx);
+}
+
+/*
+ * Guest->host notifications arrive on chan->notifier, either straight from
+ * KVM through KVM_HYPERV_EVENTFD or from the hypercall handler, and neither
+ * takes the BQL.  Host->guest notifications go through
+ * hyperv_set_event_flag(), which doesn't need the BQL either, so a device
+ * with an IOThread processes its ring buffers without ever involving the
+ * main loop.
+ */
+static void channel_set_event_handler(VMBusChannel *chan, bool enable)
+{
+    AioContext *ctx;
+
+    if (!chan->dev->iothread) {
+        event_notifier_set_handler(&chan->notifier,
+                                   enable ? channel_event_cb : NULL);
+        return;
+    }
+
+    /* Also waits for a running device worker to finish on disable */
+    ctx = vmbus_channel_get_aio_context(chan);
+    aio_context_acquire(ctx);
+    aio_set_event_notifier(ctx, &chan->notifier, false,
+                           enable ? channel_iothread_event_cb : NULL, NULL);
+    aio_context_release(ctx);
+}
+
 static int alloc_chan_id(VMBus *vmbus)
 {
     int ret;
@@ -1523,7 +1567,7 @@ static void open_channel(VMBusChannel *chan)
         goto put_gpadl;
     }
 
-    event_notifier_set_handler(&chan->notifier, channel_event_cb);
+    channel_set_event_handler(chan, true);
 
     if (hyperv_set_event_flag_handler(chan_connection_id(chan),
                                       &chan->notifier)) {
@@ -1547,7 +1591,7 @@ unref_sint_route:
 clear_event_flag_handler:
     hyperv_set_event_flag_handler(chan_connection_id(chan), NULL);
 cleanup_notifier:
-    event_notifier_set_handler(&chan->notifier, NULL);
+    channel_set_event_handler(chan, false);
     event_notifier_cleanup(&chan->notifier);
 put_gpadl:
     vmbus_put_gpadl(chan->gpadl);
@@ -1561,13 +1605,19 @@ static void close_channel(VMBusChannel *chan)
         return;
     }
 
+    /*
+     * Stop the notifications first; with an IOThread this also waits for a
+     * running device worker, which must not see the channel half torn down
+     * or send to the guest through a dropped SINT route.
+     */
+    hyperv_set_event_flag_handler(chan_connection_id(chan), NULL);
+    channel_set_event_handler(chan, false);
+
     if (vdc->close_channel) {
         vdc->close_channel(chan);
     }
 
     hyperv_sint_route_unref(chan->notify_route);
-    hyperv_set_event_flag_handler(chan_connection_id(chan), NULL);
-    event_notifier_set_handler(&chan->notifier, NULL);
     event_notifier_cleanup(&chan->notifier);
     vmbus_put_gpadl(chan->gpadl);
     chan->is_open = false;
@@ -2460,6 +2510,13 @@ static void vmbus_dev_instance_init(Object *obj)
     } else {
         qdev_property_add_static(DEVICE(vdev), &vmbus_dev_instanceid);
     }
+
+    if (vdc->iothread_capable) {
+        object_property_add_link(obj, "iothread", TYPE_IOTHREAD,
+                                 (Object **)&vdev->iothread,
+                                 qdev_prop_allow_set_link_before_realize,
+                                 OBJ_PROP_LINK_STRONG);
+    }
 }
 
 const VMStateDescription vmstate_vmbus_dev = {
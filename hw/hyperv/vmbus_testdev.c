@@ -0,0 +1,92 @@
+/*
+ * VMBus test device
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * The device has a single channel and sends every in-band packet that the
+ * guest puts in it back to the guest unchanged, with the same transaction
+ * id.  It exercises the VMBus transport without a device protocol on top,
+ * and can process its channel in an IOThread.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/module.h"
+#include "hw/hyperv/vmbus.h"
+#include "qom/object.h"
+
+#define TYPE_VMBUS_TESTDEV "vmbus-testdev"
+OBJECT_DECLARE_SIMPLE_TYPE(VMBusTestDev, VMBUS_TESTDEV)
+
+#define VMBUS_TESTDEV_GUID "e0d8ba38-0bd1-4b55-8f19-6a6b3e8c4a1d"
+
+struct VMBusTestDev {
+    VMBusDevice parent;
+};
+
+/* Runs in the IOThread if there is one; it only touches the channel */
+static void vmbus_testdev_notify_cb(VMBusChannel *chan)
+{
+    VMBusChanReq *req;
+
+    if (vmbus_channel_recv_start(chan)) {
+        return;
+    }
+
+    while ((req = vmbus_channel_recv_peek(chan, sizeof(*req)))) {
+        if (req->pkt_type == VMBUS_PACKET_DATA_INBAND) {
+            /*
+             * Without room for the reply, leave the packet in the ring;
+             * the guest notifies us when it has made room.
+             */
+            if (vmbus_channel_reserve(chan, 0, req->msglen)) {
+                vmbus_free_req(req);
+                break;
+            }
+            vmbus_channel_send(chan, VMBUS_PACKET_DATA_INBAND, NULL, 0,
+                               req->msg, req->msglen, false,
+                               req->transaction_id);
+        }
+        vmbus_channel_recv_pop(chan);
+        vmbus_free_req(req);
+    }
+
+    vmbus_channel_recv_done(chan);
+}
+
+static const VMStateDescription vmstate_vmbus_testdev = {
+    .name = TYPE_VMBUS_TESTDEV,
+    .version_id = 0,
+    .minimum_version_id = 0,
+    .fields = (VMStateField[]) {
+        VMSTATE_STRUCT(parent, VMBusTestDev, 0, vmstate_vmbus_dev,
+                       VMBusDevice),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static void vmbus_testdev_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    VMBusDeviceClass *vdc = VMBUS_DEVICE_CLASS(klass);
+
+    qemu_uuid_parse(VMBUS_TESTDEV_GUID, &vdc->classid);
+    vdc->iothread_capable = true;
+    vdc->chan_notify_cb = vmbus_testdev_notify_cb;
+    dc->vmsd = &vmstate_vmbus_testdev;
+    set_bit(DEVICE_CATEGORY_MISC, dc->categories);
+}
+
+static const TypeInfo vmbus_testdev_type_info = {
+    .name = TYPE_VMBUS_TESTDEV,
+    .parent = TYPE_VMBUS_DEVICE,
+    .instance_size = sizeof(VMBusTestDev),
+    .class_init = vmbus_testdev_class_init,
+};
+
+static void vmbus_testdev_register_types(void)
+{
+    type_register_static(&vmbus_testdev_type_info);
+}
+
+type_init(vmbus_testdev_register_types)
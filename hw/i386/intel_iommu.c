@@ -199,6 +199,14 @@ static guint vtd_uint64_hash(gconstpointer v)
     return (guint)*(const uint64_t *)v;
 }
 
+static guint vtd_iotlb_hash(gconstpointer v)
+{
+    uint64_t key = *(const uint64_t *)v;
+
+    /* Fold the level into the hash, the gfn alone repeats across levels */
+    return (guint)(key ^ (key >> 32));
+}
+
 static gboolean vtd_hash_remove_by_domain(gpointer key, gpointer value,
                                           gpointer user_data)
 {
@@ -260,8 +268,24 @@ static void vtd_reset_context_cache_locked(IntelIOMMUState *s)
 /* Must be called with IOMMU lock held. */
 static void vtd_reset_iotlb_locked(IntelIOMMUState *s)
 {
-    assert(s->iotlb);
-    g_hash_table_remove_all(s->iotlb);
+    VTDAddressSpace *vtd_as, *next;
+
+    QLIST_FOREACH_SAFE(vtd_as, &s->vtd_as_with_iotlb, iotlb_next, next) {
+        g_hash_table_remove_all(vtd_as->iotlb);
+        QLIST_REMOVE(vtd_as, iotlb_next);
+    }
+    s->iotlb_size = 0;
+}
+
+/* Account for @removed entries dropped from the IOTLB of @vtd_as. */
+static void vtd_iotlb_removed_locked(IntelIOMMUState *s,
+                                     VTDAddressSpace *vtd_as, guint removed)
+{
+    assert(s->iotlb_size >= removed);
+    s->iotlb_size -= removed;
+    if (removed && !g_hash_table_size(vtd_as->iotlb)) {
+        QLIST_REMOVE(vtd_as, iotlb_next);
+    }
 }
 
 static void vtd_reset_iotlb(IntelIOMMUState *s)
@@ -279,11 +303,9 @@ static void vtd_reset_caches(IntelIOMMUState *s)
     vtd_iommu_unlock(s);
 }
 
-static uint64_t vtd_get_iotlb_key(uint64_t gfn, uint16_t source_id,
-                                  uint32_t level)
+static uint64_t vtd_get_iotlb_key(uint64_t gfn, uint32_t level)
 {
-    return gfn | ((uint64_t)(source_id) << VTD_IOTLB_SID_SHIFT) |
-           ((uint64_t)(level) << VTD_IOTLB_LVL_SHIFT);
+    return gfn | ((uint64_t)(level) << VTD_IOTLB_LVL_SHIFT);
 }
 
 static uint64_t vtd_get_iotlb_gfn(hwaddr addr, uint32_t level)
@@ -292,17 +314,15 @@ static uint64_t vtd_get_iotlb_gfn(hwaddr addr, uint32_t level)
 }
 
 /* Must be called with IOMMU lock held */
-static VTDIOTLBEntry *vtd_lookup_iotlb(IntelIOMMUState *s, uint16_t source_id,
-                                       hwaddr addr)
+static VTDIOTLBEntry *vtd_lookup_iotlb(VTDAddressSpace *vtd_as, hwaddr addr)
 {
     VTDIOTLBEntry *entry;
     uint64_t key;
     int level;
 
     for (level = VTD_SL_PT_LEVEL; level < VTD_SL_PML4_LEVEL; level++) {
-        key = vtd_get_iotlb_key(vtd_get_iotlb_gfn(addr, level),
-                                source_id, level);
-        entry = g_hash_table_lookup(s->iotlb, &key);
+        key = vtd_get_iotlb_key(vtd_get_iotlb_gfn(addr, level), level);
+        entry = g_hash_table_lookup(vtd_as->iotlb, &key);
         if (entry) {
             goto out;
         }
@@ -313,8 +333,9 @@ out:
 }
 
 /* Must be with IOMMU lock held */
-static void vtd_update_iotlb(IntelIOMMUState *s, uint16_t source_id,
-                             uint16_t domain_id, hwaddr addr, uint64_t slpte,
+static void vtd_update_iotlb(IntelIOMMUState *s, VTDAddressSpace *vtd_as,
+                             uint16_t source_id, uint16_t domain_id,
+                             hwaddr addr, uint64_t slpte,
                              uint8_t access_flags, uint32_t level)
 {
     VTDIOTLBEntry *entry = g_malloc(sizeof(*entry));
@@ -322,7 +343,7 @@ static void vtd_update_iotlb(IntelIOMMUState *s, uint16_t source_id,
     uint64_t gfn = vtd_get_iotlb_gfn(addr, level);
 
     trace_vtd_iotlb_page_update(source_id, addr, slpte, domain_id);
-    if (g_hash_table_size(s->iotlb) >= VTD_IOTLB_MAX_SIZE) {
+    if (s->iotlb_size >= VTD_IOTLB_MAX_SIZE) {
         trace_vtd_iotlb_reset("iotlb exceeds size limit");
         vtd_reset_iotlb_locked(s);
     }
@@ -332,8 +353,14 @@ static void vtd_update_iotlb(IntelIOMMUState *s, uint16_t source_id,
     entry->slpte = slpte;
     entry->access_flags = access_flags;
     entry->mask = vtd_slpt_level_page_mask(level);
-    *key = vtd_get_iotlb_key(gfn, source_id, level);
-    g_hash_table_replace(s->iotlb, key, entry);
+    *key = vtd_get_iotlb_key(gfn, level);
+
+    if (!g_hash_table_size(vtd_as->iotlb)) {
+        QLIST_INSERT_HEAD(&s->vtd_as_with_iotlb, vtd_as, iotlb_next);
+    }
+    if (g_hash_table_replace(vtd_as->iotlb, key, entry)) {
+        s->iotlb_size++;
+    }
 }
 
 /* Given the reg addr of both the message data and address, generate an
@@ -1701,7 +1728,7 @@ static bool vtd_do_iommu_translate(VTDAddressSpace *vtd_as, PCIBus *bus,
     cc_entry = &vtd_as->context_cache_entry;
 
     /* Try to fetch slpte form IOTLB */
-    iotlb_entry = vtd_lookup_iotlb(s, source_id, addr);
+    iotlb_entry = vtd_lookup_iotlb(vtd_as, addr);
     if (iotlb_entry) {
         trace_vtd_iotlb_page_hit(source_id, addr, iotlb_entry->slpte,
                                  iotlb_entry->domain_id);
@@ -1768,8 +1795,8 @@ static bool vtd_do_iommu_translate(VTDAddressSpace *vtd_as, PCIBus *bus,
 
     page_mask = vtd_slpt_level_page_mask(level);
     access_flags = IOMMU_ACCESS_FLAG(reads, writes);
-    vtd_update_iotlb(s, source_id, vtd_get_domain_id(s, &ce), addr, slpte,
-                     access_flags, level);
+    vtd_update_iotlb(s, vtd_as, source_id, vtd_get_domain_id(s, &ce), addr,
+                     slpte, access_flags, level);
 out:
     vtd_iommu_unlock(s);
     entry->iova = addr & page_mask;
@@ -1949,13 +1976,18 @@ static void vtd_iotlb_global_invalidate(IntelIOMMUState *s)
 static void vtd_iotlb_domain_invalidate(IntelIOMMUState *s, uint16_t domain_id)
 {
     VTDContextEntry ce;
-    VTDAddressSpace *vtd_as;
+    VTDAddressSpace *vtd_as, *next;
+    guint removed;
 
     trace_vtd_inv_desc_iotlb_domain(domain_id);
 
     vtd_iommu_lock(s);
-    g_hash_table_foreach_remove(s->iotlb, vtd_hash_remove_by_domain,
-                                &domain_id);
+    QLIST_FOREACH_SAFE(vtd_as, &s->vtd_as_with_iotlb, iotlb_next, next) {
+        removed = g_hash_table_foreach_remove(vtd_as->iotlb,
+                                              vtd_hash_remove_by_domain,
+                                              &domain_id);
+        vtd_iotlb_removed_locked(s, vtd_as, removed);
+    }
     vtd_iommu_unlock(s);
 
     QLIST_FOREACH(vtd_as, &s->vtd_as_with_notifiers, next) {
@@ -1967,14 +1999,31 @@ static void vtd_iotlb_domain_invalidate(IntelIOMMUState *s, uint16_t domain_id)
     }
 }
 
+static uint64_t get_naturally_aligned_size(uint64_t start,
+                                           uint64_t size, int gaw)
+{
+    uint64_t max_mask = 1ULL << gaw;
+    uint64_t alignment = start ? start & -start : max_mask;
+
+    alignment = MIN(alignment, max_mask);
+    size = MIN(size, max_mask);
+
+    if (alignment <= size) {
+        /* Increase the alignment of start */
+        return alignment;
+    } else {
+        /* Find the largest page mask from size */
+        return 1ULL << (63 - clz64(size));
+    }
+}
+
 static void vtd_iotlb_page_invalidate_notify(IntelIOMMUState *s,
                                            uint16_t domain_id, hwaddr addr,
-                                           uint8_t am)
+                                           hwaddr size)
 {
     VTDAddressSpace *vtd_as;
     VTDContextEntry ce;
     int ret;
-    hwaddr size = (1 << am) * VTD_PAGE_SIZE;
 
     QLIST_FOREACH(vtd_as, &(s->vtd_as_with_notifiers), next) {
         ret = vtd_dev_to_context_entry(s, pci_bus_num(vtd_as->bus),
@@ -1991,36 +2040,136 @@ static void vtd_iotlb_page_invalidate_notify(IntelIOMMUState *s,
                 /*
                  * For UNMAP-only notifiers, we don't need to walk the
                  * page tables.  We just deliver the PSI down to
-                 * invalidate caches.
+                 * invalidate caches, split in naturally aligned ranges
+                 * if several invalidations were merged.
                  */
-                IOMMUTLBEntry entry = {
-                    .target_as = &address_space_memory,
-                    .iova = addr,
-                    .translated_addr = 0,
-                    .addr_mask = size - 1,
-                    .perm = IOMMU_NONE,
-                };
-                memory_region_notify_iommu(&vtd_as->iommu, 0, entry);
+                hwaddr start = addr, remain = size;
+
+                while (remain) {
+                    hwaddr mask = get_naturally_aligned_size(start, remain,
+                                                             s->aw_bits);
+                    IOMMUTLBEntry entry = {
+                        .target_as = &address_space_memory,
+                        .iova = start,
+                        .translated_addr = 0,
+                        .addr_mask = mask - 1,
+                        .perm = IOMMU_NONE,
+                    };
+
+                    memory_region_notify_iommu(&vtd_as->iommu, 0, entry);
+                    start += mask;
+                    remain -= mask;
+                }
             }
         }
     }
 }
 
-static void vtd_iotlb_page_invalidate(IntelIOMMUState *s, uint16_t domain_id,
-                                      hwaddr addr, uint8_t am)
+/*
+ * Drop the entries of @vtd_as matched by a page-selective invalidation.
+ * Small invalidations look up the few keys that can match instead of
+ * walking the whole table.  Must be called with IOMMU lock held.
+ */
+static guint vtd_iotlb_page_remove_as(VTDAddressSpace *vtd_as,
+                                      VTDIOTLBPageInvInfo *info, uint8_t am)
 {
+    uint64_t gfn = (info->addr >> VTD_PAGE_SHIFT_4K) & info->mask;
+    uint64_t npages = 1ULL << am;
+    VTDIOTLBEntry *entry;
+    guint removed = 0;
+    uint64_t key, step, g;
+    int level;
+
+    if (npages >= g_hash_table_size(vtd_as->iotlb)) {
+        return g_hash_table_foreach_remove(vtd_as->iotlb,
+                                           vtd_hash_remove_by_page, info);
+    }
+
+    for (level = VTD_SL_PT_LEVEL; level < VTD_SL_PML4_LEVEL; level++) {
+        /*
+         * The entries of this level that are inside the range or, for
+         * large pages, the single entry that covers it.
+         */
+        step = 1ULL << (vtd_slpt_level_shift(level) - VTD_PAGE_SHIFT_4K);
+        g = gfn & ~(step - 1);
+        do {
+            key = vtd_get_iotlb_key(g, level);
+            entry = g_hash_table_lookup(vtd_as->iotlb, &key);
+            if (entry && entry->domain_id == info->domain_id) {
+                g_hash_table_remove(vtd_as->iotlb, &key);
+                removed++;
+            }
+            g += step;
+        } while (g < gfn + npages);
+    }
+    return removed;
+}
+
+static void vtd_iotlb_page_remove(IntelIOMMUState *s, uint16_t domain_id,
+                                  hwaddr addr, uint8_t am)
+{
+    VTDAddressSpace *vtd_as, *next;
     VTDIOTLBPageInvInfo info;
+    guint removed;
 
     trace_vtd_inv_desc_iotlb_pages(domain_id, addr, am);
 
     assert(am <= VTD_MAMV);
     info.domain_id = domain_id;
     info.addr = addr;
-    info.mask = ~((1 << am) - 1);
+    info.mask = ~((1ULL << am) - 1);
     vtd_iommu_lock(s);
-    g_hash_table_foreach_remove(s->iotlb, vtd_hash_remove_by_page, &info);
+    QLIST_FOREACH_SAFE(vtd_as, &s->vtd_as_with_iotlb, iotlb_next, next) {
+        removed = vtd_iotlb_page_remove_as(vtd_as, &info, am);
+        vtd_iotlb_removed_locked(s, vtd_as, removed);
+    }
     vtd_iommu_unlock(s);
-    vtd_iotlb_page_invalidate_notify(s, domain_id, addr, am);
+}
+
+static void vtd_iotlb_page_invalidate(IntelIOMMUState *s, uint16_t domain_id,
+                                      hwaddr addr, uint8_t am)
+{
+    vtd_iotlb_page_remove(s, domain_id, addr, am);
+    vtd_iotlb_page_invalidate_notify(s, domain_id, addr,
+                                     (1ULL << am) * VTD_PAGE_SIZE);
+}
+
+/* Notify the page-selective invalidations merged from the QI, if any */
+static void vtd_flush_pending_psi(IntelIOMMUState *s)
+{
+    if (s->psi_size) {
+        vtd_iotlb_page_invalidate_notify(s, s->psi_domain_id, s->psi_addr,
+                                         s->psi_size);
+        s->psi_size = 0;
+    }
+}
+
+/*
+ * Guests usually queue a run of page-selective invalidations for
+ * contiguous ranges of the same domain.  The IOTLB entries are dropped
+ * right away, but the notifiers, which may walk the page tables or call
+ * into VFIO for each of them, are only told about the merged range once
+ * the run ends.  This is invisible to the guest, because the whole queue
+ * is processed before the IQ tail write returns.
+ */
+static void vtd_queue_psi(IntelIOMMUState *s, uint16_t domain_id,
+                          hwaddr addr, uint8_t am)
+{
+    hwaddr size = (1ULL << am) * VTD_PAGE_SIZE;
+
+    addr &= ~(size - 1);
+    vtd_iotlb_page_remove(s, domain_id, addr, am);
+
+    if (s->psi_size && s->psi_domain_id == domain_id &&
+        s->psi_addr + s->psi_size == addr) {
+        s->psi_size += size;
+        return;
+    }
+
+    vtd_flush_pending_psi(s);
+    s->psi_domain_id = domain_id;
+    s->psi_addr = addr;
+    s->psi_size = size;
 }
 
 /* Flush IOTLB
@@ -2382,7 +2531,7 @@ static bool vtd_process_iotlb_desc(IntelIOMMUState *s, VTDInvDesc *inv_desc)
                               am, (unsigned)VTD_MAMV);
             return false;
         }
-        vtd_iotlb_page_invalidate(s, domain_id, addr, am);
+        vtd_queue_psi(s, domain_id, addr, am);
         break;
 
     default:
@@ -2486,6 +2635,12 @@ static bool vtd_process_inv_desc(IntelIOMMUState *s)
     /* FIXME: should update at first or at last? */
     s->iq_last_desc_type = desc_type;
 
+    /* Anything but another page-selective invalidation ends a run of them */
+    if (desc_type != VTD_INV_DESC_IOTLB ||
+        (inv_desc.lo & VTD_INV_DESC_IOTLB_G) != VTD_INV_DESC_IOTLB_PAGE) {
+        vtd_flush_pending_psi(s);
+    }
+
     switch (desc_type) {
     case VTD_INV_DESC_CC:
         trace_vtd_inv_desc("context-cache", inv_desc.hi, inv_desc.lo);
@@ -2575,6 +2730,7 @@ static void vtd_fetch_inv_desc(IntelIOMMUState *s)
                          (((uint64_t)(s->iq_head)) << qi_shift) &
                          VTD_IQH_QH_MASK);
     }
+    vtd_flush_pending_psi(s);
 }
 
 /* Handle write to Invalidation Queue Tail Register */
@@ -3387,6 +3543,9 @@ VTDAddressSpace *vtd_find_add_as(IntelIOMMUState *s, PCIBus *bus, int devfn)
         vtd_dev_as->iommu_state = s;
         vtd_dev_as->context_cache_entry.context_cache_gen = 0;
         vtd_dev_as->iova_tree = iova_tree_new();
+        vtd_dev_as->iotlb = g_hash_table_new_full(vtd_iotlb_hash,
+                                                  vtd_uint64_equal,
+                                                  g_free, g_free);
 
         memory_region_init(&vtd_dev_as->root, OBJECT(s), name, UINT64_MAX);
         address_space_init(&vtd_dev_as->as, &vtd_dev_as->root, "vtd-root");
@@ -3440,24 +3599,6 @@ VTDAddressSpace *vtd_find_add_as(IntelIOMMUState *s, PCIBus *bus, int devfn)
     return vtd_dev_as;
 }
 
-static uint64_t get_naturally_aligned_size(uint64_t start,
-                                           uint64_t size, int gaw)
-{
-    uint64_t max_mask = 1ULL << gaw;
-    uint64_t alignment = start ? start & -start : max_mask;
-
-    alignment = MIN(alignment, max_mask);
-    size = MIN(size, max_mask);
-
-    if (alignment <= size) {
-        /* Increase the alignment of start */
-        return alignment;
-    } else {
-        /* Find the largest page mask from size */
-        return 1ULL << (63 - clz64(size));
-    }
-}
-
 /* Unmap the whole range in the notifier's scope. */
 static void vtd_address_space_unmap(VTDAddressSpace *as, IOMMUNotifier *n)
 {
@@ -3837,9 +3978,7 @@ static void vtd_realize(DeviceState *dev, Error **errp)
                                         &s->mr_ir, 1);
 
     sysbus_init_mmio(SYS_BUS_DEVICE(s), &s->csrmem);
-    /* No corresponding destroy */
-    s->iotlb = g_hash_table_new_full(vtd_uint64_hash, vtd_uint64_equal,
-                                     g_free, g_free);
+    QLIST_INIT(&s->vtd_as_with_iotlb);
     s->vtd_as_by_busptr = g_hash_table_new_full(vtd_uint64_hash, vtd_uint64_equal,
                                               g_free, g_free);
     vtd_init(s);
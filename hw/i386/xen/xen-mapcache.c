@@ -18,6 +18,7 @@
 #include "qemu/bitmap.h"
 
 #include "sysemu/runstate.h"
+#include "exec/memory.h"
 #include "sysemu/xen-mapcache.h"
 #include "trace.h"
 
@@ -382,13 +383,10 @@ ram_addr_t xen_ram_addr_from_mapcache(void *ptr)
         }
     }
     if (!found) {
-        fprintf(stderr, "%s, could not find %p\n", __func__, ptr);
-        QTAILQ_FOREACH(reventry, &mapcache->locked_entries, next) {
-            DPRINTF("   "TARGET_FMT_plx" -> %p is present\n", reventry->paddr_index,
-                    reventry->vaddr_req);
-        }
-        abort();
-        return 0;
+        /* Not guest RAM, e.g. a DMA bounce buffer */
+        DPRINTF("%s, could not find %p\n", __func__, ptr);
+        mapcache_unlock();
+        return RAM_ADDR_INVALID;
     }
 
     entry = &mapcache->entry[paddr_index % mapcache->nr_buckets];
@@ -24,6 +24,7 @@
 
 #include "qemu/osdep.h"
 #include "qemu/log.h"
+#include "qemu/main-loop.h"
 #include "hw/isa/isa.h"
 #include "migration/vmstate.h"
 #include "hw/acpi/aml-build.h"
@@ -520,9 +521,29 @@ static const MemoryRegionOps i8042_data_ops = {
     .endianness = DEVICE_LITTLE_ENDIAN,
 };
 
+/*
+ * The command port is dispatched without the BQL, because guests poll
+ * the status register in tight loops; commands still need the lock.
+ * Some callers, like qtest, access the port with the BQL already held.
+ */
+static void i8042_cmd_write(void *opaque, hwaddr addr,
+                            uint64_t val, unsigned size)
+{
+    bool release_lock = false;
+
+    if (!qemu_mutex_iothread_locked()) {
+        qemu_mutex_lock_iothread();
+        release_lock = true;
+    }
+    kbd_write_command(opaque, addr, val, size);
+    if (release_lock) {
+        qemu_mutex_unlock_iothread();
+    }
+}
+
 static const MemoryRegionOps i8042_cmd_ops = {
     .read = kbd_read_status,
-    .write = kbd_write_command,
+    .write = i8042_cmd_write,
     .impl = {
         .min_access_size = 1,
         .max_access_size = 1,
@@ -539,6 +560,7 @@ static void i8042_initfn(Object *obj)
                           "i8042-data", 1);
     memory_region_init_io(isa_s->io + 1, obj, &i8042_cmd_ops, s,
                           "i8042-cmd", 1);
+    memory_region_clear_global_locking(isa_s->io + 1);
 
     qdev_init_gpio_out_named(DEVICE(obj), &s->a20_out, I8042_A20_LINE, 1);
 }
@@ -262,16 +262,43 @@ static void gicv3_update_noirqset(GICv3State *s, int start, int len)
     }
 }
 
-void gicv3_update(GICv3State *s, int start, int len)
+static void gicv3_save_hppis(GICv3State *s)
 {
     int i;
 
-    gicv3_update_noirqset(s, start, len);
     for (i = 0; i < s->num_cpu; i++) {
-        gicv3_cpuif_update(&s->cpu[i]);
+        s->cpu[i].last_hppi = s->cpu[i].hppi;
     }
 }
 
+/*
+ * Tell the CPU interfaces whose highest priority pending interrupt changed
+ * since gicv3_save_hppis().  The other CPU interfaces already signal the
+ * right thing, and updating them would needlessly kick their vCPUs, which
+ * adds up quickly with many vCPUs.
+ */
+static void gicv3_update_changed_cpuifs(GICv3State *s)
+{
+    int i;
+
+    for (i = 0; i < s->num_cpu; i++) {
+        GICv3CPUState *cs = &s->cpu[i];
+
+        if (cs->hppi.irq != cs->last_hppi.irq ||
+            cs->hppi.prio != cs->last_hppi.prio ||
+            cs->hppi.grp != cs->last_hppi.grp) {
+            gicv3_cpuif_update(cs);
+        }
+    }
+}
+
+void gicv3_update(GICv3State *s, int start, int len)
+{
+    gicv3_save_hppis(s);
+    gicv3_update_noirqset(s, start, len);
+    gicv3_update_changed_cpuifs(s);
+}
+
 void gicv3_full_update_noirqset(GICv3State *s)
 {
     /* Completely recalculate the GIC status from scratch, but
@@ -300,12 +327,9 @@ void gicv3_full_update(GICv3State *s)
     /* Completely recalculate the GIC status from scratch, including
      * updating outbound IRQ lines.
      */
-    int i;
-
+    gicv3_save_hppis(s);
     gicv3_full_update_noirqset(s);
-    for (i = 0; i < s->num_cpu; i++) {
-        gicv3_cpuif_update(&s->cpu[i]);
-    }
+    gicv3_update_changed_cpuifs(s);
 }
 
 /* Process a change in an external IRQ input. */
@@ -902,6 +902,8 @@ static void icc_activate_irq(GICv3CPUState *cs, int irq)
         gicv3_gicd_active_set(cs->gic, irq);
         gicv3_gicd_pending_clear(cs->gic, irq);
         gicv3_update(cs->gic, irq, 1);
+        /* Our running priority changed even if our hppi did not */
+        gicv3_cpuif_update(cs);
     }
 }
 
@@ -1113,6 +1115,8 @@ static void icc_deactivate_irq(GICv3CPUState *cs, int irq)
     } else {
         gicv3_gicd_active_clear(cs->gic, irq);
         gicv3_update(cs->gic, irq, 1);
+        /* Our running priority may have dropped even if our hppi did not */
+        gicv3_cpuif_update(cs);
     }
 }
 
@@ -263,7 +263,10 @@ void gicv3_redist_update(GICv3CPUState *cs);
  *
  * Recalculate the highest priority pending interrupts after a
  * change to the distributor state affecting @len interrupts
- * starting at @start, and inform the CPUs accordingly.
+ * starting at @start, and inform the CPUs whose highest priority
+ * pending interrupt changed.  Changes to the state of a CPU
+ * interface must be signalled with gicv3_cpuif_update() by the
+ * caller.
  */
 void gicv3_update(GICv3State *s, int start, int len);
 
@@ -283,7 +286,8 @@ void gicv3_full_update_noirqset(GICv3State *s);
  *
  * Recalculate the highest priority pending interrupts after
  * a change that could affect the status of all interrupts,
- * and inform the CPUs accordingly.
+ * and inform the CPUs whose highest priority pending interrupt
+ * changed.
  */
 void gicv3_full_update(GICv3State *s);
 MemTxResult gicv3_dist_read(void *opaque, hwaddr offset, uint64_t *data,
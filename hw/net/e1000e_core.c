@@ -52,6 +52,8 @@
 #define E1000E_MIN_XITR     (500) /* No more then 7813 interrupts per
                                      second according to spec 10.2.4.2 */
 #define E1000E_MAX_TX_FRAGS (64)
+/* TX descriptors fetched with a single DMA read */
+#define E1000E_TX_DESC_BATCH (32)
 
 static inline void
 e1000e_set_interrupt_cause(E1000ECore *core, uint32_t val);
@@ -95,11 +97,28 @@ e1000e_intrmgr_rearm_timer(E1000IntrDelayTimer *timer)
 
     trace_e1000e_irq_rearm_timer(timer->delay_reg << 2, delay_ns);
 
-    timer_mod(timer->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + delay_ns);
+    /*
+     * The packet timers are rearmed for every packet; leave it to the
+     * callback to catch up instead of moving the timer each time.
+     */
+    timer->deadline = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + delay_ns;
+    if (!timer_pending(timer->timer) ||
+        timer_expire_time_ns(timer->timer) > timer->deadline) {
+        timer_mod(timer->timer, timer->deadline);
+    }
 
     timer->running = true;
 }
 
+static void
+e1000e_intrmgr_sync_timer(E1000IntrDelayTimer *timer)
+{
+    if (timer_pending(timer->timer) &&
+        timer_expire_time_ns(timer->timer) < timer->deadline) {
+        timer_mod(timer->timer, timer->deadline);
+    }
+}
+
 static void
 e1000e_intmgr_timer_resume(E1000IntrDelayTimer *timer)
 {
@@ -137,6 +156,12 @@ e1000e_intrmgr_on_timer(void *opaque)
 {
     E1000IntrDelayTimer *timer = opaque;
 
+    if (timer->deadline > qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL)) {
+        /* Rearmed since the timer was set */
+        timer_mod(timer->timer, timer->deadline);
+        return;
+    }
+
     trace_e1000e_irq_throttling_timer(timer->delay_reg << 2);
 
     timer->running = false;
@@ -246,6 +271,16 @@ e1000e_intrmgr_initialize_all_timers(E1000ECore *core, bool create)
     }
 }
 
+static void
+e1000e_intrmgr_sync_delay_timers(E1000ECore *core)
+{
+    e1000e_intrmgr_sync_timer(&core->radv);
+    e1000e_intrmgr_sync_timer(&core->rdtr);
+    e1000e_intrmgr_sync_timer(&core->raid);
+    e1000e_intrmgr_sync_timer(&core->tidv);
+    e1000e_intrmgr_sync_timer(&core->tadv);
+}
+
 static inline void
 e1000e_intrmgr_stop_delay_timers(E1000ECore *core)
 {
@@ -855,6 +890,19 @@ e1000e_ring_free_descr_num(E1000ECore *core, const E1000E_RingInfo *r)
     return 0;
 }
 
+/* Descriptors from the head up to the tail or the end of the ring */
+static inline uint32_t
+e1000e_ring_contig_descr_num(E1000ECore *core, const E1000E_RingInfo *r)
+{
+    uint32_t size = core->mac[r->dlen] / E1000_RING_DESC_LEN;
+
+    if (core->mac[r->dh] < core->mac[r->dt]) {
+        return core->mac[r->dt] - core->mac[r->dh];
+    }
+
+    return core->mac[r->dh] < size ? size - core->mac[r->dh] : 1;
+}
+
 static inline bool
 e1000e_ring_enabled(E1000ECore *core, const E1000E_RingInfo *r)
 {
@@ -913,10 +961,11 @@ static void
 e1000e_start_xmit(E1000ECore *core, const E1000E_TxRing *txr)
 {
     dma_addr_t base;
-    struct e1000_tx_desc desc;
+    struct e1000_tx_desc desc[E1000E_TX_DESC_BATCH];
     bool ide = false;
     const E1000E_RingInfo *txi = txr->i;
     uint32_t cause = E1000_ICS_TXQE;
+    uint32_t i, n;
 
     if (!(core->mac[TCTL] & E1000_TCTL_EN)) {
         trace_e1000e_tx_disabled();
@@ -925,16 +974,21 @@ e1000e_start_xmit(E1000ECore *core, const E1000E_TxRing *txr)
 
     while (!e1000e_ring_empty(core, txi)) {
         base = e1000e_ring_head_descr(core, txi);
+        n = MIN(e1000e_ring_contig_descr_num(core, txi), ARRAY_SIZE(desc));
 
-        pci_dma_read(core->owner, base, &desc, sizeof(desc));
+        /* The guest doesn't touch descriptors between head and tail */
+        pci_dma_read(core->owner, base, desc, n * sizeof(desc[0]));
 
-        trace_e1000e_tx_descr((void *)(intptr_t)desc.buffer_addr,
-                              desc.lower.data, desc.upper.data);
+        for (i = 0; i < n; i++) {
+            trace_e1000e_tx_descr((void *)(intptr_t)desc[i].buffer_addr,
+                                  desc[i].lower.data, desc[i].upper.data);
 
-        e1000e_process_tx_desc(core, txr->tx, &desc, txi->idx);
-        cause |= e1000e_txdesc_writeback(core, base, &desc, &ide, txi->idx);
+            e1000e_process_tx_desc(core, txr->tx, &desc[i], txi->idx);
+            cause |= e1000e_txdesc_writeback(core, base + i * sizeof(desc[0]),
+                                             &desc[i], &ide, txi->idx);
 
-        e1000e_ring_advance(core, txi, 1);
+            e1000e_ring_advance(core, txi, 1);
+        }
     }
 
     if (!ide || !e1000e_intrmgr_delay_tx_causes(core, &cause)) {
@@ -3501,6 +3555,9 @@ void e1000e_core_pre_save(E1000ECore *core)
             core->tx[i].skip_cp = true;
         }
     }
+
+    /* The expiry time is migrated, but the deadline is not */
+    e1000e_intrmgr_sync_delay_timers(core);
 }
 
 int
@@ -53,6 +53,12 @@ enum { PHY_R = BIT(0),
 typedef struct E1000IntrDelayTimer_st {
     QEMUTimer *timer;
     bool running;
+    /*
+     * When the timer is due.  A pending timer is not moved when it is
+     * rearmed to a later time, so it may expire before this and then
+     * only moves itself here.
+     */
+    int64_t deadline;
     uint32_t delay_reg;
     uint32_t delay_resolution_ns;
     E1000ECore *core;
@@ -15,6 +15,7 @@
 #include "qemu/atomic.h"
 #include "qemu/iov.h"
 #include "qemu/main-loop.h"
+#include "block/aio-wait.h"
 #include "qemu/module.h"
 #include "hw/virtio/virtio.h"
 #include "net/net.h"
@@ -22,6 +23,7 @@
 #include "net/tap.h"
 #include "qemu/error-report.h"
 #include "qemu/timer.h"
+#include "qemu/xxhash.h"
 #include "qemu/option.h"
 #include "qemu/option_int.h"
 #include "qemu/config-file.h"
@@ -73,6 +75,12 @@
 #define VIRTIO_NET_IP6_ADDR_SIZE   32      /* ipv6 saddr + daddr */
 #define VIRTIO_NET_MAX_IP6_PAYLOAD VIRTIO_NET_MAX_TCP_PAYLOAD
 
+/* Extension headers walked before giving up on an ipv6 packet */
+#define VIRTIO_NET_RSC_MAX_IP6_EXT 4
+
+/* Segments cached per chain, the oldest is drained to make room */
+#define VIRTIO_NET_RSC_MAX_FLOWS   64
+
 /* Purge coalesced packets timer interval, This value affects the performance
    a lot, and should be tuned carefully, '300000'(300us) is the recommended
    value to pass the WHQL test, '50000' can gain 2x netperf throughput with
@@ -232,6 +240,7 @@ static void virtio_net_vhost_status(VirtIONet *n, uint8_t status)
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
     NetClientState *nc = qemu_get_queue(n->nic);
     int queues = n->multiqueue ? n->max_queues : 1;
+    int cvq = n->max_ncs - n->max_queues;
 
     if (!get_vhost_net(nc->peer)) {
         return;
@@ -273,14 +282,14 @@ static void virtio_net_vhost_status(VirtIONet *n, uint8_t status)
         }
 
         n->vhost_started = 1;
-        r = vhost_net_start(vdev, n->nic->ncs, queues);
+        r = vhost_net_start(vdev, n->nic->ncs, queues, cvq);
         if (r < 0) {
             error_report("unable to start vhost net: %d: "
                          "falling back on userspace virtio", -r);
             n->vhost_started = 0;
         }
     } else {
-        vhost_net_stop(vdev, n->nic->ncs, queues);
+        vhost_net_stop(vdev, n->nic->ncs, queues, cvq);
         n->vhost_started = 0;
     }
 }
@@ -338,14 +347,29 @@ static void virtio_net_vnet_endian_status(VirtIONet *n, uint8_t status)
     }
 }
 
+/* Notify the guest about a data queue, from the main loop or an IOThread */
+static void virtio_net_notify(VirtIONet *n, VirtQueue *vq)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+
+    if (n->dataplane_started) {
+        virtio_notify_irqfd(vdev, vq);
+    } else {
+        virtio_notify(vdev, vq);
+    }
+}
+
 static void virtio_net_drop_tx_queue_data(VirtIODevice *vdev, VirtQueue *vq)
 {
     unsigned int dropped = virtqueue_drop_all(vq);
     if (dropped) {
-        virtio_notify(vdev, vq);
+        virtio_net_notify(VIRTIO_NET(vdev), vq);
     }
 }
 
+static void virtio_net_dataplane_stop(VirtIONet *n);
+static void virtio_net_dataplane_status(VirtIONet *n, uint8_t status);
+
 static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
@@ -353,6 +377,9 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
     int i;
     uint8_t queue_status;
 
+    /* The queues are only touched from outside the IOThread when stopped */
+    virtio_net_dataplane_stop(n);
+
     virtio_net_vnet_endian_status(n, status);
     virtio_net_vhost_status(n, status);
 
@@ -382,7 +409,7 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
                 timer_mod(q->tx_timer,
                                qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + n->tx_timeout);
             } else {
-                qemu_bh_schedule(q->tx_bh);
+                virtio_net_schedule_tx(q);
             }
         } else {
             if (q->tx_timer) {
@@ -401,6 +428,8 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
             }
         }
     }
+
+    virtio_net_dataplane_status(n, status);
 }
 
 static void virtio_net_set_link_status(NetClientState *nc)
@@ -527,6 +556,11 @@ static void virtio_net_reset(VirtIODevice *vdev)
     VirtIONet *n = VIRTIO_NET(vdev);
     int i;
 
+    /* Give the IOThread another chance after a failure to start */
+    n->dataplane_disabled = false;
+
+    virtio_net_disable_rss(n);
+
     /* Reset back to compatibility mode */
     n->promisc = 1;
     n->allmulti = 0;
@@ -732,7 +766,10 @@ static uint64_t virtio_net_get_features(VirtIODevice *vdev, uint64_t features,
         return features;
     }
 
-    virtio_clear_feature(&features, VIRTIO_NET_F_RSS);
+    /* With vhost, RSS is only possible if the backend does the steering */
+    if (!ebpf_rss_is_loaded(&n->ebpf_rss)) {
+        virtio_clear_feature(&features, VIRTIO_NET_F_RSS);
+    }
     virtio_clear_feature(&features, VIRTIO_NET_F_HASH_REPORT);
     features = vhost_net_get_features(get_vhost_net(nc->peer), features);
     vdev->backend_features = features;
@@ -912,7 +949,7 @@ static void virtio_net_set_features(VirtIODevice *vdev, uint64_t features)
         virtio_net_apply_guest_offloads(n);
     }
 
-    for (i = 0;  i < n->max_queues; i++) {
+    for (i = 0;  i < n->max_ncs; i++) {
         NetClientState *nc = qemu_get_subqueue(n->nic, i);
 
         if (!get_vhost_net(nc->peer)) {
@@ -1169,10 +1206,99 @@ static int virtio_net_handle_announce(VirtIONet *n, uint8_t cmd,
     }
 }
 
+/* Hash types the eBPF program cannot compute, see tools/ebpf/rss.bpf.c */
+#define VIRTIO_NET_RSS_EBPF_UNSUPPORTED_TYPES \
+    (VIRTIO_NET_RSS_HASH_TYPE_IP_EX | VIRTIO_NET_RSS_HASH_TYPE_TCP_EX | \
+     VIRTIO_NET_RSS_HASH_TYPE_UDP_EX)
+
+static bool virtio_net_attach_ebpf_to_backend(NICState *nic, int prog_fd)
+{
+    NetClientState *nc = qemu_get_queue(nic)->peer;
+
+    if (!nc || !nc->info->set_steering_ebpf) {
+        return false;
+    }
+
+    return nc->info->set_steering_ebpf(nc, prog_fd);
+}
+
+/*
+ * Steer the packets in the backend according to the RSS configuration, so
+ * that they need not go through virtio_net_process_rss() and RSS keeps
+ * working with vhost.
+ */
+static bool virtio_net_attach_ebpf_rss(VirtIONet *n)
+{
+    EBPFRSSConfig config = {};
+
+    if (!ebpf_rss_is_loaded(&n->ebpf_rss)) {
+        return false;
+    }
+    if (n->rss_data.populate_hash ||
+        (n->rss_data.hash_types & VIRTIO_NET_RSS_EBPF_UNSUPPORTED_TYPES)) {
+        return false;
+    }
+
+    config.redirect = n->rss_data.redirect;
+    config.populate_hash = n->rss_data.populate_hash;
+    config.hash_types = n->rss_data.hash_types;
+    config.indirections_len = n->rss_data.indirections_len;
+    config.default_queue = n->rss_data.default_queue;
+
+    if (!ebpf_rss_set_all(&n->ebpf_rss, &config,
+                          n->rss_data.indirections_table, n->rss_data.key)) {
+        return false;
+    }
+
+    return virtio_net_attach_ebpf_to_backend(n->nic, n->ebpf_rss.program_fd);
+}
+
+static void virtio_net_detach_ebpf_rss(VirtIONet *n)
+{
+    if (ebpf_rss_is_loaded(&n->ebpf_rss)) {
+        virtio_net_attach_ebpf_to_backend(n->nic, -1);
+    }
+}
+
+static void virtio_net_commit_rss_config(VirtIONet *n)
+{
+    if (!n->rss_data.enabled) {
+        virtio_net_detach_ebpf_rss(n);
+        return;
+    }
+
+    n->rss_data.enabled_software_rss = !virtio_net_attach_ebpf_rss(n);
+    if (n->rss_data.enabled_software_rss) {
+        virtio_net_detach_ebpf_rss(n);
+        if (get_vhost_net(qemu_get_queue(n->nic)->peer)) {
+            warn_report_once("virtio-net: this RSS configuration needs "
+                             "QEMU to steer packets, it is ignored while "
+                             "vhost is running");
+        }
+    }
+}
+
+static bool virtio_net_load_ebpf(VirtIONet *n)
+{
+    /* Detaching doubles as a check that the backend supports steering */
+    if (!virtio_net_attach_ebpf_to_backend(n->nic, -1)) {
+        return false;
+    }
+
+    return ebpf_rss_load(&n->ebpf_rss);
+}
+
+static void virtio_net_unload_ebpf(VirtIONet *n)
+{
+    virtio_net_detach_ebpf_rss(n);
+    ebpf_rss_unload(&n->ebpf_rss);
+}
+
 static void virtio_net_disable_rss(VirtIONet *n)
 {
     if (n->rss_data.enabled) {
         trace_virtio_net_rss_disable();
+        virtio_net_detach_ebpf_rss(n);
     }
     n->rss_data.enabled = false;
 }
@@ -1289,6 +1415,7 @@ static uint16_t virtio_net_handle_rss(VirtIONet *n,
         goto error;
     }
     n->rss_data.enabled = true;
+    virtio_net_commit_rss_config(n);
     trace_virtio_net_rss_enable(n->rss_data.hash_types,
                                 n->rss_data.indirections_len,
                                 temp.b);
@@ -1354,6 +1481,9 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
     struct iovec *iov, *iov2;
     unsigned int iov_cnt;
 
+    /* Commands change state that the IOThread reads without locking */
+    virtio_net_dataplane_stop(n);
+
     for (;;) {
         elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
         if (!elem) {
@@ -1395,6 +1525,8 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
         g_free(iov2);
         g_free(elem);
     }
+
+    virtio_net_dataplane_status(n, vdev->status);
 }
 
 /* RX */
@@ -1674,7 +1806,7 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
         return -1;
     }
 
-    if (!no_rss && n->rss_data.enabled) {
+    if (!no_rss && n->rss_data.enabled && n->rss_data.enabled_software_rss) {
         int index = virtio_net_process_rss(nc, buf, size);
         if (index >= 0) {
             NetClientState *nc2 = qemu_get_subqueue(n->nic, index);
@@ -1717,7 +1849,7 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
             virtio_error(vdev,
                          "virtio-net receive queue contains no in buffers");
             virtqueue_detach_element(q->rx_vq, elem, 0);
-            g_free(elem);
+            virtqueue_element_free(q->rx_vq, elem);
             return -1;
         }
 
@@ -1754,13 +1886,13 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
          * Otherwise, drop it. */
         if (!n->mergeable_rx_bufs && offset < size) {
             virtqueue_unpop(q->rx_vq, elem, total);
-            g_free(elem);
+            virtqueue_element_free(q->rx_vq, elem);
             return size;
         }
 
         /* signal other side */
         virtqueue_fill(q->rx_vq, elem, total, i++);
-        g_free(elem);
+        virtqueue_element_free(q->rx_vq, elem);
     }
 
     if (mhdr_cnt) {
@@ -1771,7 +1903,11 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
     }
 
     virtqueue_flush(q->rx_vq, i);
-    virtio_notify(vdev, q->rx_vq);
+    if (q->rx_batch) {
+        q->rx_notify_pending = true;
+    } else {
+        virtio_net_notify(n, q->rx_vq);
+    }
 
     return size;
 }
@@ -1795,6 +1931,7 @@ static void virtio_net_rsc_extract_unit4(VirtioNetRscChain *chain,
                               + sizeof(struct eth_header));
     unit->ip = (void *)ip;
     ip_hdrlen = (ip->ip_ver_len & 0xF) << 2;
+    unit->ip_hdrlen = ip_hdrlen;
     unit->ip_plen = &ip->ip_len;
     unit->tcp = (struct tcp_header *)(((uint8_t *)unit->ip) + ip_hdrlen);
     unit->tcp_hdrlen = (htons(unit->tcp->th_offset_flags) & 0xF000) >> 10;
@@ -1803,21 +1940,56 @@ static void virtio_net_rsc_extract_unit4(VirtioNetRscChain *chain,
 
 static void virtio_net_rsc_extract_unit6(VirtioNetRscChain *chain,
                                          const uint8_t *buf,
-                                         VirtioNetRscUnit *unit)
+                                         VirtioNetRscUnit *unit,
+                                         uint16_t ext_len)
 {
     struct ip6_header *ip6;
 
     ip6 = (struct ip6_header *)(buf + chain->n->guest_hdr_len
                                  + sizeof(struct eth_header));
     unit->ip = ip6;
+    unit->ip_hdrlen = sizeof(struct ip6_header) + ext_len;
     unit->ip_plen = &(ip6->ip6_ctlun.ip6_un1.ip6_un1_plen);
     unit->tcp = (struct tcp_header *)(((uint8_t *)unit->ip)
-                                        + sizeof(struct ip6_header));
+                                        + unit->ip_hdrlen);
     unit->tcp_hdrlen = (htons(unit->tcp->th_offset_flags) & 0xF000) >> 10;
 
-    /* There is a difference between payload lenght in ipv4 and v6,
-       ip header is excluded in ipv6 */
-    unit->payload = htons(*unit->ip_plen) - unit->tcp_hdrlen;
+    /*
+     * There is a difference between payload length in ipv4 and v6,
+     * ip header is excluded in ipv6 but extension headers are not
+     */
+    unit->payload = htons(*unit->ip_plen) - ext_len - unit->tcp_hdrlen;
+}
+
+static void virtio_net_rsc_extract_flow(VirtioNetRscChain *chain,
+                                        const VirtioNetRscUnit *unit,
+                                        VirtioNetRscFlow *flow)
+{
+    memset(flow, 0, sizeof(*flow));
+    if (chain->proto == ETH_P_IP) {
+        struct ip_header *ip = unit->ip;
+
+        memcpy(flow->addr, &ip->ip_src, VIRTIO_NET_IP4_ADDR_SIZE);
+    } else {
+        struct ip6_header *ip6 = unit->ip;
+
+        memcpy(flow->addr, &ip6->ip6_src, VIRTIO_NET_IP6_ADDR_SIZE);
+    }
+    memcpy(&flow->ports, &unit->tcp->th_sport, sizeof(flow->ports));
+}
+
+static guint virtio_net_rsc_flow_hash(gconstpointer key)
+{
+    const VirtioNetRscFlow *flow = key;
+    uint64_t addr[4];
+
+    memcpy(addr, flow->addr, sizeof(addr));
+    return qemu_xxhash6(addr[0] ^ addr[2], addr[1] ^ addr[3], flow->ports, 0);
+}
+
+static gboolean virtio_net_rsc_flow_equal(gconstpointer a, gconstpointer b)
+{
+    return !memcmp(a, b, sizeof(VirtioNetRscFlow));
 }
 
 static size_t virtio_net_rsc_drain_seg(VirtioNetRscChain *chain,
@@ -1842,6 +2014,7 @@ static size_t virtio_net_rsc_drain_seg(VirtioNetRscChain *chain,
     }
 
     ret = virtio_net_do_receive(seg->nc, seg->buf, seg->size);
+    g_hash_table_remove(chain->flows, &seg->flow);
     QTAILQ_REMOVE(&chain->buffers, seg, next);
     g_free(seg->buf);
     g_free(seg);
@@ -1880,6 +2053,7 @@ static void virtio_net_rsc_cleanup(VirtIONet *n)
             g_free(seg);
         }
 
+        g_hash_table_destroy(chain->flows);
         timer_del(chain->drain_timer);
         timer_free(chain->drain_timer);
         QTAILQ_REMOVE(&n->rsc_chains, chain, next);
@@ -1889,10 +2063,13 @@ static void virtio_net_rsc_cleanup(VirtIONet *n)
 
 static void virtio_net_rsc_cache_buf(VirtioNetRscChain *chain,
                                      NetClientState *nc,
-                                     const uint8_t *buf, size_t size)
+                                     const uint8_t *buf, size_t size,
+                                     const VirtioNetRscUnit *unit,
+                                     const VirtioNetRscFlow *flow)
 {
     uint16_t hdr_len;
     VirtioNetRscSeg *seg;
+    uint8_t *ip;
 
     hdr_len = chain->n->guest_hdr_len;
     seg = g_malloc(sizeof(VirtioNetRscSeg));
@@ -1904,20 +2081,19 @@ static void virtio_net_rsc_cache_buf(VirtioNetRscChain *chain,
     seg->dup_ack = 0;
     seg->is_coalesced = 0;
     seg->nc = nc;
+    seg->flow = *flow;
+
+    /* Same layout as the packet, only rebase the pointers */
+    ip = (uint8_t *)seg->buf + ((const uint8_t *)unit->ip - buf);
+    seg->unit = *unit;
+    seg->unit.ip = ip;
+    seg->unit.ip_plen = (uint16_t *)(ip + ((uint8_t *)unit->ip_plen
+                                           - (uint8_t *)unit->ip));
+    seg->unit.tcp = (struct tcp_header *)(ip + unit->ip_hdrlen);
 
     QTAILQ_INSERT_TAIL(&chain->buffers, seg, next);
+    g_hash_table_insert(chain->flows, &seg->flow, seg);
     chain->stat.cache++;
-
-    switch (chain->proto) {
-    case ETH_P_IP:
-        virtio_net_rsc_extract_unit4(chain, seg->buf, &seg->unit);
-        break;
-    case ETH_P_IPV6:
-        virtio_net_rsc_extract_unit6(chain, seg->buf, &seg->unit);
-        break;
-    default:
-        g_assert_not_reached();
-    }
 }
 
 static int32_t virtio_net_rsc_handle_ack(VirtioNetRscChain *chain,
@@ -2021,43 +2197,22 @@ coalesce:
     }
 }
 
-static int32_t virtio_net_rsc_coalesce4(VirtioNetRscChain *chain,
-                                        VirtioNetRscSeg *seg,
-                                        const uint8_t *buf, size_t size,
-                                        VirtioNetRscUnit *unit)
-{
-    struct ip_header *ip1, *ip2;
-
-    ip1 = (struct ip_header *)(unit->ip);
-    ip2 = (struct ip_header *)(seg->unit.ip);
-    if ((ip1->ip_src ^ ip2->ip_src) || (ip1->ip_dst ^ ip2->ip_dst)
-        || (unit->tcp->th_sport ^ seg->unit.tcp->th_sport)
-        || (unit->tcp->th_dport ^ seg->unit.tcp->th_dport)) {
-        chain->stat.no_match++;
-        return RSC_NO_MATCH;
-    }
-
-    return virtio_net_rsc_coalesce_data(chain, seg, buf, unit);
-}
-
-static int32_t virtio_net_rsc_coalesce6(VirtioNetRscChain *chain,
-                                        VirtioNetRscSeg *seg,
-                                        const uint8_t *buf, size_t size,
-                                        VirtioNetRscUnit *unit)
+/*
+ * The hash lookup matched addresses and ports, ipv6 extensions must match
+ * too as only the first packet's headers are delivered to the guest
+ */
+static bool virtio_net_rsc_ext_match(VirtioNetRscChain *chain,
+                                     VirtioNetRscSeg *seg,
+                                     VirtioNetRscUnit *unit)
 {
-    struct ip6_header *ip1, *ip2;
-
-    ip1 = (struct ip6_header *)(unit->ip);
-    ip2 = (struct ip6_header *)(seg->unit.ip);
-    if (memcmp(&ip1->ip6_src, &ip2->ip6_src, sizeof(struct in6_address))
-        || memcmp(&ip1->ip6_dst, &ip2->ip6_dst, sizeof(struct in6_address))
-        || (unit->tcp->th_sport ^ seg->unit.tcp->th_sport)
-        || (unit->tcp->th_dport ^ seg->unit.tcp->th_dport)) {
-            chain->stat.no_match++;
-            return RSC_NO_MATCH;
+    if (chain->proto == ETH_P_IP) {
+        return true;
     }
 
-    return virtio_net_rsc_coalesce_data(chain, seg, buf, unit);
+    return unit->ip_hdrlen == seg->unit.ip_hdrlen &&
+           !memcmp((uint8_t *)unit->ip + sizeof(struct ip6_header),
+                   (uint8_t *)seg->unit.ip + sizeof(struct ip6_header),
+                   unit->ip_hdrlen - sizeof(struct ip6_header));
 }
 
 /* Packets with 'SYN' should bypass, other flag should be sent after drain
@@ -2095,43 +2250,50 @@ static size_t virtio_net_rsc_do_coalesce(VirtioNetRscChain *chain,
                                          VirtioNetRscUnit *unit)
 {
     int ret;
-    VirtioNetRscSeg *seg, *nseg;
-
-    if (QTAILQ_EMPTY(&chain->buffers)) {
-        chain->stat.empty_cache++;
-        virtio_net_rsc_cache_buf(chain, nc, buf, size);
-        timer_mod(chain->drain_timer,
-              qemu_clock_get_ns(QEMU_CLOCK_HOST) + chain->n->rsc_timeout);
-        return size;
-    }
-
-    QTAILQ_FOREACH_SAFE(seg, &chain->buffers, next, nseg) {
-        if (chain->proto == ETH_P_IP) {
-            ret = virtio_net_rsc_coalesce4(chain, seg, buf, size, unit);
+    VirtioNetRscSeg *seg;
+    VirtioNetRscFlow flow;
+
+    virtio_net_rsc_extract_flow(chain, unit, &flow);
+    seg = g_hash_table_lookup(chain->flows, &flow);
+    if (!seg) {
+        if (QTAILQ_EMPTY(&chain->buffers)) {
+            chain->stat.empty_cache++;
+            timer_mod(chain->drain_timer,
+                  qemu_clock_get_ns(QEMU_CLOCK_HOST) + chain->n->rsc_timeout);
         } else {
-            ret = virtio_net_rsc_coalesce6(chain, seg, buf, size, unit);
+            chain->stat.no_match_cache++;
+            if (g_hash_table_size(chain->flows) >= VIRTIO_NET_RSC_MAX_FLOWS) {
+                chain->stat.evicted++;
+                if (virtio_net_rsc_drain_seg(chain,
+                                             QTAILQ_FIRST(&chain->buffers))
+                    == 0) {
+                    chain->stat.drain_failed++;
+                }
+            }
         }
+        virtio_net_rsc_cache_buf(chain, nc, buf, size, unit, &flow);
+        return size;
+    }
 
-        if (ret == RSC_FINAL) {
-            if (virtio_net_rsc_drain_seg(chain, seg) == 0) {
-                /* Send failed */
-                chain->stat.final_failed++;
-                return 0;
-            }
+    if (!virtio_net_rsc_ext_match(chain, seg, unit)) {
+        ret = RSC_FINAL;
+    } else {
+        ret = virtio_net_rsc_coalesce_data(chain, seg, buf, unit);
+    }
 
-            /* Send current packet */
-            return virtio_net_do_receive(nc, buf, size);
-        } else if (ret == RSC_NO_MATCH) {
-            continue;
-        } else {
-            /* Coalesced, mark coalesced flag to tell calc cksum for ipv4 */
-            seg->is_coalesced = 1;
-            return size;
+    if (ret == RSC_FINAL) {
+        if (virtio_net_rsc_drain_seg(chain, seg) == 0) {
+            /* Send failed */
+            chain->stat.final_failed++;
+            return 0;
         }
+
+        /* Send current packet */
+        return virtio_net_do_receive(nc, buf, size);
     }
 
-    chain->stat.no_match_cache++;
-    virtio_net_rsc_cache_buf(chain, nc, buf, size);
+    /* Coalesced, mark coalesced flag to tell calc cksum for ipv4 */
+    seg->is_coalesced = 1;
     return size;
 }
 
@@ -2139,24 +2301,15 @@ static size_t virtio_net_rsc_do_coalesce(VirtioNetRscChain *chain,
 static size_t virtio_net_rsc_drain_flow(VirtioNetRscChain *chain,
                                         NetClientState *nc,
                                         const uint8_t *buf, size_t size,
-                                        uint16_t ip_start, uint16_t ip_size,
-                                        uint16_t tcp_port)
+                                        VirtioNetRscUnit *unit)
 {
-    VirtioNetRscSeg *seg, *nseg;
-    uint32_t ppair1, ppair2;
-
-    ppair1 = *(uint32_t *)(buf + tcp_port);
-    QTAILQ_FOREACH_SAFE(seg, &chain->buffers, next, nseg) {
-        ppair2 = *(uint32_t *)(seg->buf + tcp_port);
-        if (memcmp(buf + ip_start, seg->buf + ip_start, ip_size)
-            || (ppair1 != ppair2)) {
-            continue;
-        }
-        if (virtio_net_rsc_drain_seg(chain, seg) == 0) {
-            chain->stat.drain_failed++;
-        }
+    VirtioNetRscSeg *seg;
+    VirtioNetRscFlow flow;
 
-        break;
+    virtio_net_rsc_extract_flow(chain, unit, &flow);
+    seg = g_hash_table_lookup(chain->flows, &flow);
+    if (seg && virtio_net_rsc_drain_seg(chain, seg) == 0) {
+        chain->stat.drain_failed++;
     }
 
     return virtio_net_do_receive(nc, buf, size);
@@ -2234,10 +2387,7 @@ static size_t virtio_net_rsc_receive4(VirtioNetRscChain *chain,
     if (ret == RSC_BYPASS) {
         return virtio_net_do_receive(nc, buf, size);
     } else if (ret == RSC_FINAL) {
-        return virtio_net_rsc_drain_flow(chain, nc, buf, size,
-                ((hdr_len + sizeof(struct eth_header)) + 12),
-                VIRTIO_NET_IP4_ADDR_SIZE,
-                hdr_len + sizeof(struct eth_header) + sizeof(struct ip_header));
+        return virtio_net_rsc_drain_flow(chain, nc, buf, size, &unit);
     }
 
     return virtio_net_rsc_do_coalesce(chain, nc, buf, size, &unit);
@@ -2245,21 +2395,19 @@ static size_t virtio_net_rsc_receive4(VirtioNetRscChain *chain,
 
 static int32_t virtio_net_rsc_sanity_check6(VirtioNetRscChain *chain,
                                             struct ip6_header *ip6,
-                                            const uint8_t *buf, size_t size)
+                                            const uint8_t *buf, size_t size,
+                                            uint16_t *ext_len)
 {
     uint16_t ip_len;
+    uint8_t nxt;
+    const uint8_t *ext;
+    int i;
 
     if (((ip6->ip6_ctlun.ip6_un1.ip6_un1_flow & 0xF0) >> 4)
         != IP_HEADER_VERSION_6) {
         return RSC_BYPASS;
     }
 
-    /* Both option and protocol is checked in this */
-    if (ip6->ip6_ctlun.ip6_un1.ip6_un1_nxt != IPPROTO_TCP) {
-        chain->stat.bypass_not_tcp++;
-        return RSC_BYPASS;
-    }
-
     ip_len = htons(ip6->ip6_ctlun.ip6_un1.ip6_un1_plen);
     if (ip_len < sizeof(struct tcp_header) ||
         ip_len > (size - chain->n->guest_hdr_len - sizeof(struct eth_header)
@@ -2268,6 +2416,33 @@ static int32_t virtio_net_rsc_sanity_check6(VirtioNetRscChain *chain,
         return RSC_BYPASS;
     }
 
+    /* Skip the extension headers that don't prevent coalescing */
+    *ext_len = 0;
+    nxt = ip6->ip6_ctlun.ip6_un1.ip6_un1_nxt;
+    for (i = 0; nxt != IPPROTO_TCP; i++) {
+        if (nxt == IP6_FRAGMENT) {
+            chain->stat.ip_frag++;
+            return RSC_BYPASS;
+        }
+        if ((nxt != IP6_HOP_BY_HOP && nxt != IP6_ROUTING &&
+             nxt != IP6_DESTINATON) || i == VIRTIO_NET_RSC_MAX_IP6_EXT) {
+            chain->stat.bypass_not_tcp++;
+            return RSC_BYPASS;
+        }
+        if (*ext_len + 2 > ip_len) {
+            chain->stat.ip_hacked++;
+            return RSC_BYPASS;
+        }
+        ext = (const uint8_t *)(ip6 + 1) + *ext_len;
+        nxt = ext[0];
+        *ext_len += (ext[1] + 1) * 8;
+    }
+
+    if (ip_len < *ext_len + sizeof(struct tcp_header)) {
+        chain->stat.ip_hacked++;
+        return RSC_BYPASS;
+    }
+
     /* Don't handle packets with ecn flag */
     if (IP6_ECN(ip6->ip6_ctlun.ip6_un3.ip6_un3_ecn)) {
         chain->stat.ip_ecn++;
@@ -2282,8 +2457,10 @@ static size_t virtio_net_rsc_receive6(void *opq, NetClientState *nc,
 {
     int32_t ret;
     uint16_t hdr_len;
+    uint16_t ext_len;
     VirtioNetRscChain *chain;
     VirtioNetRscUnit unit;
+    struct ip6_header *ip6;
 
     chain = (VirtioNetRscChain *)opq;
     hdr_len = ((VirtIONet *)(chain->n))->guest_hdr_len;
@@ -2293,21 +2470,18 @@ static size_t virtio_net_rsc_receive6(void *opq, NetClientState *nc,
         return virtio_net_do_receive(nc, buf, size);
     }
 
-    virtio_net_rsc_extract_unit6(chain, buf, &unit);
-    if (RSC_CANDIDATE != virtio_net_rsc_sanity_check6(chain,
-                                                 unit.ip, buf, size)) {
+    ip6 = (struct ip6_header *)(buf + hdr_len + sizeof(struct eth_header));
+    if (RSC_CANDIDATE != virtio_net_rsc_sanity_check6(chain, ip6, buf, size,
+                                                      &ext_len)) {
         return virtio_net_do_receive(nc, buf, size);
     }
 
+    virtio_net_rsc_extract_unit6(chain, buf, &unit, ext_len);
     ret = virtio_net_rsc_tcp_ctrl_check(chain, unit.tcp);
     if (ret == RSC_BYPASS) {
         return virtio_net_do_receive(nc, buf, size);
     } else if (ret == RSC_FINAL) {
-        return virtio_net_rsc_drain_flow(chain, nc, buf, size,
-                ((hdr_len + sizeof(struct eth_header)) + 8),
-                VIRTIO_NET_IP6_ADDR_SIZE,
-                hdr_len + sizeof(struct eth_header)
-                + sizeof(struct ip6_header));
+        return virtio_net_rsc_drain_flow(chain, nc, buf, size, &unit);
     }
 
     return virtio_net_rsc_do_coalesce(chain, nc, buf, size, &unit);
@@ -2344,6 +2518,8 @@ static VirtioNetRscChain *virtio_net_rsc_lookup_chain(VirtIONet *n,
     memset(&chain->stat, 0, sizeof(chain->stat));
 
     QTAILQ_INIT(&chain->buffers);
+    chain->flows = g_hash_table_new(virtio_net_rsc_flow_hash,
+                                    virtio_net_rsc_flow_equal);
     QTAILQ_INSERT_TAIL(&n->rsc_chains, chain, next);
 
     return chain;
@@ -2378,6 +2554,46 @@ static ssize_t virtio_net_rsc_receive(NetClientState *nc,
     return virtio_net_do_receive(nc, buf, size);
 }
 
+static RscChainStats *virtio_net_rsc_chain_stats(VirtioNetRscChain *chain)
+{
+    VirtioNetRscStat *stat = &chain->stat;
+    RscChainStats *info = g_new0(RscChainStats, 1);
+
+    info->received = stat->received;
+    info->cached = stat->cache;
+    info->coalesced = stat->coalesced;
+    info->evicted = stat->evicted;
+    info->bypassed = stat->bypass_not_tcp + stat->tcp_syn + stat->ip_frag +
+                     stat->ip_ecn + stat->ip_hacked + stat->ip_option;
+    info->finalized = stat->over_size + stat->tcp_ctrl_drain +
+                      stat->tcp_all_opt + stat->dup_ack + stat->pure_ack +
+                      stat->ack_out_of_win + stat->data_out_of_win +
+                      stat->data_out_of_order;
+    info->timer_flushes = stat->timer;
+    info->delivery_failed = stat->purge_failed + stat->drain_failed +
+                            stat->final_failed;
+    return info;
+}
+
+static RscStatsInfo *virtio_net_query_rsc_stats(NetClientState *nc)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    RscStatsInfo *info = g_new0(RscStatsInfo, 1);
+    VirtioNetRscChain *chain;
+
+    info->name = g_strdup(nc->name);
+    QTAILQ_FOREACH(chain, &n->rsc_chains, next) {
+        if (chain->proto == ETH_P_IP) {
+            info->has_ipv4 = true;
+            info->ipv4 = virtio_net_rsc_chain_stats(chain);
+        } else {
+            info->has_ipv6 = true;
+            info->ipv6 = virtio_net_rsc_chain_stats(chain);
+        }
+    }
+    return info;
+}
+
 static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf,
                                   size_t size)
 {
@@ -2395,12 +2611,11 @@ static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
-    VirtIODevice *vdev = VIRTIO_DEVICE(n);
 
     virtqueue_push(q->tx_vq, q->async_tx.elem, 0);
-    virtio_notify(vdev, q->tx_vq);
+    virtio_net_notify(n, q->tx_vq);
 
-    g_free(q->async_tx.elem);
+    virtqueue_element_free(q->tx_vq, q->async_tx.elem);
     q->async_tx.elem = NULL;
 
     virtio_queue_set_notification(q->tx_vq, 1);
@@ -2440,7 +2655,7 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
         if (out_num < 1) {
             virtio_error(vdev, "virtio-net header not in first element");
             virtqueue_detach_element(q->tx_vq, elem, 0);
-            g_free(elem);
+            virtqueue_element_free(q->tx_vq, elem);
             return -EINVAL;
         }
 
@@ -2449,7 +2664,7 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
                 n->guest_hdr_len) {
                 virtio_error(vdev, "virtio-net header incorrect");
                 virtqueue_detach_element(q->tx_vq, elem, 0);
-                g_free(elem);
+                virtqueue_element_free(q->tx_vq, elem);
                 return -EINVAL;
             }
             if (n->needs_vnet_hdr_swap) {
@@ -2493,8 +2708,8 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 
 drop:
         virtqueue_push(q->tx_vq, elem, 0);
-        virtio_notify(vdev, q->tx_vq);
-        g_free(elem);
+        virtio_net_notify(n, q->tx_vq);
+        virtqueue_element_free(q->tx_vq, elem);
 
         if (++num_packets >= n->tx_burst) {
             break;
@@ -2503,6 +2718,11 @@ drop:
     return num_packets;
 }
 
+static void virtio_net_schedule_tx(VirtIONetQueue *q)
+{
+    qemu_bh_schedule(q->ctx ? q->dataplane_tx_bh : q->tx_bh);
+}
+
 static void virtio_net_handle_tx_timer(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
@@ -2553,7 +2773,7 @@ static void virtio_net_handle_tx_bh(VirtIODevice *vdev, VirtQueue *vq)
         return;
     }
     virtio_queue_set_notification(vq, 0);
-    qemu_bh_schedule(q->tx_bh);
+    virtio_net_schedule_tx(q);
 }
 
 static void virtio_net_tx_timer(void *opaque)
@@ -2609,7 +2829,7 @@ static void virtio_net_tx_bh(void *opaque)
     /* If we flush a full burst of packets, assume there are
      * more coming and immediately reschedule */
     if (ret >= n->tx_burst) {
-        qemu_bh_schedule(q->tx_bh);
+        virtio_net_schedule_tx(q);
         q->tx_waiting = 1;
         return;
     }
@@ -2623,11 +2843,179 @@ static void virtio_net_tx_bh(void *opaque)
         return;
     } else if (ret > 0) {
         virtio_queue_set_notification(q->tx_vq, 0);
-        qemu_bh_schedule(q->tx_bh);
+        virtio_net_schedule_tx(q);
         q->tx_waiting = 1;
     }
 }
 
+/*
+ * IOThread support
+ *
+ * While n->dataplane_started is set, the data queue pairs and their tap
+ * backends are only touched by the IOThread; everything in the main loop
+ * that changes the device state calls virtio_net_dataplane_stop() first.
+ */
+
+static bool virtio_net_dataplane_handle_rx(VirtIODevice *vdev, VirtQueue *vq)
+{
+    virtio_net_handle_rx(vdev, vq);
+    return true;
+}
+
+static bool virtio_net_dataplane_handle_tx(VirtIODevice *vdev, VirtQueue *vq)
+{
+    virtio_net_handle_tx_bh(vdev, vq);
+    return true;
+}
+
+static void virtio_net_dataplane_start(VirtIONet *n)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    BusState *qbus = qdev_get_parent_bus(DEVICE(vdev));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    AioContext *ctx = iothread_get_aio_context(n->net_conf.iothread);
+    int queues = n->multiqueue ? n->max_queues : 1;
+    int i, r;
+
+    if (n->rsc4_enabled || n->rsc6_enabled) {
+        warn_report_once("virtio-net: receive segment coalescing is not "
+                         "supported with iothread, using the main loop");
+        return;
+    }
+    for (i = 0; i < queues; i++) {
+        NetClientState *nc = qemu_get_subqueue(n->nic, i);
+
+        if (!QTAILQ_EMPTY(&nc->filters) ||
+            !QTAILQ_EMPTY(&nc->peer->filters)) {
+            warn_report_once("virtio-net: network filters are not "
+                             "supported with iothread, using the main loop");
+            return;
+        }
+    }
+
+    /* Take the host notifiers over from the main loop, like vhost does */
+    r = virtio_device_grab_ioeventfd(vdev);
+    if (r < 0) {
+        error_report("virtio-net: iothread requires ioeventfd, "
+                     "falling back on the main loop");
+        n->dataplane_disabled = true;
+        return;
+    }
+
+    r = k->set_guest_notifiers(qbus->parent, queues * 2, true);
+    if (r < 0) {
+        error_report("virtio-net: failed to set guest notifiers (%d), "
+                     "falling back on the main loop", r);
+        goto fail_guest_notifiers;
+    }
+
+    for (i = 0; i < queues * 2; i++) {
+        r = virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), i, true);
+        if (r < 0) {
+            error_report("virtio-net: failed to set host notifier (%d), "
+                         "falling back on the main loop", r);
+            while (i--) {
+                virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), i, false);
+                virtio_bus_cleanup_host_notifier(VIRTIO_BUS(qbus), i);
+            }
+            goto fail_host_notifiers;
+        }
+    }
+
+    n->dataplane_started = true;
+    trace_virtio_net_dataplane_start(n, queues);
+
+    for (i = 0; i < queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        q->ctx = ctx;
+        q->dataplane_tx_bh = aio_bh_new(ctx, virtio_net_tx_bh, q);
+        qemu_bh_cancel(q->tx_bh);
+        if (q->tx_waiting) {
+            qemu_bh_schedule(q->dataplane_tx_bh);
+        }
+        qemu_set_aio_context(qemu_get_subqueue(n->nic, i)->peer, ctx);
+
+        /* Kick right away to process buffers that are already in the rings */
+        event_notifier_set(virtio_queue_get_host_notifier(q->rx_vq));
+        event_notifier_set(virtio_queue_get_host_notifier(q->tx_vq));
+
+        aio_context_acquire(ctx);
+        virtio_queue_aio_set_host_notifier_handler(q->rx_vq, ctx,
+                virtio_net_dataplane_handle_rx);
+        virtio_queue_aio_set_host_notifier_handler(q->tx_vq, ctx,
+                virtio_net_dataplane_handle_tx);
+        aio_context_release(ctx);
+    }
+    return;
+
+fail_host_notifiers:
+    k->set_guest_notifiers(qbus->parent, queues * 2, false);
+fail_guest_notifiers:
+    virtio_device_release_ioeventfd(vdev);
+    n->dataplane_disabled = true;
+}
+
+/* Context: BH in the IOThread that owns the queue pair */
+static void virtio_net_dataplane_stop_bh(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+    VirtIONet *n = q->n;
+
+    virtio_queue_aio_set_host_notifier_handler(q->rx_vq, q->ctx, NULL);
+    virtio_queue_aio_set_host_notifier_handler(q->tx_vq, q->ctx, NULL);
+    qemu_set_aio_context(qemu_get_subqueue(n->nic, q - n->vqs)->peer, NULL);
+    qemu_bh_delete(q->dataplane_tx_bh);
+    q->dataplane_tx_bh = NULL;
+}
+
+/* Context: QEMU global mutex held */
+static void virtio_net_dataplane_stop(VirtIONet *n)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    BusState *qbus = qdev_get_parent_bus(DEVICE(vdev));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int queues = n->multiqueue ? n->max_queues : 1;
+    int i;
+
+    if (!n->dataplane_started) {
+        return;
+    }
+
+    trace_virtio_net_dataplane_stop(n);
+    for (i = 0; i < queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        aio_context_acquire(q->ctx);
+        aio_wait_bh_oneshot(q->ctx, virtio_net_dataplane_stop_bh, q);
+        aio_context_release(q->ctx);
+        q->ctx = NULL;
+
+        /* A transmission in progress carries on in the main loop */
+        if (q->tx_waiting) {
+            qemu_bh_schedule(q->tx_bh);
+        }
+    }
+
+    for (i = 0; i < queues * 2; i++) {
+        virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), i, false);
+        virtio_bus_cleanup_host_notifier(VIRTIO_BUS(qbus), i);
+    }
+    k->set_guest_notifiers(qbus->parent, queues * 2, false);
+
+    n->dataplane_started = false;
+    virtio_device_release_ioeventfd(vdev);
+}
+
+static void virtio_net_dataplane_status(VirtIONet *n, uint8_t status)
+{
+    if (n->net_conf.iothread && !n->dataplane_started &&
+        !n->dataplane_disabled && !n->vhost_started &&
+        virtio_net_started(n, status)) {
+        virtio_net_dataplane_start(n);
+    }
+}
+
 static void virtio_net_add_queue(VirtIONet *n, int index)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
@@ -2649,6 +3037,15 @@ static void virtio_net_add_queue(VirtIONet *n, int index)
         n->vqs[index].tx_bh = qemu_bh_new(virtio_net_tx_bh, &n->vqs[index]);
     }
 
+    /*
+     * Both queues are processed either under the BQL or, with an iothread,
+     * only in that IOThread while it runs them.
+     */
+    virtio_queue_enable_element_pool(n->vqs[index].rx_vq,
+                                     sizeof(VirtQueueElement));
+    virtio_queue_enable_element_pool(n->vqs[index].tx_vq,
+                                     sizeof(VirtQueueElement));
+
     n->vqs[index].tx_waiting = 0;
     n->vqs[index].n = n;
 }
@@ -2779,6 +3176,7 @@ static int virtio_net_post_load_device(void *opaque, int version_id)
         }
     }
 
+    virtio_net_commit_rss_config(n);
     if (n->rss_data.enabled) {
         trace_virtio_net_rss_enable(n->rss_data.hash_types,
                                     n->rss_data.indirections_len,
@@ -3045,6 +3443,18 @@ static const VMStateDescription vmstate_virtio_net_device = {
     }
 };
 
+static void virtio_net_receive_batch(NetClientState *nc, bool start)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+
+    q->rx_batch = start;
+    if (!start && q->rx_notify_pending) {
+        q->rx_notify_pending = false;
+        virtio_net_notify(n, q->rx_vq);
+    }
+}
+
 static NetClientInfo net_virtio_info = {
     .type = NET_CLIENT_DRIVER_NIC,
     .size = sizeof(NICState),
@@ -3052,7 +3462,9 @@ static NetClientInfo net_virtio_info = {
     .receive = virtio_net_receive,
     .link_status_changed = virtio_net_set_link_status,
     .query_rx_filter = virtio_net_query_rxfilter,
+    .query_rsc_stats = virtio_net_query_rsc_stats,
     .announce = virtio_net_announce,
+    .receive_batch = virtio_net_receive_batch,
 };
 
 static bool virtio_net_guest_notifier_pending(VirtIODevice *vdev, int idx)
@@ -3324,7 +3736,25 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
         return;
     }
 
-    n->max_queues = MAX(n->nic_conf.peers.queues, 1);
+    n->max_ncs = MAX(n->nic_conf.peers.queues, 1);
+
+    /*
+     * Only count the data queue pairs, the backend can provide the control
+     * virtqueue through an additional peer.
+     */
+    n->max_queues = 0;
+    for (i = 0; i < n->nic_conf.peers.queues; i++) {
+        if (n->nic_conf.peers.ncs[i]->is_datapath) {
+            n->max_queues++;
+        }
+    }
+    n->max_queues = MAX(n->max_queues, 1);
+    if (n->max_ncs - n->max_queues > 1) {
+        error_setg(errp, "Backend provides %d control virtqueues",
+                   n->max_ncs - n->max_queues);
+        virtio_cleanup(vdev);
+        return;
+    }
     if (n->max_queues * 2 + 1 > VIRTIO_QUEUE_MAX) {
         error_setg(errp, "Invalid number of queues (= %" PRIu32 "), "
                    "must be a positive integer less than %d.",
@@ -3332,6 +3762,29 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
         virtio_cleanup(vdev);
         return;
     }
+
+    if (n->net_conf.iothread) {
+        if (n->net_conf.tx && !strcmp(n->net_conf.tx, "timer")) {
+            error_setg(errp, "iothread is not supported with tx=timer");
+            virtio_cleanup(vdev);
+            return;
+        }
+        for (i = 0; i < n->max_queues; i++) {
+            NetClientState *peer = n->nic_conf.peers.ncs[i];
+
+            if (!qemu_can_set_aio_context(peer)) {
+                error_setg(errp, "iothread requires a tap netdev");
+                virtio_cleanup(vdev);
+                return;
+            }
+            if (get_vhost_net(peer)) {
+                error_setg(errp, "iothread is not supported with vhost");
+                virtio_cleanup(vdev);
+                return;
+            }
+        }
+    }
+
     n->vqs = g_malloc0(sizeof(VirtIONetQueue) * n->max_queues);
     n->curr_queues = 1;
     n->tx_timeout = n->net_conf.txtimer;
@@ -3405,6 +3858,10 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
     n->qdev = dev;
 
     net_rx_pkt_init(&n->rx_pkt, false);
+
+    if (virtio_has_feature(n->host_features, VIRTIO_NET_F_RSS)) {
+        virtio_net_load_ebpf(n);
+    }
 }
 
 static void virtio_net_device_unrealize(DeviceState *dev)
@@ -3416,6 +3873,8 @@ static void virtio_net_device_unrealize(DeviceState *dev)
     /* This will stop vhost backend if appropriate. */
     virtio_net_set_status(vdev, 0);
 
+    virtio_net_unload_ebpf(n);
+
     g_free(n->netclient_name);
     n->netclient_name = NULL;
     g_free(n->netclient_type);
@@ -3456,6 +3915,7 @@ static void virtio_net_instance_init(Object *obj)
      * Can be overriden with virtio_net_set_config_size.
      */
     n->config_size = sizeof(struct virtio_net_config);
+    ebpf_rss_init(&n->ebpf_rss);
     device_add_bootindex_property(obj, &n->nic_conf.bootindex,
                                   "bootindex", "/ethernet-phy@0",
                                   DEVICE(n));
@@ -3558,6 +4018,8 @@ static Property virtio_net_properties[] = {
                        TX_TIMER_INTERVAL),
     DEFINE_PROP_INT32("x-txburst", VirtIONet, net_conf.txburst, TX_BURST),
     DEFINE_PROP_STRING("tx", VirtIONet, net_conf.tx),
+    DEFINE_PROP_LINK("iothread", VirtIONet, net_conf.iothread, TYPE_IOTHREAD,
+                     IOThread *),
     DEFINE_PROP_UINT16("rx_queue_size", VirtIONet, net_conf.rx_queue_size,
                        VIRTIO_NET_RX_QUEUE_DEFAULT_SIZE),
     DEFINE_PROP_UINT16("tx_queue_size", VirtIONet, net_conf.tx_queue_size,
@@ -1613,51 +1613,10 @@ static inline bool check_lba_range(SCSIDiskState *s,
 
 typedef struct UnmapCBData {
     SCSIDiskReq *r;
-    uint8_t *inbuf;
-    int count;
+    BlkDiscardRange *ranges;
+    int nr_ranges;
 } UnmapCBData;
 
-static void scsi_unmap_complete(void *opaque, int ret);
-
-static void scsi_unmap_complete_noio(UnmapCBData *data, int ret)
-{
-    SCSIDiskReq *r = data->r;
-    SCSIDiskState *s = DO_UPCAST(SCSIDiskState, qdev, r->req.dev);
-
-    assert(r->req.aiocb == NULL);
-
-    if (data->count > 0) {
-        r->sector = ldq_be_p(&data->inbuf[0])
-            * (s->qdev.blocksize / BDRV_SECTOR_SIZE);
-        r->sector_count = (ldl_be_p(&data->inbuf[8]) & 0xffffffffULL)
-            * (s->qdev.blocksize / BDRV_SECTOR_SIZE);
-        if (!check_lba_range(s, r->sector, r->sector_count)) {
-            block_acct_invalid(blk_get_stats(s->qdev.conf.blk),
-                               BLOCK_ACCT_UNMAP);
-            scsi_check_condition(r, SENSE_CODE(LBA_OUT_OF_RANGE));
-            goto done;
-        }
-
-        block_acct_start(blk_get_stats(s->qdev.conf.blk), &r->acct,
-                         r->sector_count * BDRV_SECTOR_SIZE,
-                         BLOCK_ACCT_UNMAP);
-
-        r->req.aiocb = blk_aio_pdiscard(s->qdev.conf.blk,
-                                        r->sector * BDRV_SECTOR_SIZE,
-                                        r->sector_count * BDRV_SECTOR_SIZE,
-                                        scsi_unmap_complete, data);
-        data->count--;
-        data->inbuf += 16;
-        return;
-    }
-
-    scsi_req_complete(&r->req, GOOD);
-
-done:
-    scsi_req_unref(&r->req);
-    g_free(data);
-}
-
 static void scsi_unmap_complete(void *opaque, int ret)
 {
     UnmapCBData *data = opaque;
@@ -1668,22 +1627,36 @@ static void scsi_unmap_complete(void *opaque, int ret)
     r->req.aiocb = NULL;
 
     aio_context_acquire(blk_get_aio_context(s->qdev.conf.blk));
-    if (scsi_disk_req_check_error(r, ret, true)) {
-        scsi_req_unref(&r->req);
-        g_free(data);
-    } else {
+    if (!scsi_disk_req_check_error(r, ret, true)) {
         block_acct_done(blk_get_stats(s->qdev.conf.blk), &r->acct);
-        scsi_unmap_complete_noio(data, ret);
+        scsi_req_complete(&r->req, GOOD);
     }
+    scsi_req_unref(&r->req);
+    g_free(data->ranges);
+    g_free(data);
     aio_context_release(blk_get_aio_context(s->qdev.conf.blk));
 }
 
+static int scsi_unmap_range_compare(const void *a, const void *b)
+{
+    const BlkDiscardRange *range1 = a;
+    const BlkDiscardRange *range2 = b;
+
+    if (range1->offset != range2->offset) {
+        return range1->offset < range2->offset ? -1 : 1;
+    }
+    return 0;
+}
+
 static void scsi_disk_emulate_unmap(SCSIDiskReq *r, uint8_t *inbuf)
 {
     SCSIDiskState *s = DO_UPCAST(SCSIDiskState, qdev, r->req.dev);
     uint8_t *p = inbuf;
     int len = r->req.cmd.xfer;
     UnmapCBData *data;
+    BlkDiscardRange *ranges;
+    int64_t total_bytes = 0;
+    int count, nr_ranges, i;
 
     /* Reject ANCHOR=1.  */
     if (r->req.cmd.buf[1] & 0x1) {
@@ -1709,14 +1682,74 @@ static void scsi_disk_emulate_unmap(SCSIDiskReq *r, uint8_t *inbuf)
         return;
     }
 
+    /*
+     * Check all the descriptors before discarding anything, then submit
+     * them in LBA order with contiguous and overlapping ones coalesced.
+     */
+    count = lduw_be_p(&p[2]) >> 4;
+    ranges = g_new(BlkDiscardRange, MAX(count, 1));
+    nr_ranges = 0;
+    for (i = 0; i < count; i++) {
+        uint8_t *desc = &p[8 + i * 16];
+        uint64_t sector_num = ldq_be_p(&desc[0])
+            * (s->qdev.blocksize / BDRV_SECTOR_SIZE);
+        uint64_t nb_sectors = (ldl_be_p(&desc[8]) & 0xffffffffULL)
+            * (s->qdev.blocksize / BDRV_SECTOR_SIZE);
+
+        if (!check_lba_range(s, sector_num, nb_sectors)) {
+            g_free(ranges);
+            block_acct_invalid(blk_get_stats(s->qdev.conf.blk),
+                               BLOCK_ACCT_UNMAP);
+            scsi_check_condition(r, SENSE_CODE(LBA_OUT_OF_RANGE));
+            return;
+        }
+        if (!nb_sectors) {
+            continue;
+        }
+
+        ranges[nr_ranges++] = (BlkDiscardRange) {
+            .offset = sector_num * BDRV_SECTOR_SIZE,
+            .bytes  = nb_sectors * BDRV_SECTOR_SIZE,
+        };
+    }
+
+    qsort(ranges, nr_ranges, sizeof(ranges[0]), scsi_unmap_range_compare);
+    count = nr_ranges;
+    nr_ranges = 0;
+    for (i = 0; i < count; i++) {
+        BlkDiscardRange *last = nr_ranges ? &ranges[nr_ranges - 1] : NULL;
+
+        if (last && ranges[i].offset <= last->offset + last->bytes) {
+            last->bytes = MAX(last->bytes, ranges[i].offset + ranges[i].bytes
+                                           - last->offset);
+        } else {
+            ranges[nr_ranges++] = ranges[i];
+        }
+    }
+
+    if (!nr_ranges) {
+        g_free(ranges);
+        scsi_req_complete(&r->req, GOOD);
+        return;
+    }
+
+    for (i = 0; i < nr_ranges; i++) {
+        total_bytes += ranges[i].bytes;
+    }
+    trace_scsi_disk_emulate_unmap(count, nr_ranges, total_bytes);
+
     data = g_new0(UnmapCBData, 1);
     data->r = r;
-    data->inbuf = &p[8];
-    data->count = lduw_be_p(&p[2]) >> 4;
+    data->ranges = ranges;
+    data->nr_ranges = nr_ranges;
 
     /* The matching unref is in scsi_unmap_complete, before data is freed.  */
     scsi_req_ref(&r->req);
-    scsi_unmap_complete_noio(data, 0);
+    block_acct_start(blk_get_stats(s->qdev.conf.blk), &r->acct,
+                     total_bytes, BLOCK_ACCT_UNMAP);
+    r->req.aiocb = blk_aio_pdiscard_ranges(s->qdev.conf.blk, ranges,
+                                           nr_ranges, scsi_unmap_complete,
+                                           data);
     return;
 
 invalid_param_len:
@@ -21,6 +21,46 @@
 #include "hw/virtio/virtio-bus.h"
 #include "hw/virtio/virtio-access.h"
 
+static void virtio_scsi_notify_guest_bh(void *opaque)
+{
+    VirtIOSCSI *s = opaque;
+    VirtIOSCSICommon *vs = VIRTIO_SCSI_COMMON(s);
+    VirtIODevice *vdev = VIRTIO_DEVICE(s);
+    unsigned nvqs = vs->conf.num_queues + 2;
+    unsigned long bitmap[BITS_TO_LONGS(nvqs)];
+    unsigned j;
+
+    memcpy(bitmap, s->batch_notify_vqs, sizeof(bitmap));
+    memset(s->batch_notify_vqs, 0, sizeof(bitmap));
+
+    for (j = 0; j < nvqs; j += BITS_PER_LONG) {
+        unsigned long bits = bitmap[j / BITS_PER_LONG];
+
+        while (bits != 0) {
+            unsigned i = j + ctzl(bits);
+
+            virtio_notify_irqfd(vdev, virtio_get_queue(vdev, i));
+
+            bits &= bits - 1; /* clear right-most bit */
+        }
+    }
+}
+
+/*
+ * Raise an interrupt to signal guest, if necessary.  Without event index
+ * the guest can't suppress interrupts itself, so the requests completed
+ * in one go are signalled with a single interrupt per virtqueue.
+ */
+void virtio_scsi_dataplane_notify(VirtIOSCSI *s, VirtQueue *vq)
+{
+    if (s->batch_notifications) {
+        set_bit(virtio_get_queue_index(vq), s->batch_notify_vqs);
+        qemu_bh_schedule(s->notify_bh);
+    } else {
+        virtio_notify_irqfd((VirtIODevice *)s, vq);
+    }
+}
+
 /* Context: QEMU global mutex held */
 void virtio_scsi_dataplane_setup(VirtIOSCSI *s, Error **errp)
 {
@@ -47,6 +87,20 @@ void virtio_scsi_dataplane_setup(VirtIOSCSI *s, Error **errp)
         }
         s->ctx = qemu_get_aio_context();
     }
+
+    s->notify_bh = aio_bh_new(s->ctx, virtio_scsi_notify_guest_bh, s);
+    s->batch_notify_vqs = bitmap_new(vs->conf.num_queues + 2);
+}
+
+/* Context: QEMU global mutex held */
+void virtio_scsi_dataplane_cleanup(VirtIOSCSI *s)
+{
+    if (s->notify_bh) {
+        qemu_bh_delete(s->notify_bh);
+        s->notify_bh = NULL;
+    }
+    g_free(s->batch_notify_vqs);
+    s->batch_notify_vqs = NULL;
 }
 
 static bool virtio_scsi_data_plane_handle_cmd(VirtIODevice *vdev,
@@ -139,6 +193,9 @@ int virtio_scsi_dataplane_start(VirtIODevice *vdev)
 
     s->dataplane_starting = true;
 
+    s->batch_notifications = !virtio_vdev_has_feature(vdev,
+                                                      VIRTIO_RING_F_EVENT_IDX);
+
     /* Set up guest notifier (irq) */
     rc = k->set_guest_notifiers(qbus->parent, vs->conf.num_queues + 2, true);
     if (rc != 0) {
@@ -218,6 +275,9 @@ void virtio_scsi_dataplane_stop(VirtIODevice *vdev)
         virtio_bus_cleanup_host_notifier(VIRTIO_BUS(qbus), i);
     }
 
+    qemu_bh_cancel(s->notify_bh);
+    virtio_scsi_notify_guest_bh(s); /* final chance to notify guest */
+
     /* Clean up guest notifier (irq) */
     k->set_guest_notifiers(qbus->parent, vs->conf.num_queues + 2, false);
     s->dataplane_stopping = false;
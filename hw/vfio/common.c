@@ -31,11 +31,14 @@
 #include "exec/memory.h"
 #include "exec/ram_addr.h"
 #include "hw/hw.h"
+#include "hw/boards.h"
 #include "qemu/error-report.h"
 #include "qemu/main-loop.h"
 #include "qemu/range.h"
 #include "sysemu/kvm.h"
 #include "sysemu/reset.h"
+#include "sysemu/runstate.h"
+#include "qemu/units.h"
 #include "trace.h"
 #include "qapi/error.h"
 #include "migration/migration.h"
@@ -539,6 +542,37 @@ static int vfio_host_win_del(VFIOContainer *container, hwaddr min_iova,
     return -1;
 }
 
+/*
+ * Pinning faults in the pages that the guest never touched one at a time,
+ * while the kernel holds the container lock.  When guest RAM is first
+ * mapped at startup, fault in large sections from several threads
+ * beforehand, so that VFIO_IOMMU_MAP_DMA only has to pin them.  Every page
+ * is written back with its own value, so this is only done while nothing
+ * else can be writing to guest RAM.
+ */
+#define VFIO_PREFAULT_MIN_SIZE (1 * GiB)
+
+static void vfio_prefault_ram(VFIOContainer *container,
+                              MemoryRegionSection *section,
+                              void *vaddr, ram_addr_t size)
+{
+    Error *local_err = NULL;
+
+    if (container->initialized || runstate_is_running() ||
+        size < VFIO_PREFAULT_MIN_SIZE || section->readonly ||
+        memory_region_is_nonvolatile(section->mr)) {
+        return;
+    }
+
+    trace_vfio_prefault_ram(vaddr, size, current_machine->smp.cpus);
+    os_mem_prealloc(memory_region_get_fd(section->mr), vaddr, size,
+                    current_machine->smp.cpus, &local_err);
+    if (local_err) {
+        /* Not fatal, the pinning reports the lack of memory if it matters */
+        warn_report_err(local_err);
+    }
+}
+
 static bool vfio_listener_skipped_section(MemoryRegionSection *section)
 {
     return (!memory_region_is_ram(section->mr) &&
@@ -833,6 +867,8 @@ static void vfio_listener_region_add(MemoryListener *listener,
                 pgmask + 1);
             return;
         }
+    } else {
+        vfio_prefault_ram(container, section, vaddr, int128_get64(llsize));
     }
 
     ret = vfio_dma_map(container, iova, int128_get64(llsize),
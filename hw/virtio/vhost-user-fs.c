@@ -21,6 +21,186 @@
 #include "qemu/error-report.h"
 #include "hw/virtio/vhost-user-fs.h"
 #include "monitor/monitor.h"
+#include "trace.h"
+
+/*
+ * Pages of the DAX window that have no file mapped are backed by an
+ * inaccessible anonymous mapping, so that the window always reserves
+ * its whole range of the address space.
+ */
+static int vuf_reset_cache_range(VHostUserFS *fs, uint64_t offset,
+                                 uint64_t len)
+{
+    void *ptr = mmap(fs->cache_ptr + offset, len, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+
+    if (ptr == MAP_FAILED) {
+        return -errno;
+    }
+    return 0;
+}
+
+static bool vuf_check_cache_range(VHostUserFS *fs, uint64_t offset,
+                                  uint64_t len)
+{
+    return QEMU_IS_ALIGNED(offset | len, qemu_real_host_page_size) &&
+           offset < fs->conf.cache_size &&
+           len <= fs->conf.cache_size - offset;
+}
+
+static VHostUserFS *vuf_from_vhost_dev(struct vhost_dev *dev)
+{
+    VHostUserFS *fs;
+
+    if (!dev->vdev) {
+        error_report("vhost-user-fs: slave request on a stopped device");
+        return NULL;
+    }
+
+    fs = (VHostUserFS *)object_dynamic_cast(OBJECT(dev->vdev),
+                                            TYPE_VHOST_USER_FS);
+    if (!fs) {
+        error_report("vhost-user-fs: slave request for another device type");
+        return NULL;
+    }
+
+    if (!fs->cache_ptr) {
+        error_report("vhost-user-fs: slave request but no cache-size set");
+        return NULL;
+    }
+    return fs;
+}
+
+int vhost_user_fs_slave_map(struct vhost_dev *dev, VhostUserFSSlaveMsg *sm,
+                            int fd)
+{
+    VHostUserFS *fs = vuf_from_vhost_dev(dev);
+    int ret = 0;
+    int i;
+
+    if (!fs) {
+        return -EINVAL;
+    }
+
+    if (fd < 0) {
+        error_report("vhost-user-fs: map request without a file descriptor");
+        return -EINVAL;
+    }
+
+    for (i = 0; i < VHOST_USER_FS_SLAVE_ENTRIES; i++) {
+        int prot = 0;
+        void *ptr;
+
+        if (sm->len[i] == 0) {
+            continue;
+        }
+
+        if (!vuf_check_cache_range(fs, sm->c_offset[i], sm->len[i])) {
+            error_report("vhost-user-fs: bad map range 0x%" PRIx64
+                         "+0x%" PRIx64, sm->c_offset[i], sm->len[i]);
+            ret = -EINVAL;
+            break;
+        }
+
+        if (sm->flags[i] & VHOST_USER_FS_FLAG_MAP_R) {
+            prot |= PROT_READ;
+        }
+        if (sm->flags[i] & VHOST_USER_FS_FLAG_MAP_W) {
+            prot |= PROT_WRITE;
+        }
+
+        trace_vhost_user_fs_slave_map(sm->c_offset[i], sm->len[i],
+                                      sm->fd_offset[i], sm->flags[i]);
+        ptr = mmap(fs->cache_ptr + sm->c_offset[i], sm->len[i], prot,
+                   MAP_SHARED | MAP_FIXED, fd, sm->fd_offset[i]);
+        if (ptr == MAP_FAILED) {
+            ret = -errno;
+            error_report("vhost-user-fs: map failed: %s", strerror(-ret));
+            break;
+        }
+    }
+
+    if (ret < 0) {
+        /* Do not leave a partial mapping behind */
+        while (--i >= 0) {
+            if (sm->len[i]) {
+                vuf_reset_cache_range(fs, sm->c_offset[i], sm->len[i]);
+            }
+        }
+    }
+    return ret;
+}
+
+int vhost_user_fs_slave_unmap(struct vhost_dev *dev, VhostUserFSSlaveMsg *sm)
+{
+    VHostUserFS *fs = vuf_from_vhost_dev(dev);
+    int ret = 0;
+    int i;
+
+    if (!fs) {
+        return -EINVAL;
+    }
+
+    for (i = 0; i < VHOST_USER_FS_SLAVE_ENTRIES; i++) {
+        uint64_t offset = sm->c_offset[i];
+        uint64_t len = sm->len[i];
+        int r;
+
+        if (len == 0) {
+            continue;
+        }
+
+        /* A length of ~0 stands for the whole cache */
+        if (len == ~(uint64_t)0) {
+            offset = 0;
+            len = fs->conf.cache_size;
+        } else if (!vuf_check_cache_range(fs, offset, len)) {
+            error_report("vhost-user-fs: bad unmap range 0x%" PRIx64
+                         "+0x%" PRIx64, offset, len);
+            ret = -EINVAL;
+            continue;
+        }
+
+        trace_vhost_user_fs_slave_unmap(offset, len);
+        r = vuf_reset_cache_range(fs, offset, len);
+        if (r < 0) {
+            error_report("vhost-user-fs: unmap failed: %s", strerror(-r));
+            ret = r;
+        }
+    }
+    return ret;
+}
+
+int vhost_user_fs_slave_sync(struct vhost_dev *dev, VhostUserFSSlaveMsg *sm)
+{
+    VHostUserFS *fs = vuf_from_vhost_dev(dev);
+    int ret = 0;
+    int i;
+
+    if (!fs) {
+        return -EINVAL;
+    }
+
+    for (i = 0; i < VHOST_USER_FS_SLAVE_ENTRIES; i++) {
+        if (sm->len[i] == 0) {
+            continue;
+        }
+
+        if (!vuf_check_cache_range(fs, sm->c_offset[i], sm->len[i])) {
+            error_report("vhost-user-fs: bad sync range 0x%" PRIx64
+                         "+0x%" PRIx64, sm->c_offset[i], sm->len[i]);
+            ret = -EINVAL;
+            continue;
+        }
+
+        trace_vhost_user_fs_slave_sync(sm->c_offset[i], sm->len[i]);
+        if (msync(fs->cache_ptr + sm->c_offset[i], sm->len[i], MS_SYNC)) {
+            ret = -errno;
+            error_report("vhost-user-fs: sync failed: %s", strerror(-ret));
+        }
+    }
+    return ret;
+}
 
 static void vuf_get_config(VirtIODevice *vdev, uint8_t *config)
 {
@@ -201,6 +381,29 @@ static void vuf_device_realize(DeviceState *dev, Error **errp)
         return;
     }
 
+    if (fs->conf.cache_size &&
+        (!is_power_of_2(fs->conf.cache_size) ||
+         fs->conf.cache_size < qemu_real_host_page_size)) {
+        error_setg(errp, "cache-size property must be a power of 2 "
+                   "no smaller than the page size");
+        return;
+    }
+
+    if (fs->conf.cache_size) {
+        /* Anonymous, private to begin with, file mappings are added later */
+        fs->cache_ptr = mmap(NULL, fs->conf.cache_size, PROT_NONE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (fs->cache_ptr == MAP_FAILED) {
+            error_setg_errno(errp, errno, "Unable to mmap blank cache");
+            fs->cache_ptr = NULL;
+            return;
+        }
+
+        memory_region_init_ram_ptr(&fs->cache, OBJECT(vdev),
+                                   "virtio-fs-cache", fs->conf.cache_size,
+                                   fs->cache_ptr);
+    }
+
     if (!vhost_user_init(&fs->vhost_user, &fs->conf.chardev, errp)) {
         return;
     }
@@ -250,6 +453,15 @@ static void vuf_device_unrealize(DeviceState *dev)
     /* This will stop vhost backend if appropriate. */
     vuf_set_status(vdev, 0);
 
+    /*
+     * The transport may still expose the window until it is unrealized
+     * too, so only drop the file mappings here; the reservation itself
+     * goes away in vuf_instance_finalize().
+     */
+    if (fs->cache_ptr) {
+        vuf_reset_cache_range(fs, 0, fs->conf.cache_size);
+    }
+
     vhost_dev_cleanup(&fs->vhost_dev);
 
     vhost_user_cleanup(&fs->vhost_user);
@@ -275,9 +487,20 @@ static Property vuf_properties[] = {
     DEFINE_PROP_UINT16("num-request-queues", VHostUserFS,
                        conf.num_request_queues, 1),
     DEFINE_PROP_UINT16("queue-size", VHostUserFS, conf.queue_size, 128),
+    DEFINE_PROP_SIZE("cache-size", VHostUserFS, conf.cache_size, 0),
     DEFINE_PROP_END_OF_LIST(),
 };
 
+static void vuf_instance_finalize(Object *obj)
+{
+    VHostUserFS *fs = VHOST_USER_FS(obj);
+
+    if (fs->cache_ptr) {
+        munmap(fs->cache_ptr, fs->conf.cache_size);
+        fs->cache_ptr = NULL;
+    }
+}
+
 static void vuf_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
@@ -299,6 +522,7 @@ static const TypeInfo vuf_info = {
     .name = TYPE_VHOST_USER_FS,
     .parent = TYPE_VIRTIO_DEVICE,
     .instance_size = sizeof(VHostUserFS),
+    .instance_finalize = vuf_instance_finalize,
     .class_init = vuf_class_init,
 };
 
@@ -17,6 +17,7 @@
 #include "qapi/error.h"
 #include "hw/virtio/vhost.h"
 #include "qemu/atomic.h"
+#include "qemu/cutils.h"
 #include "qemu/range.h"
 #include "qemu/error-report.h"
 #include "qemu/memfd.h"
@@ -42,6 +43,13 @@
     do { } while (0)
 #endif
 
+/*
+ * Chunks of the log tested for zero at once, so that clean areas are
+ * skipped with buffer_is_zero(); with 64-bit chunks a block covers
+ * 16 MiB of guest memory.
+ */
+#define VHOST_LOG_SKIP_CHUNKS 64
+
 static struct vhost_log *vhost_log;
 static struct vhost_log *vhost_log_shm;
 
@@ -80,11 +88,21 @@ static void vhost_dev_sync_region(struct vhost_dev *dev,
     assert(end / VHOST_LOG_CHUNK < dev->log_size);
     assert(start / VHOST_LOG_CHUNK < dev->log_size);
 
-    for (;from < to; ++from) {
+    while (from < to) {
         vhost_log_chunk_t log;
+        int bit, nbits;
+
+        /* Most of the log is clean, skip it a block at a time */
+        if (to - from >= VHOST_LOG_SKIP_CHUNKS &&
+            buffer_is_zero(from, VHOST_LOG_SKIP_CHUNKS * sizeof(*from))) {
+            from += VHOST_LOG_SKIP_CHUNKS;
+            addr += VHOST_LOG_SKIP_CHUNKS * VHOST_LOG_CHUNK;
+            continue;
+        }
         /* We first check with non-atomic: much cheaper,
          * and we expect non-dirty to be the common case. */
         if (!*from) {
+            from++;
             addr += VHOST_LOG_CHUNK;
             continue;
         }
@@ -92,16 +110,24 @@ static void vhost_dev_sync_region(struct vhost_dev *dev,
          * but it's easier to use atomic_* than roll our own. */
         log = qatomic_xchg(from, 0);
         while (log) {
-            int bit = ctzl(log);
             hwaddr page_addr;
             hwaddr section_offset;
             hwaddr mr_offset;
+
+            /* Mark each run of dirty pages at once */
+            bit = ctzl(log);
+            nbits = ctol(log >> bit);
             page_addr = addr + bit * VHOST_LOG_PAGE;
             section_offset = page_addr - section->offset_within_address_space;
             mr_offset = section_offset + section->offset_within_region;
-            memory_region_set_dirty(section->mr, mr_offset, VHOST_LOG_PAGE);
-            log &= ~(0x1ull << bit);
+            memory_region_set_dirty(section->mr, mr_offset,
+                                    nbits * VHOST_LOG_PAGE);
+            if (bit + nbits == VHOST_LOG_BITS) {
+                break;
+            }
+            log &= ~0UL << (bit + nbits);
         }
+        from++;
         addr += VHOST_LOG_CHUNK;
     }
 }
@@ -17,10 +17,13 @@
 #include "qemu/iov.h"
 #include "qemu/module.h"
 #include "qemu/timer.h"
+#include "qemu/main-loop.h"
+#include "qemu/rcu.h"
 #include "hw/virtio/virtio.h"
 #include "hw/mem/pc-dimm.h"
 #include "hw/qdev-properties.h"
 #include "sysemu/balloon.h"
+#include "sysemu/runstate.h"
 #include "hw/virtio/virtio-balloon.h"
 #include "exec/address-spaces.h"
 #include "qapi/error.h"
@@ -320,14 +323,148 @@ static void balloon_stats_set_poll_interval(Object *obj, Visitor *v,
     balloon_stats_change_timer(s, 0);
 }
 
+/* Host memory that a batch of free page reports lets us discard */
+typedef struct BalloonReportRange {
+    void *host;
+    size_t size;
+} BalloonReportRange;
+
+/* Contiguous reported memory within one RAMBlock, in RAMBlock offsets */
+typedef struct BalloonReportRun {
+    RAMBlock *rb;
+    ram_addr_t start;
+    ram_addr_t end;
+} BalloonReportRun;
+
+/*
+ * The guest reports memory in units of its own pages, but discarding only
+ * has an effect on whole host pages, which are huge with hugetlbfs.  Queue
+ * the host pages that @run covers completely, now that it can't grow.
+ */
+static void virtio_balloon_report_queue_run(VirtIOBalloon *dev,
+                                            BalloonReportRun *run)
+{
+    BalloonReportRange range;
+    ram_addr_t start, end;
+    size_t page_size;
+
+    if (!run->rb) {
+        return;
+    }
+
+    page_size = qemu_ram_pagesize(run->rb);
+    start = QEMU_ALIGN_UP(run->start, page_size);
+    end = QEMU_ALIGN_DOWN(run->end, page_size);
+    if (start < end) {
+        range.host = qemu_ram_get_host_addr(run->rb) + start;
+        range.size = end - start;
+        g_array_append_val(dev->report_ranges, range);
+    }
+    run->rb = NULL;
+}
+
+static void virtio_balloon_report_discard(VirtIOBalloon *dev)
+{
+    guint i;
+
+    RCU_READ_LOCK_GUARD();
+    for (i = 0; i < dev->report_ranges->len; i++) {
+        BalloonReportRange *range = &g_array_index(dev->report_ranges,
+                                                   BalloonReportRange, i);
+        ram_addr_t offset;
+        RAMBlock *rb;
+
+        /* The memory might have been unplugged since the batch was built */
+        rb = qemu_ram_block_from_host(range->host, false, &offset);
+        if (rb) {
+            ram_block_discard_range(rb, offset, range->size);
+        }
+    }
+}
+
+/* What happens to the reports of a batch once they are discarded */
+typedef enum BalloonReportAction {
+    /* Give them back to the guest */
+    BALLOON_REPORT_RESPOND,
+    /* Drop them, because the queue is reset */
+    BALLOON_REPORT_DROP,
+    /* Put them back into the queue, to be handled again */
+    BALLOON_REPORT_REQUEUE,
+} BalloonReportAction;
+
+static void virtio_balloon_report_complete(VirtIOBalloon *dev,
+                                           BalloonReportAction action)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(dev);
+    guint i;
+
+    for (i = 0; i < dev->report_elems->len; i++) {
+        VirtQueueElement *elem = g_ptr_array_index(dev->report_elems, i);
+
+        switch (action) {
+        case BALLOON_REPORT_RESPOND:
+            virtqueue_push(dev->reporting_vq, elem, 0);
+            break;
+        case BALLOON_REPORT_DROP:
+            virtqueue_detach_element(dev->reporting_vq, elem, 0);
+            break;
+        case BALLOON_REPORT_REQUEUE:
+            /* No report is popped while a batch is in flight */
+            virtqueue_unpop(dev->reporting_vq, elem, 0);
+            break;
+        }
+        g_free(elem);
+    }
+    if (action == BALLOON_REPORT_RESPOND && dev->report_elems->len) {
+        virtio_notify(vdev, dev->reporting_vq);
+    }
+    g_ptr_array_set_size(dev->report_elems, 0);
+    g_array_set_size(dev->report_ranges, 0);
+}
+
+/* Runs in the iothread */
+static void virtio_balloon_report_discard_bh(void *opaque)
+{
+    VirtIOBalloon *dev = opaque;
+
+    virtio_balloon_report_discard(dev);
+    qemu_bh_schedule(dev->report_done_bh);
+    qemu_event_set(&dev->report_done);
+}
+
+/* Wait for the discards in the iothread and complete the batch */
+static void virtio_balloon_report_flush(VirtIOBalloon *dev,
+                                        BalloonReportAction action)
+{
+    if (dev->report_in_flight) {
+        qemu_event_wait(&dev->report_done);
+        qemu_bh_cancel(dev->report_done_bh);
+        dev->report_in_flight = false;
+        virtio_balloon_report_complete(dev, action);
+    }
+}
+
 static void virtio_balloon_handle_report(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIOBalloon *dev = VIRTIO_BALLOON(vdev);
+    BalloonReportRun run = { .rb = NULL };
     VirtQueueElement *elem;
 
+    if (dev->report_in_flight) {
+        /* report_done_bh comes back here */
+        return;
+    }
+
+    /*
+     * Collect all pending reports first, so that memory reported in pieces
+     * can be discarded in as few calls as possible.  None of it can be
+     * handed back to the guest before it was discarded.
+     */
     while ((elem = virtqueue_pop(vq, sizeof(VirtQueueElement)))) {
         unsigned int i;
 
+        g_ptr_array_add(dev->report_elems, elem);
+
         /*
          * When we discard the page it has the effect of removing the page
          * from the hypervisor itself and causing it to be zeroed when it
@@ -336,7 +473,7 @@ static void virtio_balloon_handle_report(VirtIODevice *vdev, VirtQueue *vq)
          * expecting it to retain a non-zero value.
          */
         if (virtio_balloon_inhibited() || dev->poison_val) {
-            goto skip_element;
+            continue;
         }
 
         for (i = 0; i < elem->in_num; i++) {
@@ -362,22 +499,56 @@ static void virtio_balloon_handle_report(VirtIODevice *vdev, VirtQueue *vq)
                 continue;
             }
 
-            /*
-             * For now we will simply ignore unaligned memory regions, or
-             * regions that overrun the end of the RAMBlock.
-             */
-            if (!QEMU_IS_ALIGNED(ram_offset | size, qemu_ram_pagesize(rb)) ||
-                (ram_offset + size) > qemu_ram_get_used_length(rb)) {
+            /* Ignore regions that overrun the end of the RAMBlock. */
+            if ((ram_offset + size) > qemu_ram_get_used_length(rb)) {
                 continue;
             }
 
-            ram_block_discard_range(rb, ram_offset, size);
+            if (rb != run.rb || ram_offset != run.end) {
+                virtio_balloon_report_queue_run(dev, &run);
+                run.rb = rb;
+                run.start = ram_offset;
+            }
+            run.end = ram_offset + size;
         }
+    }
+    virtio_balloon_report_queue_run(dev, &run);
+
+    trace_virtio_balloon_report(dev->report_elems->len,
+                                dev->report_ranges->len);
+    if (dev->report_ranges->len && dev->iothread) {
+        dev->report_in_flight = true;
+        qemu_event_reset(&dev->report_done);
+        aio_bh_schedule_oneshot(iothread_get_aio_context(dev->iothread),
+                                virtio_balloon_report_discard_bh, dev);
+        return;
+    }
 
-skip_element:
-        virtqueue_push(vq, elem, 0);
-        virtio_notify(vdev, vq);
-        g_free(elem);
+    virtio_balloon_report_discard(dev);
+    virtio_balloon_report_complete(dev, BALLOON_REPORT_RESPOND);
+}
+
+static void virtio_balloon_report_done_bh(void *opaque)
+{
+    VirtIOBalloon *dev = opaque;
+
+    virtio_balloon_report_flush(dev, BALLOON_REPORT_RESPOND);
+    /* Process the reports that were queued meanwhile */
+    virtio_balloon_handle_report(VIRTIO_DEVICE(dev), dev->reporting_vq);
+}
+
+static void virtio_balloon_report_vm_state_change(void *opaque, int running,
+                                                  RunState state)
+{
+    VirtIOBalloon *dev = opaque;
+    VirtIODevice *vdev = VIRTIO_DEVICE(dev);
+
+    /*
+     * virtio_balloon_pre_save() may have put reports back into the queue,
+     * and the guest won't kick for them again.
+     */
+    if (running && (vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
+        virtio_balloon_handle_report(vdev, dev->reporting_vq);
     }
 }
 
@@ -918,6 +1089,13 @@ static void virtio_balloon_device_realize(DeviceState *dev, Error **errp)
     if (virtio_has_feature(s->host_features, VIRTIO_BALLOON_F_REPORTING)) {
         s->reporting_vq = virtio_add_queue(vdev, 32,
                                            virtio_balloon_handle_report);
+        s->report_elems = g_ptr_array_new();
+        s->report_ranges = g_array_new(false, false,
+                                       sizeof(BalloonReportRange));
+        qemu_event_init(&s->report_done, false);
+        s->report_done_bh = qemu_bh_new(virtio_balloon_report_done_bh, s);
+        s->report_vmstate = qemu_add_vm_change_state_handler(
+            virtio_balloon_report_vm_state_change, s);
     }
 
     reset_stats(s);
@@ -928,6 +1106,14 @@ static void virtio_balloon_device_unrealize(DeviceState *dev)
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
     VirtIOBalloon *s = VIRTIO_BALLOON(dev);
 
+    if (s->reporting_vq) {
+        qemu_del_vm_change_state_handler(s->report_vmstate);
+        virtio_balloon_report_flush(s, BALLOON_REPORT_DROP);
+        qemu_bh_delete(s->report_done_bh);
+        qemu_event_destroy(&s->report_done);
+        g_ptr_array_free(s->report_elems, true);
+        g_array_free(s->report_ranges, true);
+    }
     if (s->free_page_bh) {
         qemu_bh_delete(s->free_page_bh);
         object_unref(OBJECT(s->iothread));
@@ -957,6 +1143,10 @@ static void virtio_balloon_device_reset(VirtIODevice *vdev)
         virtio_balloon_free_page_stop(s);
     }
 
+    if (s->reporting_vq) {
+        virtio_balloon_report_flush(s, BALLOON_REPORT_DROP);
+    }
+
     if (s->stats_vq_elem != NULL) {
         virtqueue_unpop(s->svq, s->stats_vq_elem, 0);
         g_free(s->stats_vq_elem);
@@ -1016,10 +1206,27 @@ static void virtio_balloon_instance_init(Object *obj)
                         NULL, s);
 }
 
+static int virtio_balloon_pre_save(void *opaque)
+{
+    VirtIOBalloon *s = VIRTIO_BALLOON(opaque);
+
+    /*
+     * RAM is already saved, so the used ring can't be written any more.
+     * Put the reports in flight back into the queue instead; once the VM
+     * runs, virtio_balloon_report_vm_state_change() discards the memory
+     * once more and answers them.
+     */
+    if (s->reporting_vq) {
+        virtio_balloon_report_flush(s, BALLOON_REPORT_REQUEUE);
+    }
+    return 0;
+}
+
 static const VMStateDescription vmstate_virtio_balloon = {
     .name = "virtio-balloon",
     .minimum_version_id = 1,
     .version_id = 1,
+    .pre_save = virtio_balloon_pre_save,
     .fields = (VMStateField[]) {
         VMSTATE_VIRTIO_DEVICE,
         VMSTATE_END_OF_LIST()
@@ -16,9 +16,12 @@
 #include "qemu/cutils.h"
 #include "qemu/error-report.h"
 #include "qemu/units.h"
+#include "qemu/main-loop.h"
+#include "qemu/rcu.h"
 #include "sysemu/numa.h"
 #include "sysemu/sysemu.h"
 #include "sysemu/reset.h"
+#include "sysemu/runstate.h"
 #include "hw/virtio/virtio.h"
 #include "hw/virtio/virtio-bus.h"
 #include "hw/virtio/virtio-access.h"
@@ -38,6 +41,13 @@
  */
 #define VIRTIO_MEM_MIN_BLOCK_SIZE ((uint32_t)(1 * MiB))
 
+/*
+ * Preallocating or discarding a big range can take seconds.  Such requests
+ * are processed by a worker thread, one chunk at a time so that they can be
+ * cancelled quickly.  Smaller discards are done right away.
+ */
+#define VIRTIO_MEM_WORKER_CHUNK (1 * GiB)
+
 #if defined(__x86_64__) || defined(__arm__) || defined(__aarch64__) || \
     defined(__powerpc64__)
 #define VIRTIO_MEM_DEFAULT_THP_SIZE ((uint32_t)(2 * MiB))
@@ -237,36 +247,171 @@ static int virtio_mem_set_block_state(VirtIOMEM *vmem, uint64_t start_gpa,
     return 0;
 }
 
-static int virtio_mem_state_change_request(VirtIOMEM *vmem, uint64_t gpa,
-                                           uint16_t nb_blocks, bool plug)
+static void virtio_mem_update_size(VirtIOMEM *vmem, uint64_t size, bool plug)
 {
-    const uint64_t size = nb_blocks * vmem->block_size;
+    if (plug) {
+        vmem->size += size;
+    } else {
+        vmem->size -= size;
+    }
+    notifier_list_notify(&vmem->size_change_notifiers, &vmem->size);
+}
+
+static void *virtio_mem_worker(void *opaque)
+{
+    VirtIOMEM *vmem = opaque;
+    RAMBlock *rb = vmem->memdev->mr.ram_block;
+    const uint64_t chunk = MAX(VIRTIO_MEM_WORKER_CHUNK, vmem->block_size);
+    const uint64_t start = vmem->pending_gpa - vmem->addr;
+    const uint64_t end = start + vmem->pending_size;
+    uint64_t offset, len;
+    int fd, ret = 0;
+
+    rcu_register_thread();
+    fd = memory_region_get_fd(&vmem->memdev->mr);
+
+    for (offset = start; offset < end && !ret; offset += len) {
+        Error *local_err = NULL;
+
+        len = MIN(chunk, end - offset);
+        if (qatomic_read(&vmem->pending_cancel)) {
+            ret = -ECANCELED;
+        } else if (vmem->pending_plug) {
+            os_mem_prealloc_nodes(fd, qemu_ram_get_host_addr(rb) + offset, len,
+                                  vmem->memdev->prealloc_threads,
+                                  vmem->memdev->host_nodes, MAX_NODES,
+                                  &local_err);
+            if (local_err) {
+                error_free(local_err);
+                ret = -ENOMEM;
+            }
+        } else {
+            ret = ram_block_discard_range(rb, offset, len);
+        }
+    }
+
+    vmem->pending_ret = ret;
+    qemu_bh_schedule(vmem->done_bh);
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static void virtio_mem_start_worker(VirtIOMEM *vmem, VirtQueueElement *elem,
+                                    uint64_t gpa, uint64_t size, bool plug)
+{
+    trace_virtio_mem_worker_start(gpa, size, plug);
+    vmem->pending_elem = elem;
+    vmem->pending_gpa = gpa;
+    vmem->pending_size = size;
+    vmem->pending_plug = plug;
+    vmem->pending_cancel = false;
+    qemu_thread_create(&vmem->worker, "virtio-mem", virtio_mem_worker, vmem,
+                       QEMU_THREAD_JOINABLE);
+}
+
+/* What happens to the pending request once the worker is done */
+typedef enum VirtIOMEMPendingAction {
+    /* Answer it */
+    VIRTIO_MEM_PENDING_RESPOND,
+    /* Drop it, because the queue is reset */
+    VIRTIO_MEM_PENDING_DROP,
+    /* Give it back to the queue without an answer, to be handled again */
+    VIRTIO_MEM_PENDING_REQUEUE,
+} VirtIOMEMPendingAction;
+
+/*
+ * Wait for the worker and apply the outcome of the pending request, unless
+ * it isn't answered.
+ */
+static void virtio_mem_finish_pending(VirtIOMEM *vmem,
+                                      VirtIOMEMPendingAction action)
+{
+    VirtQueueElement *elem = vmem->pending_elem;
+    const uint64_t gpa = vmem->pending_gpa;
+    const uint64_t size = vmem->pending_size;
+    const bool plug = vmem->pending_plug;
+    uint16_t type = VIRTIO_MEM_RESP_ACK;
     int ret;
 
-    if (!virtio_mem_valid_range(vmem, gpa, size)) {
-        return VIRTIO_MEM_RESP_ERROR;
+    qemu_thread_join(&vmem->worker);
+    qemu_bh_cancel(vmem->done_bh);
+    vmem->pending_elem = NULL;
+    ret = vmem->pending_ret;
+
+    /* Migration might have started meanwhile, see virtio_mem_is_busy() */
+    if (!ret && (action != VIRTIO_MEM_PENDING_RESPOND ||
+                 virtio_mem_is_busy())) {
+        ret = -EBUSY;
     }
+    trace_virtio_mem_worker_done(gpa, size, plug, ret);
 
-    if (plug && (vmem->size + size > vmem->requested_size)) {
-        return VIRTIO_MEM_RESP_NACK;
+    if (!ret) {
+        virtio_mem_set_bitmap(vmem, gpa, size, plug);
+        virtio_mem_update_size(vmem, size, plug);
+    } else {
+        if (ret != -EBUSY && ret != -ECANCELED) {
+            error_report(plug ? "Preallocating plugged memory failed: %s" :
+                         "Unexpected error discarding RAM: %s",
+                         strerror(-ret));
+        }
+        if (plug) {
+            /* The blocks stay unplugged, drop what was preallocated */
+            ram_block_discard_range(vmem->memdev->mr.ram_block,
+                                    gpa - vmem->addr, size);
+        }
+        type = VIRTIO_MEM_RESP_BUSY;
     }
 
-    /* test if really all blocks are in the opposite state */
-    if (!virtio_mem_test_bitmap(vmem, gpa, size, !plug)) {
-        return VIRTIO_MEM_RESP_ERROR;
+    switch (action) {
+    case VIRTIO_MEM_PENDING_RESPOND:
+        virtio_mem_send_response_simple(vmem, elem, type);
+        break;
+    case VIRTIO_MEM_PENDING_DROP:
+        virtqueue_detach_element(vmem->vq, elem, 0);
+        break;
+    case VIRTIO_MEM_PENDING_REQUEUE:
+        /* No other request was popped after it, see the request handler */
+        virtqueue_unpop(vmem->vq, elem, 0);
+        break;
     }
+    g_free(elem);
+}
 
-    ret = virtio_mem_set_block_state(vmem, gpa, size, plug);
-    if (ret) {
-        return VIRTIO_MEM_RESP_BUSY;
+static void virtio_mem_cancel_pending(VirtIOMEM *vmem,
+                                      VirtIOMEMPendingAction action)
+{
+    if (vmem->pending_elem) {
+        qatomic_set(&vmem->pending_cancel, true);
+        virtio_mem_finish_pending(vmem, action);
     }
-    if (plug) {
-        vmem->size += size;
+}
+
+static void virtio_mem_state_change_request(VirtIOMEM *vmem,
+                                            VirtQueueElement *elem,
+                                            uint64_t gpa, uint16_t nb_blocks,
+                                            bool plug)
+{
+    const uint64_t size = nb_blocks * vmem->block_size;
+    uint16_t type = VIRTIO_MEM_RESP_ACK;
+
+    if (!virtio_mem_valid_range(vmem, gpa, size)) {
+        type = VIRTIO_MEM_RESP_ERROR;
+    } else if (plug && (vmem->size + size > vmem->requested_size)) {
+        type = VIRTIO_MEM_RESP_NACK;
+    } else if (!virtio_mem_test_bitmap(vmem, gpa, size, !plug)) {
+        /* not all blocks are in the opposite state */
+        type = VIRTIO_MEM_RESP_ERROR;
+    } else if (virtio_mem_is_busy()) {
+        type = VIRTIO_MEM_RESP_BUSY;
+    } else if (plug ? vmem->prealloc : size >= VIRTIO_MEM_WORKER_CHUNK) {
+        virtio_mem_start_worker(vmem, elem, gpa, size, plug);
+        return;
+    } else if (virtio_mem_set_block_state(vmem, gpa, size, plug)) {
+        type = VIRTIO_MEM_RESP_BUSY;
     } else {
-        vmem->size -= size;
+        virtio_mem_update_size(vmem, size, plug);
     }
-    notifier_list_notify(&vmem->size_change_notifiers, &vmem->size);
-    return VIRTIO_MEM_RESP_ACK;
+    virtio_mem_send_response_simple(vmem, elem, type);
 }
 
 static void virtio_mem_plug_request(VirtIOMEM *vmem, VirtQueueElement *elem,
@@ -274,11 +419,9 @@ static void virtio_mem_plug_request(VirtIOMEM *vmem, VirtQueueElement *elem,
 {
     const uint64_t gpa = le64_to_cpu(req->u.plug.addr);
     const uint16_t nb_blocks = le16_to_cpu(req->u.plug.nb_blocks);
-    uint16_t type;
 
     trace_virtio_mem_plug_request(gpa, nb_blocks);
-    type = virtio_mem_state_change_request(vmem, gpa, nb_blocks, true);
-    virtio_mem_send_response_simple(vmem, elem, type);
+    virtio_mem_state_change_request(vmem, elem, gpa, nb_blocks, true);
 }
 
 static void virtio_mem_unplug_request(VirtIOMEM *vmem, VirtQueueElement *elem,
@@ -286,11 +429,9 @@ static void virtio_mem_unplug_request(VirtIOMEM *vmem, VirtQueueElement *elem,
 {
     const uint64_t gpa = le64_to_cpu(req->u.unplug.addr);
     const uint16_t nb_blocks = le16_to_cpu(req->u.unplug.nb_blocks);
-    uint16_t type;
 
     trace_virtio_mem_unplug_request(gpa, nb_blocks);
-    type = virtio_mem_state_change_request(vmem, gpa, nb_blocks, false);
-    virtio_mem_send_response_simple(vmem, elem, type);
+    virtio_mem_state_change_request(vmem, elem, gpa, nb_blocks, false);
 }
 
 static void virtio_mem_resize_usable_region(VirtIOMEM *vmem,
@@ -385,7 +526,7 @@ static void virtio_mem_handle_request(VirtIODevice *vdev, VirtQueue *vq)
     struct virtio_mem_req req;
     uint16_t type;
 
-    while (true) {
+    while (!vmem->pending_elem) {
         elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
         if (!elem) {
             return;
@@ -431,7 +572,34 @@ static void virtio_mem_handle_request(VirtIODevice *vdev, VirtQueue *vq)
             return;
         }
 
-        g_free(elem);
+        if (elem != vmem->pending_elem) {
+            g_free(elem);
+        }
+    }
+}
+
+static void virtio_mem_worker_done_bh(void *opaque)
+{
+    VirtIOMEM *vmem = opaque;
+
+    virtio_mem_finish_pending(vmem, VIRTIO_MEM_PENDING_RESPOND);
+    /* Process the requests that were queued meanwhile */
+    virtio_mem_handle_request(VIRTIO_DEVICE(vmem), vmem->vq);
+}
+
+static void virtio_mem_vm_state_change(void *opaque, int running,
+                                       RunState state)
+{
+    VirtIOMEM *vmem = opaque;
+    VirtIODevice *vdev = VIRTIO_DEVICE(vmem);
+
+    /*
+     * virtio_mem_pre_save() may have given a request back to the queue.
+     * The guest already kicked for it, so process the queue once the VM
+     * runs again, on the destination or after a failed migration.
+     */
+    if (running && (vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
+        virtio_mem_handle_request(vdev, vmem->vq);
     }
 }
 
@@ -471,9 +639,16 @@ static void virtio_mem_system_reset(void *opaque)
      * region size. This is, however, not possible in all scenarios. Then,
      * the guest has to deal with this manually (VIRTIO_MEM_REQ_UNPLUG_ALL).
      */
+    virtio_mem_cancel_pending(vmem, VIRTIO_MEM_PENDING_DROP);
     virtio_mem_unplug_all(vmem);
 }
 
+static void virtio_mem_device_reset(VirtIODevice *vdev)
+{
+    /* The queue is reset, nobody waits for the response anymore */
+    virtio_mem_cancel_pending(VIRTIO_MEM(vdev), VIRTIO_MEM_PENDING_DROP);
+}
+
 static void virtio_mem_device_realize(DeviceState *dev, Error **errp)
 {
     MachineState *ms = MACHINE(qdev_get_machine());
@@ -572,6 +747,9 @@ static void virtio_mem_device_realize(DeviceState *dev, Error **errp)
     virtio_init(vdev, TYPE_VIRTIO_MEM, VIRTIO_ID_MEM,
                 sizeof(struct virtio_mem_config));
     vmem->vq = virtio_add_queue(vdev, 128, virtio_mem_handle_request);
+    vmem->done_bh = qemu_bh_new(virtio_mem_worker_done_bh, vmem);
+    vmem->vmstate = qemu_add_vm_change_state_handler(virtio_mem_vm_state_change,
+                                                     vmem);
 
     host_memory_backend_set_mapped(vmem->memdev, true);
     vmstate_register_ram(&vmem->memdev->mr, DEVICE(vmem));
@@ -584,6 +762,9 @@ static void virtio_mem_device_unrealize(DeviceState *dev)
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
     VirtIOMEM *vmem = VIRTIO_MEM(dev);
 
+    qemu_del_vm_change_state_handler(vmem->vmstate);
+    virtio_mem_cancel_pending(vmem, VIRTIO_MEM_PENDING_DROP);
+    qemu_bh_delete(vmem->done_bh);
     precopy_remove_notifier(&vmem->precopy_notifier);
     qemu_unregister_reset(virtio_mem_system_reset, vmem);
     vmstate_unregister_ram(&vmem->memdev->mr, DEVICE(vmem));
@@ -714,10 +895,22 @@ static const VMStateDescription vmstate_virtio_mem_device = {
     },
 };
 
+static int virtio_mem_pre_save(void *opaque)
+{
+    /*
+     * RAM is already saved, so the pending request can't be answered any
+     * more: the used ring is guest memory.  Give it back to the queue
+     * instead, and virtio_mem_vm_state_change() handles it once more.
+     */
+    virtio_mem_cancel_pending(VIRTIO_MEM(opaque), VIRTIO_MEM_PENDING_REQUEUE);
+    return 0;
+}
+
 static const VMStateDescription vmstate_virtio_mem = {
     .name = "virtio-mem",
     .minimum_version_id = 1,
     .version_id = 1,
+    .pre_save = virtio_mem_pre_save,
     .fields = (VMStateField[]) {
         VMSTATE_VIRTIO_DEVICE,
         VMSTATE_END_OF_LIST()
@@ -937,6 +1130,7 @@ static Property virtio_mem_properties[] = {
     DEFINE_PROP_UINT32(VIRTIO_MEM_NODE_PROP, VirtIOMEM, node, 0),
     DEFINE_PROP_LINK(VIRTIO_MEM_MEMDEV_PROP, VirtIOMEM, memdev,
                      TYPE_MEMORY_BACKEND, HostMemoryBackend *),
+    DEFINE_PROP_BOOL(VIRTIO_MEM_PREALLOC_PROP, VirtIOMEM, prealloc, false),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -952,6 +1146,7 @@ static void virtio_mem_class_init(ObjectClass *klass, void *data)
     set_bit(DEVICE_CATEGORY_MISC, dc->categories);
     vdc->realize = virtio_mem_device_realize;
     vdc->unrealize = virtio_mem_device_unrealize;
+    vdc->reset = virtio_mem_device_reset;
     vdc->get_config = virtio_mem_get_config;
     vdc->get_features = virtio_mem_get_features;
     vdc->vmsd = &vmstate_virtio_mem_device;
@@ -234,6 +234,17 @@ typedef struct VirtioPCIDeviceTypeInfo {
 /* Register virtio-pci type(s).  @t must be static. */
 void virtio_pci_types_register(const VirtioPCIDeviceTypeInfo *t);
 
+/**
+ * virtio_pci_add_shm_cap:
+ * Add a shared memory region capability, describing @length bytes at
+ * @offset of BAR @bar.  @id identifies the region to the device driver.
+ *
+ * Returns the offset of the capability in config space.
+ */
+int virtio_pci_add_shm_cap(VirtIOPCIProxy *proxy,
+                           uint8_t bar, uint64_t offset, uint64_t length,
+                           uint8_t id);
+
 /**
  * virtio_pci_optimal_num_queues:
  * @fixed_queues: number of queues that are always present
@@ -20,6 +20,7 @@
 #include "qemu/log.h"
 #include "qemu/main-loop.h"
 #include "qemu/module.h"
+#include "qemu/timer.h"
 #include "hw/virtio/virtio.h"
 #include "migration/qemu-file-types.h"
 #include "qemu/atomic.h"
@@ -132,6 +133,17 @@ struct VirtQueue
     EventNotifier host_notifier;
     bool host_notifier_enabled;
     QLIST_ENTRY(VirtQueue) node;
+
+    /* Interrupt coalescing, see virtio_queue_set_coalescing() */
+    QEMUTimer *coalesce_timer;
+    uint32_t coalesce_usecs;
+    uint32_t coalesce_frames;
+    uint32_t coalesce_pending;
+
+    /* Free elements, see virtio_queue_enable_element_pool() */
+    void **elem_pool;
+    unsigned int elem_pool_len;
+    size_t elem_pool_block;
 };
 
 static void virtio_free_region_cache(VRingMemoryRegionCaches *caches)
@@ -524,19 +536,22 @@ static void vring_packed_desc_read(VirtIODevice *vdev,
 {
     hwaddr off = i * sizeof(VRingPackedDesc);
 
-    vring_packed_desc_read_flags(vdev, &desc->flags, cache, i);
+    /* addr, len and id are contiguous and precede flags */
+    QEMU_BUILD_BUG_ON(offsetof(VRingPackedDesc, addr) != 0 ||
+                      offsetof(VRingPackedDesc, len) != 8 ||
+                      offsetof(VRingPackedDesc, id) != 12 ||
+                      offsetof(VRingPackedDesc, flags) != 14);
 
     if (strict_order) {
+        vring_packed_desc_read_flags(vdev, &desc->flags, cache, i);
         /* Make sure flags is read before the rest fields. */
         smp_rmb();
+        address_space_read_cached(cache, off, desc,
+                                  offsetof(VRingPackedDesc, flags));
+    } else {
+        address_space_read_cached(cache, off, desc, sizeof(*desc));
+        virtio_tswap16s(vdev, &desc->flags);
     }
-
-    address_space_read_cached(cache, off + offsetof(VRingPackedDesc, addr),
-                              &desc->addr, sizeof(desc->addr));
-    address_space_read_cached(cache, off + offsetof(VRingPackedDesc, id),
-                              &desc->id, sizeof(desc->id));
-    address_space_read_cached(cache, off + offsetof(VRingPackedDesc, len),
-                              &desc->len, sizeof(desc->len));
     virtio_tswap64s(vdev, &desc->addr);
     virtio_tswap16s(vdev, &desc->id);
     virtio_tswap32s(vdev, &desc->len);
@@ -547,17 +562,16 @@ static void vring_packed_desc_write_data(VirtIODevice *vdev,
                                          MemoryRegionCache *cache,
                                          int i)
 {
-    hwaddr off_id = i * sizeof(VRingPackedDesc) +
-                    offsetof(VRingPackedDesc, id);
-    hwaddr off_len = i * sizeof(VRingPackedDesc) +
-                    offsetof(VRingPackedDesc, len);
+    hwaddr off = i * sizeof(VRingPackedDesc) +
+                 offsetof(VRingPackedDesc, len);
+    /* len and id are adjacent, so store them together */
+    hwaddr size = offsetof(VRingPackedDesc, flags) -
+                  offsetof(VRingPackedDesc, len);
 
     virtio_tswap32s(vdev, &desc->len);
     virtio_tswap16s(vdev, &desc->id);
-    address_space_write_cached(cache, off_id, &desc->id, sizeof(desc->id));
-    address_space_cache_invalidate(cache, off_id, sizeof(desc->id));
-    address_space_write_cached(cache, off_len, &desc->len, sizeof(desc->len));
-    address_space_cache_invalidate(cache, off_len, sizeof(desc->len));
+    address_space_write_cached(cache, off, &desc->len, size);
+    address_space_cache_invalidate(cache, off, size);
 }
 
 static void vring_packed_desc_write_flags(VirtIODevice *vdev,
@@ -798,23 +812,20 @@ static void virtqueue_packed_fill(VirtQueue *vq, const VirtQueueElement *elem,
     vq->used_elems[idx].ndescs = elem->ndescs;
 }
 
+/* Called within rcu_read_lock().  */
 static void virtqueue_packed_fill_desc(VirtQueue *vq,
+                                       VRingMemoryRegionCaches *caches,
                                        const VirtQueueElement *elem,
                                        unsigned int idx,
                                        bool strict_order)
 {
     uint16_t head;
-    VRingMemoryRegionCaches *caches;
     VRingPackedDesc desc = {
         .id = elem->index,
         .len = elem->len,
     };
     bool wrap_counter = vq->used_wrap_counter;
 
-    if (unlikely(!vq->vring.desc)) {
-        return;
-    }
-
     head = vq->used_idx + idx;
     if (head >= vq->vring.num) {
         head -= vq->vring.num;
@@ -828,11 +839,6 @@ static void virtqueue_packed_fill_desc(VirtQueue *vq,
         desc.flags &= ~(1 << VRING_PACKED_DESC_F_USED);
     }
 
-    caches = vring_get_region_caches(vq);
-    if (!caches) {
-        return;
-    }
-
     vring_packed_desc_write(vq->vdev, &desc, &caches->desc, head, strict_order);
 }
 
@@ -878,16 +884,27 @@ static void virtqueue_split_flush(VirtQueue *vq, unsigned int count)
 static void virtqueue_packed_flush(VirtQueue *vq, unsigned int count)
 {
     unsigned int i, ndescs = 0;
+    VRingMemoryRegionCaches *caches;
 
     if (unlikely(!vq->vring.desc)) {
         return;
     }
 
+    caches = vring_get_region_caches(vq);
+    if (!caches) {
+        return;
+    }
+
+    /*
+     * The guest only looks past the first descriptor once its flags
+     * are updated, so only that store needs to be ordered after the
+     * others.
+     */
     for (i = 1; i < count; i++) {
-        virtqueue_packed_fill_desc(vq, &vq->used_elems[i], i, false);
+        virtqueue_packed_fill_desc(vq, caches, &vq->used_elems[i], i, false);
         ndescs += vq->used_elems[i].ndescs;
     }
-    virtqueue_packed_fill_desc(vq, &vq->used_elems[0], 0, true);
+    virtqueue_packed_fill_desc(vq, caches, &vq->used_elems[0], 0, true);
     ndescs += vq->used_elems[0].ndescs;
 
     vq->inuse -= ndescs;
@@ -1389,7 +1406,15 @@ void virtqueue_map(VirtIODevice *vdev, VirtQueueElement *elem)
                                                                         false);
 }
 
-static void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_num)
+/*
+ * Elements with up to this many descriptors in total are recycled by queues
+ * that have an element pool, and that many free elements are kept at most.
+ */
+#define VIRTQUEUE_ELEM_POOL_SG      4
+#define VIRTQUEUE_ELEM_POOL_MAX     64
+
+static void *virtqueue_alloc_element(VirtQueue *vq, size_t sz,
+                                     unsigned out_num, unsigned in_num)
 {
     VirtQueueElement *elem;
     size_t in_addr_ofs = QEMU_ALIGN_UP(sz, __alignof__(elem->in_addr[0]));
@@ -1398,12 +1423,20 @@ static void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_nu
     size_t in_sg_ofs = QEMU_ALIGN_UP(out_addr_end, __alignof__(elem->in_sg[0]));
     size_t out_sg_ofs = in_sg_ofs + in_num * sizeof(elem->in_sg[0]);
     size_t out_sg_end = out_sg_ofs + out_num * sizeof(elem->out_sg[0]);
+    bool pooled = vq && vq->elem_pool && out_sg_end <= vq->elem_pool_block;
 
     assert(sz >= sizeof(VirtQueueElement));
-    elem = g_malloc(out_sg_end);
+    if (!pooled) {
+        elem = g_malloc(out_sg_end);
+    } else if (vq->elem_pool_len) {
+        elem = vq->elem_pool[--vq->elem_pool_len];
+    } else {
+        elem = g_malloc(vq->elem_pool_block);
+    }
     trace_virtqueue_alloc_element(elem, sz, in_num, out_num);
     elem->out_num = out_num;
     elem->in_num = in_num;
+    elem->pooled = pooled;
     elem->in_addr = (void *)elem + in_addr_ofs;
     elem->out_addr = (void *)elem + out_addr_ofs;
     elem->in_sg = (void *)elem + in_sg_ofs;
@@ -1411,10 +1444,79 @@ static void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_nu
     return elem;
 }
 
-static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
+/*
+ * Free an element returned by virtqueue_pop() on @vq, keeping it for a
+ * later virtqueue_pop() if the queue has an element pool.
+ */
+void virtqueue_element_free(VirtQueue *vq, void *elem)
+{
+    VirtQueueElement *e = elem;
+
+    if (e->pooled && vq->elem_pool &&
+        vq->elem_pool_len < VIRTQUEUE_ELEM_POOL_MAX) {
+        vq->elem_pool[vq->elem_pool_len++] = e;
+    } else {
+        g_free(e);
+    }
+}
+
+/*
+ * Recycle the elements of @vq instead of allocating a new one for each
+ * request.  @sz is the size that the device passes to virtqueue_pop().
+ * There is no locking, so the device must pop and free the elements from
+ * the same thread or under the same lock, and must free them with
+ * virtqueue_element_free().
+ */
+void virtio_queue_enable_element_pool(VirtQueue *vq, size_t sz)
+{
+    VirtQueueElement *elem;
+    size_t addr_end = QEMU_ALIGN_UP(sz, __alignof__(elem->in_addr[0])) +
+                      VIRTQUEUE_ELEM_POOL_SG * sizeof(elem->in_addr[0]);
+
+    assert(!vq->elem_pool);
+    vq->elem_pool = g_new(void *, VIRTQUEUE_ELEM_POOL_MAX);
+    vq->elem_pool_len = 0;
+    vq->elem_pool_block = QEMU_ALIGN_UP(addr_end, __alignof__(elem->in_sg[0])) +
+                          VIRTQUEUE_ELEM_POOL_SG * sizeof(elem->in_sg[0]);
+}
+
+static void virtio_queue_free_element_pool(VirtQueue *vq)
+{
+    while (vq->elem_pool_len) {
+        g_free(vq->elem_pool[--vq->elem_pool_len]);
+    }
+    g_free(vq->elem_pool);
+    vq->elem_pool = NULL;
+    vq->elem_pool_block = 0;
+}
+
+/* Called within rcu_read_lock().  */
+static VRingMemoryRegionCaches *virtqueue_split_get_caches(VirtQueue *vq)
+{
+    VRingMemoryRegionCaches *caches = vring_get_region_caches(vq);
+
+    if (!caches) {
+        virtio_error(vq->vdev, "Region caches not initialized");
+        return NULL;
+    }
+
+    if (caches->desc.len < vq->vring.num * sizeof(VRingDesc)) {
+        virtio_error(vq->vdev, "Cannot map descriptor ring");
+        return NULL;
+    }
+
+    return caches;
+}
+
+/*
+ * Called within rcu_read_lock(), once the caller has made sure that the
+ * avail ring has an entry at vq->last_avail_idx.  The caller is also
+ * responsible for updating the avail event.
+ */
+static void *virtqueue_split_pop_rcu(VirtQueue *vq, size_t sz,
+                                     VRingMemoryRegionCaches *caches)
 {
     unsigned int i, head, max;
-    VRingMemoryRegionCaches *caches;
     MemoryRegionCache indirect_desc_cache = MEMORY_REGION_CACHE_INVALID;
     MemoryRegionCache *desc_cache;
     int64_t len;
@@ -1426,14 +1528,6 @@ static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
     VRingDesc desc;
     int rc;
 
-    RCU_READ_LOCK_GUARD();
-    if (virtio_queue_empty_rcu(vq)) {
-        goto done;
-    }
-    /* Needed after virtio_queue_empty(), see comment in
-     * virtqueue_num_heads(). */
-    smp_rmb();
-
     /* When we start there are none of either input nor output. */
     out_num = in_num = elem_entries = 0;
 
@@ -1448,23 +1542,7 @@ static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
         goto done;
     }
 
-    if (virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
-        vring_set_avail_event(vq, vq->last_avail_idx);
-    }
-
     i = head;
-
-    caches = vring_get_region_caches(vq);
-    if (!caches) {
-        virtio_error(vdev, "Region caches not initialized");
-        goto done;
-    }
-
-    if (caches->desc.len < max * sizeof(VRingDesc)) {
-        virtio_error(vdev, "Cannot map descriptor ring");
-        goto done;
-    }
-
     desc_cache = &caches->desc;
     vring_split_desc_read(vdev, &desc, desc_cache, i);
     if (desc.flags & VRING_DESC_F_INDIRECT) {
@@ -1523,7 +1601,7 @@ static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
     }
 
     /* Now copy what we have collected and mapped */
-    elem = virtqueue_alloc_element(sz, out_num, in_num);
+    elem = virtqueue_alloc_element(vq, sz, out_num, in_num);
     elem->index = head;
     elem->ndescs = 1;
     for (i = 0; i < out_num; i++) {
@@ -1548,6 +1626,68 @@ err_undo_map:
     goto done;
 }
 
+static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
+{
+    VRingMemoryRegionCaches *caches;
+    VirtQueueElement *elem;
+
+    RCU_READ_LOCK_GUARD();
+    if (virtio_queue_empty_rcu(vq)) {
+        return NULL;
+    }
+    /* Needed after virtio_queue_empty(), see comment in
+     * virtqueue_num_heads(). */
+    smp_rmb();
+
+    caches = virtqueue_split_get_caches(vq);
+    if (!caches) {
+        return NULL;
+    }
+
+    elem = virtqueue_split_pop_rcu(vq, sz, caches);
+    if (elem && virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_set_avail_event(vq, vq->last_avail_idx);
+    }
+    return elem;
+}
+
+static unsigned int virtqueue_split_pop_batch(VirtQueue *vq, size_t sz,
+                                              void **elems, unsigned int max)
+{
+    VRingMemoryRegionCaches *caches;
+    unsigned int i;
+    int num_heads;
+
+    RCU_READ_LOCK_GUARD();
+    if (unlikely(!vq->vring.avail)) {
+        return 0;
+    }
+
+    /* A single read of the avail index covers the whole batch. */
+    num_heads = virtqueue_num_heads(vq, vq->last_avail_idx);
+    if (num_heads <= 0) {
+        return 0;
+    }
+
+    caches = virtqueue_split_get_caches(vq);
+    if (!caches) {
+        return 0;
+    }
+
+    max = MIN(max, num_heads);
+    for (i = 0; i < max; i++) {
+        elems[i] = virtqueue_split_pop_rcu(vq, sz, caches);
+        if (!elems[i]) {
+            break;
+        }
+    }
+
+    if (i && virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_set_avail_event(vq, vq->last_avail_idx);
+    }
+    return i;
+}
+
 static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
 {
     unsigned int i, max;
@@ -1649,7 +1789,7 @@ static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
     } while (rc == VIRTQUEUE_READ_DESC_MORE);
 
     /* Now copy what we have collected and mapped */
-    elem = virtqueue_alloc_element(sz, out_num, in_num);
+    elem = virtqueue_alloc_element(vq, sz, out_num, in_num);
     for (i = 0; i < out_num; i++) {
         elem->out_addr[i] = addr[i];
         elem->out_sg[i] = iov[i];
@@ -1696,6 +1836,34 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
     }
 }
 
+/*
+ * Pop up to @max elements into @elems, each allocated as in virtqueue_pop().
+ * For split rings, the avail index and the ring's memory region caches are
+ * only looked up once for the whole batch, and the avail event is updated
+ * once at the end.  Returns the number of elements popped.
+ */
+unsigned int virtqueue_pop_batch(VirtQueue *vq, size_t sz, void **elems,
+                                 unsigned int max)
+{
+    unsigned int i;
+
+    if (virtio_device_disabled(vq->vdev)) {
+        return 0;
+    }
+
+    if (!virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED)) {
+        return virtqueue_split_pop_batch(vq, sz, elems, max);
+    }
+
+    for (i = 0; i < max; i++) {
+        elems[i] = virtqueue_packed_pop(vq, sz);
+        if (!elems[i]) {
+            break;
+        }
+    }
+    return i;
+}
+
 static unsigned int virtqueue_packed_drop_all(VirtQueue *vq)
 {
     VRingMemoryRegionCaches *caches;
@@ -1829,7 +1997,7 @@ void *qemu_get_virtqueue_element(VirtIODevice *vdev, QEMUFile *f, size_t sz)
     assert(ARRAY_SIZE(data.in_addr) >= data.in_num);
     assert(ARRAY_SIZE(data.out_addr) >= data.out_num);
 
-    elem = virtqueue_alloc_element(sz, data.out_num, data.in_num);
+    elem = virtqueue_alloc_element(NULL, sz, data.out_num, data.in_num);
     elem->index = data.index;
 
     for (i = 0; i < elem->in_num; i++) {
@@ -2028,6 +2196,10 @@ void virtio_reset(void *opaque)
         vdev->vq[i].notification = true;
         vdev->vq[i].vring.num = vdev->vq[i].vring.num_default;
         vdev->vq[i].inuse = 0;
+        vdev->vq[i].coalesce_pending = 0;
+        if (vdev->vq[i].coalesce_timer) {
+            timer_del(vdev->vq[i].coalesce_timer);
+        }
         virtio_virtqueue_reset_region_cache(&vdev->vq[i]);
     }
 }
@@ -2394,6 +2566,8 @@ void virtio_queue_set_vector(VirtIODevice *vdev, int n, uint16_t vector)
     }
 }
 
+static void virtio_queue_coalesce_reset(VirtQueue *vq);
+
 VirtQueue *virtio_add_queue(VirtIODevice *vdev, int queue_size,
                             VirtIOHandleOutput handle_output)
 {
@@ -2414,6 +2588,8 @@ VirtQueue *virtio_add_queue(VirtIODevice *vdev, int queue_size,
     vdev->vq[i].handle_aio_output = NULL;
     vdev->vq[i].used_elems = g_malloc0(sizeof(VirtQueueElement) *
                                        queue_size);
+    virtio_queue_set_coalescing(&vdev->vq[i], vdev->notify_coalesce_usecs,
+                                vdev->notify_coalesce_frames);
 
     return &vdev->vq[i];
 }
@@ -2426,6 +2602,8 @@ void virtio_delete_queue(VirtQueue *vq)
     vq->handle_aio_output = NULL;
     g_free(vq->used_elems);
     vq->used_elems = NULL;
+    virtio_queue_free_element_pool(vq);
+    virtio_queue_coalesce_reset(vq);
     virtio_virtqueue_reset_region_cache(vq);
 }
 
@@ -2560,6 +2738,54 @@ static void virtio_irq(VirtQueue *vq)
     virtio_notify_vector(vq->vdev, vq->vector);
 }
 
+static void virtio_queue_coalesce_flush(VirtQueue *vq)
+{
+    if (vq->coalesce_pending) {
+        vq->coalesce_pending = 0;
+        timer_del(vq->coalesce_timer);
+        trace_virtio_notify(vq->vdev, vq);
+        virtio_irq(vq);
+    }
+}
+
+static void virtio_queue_coalesce_timer(void *opaque)
+{
+    virtio_queue_coalesce_flush(opaque);
+}
+
+/*
+ * Delay the interrupts that virtio_notify() sends for @vq by up to @usecs
+ * microseconds, so that notifications for several flushes are merged into
+ * one.  The interrupt is sent earlier once @frames notifications are
+ * pending, unless @frames is 0.  A @usecs of 0 disables coalescing.
+ *
+ * virtio_notify_irqfd() is not affected.
+ */
+void virtio_queue_set_coalescing(VirtQueue *vq, uint32_t usecs,
+                                 uint32_t frames)
+{
+    if (vq->coalesce_timer) {
+        virtio_queue_coalesce_flush(vq);
+    }
+    if (usecs && !vq->coalesce_timer) {
+        vq->coalesce_timer = timer_new_us(QEMU_CLOCK_VIRTUAL,
+                                          virtio_queue_coalesce_timer, vq);
+    }
+    vq->coalesce_usecs = usecs;
+    vq->coalesce_frames = frames;
+}
+
+static void virtio_queue_coalesce_reset(VirtQueue *vq)
+{
+    vq->coalesce_pending = 0;
+    if (vq->coalesce_timer) {
+        timer_free(vq->coalesce_timer);
+        vq->coalesce_timer = NULL;
+    }
+    vq->coalesce_usecs = 0;
+    vq->coalesce_frames = 0;
+}
+
 void virtio_notify(VirtIODevice *vdev, VirtQueue *vq)
 {
     WITH_RCU_READ_LOCK_GUARD() {
@@ -2568,6 +2794,25 @@ void virtio_notify(VirtIODevice *vdev, VirtQueue *vq)
         }
     }
 
+    /*
+     * The timer doesn't run while the VM is stopped, and the stop handler
+     * already delivered what was held back, so notify right away then.
+     */
+    if (vq->coalesce_usecs) {
+        vq->coalesce_pending++;
+        if (vdev->vm_running && (!vq->coalesce_frames ||
+                                 vq->coalesce_pending < vq->coalesce_frames)) {
+            if (!timer_pending(vq->coalesce_timer)) {
+                timer_mod(vq->coalesce_timer,
+                          qemu_clock_get_us(QEMU_CLOCK_VIRTUAL) +
+                          vq->coalesce_usecs);
+            }
+            return;
+        }
+        virtio_queue_coalesce_flush(vq);
+        return;
+    }
+
     trace_virtio_notify(vdev, vq);
     virtio_irq(vq);
 }
@@ -3211,8 +3456,26 @@ static void virtio_vmstate_change(void *opaque, int running, RunState state)
     BusState *qbus = qdev_get_parent_bus(DEVICE(vdev));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
     bool backend_run = running && virtio_device_started(vdev, vdev->status);
+    int i;
+
     vdev->vm_running = running;
 
+    /*
+     * Coalesced interrupts are not migrated.  Deliver them while the
+     * interrupt controllers can still take them, before any device state
+     * is saved.
+     */
+    if (!running) {
+        for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+            if (vdev->vq[i].vring.num == 0) {
+                break;
+            }
+            if (vdev->vq[i].coalesce_timer) {
+                virtio_queue_coalesce_flush(&vdev->vq[i]);
+            }
+        }
+    }
+
     if (backend_run) {
         virtio_set_status(vdev, vdev->status);
     }
@@ -3699,6 +3962,8 @@ static void virtio_device_free_virtqueues(VirtIODevice *vdev)
             break;
         }
         virtio_virtqueue_reset_region_cache(&vdev->vq[i]);
+        virtio_queue_free_element_pool(&vdev->vq[i]);
+        virtio_queue_coalesce_reset(&vdev->vq[i]);
     }
     g_free(vdev->vq);
 }
@@ -3720,6 +3985,10 @@ static Property virtio_properties[] = {
     DEFINE_PROP_BOOL("use-disabled-flag", VirtIODevice, use_disabled_flag, true),
     DEFINE_PROP_BOOL("x-disable-legacy-check", VirtIODevice,
                      disable_legacy_check, false),
+    DEFINE_PROP_UINT32("notify-coalesce-usecs", VirtIODevice,
+                       notify_coalesce_usecs, 0),
+    DEFINE_PROP_UINT32("notify-coalesce-frames", VirtIODevice,
+                       notify_coalesce_frames, 0),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -22,6 +22,7 @@
 #include "qemu/event_notifier.h"
 #include "qemu/thread.h"
 #include "qemu/timer.h"
+#include "qemu/log-histogram.h"
 
 typedef struct BlockAIOCB BlockAIOCB;
 typedef void BlockCompletionFunc(void *opaque, int ret);
@@ -121,6 +122,16 @@ struct BHListSlice {
 
 typedef QSLIST_HEAD(, AioHandler) AioHandlerSList;
 
+/*
+ * AioContexts that belong to the same poll group take turns at busy
+ * polling, so that many event loops share a bounded number of host CPUs
+ * worth of polling.
+ */
+typedef struct AioPollGroup {
+    unsigned max_pollers;   /* how many contexts may poll at the same time */
+    unsigned pollers;       /* how many contexts are polling now */
+} AioPollGroup;
+
 struct AioContext {
     GSource source;
 
@@ -197,6 +208,10 @@ struct AioContext {
      */
     struct ThreadPool *thread_pool;
 
+    /* Number of worker threads the thread pool keeps and may grow to */
+    int64_t thread_pool_min;
+    int64_t thread_pool_max;
+
 #ifdef CONFIG_LINUX_AIO
     /*
      * State for native Linux AIO.  Uses aio_context_acquire/release for
@@ -214,6 +229,7 @@ struct AioContext {
     /* State for file descriptor monitoring using Linux io_uring */
     struct io_uring fdmon_io_uring;
     AioHandlerSList submit_list;
+    bool fdmon_io_uring_multishot;  /* use multishot IORING_OP_POLL_ADD? */
 #endif
 
     /* TimerLists for calling timers - one per clock type.  Has its own
@@ -232,6 +248,30 @@ struct AioContext {
     int64_t poll_grow;      /* polling time growth factor */
     int64_t poll_shrink;    /* polling time shrink factor */
 
+    /*
+     * Statistics, only updated in the AioContext's home thread.  The times
+     * are spent in aio_poll(); a nested aio_poll() call also counts towards
+     * the dispatch time of the outer call.
+     */
+    Stat64 stat_aio_polls;          /* aio_poll() calls */
+    Stat64 stat_poll_attempts;      /* times userspace polling ran */
+    Stat64 stat_poll_hits;          /* ...and found work */
+    Stat64 stat_blocking_waits;     /* times the fd monitor was entered */
+    Stat64 stat_bh_calls;           /* bottom halves run */
+    Stat64 stat_poll_time_ns;       /* time spent in userspace polling */
+    Stat64 stat_wait_time_ns;       /* time spent in the fd monitor */
+    Stat64 stat_dispatch_time_ns;   /* time spent dispatching */
+
+    /* How long each fd handler callback ran, in nanoseconds */
+    LogHistogram dispatch_latency;
+
+    /*
+     * Idle time in milliseconds after which the kernel SQ polling thread of
+     * the Linux io_uring instance goes to sleep, or 0 to submit requests
+     * with io_uring_enter() instead of using an SQ polling thread.
+     */
+    int64_t io_uring_sqpoll_idle;
+
     /*
      * List of handlers participating in userspace polling.  Protected by
      * ctx->list_lock.  Iterated and modified mostly by the event loop thread
@@ -243,6 +283,9 @@ struct AioContext {
     /* Are we in polling mode or monitoring file descriptors? */
     bool poll_started;
 
+    /* Poll group that limits how many contexts poll at once, or NULL */
+    AioPollGroup *poll_group;
+
     /* epoll(7) state used when built with CONFIG_EPOLL */
     int epollfd;
 
@@ -727,4 +770,42 @@ void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
                                  int64_t grow, int64_t shrink,
                                  Error **errp);
 
+/**
+ * aio_context_set_thread_pool_params:
+ * @ctx: the aio context
+ * @min: number of worker threads that stay alive even when idle
+ * @max: maximum number of worker threads
+ *
+ * Applies immediately if the thread pool of @ctx already exists: workers
+ * are started to reach @min, and idle workers above @max exit.
+ */
+void aio_context_set_thread_pool_params(AioContext *ctx, int64_t min,
+                                        int64_t max, Error **errp);
+
+/**
+ * aio_context_set_poll_group:
+ * @ctx: the aio context
+ * @group: the poll group to join, or NULL
+ *
+ * A context in a poll group only busy polls while fewer than
+ * @group->max_pollers contexts of the group do; otherwise it monitors
+ * file descriptors right away.  The group must be set before the event
+ * loop of @ctx starts running and must outlive it.
+ */
+void aio_context_set_poll_group(AioContext *ctx, AioPollGroup *group);
+
+/**
+ * aio_context_set_io_uring_params:
+ * @ctx: the aio context
+ * @sqpoll_idle: idle time of the kernel submission queue polling thread in
+ *               milliseconds, or 0 to disable submission queue polling
+ *
+ * The parameters only take effect if they are set before the Linux io_uring
+ * instance of @ctx is created by aio_setup_linux_io_uring().
+ *
+ * Returns true on success, false with @errp set on failure.
+ */
+bool aio_context_set_io_uring_params(AioContext *ctx, int64_t sqpoll_idle,
+                                     Error **errp);
+
 #endif
@@ -33,6 +33,9 @@ void block_copy_set_progress_callback(
 
 void block_copy_set_progress_meter(BlockCopyState *s, ProgressMeter *pm);
 
+void block_copy_set_async_write(BlockCopyState *s, BlockDriverState *bs,
+                                int64_t max_bytes);
+
 void block_copy_state_free(BlockCopyState *s);
 
 int64_t block_copy_reset_unallocated(BlockCopyState *s,
@@ -40,6 +43,9 @@ int64_t block_copy_reset_unallocated(BlockCopyState *s,
 
 int coroutine_fn block_copy(BlockCopyState *s, int64_t offset, int64_t bytes,
                             bool *error_is_read);
+int coroutine_fn block_copy_before_write(BlockCopyState *s, int64_t offset,
+                                         int64_t bytes, bool *error_is_read);
+int coroutine_fn block_copy_wait_async(BlockCopyState *s);
 
 BdrvDirtyBitmap *block_copy_dirty_bitmap(BlockCopyState *s);
 void block_copy_set_skip_unallocated(BlockCopyState *s, bool skip);
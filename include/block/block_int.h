@@ -32,6 +32,7 @@
 #include "qemu/stats64.h"
 #include "qemu/timer.h"
 #include "qemu/hbitmap.h"
+#include "qemu/log-histogram.h"
 #include "block/snapshot.h"
 #include "qemu/throttle.h"
 
@@ -75,6 +76,7 @@ typedef struct BdrvTrackedRequest {
     int64_t offset;
     uint64_t bytes;
     enum BdrvTrackedRequestType type;
+    int64_t start_ns;
 
     bool serialising;
     int64_t overlap_offset;
@@ -953,6 +955,13 @@ struct BlockDriverState {
     /* Offset after the highest byte written to */
     Stat64 wr_highest_offset;
 
+    /*
+     * Latency of the requests processed by this node, by BlockAcctType.
+     * Measured from the point a request enters the node in the generic
+     * block layer, so it includes the time spent in its children.
+     */
+    LogHistogram latency[BLOCK_MAX_IOTYPE];
+
     /* If true, copy read backing sectors into image.  Can be >1 if more
      * than one client has requested copy-on-read.  Accessed with atomic
      * ops.
@@ -1247,6 +1256,8 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
  * @sync_mode: What parts of the disk image should be copied to the destination.
  * @sync_bitmap: The dirty bitmap if sync_mode is 'bitmap' or 'incremental'
  * @bitmap_mode: The bitmap synchronization policy to use.
+ * @cbw_buffer_size: How much old data guest writes may leave in memory
+ *                   for a background write to @target, or 0.
  * @on_source_error: The action to take upon error reading from the source.
  * @on_target_error: The action to take upon error writing to the target.
  * @creation_flags: Flags that control the behavior of the Job lifetime.
@@ -1264,6 +1275,7 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
                             BdrvDirtyBitmap *sync_bitmap,
                             BitmapSyncMode bitmap_mode,
                             bool compress,
+                            int64_t cbw_buffer_size,
                             const char *filter_node_name,
                             BlockdevOnError on_source_error,
                             BlockdevOnError on_target_error,
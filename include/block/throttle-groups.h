@@ -57,6 +57,16 @@ typedef struct ThrottleGroupMember {
     unsigned       pending_reqs[2];
     QLIST_ENTRY(ThrottleGroupMember) round_robin;
 
+    /* Budget that has already been accounted in the group's ThrottleState
+     * and that this member can use without taking the group lock.  A
+     * negative value means that the corresponding limit is not set.  These
+     * fields are only accessed from the member's AioContext; the budget is
+     * only valid while cache_gen matches the group's generation. */
+    double         cached_units[2];
+    double         cached_bytes[2];
+    uint64_t       cached_op_size;
+    unsigned       cache_gen;
+
 } ThrottleGroupMember;
 
 #define TYPE_THROTTLE_GROUP "throttle-group"
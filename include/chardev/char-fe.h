@@ -206,6 +206,18 @@ guint qemu_chr_fe_add_watch(CharBackend *be, GIOCondition cond,
  */
 int qemu_chr_fe_write(CharBackend *be, const uint8_t *buf, int len);
 
+/**
+ * qemu_chr_fe_writev:
+ * @iov: the data
+ * @iovcnt: the number of elements in @iov
+ *
+ * Like qemu_chr_fe_write(), but for a scatter/gather list.  Backends
+ * that support it write the whole list with one system call.
+ *
+ * Returns: the number of bytes consumed (0 if no associated Chardev)
+ */
+int qemu_chr_fe_writev(CharBackend *be, const struct iovec *iov, int iovcnt);
+
 /**
  * qemu_chr_fe_write_all:
  * @buf: the data
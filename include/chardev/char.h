@@ -65,6 +65,10 @@ struct Chardev {
     char *filename;
     int logfd;
     int be_open;
+    /* Output queued for flush_delay milliseconds, NULL if not coalescing */
+    GByteArray *outbuf;
+    QEMUTimer *flush_timer;
+    uint32_t flush_delay;
     GSource *gsource;
     GMainContext *gcontext;
     DECLARE_BITMAP(features, QEMU_CHAR_FEATURE_LAST);
@@ -223,6 +227,24 @@ QemuOpts *qemu_chr_parse_compat(const char *label, const char *filename,
                                 bool permit_mux_mon);
 int qemu_chr_write(Chardev *s, const uint8_t *buf, int len, bool write_all);
 #define qemu_chr_write_all(s, buf, len) qemu_chr_write(s, buf, len, true)
+
+/**
+ * qemu_chr_writev:
+ *
+ * Write a scatter/gather list without waiting for the backend, with a
+ * single system call if the backend supports it.  Like qemu_chr_write()
+ * without write_all, it returns the number of bytes written, which can
+ * be less than the size of @iov, or -1 with errno set.
+ */
+int qemu_chr_writev(Chardev *s, const struct iovec *iov, int iovcnt);
+
+/**
+ * qemu_chr_flush:
+ *
+ * Write out the output that the flush-delay option queued, waiting
+ * until the backend accepts it.
+ */
+void qemu_chr_flush(Chardev *s);
 int qemu_chr_wait_connected(Chardev *chr, Error **errp);
 
 #define TYPE_CHARDEV "chardev"
@@ -257,6 +279,8 @@ struct ChardevClass {
                  bool *be_opened, Error **errp);
 
     int (*chr_write)(Chardev *s, const uint8_t *buf, int len);
+    /* optional, write a scatter/gather list at once; may write less */
+    int (*chr_writev)(Chardev *s, const struct iovec *iov, int iovcnt);
     int (*chr_sync_read)(Chardev *s, const uint8_t *buf, int len);
     GSource *(*chr_add_watch)(Chardev *s, GIOCondition cond);
     void (*chr_update_read_handler)(Chardev *s);
@@ -56,6 +56,7 @@ struct QCryptoTLSCreds {
 #endif
     bool verifyPeer;
     char *priority;
+    bool ktls;
 };
 
 
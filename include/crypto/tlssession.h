@@ -321,4 +321,29 @@ int qcrypto_tls_session_get_key_size(QCryptoTLSSession *sess,
  */
 char *qcrypto_tls_session_get_peer_name(QCryptoTLSSession *sess);
 
+/**
+ * qcrypto_tls_session_enable_ktls_tx:
+ * @sess: the TLS session object
+ * @fd: the TCP socket that carries the session
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * If the credentials of @sess have the "x-ktls" property set,
+ * hand the transmit side of the session over to the kernel, so
+ * that payload data written in clear text to @fd is encrypted
+ * by the kernel.  This must be called once the handshake is
+ * complete, and qcrypto_tls_session_write() must not be used
+ * afterwards.
+ *
+ * The receive side is still handled by @sess, since the kernel
+ * does not process the TLS control messages that may arrive.
+ * The peer must not request a TLS 1.3 key update, because it
+ * would make @sess write records with stale keys.
+ *
+ * Returns: 1 if kernel TLS was enabled, 0 if it was not
+ * requested, -1 on error
+ */
+int qcrypto_tls_session_enable_ktls_tx(QCryptoTLSSession *sess,
+                                       int fd,
+                                       Error **errp);
+
 #endif /* QCRYPTO_TLSSESSION_H */
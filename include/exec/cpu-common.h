@@ -47,6 +47,14 @@ extern ram_addr_t ram_size;
 /* memory API */
 
 void qemu_ram_remap(ram_addr_t addr, ram_addr_t length);
+/*
+ * Replace the memory of @block, which must be private anonymous memory,
+ * with a copy-on-write mapping of @fd at @offset.  The pages are then
+ * only read from the file when they are first accessed, and writes do
+ * not reach the file.  Returns 0 on success, or -1 with @errp set.
+ */
+int qemu_ram_map_file_private(RAMBlock *block, int fd, off_t offset,
+                              Error **errp);
 /* This should not be used by devices.  */
 ram_addr_t qemu_ram_addr_from_host(void *ptr);
 RAMBlock *qemu_ram_block_by_name(const char *name);
@@ -86,8 +94,6 @@ void *cpu_physical_memory_map(hwaddr addr,
                               bool is_write);
 void cpu_physical_memory_unmap(void *buffer, hwaddr len,
                                bool is_write, hwaddr access_len);
-void cpu_register_map_client(QEMUBH *bh);
-void cpu_unregister_map_client(QEMUBH *bh);
 
 bool cpu_physical_memory_is_io(hwaddr phys_addr);
 
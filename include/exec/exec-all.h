@@ -519,6 +519,21 @@ struct TranslationBlock {
     uintptr_t jmp_list_head;
     uintptr_t jmp_list_next[2];
     uintptr_t jmp_dest[2];
+
+    /*
+     * Number of times the TB was entered, when the tcg accelerator's
+     * tb-profile option is on and the counter table was not full when
+     * the TB was generated; NULL otherwise.  The increments are not
+     * atomic, so the counts are approximate with MTTCG.
+     */
+    uint64_t *exec_count;
+
+    /*
+     * Where the indirect jumps of this TB went last time, tried first by
+     * HELPER(lookup_tb_ptr).  Accessed in parallel; all accesses must be
+     * atomic.
+     */
+    struct TranslationBlock *ind_next;
 };
 
 extern bool parallel_cpus;
@@ -61,6 +61,17 @@ static inline void gen_tb_start(const TranslationBlock *tb)
 
     tcg_gen_brcondi_i32(TCG_COND_LT, count, 0, tcg_ctx->exitreq_label);
 
+    if (tb->exec_count) {
+        TCGv_ptr ptr = tcg_const_ptr(tb->exec_count);
+        TCGv_i64 val = tcg_temp_new_i64();
+
+        tcg_gen_ld_i64(val, ptr, 0);
+        tcg_gen_addi_i64(val, val, 1);
+        tcg_gen_st_i64(val, ptr, 0);
+        tcg_temp_free_i64(val);
+        tcg_temp_free_ptr(ptr);
+    }
+
     if (tb_cflags(tb) & CF_USE_ICOUNT) {
         tcg_gen_st16_i32(count, cpu_env,
                          offsetof(ArchCPU, neg.icount_decr.u16.low) -
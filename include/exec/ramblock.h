@@ -43,6 +43,31 @@ struct RAMBlock {
     unsigned long *bmap;
     /* bitmap of already received pages in postcopy */
     unsigned long *receivedmap;
+    /*
+     * For each page, the multifd channel (id + 1) whose cache holds the
+     * version of the page that was sent last, or 0.  Only allocated on
+     * the source with the xbzrle multifd compression method.
+     */
+    uint8_t *multifd_owner;
+    /*
+     * With multifd, bitmap of the pages the guest reported free since the
+     * last bitmap sync, so that the channels don't send them.
+     */
+    unsigned long *free_bmap;
+    /*
+     * With mapped-ram, bitmap of the pages that were saved to the file,
+     * and the offsets in the file of that bitmap and of the pages.
+     */
+    unsigned long *file_bmap;
+    off_t bitmap_offset;
+    off_t pages_offset;
+    /*
+     * On the destination of a postcopy migration with minor faults, a
+     * second mapping of the backing file that userfaultfd does not
+     * watch; incoming pages are written through it and then mapped at
+     * @host with UFFDIO_CONTINUE.
+     */
+    uint8_t *host_mirror;
 
     /*
      * bitmap to track already cleared dirty bitmap.  When the bit is
@@ -16,36 +16,95 @@
 #include "exec/exec-all.h"
 #include "exec/tb-hash.h"
 
-/* Might cause an exception, so have a longjmp destination ready */
+/* Add @tb in front of the jump cache set @hash, evicting the oldest entry */
+static inline void tb_jmp_cache_insert(CPUState *cpu, uint32_t hash,
+                                       TranslationBlock *tb)
+{
+    TranslationBlock **set = &cpu->tb_jmp_cache[hash * TB_JMP_CACHE_WAYS];
+    int way;
+
+    for (way = TB_JMP_CACHE_WAYS - 1; way > 0; way--) {
+        qatomic_set(&set[way], qatomic_read(&set[way - 1]));
+    }
+    qatomic_set(&set[0], tb);
+}
+
+static inline bool tb_lookup_cmp(CPUState *cpu, const TranslationBlock *tb,
+                                 target_ulong pc, target_ulong cs_base,
+                                 uint32_t flags, uint32_t cf_mask)
+{
+    return tb &&
+           tb->pc == pc &&
+           tb->cs_base == cs_base &&
+           tb->flags == flags &&
+           tb->trace_vcpu_dstate == *cpu->trace_dstate &&
+           (tb_cflags(tb) & (CF_HASH_MASK | CF_INVALID)) == cf_mask;
+}
+
+/*
+ * Like tb_lookup__cpu_state(), but try *@hint first if @hint is not NULL,
+ * and leave the TB that was found there.
+ *
+ * Might cause an exception, so have a longjmp destination ready.
+ */
 static inline TranslationBlock *
-tb_lookup__cpu_state(CPUState *cpu, target_ulong *pc, target_ulong *cs_base,
-                     uint32_t *flags, uint32_t cf_mask)
+tb_lookup__cpu_state_hint(CPUState *cpu, TranslationBlock **hint,
+                          target_ulong *pc, target_ulong *cs_base,
+                          uint32_t *flags, uint32_t cf_mask)
 {
     CPUArchState *env = (CPUArchState *)cpu->env_ptr;
-    TranslationBlock *tb;
+    TranslationBlock *tb, **set;
     uint32_t hash;
+    int way;
 
     cpu_get_tb_cpu_state(env, pc, cs_base, flags);
-    hash = tb_jmp_cache_hash_func(*pc);
-    tb = qatomic_rcu_read(&cpu->tb_jmp_cache[hash]);
 
     cf_mask &= ~CF_CLUSTER_MASK;
     cf_mask |= cpu->cluster_index << CF_CLUSTER_SHIFT;
 
-    if (likely(tb &&
-               tb->pc == *pc &&
-               tb->cs_base == *cs_base &&
-               tb->flags == *flags &&
-               tb->trace_vcpu_dstate == *cpu->trace_dstate &&
-               (tb_cflags(tb) & (CF_HASH_MASK | CF_INVALID)) == cf_mask)) {
-        return tb;
+    if (hint) {
+        tb = qatomic_rcu_read(hint);
+        if (likely(tb_lookup_cmp(cpu, tb, *pc, *cs_base, *flags, cf_mask))) {
+            return tb;
+        }
     }
+
+    hash = tb_jmp_cache_hash_func(*pc);
+    set = &cpu->tb_jmp_cache[hash * TB_JMP_CACHE_WAYS];
+    for (way = 0; way < TB_JMP_CACHE_WAYS; way++) {
+        tb = qatomic_rcu_read(&set[way]);
+        if (likely(tb_lookup_cmp(cpu, tb, *pc, *cs_base, *flags, cf_mask))) {
+            if (way) {
+                /*
+                 * Invalidation may race with this, but a stale entry
+                 * is harmless: it fails the CF_INVALID check.
+                 */
+                qatomic_set(&set[way], qatomic_read(&set[0]));
+                qatomic_set(&set[0], tb);
+            }
+            cpu->tb_jmp_cache_hits++;
+            goto found;
+        }
+    }
+    cpu->tb_jmp_cache_misses++;
     tb = tb_htable_lookup(cpu, *pc, *cs_base, *flags, cf_mask);
     if (tb == NULL) {
         return NULL;
     }
-    qatomic_set(&cpu->tb_jmp_cache[hash], tb);
+    tb_jmp_cache_insert(cpu, hash, tb);
+ found:
+    if (hint) {
+        qatomic_set(hint, tb);
+    }
     return tb;
 }
 
+/* Might cause an exception, so have a longjmp destination ready */
+static inline TranslationBlock *
+tb_lookup__cpu_state(CPUState *cpu, target_ulong *pc, target_ulong *cs_base,
+                     uint32_t *flags, uint32_t cf_mask)
+{
+    return tb_lookup__cpu_state_hint(cpu, NULL, pc, cs_base, flags, cf_mask);
+}
+
 #endif /* EXEC_TB_LOOKUP_H */
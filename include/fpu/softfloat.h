@@ -278,6 +278,11 @@ static inline bool float16_is_normal(float16 a)
     return (((float16_val(a) >> 10) + 1) & 0x1f) >= 2;
 }
 
+static inline bool float16_is_zero_or_normal(float16 a)
+{
+    return float16_is_normal(a) || float16_is_zero(a);
+}
+
 static inline float16 float16_abs(float16 a)
 {
     /* Note that abs does *not* handle NaN specially, nor does
@@ -458,6 +463,11 @@ static inline bool bfloat16_is_normal(bfloat16 a)
     return (((a >> 7) + 1) & 0xff) >= 2;
 }
 
+static inline bool bfloat16_is_zero_or_normal(bfloat16 a)
+{
+    return bfloat16_is_normal(a) || bfloat16_is_zero(a);
+}
+
 static inline bfloat16 bfloat16_abs(bfloat16 a)
 {
     /* Note that abs does *not* handle NaN specially, nor does
@@ -573,6 +583,14 @@ float32 float32_add(float32, float32, float_status *status);
 float32 float32_sub(float32, float32, float_status *status);
 float32 float32_mul(float32, float32, float_status *status);
 float32 float32_div(float32, float32, float_status *status);
+void float32_add_array(float32 *, const float32 *, const float32 *,
+                       size_t, float_status *status);
+void float32_sub_array(float32 *, const float32 *, const float32 *,
+                       size_t, float_status *status);
+void float32_mul_array(float32 *, const float32 *, const float32 *,
+                       size_t, float_status *status);
+void float32_div_array(float32 *, const float32 *, const float32 *,
+                       size_t, float_status *status);
 float32 float32_rem(float32, float32, float_status *status);
 float32 float32_muladd(float32, float32, float32, int, float_status *status);
 float32 float32_sqrt(float32, float_status *status);
@@ -763,6 +781,14 @@ float64 float64_add(float64, float64, float_status *status);
 float64 float64_sub(float64, float64, float_status *status);
 float64 float64_mul(float64, float64, float_status *status);
 float64 float64_div(float64, float64, float_status *status);
+void float64_add_array(float64 *, const float64 *, const float64 *,
+                       size_t, float_status *status);
+void float64_sub_array(float64 *, const float64 *, const float64 *,
+                       size_t, float_status *status);
+void float64_mul_array(float64 *, const float64 *, const float64 *,
+                       size_t, float_status *status);
+void float64_div_array(float64 *, const float64 *, const float64 *,
+                       size_t, float_status *status);
 float64 float64_rem(float64, float64, float_status *status);
 float64 float64_muladd(float64, float64, float64, int, float_status *status);
 float64 float64_sqrt(float64, float_status *status);
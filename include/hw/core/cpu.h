@@ -27,6 +27,7 @@
 #include "qapi/qapi-types-run-state.h"
 #include "qemu/bitmap.h"
 #include "qemu/rcu_queue.h"
+#include "qemu/stats64.h"
 #include "qemu/queue.h"
 #include "qemu/thread.h"
 #include "qemu/plugin.h"
@@ -279,12 +280,19 @@ typedef struct SavedIOTLB {
 
 struct KVMState;
 struct kvm_run;
+struct kvm_dirty_gfn;
+typedef struct KVMVCPUStats KVMVCPUStats;
 
 struct hax_vcpu_state;
 struct hvf_vcpu_state;
 
+/*
+ * The jump cache has TB_JMP_CACHE_SIZE sets of TB_JMP_CACHE_WAYS entries.
+ * The entries of a set are adjacent, the most recently used one first.
+ */
 #define TB_JMP_CACHE_BITS 12
 #define TB_JMP_CACHE_SIZE (1 << TB_JMP_CACHE_BITS)
+#define TB_JMP_CACHE_WAYS 2
 
 /* work queue */
 
@@ -327,12 +335,16 @@ struct qemu_work_item;
  * @created: Indicates whether the CPU thread has been successfully created.
  * @interrupt_request: Indicates a pending interrupt request.
  * @halted: Nonzero if the CPU is in suspended state.
+ * @halt_poll_ns: How long the vCPU thread polls for work when the CPU
+ * becomes idle, adjusted after each halt; see halt-poll-max-ns.
  * @stop: Indicates a pending stop request.
  * @stopped: Indicates the CPU has been artificially stopped.
  * @unplug: Indicates a pending CPU unplug request.
  * @crash_occurred: Indicates the OS reported a crash (panic) for this CPU
  * @singlestep_enabled: Flags for single-stepping.
  * @icount_extra: Instructions until next timer event.
+ * @icount_local: Instruction count reached by this CPU, used instead of
+ * the global count when icount runs with MTTCG.
  * @can_do_io: Nonzero if memory-mapped IO is safe. Deterministic execution
  * requires that IO only be performed on the last instruction of a TB
  * so that interrupts take effect immediately.
@@ -395,6 +407,7 @@ struct CPUState {
     int singlestep_enabled;
     int64_t icount_budget;
     int64_t icount_extra;
+    int64_t icount_local;
     uint64_t random_seed;
     sigjmp_buf jmp_env;
 
@@ -410,7 +423,11 @@ struct CPUState {
     IcountDecr *icount_decr_ptr;
 
     /* Accessed in parallel; all accesses must be atomic */
-    struct TranslationBlock *tb_jmp_cache[TB_JMP_CACHE_SIZE];
+    struct TranslationBlock *tb_jmp_cache[TB_JMP_CACHE_SIZE *
+                                          TB_JMP_CACHE_WAYS];
+    /* Only updated by the vCPU thread, read by "info jit" */
+    uint64_t tb_jmp_cache_hits;
+    uint64_t tb_jmp_cache_misses;
 
     struct GDBRegisterState *gdb_regs;
     int gdb_num_regs;
@@ -433,6 +450,9 @@ struct CPUState {
     int kvm_fd;
     struct KVMState *kvm_state;
     struct kvm_run *kvm_run;
+    struct kvm_dirty_gfn *kvm_dirty_gfns;
+    uint32_t kvm_fetch_index;
+    KVMVCPUStats *kvm_stats;
 
     /* Used for events with 'vcpu' and *without* the 'disabled' properties */
     DECLARE_BITMAP(trace_dstate_delayed, CPU_TRACE_DSTATE_MAX_EVENTS);
@@ -450,6 +470,7 @@ struct CPUState {
     int cpu_index;
     int cluster_index;
     uint32_t halted;
+    int64_t halt_poll_ns;
     uint32_t can_do_io;
     int32_t exception_index;
 
@@ -460,6 +481,10 @@ struct CPUState {
      * autoconverge
      */
     bool throttle_thread_scheduled;
+    /* Throttle percentage of this vCPU, when they are throttled apart */
+    int throttle_percentage;
+    /* Pages dirtied by this vCPU, if the accelerator can tell them apart */
+    Stat64 dirty_pages;
 
     bool ignore_memory_transaction_failures;
 
@@ -486,7 +511,7 @@ static inline void cpu_tb_jmp_cache_clear(CPUState *cpu)
 {
     unsigned int i;
 
-    for (i = 0; i < TB_JMP_CACHE_SIZE; i++) {
+    for (i = 0; i < TB_JMP_CACHE_SIZE * TB_JMP_CACHE_WAYS; i++) {
         qatomic_set(&cpu->tb_jmp_cache[i], NULL);
     }
 }
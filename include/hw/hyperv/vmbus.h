@@ -12,6 +12,7 @@
 
 #include "sysemu/sysemu.h"
 #include "sysemu/dma.h"
+#include "sysemu/iothread.h"
 #include "hw/qdev-core.h"
 #include "migration/vmstate.h"
 #include "hw/hyperv/vmbus-proto.h"
@@ -50,6 +51,11 @@ struct VMBusDeviceClass {
     QemuUUID instanceid;     /* Fixed UUID for singleton devices */
     uint16_t channel_flags;
     uint16_t mmio_size_mb;
+    /*
+     * The device worker can run outside the BQL, so the device gets an
+     * "iothread" property to process its channels in an IOThread.
+     */
+    bool iothread_capable;
 
     /* Extentions to standard device callbacks */
     void (*vmdev_realize)(VMBusDevice *vdev, Error **errp);
@@ -83,6 +89,12 @@ struct VMBusDevice {
     uint16_t num_channels;
     VMBusChannel *channels;
     AddressSpace *dma_as;
+    /*
+     * If set, guest->host notifications of the channels are handled, and
+     * the device worker invoked, in this IOThread with its AioContext
+     * acquired rather than in the main loop.
+     */
+    IOThread *iothread;
 };
 
 extern const VMStateDescription vmstate_vmbus_dev;
@@ -107,6 +119,11 @@ VMBusChannel *vmbus_device_channel(VMBusDevice *dev, uint32_t chan_idx);
 uint32_t vmbus_channel_idx(VMBusChannel *chan);
 bool vmbus_channel_is_open(VMBusChannel *chan);
 
+/*
+ * The AioContext in which the device worker of the channel runs.
+ */
+AioContext *vmbus_channel_get_aio_context(VMBusChannel *chan);
+
 /*
  * Notify (on guest's behalf) the host side of the channel that there's data in
  * the ringbuffer to process.
@@ -109,6 +109,8 @@ struct VTDAddressSpace {
     /* Superset of notifier flags that this address space has */
     IOMMUNotifierFlag notifier_flags;
     IOVATree *iova_tree;          /* Traces mapped IOVA ranges */
+    GHashTable *iotlb;            /* IOTLB entries of this device */
+    QLIST_ENTRY(VTDAddressSpace) iotlb_next;
 };
 
 struct VTDBus {
@@ -250,7 +252,14 @@ struct IntelIOMMUState {
     uint64_t ecap;                  /* The value of extended capability reg */
 
     uint32_t context_cache_gen;     /* Should be in [1,MAX] */
-    GHashTable *iotlb;              /* IOTLB */
+    /* Devices with a non-empty IOTLB, and the total number of entries */
+    QLIST_HEAD(, VTDAddressSpace) vtd_as_with_iotlb;
+    uint32_t iotlb_size;
+
+    /* Page-selective invalidation from the QI that is not notified yet */
+    uint16_t psi_domain_id;
+    hwaddr psi_addr;
+    hwaddr psi_size;                /* Zero if there is none */
 
     GHashTable *vtd_as_by_busptr;   /* VTDBus objects indexed by PCIBus* reference */
     VTDBus *vtd_as_by_bus_num[VTD_PCI_BUS_MAX]; /* VTDBus objects indexed by bus number */
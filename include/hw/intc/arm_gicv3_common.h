@@ -204,6 +204,8 @@ struct GICv3CPUState {
     PendingIrq hppi;
     /* This is temporary working state, to avoid a malloc in gicv3_update() */
     bool seenbetter;
+    /* hppi before gicv3_update() or gicv3_full_update() recalculated it */
+    PendingIrq last_hppi;
 };
 
 struct GICv3State {
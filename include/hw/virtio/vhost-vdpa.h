@@ -16,6 +16,8 @@
 
 typedef struct vhost_vdpa {
     int device_fd;
+    /* queue pair served by this vhost_dev, the device is shared by all */
+    int index;
     uint32_t msg_type;
     MemoryListener listener;
     struct vhost_dev *dev;
@@ -65,6 +65,17 @@ struct VirtIOBalloon {
      */
     bool block_iothread;
     NotifierWithReturn free_page_hint_notify;
+    /*
+     * Free page reports whose memory is being discarded in @iothread.  The
+     * reporting queue is not processed until report_done_bh answered them.
+     */
+    GPtrArray *report_elems;
+    GArray *report_ranges;
+    bool report_in_flight;
+    QemuEvent report_done;
+    QEMUBH *report_done_bh;
+    /* processes the reports put back into the queue on migration */
+    VMChangeStateEntry *report_vmstate;
     int64_t stats_last_update;
     int64_t stats_poll_interval;
     uint32_t host_features;
@@ -17,6 +17,7 @@
 #include "hw/virtio/virtio.h"
 #include "qapi/qapi-types-misc.h"
 #include "sysemu/hostmem.h"
+#include "qemu/thread.h"
 #include "qom/object.h"
 
 #define TYPE_VIRTIO_MEM "virtio-mem"
@@ -30,6 +31,7 @@ OBJECT_DECLARE_TYPE(VirtIOMEM, VirtIOMEMClass,
 #define VIRTIO_MEM_REQUESTED_SIZE_PROP "requested-size"
 #define VIRTIO_MEM_BLOCK_SIZE_PROP "block-size"
 #define VIRTIO_MEM_ADDR_PROP "memaddr"
+#define VIRTIO_MEM_PREALLOC_PROP "prealloc"
 
 struct VirtIOMEM {
     VirtIODevice parent_obj;
@@ -62,6 +64,26 @@ struct VirtIOMEM {
     /* block size and alignment */
     uint64_t block_size;
 
+    /* preallocate blocks before acknowledging that they are plugged */
+    bool prealloc;
+
+    /*
+     * Plug or unplug request whose memory @worker is preallocating or
+     * discarding.  No other request is processed until it completes in
+     * @done_bh.
+     */
+    VirtQueueElement *pending_elem;
+    uint64_t pending_gpa;
+    uint64_t pending_size;
+    bool pending_plug;
+    bool pending_cancel;
+    int pending_ret;
+    QemuThread worker;
+    QEMUBH *done_bh;
+
+    /* process requests given back to the queue on migration */
+    VMChangeStateEntry *vmstate;
+
     /* notifiers to notify when "size" changes */
     NotifierList size_change_notifiers;
 
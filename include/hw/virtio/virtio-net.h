@@ -20,6 +20,8 @@
 #include "net/announce.h"
 #include "qemu/option_int.h"
 #include "qom/object.h"
+#include "sysemu/iothread.h"
+#include "ebpf/ebpf_rss.h"
 
 #define TYPE_VIRTIO_NET "virtio-net-device"
 OBJECT_DECLARE_SIMPLE_TYPE(VirtIONet, VIRTIO_NET)
@@ -45,6 +47,7 @@ typedef struct virtio_net_conf
     char *duplex_str;
     uint8_t duplex;
     char *primary_id_str;
+    IOThread *iothread;
 } virtio_net_conf;
 
 /* Coalesced packets type & status */
@@ -64,7 +67,6 @@ typedef struct VirtioNetRscStat {
     uint32_t empty_cache;
     uint32_t no_match_cache;
     uint32_t win_update;
-    uint32_t no_match;
     uint32_t tcp_syn;
     uint32_t tcp_ctrl_drain;
     uint32_t dup_ack;
@@ -85,6 +87,7 @@ typedef struct VirtioNetRscStat {
     uint32_t purge_failed;
     uint32_t drain_failed;
     uint32_t final_failed;
+    uint32_t evicted;
     int64_t  timer;
 } VirtioNetRscStat;
 
@@ -92,14 +95,22 @@ typedef struct VirtioNetRscStat {
 typedef struct VirtioNetRscUnit {
     void *ip;   /* ip header */
     uint16_t *ip_plen;      /* data len pointer in ip header field */
+    uint16_t ip_hdrlen;     /* ip header len, including ipv6 extensions */
     struct tcp_header *tcp; /* tcp header */
     uint16_t tcp_hdrlen;    /* tcp header len */
     uint16_t payload;       /* pure payload without virtio/eth/ip/tcp */
 } VirtioNetRscUnit;
 
+/* Lookup key of a tcp connection, ipv4 only uses 8 bytes of addr */
+typedef struct VirtioNetRscFlow {
+    uint8_t addr[32];       /* saddr + daddr */
+    uint32_t ports;         /* sport + dport */
+} VirtioNetRscFlow;
+
 /* Coalesced segment */
 typedef struct VirtioNetRscSeg {
     QTAILQ_ENTRY(VirtioNetRscSeg) next;
+    VirtioNetRscFlow flow;
     void *buf;
     size_t size;
     uint16_t packets;
@@ -118,7 +129,8 @@ typedef struct VirtioNetRscChain {
     uint8_t  gso_type;
     uint16_t max_payload;
     QEMUTimer *drain_timer;
-    QTAILQ_HEAD(, VirtioNetRscSeg) buffers;
+    QTAILQ_HEAD(, VirtioNetRscSeg) buffers; /* oldest first */
+    GHashTable *flows;                       /* VirtioNetRscFlow -> seg */
     VirtioNetRscStat stat;
 } VirtioNetRscChain;
 
@@ -130,6 +142,7 @@ typedef struct VirtioNetRscChain {
 
 typedef struct VirtioNetRssData {
     bool    enabled;
+    bool    enabled_software_rss;   /* false when steered by eBPF in tap */
     bool    redirect;
     bool    populate_hash;
     uint32_t hash_types;
@@ -149,6 +162,12 @@ typedef struct VirtIONetQueue {
         VirtQueueElement *elem;
     } async_tx;
     struct VirtIONet *n;
+    /* AioContext of the IOThread running the queue pair, NULL if none */
+    AioContext *ctx;
+    QEMUBH *dataplane_tx_bh;
+    /* The guest is notified at the end of a batch of received packets */
+    bool rx_batch;
+    bool rx_notify_pending;
 } VirtIONetQueue;
 
 struct VirtIONet {
@@ -179,6 +198,8 @@ struct VirtIONet {
     uint8_t nouni;
     uint8_t nobcast;
     uint8_t vhost_started;
+    bool dataplane_started;
+    bool dataplane_disabled;
     struct {
         uint32_t in_use;
         uint32_t first_multi;
@@ -193,6 +214,8 @@ struct VirtIONet {
     int multiqueue;
     uint16_t max_queues;
     uint16_t curr_queues;
+    /* peers, including the backend of the control virtqueue if any */
+    uint16_t max_ncs;
     size_t config_size;
     char *netclient_name;
     char *netclient_type;
@@ -214,6 +237,7 @@ struct VirtIONet {
     Notifier migration_state;
     VirtioNetRssData rss_data;
     struct NetRxPkt *rx_pkt;
+    EBPFRSSContext ebpf_rss;
 };
 
 void virtio_net_set_netclient_name(VirtIONet *n, const char *name,
@@ -91,6 +91,9 @@ struct VirtIOSCSI {
     bool dataplane_starting;
     bool dataplane_stopping;
     bool dataplane_fenced;
+    QEMUBH *notify_bh;              /* bh for guest notification */
+    unsigned long *batch_notify_vqs;
+    bool batch_notifications;
     uint32_t host_features;
 };
 
@@ -160,7 +163,9 @@ void virtio_scsi_push_event(VirtIOSCSI *s, SCSIDevice *dev,
                             uint32_t event, uint32_t reason);
 
 void virtio_scsi_dataplane_setup(VirtIOSCSI *s, Error **errp);
+void virtio_scsi_dataplane_cleanup(VirtIOSCSI *s);
 int virtio_scsi_dataplane_start(VirtIODevice *s);
 void virtio_scsi_dataplane_stop(VirtIODevice *s);
+void virtio_scsi_dataplane_notify(VirtIOSCSI *s, VirtQueue *vq);
 
 #endif /* QEMU_VIRTIO_SCSI_H */
@@ -80,6 +80,13 @@ struct VirtIOSerialPortClass {
      */
     ssize_t (*have_data)(VirtIOSerialPort *port, const uint8_t *buf,
                          ssize_t len);
+
+    /*
+     * Optional, like have_data but for all the remaining buffers of a
+     * request at once, so that they can be passed on without copying.
+     */
+    ssize_t (*have_data_iov)(VirtIOSerialPort *port, const struct iovec *iov,
+                             int iovcnt);
 };
 
 /*
@@ -133,6 +140,12 @@ struct VirtIOSerialPort {
     uint32_t iov_idx;
     uint64_t iov_offset;
 
+    /*
+     * Number of elements of ovq that were consumed and filled into the
+     * used ring, but not flushed yet.
+     */
+    unsigned int ovq_filled;
+
     /*
      * When unthrottling we use a bottom-half to call flush_queued_data.
      */
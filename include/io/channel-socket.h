@@ -47,6 +47,10 @@ struct QIOChannelSocket {
     socklen_t localAddrLen;
     struct sockaddr_storage remoteAddr;
     socklen_t remoteAddrLen;
+    bool zero_copy;
+    bool zero_copy_write;      /* Current write may use MSG_ZEROCOPY */
+    uint32_t zero_copy_queued; /* Number of sends using MSG_ZEROCOPY */
+    uint32_t zero_copy_sent;   /* Number of those the kernel is done with */
 };
 
 
@@ -259,5 +263,55 @@ QIOChannelSocket *
 qio_channel_socket_accept(QIOChannelSocket *ioc,
                           Error **errp);
 
+/**
+ * qio_channel_socket_set_zero_copy:
+ * @ioc: the socket channel object
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Allow qio_channel_socket_writev_zero_copy_all() to use
+ * MSG_ZEROCOPY on the socket.  Other writes are still copied.
+ *
+ * Returns: 0 on success, -1 if zero copy is not supported
+ */
+int
+qio_channel_socket_set_zero_copy(QIOChannelSocket *ioc,
+                                 Error **errp);
+
+/**
+ * qio_channel_socket_writev_zero_copy_all:
+ * @ioc: the socket channel object
+ * @iov: the array of memory regions to write data from
+ * @niov: the length of the @iov array
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Like qio_channel_writev_all(), but if zero copy is enabled, large
+ * writes are sent directly from the caller's buffers instead of being
+ * copied.  The contents of the buffers must then not be changed, and
+ * the buffers must not be freed, until qio_channel_socket_zero_copy_done()
+ * reports that the kernel is done with them.
+ *
+ * Returns: 0 if all bytes were written, or -1 on error
+ */
+int
+qio_channel_socket_writev_zero_copy_all(QIOChannelSocket *ioc,
+                                        const struct iovec *iov,
+                                        size_t niov,
+                                        Error **errp);
+
+/**
+ * qio_channel_socket_zero_copy_done:
+ * @ioc: the socket channel object
+ * @seq: the value of @ioc->zero_copy_queued after the write
+ *
+ * Check whether all data that was written until @ioc->zero_copy_queued
+ * had the value @seq has been sent, so that the buffers it was written
+ * from may be reused.  This never blocks.
+ *
+ * Returns: true if the buffers may be reused
+ */
+bool
+qio_channel_socket_zero_copy_done(QIOChannelSocket *ioc,
+                                  uint32_t seq);
+
 
 #endif /* QIO_CHANNEL_SOCKET_H */
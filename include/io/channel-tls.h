@@ -48,6 +48,7 @@ struct QIOChannelTLS {
     QIOChannel *master;
     QCryptoTLSSession *session;
     QIOChannelShutdown shutdown;
+    bool ktls_tx; /* writes go straight to @master, encrypted by the kernel */
 };
 
 /**
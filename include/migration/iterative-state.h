@@ -0,0 +1,53 @@
+/*
+ * Iterative migration of device state buffers
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef MIGRATION_ITERATIVE_STATE_H
+#define MIGRATION_ITERATIVE_STATE_H
+
+typedef struct IterativeState IterativeState;
+
+/**
+ * iterative_state_register: migrate a buffer of device state iteratively
+ *
+ * The buffer is sent while the guest is still running.  The device must
+ * report the parts it changes afterwards with iterative_state_set_dirty(),
+ * and only those are sent again, so that just what is still dirty when
+ * the guest is stopped adds to the downtime.  The destination must register
+ * a buffer of the same size with the same @idstr and @instance_id.
+ *
+ * Returns the state to pass to the other functions.
+ *
+ * @idstr: name of the section in the migration stream
+ * @instance_id: instance of the section
+ * @data: the buffer
+ * @size: size of @data in bytes
+ * @chunk_size: granularity of the dirty tracking, in bytes
+ */
+IterativeState *iterative_state_register(const char *idstr,
+                                         uint32_t instance_id,
+                                         void *data, size_t size,
+                                         size_t chunk_size);
+
+/**
+ * iterative_state_set_dirty: mark part of the buffer as modified
+ *
+ * Can be called from any thread, after the data has been written.
+ *
+ * @is: the state returned by iterative_state_register()
+ * @offset: start of the modified bytes
+ * @len: number of modified bytes
+ */
+void iterative_state_set_dirty(IterativeState *is, size_t offset, size_t len);
+
+/**
+ * iterative_state_unregister: stop migrating the buffer and free @is
+ *
+ * @is: the state returned by iterative_state_register()
+ */
+void iterative_state_unregister(IterativeState *is);
+
+#endif
@@ -182,6 +182,13 @@ struct VMStateDescription {
     int minimum_version_id;
     int minimum_version_id_old;
     MigrationPriority priority;
+    /*
+     * The section can be loaded by a worker thread, concurrently with
+     * the other sections that set this and without the BQL.  pre_load
+     * and the fields must only touch the device's own state; post_load
+     * is still called from the main thread, in stream order.
+     */
+    bool parallel_load;
     LoadStateHandler *load_state_old;
     int (*pre_load)(void *opaque);
     int (*post_load)(void *opaque, int version_id);
@@ -1168,6 +1175,9 @@ extern const VMStateInfo vmstate_info_qlist;
 
 int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
                        void *opaque, int version_id);
+int vmstate_load_state_no_post_load(QEMUFile *f,
+                                    const VMStateDescription *vmsd,
+                                    void *opaque, int version_id);
 int vmstate_save_state(QEMUFile *f, const VMStateDescription *vmsd,
                        void *opaque, QJSON *vmdesc);
 int vmstate_save_state_v(QEMUFile *f, const VMStateDescription *vmsd,
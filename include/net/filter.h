@@ -77,6 +77,12 @@ ssize_t qemu_netfilter_pass_to_next(NetClientState *sender,
                                     int iovcnt,
                                     void *opaque);
 
+/*
+ * Recompute nc->filters_active after a filter of @nc was added, removed,
+ * or switched on or off.  Called with the BQL held.
+ */
+void netfilter_update_active(NetClientState *nc);
+
 void colo_notify_filters_event(int event, Error **errp);
 
 #endif /* QEMU_NET_FILTER_H */
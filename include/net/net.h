@@ -2,6 +2,7 @@
 #define QEMU_NET_H
 
 #include "qemu/queue.h"
+#include "qemu/stats64.h"
 #include "qapi/qapi-types-net.h"
 #include "net/queue.h"
 
@@ -49,6 +50,7 @@ typedef void (NetCleanup) (NetClientState *);
 typedef void (LinkStatusChanged)(NetClientState *);
 typedef void (NetClientDestructor)(NetClientState *);
 typedef RxFilterInfo *(QueryRxFilter)(NetClientState *);
+typedef RscStatsInfo *(QueryRscStats)(NetClientState *);
 typedef bool (HasUfo)(NetClientState *);
 typedef bool (HasVnetHdr)(NetClientState *);
 typedef bool (HasVnetHdrLen)(NetClientState *, int);
@@ -57,6 +59,9 @@ typedef void (SetOffload)(NetClientState *, int, int, int, int, int);
 typedef void (SetVnetHdrLen)(NetClientState *, int);
 typedef int (SetVnetLE)(NetClientState *, bool);
 typedef int (SetVnetBE)(NetClientState *, bool);
+typedef void (SetAioContext)(NetClientState *, AioContext *);
+typedef void (NetReceiveBatch)(NetClientState *, bool start);
+typedef bool (SetSteeringEBPF)(NetClientState *, int);
 typedef struct SocketReadState SocketReadState;
 typedef void (SocketReadStateFinalize)(SocketReadState *rs);
 typedef void (NetAnnounce)(NetClientState *);
@@ -71,6 +76,7 @@ typedef struct NetClientInfo {
     NetCleanup *cleanup;
     LinkStatusChanged *link_status_changed;
     QueryRxFilter *query_rx_filter;
+    QueryRscStats *query_rsc_stats;
     NetPoll *poll;
     HasUfo *has_ufo;
     HasVnetHdr *has_vnet_hdr;
@@ -81,6 +87,9 @@ typedef struct NetClientInfo {
     SetVnetLE *set_vnet_le;
     SetVnetBE *set_vnet_be;
     NetAnnounce *announce;
+    SetAioContext *set_aio_context;
+    NetReceiveBatch *receive_batch;
+    SetSteeringEBPF *set_steering_ebpf;
 } NetClientInfo;
 
 struct NetClientState {
@@ -99,7 +108,17 @@ struct NetClientState {
     int vring_enable;
     int vnet_hdr_len;
     bool is_netdev;
+    bool is_datapath;
+    /* Set by qemu_set_aio_context(), NULL for the main loop */
+    AioContext *aio_context;
     QTAILQ_HEAD(, NetFilterState) filters;
+    /* Whether any filter is on for a direction, see netfilter_update_active */
+    bool filters_active[NET_FILTER_DIRECTION__MAX];
+
+    /* Packets delivered to the peer and received from it */
+    Stat64 tx_packets, tx_bytes;
+    Stat64 rx_packets, rx_bytes;
+    StatsSource *stats_source;
 };
 
 typedef struct NICState {
@@ -152,6 +171,11 @@ ssize_t qemu_send_packet(NetClientState *nc, const uint8_t *buf, int size);
 ssize_t qemu_send_packet_raw(NetClientState *nc, const uint8_t *buf, int size);
 ssize_t qemu_send_packet_async(NetClientState *nc, const uint8_t *buf,
                                int size, NetPacketSent *sent_cb);
+int qemu_sendv_batch_async(NetClientState *sender,
+                           const NetPacketIov *pkts, int count,
+                           NetPacketSent *sent_cb);
+void qemu_send_batch_begin(NetClientState *nc);
+void qemu_send_batch_end(NetClientState *nc);
 void qemu_purge_queued_packets(NetClientState *nc);
 void qemu_flush_queued_packets(NetClientState *nc);
 void qemu_flush_or_purge_queued_packets(NetClientState *nc, bool purge);
@@ -165,6 +189,8 @@ void qemu_set_offload(NetClientState *nc, int csum, int tso4, int tso6,
 void qemu_set_vnet_hdr_len(NetClientState *nc, int len);
 int qemu_set_vnet_le(NetClientState *nc, bool is_le);
 int qemu_set_vnet_be(NetClientState *nc, bool is_be);
+bool qemu_can_set_aio_context(NetClientState *nc);
+void qemu_set_aio_context(NetClientState *nc, AioContext *ctx);
 void qemu_macaddr_default_if_unset(MACAddr *macaddr);
 int qemu_show_nic_models(const char *arg, const char *const *models);
 void qemu_check_nic_model(NICInfo *nd, const char *model);
@@ -30,6 +30,12 @@ typedef struct NetQueue NetQueue;
 
 typedef void (NetPacketSent) (NetClientState *sender, ssize_t ret);
 
+/* One packet of a batch */
+typedef struct NetPacketIov {
+    const struct iovec *iov;
+    int iovcnt;
+} NetPacketIov;
+
 #define QEMU_NET_PACKET_FLAG_NONE  0
 #define QEMU_NET_PACKET_FLAG_RAW  (1<<0)
 
@@ -69,6 +75,20 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
                                 int iovcnt,
                                 NetPacketSent *sent_cb);
 
+/*
+ * Send @count packets, stopping at the first one that cannot be
+ * delivered.  That packet is queued with @sent_cb and its index is
+ * returned; the packets after it are left to the caller.  Without
+ * @sent_cb, packets that cannot be delivered are queued or dropped and
+ * @count is returned.
+ */
+int qemu_net_queue_send_batch(NetQueue *queue,
+                              NetClientState *sender,
+                              unsigned flags,
+                              const NetPacketIov *pkts,
+                              int count,
+                              NetPacketSent *sent_cb);
+
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from);
 bool qemu_net_queue_flush(NetQueue *queue);
 
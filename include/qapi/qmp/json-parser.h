@@ -20,14 +20,21 @@ typedef struct JSONLexer {
     int x, y;
 } JSONLexer;
 
+typedef struct JSONParser {
+    Error *err;
+    va_list *ap;
+    GArray *stack;
+    int state;
+} JSONParser;
+
 typedef struct JSONMessageParser {
     void (*emit)(void *opaque, QObject *json, Error *err);
     void *opaque;
-    va_list *ap;
     JSONLexer lexer;
+    JSONParser parser;
     int brace_count;
     int bracket_count;
-    GQueue tokens;
+    uint64_t token_count;
     uint64_t token_size;
 } JSONMessageParser;
 
@@ -319,6 +319,24 @@ void qemu_co_sleep_wake(QemuCoSleepState *sleep_state);
  */
 void coroutine_fn yield_until_fd_readable(int fd);
 
+/**
+ * qemu_coroutine_increase_pool_batch_size:
+ * @additional_pool_size: how many more coroutines the pool may keep
+ *
+ * Devices call this with their maximum number of in-flight requests, so
+ * that freed coroutines are kept for reuse instead of having their stack
+ * unmapped and mapped again under load.  The pool stops growing well
+ * before the stacks could exhaust vm.max_map_count.
+ */
+void qemu_coroutine_increase_pool_batch_size(unsigned int additional_pool_size);
+
+/**
+ * qemu_coroutine_decrease_pool_batch_size:
+ * @removing_pool_size: the value passed to
+ * qemu_coroutine_increase_pool_batch_size()
+ */
+void qemu_coroutine_decrease_pool_batch_size(unsigned int removing_pool_size);
+
 #include "qemu/lockable.h"
 
 #endif /* QEMU_COROUTINE_H */
@@ -176,6 +176,30 @@ char *freq_to_str(uint64_t freq_hz);
 bool buffer_is_zero(const void *buf, size_t len);
 bool test_buffer_is_zero_next_accel(void);
 
+/**
+ * buffer_zero_prefix:
+ * @buf: the buffer
+ * @len: its length in bytes
+ *
+ * Returns the number of zero bytes at the start of @buf, which is @len
+ * if the buffer is all zeroes.  Rounding the result down to a block size
+ * gives the number of leading blocks that are all zeroes.
+ */
+size_t buffer_zero_prefix(const void *buf, size_t len);
+
+/**
+ * buffer_nonzero_prefix:
+ * @buf: the buffer
+ * @len: its length in bytes
+ * @unit: the block size, which must not be zero
+ *
+ * Returns the length of the run of @unit-sized blocks at the start of
+ * @buf that each contain a nonzero byte.  The result is a multiple of
+ * @unit, or @len if the run reaches the end of the buffer, where the
+ * last block may be shorter than @unit.
+ */
+size_t buffer_nonzero_prefix(const void *buf, size_t len, size_t unit);
+
 /*
  * Implementation of ULEB128 (http://en.wikipedia.org/wiki/LEB128)
  * Input is limited to 14-bit numbers
@@ -0,0 +1,55 @@
+/*
+ * Logarithmic histograms
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_LOG_HISTOGRAM_H
+#define QEMU_LOG_HISTOGRAM_H
+
+#include "qemu/stats64.h"
+#include "qapi/qapi-types-common.h"
+
+/*
+ * Histogram with a fixed, logarithmic layout that is cheap enough to be
+ * always enabled, typically for latencies: values below LOG_HISTOGRAM_SUB
+ * are counted exactly, and every larger power of two is split into
+ * LOG_HISTOGRAM_SUB buckets of equal width.  A value is therefore
+ * reported with a relative error of at most 1/LOG_HISTOGRAM_SUB.
+ */
+#define LOG_HISTOGRAM_SUB_BITS 3
+#define LOG_HISTOGRAM_SUB (1 << LOG_HISTOGRAM_SUB_BITS)
+#define LOG_HISTOGRAM_BUCKETS \
+    ((64 - LOG_HISTOGRAM_SUB_BITS + 1) * LOG_HISTOGRAM_SUB)
+
+typedef struct LogHistogram {
+    Stat64 sum;
+    Stat64 min;
+    Stat64 max;
+    Stat64 buckets[LOG_HISTOGRAM_BUCKETS];
+} LogHistogram;
+
+void log_histogram_init(LogHistogram *h);
+
+/* Record @value; can be called concurrently from any thread */
+void log_histogram_add(LogHistogram *h, uint64_t value);
+
+/*
+ * Record @value in a histogram that only the calling thread updates.
+ * Readers can still run concurrently.
+ */
+void log_histogram_add_single_writer(LogHistogram *h, uint64_t value);
+
+uint64_t log_histogram_count(const LogHistogram *h);
+
+/*
+ * Returns an upper bound for the lowest @per_mille / 1000 of all
+ * recorded values, or 0 if no values were recorded.
+ */
+uint64_t log_histogram_percentile(const LogHistogram *h, unsigned per_mille);
+
+/* Summarize @h for QMP; the caller frees the result */
+LatencyPercentiles *log_histogram_get_percentiles(const LogHistogram *h);
+
+#endif
@@ -614,6 +614,56 @@ void qemu_set_tty_echo(int fd, bool echo);
 void os_mem_prealloc(int fd, char *area, size_t sz, int smp_cpus,
                      Error **errp);
 
+/**
+ * os_mem_prealloc_nodes:
+ * @host_nodes: bitmap of the host NUMA nodes the memory is bound to
+ * @maxnode: number of bits in @host_nodes
+ *
+ * Like os_mem_prealloc(), but run the threads on the host CPUs of
+ * @host_nodes, if any, so that the pages are cleared from the node
+ * they are allocated on.
+ *
+ * Between os_mem_prealloc_begin_async() and os_mem_prealloc_wait() this
+ * only starts the threads, and errors are reported by the latter.
+ *
+ * Can be called from any thread; preallocations from different threads
+ * run one after the other.
+ */
+void os_mem_prealloc_nodes(int fd, char *area, size_t sz, int smp_cpus,
+                           const unsigned long *host_nodes,
+                           unsigned long maxnode, Error **errp);
+
+/**
+ * os_mem_prealloc_begin_async:
+ *
+ * Let the following calls to os_mem_prealloc_nodes() run concurrently
+ * in the background, until os_mem_prealloc_wait() is called.  The caller
+ * must not touch the memory being preallocated in the meanwhile.
+ */
+void os_mem_prealloc_begin_async(Error **errp);
+
+/**
+ * os_mem_prealloc_wait:
+ *
+ * Wait for the preallocations started since os_mem_prealloc_begin_async().
+ */
+void os_mem_prealloc_wait(Error **errp);
+
+/**
+ * os_bind_thread_to_host_nodes:
+ * @host_nodes: bitmap of host NUMA nodes
+ * @maxnode: number of bits in @host_nodes
+ *
+ * Run the calling thread only on the host CPUs of @host_nodes.  With
+ * the default memory policy, the memory that the thread touches first
+ * is then allocated from those nodes too.
+ *
+ * Returns 0 on success, -ENOTSUP if the host cannot do it, or another
+ * negative errno value.
+ */
+int os_bind_thread_to_host_nodes(const unsigned long *host_nodes,
+                                 unsigned long maxnode);
+
 /**
  * qemu_get_pid_name:
  * @pid: pid of a process
@@ -16,11 +16,36 @@ enum QSPSortBy {
     QSP_SORT_BY_AVG_WAIT_TIME,
 };
 
+/*
+ * Wait times are bucketed by powers of two: bucket 0 counts waits shorter
+ * than 1024 ns, bucket i waits in [2^(9 + i), 2^(10 + i)) ns.  The last
+ * bucket also counts all waits longer than that.
+ */
+#define QSP_HIST_BUCKETS 20
+
+/* the default for qsp_enable_sampled(), see "sync-profile sampled" in HMP */
+#define QSP_DEFAULT_SAMPLE_PERIOD 16
+
+typedef struct QSPStats {
+    const char *type;
+    const char *callsite;
+    unsigned int n_objs;
+    uint64_t n_acqs;
+    uint64_t ns;
+    uint64_t hist[QSP_HIST_BUCKETS];
+} QSPStats;
+
+typedef void (*QSPStatsFunc)(const QSPStats *stats, void *opaque);
+
 void qsp_report(size_t max, enum QSPSortBy sort_by,
                 bool callsite_coalesce);
+void qsp_foreach(size_t max, enum QSPSortBy sort_by,
+                 QSPStatsFunc func, void *opaque);
 
 bool qsp_is_enabled(void);
+unsigned int qsp_get_sample_period(void);
 void qsp_enable(void);
+void qsp_enable_sampled(unsigned int period);
 void qsp_disable(void);
 void qsp_reset(void);
 
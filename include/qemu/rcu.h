@@ -135,6 +135,22 @@ struct rcu_head {
 extern void call_rcu1(struct rcu_head *head, RCUCBFunc *func);
 extern void drain_call_rcu(void);
 
+/*
+ * Grace period statistics.  shared_grace_periods counts the
+ * synchronize_rcu() calls that completed with another thread's grace
+ * period; pending_callbacks counts the call_rcu() callbacks that wait
+ * for the next batch of the RCU thread.
+ */
+typedef struct RCUStats {
+    uint64_t grace_periods;
+    uint64_t shared_grace_periods;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t pending_callbacks;
+} RCUStats;
+
+extern void rcu_get_stats(RCUStats *stats);
+
 /* The operands of the minus operator must have the same type,
  * which must be the one that we specify in the cast.
  */
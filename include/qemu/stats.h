@@ -0,0 +1,69 @@
+/*
+ * Statistics registry
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_STATS_H
+#define QEMU_STATS_H
+
+#include "qapi/qapi-types-stats.h"
+#include "qemu/stats64.h"
+
+/*
+ * Subsystems keep their counters wherever it is cheapest to update them,
+ * typically in a structure that only one thread writes, using
+ * stat64_add_single_writer() or stat64_add().  They register each object
+ * that has counters with stats_register(), and the registry reads the
+ * counters through the object's StatsGroup when query-stats runs.
+ */
+
+typedef struct StatsDesc {
+    const char *name;
+    StatsType type;
+    bool has_unit;
+    StatsUnit unit;
+} StatsDesc;
+
+typedef struct StatsGroup {
+    StatsProvider provider;
+    StatsTarget target;
+    const StatsDesc *stats;
+    size_t nr_stats;
+
+    /*
+     * Return the ID of the object as a string that the caller frees,
+     * or NULL to leave it out of query-stats.  Called with the BQL held.
+     * If get_id is NULL the object is reported without an ID.
+     */
+    char *(*get_id)(void *opaque);
+
+    /*
+     * Store the current value of each of the group's nr_stats statistics
+     * in @values.  Called with the BQL held, but not necessarily in the
+     * thread that updates the counters.
+     */
+    void (*read)(void *opaque, uint64_t *values);
+} StatsGroup;
+
+/**
+ * stats_register:
+ * @group: the statistics that @opaque has; must stay valid forever
+ * @opaque: the object, passed to the group's callbacks
+ *
+ * Make the statistics of @opaque visible to query-stats until
+ * stats_unregister() is called.  Can be called from any thread.
+ */
+StatsSource *stats_register(const StatsGroup *group, void *opaque);
+
+/**
+ * stats_unregister:
+ * @source: what stats_register() returned, or NULL
+ *
+ * Once this returns, the group's callbacks are not called for the
+ * object anymore and it can be freed.
+ */
+void stats_unregister(StatsSource *source);
+
+#endif
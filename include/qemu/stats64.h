@@ -190,4 +190,18 @@ static inline void stat64_max(Stat64 *s, uint64_t value)
 
 #endif
 
+/*
+ * Add @value to a counter that only the calling thread ever modifies.
+ * Readers on other threads still never see a torn value, but there is
+ * no need for an atomic read-modify-write.
+ */
+static inline void stat64_add_single_writer(Stat64 *s, uint64_t value)
+{
+#ifdef CONFIG_ATOMIC64
+    qatomic_set__nocheck(&s->value, qatomic_read__nocheck(&s->value) + value);
+#else
+    stat64_add(s, value);
+#endif
+}
+
 #endif
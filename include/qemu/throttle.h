@@ -151,7 +151,10 @@ bool throttle_schedule_timer(ThrottleState *ts,
                              ThrottleTimers *tt,
                              bool is_write);
 
+double throttle_units(ThrottleState *ts, uint64_t size);
 void throttle_account(ThrottleState *ts, bool is_write, uint64_t size);
+void throttle_account_units(ThrottleState *ts, bool is_write, double units,
+                            uint64_t size);
 void throttle_limits_to_config(ThrottleLimits *arg, ThrottleConfig *cfg,
                                Error **errp);
 void throttle_config_to_limits(ThrottleConfig *cfg, ThrottleLimits *var);
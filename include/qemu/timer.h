@@ -86,7 +86,8 @@ struct QEMUTimer {
     QEMUTimerList *timer_list;
     QEMUTimerCB *cb;
     void *opaque;
-    QEMUTimer *next;
+    uint64_t seq;               /* breaks ties between equal expire times */
+    size_t heap_index;          /* position in the timer list while pending */
     int attributes;
     int scale;
 };
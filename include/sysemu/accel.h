@@ -29,6 +29,9 @@
 typedef struct AccelState {
     /*< private >*/
     Object parent_obj;
+
+    /* Longest time an idle vCPU polls for work before sleeping */
+    uint64_t halt_poll_max_ns;
 } AccelState;
 
 typedef struct AccelClass {
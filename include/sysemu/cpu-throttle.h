@@ -42,6 +42,18 @@ void cpu_throttle_init(void);
  */
 void cpu_throttle_set(int new_throttle_pct);
 
+/**
+ * cpu_throttle_set_vcpu:
+ * @cpu: The vcpu to throttle.
+ * @new_throttle_pct: Percent of sleep time. Valid range is 0 to 99.
+ *
+ * Throttles only @cpu, like cpu_throttle_set does for all vcpus.  A
+ * throttle_pct of 0 lets @cpu run freely.  The first call stops the
+ * throttling of all the other vcpus until they get their own percentage,
+ * and cpu_throttle_set throttles all vcpus equally again.
+ */
+void cpu_throttle_set_vcpu(CPUState *cpu, int new_throttle_pct);
+
 /**
  * cpu_throttle_stop:
  *
@@ -65,4 +77,16 @@ bool cpu_throttle_active(void);
  */
 int cpu_throttle_get_percentage(void);
 
+/**
+ * cpu_throttle_get_vcpu_percentage:
+ * @cpu: The vcpu to look at.
+ *
+ * Returns the throttle percentage of @cpu, which is the global one unless
+ * cpu_throttle_set_vcpu has been used.  When vcpus are throttled apart,
+ * cpu_throttle_get_percentage returns the highest percentage of them.
+ *
+ * Returns: The throttle percentage in range 0 to 99.
+ */
+int cpu_throttle_get_vcpu_percentage(CPUState *cpu);
+
 #endif /* SYSEMU_CPU_THROTTLE_H */
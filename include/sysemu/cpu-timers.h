@@ -60,6 +60,10 @@ int64_t icount_round(int64_t count);
 void icount_start_warp_timer(void);
 void icount_account_warp_timer(void);
 
+/* used by MTTCG vcpu threads to run in lockstep quanta */
+int64_t icount_quantum_budget(CPUState *cpu);
+bool icount_quantum_advance(void);
+
 /*
  * CPU Ticks and Clock
  */
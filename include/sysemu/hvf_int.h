@@ -12,6 +12,8 @@
 #define HVF_INT_H
 
 #include "qemu/osdep.h"
+#include "qemu/stats64.h"
+#include "hw/core/cpu.h"
 #ifdef __aarch64__
 #include <Hypervisor/Hypervisor.h>
 #else
@@ -48,13 +50,33 @@ struct HVFState {
 };
 extern HVFState *hvf_state;
 
+/* Per-vCPU exit statistics, see hvf_vcpu_stat_inc() */
+enum {
+    HVF_VCPU_STAT_EXITS,
+    HVF_VCPU_STAT_MMIO_EXITS,
+    HVF_VCPU_STAT_IO_EXITS,
+    HVF_VCPU_STAT_DIRTY_LOG_EXITS,
+    HVF_VCPU_STAT_APIC_ACCESS_EXITS,
+    HVF_VCPU_STAT_HLT_EXITS,
+    HVF_VCPU_STAT_IRQ_WINDOW_EXITS,
+    HVF_VCPU_STAT__MAX,
+};
+
 struct hvf_vcpu_state {
     uint64_t fd;
     void *exit;
     sigset_t unblock_ipi_mask;
     bool enable_debug;
+    Stat64 stats[HVF_VCPU_STAT__MAX];
+    StatsSource *stats_source;
 };
 
+/* Only called from the vCPU thread, which is the only writer */
+static inline void hvf_vcpu_stat_inc(CPUState *cpu, int stat)
+{
+    stat64_add_single_writer(&cpu->hvf->stats[stat], 1);
+}
+
 void assert_hvf_ok(hv_return_t ret);
 int hvf_get_registers(CPUState *cpu);
 int hvf_put_registers(CPUState *cpu);
@@ -37,6 +37,23 @@ struct IOThread {
     int64_t poll_max_ns;
     int64_t poll_grow;
     int64_t poll_shrink;
+
+    /* Linux io_uring parameters */
+    int64_t io_uring_sqpoll_idle;
+
+    /* Thread pool size limits */
+    int64_t thread_pool_min;
+    int64_t thread_pool_max;
+
+    /* ID of the iothread-poll-group object, and the object once resolved */
+    char *poll_group_id;
+    Object *poll_group;
+
+    /* Host NUMA nodes that the thread runs on, or NULL */
+    unsigned long *host_nodes;
+    int bind_ret;               /* result of binding to host_nodes */
+
+    StatsSource *stats_source;
 };
 typedef struct IOThread IOThread;
 
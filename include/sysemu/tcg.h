@@ -10,6 +10,9 @@
 
 void tcg_exec_init(unsigned long tb_size, int splitwx);
 
+/* Count the executions of each TB, shown by "info jit" */
+extern bool tb_profile_enabled;
+
 #ifdef CONFIG_TCG
 extern bool tcg_allowed;
 #define tcg_enabled() (tcg_allowed)
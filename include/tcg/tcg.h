@@ -600,6 +600,7 @@ struct TCGContext {
 
     TCGRegSet reserved_regs;
     uint32_t tb_cflags; /* cflags of the current TB */
+    TranslationBlock *gen_tb; /* the TB being generated */
     intptr_t current_frame_offset;
     intptr_t frame_start;
     intptr_t frame_end;
@@ -860,6 +861,8 @@ TranslationBlock *tcg_tb_alloc(TCGContext *s);
 void tcg_region_init(void);
 void tb_destroy(TranslationBlock *tb);
 void tcg_region_reset_all(void);
+bool tcg_region_available(void);
+bool tcg_region_evict(void **pstart, void **pend);
 
 size_t tcg_code_size(void);
 size_t tcg_code_capacity(void);
@@ -28,6 +28,8 @@
 /* in ms */
 #define GUI_REFRESH_INTERVAL_DEFAULT    30
 #define GUI_REFRESH_INTERVAL_IDLE     3000
+/* the listener has nothing to show, stop the refresh timer for it */
+#define GUI_REFRESH_INTERVAL_NONE     UINT64_MAX
 
 /* Color number is match to standard vga palette */
 enum qemu_color_names {
@@ -22,13 +22,25 @@
 #include "qapi/error.h"
 #include "qapi/qapi-visit-sockets.h"
 #include "qemu/module.h"
+#include "qemu/iov.h"
 #include "io/channel-socket.h"
 #include "io/channel-watch.h"
 #include "trace.h"
 #include "qapi/clone-visitor.h"
 
+#if defined(CONFIG_LINUX) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+#include <linux/errqueue.h>
+#define QEMU_MSG_ZEROCOPY
+#endif
+
 #define SOCKET_MAX_FDS 16
 
+/*
+ * Setting up zero copy transmission is only cheaper than copying the data
+ * for writes that are larger than about 10 kB
+ */
+#define SOCKET_ZERO_COPY_MIN_BYTES (16 * 1024)
+
 SocketAddress *
 qio_channel_socket_get_local_address(QIOChannelSocket *ioc,
                                      Error **errp)
@@ -472,6 +484,56 @@ static void qio_channel_socket_copy_fds(struct msghdr *msg,
 }
 
 
+/*
+ * Collect the completion notifications for MSG_ZEROCOPY sends from the
+ * error queue of the socket.  They must be read even if nobody is waiting
+ * for them, because the socket polls with POLLERR as long as the queue is
+ * not empty.
+ */
+static void qio_channel_socket_reap_zero_copy(QIOChannelSocket *sioc)
+{
+#ifdef QEMU_MSG_ZEROCOPY
+    struct msghdr msg = { NULL, };
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+    struct cmsghdr *cmsg;
+    struct sock_extended_err *serr;
+
+    for (;;) {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        memset(control, 0, sizeof(control));
+
+        if (recvmsg(sioc->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            break;
+        }
+
+        cmsg = CMSG_FIRSTHDR(&msg);
+        if (!cmsg ||
+            !((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+              (cmsg->cmsg_level == SOL_IPV6 &&
+               cmsg->cmsg_type == IPV6_RECVERR))) {
+            continue;
+        }
+
+        serr = (struct sock_extended_err *)CMSG_DATA(cmsg);
+        if (serr->ee_errno != 0 ||
+            serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+            continue;
+        }
+
+        /*
+         * The notification covers the sends numbered ee_info to ee_data.
+         * TCP completes them in order, so only the upper end matters.
+         */
+        trace_qio_channel_socket_zero_copy_done(sioc, serr->ee_info,
+                                                serr->ee_data);
+        if ((int32_t)(serr->ee_data + 1 - sioc->zero_copy_sent) > 0) {
+            sioc->zero_copy_sent = serr->ee_data + 1;
+        }
+    }
+#endif
+}
+
 static ssize_t qio_channel_socket_readv(QIOChannel *ioc,
                                         const struct iovec *iov,
                                         size_t niov,
@@ -502,6 +564,10 @@ static ssize_t qio_channel_socket_readv(QIOChannel *ioc,
     ret = recvmsg(sioc->fd, &msg, sflags);
     if (ret < 0) {
         if (errno == EAGAIN) {
+            if (sioc->zero_copy) {
+                /* We may have been woken up by a zero copy notification */
+                qio_channel_socket_reap_zero_copy(sioc);
+            }
             return QIO_CHANNEL_ERR_BLOCK;
         }
         if (errno == EINTR) {
@@ -533,12 +599,20 @@ static ssize_t qio_channel_socket_writev(QIOChannel *ioc,
     char control[CMSG_SPACE(sizeof(int) * SOCKET_MAX_FDS)];
     size_t fdsize = sizeof(int) * nfds;
     struct cmsghdr *cmsg;
+    int sflags = 0;
 
     memset(control, 0, CMSG_SPACE(sizeof(int) * SOCKET_MAX_FDS));
 
     msg.msg_iov = (struct iovec *)iov;
     msg.msg_iovlen = niov;
 
+#ifdef QEMU_MSG_ZEROCOPY
+    if (sioc->zero_copy_write && !nfds &&
+        iov_size(iov, niov) >= SOCKET_ZERO_COPY_MIN_BYTES) {
+        sflags |= MSG_ZEROCOPY;
+    }
+#endif
+
     if (nfds) {
         if (nfds > SOCKET_MAX_FDS) {
             error_setg_errno(errp, EINVAL,
@@ -558,18 +632,33 @@ static ssize_t qio_channel_socket_writev(QIOChannel *ioc,
     }
 
  retry:
-    ret = sendmsg(sioc->fd, &msg, 0);
+    ret = sendmsg(sioc->fd, &msg, sflags);
     if (ret <= 0) {
         if (errno == EAGAIN) {
+            if (sioc->zero_copy) {
+                qio_channel_socket_reap_zero_copy(sioc);
+            }
             return QIO_CHANNEL_ERR_BLOCK;
         }
         if (errno == EINTR) {
             goto retry;
         }
+#ifdef QEMU_MSG_ZEROCOPY
+        if (errno == ENOBUFS && (sflags & MSG_ZEROCOPY)) {
+            /* Too much pinned memory (optmem_max), just copy this one */
+            sflags &= ~MSG_ZEROCOPY;
+            goto retry;
+        }
+#endif
         error_setg_errno(errp, errno,
                          "Unable to write to socket");
         return -1;
     }
+#ifdef QEMU_MSG_ZEROCOPY
+    if (sflags & MSG_ZEROCOPY) {
+        sioc->zero_copy_queued++;
+    }
+#endif
     return ret;
 }
 #else /* WIN32 */
@@ -658,6 +747,51 @@ static ssize_t qio_channel_socket_writev(QIOChannel *ioc,
 }
 #endif /* WIN32 */
 
+int
+qio_channel_socket_set_zero_copy(QIOChannelSocket *ioc,
+                                 Error **errp)
+{
+#ifdef QEMU_MSG_ZEROCOPY
+    int v = 1;
+
+    if (setsockopt(ioc->fd, SOL_SOCKET, SO_ZEROCOPY, &v, sizeof(v)) < 0) {
+        error_setg_errno(errp, errno, "Unable to enable zero copy on socket");
+        return -1;
+    }
+    ioc->zero_copy = true;
+    return 0;
+#else
+    error_setg(errp, "Zero copy is not supported on this platform");
+    return -1;
+#endif
+}
+
+int
+qio_channel_socket_writev_zero_copy_all(QIOChannelSocket *ioc,
+                                        const struct iovec *iov,
+                                        size_t niov,
+                                        Error **errp)
+{
+    int ret;
+
+    ioc->zero_copy_write = ioc->zero_copy;
+    ret = qio_channel_writev_all(QIO_CHANNEL(ioc), iov, niov, errp);
+    ioc->zero_copy_write = false;
+    return ret;
+}
+
+bool
+qio_channel_socket_zero_copy_done(QIOChannelSocket *ioc,
+                                  uint32_t seq)
+{
+#ifdef QEMU_MSG_ZEROCOPY
+    if ((int32_t)(ioc->zero_copy_sent - seq) < 0) {
+        qio_channel_socket_reap_zero_copy(ioc);
+    }
+#endif
+    return (int32_t)(ioc->zero_copy_sent - seq) >= 0;
+}
+
 static int
 qio_channel_socket_set_blocking(QIOChannel *ioc,
                                 bool enabled,
@@ -17,18 +17,36 @@
 #include "qemu/module.h"
 #include "block/aio.h"
 #include "block/block.h"
+#include "block/thread-pool.h"
 #include "sysemu/iothread.h"
 #include "qapi/error.h"
 #include "qapi/qapi-commands-misc.h"
 #include "qemu/error-report.h"
 #include "qemu/rcu.h"
 #include "qemu/main-loop.h"
+#include "qemu/stats.h"
+#include "qapi/qapi-builtin-visit.h"
+#include "qapi/util.h"
+#include "qapi/visitor.h"
+#include "sysemu/numa.h"
 
 typedef ObjectClass IOThreadClass;
 
 DECLARE_CLASS_CHECKERS(IOThreadClass, IOTHREAD,
                        TYPE_IOTHREAD)
 
+#define TYPE_IOTHREAD_POLL_GROUP "iothread-poll-group"
+
+typedef struct IOThreadPollGroup {
+    Object parent_obj;
+
+    AioPollGroup group;
+    unsigned users;             /* number of IOThreads in the group */
+} IOThreadPollGroup;
+
+DECLARE_INSTANCE_CHECKER(IOThreadPollGroup, IOTHREAD_POLL_GROUP,
+                         TYPE_IOTHREAD_POLL_GROUP)
+
 #ifdef CONFIG_POSIX
 /* Benchmark results from 2016 on NVMe SSD drives show max polling times around
  * 16-32 microseconds yield IOPS improvements for both iodepth=1 and iodepth=32
@@ -51,6 +69,20 @@ static void *iothread_run(void *opaque)
     IOThread *iothread = opaque;
 
     rcu_register_thread();
+
+    /*
+     * Bind before allocating anything, so that the memory is local to the
+     * nodes.  This includes the workers of the thread pool, which inherit
+     * the affinity.
+     */
+    if (iothread->host_nodes) {
+        iothread->bind_ret = os_bind_thread_to_host_nodes(iothread->host_nodes,
+                                                          MAX_NODES);
+        if (iothread->bind_ret < 0) {
+            iothread->running = false;
+        }
+    }
+
     /*
      * g_main_context_push_thread_default() must be called before anything
      * in this new thread uses glib.
@@ -113,16 +145,87 @@ static void iothread_instance_init(Object *obj)
     IOThread *iothread = IOTHREAD(obj);
 
     iothread->poll_max_ns = IOTHREAD_POLL_MAX_NS_DEFAULT;
+    iothread->thread_pool_max = THREAD_POOL_MAX_THREADS_DEFAULT;
     iothread->thread_id = -1;
     qemu_sem_init(&iothread->init_done_sem, 0);
     /* By default, we don't run gcontext */
     qatomic_set(&iothread->run_gcontext, 0);
 }
 
+enum {
+    IOTHREAD_STAT_AIO_POLLS,
+    IOTHREAD_STAT_POLL_ATTEMPTS,
+    IOTHREAD_STAT_POLL_HITS,
+    IOTHREAD_STAT_BLOCKING_WAITS,
+    IOTHREAD_STAT_BH_CALLS,
+    IOTHREAD_STAT_POLL_TIME_NS,
+    IOTHREAD_STAT_WAIT_TIME_NS,
+    IOTHREAD_STAT_DISPATCH_TIME_NS,
+    IOTHREAD_STAT_POLL_NS,
+    IOTHREAD_STAT__MAX,
+};
+
+static const StatsDesc iothread_stats_desc[IOTHREAD_STAT__MAX] = {
+    [IOTHREAD_STAT_AIO_POLLS] = {
+        .name = "aio_polls", .type = STATS_TYPE_CUMULATIVE },
+    [IOTHREAD_STAT_POLL_ATTEMPTS] = {
+        .name = "poll_attempts", .type = STATS_TYPE_CUMULATIVE },
+    [IOTHREAD_STAT_POLL_HITS] = {
+        .name = "poll_hits", .type = STATS_TYPE_CUMULATIVE },
+    [IOTHREAD_STAT_BLOCKING_WAITS] = {
+        .name = "blocking_waits", .type = STATS_TYPE_CUMULATIVE },
+    [IOTHREAD_STAT_BH_CALLS] = {
+        .name = "bh_calls", .type = STATS_TYPE_CUMULATIVE },
+    [IOTHREAD_STAT_POLL_TIME_NS] = {
+        .name = "poll_time_ns", .type = STATS_TYPE_CUMULATIVE,
+        .has_unit = true, .unit = STATS_UNIT_NANOSECONDS },
+    [IOTHREAD_STAT_WAIT_TIME_NS] = {
+        .name = "wait_time_ns", .type = STATS_TYPE_CUMULATIVE,
+        .has_unit = true, .unit = STATS_UNIT_NANOSECONDS },
+    [IOTHREAD_STAT_DISPATCH_TIME_NS] = {
+        .name = "dispatch_time_ns", .type = STATS_TYPE_CUMULATIVE,
+        .has_unit = true, .unit = STATS_UNIT_NANOSECONDS },
+    [IOTHREAD_STAT_POLL_NS] = {
+        .name = "poll_ns", .type = STATS_TYPE_INSTANT,
+        .has_unit = true, .unit = STATS_UNIT_NANOSECONDS },
+};
+
+static char *iothread_stats_get_id(void *opaque)
+{
+    return iothread_get_id(opaque);
+}
+
+static void iothread_stats_read(void *opaque, uint64_t *values)
+{
+    AioContext *ctx = IOTHREAD(opaque)->ctx;
+
+    values[IOTHREAD_STAT_AIO_POLLS] = stat64_get(&ctx->stat_aio_polls);
+    values[IOTHREAD_STAT_POLL_ATTEMPTS] = stat64_get(&ctx->stat_poll_attempts);
+    values[IOTHREAD_STAT_POLL_HITS] = stat64_get(&ctx->stat_poll_hits);
+    values[IOTHREAD_STAT_BLOCKING_WAITS] =
+        stat64_get(&ctx->stat_blocking_waits);
+    values[IOTHREAD_STAT_BH_CALLS] = stat64_get(&ctx->stat_bh_calls);
+    values[IOTHREAD_STAT_POLL_TIME_NS] = stat64_get(&ctx->stat_poll_time_ns);
+    values[IOTHREAD_STAT_WAIT_TIME_NS] = stat64_get(&ctx->stat_wait_time_ns);
+    values[IOTHREAD_STAT_DISPATCH_TIME_NS] =
+        stat64_get(&ctx->stat_dispatch_time_ns);
+    values[IOTHREAD_STAT_POLL_NS] = qatomic_read__nocheck(&ctx->poll_ns);
+}
+
+static const StatsGroup iothread_stats_group = {
+    .provider = STATS_PROVIDER_IOTHREAD,
+    .target = STATS_TARGET_IOTHREAD,
+    .stats = iothread_stats_desc,
+    .nr_stats = IOTHREAD_STAT__MAX,
+    .get_id = iothread_stats_get_id,
+    .read = iothread_stats_read,
+};
+
 static void iothread_instance_finalize(Object *obj)
 {
     IOThread *iothread = IOTHREAD(obj);
 
+    stats_unregister(iothread->stats_source);
     iothread_stop(iothread);
 
     /*
@@ -145,9 +248,44 @@ static void iothread_instance_finalize(Object *obj)
         g_main_loop_unref(iothread->main_loop);
         iothread->main_loop = NULL;
     }
+    if (iothread->poll_group) {
+        IOTHREAD_POLL_GROUP(iothread->poll_group)->users--;
+        object_unref(iothread->poll_group);
+        iothread->poll_group = NULL;
+    }
+    g_free(iothread->poll_group_id);
+    g_free(iothread->host_nodes);
     qemu_sem_destroy(&iothread->init_done_sem);
 }
 
+/*
+ * The poll group is referenced by ID and looked up when the IOThread
+ * starts, so it has to be created before the IOThread.
+ */
+static bool iothread_join_poll_group(IOThread *iothread, Error **errp)
+{
+    IOThreadPollGroup *pg;
+    Object *obj;
+
+    if (!iothread->poll_group_id) {
+        return true;
+    }
+
+    obj = object_resolve_path_component(object_get_objects_root(),
+                                        iothread->poll_group_id);
+    if (!obj || !object_dynamic_cast(obj, TYPE_IOTHREAD_POLL_GROUP)) {
+        error_setg(errp, "%s is not an iothread-poll-group object",
+                   iothread->poll_group_id);
+        return false;
+    }
+
+    pg = IOTHREAD_POLL_GROUP(obj);
+    pg->users++;
+    iothread->poll_group = object_ref(obj);
+    aio_context_set_poll_group(iothread->ctx, &pg->group);
+    return true;
+}
+
 static void iothread_init_gcontext(IOThread *iothread)
 {
     GSource *source;
@@ -190,6 +328,26 @@ static void iothread_complete(UserCreatable *obj, Error **errp)
         return;
     }
 
+    if (!aio_context_set_io_uring_params(iothread->ctx,
+                                         iothread->io_uring_sqpoll_idle,
+                                         errp) ||
+        !iothread_join_poll_group(iothread, errp)) {
+        aio_context_unref(iothread->ctx);
+        iothread->ctx = NULL;
+        return;
+    }
+
+    aio_context_set_thread_pool_params(iothread->ctx,
+                                       iothread->thread_pool_min,
+                                       iothread->thread_pool_max,
+                                       &local_error);
+    if (local_error) {
+        error_propagate(errp, local_error);
+        aio_context_unref(iothread->ctx);
+        iothread->ctx = NULL;
+        return;
+    }
+
     /* This assumes we are called from a thread with useful CPU affinity for us
      * to inherit.
      */
@@ -203,6 +361,16 @@ static void iothread_complete(UserCreatable *obj, Error **errp)
     while (iothread->thread_id == -1) {
         qemu_sem_wait(&iothread->init_done_sem);
     }
+
+    if (iothread->bind_ret < 0) {
+        /* The thread has exited already */
+        error_setg_errno(errp, -iothread->bind_ret,
+                         "Cannot bind the IOThread to host-nodes");
+        iothread_stop(iothread);
+        return;
+    }
+
+    iothread->stats_source = stats_register(&iothread_stats_group, iothread);
 }
 
 typedef struct {
@@ -259,6 +427,149 @@ static void iothread_set_poll_param(Object *obj, Visitor *v,
     }
 }
 
+static void iothread_get_io_uring_sqpoll_idle(Object *obj, Visitor *v,
+        const char *name, void *opaque, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    visit_type_int64(v, name, &iothread->io_uring_sqpoll_idle, errp);
+}
+
+static void iothread_set_io_uring_sqpoll_idle(Object *obj, Visitor *v,
+        const char *name, void *opaque, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    int64_t value;
+
+    if (!visit_type_int64(v, name, &value, errp)) {
+        return;
+    }
+
+    if (value < 0 || value > UINT32_MAX) {
+        error_setg(errp, "%s value must be in range [0, %" PRIu32 "]",
+                   name, UINT32_MAX);
+        return;
+    }
+
+    if (iothread->ctx &&
+        !aio_context_set_io_uring_params(iothread->ctx, value, errp)) {
+        return;
+    }
+    iothread->io_uring_sqpoll_idle = value;
+}
+
+static PollParamInfo thread_pool_min_info = {
+    "thread-pool-min", offsetof(IOThread, thread_pool_min),
+};
+static PollParamInfo thread_pool_max_info = {
+    "thread-pool-max", offsetof(IOThread, thread_pool_max),
+};
+
+static void iothread_set_thread_pool_param(Object *obj, Visitor *v,
+        const char *name, void *opaque, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    PollParamInfo *info = opaque;
+    int64_t *field = (void *)iothread + info->offset;
+    int64_t old, value;
+
+    if (!visit_type_int64(v, name, &value, errp)) {
+        return;
+    }
+
+    old = *field;
+    *field = value;
+
+    /* Both limits are checked together once the IOThread is running */
+    if (iothread->ctx) {
+        Error *local_err = NULL;
+
+        aio_context_set_thread_pool_params(iothread->ctx,
+                                           iothread->thread_pool_min,
+                                           iothread->thread_pool_max,
+                                           &local_err);
+        if (local_err) {
+            error_propagate(errp, local_err);
+            *field = old;
+        }
+    }
+}
+
+static char *iothread_get_poll_group(Object *obj, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    return g_strdup(iothread->poll_group_id);
+}
+
+static void iothread_set_poll_group(Object *obj, const char *value,
+                                    Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    if (iothread->ctx) {
+        error_setg(errp, "poll-group cannot be changed once the IOThread "
+                   "is running");
+        return;
+    }
+    g_free(iothread->poll_group_id);
+    iothread->poll_group_id = g_strdup(value);
+}
+
+static void iothread_get_host_nodes(Object *obj, Visitor *v,
+        const char *name, void *opaque, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    uint16List *host_nodes = NULL;
+    unsigned long node;
+
+    if (iothread->host_nodes) {
+        /* Prepend in reverse, so that the list is sorted */
+        for (node = find_last_bit(iothread->host_nodes, MAX_NODES);
+             node < MAX_NODES; node--) {
+            if (test_bit(node, iothread->host_nodes)) {
+                QAPI_LIST_PREPEND(host_nodes, node);
+            }
+        }
+    }
+    visit_type_uint16List(v, name, &host_nodes, errp);
+    qapi_free_uint16List(host_nodes);
+}
+
+static void iothread_set_host_nodes(Object *obj, Visitor *v,
+        const char *name, void *opaque, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    g_autofree unsigned long *bitmap = NULL;
+    uint16List *l, *host_nodes = NULL;
+
+    if (iothread->ctx) {
+        error_setg(errp, "host-nodes cannot be changed once the IOThread "
+                   "is running");
+        return;
+    }
+    if (!visit_type_uint16List(v, name, &host_nodes, errp)) {
+        return;
+    }
+
+    for (l = host_nodes; l; l = l->next) {
+        if (l->value >= MAX_NODES) {
+            error_setg(errp, "Invalid host-nodes value: %d", l->value);
+            goto out;
+        }
+        if (!bitmap) {
+            bitmap = bitmap_new(MAX_NODES);
+        }
+        set_bit(l->value, bitmap);
+    }
+
+    g_free(iothread->host_nodes);
+    iothread->host_nodes = g_steal_pointer(&bitmap);
+
+out:
+    qapi_free_uint16List(host_nodes);
+}
+
 static void iothread_class_init(ObjectClass *klass, void *class_data)
 {
     UserCreatableClass *ucc = USER_CREATABLE_CLASS(klass);
@@ -276,6 +587,25 @@ static void iothread_class_init(ObjectClass *klass, void *class_data)
                               iothread_get_poll_param,
                               iothread_set_poll_param,
                               NULL, &poll_shrink_info);
+    object_class_property_add(klass, "io-uring-sqpoll-idle", "int",
+                              iothread_get_io_uring_sqpoll_idle,
+                              iothread_set_io_uring_sqpoll_idle,
+                              NULL, NULL);
+    object_class_property_add(klass, "thread-pool-min", "int",
+                              iothread_get_poll_param,
+                              iothread_set_thread_pool_param,
+                              NULL, &thread_pool_min_info);
+    object_class_property_add(klass, "thread-pool-max", "int",
+                              iothread_get_poll_param,
+                              iothread_set_thread_pool_param,
+                              NULL, &thread_pool_max_info);
+    object_class_property_add_str(klass, "poll-group",
+                                  iothread_get_poll_group,
+                                  iothread_set_poll_group);
+    object_class_property_add(klass, "host-nodes", "int",
+                              iothread_get_host_nodes,
+                              iothread_set_host_nodes,
+                              NULL, NULL);
 }
 
 static const TypeInfo iothread_info = {
@@ -291,9 +621,69 @@ static const TypeInfo iothread_info = {
     },
 };
 
+static void iothread_poll_group_get_max_pollers(Object *obj, Visitor *v,
+        const char *name, void *opaque, Error **errp)
+{
+    IOThreadPollGroup *pg = IOTHREAD_POLL_GROUP(obj);
+    uint32_t value = pg->group.max_pollers;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void iothread_poll_group_set_max_pollers(Object *obj, Visitor *v,
+        const char *name, void *opaque, Error **errp)
+{
+    IOThreadPollGroup *pg = IOTHREAD_POLL_GROUP(obj);
+    uint32_t value;
+
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+
+    /* Takes effect the next time each member context tries to poll */
+    qatomic_set(&pg->group.max_pollers, value);
+}
+
+static bool iothread_poll_group_can_be_deleted(UserCreatable *uc)
+{
+    return IOTHREAD_POLL_GROUP(uc)->users == 0;
+}
+
+static void iothread_poll_group_instance_init(Object *obj)
+{
+    IOThreadPollGroup *pg = IOTHREAD_POLL_GROUP(obj);
+
+    pg->group.max_pollers = 1;
+}
+
+static void iothread_poll_group_class_init(ObjectClass *klass,
+                                           void *class_data)
+{
+    UserCreatableClass *ucc = USER_CREATABLE_CLASS(klass);
+    ucc->can_be_deleted = iothread_poll_group_can_be_deleted;
+
+    object_class_property_add(klass, "max-pollers", "uint32",
+                              iothread_poll_group_get_max_pollers,
+                              iothread_poll_group_set_max_pollers,
+                              NULL, NULL);
+}
+
+static const TypeInfo iothread_poll_group_info = {
+    .name = TYPE_IOTHREAD_POLL_GROUP,
+    .parent = TYPE_OBJECT,
+    .class_init = iothread_poll_group_class_init,
+    .instance_size = sizeof(IOThreadPollGroup),
+    .instance_init = iothread_poll_group_instance_init,
+    .interfaces = (InterfaceInfo[]) {
+        {TYPE_USER_CREATABLE},
+        {}
+    },
+};
+
 static void iothread_register_types(void)
 {
     type_register_static(&iothread_info);
+    type_register_static(&iothread_poll_group_info);
 }
 
 type_init(iothread_register_types)
@@ -308,6 +698,24 @@ AioContext *iothread_get_aio_context(IOThread *iothread)
     return iothread->ctx;
 }
 
+static IOThreadStats *iothread_get_stats(IOThread *iothread)
+{
+    AioContext *ctx = iothread->ctx;
+    IOThreadStats *stats = g_new0(IOThreadStats, 1);
+
+    stats->loop_iterations = stat64_get(&ctx->stat_aio_polls);
+    stats->poll_attempts = stat64_get(&ctx->stat_poll_attempts);
+    stats->poll_hits = stat64_get(&ctx->stat_poll_hits);
+    stats->blocking_waits = stat64_get(&ctx->stat_blocking_waits);
+    stats->bh_calls = stat64_get(&ctx->stat_bh_calls);
+    stats->poll_time_ns = stat64_get(&ctx->stat_poll_time_ns);
+    stats->wait_time_ns = stat64_get(&ctx->stat_wait_time_ns);
+    stats->dispatch_time_ns = stat64_get(&ctx->stat_dispatch_time_ns);
+    stats->dispatch_latency =
+        log_histogram_get_percentiles(&ctx->dispatch_latency);
+    return stats;
+}
+
 static int query_one_iothread(Object *object, void *opaque)
 {
     IOThreadInfoList ***prev = opaque;
@@ -326,6 +734,7 @@ static int query_one_iothread(Object *object, void *opaque)
     info->poll_max_ns = iothread->poll_max_ns;
     info->poll_grow = iothread->poll_grow;
     info->poll_shrink = iothread->poll_shrink;
+    info->stats = iothread_get_stats(iothread);
 
     elem = g_new0(IOThreadInfoList, 1);
     elem->value = info;
@@ -2343,6 +2343,53 @@ static void pgb_dynamic(const char *image_name, long align)
     }
 }
 
+/*
+ * Try to place the reserved address space at its own address on the host,
+ * i.e. with guest_base == 0, which removes the guest_base addition (and
+ * for 32-bit guests the zero-extension) from every load and store that
+ * the backend generates.  The pages below mmap_min_addr cannot be mapped
+ * by the host, so they are withheld from the guest as well, which is what
+ * the kernel would do for a native process.
+ */
+static bool pgb_reserved_va_identity(abi_ulong guest_loaddr, long align)
+{
+    uintptr_t start = ROUND_UP(MAX(mmap_min_addr, 1), align);
+    uintptr_t end = reserved_va;
+    void *addr;
+
+    if (sizeof(uintptr_t) != 8 || !MAP_FIXED_NOREPLACE) {
+        return false;
+    }
+    if (guest_loaddr && guest_loaddr < start) {
+        return false;
+    }
+    if (ARM_COMMPAGE) {
+        /* As in pgb_static, keep the commpage inside the reservation. */
+        end = MAX(end, (uintptr_t)4 << 30);
+    }
+    if (start >= end) {
+        return false;
+    }
+
+    addr = mmap((void *)start, end - start, PROT_NONE,
+                MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE |
+                MAP_FIXED_NOREPLACE, -1, 0);
+    if (addr == MAP_FAILED) {
+        return false;
+    }
+    if (addr != (void *)start) {
+        /* Kernels before 4.17 treat MAP_FIXED_NOREPLACE as a hint. */
+        munmap(addr, end - start);
+        return false;
+    }
+
+    guest_base = 0;
+    mmap_lock();
+    page_set_flags(0, start, PAGE_RESERVED);
+    mmap_unlock();
+    return true;
+}
+
 static void pgb_reserved_va(const char *image_name, abi_ulong guest_loaddr,
                             abi_ulong guest_hiaddr, long align)
 {
@@ -2356,6 +2403,10 @@ static void pgb_reserved_va(const char *image_name, abi_ulong guest_loaddr,
         exit(EXIT_FAILURE);
     }
 
+    if (pgb_reserved_va_identity(guest_loaddr, align)) {
+        return;
+    }
+
     /* Widen the "image" to the entire reserved address space. */
     pgb_static(image_name, 0, reserved_va, align);
 
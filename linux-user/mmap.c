@@ -708,8 +708,8 @@ int target_munmap(abi_ulong start, abi_ulong len)
     }
 
     if (ret == 0) {
+        /* this also invalidates the code in the range */
         page_set_flags(start, start + len, 0);
-        tb_invalidate_phys_range(start, start + len);
     }
     mmap_unlock();
     return ret;
@@ -50,9 +50,12 @@
  * header
  * be64: start sector
  * be32: number of sectors
- * [ be64: buffer size  ] \ ! (flags & ZEROES)
+ * [ be64: buffer size  ] \ ! (flags & (ZEROES | ONES))
  * [ n bytes: buffer    ] /
  *
+ * A chunk with ZEROES or ONES may span many CHUNK_SIZE chunks.  ONES is only
+ * sent with the dirty-bitmaps-compact capability.
+ *
  * The last chunk in stream should contain flags & EOS. The chunk may skip
  * device and/or bitmap names, assuming them to be the same with the previous
  * chunk.
@@ -97,6 +100,9 @@
 
 #define DIRTY_BITMAP_MIG_EXTRA_FLAGS        0x80
 
+/* Two-byte flags */
+#define DIRTY_BITMAP_MIG_FLAG_ONES          0x0100
+
 #define DIRTY_BITMAP_MIG_START_FLAG_ENABLED          0x01
 #define DIRTY_BITMAP_MIG_START_FLAG_PERSISTENT       0x02
 /* 0x04 was "AUTOLOAD" flags on older versions, now it is ignored */
@@ -353,7 +359,7 @@ bool check_dirty_bitmap_mig_alias_map(const BitmapMigrationNodeAliasList *bbm,
 
 static uint32_t qemu_get_bitmap_flags(QEMUFile *f)
 {
-    uint8_t flags = qemu_get_byte(f);
+    uint32_t flags = qemu_get_byte(f);
     if (flags & DIRTY_BITMAP_MIG_EXTRA_FLAGS) {
         flags = flags << 8 | qemu_get_byte(f);
         if (flags & DIRTY_BITMAP_MIG_EXTRA_FLAGS) {
@@ -366,10 +372,14 @@ static uint32_t qemu_get_bitmap_flags(QEMUFile *f)
 
 static void qemu_put_bitmap_flags(QEMUFile *f, uint32_t flags)
 {
-    /* The code currently does not send flags as more than one byte */
-    assert(!(flags & (0xffffff00 | DIRTY_BITMAP_MIG_EXTRA_FLAGS)));
+    /* The code currently does not send flags as more than two bytes */
+    assert(!(flags & (0xffff8000 | DIRTY_BITMAP_MIG_EXTRA_FLAGS)));
 
-    qemu_put_byte(f, flags);
+    if (flags & 0xff00) {
+        qemu_put_be16(f, flags | DIRTY_BITMAP_MIG_EXTRA_FLAGS << 8);
+    } else {
+        qemu_put_byte(f, flags);
+    }
 }
 
 static void send_bitmap_header(QEMUFile *f, DBMSaveState *s,
@@ -459,6 +469,49 @@ static void send_bitmap_bits(QEMUFile *f, DBMSaveState *s,
     g_free(buf);
 }
 
+/* Send @nr_sectors from @start_sector whose bits are all clear or all set */
+static void send_bitmap_fill(QEMUFile *f, DBMSaveState *s,
+                             SaveBitmapState *dbms, uint32_t fill_flag,
+                             uint64_t start_sector, uint32_t nr_sectors)
+{
+    uint32_t flags = DIRTY_BITMAP_MIG_FLAG_BITS | fill_flag;
+
+    trace_send_bitmap_bits(flags, start_sector, nr_sectors, 0);
+
+    send_bitmap_header(f, s, dbms, flags);
+
+    qemu_put_be64(f, start_sector);
+    qemu_put_be32(f, nr_sectors);
+    qemu_fflush(f);
+}
+
+/*
+ * Return how many sectors from dbms->cur_sector, in whole chunks, have
+ * all their bits clear, or all set if @ones.
+ */
+static uint32_t bitmap_fill_sectors(SaveBitmapState *dbms, bool ones)
+{
+    uint64_t max_sectors = QEMU_ALIGN_DOWN(UINT32_MAX, dbms->sectors_per_chunk);
+    uint64_t nr_sectors = MIN(dbms->total_sectors - dbms->cur_sector,
+                              max_sectors);
+    int64_t offset = dbms->cur_sector << BDRV_SECTOR_BITS;
+    int64_t bytes = nr_sectors << BDRV_SECTOR_BITS;
+    int64_t end;
+
+    if (ones) {
+        end = bdrv_dirty_bitmap_next_zero(dbms->bitmap, offset, bytes);
+    } else {
+        end = bdrv_dirty_bitmap_next_dirty(dbms->bitmap, offset, bytes);
+    }
+    if (end < 0) {
+        /* The last chunk of the bitmap may be partial */
+        return nr_sectors;
+    }
+
+    return QEMU_ALIGN_DOWN((end >> BDRV_SECTOR_BITS) - dbms->cur_sector,
+                           dbms->sectors_per_chunk);
+}
+
 /* Called with iothread lock taken.  */
 static void dirty_bitmap_do_save_cleanup(DBMSaveState *s)
 {
@@ -668,10 +721,23 @@ fail:
 static void bulk_phase_send_chunk(QEMUFile *f, DBMSaveState *s,
                                   SaveBitmapState *dbms)
 {
-    uint32_t nr_sectors = MIN(dbms->total_sectors - dbms->cur_sector,
-                             dbms->sectors_per_chunk);
+    uint32_t nr_sectors;
+    uint32_t fill_flag = DIRTY_BITMAP_MIG_FLAG_ZEROES;
+
+    /* Runs of clean (or, if the destination knows ONES, dirty) chunks */
+    nr_sectors = bitmap_fill_sectors(dbms, false);
+    if (!nr_sectors && migrate_dirty_bitmaps_compact()) {
+        nr_sectors = bitmap_fill_sectors(dbms, true);
+        fill_flag = DIRTY_BITMAP_MIG_FLAG_ONES;
+    }
 
-    send_bitmap_bits(f, s, dbms, dbms->cur_sector, nr_sectors);
+    if (nr_sectors) {
+        send_bitmap_fill(f, s, dbms, fill_flag, dbms->cur_sector, nr_sectors);
+    } else {
+        nr_sectors = MIN(dbms->total_sectors - dbms->cur_sector,
+                         dbms->sectors_per_chunk);
+        send_bitmap_bits(f, s, dbms, dbms->cur_sector, nr_sectors);
+    }
 
     dbms->cur_sector += nr_sectors;
     if (dbms->cur_sector >= dbms->total_sectors) {
@@ -953,6 +1019,12 @@ static int dirty_bitmap_load_bits(QEMUFile *f, DBMLoadState *s)
             bdrv_dirty_bitmap_deserialize_zeroes(s->bitmap, first_byte,
                                                  nr_bytes, false);
         }
+    } else if (s->flags & DIRTY_BITMAP_MIG_FLAG_ONES) {
+        trace_dirty_bitmap_load_bits_ones();
+        if (!s->cancelled) {
+            bdrv_dirty_bitmap_deserialize_ones(s->bitmap, first_byte,
+                                               nr_bytes, false);
+        }
     } else {
         size_t ret;
         g_autofree uint8_t *buf = NULL;
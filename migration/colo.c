@@ -453,6 +453,13 @@ static int colo_do_checkpoint_transaction(MigrationState *s,
         abort();
 #endif
 
+    /* Send the packets that filter-mirror still holds to the secondary */
+    colo_notify_filters_event(COLO_EVENT_CHECKPOINT, &local_err);
+    if (local_err) {
+        qemu_mutex_unlock_iothread();
+        goto out;
+    }
+
     colo_send_message(s->to_dst_file, COLO_MESSAGE_VMSTATE_SEND, &local_err);
     if (local_err) {
         qemu_mutex_unlock_iothread();
@@ -15,14 +15,21 @@
 #include "qapi/error.h"
 #include "cpu.h"
 #include "exec/ramblock.h"
+#include "exec/ram_addr.h"
 #include "qemu/rcu_queue.h"
+#include "qemu/main-loop.h"
+#include "qapi/clone-visitor.h"
 #include "qapi/qapi-commands-migration.h"
+#include "qapi/qapi-visit-migration.h"
+#include "migration/misc.h"
+#include "sysemu/kvm.h"
 #include "ram.h"
 #include "trace.h"
 #include "dirtyrate.h"
 
 static int CalculatingState = DIRTY_RATE_STATUS_UNSTARTED;
 static struct DirtyRateStat DirtyStat;
+static bool DirtyLogInUse;
 
 static int64_t set_sample_page_period(int64_t msec, int64_t initial_time)
 {
@@ -72,6 +79,18 @@ static struct DirtyRateInfo *query_dirty_rate_info(void)
     info->status = CalculatingState;
     info->start_time = DirtyStat.start_time;
     info->calc_time = DirtyStat.calc_time;
+    info->mode = DirtyStat.mode;
+
+    if (info->has_dirty_rate) {
+        info->has_ramblock_dirty_rate = true;
+        info->ramblock_dirty_rate = QAPI_CLONE(DirtyRateRamBlockList,
+                                               DirtyStat.ramblock_rates);
+        if (DirtyStat.vcpu_rates) {
+            info->has_vcpu_dirty_rate = true;
+            info->vcpu_dirty_rate = QAPI_CLONE(DirtyRateVcpuList,
+                                               DirtyStat.vcpu_rates);
+        }
+    }
 
     trace_query_dirty_rate_info(DirtyRateStatus_str(CalculatingState));
 
@@ -88,6 +107,46 @@ static void init_dirtyrate_stat(int64_t start_time, int64_t calc_time)
     DirtyStat.calc_time = calc_time;
 }
 
+/* Called with the BQL held, so that no query looks at the old results */
+static void reset_dirtyrate_stat(DirtyRateMeasureMode mode)
+{
+    qapi_free_DirtyRateRamBlockList(DirtyStat.ramblock_rates);
+    DirtyStat.ramblock_rates = NULL;
+    qapi_free_DirtyRateVcpuList(DirtyStat.vcpu_rates);
+    DirtyStat.vcpu_rates = NULL;
+    DirtyStat.mode = mode;
+}
+
+/* dirty rate in MB/s of @pages pages dirtied in @msec milliseconds */
+static int64_t pages_to_dirtyrate(uint64_t pages, int64_t msec)
+{
+    return ((pages * TARGET_PAGE_SIZE * 1000) / msec) >> 20;
+}
+
+static void add_ramblock_dirtyrate(DirtyRateRamBlockList ***tail,
+                                   const char *idstr, int64_t dirty_rate)
+{
+    DirtyRateRamBlockList *entry = g_new0(DirtyRateRamBlockList, 1);
+
+    entry->value = g_new0(DirtyRateRamBlock, 1);
+    entry->value->idstr = g_strdup(idstr);
+    entry->value->dirty_rate = dirty_rate;
+    **tail = entry;
+    *tail = &entry->next;
+}
+
+static void add_vcpu_dirtyrate(DirtyRateVcpuList ***tail, int64_t id,
+                               int64_t dirty_rate)
+{
+    DirtyRateVcpuList *entry = g_new0(DirtyRateVcpuList, 1);
+
+    entry->value = g_new0(DirtyRateVcpu, 1);
+    entry->value->id = id;
+    entry->value->dirty_rate = dirty_rate;
+    **tail = entry;
+    *tail = &entry->next;
+}
+
 static void update_dirtyrate_stat(struct RamblockDirtyInfo *info)
 {
     DirtyStat.total_dirty_samples += info->sample_dirty_count;
@@ -298,9 +357,10 @@ find_block_matched(RAMBlock *block, int count,
 }
 
 static bool compare_page_hash_info(struct RamblockDirtyInfo *info,
-                                  int block_count)
+                                  int block_count, int64_t msec)
 {
     struct RamblockDirtyInfo *block_dinfo = NULL;
+    DirtyRateRamBlockList **tail = &DirtyStat.ramblock_rates;
     RAMBlock *block = NULL;
 
     RAMBLOCK_FOREACH_MIGRATABLE(block) {
@@ -313,6 +373,14 @@ static bool compare_page_hash_info(struct RamblockDirtyInfo *info,
         }
         calc_page_dirty_rate(block_dinfo);
         update_dirtyrate_stat(block_dinfo);
+        if (block_dinfo->sample_pages_count) {
+            add_ramblock_dirtyrate(&tail, block_dinfo->idstr,
+                                   pages_to_dirtyrate(
+                                       block_dinfo->sample_dirty_count *
+                                       block_dinfo->ramblock_pages /
+                                       block_dinfo->sample_pages_count,
+                                       msec));
+        }
     }
 
     if (DirtyStat.total_sample_count == 0) {
@@ -322,6 +390,112 @@ static bool compare_page_hash_info(struct RamblockDirtyInfo *info,
     return true;
 }
 
+/*
+ * Count the pages of @block that are dirty in the migration bitmap, and
+ * clear them.
+ */
+static uint64_t ramblock_count_and_clear_dirty(RAMBlock *block)
+{
+    DirtyMemoryBlocks *blocks;
+    unsigned long page = block->offset >> TARGET_PAGE_BITS;
+    unsigned long end = page + (block->used_length >> TARGET_PAGE_BITS);
+    uint64_t count = 0;
+
+    blocks = qatomic_rcu_read(&ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION]);
+    while (page < end) {
+        unsigned long idx = page / DIRTY_MEMORY_BLOCK_SIZE;
+        unsigned long offset = page % DIRTY_MEMORY_BLOCK_SIZE;
+        unsigned long num = MIN(end - page, DIRTY_MEMORY_BLOCK_SIZE - offset);
+
+        count += bitmap_count_one_with_offset(blocks->blocks[idx], offset,
+                                              num);
+        bitmap_test_and_clear_atomic(blocks->blocks[idx], offset, num);
+        page += num;
+    }
+
+    return count;
+}
+
+/*
+ * Measure with dirty page logging: unlike sampling, every page that is
+ * written during the measurement is counted, however sparse the writes
+ * are, and no page needs to be hashed.
+ */
+static void calculate_dirtyrate_dirty_log(struct DirtyRateConfig config)
+{
+    DirtyRateRamBlockList **block_tail = &DirtyStat.ramblock_rates;
+    DirtyRateVcpuList **vcpu_tail = &DirtyStat.vcpu_rates;
+    bool per_vcpu = kvm_dirty_ring_enabled();
+    uint64_t *vcpu_pages = NULL;
+    int nr_vcpu_pages = 0;
+    uint64_t total_pages = 0;
+    int64_t initial_time;
+    int64_t msec;
+    RAMBlock *block;
+    CPUState *cpu;
+
+    qemu_mutex_lock_iothread();
+    memory_global_dirty_log_start();
+
+    /* Forget about the pages that were dirtied before the measurement */
+    memory_global_dirty_log_sync();
+    WITH_RCU_READ_LOCK_GUARD() {
+        RAMBLOCK_FOREACH_MIGRATABLE(block) {
+            ramblock_count_and_clear_dirty(block);
+            /* With manual dirty log protection, this protects the pages */
+            memory_region_clear_dirty_bitmap(block->mr, 0, block->used_length);
+        }
+    }
+    if (per_vcpu) {
+        CPU_FOREACH(cpu) {
+            nr_vcpu_pages = MAX(nr_vcpu_pages, cpu->cpu_index + 1);
+        }
+        vcpu_pages = g_new0(uint64_t, nr_vcpu_pages);
+        CPU_FOREACH(cpu) {
+            vcpu_pages[cpu->cpu_index] = stat64_get(&cpu->dirty_pages);
+        }
+    }
+    initial_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    qemu_mutex_unlock_iothread();
+
+    msec = config.sample_period_seconds * 1000;
+    msec = set_sample_page_period(msec, initial_time);
+    DirtyStat.start_time = initial_time / 1000;
+    DirtyStat.calc_time = msec / 1000;
+
+    qemu_mutex_lock_iothread();
+    memory_global_dirty_log_sync();
+    WITH_RCU_READ_LOCK_GUARD() {
+        RAMBLOCK_FOREACH_MIGRATABLE(block) {
+            uint64_t pages = ramblock_count_and_clear_dirty(block);
+
+            add_ramblock_dirtyrate(&block_tail, block->idstr,
+                                   pages_to_dirtyrate(pages, msec));
+            total_pages += pages;
+        }
+    }
+    if (per_vcpu) {
+        CPU_FOREACH(cpu) {
+            uint64_t pages = stat64_get(&cpu->dirty_pages);
+
+            /* A vcpu plugged during the measurement counts from zero */
+            if (cpu->cpu_index < nr_vcpu_pages &&
+                pages >= vcpu_pages[cpu->cpu_index]) {
+                pages -= vcpu_pages[cpu->cpu_index];
+            }
+            add_vcpu_dirtyrate(&vcpu_tail, cpu->cpu_index,
+                               pages_to_dirtyrate(pages, msec));
+        }
+    }
+    memory_global_dirty_log_stop();
+    qatomic_set(&DirtyLogInUse, false);
+    qemu_mutex_unlock_iothread();
+
+    trace_calculate_dirtyrate_dirty_log(total_pages, msec);
+    DirtyStat.dirty_rate = pages_to_dirtyrate(total_pages, msec);
+    g_free(vcpu_pages);
+}
+
 static void calculate_dirtyrate(struct DirtyRateConfig config)
 {
     struct RamblockDirtyInfo *block_dinfo = NULL;
@@ -343,7 +517,7 @@ static void calculate_dirtyrate(struct DirtyRateConfig config)
     DirtyStat.calc_time = msec / 1000;
 
     rcu_read_lock();
-    if (!compare_page_hash_info(block_dinfo, block_count)) {
+    if (!compare_page_hash_info(block_dinfo, block_count, msec)) {
         goto out;
     }
 
@@ -366,6 +540,7 @@ void *get_dirtyrate_thread(void *arg)
                               DIRTY_RATE_STATUS_MEASURING);
     if (ret == -1) {
         error_report("change dirtyrate state failed.");
+        qatomic_set(&DirtyLogInUse, false);
         return NULL;
     }
 
@@ -373,7 +548,13 @@ void *get_dirtyrate_thread(void *arg)
     calc_time = config.sample_period_seconds;
     init_dirtyrate_stat(start_time, calc_time);
 
-    calculate_dirtyrate(config);
+    if (config.mode == DIRTY_RATE_MEASURE_MODE_DIRTY_LOG) {
+        rcu_register_thread();
+        calculate_dirtyrate_dirty_log(config);
+        rcu_unregister_thread();
+    } else {
+        calculate_dirtyrate(config);
+    }
 
     ret = dirtyrate_set_state(&CalculatingState, DIRTY_RATE_STATUS_MEASURING,
                               DIRTY_RATE_STATUS_MEASURED);
@@ -383,7 +564,13 @@ void *get_dirtyrate_thread(void *arg)
     return NULL;
 }
 
-void qmp_calc_dirty_rate(int64_t calc_time, Error **errp)
+bool dirtyrate_dirty_log_in_use(void)
+{
+    return qatomic_read(&DirtyLogInUse);
+}
+
+void qmp_calc_dirty_rate(int64_t calc_time, bool has_mode,
+                         DirtyRateMeasureMode mode, Error **errp)
 {
     static struct DirtyRateConfig config;
     QemuThread thread;
@@ -404,6 +591,14 @@ void qmp_calc_dirty_rate(int64_t calc_time, Error **errp)
         return;
     }
 
+    if (!has_mode) {
+        mode = DIRTY_RATE_MEASURE_MODE_PAGE_SAMPLING;
+    }
+    if (mode == DIRTY_RATE_MEASURE_MODE_DIRTY_LOG && !migration_is_idle()) {
+        error_setg(errp, "mode dirty-log cannot be used during migration.");
+        return;
+    }
+
     /*
      * Init calculation state as unstarted.
      */
@@ -414,8 +609,14 @@ void qmp_calc_dirty_rate(int64_t calc_time, Error **errp)
         return;
     }
 
+    reset_dirtyrate_stat(mode);
+    if (mode == DIRTY_RATE_MEASURE_MODE_DIRTY_LOG) {
+        qatomic_set(&DirtyLogInUse, true);
+    }
+
     config.sample_period_seconds = calc_time;
     config.sample_pages_per_gigabytes = DIRTYRATE_DEFAULT_SAMPLE_PAGES;
+    config.mode = mode;
     qemu_thread_create(&thread, "get_dirtyrate", get_dirtyrate_thread,
                        (void *)&config, QEMU_THREAD_DETACHED);
 }
@@ -13,6 +13,8 @@
 #ifndef QEMU_MIGRATION_DIRTYRATE_H
 #define QEMU_MIGRATION_DIRTYRATE_H
 
+#include "qapi/qapi-types-migration.h"
+
 /*
  * Sample 512 pages per GB as default.
  * TODO: Make it configurable.
@@ -38,6 +40,7 @@
 struct DirtyRateConfig {
     uint64_t sample_pages_per_gigabytes; /* sample pages per GB */
     int64_t sample_period_seconds; /* time duration between two sampling */
+    DirtyRateMeasureMode mode; /* method used to measure */
 };
 
 /*
@@ -63,7 +66,16 @@ struct DirtyRateStat {
     int64_t dirty_rate; /* dirty rate in MB/s */
     int64_t start_time; /* calculation start time in units of second */
     int64_t calc_time; /* time duration of two sampling in units of second */
+    DirtyRateMeasureMode mode; /* method used to measure */
+    DirtyRateRamBlockList *ramblock_rates; /* dirty rate of each ramblock */
+    DirtyRateVcpuList *vcpu_rates; /* dirty rate of each vcpu, if known */
 };
 
 void *get_dirtyrate_thread(void *arg);
+
+/*
+ * Whether a measurement is using dirty page logging, which migration
+ * needs for itself.
+ */
+bool dirtyrate_dirty_log_in_use(void);
 #endif
@@ -0,0 +1,174 @@
+/*
+ * Iterative migration of device state buffers
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Format of the section:
+ *
+ * repeated:
+ *   be32: chunk index
+ *   chunk_size bytes: chunk data (the last chunk may be shorter)
+ * be32: ITERATIVE_STATE_EOS
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bitmap.h"
+#include "qemu/error-report.h"
+#include "migration/iterative-state.h"
+#include "migration/register.h"
+#include "qemu-file.h"
+#include "trace.h"
+
+#define ITERATIVE_STATE_EOS UINT32_MAX
+
+struct IterativeState {
+    char *idstr;
+    uint8_t *data;
+    size_t size;
+    size_t chunk_size;
+    unsigned long nb_chunks;
+    /* Chunks modified since they were last sent */
+    unsigned long *dirty;
+};
+
+static size_t iterative_state_chunk_len(IterativeState *is,
+                                        unsigned long chunk)
+{
+    return MIN(is->chunk_size, is->size - chunk * is->chunk_size);
+}
+
+/*
+ * Send the dirty chunks, stopping early when @rate_limit is set and the
+ * stream is over its limit.  Returns true if nothing is left to send.
+ */
+static bool iterative_state_send(QEMUFile *f, IterativeState *is,
+                                 bool rate_limit)
+{
+    unsigned long chunk = 0;
+    unsigned long sent = 0;
+    bool done = true;
+
+    while ((chunk = find_next_bit(is->dirty, is->nb_chunks, chunk)) <
+           is->nb_chunks) {
+        if (rate_limit && qemu_file_rate_limit(f)) {
+            done = false;
+            break;
+        }
+        if (bitmap_test_and_clear_atomic(is->dirty, chunk, 1)) {
+            qemu_put_be32(f, chunk);
+            qemu_put_buffer(f, is->data + chunk * is->chunk_size,
+                            iterative_state_chunk_len(is, chunk));
+            sent++;
+        }
+        chunk++;
+    }
+    qemu_put_be32(f, ITERATIVE_STATE_EOS);
+
+    trace_iterative_state_send(is->idstr, sent, done);
+    return done;
+}
+
+static int iterative_state_save_setup(QEMUFile *f, void *opaque)
+{
+    IterativeState *is = opaque;
+
+    bitmap_set_atomic(is->dirty, 0, is->nb_chunks);
+    qemu_put_be32(f, ITERATIVE_STATE_EOS);
+    return 0;
+}
+
+static int iterative_state_save_iterate(QEMUFile *f, void *opaque)
+{
+    return iterative_state_send(f, opaque, true) ? 1 : 0;
+}
+
+static int iterative_state_save_complete(QEMUFile *f, void *opaque)
+{
+    iterative_state_send(f, opaque, false);
+    return 0;
+}
+
+static void iterative_state_save_pending(QEMUFile *f, void *opaque,
+                                         uint64_t max_size,
+                                         uint64_t *res_precopy_only,
+                                         uint64_t *res_compatible,
+                                         uint64_t *res_postcopy_only)
+{
+    IterativeState *is = opaque;
+
+    *res_precopy_only += bitmap_count_one(is->dirty, is->nb_chunks) *
+                         is->chunk_size;
+}
+
+static int iterative_state_load(QEMUFile *f, void *opaque, int version_id)
+{
+    IterativeState *is = opaque;
+    uint32_t chunk;
+    int ret;
+
+    while ((chunk = qemu_get_be32(f)) != ITERATIVE_STATE_EOS) {
+        if (chunk >= is->nb_chunks) {
+            error_report("%s: chunk %" PRIu32 " out of range (%lu chunks)",
+                         is->idstr, chunk, is->nb_chunks);
+            return -EINVAL;
+        }
+        qemu_get_buffer(f, is->data + (size_t)chunk * is->chunk_size,
+                        iterative_state_chunk_len(is, chunk));
+        ret = qemu_file_get_error(f);
+        if (ret) {
+            return ret;
+        }
+    }
+
+    return qemu_file_get_error(f);
+}
+
+static SaveVMHandlers savevm_iterative_state_handlers = {
+    .save_setup = iterative_state_save_setup,
+    .save_live_iterate = iterative_state_save_iterate,
+    .save_live_complete_precopy = iterative_state_save_complete,
+    .save_live_pending = iterative_state_save_pending,
+    .load_state = iterative_state_load,
+};
+
+IterativeState *iterative_state_register(const char *idstr,
+                                         uint32_t instance_id,
+                                         void *data, size_t size,
+                                         size_t chunk_size)
+{
+    IterativeState *is = g_new0(IterativeState, 1);
+
+    assert(chunk_size);
+    is->idstr = g_strdup(idstr);
+    is->data = data;
+    is->size = size;
+    is->chunk_size = chunk_size;
+    is->nb_chunks = DIV_ROUND_UP(size, chunk_size);
+    is->dirty = bitmap_new(is->nb_chunks);
+
+    register_savevm_live(idstr, instance_id, 1,
+                         &savevm_iterative_state_handlers, is);
+    return is;
+}
+
+void iterative_state_set_dirty(IterativeState *is, size_t offset, size_t len)
+{
+    unsigned long first, last;
+
+    if (!len) {
+        return;
+    }
+    assert(offset + len <= is->size);
+    first = offset / is->chunk_size;
+    last = (offset + len - 1) / is->chunk_size;
+    bitmap_set_atomic(is->dirty, first, last - first + 1);
+}
+
+void iterative_state_unregister(IterativeState *is)
+{
+    unregister_savevm(NULL, is->idstr, is);
+    g_free(is->dirty);
+    g_free(is->idstr);
+    g_free(is);
+}
@@ -0,0 +1,549 @@
+/*
+ * Fixed offsets for the RAM pages in the migration file
+ *
+ * With mapped-ram, the stream only carries a small header for each
+ * RAMBlock.  The header gives the offsets in the file of a bitmap of the
+ * pages that were saved and of a region as large as the RAMBlock, where
+ * each page has its own place.  The stream continues after the region.
+ * A page that is dirtied again overwrites its previous version, so the
+ * file doesn't grow with the number of iterations, and the pages can be
+ * written and read by several threads, without going through QEMUFile.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bitmap.h"
+#include "qemu/cutils.h"
+#include "qemu/error-report.h"
+#include "qemu/rcu.h"
+#include "qemu/thread.h"
+#include "qemu/units.h"
+#include "exec/ramblock.h"
+#include "exec/target_page.h"
+#include "qapi/error.h"
+#include "migration.h"
+#include "qemu-file.h"
+#include "file.h"
+#include "mapped-ram.h"
+#include "trace.h"
+
+#define MAPPED_RAM_HDR_VERSION 1
+/* version, page size, bitmap offset, pages offset */
+#define MAPPED_RAM_HDR_SIZE    (4 + 3 * 8)
+#define MAPPED_RAM_BITMAP_ALIGN (4 * KiB)
+/* Keep the pages aligned for O_DIRECT, whatever the block size */
+#define MAPPED_RAM_PAGES_ALIGN  (1 * MiB)
+
+/* Enough jobs for each thread to have one waiting */
+#define MAPPED_RAM_MAX_JOBS    (2 * UINT8_MAX)
+
+typedef struct {
+    RAMBlock *block;
+    ram_addr_t offset;
+    ram_addr_t length;
+} MappedRamJob;
+
+static struct {
+    QemuThread *threads;
+    int thread_count;
+    /* reading the file instead of writing it */
+    bool load;
+    /* for the bitmaps */
+    int fd;
+    /* for the pages, opened with O_DIRECT with direct-io */
+    int pages_fd;
+    /* Protects everything below */
+    QemuMutex lock;
+    /* signalled when a job is queued, or to quit */
+    QemuCond job_cond;
+    /* signalled when a thread is done with a job */
+    QemuCond done_cond;
+    MappedRamJob jobs[MAPPED_RAM_MAX_JOBS];
+    int first_job;
+    int nr_jobs;
+    /* jobs that a thread took and has not finished yet */
+    int running_jobs;
+    /* zero pages that the threads did not write since the last flush */
+    uint64_t zero_pages;
+    /* first error of the threads, as a negative errno */
+    int error;
+    bool quit;
+} mapped_ram;
+
+static int mapped_ram_pio(bool write, int fd, uint8_t *buf, size_t len,
+                          off_t offset)
+{
+    while (len) {
+        ssize_t ret;
+
+        if (write) {
+            ret = pwrite(fd, buf, len, offset);
+        } else {
+            ret = pread(fd, buf, len, offset);
+        }
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        if (ret == 0) {
+            /* The file is shorter than its headers say */
+            return -EIO;
+        }
+        buf += ret;
+        len -= ret;
+        offset += ret;
+    }
+    return 0;
+}
+
+/*
+ * A zero page is not written if the file has no copy of it yet, because
+ * the file starts out empty and reads as zero there.  Keeping this true
+ * lets the destination map the pages of the file as they are.
+ */
+static bool mapped_ram_skip_page(RAMBlock *block, ram_addr_t offset)
+{
+    return !test_bit(offset >> qemu_target_page_bits(), block->file_bmap) &&
+           buffer_is_zero(block->host + offset, qemu_target_page_size());
+}
+
+/*
+ * Write the pages of a job that are not zero.  Zero pages are only
+ * cleared in the bitmap: the destination RAM is zero to start with.
+ */
+static int mapped_ram_write_job(MappedRamJob *job, uint64_t *zero_pages)
+{
+    RAMBlock *block = job->block;
+    size_t page_size = qemu_target_page_size();
+    int page_bits = qemu_target_page_bits();
+    ram_addr_t offset = job->offset;
+    ram_addr_t end = job->offset + job->length;
+    int ret;
+
+    while (offset < end) {
+        ram_addr_t start;
+
+        if (mapped_ram_skip_page(block, offset)) {
+            (*zero_pages)++;
+            offset += page_size;
+            continue;
+        }
+
+        start = offset;
+        do {
+            set_bit_atomic(offset >> page_bits, block->file_bmap);
+            offset += page_size;
+        } while (offset < end && !mapped_ram_skip_page(block, offset));
+
+        ret = mapped_ram_pio(true, mapped_ram.pages_fd, block->host + start,
+                             offset - start, block->pages_offset + start);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+static void *mapped_ram_thread(void *opaque)
+{
+    rcu_register_thread();
+
+    qemu_mutex_lock(&mapped_ram.lock);
+    while (true) {
+        MappedRamJob job;
+        uint64_t zero_pages = 0;
+        int ret;
+
+        while (!mapped_ram.nr_jobs && !mapped_ram.quit) {
+            qemu_cond_wait(&mapped_ram.job_cond, &mapped_ram.lock);
+        }
+        if (mapped_ram.quit) {
+            break;
+        }
+
+        job = mapped_ram.jobs[mapped_ram.first_job];
+        mapped_ram.first_job = (mapped_ram.first_job + 1) %
+                               MAPPED_RAM_MAX_JOBS;
+        mapped_ram.nr_jobs--;
+        mapped_ram.running_jobs++;
+        qemu_mutex_unlock(&mapped_ram.lock);
+
+        WITH_RCU_READ_LOCK_GUARD() {
+            if (mapped_ram.load) {
+                ret = mapped_ram_pio(false, mapped_ram.pages_fd,
+                                     job.block->host + job.offset,
+                                     job.length,
+                                     job.block->pages_offset + job.offset);
+            } else {
+                ret = mapped_ram_write_job(&job, &zero_pages);
+            }
+        }
+
+        qemu_mutex_lock(&mapped_ram.lock);
+        mapped_ram.running_jobs--;
+        mapped_ram.zero_pages += zero_pages;
+        if (ret < 0 && !mapped_ram.error) {
+            mapped_ram.error = ret;
+        }
+        qemu_cond_broadcast(&mapped_ram.done_cond);
+    }
+    qemu_mutex_unlock(&mapped_ram.lock);
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/**
+ * mapped_ram_cleanup: stop the threads and close the file descriptors
+ *
+ * Jobs that are still queued are dropped.
+ */
+void mapped_ram_cleanup(void)
+{
+    int i;
+
+    if (!mapped_ram.threads) {
+        return;
+    }
+
+    qemu_mutex_lock(&mapped_ram.lock);
+    mapped_ram.quit = true;
+    qemu_cond_broadcast(&mapped_ram.job_cond);
+    qemu_mutex_unlock(&mapped_ram.lock);
+
+    for (i = 0; i < mapped_ram.thread_count; i++) {
+        qemu_thread_join(&mapped_ram.threads[i]);
+    }
+    g_free(mapped_ram.threads);
+    mapped_ram.threads = NULL;
+    mapped_ram.thread_count = 0;
+
+    if (mapped_ram.pages_fd != mapped_ram.fd) {
+        close(mapped_ram.pages_fd);
+    }
+    close(mapped_ram.fd);
+
+    qemu_cond_destroy(&mapped_ram.done_cond);
+    qemu_cond_destroy(&mapped_ram.job_cond);
+    qemu_mutex_destroy(&mapped_ram.lock);
+}
+
+/**
+ * mapped_ram_setup: open the migration file and start the threads
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @load: whether the pages are read from the file, or written to it
+ * @errp: pointer to an error
+ */
+int mapped_ram_setup(bool load, Error **errp)
+{
+    int flags = load ? O_RDONLY : O_WRONLY;
+    int i, thread_count = migrate_get_current()->mapped_ram_threads;
+    int fd, pages_fd;
+
+    if (!thread_count) {
+        error_setg(errp, "mapped-ram needs at least one thread");
+        return -1;
+    }
+
+    fd = file_open_fd(flags, errp);
+    if (fd < 0) {
+        return -1;
+    }
+    pages_fd = fd;
+
+    if (migrate_direct_io()) {
+#ifdef O_DIRECT
+        if (qemu_target_page_size() < qemu_real_host_page_size) {
+            error_setg(errp, "direct-io needs target pages at least as "
+                       "large as host pages");
+            close(fd);
+            return -1;
+        }
+        pages_fd = file_open_fd(flags | O_DIRECT, errp);
+        if (pages_fd < 0) {
+            close(fd);
+            return -1;
+        }
+#else
+        error_setg(errp, "direct-io is not supported on this host");
+        close(fd);
+        return -1;
+#endif
+    }
+
+    mapped_ram.load = load;
+    mapped_ram.fd = fd;
+    mapped_ram.pages_fd = pages_fd;
+    mapped_ram.first_job = 0;
+    mapped_ram.nr_jobs = 0;
+    mapped_ram.running_jobs = 0;
+    mapped_ram.zero_pages = 0;
+    mapped_ram.error = 0;
+    mapped_ram.quit = false;
+    qemu_mutex_init(&mapped_ram.lock);
+    qemu_cond_init(&mapped_ram.job_cond);
+    qemu_cond_init(&mapped_ram.done_cond);
+
+    mapped_ram.threads = g_new0(QemuThread, thread_count);
+    for (i = 0; i < thread_count; i++) {
+        qemu_thread_create(&mapped_ram.threads[i], "mapped-ram",
+                           mapped_ram_thread, NULL, QEMU_THREAD_JOINABLE);
+    }
+    mapped_ram.thread_count = thread_count;
+    trace_mapped_ram_setup(load, thread_count, pages_fd != fd);
+
+    return 0;
+}
+
+/**
+ * mapped_ram_queue_pages: have a thread write or read a run of pages
+ *
+ * Waits for a thread to take a job if too many are queued already.
+ *
+ * @block: RAMBlock of the pages
+ * @offset: offset of the first page in the block
+ * @length: length of the run, at most MAPPED_RAM_JOB_SIZE
+ */
+void mapped_ram_queue_pages(RAMBlock *block, ram_addr_t offset,
+                            ram_addr_t length)
+{
+    int max_jobs = MIN(2 * mapped_ram.thread_count, MAPPED_RAM_MAX_JOBS);
+    MappedRamJob *job;
+
+    qemu_mutex_lock(&mapped_ram.lock);
+    while (mapped_ram.nr_jobs >= max_jobs) {
+        qemu_cond_wait(&mapped_ram.done_cond, &mapped_ram.lock);
+    }
+    job = &mapped_ram.jobs[(mapped_ram.first_job + mapped_ram.nr_jobs) %
+                           MAPPED_RAM_MAX_JOBS];
+    job->block = block;
+    job->offset = offset;
+    job->length = length;
+    mapped_ram.nr_jobs++;
+    qemu_cond_signal(&mapped_ram.job_cond);
+    qemu_mutex_unlock(&mapped_ram.lock);
+}
+
+/**
+ * mapped_ram_flush: wait for the threads to finish all the queued jobs
+ *
+ * Returns 0 for success or the first error of the threads
+ *
+ * @zero_pages: if not NULL, set to the number of zero pages that were not
+ *              written since the last flush
+ */
+int mapped_ram_flush(uint64_t *zero_pages)
+{
+    int ret;
+
+    if (!mapped_ram.threads) {
+        return 0;
+    }
+
+    qemu_mutex_lock(&mapped_ram.lock);
+    while (mapped_ram.nr_jobs || mapped_ram.running_jobs) {
+        qemu_cond_wait(&mapped_ram.done_cond, &mapped_ram.lock);
+    }
+    if (zero_pages) {
+        *zero_pages = mapped_ram.zero_pages;
+    }
+    mapped_ram.zero_pages = 0;
+    ret = mapped_ram.error;
+    qemu_mutex_unlock(&mapped_ram.lock);
+
+    return ret;
+}
+
+static size_t mapped_ram_bitmap_size(RAMBlock *block)
+{
+    return DIV_ROUND_UP(block->used_length >> qemu_target_page_bits(),
+                        BITS_PER_BYTE);
+}
+
+/**
+ * mapped_ram_save_block_header: lay out a RAMBlock in the file
+ *
+ * Put the header of the block into the stream, then continue the stream
+ * after the place of its pages.
+ *
+ * Returns 0 for success or a negative errno value
+ *
+ * @f: QEMUFile of the migration
+ * @block: RAMBlock that is laid out
+ */
+int mapped_ram_save_block_header(QEMUFile *f, RAMBlock *block)
+{
+    int64_t offset;
+
+    offset = qemu_file_get_offset(f);
+    if (offset < 0) {
+        return offset;
+    }
+
+    block->file_bmap = bitmap_new(block->used_length >>
+                                  qemu_target_page_bits());
+    block->bitmap_offset = QEMU_ALIGN_UP(offset + MAPPED_RAM_HDR_SIZE,
+                                         MAPPED_RAM_BITMAP_ALIGN);
+    block->pages_offset = QEMU_ALIGN_UP(block->bitmap_offset +
+                                        mapped_ram_bitmap_size(block),
+                                        MAPPED_RAM_PAGES_ALIGN);
+
+    qemu_put_be32(f, MAPPED_RAM_HDR_VERSION);
+    qemu_put_be64(f, qemu_target_page_size());
+    qemu_put_be64(f, block->bitmap_offset);
+    qemu_put_be64(f, block->pages_offset);
+    trace_mapped_ram_save_block_header(block->idstr, block->bitmap_offset,
+                                       block->pages_offset);
+
+    return qemu_file_set_offset(f, block->pages_offset + block->used_length);
+}
+
+/**
+ * mapped_ram_save_bitmap: write the bitmap of the saved pages of a block
+ *
+ * Must be called once the pages have been flushed for the last time.
+ *
+ * Returns 0 for success or a negative errno value
+ *
+ * @block: RAMBlock whose bitmap is written
+ */
+int mapped_ram_save_bitmap(RAMBlock *block)
+{
+    unsigned long nbits = block->used_length >> qemu_target_page_bits();
+    g_autofree unsigned long *le_bitmap = bitmap_new(nbits);
+
+    bitmap_to_le(le_bitmap, block->file_bmap, nbits);
+    return mapped_ram_pio(true, mapped_ram.fd, (uint8_t *)le_bitmap,
+                          mapped_ram_bitmap_size(block),
+                          block->bitmap_offset);
+}
+
+/*
+ * Map the pages of a block from the file copy-on-write, instead of
+ * reading them.  The pages that were not saved read as zero in the file,
+ * so the bitmap is not needed.
+ */
+static int mapped_ram_map_block(RAMBlock *block, Error **errp)
+{
+    struct stat st;
+
+    if (fstat(mapped_ram.fd, &st) < 0) {
+        error_setg_errno(errp, errno, "Failed to get the size of the "
+                         "migration file");
+        return -1;
+    }
+    /* Touching a page past the end of the file would raise SIGBUS */
+    if (st.st_size < block->pages_offset + block->used_length) {
+        error_setg(errp, "The migration file is too short for the "
+                   "mapped-ram pages of %s", block->idstr);
+        return -1;
+    }
+
+    if (qemu_ram_map_file_private(block, mapped_ram.fd, block->pages_offset,
+                                  errp) < 0) {
+        return -1;
+    }
+    trace_mapped_ram_map_block(block->idstr, block->pages_offset,
+                               block->used_length);
+    return 0;
+}
+
+/**
+ * mapped_ram_load_block: read the pages of a RAMBlock
+ *
+ * Get the header of the block from the stream, read its bitmap and have
+ * the threads read the saved pages, or map them with mapped-ram-map;
+ * then continue the stream after the place of the pages.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @f: QEMUFile of the migration
+ * @block: RAMBlock that is loaded
+ * @errp: pointer to an error
+ */
+int mapped_ram_load_block(QEMUFile *f, RAMBlock *block, Error **errp)
+{
+    int page_bits = qemu_target_page_bits();
+    unsigned long max_run = MAPPED_RAM_JOB_SIZE >> page_bits;
+    unsigned long nbits = block->used_length >> page_bits;
+    g_autofree unsigned long *le_bitmap = bitmap_new(nbits);
+    g_autofree unsigned long *bitmap = bitmap_new(nbits);
+    unsigned long page, end;
+    uint64_t page_size;
+    uint32_t version;
+    int ret;
+
+    version = qemu_get_be32(f);
+    page_size = qemu_get_be64(f);
+    block->bitmap_offset = qemu_get_be64(f);
+    block->pages_offset = qemu_get_be64(f);
+    ret = qemu_file_get_error(f);
+    if (ret) {
+        error_setg_errno(errp, -ret, "Failed to read mapped-ram header of %s",
+                         block->idstr);
+        return -1;
+    }
+    if (version != MAPPED_RAM_HDR_VERSION) {
+        error_setg(errp, "Unsupported mapped-ram header version %u of %s",
+                   version, block->idstr);
+        return -1;
+    }
+    if (page_size != qemu_target_page_size()) {
+        error_setg(errp, "Mismatched mapped-ram page size of %s: "
+                   "%" PRIu64 " != %zu", block->idstr, page_size,
+                   qemu_target_page_size());
+        return -1;
+    }
+    trace_mapped_ram_load_block(block->idstr, block->bitmap_offset,
+                                block->pages_offset);
+
+    if (migrate_mapped_ram_map()) {
+        if (mapped_ram_map_block(block, errp) < 0) {
+            return -1;
+        }
+        goto done;
+    }
+
+    ret = mapped_ram_pio(false, mapped_ram.fd, (uint8_t *)le_bitmap,
+                         mapped_ram_bitmap_size(block), block->bitmap_offset);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to read mapped-ram bitmap of %s",
+                         block->idstr);
+        return -1;
+    }
+    bitmap_from_le(bitmap, le_bitmap, nbits);
+
+    for (page = find_first_bit(bitmap, nbits); page < nbits;
+         page = find_next_bit(bitmap, nbits, end)) {
+        end = find_next_zero_bit(bitmap, nbits, page);
+        while (page < end) {
+            unsigned long run = MIN(end - page, max_run);
+
+            mapped_ram_queue_pages(block, (ram_addr_t)page << page_bits,
+                                   (ram_addr_t)run << page_bits);
+            page += run;
+        }
+    }
+
+    ret = mapped_ram_flush(NULL);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to read mapped-ram pages of %s",
+                         block->idstr);
+        return -1;
+    }
+
+done:
+    ret = qemu_file_set_offset(f, block->pages_offset + block->used_length);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to skip mapped-ram pages of %s",
+                         block->idstr);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,26 @@
+/*
+ * Fixed offsets for the RAM pages in the migration file
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_MIGRATION_MAPPED_RAM_H
+#define QEMU_MIGRATION_MAPPED_RAM_H
+
+#include "qemu/units.h"
+#include "exec/cpu-common.h"
+
+/* Largest run of pages that a mapped-ram thread writes or reads at once */
+#define MAPPED_RAM_JOB_SIZE (1 * MiB)
+
+int mapped_ram_setup(bool load, Error **errp);
+void mapped_ram_cleanup(void);
+int mapped_ram_save_block_header(QEMUFile *f, RAMBlock *block);
+int mapped_ram_load_block(QEMUFile *f, RAMBlock *block, Error **errp);
+void mapped_ram_queue_pages(RAMBlock *block, ram_addr_t offset,
+                            ram_addr_t length);
+int mapped_ram_flush(uint64_t *zero_pages);
+int mapped_ram_save_bitmap(RAMBlock *block);
+
+#endif
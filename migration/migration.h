@@ -20,6 +20,7 @@
 #include "qemu/thread.h"
 #include "qemu/coroutine_int.h"
 #include "io/channel.h"
+#include "io/channel-buffer.h"
 #include "net/announce.h"
 #include "qom/object.h"
 
@@ -44,6 +45,20 @@ struct PostcopyBlocktimeContext;
  */
 #define CLEAR_BITMAP_SHIFT_MAX            31
 
+/* Threads that help the migration thread with the dirty bitmap sync */
+#define BITMAP_SYNC_THREADS_DEFAULT        4
+
+/* Threads that write and read the RAM pages with mapped-ram */
+#define MAPPED_RAM_THREADS_DEFAULT         4
+
+/* Channels that carry RAM pages */
+typedef enum {
+    RAM_CHANNEL_PRECOPY = 0,
+    /* The postcopy-preempt channel */
+    RAM_CHANNEL_POSTCOPY = 1,
+    RAM_CHANNEL_MAX,
+} RamChannel;
+
 /* State for the incoming migration */
 struct MigrationIncomingState {
     QEMUFile *from_src_file;
@@ -76,8 +91,15 @@ struct MigrationIncomingState {
     QemuMutex rp_mutex;    /* We send replies from multiple threads */
     /* RAMBlock of last request sent to source */
     RAMBlock *last_rb;
-    void     *postcopy_tmp_page;
+    /* Host page that is filled before it is placed, for each channel */
+    void     *postcopy_tmp_pages[RAM_CHANNEL_MAX];
     void     *postcopy_tmp_zero_page;
+    /* RAMBlock of the last page received on each channel */
+    RAMBlock *last_recv_block[RAM_CHANNEL_MAX];
+    /* Channel of the postcopy-preempt capability, and its thread */
+    QEMUFile *postcopy_qemufile_dst;
+    bool      have_preempt_thread;
+    QemuThread preempt_thread;
     /* PostCopyFD's for external userfaultfds & handlers of shared memory */
     GArray   *postcopy_remote_fds;
 
@@ -149,8 +171,10 @@ struct MigrationState {
     QemuThread thread;
     QEMUBH *cleanup_bh;
     QEMUFile *to_dst_file;
+    /* Channel of the postcopy-preempt capability, or NULL */
+    QEMUFile *postcopy_qemufile_src;
     /*
-     * Protects to_dst_file pointer.  We need to make sure we won't
+     * Protects to_dst_file and postcopy_qemufile_src pointers.  We need to make sure we won't
      * yield or hang during the critical section, since this lock will
      * be used in OOB command handler.
      */
@@ -209,6 +233,11 @@ struct MigrationState {
      */
     bool vm_was_running;
 
+    /* Device state of a background snapshot, saved before its RAM */
+    QIOChannelBuffer *bioc;
+    /* Restarts the VM once a background snapshot has protected its RAM */
+    QEMUBH *vm_start_bh;
+
     /* Flag set once the migration has been asked to enter postcopy */
     bool start_postcopy;
     /* Flag set after postcopy has sent the device state */
@@ -276,6 +305,15 @@ struct MigrationState {
      */
     uint8_t clear_bitmap_shift;
 
+    /*
+     * Number of threads that help the migration thread to sync the
+     * dirty bitmap of large guests, 0 to sync it serially.
+     */
+    uint8_t bitmap_sync_threads;
+
+    /* Number of threads that write the RAM pages with mapped-ram */
+    uint8_t mapped_ram_threads;
+
     /*
      * This save hostname when out-going migration starts
      */
@@ -314,6 +352,18 @@ bool migrate_zero_blocks(void);
 bool migrate_dirty_bitmaps(void);
 bool migrate_ignore_shared(void);
 bool migrate_validate_uuid(void);
+bool migrate_zero_extents(void);
+bool migrate_multifd_zero_pages(void);
+bool migrate_background_snapshot(void);
+bool migrate_mapped_ram(void);
+bool migrate_mapped_ram_map(void);
+bool migrate_direct_io(void);
+bool migrate_postcopy_preempt(void);
+bool migrate_postcopy_minor_faults(void);
+bool migrate_parallel_load(void);
+bool migrate_multifd_auto_tune(void);
+bool migrate_dirty_bitmaps_compact(void);
+int migrate_postcopy_fault_around(void);
 
 bool migrate_auto_converge(void);
 bool migrate_use_multifd(void);
@@ -322,6 +372,7 @@ int migrate_multifd_channels(void);
 MultiFDCompression migrate_multifd_compression(void);
 int migrate_multifd_zlib_level(void);
 int migrate_multifd_zstd_level(void);
+int migrate_multifd_qatzip_level(void);
 
 int migrate_use_xbzrle(void);
 int64_t migrate_xbzrle_cache_size(void);
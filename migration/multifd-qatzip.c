@@ -0,0 +1,298 @@
+/*
+ * Multifd QATzip compression implementation
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <qatzip.h>
+#include "qemu/iov.h"
+#include "qemu/rcu.h"
+#include "exec/target_page.h"
+#include "qapi/error.h"
+#include "migration.h"
+#include "trace.h"
+#include "multifd.h"
+
+struct qatzip_data {
+    /* QATzip session, bound to a hardware instance */
+    QzSession_T sess;
+    /* pages of a packet, contiguous for the engine */
+    uint8_t *in_buf;
+    /* size of in_buf */
+    uint32_t in_len;
+    /* compressed packet */
+    uint8_t *out_buf;
+    /* size of out_buf */
+    uint32_t out_len;
+};
+
+/*
+ * Buffers that the engine reads or writes have to be pinned, otherwise
+ * QATzip bounces them through its own pinned memory.  Fall back to
+ * normal memory if no pinned memory is left.
+ */
+static uint8_t *qatzip_buf_new(uint32_t len)
+{
+    uint8_t *buf = qzMalloc(len, 0, PINNED_MEM);
+
+    return buf ? buf : g_try_malloc(len);
+}
+
+static void qatzip_buf_free(uint8_t *buf)
+{
+    if (buf && qzMemFindAddr(buf)) {
+        qzFree(buf);
+    } else {
+        g_free(buf);
+    }
+}
+
+static void qatzip_data_free(struct qatzip_data *q)
+{
+    qzTeardownSession(&q->sess);
+    qzClose(&q->sess);
+    qatzip_buf_free(q->in_buf);
+    qatzip_buf_free(q->out_buf);
+    g_free(q);
+}
+
+/**
+ * qatzip_data_new: open a session and allocate the buffers
+ *
+ * Returns the channel data or NULL on error
+ *
+ * @id: channel number, for error messages
+ * @direction: QZ_DIR_COMPRESS or QZ_DIR_DECOMPRESS
+ * @errp: pointer to an error
+ */
+static struct qatzip_data *qatzip_data_new(uint8_t id, QzDirection_T direction,
+                                           Error **errp)
+{
+    struct qatzip_data *q = g_malloc0(sizeof(struct qatzip_data));
+    QzSessionParams_T params;
+    int ret;
+
+    /* Fall back to software if there is no hardware instance left */
+    ret = qzInit(&q->sess, 1);
+    if (ret != QZ_OK && ret != QZ_DUPLICATE && ret != QZ_NO_HW) {
+        g_free(q);
+        error_setg(errp, "multifd %d: qzInit failed with %d", id, ret);
+        return NULL;
+    }
+    if (qzGetDefaults(&params) != QZ_OK) {
+        qzClose(&q->sess);
+        g_free(q);
+        error_setg(errp, "multifd %d: qzGetDefaults failed", id);
+        return NULL;
+    }
+    params.direction = direction;
+    params.comp_lvl = migrate_multifd_qatzip_level();
+    params.sw_backup = 1;
+    ret = qzSetupSession(&q->sess, &params);
+    if (ret != QZ_OK && ret != QZ_DUPLICATE && ret != QZ_NO_HW) {
+        qzClose(&q->sess);
+        g_free(q);
+        error_setg(errp, "multifd %d: qzSetupSession failed with %d", id, ret);
+        return NULL;
+    }
+
+    /* We will never have more than MULTIFD_PACKET_SIZE bytes of pages */
+    q->in_len = MULTIFD_PACKET_SIZE;
+    q->out_len = qzMaxCompressedLength(MULTIFD_PACKET_SIZE, &q->sess);
+    q->in_buf = qatzip_buf_new(q->in_len);
+    q->out_buf = qatzip_buf_new(q->out_len);
+    if (!q->in_buf || !q->out_buf) {
+        qatzip_data_free(q);
+        error_setg(errp, "multifd %d: out of memory for qatzip buffers", id);
+        return NULL;
+    }
+    return q;
+}
+
+/* Multifd QATzip compression */
+
+/**
+ * qatzip_send_setup: setup send side
+ *
+ * Setup each channel with a QATzip compression session.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int qatzip_send_setup(MultiFDSendParams *p, Error **errp)
+{
+    p->data = qatzip_data_new(p->id, QZ_DIR_COMPRESS, errp);
+    return p->data ? 0 : -1;
+}
+
+/**
+ * qatzip_send_cleanup: cleanup send side
+ *
+ * Close the session and return memory.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void qatzip_send_cleanup(MultiFDSendParams *p, Error **errp)
+{
+    qatzip_data_free(p->data);
+    p->data = NULL;
+}
+
+/**
+ * qatzip_send_prepare: prepare date to be able to send
+ *
+ * Gather all the pages of the packet and compress them with a single
+ * request, so that the engine sees large jobs.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ */
+static int qatzip_send_prepare(MultiFDSendParams *p, uint32_t used,
+                               Error **errp)
+{
+    struct iovec *iov = p->pages->iov;
+    struct qatzip_data *q = p->data;
+    unsigned int in_size, out_size;
+    size_t total;
+    int ret;
+
+    total = iov_to_buf(iov, used, 0, q->in_buf, q->in_len);
+    in_size = total;
+    out_size = q->out_len;
+
+    ret = qzCompress(&q->sess, q->in_buf, &in_size, q->out_buf, &out_size, 1);
+    if (ret != QZ_OK) {
+        error_setg(errp, "multifd %d: qzCompress returned %d", p->id, ret);
+        return -1;
+    }
+    if (in_size != total) {
+        error_setg(errp, "multifd %d: qzCompress failed to compress all input",
+                   p->id);
+        return -1;
+    }
+    p->next_packet_size = out_size;
+    p->flags |= MULTIFD_FLAG_QATZIP;
+
+    return 0;
+}
+
+/**
+ * qatzip_send_write: do the actual write of the data
+ *
+ * Do the actual write of the comprresed buffer.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @errp: pointer to an error
+ */
+static int qatzip_send_write(MultiFDSendParams *p, uint32_t used, Error **errp)
+{
+    struct qatzip_data *q = p->data;
+
+    return qio_channel_write_all(p->c, (void *)q->out_buf, p->next_packet_size,
+                                 errp);
+}
+
+/**
+ * qatzip_recv_setup: setup receive side
+ *
+ * Create the decompression session and buffers.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int qatzip_recv_setup(MultiFDRecvParams *p, Error **errp)
+{
+    p->data = qatzip_data_new(p->id, QZ_DIR_DECOMPRESS, errp);
+    return p->data ? 0 : -1;
+}
+
+/**
+ * qatzip_recv_cleanup: cleanup receive side
+ *
+ * Close the session and return memory.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void qatzip_recv_cleanup(MultiFDRecvParams *p)
+{
+    qatzip_data_free(p->data);
+    p->data = NULL;
+}
+
+/**
+ * qatzip_recv_pages: read the data from the channel into actual pages
+ *
+ * Read the compressed buffer, decompress it and scatter it into the
+ * actual pages.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @errp: pointer to an error
+ */
+static int qatzip_recv_pages(MultiFDRecvParams *p, uint32_t used, Error **errp)
+{
+    struct qatzip_data *q = p->data;
+    unsigned int in_size = p->next_packet_size;
+    unsigned int out_size = q->in_len;
+    uint32_t expected_size = used * qemu_target_page_size();
+    uint32_t flags = p->flags & MULTIFD_FLAG_COMPRESSION_MASK;
+    int ret;
+
+    if (flags != MULTIFD_FLAG_QATZIP) {
+        error_setg(errp, "multifd %d: flags received %x flags expected %x",
+                   p->id, flags, MULTIFD_FLAG_QATZIP);
+        return -1;
+    }
+    if (in_size > q->out_len) {
+        error_setg(errp, "multifd %d: packet size received %d maximum size %d",
+                   p->id, in_size, q->out_len);
+        return -1;
+    }
+    ret = qio_channel_read_all(p->c, (void *)q->out_buf, in_size, errp);
+    if (ret != 0) {
+        return ret;
+    }
+
+    ret = qzDecompress(&q->sess, q->out_buf, &in_size, q->in_buf, &out_size);
+    if (ret != QZ_OK) {
+        error_setg(errp, "multifd %d: qzDecompress returned %d", p->id, ret);
+        return -1;
+    }
+    if (out_size != expected_size) {
+        error_setg(errp, "multifd %d: packet size received %d size expected %d",
+                   p->id, out_size, expected_size);
+        return -1;
+    }
+    iov_from_buf(p->pages->iov, used, 0, q->in_buf, out_size);
+    return 0;
+}
+
+static MultiFDMethods multifd_qatzip_ops = {
+    .send_setup = qatzip_send_setup,
+    .send_cleanup = qatzip_send_cleanup,
+    .send_prepare = qatzip_send_prepare,
+    .send_write = qatzip_send_write,
+    .recv_setup = qatzip_recv_setup,
+    .recv_cleanup = qatzip_recv_cleanup,
+    .recv_pages = qatzip_recv_pages
+};
+
+static void multifd_qatzip_register(void)
+{
+    multifd_register_ops(MULTIFD_COMPRESSION_QATZIP, &multifd_qatzip_ops);
+}
+
+migration_init(multifd_qatzip_register);
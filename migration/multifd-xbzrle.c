@@ -0,0 +1,355 @@
+/*
+ * Multifd XBZRLE delta encoding implementation
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "exec/target_page.h"
+#include "exec/ramblock.h"
+#include "qapi/error.h"
+#include "migration.h"
+#include "page_cache.h"
+#include "xbzrle.h"
+#include "trace.h"
+#include "multifd.h"
+
+/*
+ * Each page of a packet starts with one of these bytes.  A delta page
+ * continues with a big endian 16-bit length and the XBZRLE data, a full
+ * page with the page contents.
+ */
+#define XBZRLE_PAGE_FULL      0
+#define XBZRLE_PAGE_DELTA     1
+#define XBZRLE_PAGE_UNCHANGED 2
+
+#define XBZRLE_PAGE_HDR_LEN   3
+
+struct xbzrle_data {
+    /* last sent version of the pages that this channel sent */
+    PageCache *cache;
+    /* copy of the page being encoded */
+    uint8_t *current_buf;
+    /* encoded packet */
+    uint8_t *buf;
+    /* size of encoded packet buffer */
+    uint32_t buf_len;
+};
+
+static struct xbzrle_data *xbzrle_data_new(Error **errp)
+{
+    uint32_t page_count = MULTIFD_PACKET_SIZE / qemu_target_page_size();
+    struct xbzrle_data *x = g_malloc0(sizeof(struct xbzrle_data));
+
+    /* We will never have more than page_count pages */
+    x->buf_len = page_count * (qemu_target_page_size() + XBZRLE_PAGE_HDR_LEN);
+    x->buf = g_try_malloc(x->buf_len);
+    if (!x->buf) {
+        g_free(x);
+        error_setg(errp, "out of memory for xbzrle buffer");
+        return NULL;
+    }
+    return x;
+}
+
+/* Multifd XBZRLE delta encoding */
+
+/**
+ * xbzrle_send_setup: setup send side
+ *
+ * Each channel gets its share of the XBZRLE cache size.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int xbzrle_send_setup(MultiFDSendParams *p, Error **errp)
+{
+    size_t page_size = qemu_target_page_size();
+    int64_t cache_size = migrate_xbzrle_cache_size() /
+                         migrate_multifd_channels();
+    struct xbzrle_data *x;
+    Error *local_err = NULL;
+
+    x = xbzrle_data_new(&local_err);
+    if (!x) {
+        error_propagate_prepend(errp, local_err, "multifd %d: ", p->id);
+        return -1;
+    }
+    x->cache = cache_init(MAX(cache_size, page_size), page_size, &local_err);
+    if (!x->cache) {
+        g_free(x->buf);
+        g_free(x);
+        error_propagate_prepend(errp, local_err, "multifd %d: ", p->id);
+        return -1;
+    }
+    x->current_buf = g_malloc(page_size);
+    p->data = x;
+    return 0;
+}
+
+/**
+ * xbzrle_send_cleanup: cleanup send side
+ *
+ * Free the cache and the buffers.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void xbzrle_send_cleanup(MultiFDSendParams *p, Error **errp)
+{
+    struct xbzrle_data *x = p->data;
+
+    cache_fini(x->cache);
+    g_free(x->current_buf);
+    g_free(x->buf);
+    g_free(p->data);
+    p->data = NULL;
+}
+
+/**
+ * xbzrle_send_prepare: prepare date to be able to send
+ *
+ * Encode each page against the version that this channel sent last
+ * time.  That version is only used if no other channel sent the page
+ * in the meantime, because the destination applies the delta to the
+ * page as it has it now.  Pages without a usable version in the cache
+ * are sent in full.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ */
+static int xbzrle_send_prepare(MultiFDSendParams *p, uint32_t used,
+                               Error **errp)
+{
+    struct xbzrle_data *x = p->data;
+    RAMBlock *block = p->pages->block;
+    size_t page_size = qemu_target_page_size();
+    uint8_t owner = p->id + 1;
+    uint32_t out_size = 0;
+    uint32_t i;
+
+    for (i = 0; i < used; i++) {
+        ram_addr_t offset = p->pages->offset[i];
+        unsigned long page = offset >> qemu_target_page_bits();
+        uint64_t addr = block->offset + offset;
+        uint8_t *out = x->buf + out_size;
+        uint8_t *cached;
+        int len = -1;
+
+        if (block->multifd_owner[page] == owner &&
+            cache_is_cached(x->cache, addr, p->dirty_sync_count)) {
+            cached = get_cached_data(x->cache, addr);
+            /* The guest may change the page while we are encoding it */
+            memcpy(x->current_buf, p->pages->iov[i].iov_base, page_size);
+            len = xbzrle_encode_buffer(cached, x->current_buf, page_size,
+                                       out + XBZRLE_PAGE_HDR_LEN,
+                                       page_size - XBZRLE_PAGE_HDR_LEN);
+            if (len == 0) {
+                out[0] = XBZRLE_PAGE_UNCHANGED;
+                out_size += 1;
+                continue;
+            }
+            if (len > 0) {
+                out[0] = XBZRLE_PAGE_DELTA;
+                stw_be_p(out + 1, len);
+                out_size += XBZRLE_PAGE_HDR_LEN + len;
+                memcpy(cached, x->current_buf, page_size);
+                continue;
+            }
+            /* The delta is too big, send the copy in full */
+            out[0] = XBZRLE_PAGE_FULL;
+            memcpy(out + 1, x->current_buf, page_size);
+            memcpy(cached, x->current_buf, page_size);
+            out_size += 1 + page_size;
+            continue;
+        }
+
+        out[0] = XBZRLE_PAGE_FULL;
+        memcpy(out + 1, p->pages->iov[i].iov_base, page_size);
+        out_size += 1 + page_size;
+
+        /*
+         * Pages keep being rewritten during the first round, so only
+         * cache them once the dirty bitmap has been synced again.
+         */
+        if (p->dirty_sync_count > 1 &&
+            cache_insert(x->cache, addr, out + 1, p->dirty_sync_count) == 0) {
+            block->multifd_owner[page] = owner;
+        } else {
+            block->multifd_owner[page] = 0;
+        }
+    }
+    p->next_packet_size = out_size;
+    p->flags |= MULTIFD_FLAG_XBZRLE;
+
+    return 0;
+}
+
+/**
+ * xbzrle_send_write: do the actual write of the data
+ *
+ * Do the actual write of the encoded buffer.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @errp: pointer to an error
+ */
+static int xbzrle_send_write(MultiFDSendParams *p, uint32_t used, Error **errp)
+{
+    struct xbzrle_data *x = p->data;
+
+    return qio_channel_write_all(p->c, (void *)x->buf, p->next_packet_size,
+                                 errp);
+}
+
+/**
+ * xbzrle_recv_setup: setup receive side
+ *
+ * Create the buffer for the encoded packets.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int xbzrle_recv_setup(MultiFDRecvParams *p, Error **errp)
+{
+    Error *local_err = NULL;
+
+    p->data = xbzrle_data_new(&local_err);
+    if (!p->data) {
+        error_propagate_prepend(errp, local_err, "multifd %d: ", p->id);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * xbzrle_recv_cleanup: cleanup receive side
+ *
+ * Free the buffer.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void xbzrle_recv_cleanup(MultiFDRecvParams *p)
+{
+    struct xbzrle_data *x = p->data;
+
+    g_free(x->buf);
+    g_free(p->data);
+    p->data = NULL;
+}
+
+/**
+ * xbzrle_recv_pages: read the data from the channel into actual pages
+ *
+ * Read the encoded buffer, and apply it to the pages, which still hold
+ * the version that the deltas are based on.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @used: number of pages used
+ * @errp: pointer to an error
+ */
+static int xbzrle_recv_pages(MultiFDRecvParams *p, uint32_t used, Error **errp)
+{
+    struct xbzrle_data *x = p->data;
+    size_t page_size = qemu_target_page_size();
+    uint32_t in_size = p->next_packet_size;
+    uint32_t flags = p->flags & MULTIFD_FLAG_COMPRESSION_MASK;
+    uint32_t pos = 0;
+    uint32_t i;
+    int ret;
+
+    if (flags != MULTIFD_FLAG_XBZRLE) {
+        error_setg(errp, "multifd %d: flags received %x flags expected %x",
+                   p->id, flags, MULTIFD_FLAG_XBZRLE);
+        return -1;
+    }
+    if (in_size > x->buf_len) {
+        error_setg(errp, "multifd %d: packet size received %d maximum size %d",
+                   p->id, in_size, x->buf_len);
+        return -1;
+    }
+    ret = qio_channel_read_all(p->c, (void *)x->buf, in_size, errp);
+    if (ret != 0) {
+        return ret;
+    }
+
+    for (i = 0; i < used; i++) {
+        uint8_t *host = p->pages->iov[i].iov_base;
+        uint32_t len;
+
+        if (pos >= in_size) {
+            goto truncated;
+        }
+        switch (x->buf[pos]) {
+        case XBZRLE_PAGE_UNCHANGED:
+            pos += 1;
+            break;
+        case XBZRLE_PAGE_FULL:
+            if (in_size - pos < 1 + page_size) {
+                goto truncated;
+            }
+            memcpy(host, x->buf + pos + 1, page_size);
+            pos += 1 + page_size;
+            break;
+        case XBZRLE_PAGE_DELTA:
+            if (in_size - pos < XBZRLE_PAGE_HDR_LEN) {
+                goto truncated;
+            }
+            len = lduw_be_p(x->buf + pos + 1);
+            pos += XBZRLE_PAGE_HDR_LEN;
+            if (in_size - pos < len) {
+                goto truncated;
+            }
+            if (xbzrle_decode_buffer(x->buf + pos, len, host, page_size) < 0) {
+                error_setg(errp, "multifd %d: failed to decode XBZRLE page",
+                           p->id);
+                return -1;
+            }
+            pos += len;
+            break;
+        default:
+            error_setg(errp, "multifd %d: unknown XBZRLE page type %d",
+                       p->id, x->buf[pos]);
+            return -1;
+        }
+    }
+    if (pos != in_size) {
+        error_setg(errp, "multifd %d: packet size received %d size used %d",
+                   p->id, in_size, pos);
+        return -1;
+    }
+    return 0;
+
+truncated:
+    error_setg(errp, "multifd %d: XBZRLE packet of %d bytes is truncated",
+               p->id, in_size);
+    return -1;
+}
+
+static MultiFDMethods multifd_xbzrle_ops = {
+    .send_setup = xbzrle_send_setup,
+    .send_cleanup = xbzrle_send_cleanup,
+    .send_prepare = xbzrle_send_prepare,
+    .send_write = xbzrle_send_write,
+    .recv_setup = xbzrle_recv_setup,
+    .recv_cleanup = xbzrle_recv_cleanup,
+    .recv_pages = xbzrle_recv_pages
+};
+
+static void multifd_xbzrle_register(void)
+{
+    multifd_register_ops(MULTIFD_COMPRESSION_XBZRLE, &multifd_xbzrle_ops);
+}
+
+migration_init(multifd_xbzrle_register);
@@ -26,6 +26,8 @@ struct zlib_data {
     uint8_t *zbuff;
     /* size of compressed buffer */
     uint32_t zbuff_len;
+    /* compression level of the stream */
+    int level;
 };
 
 /* Multifd zlib compression */
@@ -49,7 +51,8 @@ static int zlib_send_setup(MultiFDSendParams *p, Error **errp)
     zs->zalloc = Z_NULL;
     zs->zfree = Z_NULL;
     zs->opaque = Z_NULL;
-    if (deflateInit(zs, migrate_multifd_zlib_level()) != Z_OK) {
+    z->level = multifd_send_level();
+    if (deflateInit(zs, z->level) != Z_OK) {
         g_free(z);
         error_setg(errp, "multifd %d: deflate init failed", p->id);
         return -1;
@@ -114,12 +117,29 @@ static int zlib_send_prepare(MultiFDSendParams *p, uint32_t used, Error **errp)
             flush = Z_SYNC_FLUSH;
         }
 
-        zs->avail_in = iov[i].iov_len;
-        zs->next_in = iov[i].iov_base;
-
         zs->avail_out = available;
         zs->next_out = z->zbuff + out_size;
 
+        /*
+         * deflateParams() compresses the input it is given with the old
+         * level, so change it before any input of this packet is there.
+         * Nothing is pending after the Z_SYNC_FLUSH of the last packet, so
+         * it doesn't output anything or fail with Z_BUF_ERROR either.
+         */
+        if (i == 0 && z->level != multifd_send_level()) {
+            z->level = multifd_send_level();
+            zs->avail_in = 0;
+            ret = deflateParams(zs, z->level, Z_DEFAULT_STRATEGY);
+            if (ret != Z_OK) {
+                error_setg(errp, "multifd %d: deflateParams returned %d",
+                           p->id, ret);
+                return -1;
+            }
+        }
+
+        zs->avail_in = iov[i].iov_len;
+        zs->next_in = iov[i].iov_base;
+
         /*
          * Welcome to deflate semantics
          *
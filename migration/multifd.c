@@ -11,6 +11,9 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu/atomic.h"
+#include "qemu/cutils.h"
+#include "qemu/bitops.h"
 #include "qemu/rcu.h"
 #include "exec/target_page.h"
 #include "sysemu/sysemu.h"
@@ -24,6 +27,7 @@
 #include "qemu-file.h"
 #include "trace.h"
 #include "multifd.h"
+#include "migration/colo.h"
 
 /* Multiple fd's */
 
@@ -269,12 +273,13 @@ static void multifd_send_fill_packet(MultiFDSendParams *p)
     packet->pages_used = cpu_to_be32(p->pages->used);
     packet->next_packet_size = cpu_to_be32(p->next_packet_size);
     packet->packet_num = cpu_to_be64(p->packet_num);
+    packet->zero_pages = cpu_to_be32(p->zero_num);
 
     if (p->pages->block) {
         strncpy(packet->ramblock, p->pages->block->idstr, 256);
     }
 
-    for (i = 0; i < p->pages->used; i++) {
+    for (i = 0; i < p->pages->used + p->zero_num; i++) {
         /* there are architectures where ram_addr_t is 32 bit */
         uint64_t temp = p->pages->offset[i];
 
@@ -287,6 +292,7 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
     MultiFDPacket_t *packet = p->packet;
     uint32_t pages_max = MULTIFD_PACKET_SIZE / qemu_target_page_size();
     RAMBlock *block;
+    uint8_t *host;
     int i;
 
     packet->magic = be32_to_cpu(packet->magic);
@@ -335,10 +341,23 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
         return -1;
     }
 
+    p->zero_num = be32_to_cpu(packet->zero_pages);
+    if (p->zero_num && !migrate_multifd_zero_pages()) {
+        error_setg(errp, "multifd: received zero pages but "
+                   "multifd-zero-pages is not enabled");
+        return -1;
+    }
+    if (p->zero_num > packet->pages_alloc - p->pages->used) {
+        error_setg(errp, "multifd: received packet "
+                   "with %d zero pages and expected maximum pages are %d",
+                   p->zero_num, packet->pages_alloc - p->pages->used);
+        return -1;
+    }
+
     p->next_packet_size = be32_to_cpu(packet->next_packet_size);
     p->packet_num = be64_to_cpu(packet->packet_num);
 
-    if (p->pages->used == 0) {
+    if (p->pages->used + p->zero_num == 0) {
         return 0;
     }
 
@@ -351,7 +370,27 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
         return -1;
     }
 
-    for (i = 0; i < p->pages->used; i++) {
+    /*
+     * Like ram_load_precopy(), load the pages into the COLO cache once
+     * COLO runs, and into both the SVM's memory and the cache before.
+     */
+    p->colo_backup = false;
+    host = block->host;
+    if (migration_incoming_colo_enabled()) {
+        if (!block->colo_cache) {
+            error_setg(errp, "multifd: no COLO cache for ram block %s",
+                       block->idstr);
+            return -1;
+        }
+        if (migration_incoming_in_colo_state()) {
+            host = block->colo_cache;
+        } else {
+            p->colo_backup = true;
+        }
+    }
+    p->pages->block = block;
+
+    for (i = 0; i < p->pages->used + p->zero_num; i++) {
         uint64_t offset = be64_to_cpu(packet->offset[i]);
 
         if (offset > (block->used_length - qemu_target_page_size())) {
@@ -360,13 +399,30 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
                        offset, block->max_length);
             return -1;
         }
-        p->pages->iov[i].iov_base = block->host + offset;
+        if (host == block->colo_cache) {
+            colo_record_cached_page(block, offset);
+        }
+        p->pages->iov[i].iov_base = host + offset;
         p->pages->iov[i].iov_len = qemu_target_page_size();
     }
 
     return 0;
 }
 
+/* Copy the pages just loaded into the SVM's memory to the COLO cache */
+static void multifd_recv_colo_backup(MultiFDRecvParams *p, uint32_t n)
+{
+    RAMBlock *block = p->pages->block;
+    uint32_t i;
+
+    for (i = 0; i < n; i++) {
+        uint8_t *page = p->pages->iov[i].iov_base;
+
+        memcpy(block->colo_cache + (page - block->host), page,
+               qemu_target_page_size());
+    }
+}
+
 struct {
     MultiFDSendParams *params;
     /* array of pages to sent */
@@ -383,8 +439,132 @@ struct {
     int exiting;
     /* multifd ops */
     MultiFDMethods *ops;
+    /*
+     * Page data written and zero pages found by the channels, which the
+     * migration thread has not accounted yet.  Only used with
+     * multifd-zero-pages, because the channels decide what is sent.
+     */
+    size_t data_bytes;
+    size_t zero_pages;
+    /* Queued pages that the channels dropped because they are free */
+    size_t free_pages;
+    /*
+     * Channels used by multifd_send_pages(), the first ones of params.
+     * Only accessed by the migration thread.
+     */
+    int active_channels;
+    /* channels_ready posts taken from channels that are not active */
+    int parked_ready;
+    /* compression level used by the channels, -1 if not tunable */
+    int level;
+    /* time spent in microseconds since the start of migration */
+    Stat64 wait_us;
+    Stat64 prepare_us;
+    Stat64 write_us;
+    /* totals at the previous multifd_send_get_period_stats() */
+    MultiFDSendStats period_prev;
 } *multifd_send_state;
 
+/*
+ * Account what the channels sent.  Called from the migration thread
+ * with the size of the packets it queued.
+ */
+static void multifd_send_account(QEMUFile *f, uint64_t transferred)
+{
+    size_t free_pages = qatomic_xchg(&multifd_send_state->free_pages, 0);
+
+    /*
+     * They were accounted as sent when they were queued; this can make
+     * transferred wrap around, but the totals stay right.
+     */
+    ram_counters.normal -= free_pages;
+    if (!migrate_multifd_zero_pages()) {
+        transferred -= (uint64_t)free_pages * qemu_target_page_size();
+    }
+
+    if (migrate_multifd_zero_pages()) {
+        size_t zero_pages = qatomic_xchg(&multifd_send_state->zero_pages, 0);
+
+        transferred += qatomic_xchg(&multifd_send_state->data_bytes, 0);
+        ram_counters.normal -= zero_pages;
+        ram_counters.duplicate += zero_pages;
+    }
+    qemu_file_update_transfer(f, transferred);
+    ram_counters.multifd_bytes += transferred;
+    ram_counters.transferred += transferred;
+}
+
+/*
+ * multifd_send_zero_page_detect: move zero pages to the end of pages
+ *
+ * The pages that are left in p->pages->used are the ones whose data has
+ * to be sent.  The zero pages follow them and are only listed in the
+ * packet.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void multifd_send_zero_page_detect(MultiFDSendParams *p)
+{
+    MultiFDPages_t *pages = p->pages;
+    size_t page_size = qemu_target_page_size();
+    uint32_t i = 0, j = pages->used;
+
+    while (i < j) {
+        if (buffer_is_zero(pages->iov[i].iov_base, page_size)) {
+            struct iovec iov = pages->iov[i];
+            ram_addr_t offset = pages->offset[i];
+
+            j--;
+            pages->iov[i] = pages->iov[j];
+            pages->offset[i] = pages->offset[j];
+            pages->iov[j] = iov;
+            pages->offset[j] = offset;
+        } else {
+            i++;
+        }
+    }
+
+    p->zero_num = pages->used - j;
+    pages->used = j;
+
+    for (; j < pages->used + p->zero_num; j++) {
+        multifd_page_sent_elsewhere(pages->block, pages->offset[j]);
+    }
+}
+
+/*
+ * multifd_send_free_page_drop: drop the pages the guest reported free
+ *
+ * Free page hints come from the balloon while the pages are queued.  A
+ * page that was reported free doesn't need to be sent: if the guest uses
+ * it again, it is dirtied and goes out after the next bitmap sync.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void multifd_send_free_page_drop(MultiFDSendParams *p)
+{
+    MultiFDPages_t *pages = p->pages;
+    unsigned long *free_bmap = pages->block->free_bmap;
+    int page_bits = qemu_target_page_bits();
+    uint32_t i = 0, j = pages->used;
+
+    while (i < j) {
+        if (test_bit(pages->offset[i] >> page_bits, free_bmap)) {
+            j--;
+            pages->iov[i] = pages->iov[j];
+            pages->offset[i] = pages->offset[j];
+        } else {
+            i++;
+        }
+    }
+
+    if (j != pages->used) {
+        trace_multifd_send_free_page_drop(p->id, pages->used - j);
+        qatomic_add(&multifd_send_state->free_pages, pages->used - j);
+        pages->used = j;
+    }
+}
+
 /*
  * How we use multifd_send_state->pages and channel->pages?
  *
@@ -405,50 +585,65 @@ struct {
 
 static int multifd_send_pages(QEMUFile *f)
 {
-    int i;
+    int i, n;
     static int next_channel;
     MultiFDSendParams *p = NULL; /* make happy gcc */
     MultiFDPages_t *pages = multifd_send_state->pages;
+    int active = multifd_send_state->active_channels;
     uint64_t transferred;
+    int64_t start;
 
     if (qatomic_read(&multifd_send_state->exiting)) {
         return -1;
     }
 
-    qemu_sem_wait(&multifd_send_state->channels_ready);
+    start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     /*
      * next_channel can remain from a previous migration that was
      * using more channels, so ensure it doesn't overflow if the
      * limit is lower now.
      */
-    next_channel %= migrate_multifd_channels();
-    for (i = next_channel;; i = (i + 1) % migrate_multifd_channels()) {
-        p = &multifd_send_state->params[i];
+    next_channel %= active;
+    while (true) {
+        qemu_sem_wait(&multifd_send_state->channels_ready);
+        for (i = next_channel, n = 0; n < active; i = (i + 1) % active, n++) {
+            p = &multifd_send_state->params[i];
 
-        qemu_mutex_lock(&p->mutex);
-        if (p->quit) {
-            error_report("%s: channel %d has already quit!", __func__, i);
+            qemu_mutex_lock(&p->mutex);
+            if (p->quit) {
+                error_report("%s: channel %d has already quit!", __func__, i);
+                qemu_mutex_unlock(&p->mutex);
+                return -1;
+            }
+            if (!p->pending_job) {
+                p->pending_job++;
+                next_channel = (i + 1) % active;
+                goto found;
+            }
             qemu_mutex_unlock(&p->mutex);
-            return -1;
-        }
-        if (!p->pending_job) {
-            p->pending_job++;
-            next_channel = (i + 1) % migrate_multifd_channels();
-            break;
         }
-        qemu_mutex_unlock(&p->mutex);
+        /*
+         * The post came from a channel that is not active; keep it for
+         * when the channel will be used again.
+         */
+        multifd_send_state->parked_ready++;
     }
+
+found:
+    stat64_add(&multifd_send_state->wait_us,
+               qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start);
     assert(!p->pages->used);
     assert(!p->pages->block);
 
     p->packet_num = multifd_send_state->packet_num++;
+    p->dirty_sync_count = ram_counters.dirty_sync_count;
     multifd_send_state->pages = p->pages;
     p->pages = pages;
-    transferred = ((uint64_t) pages->used) * qemu_target_page_size()
-                + p->packet_len;
-    qemu_file_update_transfer(f, transferred);
-    ram_counters.multifd_bytes += transferred;
-    ram_counters.transferred += transferred;
+    transferred = p->packet_len;
+    if (!migrate_multifd_zero_pages()) {
+        transferred += ((uint64_t) pages->used) * qemu_target_page_size();
+    }
+    multifd_send_account(f, transferred);
     qemu_mutex_unlock(&p->mutex);
     qemu_sem_post(&p->sem);
 
@@ -485,6 +680,17 @@ int multifd_queue_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset)
     return 1;
 }
 
+/*
+ * Called for pages that are sent on the main channel, so that caching
+ * methods do not encode a later version against an outdated one.
+ */
+void multifd_page_sent_elsewhere(RAMBlock *block, ram_addr_t offset)
+{
+    if (block->multifd_owner) {
+        block->multifd_owner[offset >> qemu_target_page_bits()] = 0;
+    }
+}
+
 static void multifd_send_terminate_threads(Error *err)
 {
     int i;
@@ -600,9 +806,7 @@ void multifd_send_sync_main(QEMUFile *f)
         p->packet_num = multifd_send_state->packet_num++;
         p->flags |= MULTIFD_FLAG_SYNC;
         p->pending_job++;
-        qemu_file_update_transfer(f, p->packet_len);
-        ram_counters.multifd_bytes += p->packet_len;
-        ram_counters.transferred += p->packet_len;
+        multifd_send_account(f, p->packet_len);
         qemu_mutex_unlock(&p->mutex);
         qemu_sem_post(&p->sem);
     }
@@ -612,9 +816,90 @@ void multifd_send_sync_main(QEMUFile *f)
         trace_multifd_send_sync_main_wait(p->id);
         qemu_sem_wait(&p->sem_sync);
     }
+    /* The channels are idle now, account the rest of their pages */
+    multifd_send_account(f, 0);
     trace_multifd_send_sync_main(multifd_send_state->packet_num);
 }
 
+/*
+ * Fill @stats with the time spent since the start of migration, summed
+ * over the channels for the compression and the writes.
+ */
+void multifd_send_get_stats(MultiFDSendStats *stats)
+{
+    stats->wait_us = stat64_get(&multifd_send_state->wait_us);
+    stats->prepare_us = stat64_get(&multifd_send_state->prepare_us);
+    stats->write_us = stat64_get(&multifd_send_state->write_us);
+}
+
+/*
+ * Like multifd_send_get_stats(), but since the previous call.  Only for
+ * one caller, the auto tuning.
+ */
+void multifd_send_get_period_stats(MultiFDSendStats *stats)
+{
+    MultiFDSendStats *prev = &multifd_send_state->period_prev;
+    MultiFDSendStats now;
+
+    multifd_send_get_stats(&now);
+    stats->wait_us = now.wait_us - prev->wait_us;
+    stats->prepare_us = now.prepare_us - prev->prepare_us;
+    stats->write_us = now.write_us - prev->write_us;
+    *prev = now;
+}
+
+/* Bytes that channel @id has written since the start of migration */
+uint64_t multifd_send_channel_bytes(int id)
+{
+    return stat64_get(&multifd_send_state->params[id].bytes_sent);
+}
+
+int multifd_send_active_channels(void)
+{
+    return multifd_send_state->active_channels;
+}
+
+/*
+ * Only use the first @count channels for the pages.  They all still
+ * get the sync packets, so the destination doesn't notice.  Called
+ * from the migration thread.
+ */
+void multifd_send_set_active_channels(int count)
+{
+    count = MAX(1, MIN(count, migrate_multifd_channels()));
+    if (count > multifd_send_state->active_channels) {
+        while (multifd_send_state->parked_ready) {
+            multifd_send_state->parked_ready--;
+            qemu_sem_post(&multifd_send_state->channels_ready);
+        }
+    }
+    multifd_send_state->active_channels = count;
+}
+
+/*
+ * Returns the compression level of the channels, -1 if it can't be
+ * changed during migration.  zstd only applies a new level to the next
+ * frame, and the receive side expects one frame per channel.
+ */
+int multifd_send_level(void)
+{
+    return qatomic_read(&multifd_send_state->level);
+}
+
+/*
+ * Change the compression level; each channel switches to it on its next
+ * packet.  Level 0 is never picked, because it doesn't compress at all.
+ */
+void multifd_send_set_level(int level)
+{
+    if (multifd_send_state->level < 0) {
+        return;
+    }
+    /* 9 is the highest zlib level */
+    level = MAX(1, MIN(level, 9));
+    qatomic_set(&multifd_send_state->level, level);
+}
+
 static void *multifd_send_thread(void *opaque)
 {
     MultiFDSendParams *p = opaque;
@@ -643,20 +928,43 @@ static void *multifd_send_thread(void *opaque)
         if (p->pending_job) {
             uint32_t used = p->pages->used;
             uint64_t packet_num = p->packet_num;
+            int64_t write_start;
             flags = p->flags;
 
+            p->zero_num = 0;
+            if (used && p->pages->block->free_bmap) {
+                multifd_send_free_page_drop(p);
+                used = p->pages->used;
+                if (!used) {
+                    p->next_packet_size = 0;
+                }
+            }
+            if (used && migrate_multifd_zero_pages()) {
+                multifd_send_zero_page_detect(p);
+                used = p->pages->used;
+                qatomic_add(&multifd_send_state->data_bytes,
+                            (size_t)used * qemu_target_page_size());
+                qatomic_add(&multifd_send_state->zero_pages, p->zero_num);
+                if (!used) {
+                    p->next_packet_size = 0;
+                }
+            }
             if (used) {
+                int64_t start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+
                 ret = multifd_send_state->ops->send_prepare(p, used,
                                                             &local_err);
                 if (ret != 0) {
                     qemu_mutex_unlock(&p->mutex);
                     break;
                 }
+                stat64_add(&multifd_send_state->prepare_us,
+                           qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start);
             }
             multifd_send_fill_packet(p);
             p->flags = 0;
             p->num_packets++;
-            p->num_pages += used;
+            p->num_pages += used + p->zero_num;
             p->pages->used = 0;
             p->pages->block = NULL;
             qemu_mutex_unlock(&p->mutex);
@@ -664,6 +972,7 @@ static void *multifd_send_thread(void *opaque)
             trace_multifd_send(p->id, packet_num, used, flags,
                                p->next_packet_size);
 
+            write_start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
             ret = qio_channel_write_all(p->c, (void *)p->packet,
                                         p->packet_len, &local_err);
             if (ret != 0) {
@@ -676,6 +985,10 @@ static void *multifd_send_thread(void *opaque)
                     break;
                 }
             }
+            stat64_add(&multifd_send_state->write_us,
+                       qemu_clock_get_us(QEMU_CLOCK_REALTIME) - write_start);
+            stat64_add(&p->bytes_sent,
+                       p->packet_len + (used ? p->next_packet_size : 0));
 
             qemu_mutex_lock(&p->mutex);
             p->pending_job--;
@@ -869,6 +1182,15 @@ int multifd_save_setup(Error **errp)
     qemu_sem_init(&multifd_send_state->channels_ready, 0);
     qatomic_set(&multifd_send_state->exiting, 0);
     multifd_send_state->ops = multifd_ops[migrate_multifd_compression()];
+    multifd_send_state->active_channels = thread_count;
+    switch (migrate_multifd_compression()) {
+    case MULTIFD_COMPRESSION_ZLIB:
+        multifd_send_state->level = migrate_multifd_zlib_level();
+        break;
+    default:
+        multifd_send_state->level = -1;
+        break;
+    }
 
     for (i = 0; i < thread_count; i++) {
         MultiFDSendParams *p = &multifd_send_state->params[i];
@@ -1033,7 +1355,7 @@ static void *multifd_recv_thread(void *opaque)
     rcu_register_thread();
 
     while (true) {
-        uint32_t used;
+        uint32_t used, zero_num, i;
         uint32_t flags;
 
         if (p->quit) {
@@ -1057,13 +1379,14 @@ static void *multifd_recv_thread(void *opaque)
         }
 
         used = p->pages->used;
+        zero_num = p->zero_num;
         flags = p->flags;
         /* recv methods don't know how to handle the SYNC flag */
         p->flags &= ~MULTIFD_FLAG_SYNC;
         trace_multifd_recv(p->id, p->packet_num, used, flags,
                            p->next_packet_size);
         p->num_packets++;
-        p->num_pages += used;
+        p->num_pages += used + zero_num;
         qemu_mutex_unlock(&p->mutex);
 
         if (used) {
@@ -1073,6 +1396,15 @@ static void *multifd_recv_thread(void *opaque)
             }
         }
 
+        for (i = used; i < used + zero_num; i++) {
+            ram_handle_compressed(p->pages->iov[i].iov_base, 0,
+                                  qemu_target_page_size());
+        }
+
+        if (p->colo_backup) {
+            multifd_recv_colo_backup(p, used + zero_num);
+        }
+
         if (flags & MULTIFD_FLAG_SYNC) {
             qemu_sem_post(&multifd_recv_state->sem_sync);
             qemu_sem_wait(&p->sem_sync);
@@ -13,6 +13,8 @@
 #ifndef QEMU_MIGRATION_MULTIFD_H
 #define QEMU_MIGRATION_MULTIFD_H
 
+#include "qemu/stats64.h"
+
 int multifd_save_setup(Error **errp);
 void multifd_save_cleanup(void);
 int multifd_load_setup(Error **errp);
@@ -22,6 +24,24 @@ bool multifd_recv_new_channel(QIOChannel *ioc, Error **errp);
 void multifd_recv_sync_main(void);
 void multifd_send_sync_main(QEMUFile *f);
 int multifd_queue_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset);
+void multifd_page_sent_elsewhere(RAMBlock *block, ram_addr_t offset);
+
+typedef struct {
+    /* time the migration thread waited for a free channel */
+    uint64_t wait_us;
+    /* time the channels spent compressing the pages */
+    uint64_t prepare_us;
+    /* time the channels spent writing the packets */
+    uint64_t write_us;
+} MultiFDSendStats;
+
+void multifd_send_get_stats(MultiFDSendStats *stats);
+void multifd_send_get_period_stats(MultiFDSendStats *stats);
+uint64_t multifd_send_channel_bytes(int id);
+int multifd_send_active_channels(void);
+void multifd_send_set_active_channels(int count);
+int multifd_send_level(void);
+void multifd_send_set_level(int level);
 
 /* Multifd Compression flags */
 #define MULTIFD_FLAG_SYNC (1 << 0)
@@ -32,6 +52,8 @@ int multifd_queue_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset);
 #define MULTIFD_FLAG_NOCOMP (0 << 1)
 #define MULTIFD_FLAG_ZLIB (1 << 1)
 #define MULTIFD_FLAG_ZSTD (2 << 1)
+#define MULTIFD_FLAG_XBZRLE (3 << 1)
+#define MULTIFD_FLAG_QATZIP (4 << 1)
 
 /* This value needs to be a multiple of qemu_target_page_size() */
 #define MULTIFD_PACKET_SIZE (512 * 1024)
@@ -42,11 +64,15 @@ typedef struct {
     uint32_t flags;
     /* maximum number of allocated pages */
     uint32_t pages_alloc;
+    /* number of pages whose data follows the packet */
     uint32_t pages_used;
     /* size of the next packet that contains pages */
     uint32_t next_packet_size;
     uint64_t packet_num;
-    uint64_t unused[4];    /* Reserved for future use */
+    /* number of zero pages, listed after the pages_used ones in offset[] */
+    uint32_t zero_pages;
+    uint32_t unused32[1];  /* Reserved for future use */
+    uint64_t unused[3];    /* Reserved for future use */
     char ramblock[256];
     uint64_t offset[];
 } __attribute__((packed)) MultiFDPacket_t;
@@ -89,6 +115,8 @@ typedef struct {
     int pending_job;
     /* array of pages to sent */
     MultiFDPages_t *pages;
+    /* number of zero pages at the end of pages, not counted in used */
+    uint32_t zero_num;
     /* packet allocated len */
     uint32_t packet_len;
     /* pointer to the packet */
@@ -99,11 +127,15 @@ typedef struct {
     uint32_t next_packet_size;
     /* global number of generated multifd packets */
     uint64_t packet_num;
+    /* dirty bitmap sync round of the pages, for caching methods */
+    uint64_t dirty_sync_count;
     /* thread local variables */
     /* packets sent through this channel */
     uint64_t num_packets;
     /* pages sent through this channel */
     uint64_t num_pages;
+    /* bytes written to the channel, read by the migration thread */
+    Stat64 bytes_sent;
     /* syncs main thread and channels */
     QemuSemaphore sem_sync;
     /* used for compression methods */
@@ -128,6 +160,10 @@ typedef struct {
     bool quit;
     /* array of pages to receive */
     MultiFDPages_t *pages;
+    /* number of zero pages at the end of pages, not counted in used */
+    uint32_t zero_num;
+    /* copy the pages to the COLO cache after loading them */
+    bool colo_backup;
     /* packet allocated len */
     uint32_t packet_len;
     /* pointer to the packet */
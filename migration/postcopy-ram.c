@@ -18,12 +18,15 @@
 
 #include "qemu/osdep.h"
 #include "exec/target_page.h"
+#include "exec/ramblock.h"
 #include "migration.h"
 #include "qemu-file.h"
+#include "socket.h"
 #include "savevm.h"
 #include "postcopy-ram.h"
 #include "ram.h"
 #include "qapi/error.h"
+#include "qemu/bswap.h"
 #include "qemu/notify.h"
 #include "qemu/rcu.h"
 #include "sysemu/sysemu.h"
@@ -84,7 +87,11 @@ int postcopy_notify(enum PostcopyNotifyReason reason, Error **errp)
 #include <poll.h>
 #include <sys/ioctl.h>
 #include <sys/syscall.h>
+#include <sys/vfs.h>
 #include <asm/types.h> /* for __u64 */
+
+#define HUGETLBFS_MAGIC       0x958458f6
+#define TMPFS_MAGIC           0x01021994
 #endif
 
 #if defined(__linux__) && defined(__NR_userfaultfd) && defined(CONFIG_EVENTFD)
@@ -266,10 +273,12 @@ static bool request_ufd_features(int ufd, uint64_t features)
     return true;
 }
 
+/* Features of the host's userfaultfd, as reported by receive_ufd_features */
+static uint64_t supported_features;
+
 static bool ufd_check_and_apply(int ufd, MigrationIncomingState *mis)
 {
     uint64_t asked_features = 0;
-    static uint64_t supported_features;
 
     /*
      * it's not possible to
@@ -296,6 +305,13 @@ static bool ufd_check_and_apply(int ufd, MigrationIncomingState *mis)
     }
 #endif
 
+    if (migrate_postcopy_minor_faults() && mis) {
+        /* Blocks whose backend can't do minor faults keep using copies */
+        asked_features |= supported_features &
+                          (UFFD_FEATURE_MINOR_HUGETLBFS |
+                           UFFD_FEATURE_MINOR_SHMEM);
+    }
+
     /*
      * request features, even if asked_features is 0, due to
      * kernel expects UFFD_API before UFFDIO_REGISTER, per
@@ -502,6 +518,11 @@ static int cleanup_range(RAMBlock *rb, void *opaque)
         return -1;
     }
 
+    if (rb->host_mirror) {
+        munmap(rb->host_mirror, length);
+        rb->host_mirror = NULL;
+    }
+
     return 0;
 }
 
@@ -524,8 +545,23 @@ int postcopy_ram_incoming_init(MigrationIncomingState *mis)
  */
 int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
 {
+    int i;
+
     trace_postcopy_ram_incoming_cleanup_entry();
 
+    if (mis->have_preempt_thread) {
+        /*
+         * When postcopy completes, the source ends the preempt channel
+         * with RAM_SAVE_FLAG_EOS, and the pages before it are still
+         * needed.  Otherwise, kick the thread out of its read.
+         */
+        if (mis->state != MIGRATION_STATUS_POSTCOPY_ACTIVE) {
+            qemu_file_shutdown(mis->postcopy_qemufile_dst);
+        }
+        qemu_thread_join(&mis->preempt_thread);
+        mis->have_preempt_thread = false;
+    }
+
     if (mis->have_fault_thread) {
         Error *local_err = NULL;
 
@@ -560,9 +596,11 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
         }
     }
 
-    if (mis->postcopy_tmp_page) {
-        munmap(mis->postcopy_tmp_page, mis->largest_page_size);
-        mis->postcopy_tmp_page = NULL;
+    for (i = 0; i < RAM_CHANNEL_MAX; i++) {
+        if (mis->postcopy_tmp_pages[i]) {
+            munmap(mis->postcopy_tmp_pages[i], mis->largest_page_size);
+            mis->postcopy_tmp_pages[i] = NULL;
+        }
     }
     if (mis->postcopy_tmp_zero_page) {
         munmap(mis->postcopy_tmp_zero_page, mis->largest_page_size);
@@ -621,14 +659,44 @@ int postcopy_ram_prepare_discard(MigrationIncomingState *mis)
  *   opaque: MigrationIncomingState pointer
  * Returns 0 on success
  */
+/*
+ * Returns the userfaultfd feature that allows minor faults on the memory
+ * backing @rb, or 0 if it can only be filled with UFFDIO_COPY.  Minor
+ * faults need a shared mapping of a hugetlbfs or shmem file, so that the
+ * pages can be written to the page cache through another mapping.
+ */
+static uint64_t ramblock_minor_fault_feature(RAMBlock *rb)
+{
+    struct statfs fs;
+
+    if (!qemu_ram_is_shared(rb) || rb->fd < 0 || fstatfs(rb->fd, &fs)) {
+        return 0;
+    }
+
+    switch (fs.f_type) {
+    case HUGETLBFS_MAGIC:
+        return UFFD_FEATURE_MINOR_HUGETLBFS;
+    case TMPFS_MAGIC:
+        return UFFD_FEATURE_MINOR_SHMEM;
+    default:
+        return 0;
+    }
+}
+
 static int ram_block_enable_notify(RAMBlock *rb, void *opaque)
 {
     MigrationIncomingState *mis = opaque;
     struct uffdio_register reg_struct;
+    bool minor = migrate_postcopy_minor_faults() &&
+                 (supported_features & ramblock_minor_fault_feature(rb));
+    void *mirror;
 
     reg_struct.range.start = (uintptr_t)qemu_ram_get_host_addr(rb);
     reg_struct.range.len = qemu_ram_get_used_length(rb);
     reg_struct.mode = UFFDIO_REGISTER_MODE_MISSING;
+    if (minor) {
+        reg_struct.mode |= UFFDIO_REGISTER_MODE_MINOR;
+    }
 
     /* Now tell our userfault_fd that it's responsible for this area */
     if (ioctl(mis->userfault_fd, UFFDIO_REGISTER, &reg_struct)) {
@@ -643,6 +711,28 @@ static int ram_block_enable_notify(RAMBlock *rb, void *opaque)
         qemu_ram_set_uf_zeroable(rb);
     }
 
+    if (minor) {
+        if (!(reg_struct.ioctls & ((__u64)1 << _UFFDIO_CONTINUE))) {
+            error_report("%s userfault: Region doesn't support CONTINUE",
+                         __func__);
+            return -1;
+        }
+        /*
+         * The memory is at offset 0 of the file; pages that are in the
+         * page cache but missing from the guest mapping raise minor faults
+         */
+        mirror = mmap(NULL, reg_struct.range.len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED, rb->fd, 0);
+        if (mirror == MAP_FAILED) {
+            error_report("%s: Failed to map %s a second time: %s", __func__,
+                         qemu_ram_get_idstr(rb), strerror(errno));
+            return -1;
+        }
+        rb->host_mirror = mirror;
+        trace_postcopy_ram_enable_minor_faults(qemu_ram_get_idstr(rb),
+                                               mirror);
+    }
+
     return 0;
 }
 
@@ -965,6 +1055,21 @@ static void *postcopy_ram_fault_thread(void *opaque)
             }
 
             rb_offset &= ~(qemu_ram_pagesize(rb) - 1);
+            if ((msg.arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_MINOR) &&
+                ramblock_recv_bitmap_test_byte_offset(rb, rb_offset)) {
+                /*
+                 * The page was received already but its mapping is gone,
+                 * e.g. shmem got swapped out; just map it again.
+                 */
+                trace_postcopy_ram_fault_thread_minor(
+                        msg.arg.pagefault.address, qemu_ram_get_idstr(rb),
+                        rb_offset);
+                if (postcopy_place_page_continue(mis,
+                        qemu_ram_get_host_addr(rb) + rb_offset, rb)) {
+                    break;
+                }
+                continue;
+            }
             trace_postcopy_ram_fault_thread_request(msg.arg.pagefault.address,
                                                 qemu_ram_get_idstr(rb),
                                                 rb_offset,
@@ -1056,8 +1161,42 @@ retry:
     return NULL;
 }
 
+/*
+ * Load the pages that the source sends on the postcopy-preempt channel,
+ * until it ends the channel or fails.
+ */
+static void *postcopy_preempt_thread(void *opaque)
+{
+    MigrationIncomingState *mis = opaque;
+    QEMUFile *f = mis->postcopy_qemufile_dst;
+    int ret;
+
+    trace_postcopy_preempt_thread_entry();
+    rcu_register_thread();
+
+    qemu_file_set_blocking(f, true);
+    WITH_RCU_READ_LOCK_GUARD() {
+        ret = ram_load_postcopy(f, RAM_CHANNEL_POSTCOPY);
+    }
+
+    /*
+     * Pages that were lost with the channel are sent again on the main
+     * channel after a recovery.
+     */
+    if (ret < 0 && mis->state == MIGRATION_STATUS_POSTCOPY_ACTIVE) {
+        error_report("%s: loading from the preempt channel failed: %d",
+                     __func__, ret);
+    }
+
+    rcu_unregister_thread();
+    trace_postcopy_preempt_thread_exit(ret);
+    return NULL;
+}
+
 int postcopy_ram_incoming_setup(MigrationIncomingState *mis)
 {
+    int i;
+
     /* Open the fd for the kernel to give us userfaults */
     mis->userfault_fd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
     if (mis->userfault_fd == -1) {
@@ -1096,14 +1235,20 @@ int postcopy_ram_incoming_setup(MigrationIncomingState *mis)
         return -1;
     }
 
-    mis->postcopy_tmp_page = mmap(NULL, mis->largest_page_size,
-                                  PROT_READ | PROT_WRITE, MAP_PRIVATE |
-                                  MAP_ANONYMOUS, -1, 0);
-    if (mis->postcopy_tmp_page == MAP_FAILED) {
-        mis->postcopy_tmp_page = NULL;
-        error_report("%s: Failed to map postcopy_tmp_page %s",
-                     __func__, strerror(errno));
-        return -1;
+    for (i = 0; i < RAM_CHANNEL_MAX; i++) {
+        void *page;
+
+        if (i == RAM_CHANNEL_POSTCOPY && !mis->postcopy_qemufile_dst) {
+            continue;
+        }
+        page = mmap(NULL, mis->largest_page_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (page == MAP_FAILED) {
+            error_report("%s: Failed to map postcopy_tmp_page %s",
+                         __func__, strerror(errno));
+            return -1;
+        }
+        mis->postcopy_tmp_pages[i] = page;
     }
 
     /*
@@ -1122,11 +1267,41 @@ int postcopy_ram_incoming_setup(MigrationIncomingState *mis)
     }
     memset(mis->postcopy_tmp_zero_page, '\0', mis->largest_page_size);
 
+    if (mis->postcopy_qemufile_dst) {
+        qemu_thread_create(&mis->preempt_thread, "postcopy/preempt",
+                           postcopy_preempt_thread, mis,
+                           QEMU_THREAD_JOINABLE);
+        mis->have_preempt_thread = true;
+    }
+
     trace_postcopy_ram_enable_notify();
 
     return 0;
 }
 
+/*
+ * Book-keeping once the page at (host_addr) is mapped in the guest:
+ * it is received and no longer requested.
+ */
+static void postcopy_page_placed(MigrationIncomingState *mis, void *host_addr,
+                                 uint64_t pagesize, RAMBlock *rb)
+{
+    qemu_mutex_lock(&mis->page_request_mutex);
+    ramblock_recv_bitmap_set_range(rb, host_addr,
+                                   pagesize / qemu_target_page_size());
+    /*
+     * If this page resolves a page fault for a previous recorded faulted
+     * address, take a special note to maintain the requested page list.
+     */
+    if (g_tree_lookup(mis->page_requested, host_addr)) {
+        g_tree_remove(mis->page_requested, host_addr);
+        mis->page_requested_count--;
+        trace_postcopy_page_req_del(host_addr, mis->page_requested_count);
+    }
+    qemu_mutex_unlock(&mis->page_request_mutex);
+    mark_postcopy_blocktime_end((uintptr_t)host_addr);
+}
+
 static int qemu_ufd_copy_ioctl(MigrationIncomingState *mis, void *host_addr,
                                void *from_addr, uint64_t pagesize, RAMBlock *rb)
 {
@@ -1148,20 +1323,7 @@ static int qemu_ufd_copy_ioctl(MigrationIncomingState *mis, void *host_addr,
         ret = ioctl(userfault_fd, UFFDIO_ZEROPAGE, &zero_struct);
     }
     if (!ret) {
-        qemu_mutex_lock(&mis->page_request_mutex);
-        ramblock_recv_bitmap_set_range(rb, host_addr,
-                                       pagesize / qemu_target_page_size());
-        /*
-         * If this page resolves a page fault for a previous recorded faulted
-         * address, take a special note to maintain the requested page list.
-         */
-        if (g_tree_lookup(mis->page_requested, host_addr)) {
-            g_tree_remove(mis->page_requested, host_addr);
-            mis->page_requested_count--;
-            trace_postcopy_page_req_del(host_addr, mis->page_requested_count);
-        }
-        qemu_mutex_unlock(&mis->page_request_mutex);
-        mark_postcopy_blocktime_end((uintptr_t)host_addr);
+        postcopy_page_placed(mis, host_addr, pagesize, rb);
     }
     return ret;
 }
@@ -1238,6 +1400,39 @@ int postcopy_place_page_zero(MigrationIncomingState *mis, void *host,
     }
 }
 
+/*
+ * Map the host page at (host), whose contents were already written to the
+ * page cache through rb->host_mirror.  Until then the guest has no mapping
+ * of it, so a partially received page is never visible and is simply sent
+ * again after a postcopy recovery.
+ * returns 0 on success
+ */
+int postcopy_place_page_continue(MigrationIncomingState *mis, void *host,
+                                 RAMBlock *rb)
+{
+    size_t pagesize = qemu_ram_pagesize(rb);
+    struct uffdio_continue continue_struct;
+
+    trace_postcopy_place_page_continue(host);
+
+    continue_struct.range.start = (uint64_t)(uintptr_t)host;
+    continue_struct.range.len = pagesize;
+    continue_struct.mode = 0;
+    /* EEXIST: the fault thread and the load thread raced to map it */
+    if (ioctl(mis->userfault_fd, UFFDIO_CONTINUE, &continue_struct) &&
+        errno != EEXIST) {
+        int e = errno;
+        error_report("%s: %s continue host: %p (size: %zd)",
+                     __func__, strerror(e), host, pagesize);
+
+        return -e;
+    }
+
+    postcopy_page_placed(mis, host, pagesize, rb);
+    return postcopy_notify_shared_wake(rb,
+                                       qemu_ram_block_host_offset(rb, host));
+}
+
 #else
 /* No target OS support, stubs just fail */
 void fill_destination_postcopy_migration_info(MigrationInfo *info)
@@ -1295,6 +1490,13 @@ int postcopy_place_page_zero(MigrationIncomingState *mis, void *host,
     return -1;
 }
 
+int postcopy_place_page_continue(MigrationIncomingState *mis, void *host,
+                                 RAMBlock *rb)
+{
+    assert(0);
+    return -1;
+}
+
 int postcopy_wake_shared(struct PostCopyFD *pcfd,
                          uint64_t client_addr,
                          RAMBlock *rb)
@@ -1306,6 +1508,104 @@ int postcopy_wake_shared(struct PostCopyFD *pcfd,
 
 /* ------------------------------------------------------------------------- */
 
+/**
+ * postcopy_preempt_setup: open the postcopy-preempt channel on the source
+ *
+ * It connects to the same address as the main channel and sends
+ * POSTCOPY_PREEMPT_MAGIC first, for the destination to recognize it.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @s: current migration state
+ * @errp: pointer to an error
+ */
+int postcopy_preempt_setup(MigrationState *s, Error **errp)
+{
+    QIOChannel *ioc;
+    QEMUFile *f;
+
+    if (s->parameters.tls_creds && *s->parameters.tls_creds) {
+        error_setg(errp, "Postcopy preempt does not support TLS");
+        return -1;
+    }
+
+    ioc = socket_send_channel_create_sync(errp);
+    if (!ioc) {
+        error_prepend(errp, "Failed to open the postcopy preempt channel: ");
+        return -1;
+    }
+    qio_channel_set_name(ioc, "migration-postcopy-preempt");
+    f = qemu_fopen_channel_output(ioc);
+    object_unref(OBJECT(ioc));
+    qemu_file_set_blocking(f, true);
+
+    qemu_put_be32(f, POSTCOPY_PREEMPT_MAGIC);
+    qemu_fflush(f);
+    if (qemu_file_get_error(f)) {
+        error_setg(errp, "Failed to send the postcopy preempt channel header");
+        qemu_fclose(f);
+        return -1;
+    }
+
+    WITH_QEMU_LOCK_GUARD(&s->qemu_file_lock) {
+        s->postcopy_qemufile_src = f;
+    }
+    trace_postcopy_preempt_setup();
+    return 0;
+}
+
+/**
+ * postcopy_preempt_cleanup: close the postcopy-preempt channel on the source
+ *
+ * Called by the migration thread, or once it is gone.
+ *
+ * @s: current migration state
+ */
+void postcopy_preempt_cleanup(MigrationState *s)
+{
+    QEMUFile *f;
+
+    WITH_QEMU_LOCK_GUARD(&s->qemu_file_lock) {
+        f = s->postcopy_qemufile_src;
+        s->postcopy_qemufile_src = NULL;
+    }
+    if (f) {
+        qemu_file_shutdown(f);
+        qemu_fclose(f);
+    }
+}
+
+/**
+ * postcopy_preempt_channel_probe: tell the channels apart on the destination
+ *
+ * Returns 1 if @f is the postcopy-preempt channel, whose magic is then
+ * consumed, 0 if it is the main channel and -1 for error
+ *
+ * @f: an incoming migration channel
+ * @errp: pointer to an error
+ */
+int postcopy_preempt_channel_probe(QEMUFile *f, Error **errp)
+{
+    uint8_t *buf;
+
+    if (qemu_peek_buffer(f, &buf, 4, 0) != 4) {
+        error_setg(errp, "Failed to read the header of a migration channel");
+        return -1;
+    }
+    if (ldl_be_p(buf) != POSTCOPY_PREEMPT_MAGIC) {
+        return 0;
+    }
+    qemu_file_skip(f, 4);
+    return 1;
+}
+
+/* The destination got the postcopy-preempt channel */
+void postcopy_preempt_new_channel(MigrationIncomingState *mis, QEMUFile *f)
+{
+    mis->postcopy_qemufile_dst = f;
+    trace_postcopy_preempt_new_channel();
+}
+
 void postcopy_fault_thread_notify(MigrationIncomingState *mis)
 {
     uint64_t tmp64 = 1;
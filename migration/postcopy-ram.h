@@ -78,6 +78,14 @@ int postcopy_place_page(MigrationIncomingState *mis, void *host, void *from,
 int postcopy_place_page_zero(MigrationIncomingState *mis, void *host,
                              RAMBlock *rb);
 
+/*
+ * Map a host page at (host) whose contents were written through the
+ * RAMBlock's host_mirror, with postcopy-minor-faults
+ * returns 0 on success
+ */
+int postcopy_place_page_continue(MigrationIncomingState *mis, void *host,
+                                 RAMBlock *rb);
+
 /* The current postcopy state is read/set by postcopy_state_get/set
  * which update it atomically.
  * The state is updated as postcopy messages are received, and
@@ -106,6 +114,17 @@ PostcopyState postcopy_state_set(PostcopyState new_state);
 
 void postcopy_fault_thread_notify(MigrationIncomingState *mis);
 
+/*
+ * Second channel of the postcopy-preempt capability, which starts with
+ * this magic so that the destination tells it from the main channel
+ */
+#define POSTCOPY_PREEMPT_MAGIC  0x51505245  /* "QPRE" */
+
+int postcopy_preempt_setup(MigrationState *s, Error **errp);
+void postcopy_preempt_cleanup(MigrationState *s);
+int postcopy_preempt_channel_probe(QEMUFile *f, Error **errp);
+void postcopy_preempt_new_channel(MigrationIncomingState *mis, QEMUFile *f);
+
 /*
  * To be called once at the start before any device initialisation
  */
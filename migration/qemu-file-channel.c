@@ -146,6 +146,20 @@ static int channel_set_blocking(void *opaque,
     return 0;
 }
 
+static int64_t channel_seek(void *opaque, int64_t offset, int whence,
+                            Error **errp)
+{
+    QIOChannel *ioc = QIO_CHANNEL(opaque);
+    off_t ret;
+
+    /* Fails on channels that are not files */
+    ret = qio_channel_io_seek(ioc, offset, whence, errp);
+    if (ret < 0) {
+        return -EIO;
+    }
+    return ret;
+}
+
 static QEMUFile *channel_get_input_return_path(void *opaque)
 {
     QIOChannel *ioc = QIO_CHANNEL(opaque);
@@ -166,6 +180,7 @@ static const QEMUFileOps channel_input_ops = {
     .shut_down = channel_shutdown,
     .set_blocking = channel_set_blocking,
     .get_return_path = channel_get_input_return_path,
+    .seek = channel_seek,
 };
 
 
@@ -175,6 +190,7 @@ static const QEMUFileOps channel_output_ops = {
     .shut_down = channel_shutdown,
     .set_blocking = channel_set_blocking,
     .get_return_path = channel_get_output_return_path,
+    .seek = channel_seek,
 };
 
 
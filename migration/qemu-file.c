@@ -25,6 +25,7 @@
 #include <zlib.h>
 #include "qemu/error-report.h"
 #include "qemu/iov.h"
+#include "qemu/timer.h"
 #include "migration.h"
 #include "qemu-file.h"
 #include "trace.h"
@@ -55,6 +56,8 @@ struct QEMUFile {
     Error *last_error_obj;
     /* has the file has been shutdown */
     bool shutdown;
+    /* time spent writing out the buffer, in microseconds */
+    int64_t flush_time_us;
 };
 
 /*
@@ -228,9 +231,12 @@ void qemu_fflush(QEMUFile *f)
         return;
     }
     if (f->iovcnt > 0) {
+        int64_t start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+
         expect = iov_size(f->iov, f->iovcnt);
         ret = f->ops->writev_buffer(f->opaque, f->iov, f->iovcnt, f->pos,
                                     &local_error);
+        f->flush_time_us += qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start;
 
         qemu_iovec_release_ram(f);
     }
@@ -366,6 +372,79 @@ void qemu_update_position(QEMUFile *f, size_t size)
     f->pos += size;
 }
 
+/*
+ * Get the offset in the underlying file of the next byte that is put into
+ * or got from the stream.  Only seekable files support this.
+ *
+ * Returns the offset, or a negative errno value.
+ */
+int64_t qemu_file_get_offset(QEMUFile *f)
+{
+    Error *local_error = NULL;
+    int64_t ret;
+
+    if (!f->ops->seek) {
+        return -ENOTSUP;
+    }
+
+    if (qemu_file_is_writable(f)) {
+        qemu_fflush(f);
+    }
+    ret = qemu_file_get_error(f);
+    if (ret) {
+        return ret;
+    }
+
+    ret = f->ops->seek(f->opaque, 0, SEEK_CUR, &local_error);
+    if (ret < 0) {
+        qemu_file_set_error_obj(f, ret, local_error);
+        return ret;
+    }
+    if (!qemu_file_is_writable(f)) {
+        /* What was read ahead into the buffer hasn't been got yet */
+        ret -= f->buf_size - f->buf_index;
+    }
+    return ret;
+}
+
+/*
+ * Continue the stream at @offset of the underlying file.  Only seekable
+ * files support this.  It doesn't change the position of the stream
+ * returned by qemu_ftell(), which counts the bytes that went through it.
+ *
+ * Returns 0 on success, or a negative errno value that is also set as
+ * the error of the file.
+ */
+int qemu_file_set_offset(QEMUFile *f, int64_t offset)
+{
+    Error *local_error = NULL;
+    int64_t ret;
+
+    if (!f->ops->seek) {
+        qemu_file_set_error(f, -ENOTSUP);
+        return -ENOTSUP;
+    }
+
+    if (qemu_file_is_writable(f)) {
+        qemu_fflush(f);
+    } else {
+        /* Drop what was read ahead */
+        f->buf_index = 0;
+        f->buf_size = 0;
+    }
+    ret = qemu_file_get_error(f);
+    if (ret) {
+        return ret;
+    }
+
+    ret = f->ops->seek(f->opaque, offset, SEEK_SET, &local_error);
+    if (ret < 0) {
+        qemu_file_set_error_obj(f, ret, local_error);
+        return ret;
+    }
+    return 0;
+}
+
 /** Closes the file
  *
  * Returns negative error value if any error happened on previous operations or
@@ -657,6 +736,12 @@ int64_t qemu_ftell(QEMUFile *f)
     return f->pos;
 }
 
+/* Time spent in qemu_fflush() writing out the buffer, in microseconds */
+int64_t qemu_file_get_flush_time(QEMUFile *f)
+{
+    return f->flush_time_us;
+}
+
 int qemu_file_rate_limit(QEMUFile *f)
 {
     if (f->shutdown) {
@@ -44,6 +44,7 @@
 #include "qapi/error.h"
 #include "qapi/qapi-types-migration.h"
 #include "qapi/qapi-events-migration.h"
+#include "qapi/util.h"
 #include "qapi/qmp/qerror.h"
 #include "trace.h"
 #include "exec/ram_addr.h"
@@ -53,9 +54,15 @@
 #include "block.h"
 #include "sysemu/sysemu.h"
 #include "sysemu/cpu-throttle.h"
+#include "sysemu/kvm.h"
 #include "savevm.h"
 #include "qemu/iov.h"
 #include "multifd.h"
+#include "mapped-ram.h"
+
+#ifdef CONFIG_LINUX
+#include "qemu/userfaultfd.h"
+#endif
 
 /***********************************************************/
 /* ram save/restore */
@@ -75,6 +82,14 @@
 #define RAM_SAVE_FLAG_XBZRLE   0x40
 /* 0x80 is reserved in migration.h start with 0x100 next */
 #define RAM_SAVE_FLAG_COMPRESS_PAGE    0x100
+/*
+ * A run of zero pages, followed by the number of pages.  0x200 is the
+ * last flag that fits below the smallest target page size.
+ */
+#define RAM_SAVE_FLAG_ZERO_RANGE       0x200
+
+/* Most target pages covered by one RAM_SAVE_FLAG_ZERO_RANGE record */
+#define ZERO_EXTENT_MAX_PAGES          8192
 
 static inline bool is_zero_range(uint8_t *p, uint64_t size)
 {
@@ -312,6 +327,12 @@ struct RAMState {
     bool fpo_enabled;
     /* How many times we have dirty too many pages */
     int dirty_rate_high_cnt;
+    /* Pages dirtied by each vcpu until the last bitmap sync, by cpu_index */
+    uint64_t *vcpu_dirty_pages_prev;
+    /* Pages dirtied by each vcpu during the last sync period */
+    uint64_t *vcpu_dirty_pages_period;
+    /* Number of entries of the two arrays above */
+    int vcpu_dirty_pages_len;
     /* these variables are used for bitmap sync */
     /* last time we did a full bitmap_sync */
     int64_t time_last_bitmap_sync;
@@ -347,6 +368,38 @@ struct RAMState {
     /* Queue of outstanding page requests from the destination */
     QemuMutex src_page_req_mutex;
     QSIMPLEQ_HEAD(, RAMSrcPageRequest) src_page_requests;
+    /* /proc/self/pagemap for zero extents, or -1 */
+    int pagemap_fd;
+    /* pagemap entries of the range being checked */
+    uint64_t *pagemap_buf;
+    size_t pagemap_buf_len;
+    /* UFFD file descriptor for background snapshot write tracking, or -1 */
+    int uffdio_fd;
+    /* run of pages that is not queued to the mapped-ram threads yet */
+    RAMBlock *mapped_block;
+    ram_addr_t mapped_start;
+    ram_addr_t mapped_len;
+    /* Whether f is the postcopy-preempt channel for now */
+    bool postcopy_preempt_active;
+    /* last_sent_block of the channel that f is not */
+    RAMBlock *other_last_sent_block;
+    /*
+     * Pages after the last one that the destination faulted on, up to
+     * fault_around_end, go on the preempt channel too
+     */
+    RAMBlock *fault_around_block;
+    unsigned long fault_around_end;
+    /* counters at the start of the pass, for migration_iteration_report() */
+    int64_t iter_start_time;
+    uint64_t iter_dirty_pages;
+    uint64_t iter_page_count;
+    uint64_t iter_normal;
+    uint64_t iter_duplicate;
+    uint64_t iter_transferred;
+    int64_t iter_flush_time;
+    uint64_t iter_multifd_wait;
+    /* bytes written to each multifd channel */
+    uint64_t *iter_multifd_bytes;
 };
 typedef struct RAMState RAMState;
 
@@ -614,7 +667,95 @@ static size_t save_page_header(RAMState *rs, QEMUFile *f,  RAMBlock *block,
  * able to complete migration. Some workloads dirty memory way too
  * fast and will not effectively converge, even with auto-converge.
  */
-static void mig_throttle_guest_down(uint64_t bytes_dirty_period,
+static bool mig_throttle_per_vcpu(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    /* Only the KVM dirty ring tells which vcpu dirtied a page */
+    return s->parameters.cpu_throttle_per_vcpu && kvm_dirty_ring_enabled();
+}
+
+/**
+ * mig_throttle_vcpu_dirty_pages_update: account the pages of each vcpu
+ *
+ * Compute how many pages each vcpu dirtied since the last bitmap sync.
+ *
+ * @rs: current RAM state
+ */
+static void mig_throttle_vcpu_dirty_pages_update(RAMState *rs)
+{
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        int i = cpu->cpu_index;
+        uint64_t pages = stat64_get(&cpu->dirty_pages);
+
+        if (i >= rs->vcpu_dirty_pages_len) {
+            int len = i + 1;
+
+            rs->vcpu_dirty_pages_prev = g_renew(uint64_t,
+                                                rs->vcpu_dirty_pages_prev,
+                                                len);
+            rs->vcpu_dirty_pages_period = g_renew(uint64_t,
+                                                  rs->vcpu_dirty_pages_period,
+                                                  len);
+            while (rs->vcpu_dirty_pages_len < len) {
+                rs->vcpu_dirty_pages_prev[rs->vcpu_dirty_pages_len] = pages;
+                rs->vcpu_dirty_pages_period[rs->vcpu_dirty_pages_len] = 0;
+                rs->vcpu_dirty_pages_len++;
+            }
+        }
+        /* A replugged vcpu starts counting again */
+        if (pages < rs->vcpu_dirty_pages_prev[i]) {
+            rs->vcpu_dirty_pages_prev[i] = 0;
+        }
+        rs->vcpu_dirty_pages_period[i] = pages - rs->vcpu_dirty_pages_prev[i];
+        rs->vcpu_dirty_pages_prev[i] = pages;
+    }
+}
+
+/**
+ * mig_throttle_set: set the throttle percentage of the guest
+ *
+ * With cpu-throttle-per-vcpu, the vcpu that dirtied most pages during
+ * the last period gets @pct and the others a share of it in proportion
+ * to the pages they dirtied, so that vcpus which barely write memory
+ * keep running.  Otherwise all vcpus get @pct.
+ *
+ * @rs: current RAM state
+ * @pct: throttle percentage
+ */
+static void mig_throttle_set(RAMState *rs, int pct)
+{
+    uint64_t max_pages = 0;
+    CPUState *cpu;
+    int i;
+
+    if (mig_throttle_per_vcpu()) {
+        for (i = 0; i < rs->vcpu_dirty_pages_len; i++) {
+            max_pages = MAX(max_pages, rs->vcpu_dirty_pages_period[i]);
+        }
+    }
+    if (!max_pages) {
+        /* Nothing to tell the vcpus apart, e.g. the pages came from DMA */
+        cpu_throttle_set(pct);
+        return;
+    }
+
+    CPU_FOREACH(cpu) {
+        uint64_t pages = 0;
+
+        if (cpu->cpu_index < rs->vcpu_dirty_pages_len) {
+            pages = rs->vcpu_dirty_pages_period[cpu->cpu_index];
+        }
+        cpu_throttle_set_vcpu(cpu, DIV_ROUND_UP(pct * pages, max_pages));
+        trace_mig_throttle_vcpu(cpu->cpu_index, pages,
+                                cpu_throttle_get_vcpu_percentage(cpu));
+    }
+}
+
+static void mig_throttle_guest_down(RAMState *rs,
+                                    uint64_t bytes_dirty_period,
                                     uint64_t bytes_dirty_threshold)
 {
     MigrationState *s = migrate_get_current();
@@ -628,7 +769,7 @@ static void mig_throttle_guest_down(uint64_t bytes_dirty_period,
 
     /* We have not started throttling yet. Let's start it. */
     if (!cpu_throttle_active()) {
-        cpu_throttle_set(pct_initial);
+        mig_throttle_set(rs, pct_initial);
     } else {
         /* Throttling already on, just increase the rate */
         if (!pct_tailslow) {
@@ -641,7 +782,7 @@ static void mig_throttle_guest_down(uint64_t bytes_dirty_period,
                         bytes_dirty_period);
             throttle_inc = MIN(cpu_now - cpu_ideal, pct_increment);
         }
-        cpu_throttle_set(MIN(throttle_now + throttle_inc, pct_max));
+        mig_throttle_set(rs, MIN(throttle_now + throttle_inc, pct_max));
     }
 }
 
@@ -860,6 +1001,173 @@ static void ramblock_sync_dirty_bitmap(RAMState *rs, RAMBlock *rb)
     rs->num_dirty_pages_period += new_dirty_pages;
 }
 
+/*
+ * The bitmap sync is split in chunks of 1<<18 pages (1G with 4K pages),
+ * which threads sync in parallel.  Chunks are multiples of 64 pages, so
+ * no two threads ever touch the same word of a RAMBlock bitmap.
+ */
+#define BITMAP_SYNC_CHUNK_SHIFT     18
+
+typedef struct {
+    RAMBlock *block;
+    ram_addr_t start;
+    ram_addr_t length;
+} BitmapSyncChunk;
+
+typedef struct {
+    QemuThread thread;
+    /* posted when there are chunks to sync, or to quit */
+    QemuSemaphore sem;
+    bool quit;
+    /* new dirty pages found by this thread during the current sync */
+    uint64_t new_dirty_pages;
+} BitmapSyncParam;
+
+static BitmapSyncParam *bitmap_sync_param;
+static int bitmap_sync_thread_count;
+/* posted by each thread when it is done with the current sync */
+static QemuSemaphore bitmap_sync_done_sem;
+static BitmapSyncChunk *bitmap_sync_chunks;
+static int bitmap_sync_nr_chunks;
+static int bitmap_sync_max_chunks;
+/* next chunk to be synced */
+static int bitmap_sync_next_chunk;
+
+/* Called with RCU critical section */
+static uint64_t bitmap_sync_do_chunks(void)
+{
+    uint64_t new_dirty_pages = 0;
+    int i;
+
+    while ((i = qatomic_fetch_inc(&bitmap_sync_next_chunk)) <
+           bitmap_sync_nr_chunks) {
+        BitmapSyncChunk *chunk = &bitmap_sync_chunks[i];
+
+        new_dirty_pages += cpu_physical_memory_sync_dirty_bitmap(chunk->block,
+                                                                 chunk->start,
+                                                                 chunk->length);
+    }
+
+    return new_dirty_pages;
+}
+
+static void *bitmap_sync_thread(void *opaque)
+{
+    BitmapSyncParam *param = opaque;
+
+    rcu_register_thread();
+    while (true) {
+        qemu_sem_wait(&param->sem);
+        if (param->quit) {
+            break;
+        }
+        WITH_RCU_READ_LOCK_GUARD() {
+            param->new_dirty_pages = bitmap_sync_do_chunks();
+        }
+        qemu_sem_post(&bitmap_sync_done_sem);
+    }
+    rcu_unregister_thread();
+
+    return NULL;
+}
+
+static void bitmap_sync_threads_cleanup(void)
+{
+    int i;
+
+    for (i = 0; i < bitmap_sync_thread_count; i++) {
+        bitmap_sync_param[i].quit = true;
+        qemu_sem_post(&bitmap_sync_param[i].sem);
+        qemu_thread_join(&bitmap_sync_param[i].thread);
+        qemu_sem_destroy(&bitmap_sync_param[i].sem);
+    }
+    if (bitmap_sync_param) {
+        qemu_sem_destroy(&bitmap_sync_done_sem);
+    }
+    g_free(bitmap_sync_param);
+    bitmap_sync_param = NULL;
+    bitmap_sync_thread_count = 0;
+    g_free(bitmap_sync_chunks);
+    bitmap_sync_chunks = NULL;
+    bitmap_sync_max_chunks = 0;
+}
+
+static void bitmap_sync_threads_setup(void)
+{
+    int i, thread_count = migrate_get_current()->bitmap_sync_threads;
+
+    if (!thread_count) {
+        return;
+    }
+    qemu_sem_init(&bitmap_sync_done_sem, 0);
+    bitmap_sync_param = g_new0(BitmapSyncParam, thread_count);
+    for (i = 0; i < thread_count; i++) {
+        qemu_sem_init(&bitmap_sync_param[i].sem, 0);
+        qemu_thread_create(&bitmap_sync_param[i].thread, "bitmap-sync",
+                           bitmap_sync_thread, &bitmap_sync_param[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+    bitmap_sync_thread_count = thread_count;
+}
+
+/**
+ * ramblocks_sync_dirty_bitmap: sync the dirty bitmap of all RAMBlocks
+ *
+ * The chunks of all RAMBlocks are shared out between the calling thread
+ * and the bitmap sync threads; going through the bitmaps of a large
+ * guest word by word is what makes the sync long.
+ *
+ * Called with RCU critical section and bitmap_mutex held
+ *
+ * @rs: current RAM state
+ */
+static void ramblocks_sync_dirty_bitmap(RAMState *rs)
+{
+    ram_addr_t chunk_size = (ram_addr_t)TARGET_PAGE_SIZE <<
+                            BITMAP_SYNC_CHUNK_SHIFT;
+    uint64_t new_dirty_pages;
+    RAMBlock *block;
+    int i, threads;
+
+    bitmap_sync_nr_chunks = 0;
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        ram_addr_t start;
+
+        for (start = 0; start < block->used_length; start += chunk_size) {
+            BitmapSyncChunk *chunk;
+
+            if (bitmap_sync_nr_chunks == bitmap_sync_max_chunks) {
+                bitmap_sync_max_chunks = MAX(bitmap_sync_max_chunks * 2, 16);
+                bitmap_sync_chunks = g_renew(BitmapSyncChunk,
+                                             bitmap_sync_chunks,
+                                             bitmap_sync_max_chunks);
+            }
+            chunk = &bitmap_sync_chunks[bitmap_sync_nr_chunks++];
+            chunk->block = block;
+            chunk->start = start;
+            chunk->length = MIN(chunk_size, block->used_length - start);
+        }
+    }
+    bitmap_sync_next_chunk = 0;
+
+    /* No need to wake more threads than there are chunks left */
+    threads = MIN(bitmap_sync_thread_count, bitmap_sync_nr_chunks - 1);
+    for (i = 0; i < threads; i++) {
+        qemu_sem_post(&bitmap_sync_param[i].sem);
+    }
+    new_dirty_pages = bitmap_sync_do_chunks();
+    for (i = 0; i < threads; i++) {
+        qemu_sem_wait(&bitmap_sync_done_sem);
+    }
+    for (i = 0; i < threads; i++) {
+        new_dirty_pages += bitmap_sync_param[i].new_dirty_pages;
+    }
+    trace_ramblocks_sync_dirty_bitmap(bitmap_sync_nr_chunks, threads);
+
+    rs->migration_dirty_pages += new_dirty_pages;
+    rs->num_dirty_pages_period += new_dirty_pages;
+}
+
 /**
  * ram_pagesize_summary: calculate all the pagesizes of a VM
  *
@@ -948,6 +1256,10 @@ static void migration_trigger_throttle(RAMState *rs)
     uint64_t bytes_dirty_period = rs->num_dirty_pages_period * TARGET_PAGE_SIZE;
     uint64_t bytes_dirty_threshold = bytes_xfer_period * threshold / 100;
 
+    if (mig_throttle_per_vcpu()) {
+        mig_throttle_vcpu_dirty_pages_update(rs);
+    }
+
     /* During block migration the auto-converge logic incorrectly detects
      * that ram migration makes no progress. Avoid this by disabling the
      * throttling logic during the bulk phase of block migration. */
@@ -962,16 +1274,128 @@ static void migration_trigger_throttle(RAMState *rs)
             (++rs->dirty_rate_high_cnt >= 2)) {
             trace_migration_throttle();
             rs->dirty_rate_high_cnt = 0;
-            mig_throttle_guest_down(bytes_dirty_period,
+            mig_throttle_guest_down(rs, bytes_dirty_period,
                                     bytes_dirty_threshold);
         }
     }
 }
 
+static void ram_mapped_submit(RAMState *rs)
+{
+    if (rs->mapped_len) {
+        mapped_ram_queue_pages(rs->mapped_block, rs->mapped_start,
+                               rs->mapped_len);
+        rs->mapped_len = 0;
+    }
+}
+
+/**
+ * ram_mapped_flush: wait for the pages queued to the mapped-ram threads
+ *
+ * The pages were counted as normal pages when they were queued; move the
+ * ones that the threads found to be zero to the duplicate pages.
+ *
+ * Returns 0 for success or a negative errno value
+ *
+ * @rs: current RAM state
+ */
+static int ram_mapped_flush(RAMState *rs)
+{
+    uint64_t zero_pages = 0;
+    int ret;
+
+    if (!migrate_mapped_ram()) {
+        return 0;
+    }
+
+    ram_mapped_submit(rs);
+    ret = mapped_ram_flush(&zero_pages);
+    ram_counters.normal -= zero_pages;
+    ram_counters.duplicate += zero_pages;
+    ram_counters.transferred -= zero_pages * TARGET_PAGE_SIZE;
+    if (ret < 0) {
+        qemu_file_set_error(rs->f, ret);
+    }
+    return ret;
+}
+
+/*
+ * Report what happened during the pass that the bitmap sync just ended,
+ * and start counting for the next one.
+ */
+static void migration_iteration_report(RAMState *rs, int64_t sync_time_us)
+{
+    QEMUFile *f = migrate_get_current()->to_dst_file;
+    int64_t now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    int64_t flush_time = f ? qemu_file_get_flush_time(f) : 0;
+    uint64List *multifd_bytes = NULL;
+    uint64_t multifd_wait = 0;
+    bool multifd = migrate_use_multifd();
+    int i;
+
+    if (multifd) {
+        MultiFDSendStats stats;
+
+        multifd_send_get_stats(&stats);
+        multifd_wait = stats.wait_us;
+        if (!rs->iter_multifd_bytes) {
+            rs->iter_multifd_bytes = g_new0(uint64_t,
+                                            migrate_multifd_channels());
+        }
+    }
+
+    if (rs->iter_start_time) {
+        uint64_t pages = rs->target_page_count - rs->iter_page_count;
+        uint64_t normal = ram_counters.normal - rs->iter_normal;
+        uint64_t zero = ram_counters.duplicate - rs->iter_duplicate;
+        uint64_t transferred = ram_counters.transferred -
+                               rs->iter_transferred;
+
+        trace_migration_iteration(ram_counters.dirty_sync_count - 1,
+                                  now - rs->iter_start_time, sync_time_us,
+                                  rs->iter_dirty_pages, pages, normal, zero,
+                                  transferred,
+                                  flush_time - rs->iter_flush_time,
+                                  multifd_wait - rs->iter_multifd_wait);
+        if (migrate_use_events()) {
+            for (i = multifd ? migrate_multifd_channels() - 1 : -1;
+                 i >= 0; i--) {
+                QAPI_LIST_PREPEND(multifd_bytes,
+                                  multifd_send_channel_bytes(i) -
+                                  rs->iter_multifd_bytes[i]);
+            }
+            qapi_event_send_migration_iteration(
+                ram_counters.dirty_sync_count - 1, now - rs->iter_start_time,
+                sync_time_us, rs->iter_dirty_pages, pages, normal, zero,
+                transferred, flush_time - rs->iter_flush_time,
+                multifd, multifd_wait - rs->iter_multifd_wait,
+                multifd, multifd_bytes);
+            qapi_free_uint64List(multifd_bytes);
+        }
+    }
+
+    rs->iter_start_time = now;
+    rs->iter_dirty_pages = rs->migration_dirty_pages;
+    rs->iter_page_count = rs->target_page_count;
+    rs->iter_normal = ram_counters.normal;
+    rs->iter_duplicate = ram_counters.duplicate;
+    rs->iter_transferred = ram_counters.transferred;
+    rs->iter_flush_time = flush_time;
+    rs->iter_multifd_wait = multifd_wait;
+    for (i = 0; multifd && i < migrate_multifd_channels(); i++) {
+        rs->iter_multifd_bytes[i] = multifd_send_channel_bytes(i);
+    }
+}
+
 static void migration_bitmap_sync(RAMState *rs)
 {
-    RAMBlock *block;
-    int64_t end_time;
+    int64_t end_time, sync_start;
+
+    /*
+     * The pages that are queued have to be written before the bitmap
+     * says that they are clean, or their new version could be missed.
+     */
+    ram_mapped_flush(rs);
 
     ram_counters.dirty_sync_count++;
 
@@ -980,13 +1404,24 @@ static void migration_bitmap_sync(RAMState *rs)
     }
 
     trace_migration_bitmap_sync_start();
+    sync_start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     memory_global_dirty_log_sync();
 
     qemu_mutex_lock(&rs->bitmap_mutex);
     WITH_RCU_READ_LOCK_GUARD() {
+        RAMBlock *block;
+
+        /*
+         * Free page hints are stopped around the sync, and the new ones
+         * can only be about pages the guest has not reused since
+         */
         RAMBLOCK_FOREACH_NOT_IGNORED(block) {
-            ramblock_sync_dirty_bitmap(rs, block);
+            if (block->free_bmap) {
+                bitmap_zero(block->free_bmap,
+                            block->max_length >> TARGET_PAGE_BITS);
+            }
         }
+        ramblocks_sync_dirty_bitmap(rs);
         ram_counters.remaining = ram_bytes_remaining();
     }
     qemu_mutex_unlock(&rs->bitmap_mutex);
@@ -994,6 +1429,9 @@ static void migration_bitmap_sync(RAMState *rs)
     memory_global_after_dirty_log_sync();
     trace_migration_bitmap_sync_end(rs->num_dirty_pages_period);
 
+    migration_iteration_report(rs, qemu_clock_get_us(QEMU_CLOCK_REALTIME) -
+                                   sync_start);
+
     end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
 
     /* more than 1 second = 1000 millisecons */
@@ -1193,6 +1631,15 @@ static int ram_save_page(RAMState *rs, PageSearchStatus *pss, bool last_stage)
         }
     }
 
+    /*
+     * With background snapshot the page is write protected until it has
+     * been sent; copy it to the stream buffer so that the protection can
+     * be dropped without flushing the stream for every page.
+     */
+    if (migrate_background_snapshot()) {
+        send_async = false;
+    }
+
     /* XBZRLE overflow or normal page */
     if (pages == -1) {
         pages = save_normal_page(rs, block, offset, p, send_async);
@@ -1434,6 +1881,89 @@ static RAMBlock *unqueue_page(RAMState *rs, ram_addr_t *offset)
     return block;
 }
 
+#ifdef CONFIG_LINUX
+/**
+ * poll_fault_page: try to get next UFFD write fault page and, if pending fault
+ *   is found, return RAM block pointer and page offset
+ *
+ * Returns pointer to the RAMBlock containing faulting page,
+ *   NULL if no write faults are pending
+ *
+ * @rs: current RAM state
+ * @offset: page offset from the beginning of the block
+ */
+static RAMBlock *poll_fault_page(RAMState *rs, ram_addr_t *offset)
+{
+    struct uffd_msg uffd_msg;
+    void *page_address;
+    RAMBlock *block;
+    int res;
+
+    if (!migrate_background_snapshot() || rs->uffdio_fd < 0) {
+        return NULL;
+    }
+
+    do {
+        res = uffd_read_events(rs->uffdio_fd, &uffd_msg, 1);
+        if (res <= 0) {
+            return NULL;
+        }
+    } while (uffd_msg.event != UFFD_EVENT_PAGEFAULT);
+
+    page_address = (void *)(uintptr_t) uffd_msg.arg.pagefault.address;
+    block = qemu_ram_block_from_host(page_address, false, offset);
+    assert(block && (block->flags & RAM_UF_WRITEPROTECT) != 0);
+    /* Protection is dropped for whole host pages */
+    *offset = QEMU_ALIGN_DOWN(*offset, qemu_ram_pagesize(block));
+    trace_poll_fault_page(block->idstr, (uint64_t)*offset);
+
+    return block;
+}
+
+/**
+ * ram_save_release_protection: release UFFD write protection after
+ *   a range of pages has been saved
+ *
+ * Returns 0 on success, negative value in case of an error
+ *
+ * @rs: current RAM state
+ * @pss: page-search-status structure
+ * @start_page: index of the first page in the range relative to pss->block
+ */
+static int ram_save_release_protection(RAMState *rs, PageSearchStatus *pss,
+                                       unsigned long start_page)
+{
+    void *page_address;
+    uint64_t run_length;
+
+    /* Check if page is from UFFD-managed region */
+    if (!(pss->block->flags & RAM_UF_WRITEPROTECT)) {
+        return 0;
+    }
+
+    page_address = pss->block->host + (start_page << TARGET_PAGE_BITS);
+    run_length = (pss->page - start_page + 1) << TARGET_PAGE_BITS;
+
+    /*
+     * The pages were copied to the stream buffer (see ram_save_page), so
+     * the guest is free to change them from now on.
+     */
+    return uffd_change_protection(rs->uffdio_fd, page_address, run_length,
+                                  false, false);
+}
+#else
+static RAMBlock *poll_fault_page(RAMState *rs, ram_addr_t *offset)
+{
+    return NULL;
+}
+
+static int ram_save_release_protection(RAMState *rs, PageSearchStatus *pss,
+                                       unsigned long start_page)
+{
+    return 0;
+}
+#endif
+
 /**
  * get_queued_page: unqueue a page from the postcopy requests
  *
@@ -1473,6 +2003,14 @@ static bool get_queued_page(RAMState *rs, PageSearchStatus *pss)
 
     } while (block && !dirty);
 
+    if (!block) {
+        /*
+         * Poll write faults too if background snapshot is enabled; that's
+         * when we have vcpus got blocked by the write protected pages.
+         */
+        block = poll_fault_page(rs, &offset);
+    }
+
     if (block) {
         /*
          * As soon as we start servicing pages out of order, then we have
@@ -1639,6 +2177,180 @@ static bool save_compress_page(RAMState *rs, RAMBlock *block, ram_addr_t offset)
     return false;
 }
 
+#define PAGEMAP_PRESENT (1ULL << 63)
+#define PAGEMAP_SWAP    (1ULL << 62)
+
+/*
+ * ram_untouched_pages: count target pages that were never populated
+ *
+ * Returns how many target pages starting at @page and up to @npages
+ * have neither been faulted in nor swapped out.  Reading such a page of
+ * private anonymous memory returns zeroes.
+ *
+ * @rs: current RAM state
+ * @block: block that contains the pages
+ * @page: first target page to check
+ * @npages: maximum number of pages to check
+ */
+static unsigned long ram_untouched_pages(RAMState *rs, RAMBlock *block,
+                                         unsigned long page,
+                                         unsigned long npages)
+{
+    uintptr_t hps = qemu_real_host_page_size;
+    uintptr_t start = (uintptr_t)block->host + (page << TARGET_PAGE_BITS);
+    uintptr_t end = start + (npages << TARGET_PAGE_BITS);
+    uintptr_t first = start / hps;
+    size_t nr = DIV_ROUND_UP(end, hps) - first;
+    ssize_t len;
+    unsigned long i;
+
+    nr = MIN(nr, rs->pagemap_buf_len);
+    len = pread(rs->pagemap_fd, rs->pagemap_buf, nr * sizeof(uint64_t),
+                first * sizeof(uint64_t));
+    if (len < (ssize_t)sizeof(uint64_t)) {
+        return 0;
+    }
+    nr = len / sizeof(uint64_t);
+
+    for (i = 0; i < npages; i++) {
+        uintptr_t addr = start + (i << TARGET_PAGE_BITS);
+        uintptr_t idx = addr / hps - first;
+        uintptr_t last = (addr + TARGET_PAGE_SIZE - 1) / hps - first;
+
+        if (last >= nr) {
+            break;
+        }
+        for (; idx <= last; idx++) {
+            if (rs->pagemap_buf[idx] & (PAGEMAP_PRESENT | PAGEMAP_SWAP)) {
+                return i;
+            }
+        }
+    }
+    return i;
+}
+
+/*
+ * save_zero_extent: send a run of never populated pages as one record
+ *
+ * Returns the number of pages written, or 0 if the page at @pss is not
+ * part of such a run and has to be sent normally.
+ *
+ * Only private anonymous memory is considered, because pages of file
+ * backed or shared memory may hold data without being mapped.
+ *
+ * @rs: current RAM state
+ * @pss: data about the first page of the run
+ */
+static int save_zero_extent(RAMState *rs, PageSearchStatus *pss)
+{
+    RAMBlock *block = pss->block;
+    unsigned long start = pss->page;
+    unsigned long end = block->used_length >> TARGET_PAGE_BITS;
+    unsigned long npages, cleared, i;
+    size_t len;
+
+    if (rs->pagemap_fd < 0 || block->fd >= 0 ||
+        (block->flags & (RAM_SHARED | RAM_PREALLOC)) ||
+        migration_in_postcopy() || save_page_use_compression(rs)) {
+        return 0;
+    }
+
+    /* Dirty pages of the run; a cheap hint that avoids clearing bits */
+    end = MIN(end, start + ZERO_EXTENT_MAX_PAGES);
+    qemu_mutex_lock(&rs->bitmap_mutex);
+    for (npages = 0; start + npages < end; npages++) {
+        if (!test_bit(start + npages, block->bmap)) {
+            break;
+        }
+    }
+    qemu_mutex_unlock(&rs->bitmap_mutex);
+
+    npages = ram_untouched_pages(rs, block, start, npages);
+    if (npages < 2) {
+        return 0;
+    }
+
+    /*
+     * Clear the dirty bits before looking at the pages again, so that a
+     * write racing with the check is caught by the next sync.
+     */
+    for (cleared = 0; cleared < npages; cleared++) {
+        if (!migration_bitmap_clear_dirty(rs, block, start + cleared)) {
+            break;
+        }
+    }
+    npages = ram_untouched_pages(rs, block, start, cleared);
+
+    /* Pages populated in the meantime must still be sent */
+    qemu_mutex_lock(&rs->bitmap_mutex);
+    for (i = npages; i < cleared; i++) {
+        set_bit(start + i, block->bmap);
+        rs->migration_dirty_pages++;
+    }
+    qemu_mutex_unlock(&rs->bitmap_mutex);
+
+    if (!npages) {
+        return 0;
+    }
+
+    len = save_page_header(rs, rs->f, block,
+                           ((ram_addr_t)start << TARGET_PAGE_BITS) |
+                           RAM_SAVE_FLAG_ZERO_RANGE);
+    qemu_put_be64(rs->f, npages);
+    len += 8;
+
+    if (!rs->ram_bulk_stage && migrate_use_xbzrle()) {
+        XBZRLE_cache_lock();
+        for (i = 0; i < npages; i++) {
+            xbzrle_cache_zero_page(rs, block->offset +
+                                   ((ram_addr_t)(start + i) << TARGET_PAGE_BITS));
+        }
+        XBZRLE_cache_unlock();
+    }
+    /* A channel that cached an older version must not encode against it */
+    for (i = start; i < start + npages; i++) {
+        multifd_page_sent_elsewhere(block, (ram_addr_t)i << TARGET_PAGE_BITS);
+    }
+
+    trace_save_zero_extent(block->idstr, (ram_addr_t)start << TARGET_PAGE_BITS,
+                           npages);
+    ram_counters.duplicate += npages;
+    ram_counters.transferred += len;
+    pss->page = start + npages - 1;
+    return npages;
+}
+
+/**
+ * ram_save_mapped_page: save one target page with mapped-ram
+ *
+ * The page goes to its own place in the file.  Contiguous pages are
+ * gathered into runs, which the mapped-ram threads write.
+ *
+ * Returns the number of pages written
+ *
+ * @rs: current RAM state
+ * @block: block that contains the page
+ * @offset: offset inside the block for the page
+ */
+static int ram_save_mapped_page(RAMState *rs, RAMBlock *block,
+                                ram_addr_t offset)
+{
+    if (rs->mapped_len &&
+        (rs->mapped_block != block ||
+         rs->mapped_start + rs->mapped_len != offset ||
+         rs->mapped_len >= MAPPED_RAM_JOB_SIZE)) {
+        ram_mapped_submit(rs);
+    }
+    if (!rs->mapped_len) {
+        rs->mapped_block = block;
+        rs->mapped_start = offset;
+    }
+    rs->mapped_len += TARGET_PAGE_SIZE;
+    acct_update_position(rs->f, TARGET_PAGE_SIZE, false);
+
+    return 1;
+}
+
 /**
  * ram_save_target_page: save one target page
  *
@@ -1653,14 +2365,33 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
 {
     RAMBlock *block = pss->block;
     ram_addr_t offset = ((ram_addr_t)pss->page) << TARGET_PAGE_BITS;
+    bool use_multifd;
     int res;
 
+    if (migrate_mapped_ram()) {
+        return ram_save_mapped_page(rs, block, offset);
+    }
+
     if (control_save_page(rs, block, offset, &res)) {
         return res;
     }
 
-    if (save_compress_page(rs, block, offset)) {
-        return 1;
+    if (save_compress_page(rs, block, offset)) {
+        return 1;
+    }
+
+    /*
+     * Do not use multifd for:
+     * 1. Compression as the first page in the new block should be posted out
+     *    before sending the compressed page
+     * 2. In postcopy as one whole host page should be placed
+     */
+    use_multifd = !save_page_use_compression(rs) && migrate_use_multifd() &&
+                  !migration_in_postcopy();
+
+    /* The multifd channels look for zero pages themselves */
+    if (use_multifd && migrate_multifd_zero_pages()) {
+        return ram_save_multifd_page(rs, block, offset);
     }
 
     res = save_zero_page(rs, block, offset);
@@ -1673,21 +2404,16 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
             xbzrle_cache_zero_page(rs, block->offset + offset);
             XBZRLE_cache_unlock();
         }
+        multifd_page_sent_elsewhere(block, offset);
         ram_release_pages(block->idstr, offset, res);
         return res;
     }
 
-    /*
-     * Do not use multifd for:
-     * 1. Compression as the first page in the new block should be posted out
-     *    before sending the compressed page
-     * 2. In postcopy as one whole host page should be placed
-     */
-    if (!save_page_use_compression(rs) && migrate_use_multifd()
-        && !migration_in_postcopy()) {
+    if (use_multifd) {
         return ram_save_multifd_page(rs, block, offset);
     }
 
+    multifd_page_sent_elsewhere(block, offset);
     return ram_save_page(rs, pss, last_stage);
 }
 
@@ -1715,12 +2441,19 @@ static int ram_save_host_page(RAMState *rs, PageSearchStatus *pss,
     int tmppages, pages = 0;
     size_t pagesize_bits =
         qemu_ram_pagesize(pss->block) >> TARGET_PAGE_BITS;
+    unsigned long start_page = pss->page;
+    int res;
 
     if (ramblock_is_ignored(pss->block)) {
         error_report("block %s should not be migrated !", pss->block->idstr);
         return 0;
     }
 
+    pages = save_zero_extent(rs, pss);
+    if (pages) {
+        return pages;
+    }
+
     do {
         /* Check the pages is dirty and if it is send it */
         if (!migration_bitmap_clear_dirty(rs, pss->block, pss->page)) {
@@ -1743,7 +2476,60 @@ static int ram_save_host_page(RAMState *rs, PageSearchStatus *pss,
 
     /* The offset we leave with is the last one we looked at */
     pss->page--;
-    return pages;
+
+    res = ram_save_release_protection(rs, pss, start_page);
+    return (res < 0 ? res : pages);
+}
+
+/**
+ * postcopy_preempt_choose_channel: pick the channel of the next host page
+ *
+ * The pages that the destination waits for go on the postcopy-preempt
+ * channel, so that they don't queue behind the background pages on the
+ * main channel.
+ *
+ * @rs: current RAM state
+ * @preempt: whether the page goes on the preempt channel
+ */
+static void postcopy_preempt_choose_channel(RAMState *rs, bool preempt)
+{
+    MigrationState *s = migrate_get_current();
+    RAMBlock *block;
+
+    preempt = preempt && s->postcopy_qemufile_src;
+    if (preempt == rs->postcopy_preempt_active) {
+        return;
+    }
+
+    /* Each channel continues its own blocks */
+    block = rs->last_sent_block;
+    rs->last_sent_block = rs->other_last_sent_block;
+    rs->other_last_sent_block = block;
+
+    rs->f = preempt ? s->postcopy_qemufile_src : s->to_dst_file;
+    rs->postcopy_preempt_active = preempt;
+}
+
+/**
+ * postcopy_preempt_send_done: push out a host page of the preempt channel
+ *
+ * Returns 0 for success or a negative errno value
+ *
+ * @rs: current RAM state
+ */
+static int postcopy_preempt_send_done(RAMState *rs)
+{
+    MigrationState *s = migrate_get_current();
+    int ret;
+
+    qemu_fflush(rs->f);
+    ret = qemu_file_get_error(rs->f);
+    postcopy_preempt_choose_channel(rs, false);
+    if (ret) {
+        /* Pause postcopy, the main channel goes on after the recovery */
+        qemu_file_set_error(s->to_dst_file, ret);
+    }
+    return ret;
 }
 
 /**
@@ -1781,17 +2567,46 @@ static int ram_find_and_save_block(RAMState *rs, bool last_stage)
     }
 
     do {
+        bool urgent;
+
         again = true;
         found = get_queued_page(rs, &pss);
+        urgent = found && migration_in_postcopy();
 
         if (!found) {
             /* priority queue empty, so just search for something dirty */
             found = find_dirty_block(rs, &pss, &again);
         }
 
+        if (found && migrate_postcopy_preempt() && migration_in_postcopy()) {
+            bool preempt = urgent || (pss.block == rs->fault_around_block &&
+                                      pss.page < rs->fault_around_end);
+
+            postcopy_preempt_choose_channel(rs, preempt);
+        }
+
         if (found) {
             pages = ram_save_host_page(rs, &pss, last_stage);
         }
+
+        if (urgent) {
+            size_t pagesize_bits =
+                qemu_ram_pagesize(pss.block) >> TARGET_PAGE_BITS;
+
+            /* pss.page is the last page of the host page that was sent */
+            rs->fault_around_block = pss.block;
+            rs->fault_around_end = pss.page + 1 +
+                                   migrate_postcopy_fault_around() *
+                                   pagesize_bits;
+        }
+
+        if (rs->postcopy_preempt_active) {
+            int ret = postcopy_preempt_send_done(rs);
+
+            if (ret < 0 && pages >= 0) {
+                pages = ret;
+            }
+        }
     } while (!pages && again);
 
     rs->last_seen_block = pss.block;
@@ -1852,6 +2667,13 @@ static void ram_state_cleanup(RAMState **rsp)
 {
     if (*rsp) {
         migration_page_queue_free(*rsp);
+        if ((*rsp)->pagemap_fd >= 0) {
+            close((*rsp)->pagemap_fd);
+        }
+        g_free((*rsp)->pagemap_buf);
+        g_free((*rsp)->vcpu_dirty_pages_prev);
+        g_free((*rsp)->vcpu_dirty_pages_period);
+        g_free((*rsp)->iter_multifd_bytes);
         qemu_mutex_destroy(&(*rsp)->bitmap_mutex);
         qemu_mutex_destroy(&(*rsp)->src_page_req_mutex);
         g_free(*rsp);
@@ -1880,20 +2702,33 @@ static void ram_save_cleanup(void *opaque)
     RAMState **rsp = opaque;
     RAMBlock *block;
 
-    /* caller have hold iothread lock or is in a bh, so there is
-     * no writing race against the migration bitmap
-     */
-    memory_global_dirty_log_stop();
+    if (migrate_background_snapshot()) {
+        /* Background snapshot doesn't use the dirty log */
+        ram_write_tracking_stop();
+    } else {
+        /* caller have hold iothread lock or is in a bh, so there is
+         * no writing race against the migration bitmap
+         */
+        memory_global_dirty_log_stop();
+    }
 
     RAMBLOCK_FOREACH_NOT_IGNORED(block) {
         g_free(block->clear_bmap);
         block->clear_bmap = NULL;
         g_free(block->bmap);
         block->bmap = NULL;
+        g_free(block->multifd_owner);
+        block->multifd_owner = NULL;
+        g_free(block->free_bmap);
+        block->free_bmap = NULL;
+        g_free(block->file_bmap);
+        block->file_bmap = NULL;
     }
 
+    mapped_ram_cleanup();
     xbzrle_cleanup();
     compress_threads_save_cleanup();
+    bitmap_sync_threads_cleanup();
     ram_state_cleanup(rsp);
 }
 
@@ -1901,6 +2736,8 @@ static void ram_state_reset(RAMState *rs)
 {
     rs->last_seen_block = NULL;
     rs->last_sent_block = NULL;
+    rs->other_last_sent_block = NULL;
+    rs->fault_around_block = NULL;
     rs->last_page = 0;
     rs->last_version = ram_list.version;
     rs->ram_bulk_stage = true;
@@ -2156,8 +2993,13 @@ int ram_postcopy_send_discard_bitmap(MigrationState *ms)
 
     RCU_READ_LOCK_GUARD();
 
-    /* This should be our last sync, the src is now paused */
-    migration_bitmap_sync(rs);
+    /*
+     * This should be our last sync, the src is now paused.  Free page
+     * hints have to be stopped for it like for the precopy ones: a late
+     * hint could otherwise clear a page that the guest dirtied before
+     * it stopped.
+     */
+    migration_bitmap_sync_precopy(rs);
 
     /* Easiest way to make sure we don't resume in the middle of a host-page */
     rs->last_seen_block = NULL;
@@ -2285,6 +3127,23 @@ static int ram_state_init(RAMState **rsp)
     qemu_mutex_init(&(*rsp)->src_page_req_mutex);
     QSIMPLEQ_INIT(&(*rsp)->src_page_requests);
 
+    (*rsp)->pagemap_fd = -1;
+    (*rsp)->uffdio_fd = -1;
+#ifdef CONFIG_LINUX
+    if (migrate_zero_extents()) {
+        (*rsp)->pagemap_fd = qemu_open_old("/proc/self/pagemap", O_RDONLY);
+        if ((*rsp)->pagemap_fd < 0) {
+            warn_report("Cannot open /proc/self/pagemap, zero extents "
+                        "are disabled: %s", strerror(errno));
+        } else {
+            (*rsp)->pagemap_buf_len =
+                ZERO_EXTENT_MAX_PAGES * TARGET_PAGE_SIZE /
+                qemu_real_host_page_size + 2;
+            (*rsp)->pagemap_buf = g_new(uint64_t, (*rsp)->pagemap_buf_len);
+        }
+    }
+#endif
+
     /*
      * Count the total number of pages used by ram blocks not including any
      * gaps due to alignment or unplugs.
@@ -2331,6 +3190,13 @@ static void ram_list_init_bitmaps(void)
             bitmap_set(block->bmap, 0, pages);
             block->clear_bmap_shift = shift;
             block->clear_bmap = bitmap_new(clear_bmap_size(pages, shift));
+            if (migrate_use_multifd() &&
+                migrate_multifd_compression() == MULTIFD_COMPRESSION_XBZRLE) {
+                block->multifd_owner = g_new0(uint8_t, pages);
+            }
+            if (migrate_use_multifd()) {
+                block->free_bmap = bitmap_new(pages);
+            }
         }
     }
 }
@@ -2343,8 +3209,14 @@ static void ram_init_bitmaps(RAMState *rs)
 
     WITH_RCU_READ_LOCK_GUARD() {
         ram_list_init_bitmaps();
-        memory_global_dirty_log_start();
-        migration_bitmap_sync_precopy(rs);
+        /*
+         * Background snapshot sends every page exactly once, catching
+         * writes with UFFD write protection instead of the dirty log.
+         */
+        if (!migrate_background_snapshot()) {
+            memory_global_dirty_log_start();
+            migration_bitmap_sync_precopy(rs);
+        }
     }
     qemu_mutex_unlock_ramlist();
     qemu_mutex_unlock_iothread();
@@ -2397,6 +3269,9 @@ static void ram_state_resume_prepare(RAMState *rs, QEMUFile *out)
 
     /* Update RAMState cache of output QEMUFile */
     rs->f = out;
+    rs->postcopy_preempt_active = false;
+    rs->other_last_sent_block = NULL;
+    rs->fault_around_block = NULL;
 
     trace_ram_state_resume_prepare(pages);
 }
@@ -2414,8 +3289,12 @@ void qemu_guest_free_page_hint(void *addr, size_t len)
     size_t used_len, start, npages;
     MigrationState *s = migrate_get_current();
 
-    /* This function is currently expected to be used during live migration */
-    if (!migration_is_setup_or_active(s->state)) {
+    /*
+     * This function is currently expected to be used during live migration.
+     * Once in postcopy, the bitmap lists the pages the destination needs
+     * and doesn't have; hints must not remove any.
+     */
+    if (!migration_is_setup_or_active(s->state) || migration_in_postcopy()) {
         return;
     }
 
@@ -2444,6 +3323,10 @@ void qemu_guest_free_page_hint(void *addr, size_t len)
         ram_state->migration_dirty_pages -=
                       bitmap_count_one_with_offset(block->bmap, start, npages);
         bitmap_clear(block->bmap, start, npages);
+        /* Also catch the pages that are queued on multifd channels */
+        if (block->free_bmap) {
+            bitmap_set(block->free_bmap, start, npages);
+        }
         qemu_mutex_unlock(&ram_state->bitmap_mutex);
     }
 }
@@ -2471,16 +3354,27 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     if (compress_threads_save_setup()) {
         return -1;
     }
+    bitmap_sync_threads_setup();
 
     /* migration has already setup the bitmap, reuse it. */
     if (!migration_in_colo_state()) {
         if (ram_init_all(rsp) != 0) {
             compress_threads_save_cleanup();
+            bitmap_sync_threads_cleanup();
             return -1;
         }
     }
     (*rsp)->f = f;
 
+    if (migrate_mapped_ram()) {
+        Error *local_err = NULL;
+
+        if (mapped_ram_setup(false, &local_err)) {
+            error_report_err(local_err);
+            return -1;
+        }
+    }
+
     WITH_RCU_READ_LOCK_GUARD() {
         qemu_put_be64(f, ram_bytes_total_common(true) | RAM_SAVE_FLAG_MEM_SIZE);
 
@@ -2495,6 +3389,14 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
             if (migrate_ignore_shared()) {
                 qemu_put_be64(f, block->mr->addr);
             }
+            if (migrate_mapped_ram()) {
+                int ret = mapped_ram_save_block_header(f, block);
+
+                if (ret < 0) {
+                    qemu_file_set_error(f, ret);
+                    return ret;
+                }
+            }
         }
     }
 
@@ -2657,9 +3559,31 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
 
         flush_compressed_data(rs);
         ram_control_after_iterate(f, RAM_CONTROL_FINISH);
+
+        if (ret >= 0 && migrate_mapped_ram()) {
+            RAMBlock *block;
+
+            ret = ram_mapped_flush(rs);
+            RAMBLOCK_FOREACH_MIGRATABLE(block) {
+                if (ret < 0) {
+                    break;
+                }
+                ret = mapped_ram_save_bitmap(block);
+            }
+            if (ret < 0) {
+                qemu_file_set_error(f, ret);
+            }
+        }
     }
 
     if (ret >= 0) {
+        MigrationState *s = migrate_get_current();
+
+        /* Let the preempt thread of the destination finish */
+        if (migration_in_postcopy() && s->postcopy_qemufile_src) {
+            qemu_put_be64(s->postcopy_qemufile_src, RAM_SAVE_FLAG_EOS);
+            qemu_fflush(s->postcopy_qemufile_src);
+        }
         multifd_send_sync_main(rs->f);
         qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
         qemu_fflush(f);
@@ -2738,12 +3662,16 @@ static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
  *
  * Returns a pointer from within the RCU-protected ram_list.
  *
+ * @mis: the migration incoming state pointer
  * @f: QEMUFile where to read the data from
  * @flags: Page flags (mostly to see if it's a continuation of previous block)
+ * @channel: the channel of @f
  */
-static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags)
+static inline RAMBlock *ram_block_from_stream(MigrationIncomingState *mis,
+                                              QEMUFile *f, int flags,
+                                              int channel)
 {
-    static RAMBlock *block;
+    RAMBlock *block = mis->last_recv_block[channel];
     char id[256];
     uint8_t len;
 
@@ -2760,6 +3688,7 @@ static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags)
     id[len] = 0;
 
     block = qemu_ram_block_by_name(id);
+    mis->last_recv_block[channel] = block;
     if (!block) {
         error_report("Can't find block %s", id);
         return NULL;
@@ -2800,13 +3729,28 @@ static inline void *colo_cache_from_block_offset(RAMBlock *block,
     * It help us to decide which pages in ram cache should be flushed
     * into VM's RAM later.
     */
-    if (record_bitmap &&
-        !test_and_set_bit(offset >> TARGET_PAGE_BITS, block->bmap)) {
-        ram_state->migration_dirty_pages++;
+    if (record_bitmap) {
+        colo_record_cached_page(block, offset);
     }
     return block->colo_cache + offset;
 }
 
+/*
+ * Record that the page at @offset of @block was loaded into the COLO cache,
+ * so that colo_flush_ram_cache() copies it to the SVM's memory.  The
+ * multifd receive threads call this concurrently with the main thread.
+ */
+void colo_record_cached_page(RAMBlock *block, ram_addr_t offset)
+{
+    unsigned long nr = offset >> TARGET_PAGE_BITS;
+    unsigned long mask = BIT_MASK(nr);
+
+    if (!(qatomic_fetch_or(&block->bmap[BIT_WORD(nr)], mask) & mask)) {
+        QEMU_LOCK_GUARD(&ram_state->bitmap_mutex);
+        ram_state->migration_dirty_pages++;
+    }
+}
+
 /**
  * ram_handle_compressed: handle the zero page case
  *
@@ -2824,6 +3768,30 @@ void ram_handle_compressed(void *host, uint8_t ch, uint64_t size)
     }
 }
 
+/*
+ * ram_handle_zero_range: load a run of zero pages
+ *
+ * Pages that already read as zero are left alone, so that they are not
+ * populated just to be cleared.
+ *
+ * @block: block that contains the pages
+ * @host: host address of the first page
+ * @npages: number of target pages
+ */
+static void ram_handle_zero_range(RAMBlock *block, void *host,
+                                  uint64_t npages)
+{
+    uint64_t i;
+
+    for (i = 0; i < npages; i++) {
+        ram_handle_compressed((uint8_t *)host + (i << TARGET_PAGE_BITS), 0,
+                              TARGET_PAGE_SIZE);
+    }
+    if (!migration_incoming_in_colo_state()) {
+        ramblock_recv_bitmap_set_range(block, host, npages);
+    }
+}
+
 /* return the size after decompression, or negative value on error */
 static int
 qemu_uncompress_data(z_stream *stream, uint8_t *dest, size_t dest_len,
@@ -3131,6 +4099,15 @@ static int ram_load_setup(QEMUFile *f, void *opaque)
     xbzrle_load_setup();
     ramblock_recv_map_init();
 
+    if (migrate_mapped_ram()) {
+        Error *local_err = NULL;
+
+        if (mapped_ram_setup(true, &local_err)) {
+            error_report_err(local_err);
+            return -1;
+        }
+    }
+
     return 0;
 }
 
@@ -3144,6 +4121,7 @@ static int ram_load_cleanup(void *opaque)
 
     xbzrle_load_cleanup();
     compress_threads_load_cleanup();
+    mapped_ram_cleanup();
 
     RAMBLOCK_FOREACH_NOT_IGNORED(rb) {
         g_free(rb->receivedmap);
@@ -3174,21 +4152,24 @@ int ram_postcopy_incoming_init(MigrationIncomingState *mis)
  *
  * Returns 0 for success or -errno in case of error
  *
- * Called in postcopy mode by ram_load().
+ * Called in postcopy mode by ram_load(), and by the postcopy-preempt
+ * thread for its channel.
  * rcu_read_lock is taken prior to this being called.
  *
  * @f: QEMUFile where to send the data
+ * @channel: the channel of @f
  */
-static int ram_load_postcopy(QEMUFile *f)
+int ram_load_postcopy(QEMUFile *f, int channel)
 {
     int flags = 0, ret = 0;
     bool place_needed = false;
     bool matches_target_page_size = false;
     MigrationIncomingState *mis = migration_incoming_get_current();
     /* Temporary page that is later 'placed' */
-    void *postcopy_host_page = mis->postcopy_tmp_page;
+    void *postcopy_host_page = mis->postcopy_tmp_pages[channel];
     void *this_host = NULL;
     bool all_zero = true;
+    bool mirrored = false;
     int target_pages = 0;
 
     while (!ret && !(flags & RAM_SAVE_FLAG_EOS)) {
@@ -3217,7 +4198,7 @@ static int ram_load_postcopy(QEMUFile *f)
         trace_ram_load_postcopy_loop((uint64_t)addr, flags);
         if (flags & (RAM_SAVE_FLAG_ZERO | RAM_SAVE_FLAG_PAGE |
                      RAM_SAVE_FLAG_COMPRESS_PAGE)) {
-            block = ram_block_from_stream(f, flags);
+            block = ram_block_from_stream(mis, f, flags, channel);
 
             host = host_from_ram_block_offset(block, addr);
             if (!host) {
@@ -3236,12 +4217,17 @@ static int ram_load_postcopy(QEMUFile *f)
              * The migration protocol uses,  possibly smaller, target-pages
              * however the source ensures it always sends all the components
              * of a host page in one chunk.
+             * With postcopy-minor-faults the page cache of shared memory
+             * plays that role: the data is written through a mirror mapping
+             * and the guest only sees it once it is placed.  A page that
+             * was already placed may have been changed by the guest and
+             * must not be written that way.
              */
-            page_buffer = postcopy_host_page +
-                          ((uintptr_t)host & (block->page_size - 1));
             if (target_pages == 1) {
                 this_host = (void *)QEMU_ALIGN_DOWN((uintptr_t)host,
                                                     block->page_size);
+                mirrored = block->host_mirror &&
+                           !ramblock_recv_bitmap_test(block, this_host);
             } else {
                 /* not the 1st TP within the HP */
                 if (QEMU_ALIGN_DOWN((uintptr_t)host, block->page_size) !=
@@ -3252,6 +4238,12 @@ static int ram_load_postcopy(QEMUFile *f)
                     break;
                 }
             }
+            if (mirrored) {
+                page_buffer = block->host_mirror + ((uint8_t *)host - block->host);
+            } else {
+                page_buffer = postcopy_host_page +
+                              ((uintptr_t)host & (block->page_size - 1));
+            }
 
             /*
              * If it's the last part of a host page then we place the host
@@ -3270,7 +4262,7 @@ static int ram_load_postcopy(QEMUFile *f)
              * Can skip to set page_buffer when
              * this is a zero page and (block->page_size == TARGET_PAGE_SIZE).
              */
-            if (ch || !matches_target_page_size) {
+            if (ch || !matches_target_page_size || mirrored) {
                 memset(page_buffer, ch, TARGET_PAGE_SIZE);
             }
             if (ch) {
@@ -3280,8 +4272,8 @@ static int ram_load_postcopy(QEMUFile *f)
 
         case RAM_SAVE_FLAG_PAGE:
             all_zero = false;
-            if (!matches_target_page_size) {
-                /* For huge pages, we always use temporary buffer */
+            if (!matches_target_page_size || mirrored) {
+                /* For huge pages and mirrors, we always copy the data */
                 qemu_get_buffer(f, page_buffer, TARGET_PAGE_SIZE);
             } else {
                 /*
@@ -3333,7 +4325,9 @@ static int ram_load_postcopy(QEMUFile *f)
             void *place_dest = (void *)QEMU_ALIGN_DOWN((uintptr_t)host,
                                                        block->page_size);
 
-            if (all_zero) {
+            if (mirrored) {
+                ret = postcopy_place_page_continue(mis, place_dest, block);
+            } else if (all_zero) {
                 ret = postcopy_place_page_zero(mis, place_dest,
                                                block);
             } else {
@@ -3416,6 +4410,7 @@ void colo_flush_ram_cache(void)
  */
 static int ram_load_precopy(QEMUFile *f)
 {
+    MigrationIncomingState *mis = migration_incoming_get_current();
     int flags = 0, ret = 0, invalid_flags = 0, len = 0, i = 0;
     /* ADVISE is earlier, it shows the source has the postcopy capability on */
     bool postcopy_advised = postcopy_is_advised();
@@ -3426,6 +4421,8 @@ static int ram_load_precopy(QEMUFile *f)
     while (!ret && !(flags & RAM_SAVE_FLAG_EOS)) {
         ram_addr_t addr, total_ram_bytes;
         void *host = NULL, *host_bak = NULL;
+        RAMBlock *page_block = NULL;
+        uint64_t npages;
         uint8_t ch;
 
         /*
@@ -3453,9 +4450,12 @@ static int ram_load_precopy(QEMUFile *f)
         }
 
         if (flags & (RAM_SAVE_FLAG_ZERO | RAM_SAVE_FLAG_PAGE |
-                     RAM_SAVE_FLAG_COMPRESS_PAGE | RAM_SAVE_FLAG_XBZRLE)) {
-            RAMBlock *block = ram_block_from_stream(f, flags);
+                     RAM_SAVE_FLAG_COMPRESS_PAGE | RAM_SAVE_FLAG_XBZRLE |
+                     RAM_SAVE_FLAG_ZERO_RANGE)) {
+            RAMBlock *block = ram_block_from_stream(mis, f, flags,
+                                                    RAM_CHANNEL_PRECOPY);
 
+            page_block = block;
             host = host_from_ram_block_offset(block, addr);
             /*
              * After going into COLO stage, we should not load the page
@@ -3543,6 +4543,14 @@ static int ram_load_precopy(QEMUFile *f)
                             ret = -EINVAL;
                         }
                     }
+                    if (!ret && migrate_mapped_ram()) {
+                        Error *local_err = NULL;
+
+                        if (mapped_ram_load_block(f, block, &local_err)) {
+                            error_report_err(local_err);
+                            ret = -EINVAL;
+                        }
+                    }
                     ram_control_load_hook(f, RAM_CONTROL_BLOCK_REG,
                                           block->idstr);
                 } else {
@@ -3564,6 +4572,24 @@ static int ram_load_precopy(QEMUFile *f)
             qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
             break;
 
+        case RAM_SAVE_FLAG_ZERO_RANGE:
+            npages = qemu_get_be64(f);
+            if (!npages || npages > ZERO_EXTENT_MAX_PAGES ||
+                !offset_in_ramblock(page_block,
+                                    addr + (npages << TARGET_PAGE_BITS) - 1)) {
+                error_report("Invalid zero range of %" PRIu64 " pages at "
+                             RAM_ADDR_FMT, npages, addr);
+                ret = -EINVAL;
+                break;
+            }
+            if (host_bak) {
+                error_report("Zero ranges are not supported with COLO");
+                ret = -EINVAL;
+                break;
+            }
+            ram_handle_zero_range(page_block, host, npages);
+            break;
+
         case RAM_SAVE_FLAG_COMPRESS_PAGE:
             len = qemu_get_be32(f);
             if (len < 0 || len > compressBound(TARGET_PAGE_SIZE)) {
@@ -3631,7 +4657,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
      */
     WITH_RCU_READ_LOCK_GUARD() {
         if (postcopy_running) {
-            ret = ram_load_postcopy(f);
+            ret = ram_load_postcopy(f, RAM_CHANNEL_PRECOPY);
         } else {
             ret = ram_load_precopy(f);
         }
@@ -3788,6 +4814,217 @@ static int ram_resume_prepare(MigrationState *s, void *opaque)
     return 0;
 }
 
+#ifdef CONFIG_LINUX
+/* Read-only and MMIO-writable regions are not write tracked */
+static bool ram_block_is_write_tracked(RAMBlock *block)
+{
+    return !block->mr->readonly && !block->mr->rom_device;
+}
+
+/*
+ * ram_block_populate_pages: populate memory in the RAM block by reading
+ *   a byte from the beginning of each host page.
+ *
+ * UFFDIO_WRITEPROTECT silently skips pages that are not mapped yet, so
+ * the first write to those would go unnoticed.
+ */
+static void ram_block_populate_pages(RAMBlock *block)
+{
+    char *ptr = (char *) block->host;
+    ram_addr_t offset;
+
+    for (offset = 0; offset < block->used_length;
+         offset += qemu_ram_pagesize(block)) {
+        char tmp = *(ptr + offset);
+
+        /* Don't optimize the read out */
+        asm volatile("" : "+r" (tmp));
+    }
+}
+
+/**
+ * ram_write_tracking_available: check if kernel supports required UFFD
+ *   features
+ *
+ * Returns true if supports, false otherwise
+ */
+bool ram_write_tracking_available(void)
+{
+    uint64_t uffd_features;
+    int res;
+
+    res = uffd_query_features(&uffd_features);
+    return (res == 0 &&
+            (uffd_features & UFFD_FEATURE_PAGEFAULT_FLAG_WP) != 0);
+}
+
+/**
+ * ram_write_tracking_compatible: check if guest configuration is
+ *   compatible with write tracking
+ *
+ * Returns true if compatible, false otherwise
+ */
+bool ram_write_tracking_compatible(void)
+{
+    const uint64_t uffd_ioctls_mask = BIT(_UFFDIO_WRITEPROTECT);
+    int uffd_fd;
+    RAMBlock *block;
+    bool ret = false;
+
+    /* Open UFFD file descriptor */
+    uffd_fd = uffd_create_fd(UFFD_FEATURE_PAGEFAULT_FLAG_WP, false);
+    if (uffd_fd < 0) {
+        return false;
+    }
+
+    RCU_READ_LOCK_GUARD();
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        uint64_t uffd_ioctls;
+
+        if (!ram_block_is_write_tracked(block)) {
+            continue;
+        }
+        /* Try to register block memory via UFFD-IO to track writes */
+        if (uffd_register_memory(uffd_fd, block->host, block->max_length,
+                                 UFFDIO_REGISTER_MODE_WP, &uffd_ioctls)) {
+            goto out;
+        }
+        if ((uffd_ioctls & uffd_ioctls_mask) != uffd_ioctls_mask) {
+            goto out;
+        }
+    }
+    ret = true;
+
+out:
+    uffd_close_fd(uffd_fd);
+    return ret;
+}
+
+/**
+ * ram_write_tracking_start: start UFFD write protection of guest memory
+ *
+ * Must be called with the VM stopped, after the migration setup.
+ *
+ * Returns 0 for success or negative value in case of error
+ */
+int ram_write_tracking_start(void)
+{
+    int uffd_fd;
+    RAMState *rs = ram_state;
+    RAMBlock *block;
+
+    if (!rs) {
+        return -1;
+    }
+
+    /* Open UFFD file descriptor */
+    uffd_fd = uffd_create_fd(UFFD_FEATURE_PAGEFAULT_FLAG_WP, true);
+    if (uffd_fd < 0) {
+        return uffd_fd;
+    }
+    rs->uffdio_fd = uffd_fd;
+
+    RCU_READ_LOCK_GUARD();
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        if (!ram_block_is_write_tracked(block)) {
+            continue;
+        }
+
+        ram_block_populate_pages(block);
+
+        /* Register block memory with UFFD to track writes */
+        if (uffd_register_memory(rs->uffdio_fd, block->host,
+                                 block->max_length, UFFDIO_REGISTER_MODE_WP,
+                                 NULL)) {
+            goto fail;
+        }
+        /* Apply UFFD write protection to the block memory range */
+        if (uffd_change_protection(rs->uffdio_fd, block->host,
+                                   block->max_length, true, false)) {
+            uffd_unregister_memory(rs->uffdio_fd, block->host,
+                                   block->max_length);
+            goto fail;
+        }
+        block->flags |= RAM_UF_WRITEPROTECT;
+        memory_region_ref(block->mr);
+
+        trace_ram_write_tracking_ramblock_start(block->idstr,
+                                                block->page_size, block->host,
+                                                block->max_length);
+    }
+
+    return 0;
+
+fail:
+    error_report("ram_write_tracking_start() failed: "
+                 "restoring initial memory state");
+    ram_write_tracking_stop();
+    return -1;
+}
+
+/**
+ * ram_write_tracking_stop: stop UFFD write protection of guest memory
+ *
+ * Wakes up the threads that wait for a write fault to be resolved.  It is
+ * fine to call it more than once.
+ */
+void ram_write_tracking_stop(void)
+{
+    RAMState *rs = ram_state;
+    RAMBlock *block;
+
+    if (!rs || rs->uffdio_fd < 0) {
+        return;
+    }
+
+    RCU_READ_LOCK_GUARD();
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        if ((block->flags & RAM_UF_WRITEPROTECT) == 0) {
+            continue;
+        }
+        /* Remove protection and unregister all affected RAM blocks */
+        uffd_change_protection(rs->uffdio_fd, block->host, block->max_length,
+                               false, false);
+        uffd_unregister_memory(rs->uffdio_fd, block->host, block->max_length);
+
+        trace_ram_write_tracking_ramblock_stop(block->idstr, block->page_size,
+                                               block->host, block->max_length);
+
+        /* Cleanup flags and remove reference */
+        block->flags &= ~RAM_UF_WRITEPROTECT;
+        memory_region_unref(block->mr);
+    }
+
+    /* Finally close UFFD file descriptor */
+    uffd_close_fd(rs->uffdio_fd);
+    rs->uffdio_fd = -1;
+}
+#else
+/* No target OS support, stubs just fail or ignore */
+
+bool ram_write_tracking_available(void)
+{
+    return false;
+}
+
+bool ram_write_tracking_compatible(void)
+{
+    return false;
+}
+
+int ram_write_tracking_start(void)
+{
+    return -1;
+}
+
+void ram_write_tracking_stop(void)
+{
+}
+#endif
+
 static SaveVMHandlers savevm_ram_handlers = {
     .save_setup = ram_save_setup,
     .save_live_iterate = ram_save_iterate,
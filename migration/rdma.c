@@ -56,6 +56,12 @@
 
 #define RDMA_REG_CHUNK_SHIFT 20 /* 1 MB */
 
+/*
+ * With dynamic registration, how many of the chunks that follow an
+ * unregistered one get registered by the same request.
+ */
+#define RDMA_REG_AHEAD_CHUNKS 32
+
 /*
  * This is only for non-live state being migrated.
  * Instead of RDMA_WRITE messages, we use RDMA_SEND
@@ -75,12 +81,15 @@
  * Capabilities for negotiation.
  */
 #define RDMA_CAPABILITY_PIN_ALL 0x01
+/* The dest answers every registration of a multi-chunk REGISTER_REQUEST */
+#define RDMA_CAPABILITY_REG_AHEAD 0x02
 
 /*
  * Add the other flags above to this list of known capabilities
  * as they are introduced.
  */
-static uint32_t known_capabilities = RDMA_CAPABILITY_PIN_ALL;
+static uint32_t known_capabilities = RDMA_CAPABILITY_PIN_ALL |
+                                     RDMA_CAPABILITY_REG_AHEAD;
 
 #define CHECK_ERROR_STATE() \
     do { \
@@ -341,6 +350,8 @@ typedef struct RDMAContext {
     int current_chunk;
 
     bool pin_all;
+    /* registration requests include chunks ahead of the one being written */
+    bool reg_ahead;
 
     /*
      * infiniband-specific variables for opening the device
@@ -1962,6 +1973,43 @@ static int qemu_rdma_exchange_recv(RDMAContext *rdma, RDMAControlHeader *head,
     return 0;
 }
 
+/*
+ * Every registration request is a round trip to the dest, during which
+ * the fabric sits idle.  RAM is sent in address order, so the chunks that
+ * follow @chunk in a RAMBlock are likely to be written soon: fill @reg with
+ * registrations for the ones among the next RDMA_REG_AHEAD_CHUNKS that
+ * aren't registered yet, to be sent in the same request.  Chunks that are
+ * zero right now are left out, as unregistered zero chunks are sent with
+ * a compress command instead.
+ *
+ * Returns the number of registrations added.
+ */
+static int qemu_rdma_register_ahead(RDMALocalBlock *block, uint64_t chunk,
+                                    RDMARegister *reg, uint64_t *reg_chunk)
+{
+    uint64_t last = MIN(chunk + RDMA_REG_AHEAD_CHUNKS, block->nb_chunks - 1);
+    int nb_regs = 0;
+
+    for (chunk++; chunk <= last; chunk++) {
+        uint8_t *chunk_start = ram_chunk_start(block, chunk);
+        uint8_t *chunk_end = ram_chunk_end(block, chunk);
+
+        if (block->remote_keys[chunk] ||
+            buffer_is_zero(chunk_start, chunk_end - chunk_start)) {
+            continue;
+        }
+
+        reg[nb_regs].current_index = block->index;
+        reg[nb_regs].key.current_addr = block->offset +
+                                        (chunk_start - block->local_host_addr);
+        reg[nb_regs].chunks = 0;
+        reg_chunk[nb_regs] = chunk;
+        nb_regs++;
+    }
+
+    return nb_regs;
+}
+
 /*
  * Write an actual chunk of memory using RDMA.
  *
@@ -1976,10 +2024,12 @@ static int qemu_rdma_write_one(QEMUFile *f, RDMAContext *rdma,
     struct ibv_send_wr send_wr = { 0 };
     struct ibv_send_wr *bad_wr;
     int reg_result_idx, ret, count = 0;
+    int i, nb_regs;
     uint64_t chunk, chunks;
     uint8_t *chunk_start, *chunk_end;
     RDMALocalBlock *block = &(rdma->local_ram_blocks.block[current_index]);
-    RDMARegister reg;
+    RDMARegister reg[1 + RDMA_REG_AHEAD_CHUNKS];
+    uint64_t reg_chunk[1 + RDMA_REG_AHEAD_CHUNKS];
     RDMARegisterResult *reg_result;
     RDMAControlHeader resp = { .type = RDMA_CONTROL_REGISTER_RESULT };
     RDMAControlHeader head = { .len = sizeof(RDMARegister),
@@ -2076,19 +2126,31 @@ retry:
             /*
              * Otherwise, tell other side to register.
              */
-            reg.current_index = current_index;
+            reg[0].current_index = current_index;
             if (block->is_ram_block) {
-                reg.key.current_addr = current_addr;
+                reg[0].key.current_addr = current_addr;
             } else {
-                reg.key.chunk = chunk;
+                reg[0].key.chunk = chunk;
             }
-            reg.chunks = chunks;
+            reg[0].chunks = chunks;
+            reg_chunk[0] = chunk;
+            nb_regs = 1;
 
             trace_qemu_rdma_write_one_sendreg(chunk, sge.length, current_index,
                                               current_addr);
 
-            register_to_network(rdma, &reg);
-            ret = qemu_rdma_exchange_send(rdma, &head, (uint8_t *) &reg,
+            if (block->is_ram_block && rdma->reg_ahead) {
+                nb_regs += qemu_rdma_register_ahead(block, chunk + chunks,
+                                                    &reg[1], &reg_chunk[1]);
+                trace_qemu_rdma_write_one_sendreg_ahead(nb_regs - 1);
+            }
+
+            for (i = 0; i < nb_regs; i++) {
+                register_to_network(rdma, &reg[i]);
+            }
+            head.len = nb_regs * sizeof(RDMARegister);
+            head.repeat = nb_regs;
+            ret = qemu_rdma_exchange_send(rdma, &head, (uint8_t *) reg,
                                     &resp, &reg_result_idx, NULL);
             if (ret < 0) {
                 return ret;
@@ -2105,12 +2167,15 @@ retry:
             reg_result = (RDMARegisterResult *)
                     rdma->wr_data[reg_result_idx].control_curr;
 
-            network_to_result(reg_result);
+            for (i = 0; i < nb_regs; i++) {
+                network_to_result(&reg_result[i]);
 
-            trace_qemu_rdma_write_one_recvregres(block->remote_keys[chunk],
-                                                 reg_result->rkey, chunk);
+                trace_qemu_rdma_write_one_recvregres(
+                        block->remote_keys[reg_chunk[i]], reg_result[i].rkey,
+                        reg_chunk[i]);
 
-            block->remote_keys[chunk] = reg_result->rkey;
+                block->remote_keys[reg_chunk[i]] = reg_result[i].rkey;
+            }
             block->remote_host_addr = reg_result->host_addr;
         } else {
             /* already registered before */
@@ -2477,6 +2542,7 @@ static int qemu_rdma_connect(RDMAContext *rdma, Error **errp)
         trace_qemu_rdma_connect_pin_all_requested();
         cap.flags |= RDMA_CAPABILITY_PIN_ALL;
     }
+    cap.flags |= RDMA_CAPABILITY_REG_AHEAD;
 
     caps_to_network(&cap);
 
@@ -2521,6 +2587,8 @@ static int qemu_rdma_connect(RDMAContext *rdma, Error **errp)
                         "Will register memory dynamically.");
         rdma->pin_all = false;
     }
+    /* Older destinations only send back the first registration result */
+    rdma->reg_ahead = cap.flags & RDMA_CAPABILITY_REG_AHEAD;
 
     trace_qemu_rdma_connect_pin_all_outcome(rdma->pin_all);
 
@@ -3570,6 +3638,7 @@ static int qemu_rdma_registration_handle(QEMUFile *f, void *opaque)
             trace_qemu_rdma_registration_handle_register(head.repeat);
 
             reg_resp.repeat = head.repeat;
+            reg_resp.len = head.repeat * sizeof(RDMARegisterResult);
             registers = (RDMARegister *) rdma->wr_data[idx].control_curr;
 
             for (count = 0; count < head.repeat; count++) {
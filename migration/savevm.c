@@ -42,6 +42,7 @@
 #include "postcopy-ram.h"
 #include "qapi/error.h"
 #include "qapi/qapi-commands-migration.h"
+#include "qapi/util.h"
 #include "qapi/qmp/qerror.h"
 #include "qemu/error-report.h"
 #include "sysemu/cpus.h"
@@ -88,6 +89,10 @@ enum qemu_vm_cmd {
 };
 
 #define MAX_VM_CMD_PACKAGED_SIZE UINT32_MAX
+
+/* Number of sections reported by qemu_savevm_device_downtime() */
+#define SAVEVM_DEVICE_DOWNTIME_MAX 16
+
 static struct mig_cmd_args {
     ssize_t     len; /* -1 = variable */
     const char *name;
@@ -245,6 +250,8 @@ typedef struct SaveStateEntry {
     void *opaque;
     CompatEntry *compat;
     int is_ram;
+    /* time spent saving the section once the guest was stopped */
+    int64_t complete_time_us;
 } SaveStateEntry;
 
 typedef struct SaveState {
@@ -271,6 +278,9 @@ static bool should_validate_capability(int capability)
     /* Validate only new capabilities to keep compatibility. */
     switch (capability) {
     case MIGRATION_CAPABILITY_X_IGNORE_SHARED:
+    case MIGRATION_CAPABILITY_ZERO_EXTENTS:
+    case MIGRATION_CAPABILITY_MULTIFD_ZERO_PAGES:
+    case MIGRATION_CAPABILITY_DIRTY_BITMAPS_COMPACT:
         return true;
     default:
         return false;
@@ -915,7 +925,37 @@ static int vmstate_save(QEMUFile *f, SaveStateEntry *se, QJSON *vmdesc)
 }
 
 /*
- * Write the header for device section (QEMU_VM_SECTION START/END/PART/FULL)
+ * Save a section with its length ahead, so that the destination can read
+ * it in one go and load it in a worker thread.
+ */
+static int vmstate_save_sized(QEMUFile *f, SaveStateEntry *se, QJSON *vmdesc)
+{
+    QIOChannelBuffer *bioc;
+    QEMUFile *sf;
+    int ret;
+
+    bioc = qio_channel_buffer_new(4096);
+    qio_channel_set_name(QIO_CHANNEL(bioc), "migration-savevm-sized");
+    sf = qemu_fopen_channel_output(QIO_CHANNEL(bioc));
+    object_unref(OBJECT(bioc));
+
+    ret = vmstate_save(sf, se, vmdesc);
+    qemu_fflush(sf);
+    if (!ret) {
+        ret = qemu_file_get_error(sf);
+    }
+    if (!ret) {
+        qemu_put_be32(f, bioc->usage);
+        qemu_put_buffer(f, bioc->data, bioc->usage);
+    }
+    qemu_fclose(sf);
+
+    return ret;
+}
+
+/*
+ * Write the header for device section
+ * (QEMU_VM_SECTION START/END/PART/FULL/FULL_SIZED)
  */
 static void save_section_header(QEMUFile *f, SaveStateEntry *se,
                                 uint8_t section_type)
@@ -924,6 +964,7 @@ static void save_section_header(QEMUFile *f, SaveStateEntry *se,
     qemu_put_be32(f, se->section_id);
 
     if (section_type == QEMU_VM_SECTION_FULL ||
+        section_type == QEMU_VM_SECTION_FULL_SIZED ||
         section_type == QEMU_VM_SECTION_START) {
         /* ID string */
         size_t len = strlen(se->idstr);
@@ -1162,6 +1203,7 @@ void qemu_savevm_state_setup(QEMUFile *f)
 
     trace_savevm_state_setup();
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        se->complete_time_us = 0;
         if (!se->ops || !se->ops->save_setup) {
             continue;
         }
@@ -1321,6 +1363,7 @@ static
 int qemu_savevm_state_complete_precopy_iterable(QEMUFile *f, bool in_postcopy)
 {
     SaveStateEntry *se;
+    int64_t start;
     int ret;
 
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
@@ -1338,9 +1381,11 @@ int qemu_savevm_state_complete_precopy_iterable(QEMUFile *f, bool in_postcopy)
         }
         trace_savevm_section_start(se->idstr, se->section_id);
 
+        start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
         save_section_header(f, se, QEMU_VM_SECTION_END);
 
         ret = se->ops->save_live_complete_precopy(f, se->opaque);
+        se->complete_time_us += qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start;
         trace_savevm_section_end(se->idstr, se->section_id, ret);
         save_section_footer(f, se);
         if (ret < 0) {
@@ -1352,7 +1397,6 @@ int qemu_savevm_state_complete_precopy_iterable(QEMUFile *f, bool in_postcopy)
     return 0;
 }
 
-static
 int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
                                                     bool in_postcopy,
                                                     bool inactivate_disks)
@@ -1360,6 +1404,7 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
     g_autoptr(QJSON) vmdesc = NULL;
     int vmdesc_len;
     SaveStateEntry *se;
+    int64_t start;
     int ret;
 
     vmdesc = qjson_new();
@@ -1381,12 +1426,19 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
         json_prop_str(vmdesc, "name", se->idstr);
         json_prop_int(vmdesc, "instance_id", se->instance_id);
 
-        save_section_header(f, se, QEMU_VM_SECTION_FULL);
-        ret = vmstate_save(f, se, vmdesc);
+        start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+        if (se->vmsd && se->vmsd->parallel_load && migrate_parallel_load()) {
+            save_section_header(f, se, QEMU_VM_SECTION_FULL_SIZED);
+            ret = vmstate_save_sized(f, se, vmdesc);
+        } else {
+            save_section_header(f, se, QEMU_VM_SECTION_FULL);
+            ret = vmstate_save(f, se, vmdesc);
+        }
         if (ret) {
             qemu_file_set_error(f, ret);
             return ret;
         }
+        se->complete_time_us += qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start;
         trace_savevm_section_end(se->idstr, se->section_id, 0);
         save_section_footer(f, se);
 
@@ -1459,6 +1511,49 @@ flush:
     return 0;
 }
 
+static gint savevm_complete_time_cmp(gconstpointer a, gconstpointer b)
+{
+    const SaveStateEntry *se_a = *(SaveStateEntry * const *)a;
+    const SaveStateEntry *se_b = *(SaveStateEntry * const *)b;
+
+    if (se_a->complete_time_us == se_b->complete_time_us) {
+        return 0;
+    }
+    return se_a->complete_time_us < se_b->complete_time_us ? 1 : -1;
+}
+
+/*
+ * Report the sections that took the longest to save after the guest was
+ * stopped, most expensive first, so that the device contributing to the
+ * downtime can be identified.
+ */
+MigrationDeviceDowntimeList *qemu_savevm_device_downtime(void)
+{
+    g_autoptr(GPtrArray) entries = g_ptr_array_new();
+    MigrationDeviceDowntimeList *head = NULL;
+    SaveStateEntry *se;
+    int i;
+
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        if (se->complete_time_us > 0) {
+            g_ptr_array_add(entries, se);
+        }
+    }
+    g_ptr_array_sort(entries, savevm_complete_time_cmp);
+
+    for (i = MIN(entries->len, SAVEVM_DEVICE_DOWNTIME_MAX) - 1; i >= 0; i--) {
+        MigrationDeviceDowntime *value = g_new0(MigrationDeviceDowntime, 1);
+
+        se = g_ptr_array_index(entries, i);
+        value->name = g_strdup(se->idstr);
+        value->instance_id = se->instance_id;
+        value->time = se->complete_time_us;
+        QAPI_LIST_PREPEND(head, value);
+    }
+
+    return head;
+}
+
 /* Give an estimate of the amount left to be transferred,
  * the result is split into the amount for units that can and
  * for units that can't do postcopy.
@@ -2337,8 +2432,165 @@ static bool check_section_footer(QEMUFile *f, SaveStateEntry *se)
     return true;
 }
 
+/* A section loaded by a worker thread, waiting to be committed */
+typedef struct LoadvmParallelJob {
+    SaveStateEntry *se;
+    QEMUFile *f;
+    int version_id;
+    int ret;
+    bool done;
+    QSIMPLEQ_ENTRY(LoadvmParallelJob) next;
+} LoadvmParallelJob;
+
+/*
+ * Sections being loaded in parallel, owned by one qemu_loadvm_state_main()
+ * call; the nested one for packaged data has its own.
+ */
+typedef struct LoadvmParallel {
+    /* Created on the first section that can be loaded in parallel */
+    GThreadPool *pool;
+    /* Protects @done of the jobs */
+    QemuMutex lock;
+    QemuCond done_cond;
+    /* In stream order */
+    QSIMPLEQ_HEAD(, LoadvmParallelJob) jobs;
+} LoadvmParallel;
+
+static void qemu_loadvm_parallel_init(LoadvmParallel *lp)
+{
+    lp->pool = NULL;
+    qemu_mutex_init(&lp->lock);
+    qemu_cond_init(&lp->done_cond);
+    QSIMPLEQ_INIT(&lp->jobs);
+}
+
+static void qemu_loadvm_parallel_destroy(LoadvmParallel *lp)
+{
+    assert(QSIMPLEQ_EMPTY(&lp->jobs));
+    if (lp->pool) {
+        g_thread_pool_free(lp->pool, FALSE, TRUE);
+    }
+    qemu_cond_destroy(&lp->done_cond);
+    qemu_mutex_destroy(&lp->lock);
+}
+
+static void qemu_loadvm_parallel_worker(gpointer data, gpointer user_data)
+{
+    LoadvmParallel *lp = user_data;
+    LoadvmParallelJob *job = data;
+
+    job->ret = vmstate_load_state_no_post_load(job->f, job->se->vmsd,
+                                               job->se->opaque,
+                                               job->version_id);
+
+    qemu_mutex_lock(&lp->lock);
+    job->done = true;
+    qemu_cond_broadcast(&lp->done_cond);
+    qemu_mutex_unlock(&lp->lock);
+}
+
+/*
+ * Wait for the sections handed over to the worker threads and, if
+ * @post_load, call their post_load hooks in stream order.
+ *
+ * Returns: 0 on success, the first error otherwise
+ */
+static int qemu_loadvm_parallel_commit(LoadvmParallel *lp, bool post_load)
+{
+    LoadvmParallelJob *job;
+    int ret = 0;
+
+    while ((job = QSIMPLEQ_FIRST(&lp->jobs))) {
+        SaveStateEntry *se = job->se;
+        const VMStateDescription *vmsd = se->vmsd;
+
+        QSIMPLEQ_REMOVE_HEAD(&lp->jobs, next);
+        qemu_mutex_lock(&lp->lock);
+        while (!job->done) {
+            qemu_cond_wait(&lp->done_cond, &lp->lock);
+        }
+        qemu_mutex_unlock(&lp->lock);
+
+        /* The old style loader doesn't have a post_load hook */
+        if (job->ret >= 0 && post_load && !ret && vmsd->post_load &&
+            job->version_id >= vmsd->minimum_version_id) {
+            job->ret = vmsd->post_load(se->opaque, job->version_id);
+        }
+        trace_qemu_loadvm_parallel_commit(se->idstr, se->instance_id,
+                                          job->ret);
+        if (job->ret < 0) {
+            error_report("error while loading state for instance 0x%"PRIx32
+                         " of device '%s'", se->instance_id, se->idstr);
+            if (!ret) {
+                ret = job->ret;
+            }
+        }
+        qemu_fclose(job->f);
+        g_free(job);
+    }
+
+    return ret;
+}
+
+/*
+ * Read a section sent with its length ahead.  If the device allows it,
+ * it's loaded by a worker thread and committed later by
+ * qemu_loadvm_parallel_commit().
+ */
+static int qemu_loadvm_section_sized(QEMUFile *f, SaveStateEntry *se,
+                                     LoadvmParallel *lp)
+{
+    QIOChannelBuffer *bioc;
+    LoadvmParallelJob *job;
+    QEMUFile *sf;
+    uint32_t length;
+    int ret;
+
+    length = qemu_get_be32(f);
+    ret = qemu_file_get_error(f);
+    if (ret) {
+        return ret;
+    }
+
+    bioc = qio_channel_buffer_new(length);
+    qio_channel_set_name(QIO_CHANNEL(bioc), "migration-loadvm-sized");
+    ret = qemu_get_buffer(f, bioc->data, length);
+    if (ret != length) {
+        object_unref(OBJECT(bioc));
+        error_report("%s: Buffer receive fail ret=%d length=%"PRIu32,
+                     se->idstr, ret, length);
+        return (ret < 0) ? ret : -EIO;
+    }
+    bioc->usage = length;
+    sf = qemu_fopen_channel_input(QIO_CHANNEL(bioc));
+    object_unref(OBJECT(bioc));
+
+    trace_qemu_loadvm_state_section_sized(se->idstr, length,
+                                          se->vmsd && se->vmsd->parallel_load);
+    if (!se->vmsd || !se->vmsd->parallel_load) {
+        ret = vmstate_load(sf, se);
+        qemu_fclose(sf);
+        return ret;
+    }
+
+    if (!lp->pool) {
+        lp->pool = g_thread_pool_new(qemu_loadvm_parallel_worker, lp,
+                                     g_get_num_processors(), FALSE, NULL);
+    }
+
+    job = g_new0(LoadvmParallelJob, 1);
+    job->se = se;
+    job->f = sf;
+    job->version_id = se->load_version_id;
+    QSIMPLEQ_INSERT_TAIL(&lp->jobs, job, next);
+    g_thread_pool_push(lp->pool, job, NULL);
+
+    return 0;
+}
+
 static int
-qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis)
+qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis,
+                               uint8_t section_type, LoadvmParallel *lp)
 {
     uint32_t instance_id, version_id, section_id;
     SaveStateEntry *se;
@@ -2389,7 +2641,11 @@ qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis)
         return -EINVAL;
     }
 
-    ret = vmstate_load(f, se);
+    if (section_type == QEMU_VM_SECTION_FULL_SIZED) {
+        ret = qemu_loadvm_section_sized(f, se, lp);
+    } else {
+        ret = vmstate_load(f, se);
+    }
     if (ret < 0) {
         error_report("error while loading state for instance 0x%"PRIx32" of"
                      " device '%s'", instance_id, idstr);
@@ -2532,6 +2788,11 @@ static bool postcopy_pause_incoming(MigrationIncomingState *mis)
     qemu_fclose(mis->from_src_file);
     mis->from_src_file = NULL;
 
+    /* The preempt thread exits, the channel is not used after recovery */
+    if (mis->postcopy_qemufile_dst) {
+        qemu_file_shutdown(mis->postcopy_qemufile_dst);
+    }
+
     assert(mis->to_src_file);
     qemu_file_shutdown(mis->to_src_file);
     qemu_mutex_lock(&mis->rp_mutex);
@@ -2559,9 +2820,11 @@ static bool postcopy_pause_incoming(MigrationIncomingState *mis)
 
 int qemu_loadvm_state_main(QEMUFile *f, MigrationIncomingState *mis)
 {
+    LoadvmParallel lp;
     uint8_t section_type;
     int ret = 0;
 
+    qemu_loadvm_parallel_init(&lp);
 retry:
     while (true) {
         section_type = qemu_get_byte(f);
@@ -2572,10 +2835,18 @@ retry:
         }
 
         trace_qemu_loadvm_state_section(section_type);
+        if (section_type != QEMU_VM_SECTION_FULL_SIZED) {
+            /* Only consecutive sized sections are loaded in parallel */
+            ret = qemu_loadvm_parallel_commit(&lp, true);
+            if (ret < 0) {
+                goto out;
+            }
+        }
         switch (section_type) {
         case QEMU_VM_SECTION_START:
         case QEMU_VM_SECTION_FULL:
-            ret = qemu_loadvm_section_start_full(f, mis);
+        case QEMU_VM_SECTION_FULL_SIZED:
+            ret = qemu_loadvm_section_start_full(f, mis, section_type, &lp);
             if (ret < 0) {
                 goto out;
             }
@@ -2606,6 +2877,8 @@ retry:
 
 out:
     if (ret < 0) {
+        /* Don't leave workers behind loading into the devices */
+        qemu_loadvm_parallel_commit(&lp, false);
         qemu_file_set_error(f, ret);
 
         /* Cancel bitmaps incoming regardless of recovery */
@@ -2629,6 +2902,7 @@ out:
             goto retry;
         }
     }
+    qemu_loadvm_parallel_destroy(&lp);
     return ret;
 }
 
@@ -12,6 +12,7 @@
  */
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/host-utils.h"
 #include "xbzrle.h"
 
 /*
@@ -24,8 +25,8 @@
 
   length = uleb128 encoded integer
  */
-int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
-                         uint8_t *dst, int dlen)
+static int xbzrle_encode_buffer_int(uint8_t *old_buf, uint8_t *new_buf,
+                                    int slen, uint8_t *dst, int dlen)
 {
     uint32_t zrun_len = 0, nzrun_len = 0;
     int d = 0, i = 0;
@@ -126,6 +127,265 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
     return d;
 }
 
+/*
+ * The vector encoders share the loop below, and only differ in how they
+ * find the end of a run: @skip returns the first index from @i on where
+ * old_buf and new_buf are different (if @equal is true) or the same
+ * (if @equal is false), or @slen.
+ */
+typedef int XbzrleSkipFn(const uint8_t *old_buf, const uint8_t *new_buf,
+                         int i, int slen, bool equal);
+
+static inline QEMU_ALWAYS_INLINE int
+xbzrle_encode_buffer_skip(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                          uint8_t *dst, int dlen, XbzrleSkipFn *skip)
+{
+    int d = 0, i = 0;
+    int zrun_start, nzrun_start, nzrun_len;
+
+    while (i < slen) {
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+
+        zrun_start = i;
+        i = skip(old_buf, new_buf, i, slen, true);
+
+        /* buffer unchanged */
+        if (i - zrun_start == slen) {
+            return 0;
+        }
+
+        /* skip last zero run */
+        if (i == slen) {
+            return d;
+        }
+
+        d += uleb128_encode_small(dst + d, i - zrun_start);
+
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+
+        nzrun_start = i;
+        i = skip(old_buf, new_buf, i, slen, false);
+        nzrun_len = i - nzrun_start;
+
+        d += uleb128_encode_small(dst + d, nzrun_len);
+        /* overflow */
+        if (d + nzrun_len > dlen) {
+            return -1;
+        }
+        memcpy(dst + d, new_buf + nzrun_start, nzrun_len);
+        d += nzrun_len;
+    }
+
+    return d;
+}
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static int xbzrle_skip_avx2(const uint8_t *old_buf, const uint8_t *new_buf,
+                            int i, int slen, bool equal)
+{
+    for (; i + 32 <= slen; i += 32) {
+        __m256i o = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+        __m256i n = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+        /* one bit per byte, set for the bytes that continue the run */
+        uint32_t run = _mm256_movemask_epi8(_mm256_cmpeq_epi8(o, n));
+
+        if (!equal) {
+            run = ~run;
+        }
+        if (run != UINT32_MAX) {
+            return i + ctz32(~run);
+        }
+    }
+    while (i < slen && (old_buf[i] == new_buf[i]) == equal) {
+        i++;
+    }
+    return i;
+}
+
+static int xbzrle_encode_buffer_avx2(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_buffer_skip(old_buf, new_buf, slen, dst, dlen,
+                                     xbzrle_skip_avx2);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX2_OPT */
+
+#ifdef CONFIG_AVX512BW_OPT
+#pragma GCC push_options
+#pragma GCC target("avx512bw")
+#include <immintrin.h>
+
+static int xbzrle_skip_avx512(const uint8_t *old_buf, const uint8_t *new_buf,
+                              int i, int slen, bool equal)
+{
+    for (; i + 64 <= slen; i += 64) {
+        __m512i o = _mm512_loadu_si512(old_buf + i);
+        __m512i n = _mm512_loadu_si512(new_buf + i);
+        uint64_t run = _mm512_cmpeq_epi8_mask(o, n);
+
+        if (!equal) {
+            run = ~run;
+        }
+        if (run != UINT64_MAX) {
+            return i + ctz64(~run);
+        }
+    }
+    while (i < slen && (old_buf[i] == new_buf[i]) == equal) {
+        i++;
+    }
+    return i;
+}
+
+static int xbzrle_encode_buffer_avx512(uint8_t *old_buf, uint8_t *new_buf,
+                                       int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_buffer_skip(old_buf, new_buf, slen, dst, dlen,
+                                     xbzrle_skip_avx512);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX512BW_OPT */
+
+#ifdef __aarch64__
+/* Advanced SIMD is always there on AArch64 */
+#include <arm_neon.h>
+
+static int xbzrle_skip_neon(const uint8_t *old_buf, const uint8_t *new_buf,
+                            int i, int slen, bool equal)
+{
+    for (; i + 16 <= slen; i += 16) {
+        uint8x16_t eq = vceqq_u8(vld1q_u8(old_buf + i), vld1q_u8(new_buf + i));
+        /* narrow to four bits per byte, all set for the equal ones */
+        uint8x8_t nibbles = vshrn_n_u16(vreinterpretq_u16_u8(eq), 4);
+        uint64_t run = vget_lane_u64(vreinterpret_u64_u8(nibbles), 0);
+
+        if (!equal) {
+            run = ~run;
+        }
+        if (run != UINT64_MAX) {
+            return i + ctz64(~run) / 4;
+        }
+    }
+    while (i < slen && (old_buf[i] == new_buf[i]) == equal) {
+        i++;
+    }
+    return i;
+}
+
+static int xbzrle_encode_buffer_neon(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_buffer_skip(old_buf, new_buf, slen, dst, dlen,
+                                     xbzrle_skip_neon);
+}
+#endif /* __aarch64__ */
+
+/*
+ * The encoder is picked once at startup from what the host supports;
+ * cpuid_cache keeps the candidates so that the tests can go through all
+ * of them.
+ */
+#define CACHE_AVX512BW 1
+#define CACHE_AVX2     2
+#define CACHE_NEON     4
+
+#if defined(__aarch64__)
+# define INIT_CACHE CACHE_NEON
+# define INIT_ACCEL xbzrle_encode_buffer_neon
+#else
+# define INIT_CACHE 0
+# define INIT_ACCEL xbzrle_encode_buffer_int
+#endif
+
+static unsigned cpuid_cache = INIT_CACHE;
+static int (*xbzrle_encode_accel)(uint8_t *, uint8_t *, int,
+                                  uint8_t *, int) = INIT_ACCEL;
+
+static void init_accel(unsigned cache)
+{
+    int (*fn)(uint8_t *, uint8_t *, int, uint8_t *, int) =
+        xbzrle_encode_buffer_int;
+#ifdef __aarch64__
+    if (cache & CACHE_NEON) {
+        fn = xbzrle_encode_buffer_neon;
+    }
+#endif
+#ifdef CONFIG_AVX2_OPT
+    if (cache & CACHE_AVX2) {
+        fn = xbzrle_encode_buffer_avx2;
+    }
+#endif
+#ifdef CONFIG_AVX512BW_OPT
+    if (cache & CACHE_AVX512BW) {
+        fn = xbzrle_encode_buffer_avx512;
+    }
+#endif
+    xbzrle_encode_accel = fn;
+}
+
+#if defined(CONFIG_AVX512BW_OPT) || defined(CONFIG_AVX2_OPT)
+#include "qemu/cpuid.h"
+
+static void __attribute__((constructor)) init_cpuid_cache(void)
+{
+    int max = __get_cpuid_max(0, NULL);
+    int a, b, c, d;
+    unsigned cache = 0;
+
+    if (max >= 1) {
+        __cpuid(1, a, b, c, d);
+
+        /* We must check that AVX is not just available, but usable.  */
+        if ((c & bit_OSXSAVE) && (c & bit_AVX) && max >= 7) {
+            int bv;
+            __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+            __cpuid_count(7, 0, a, b, c, d);
+            if ((bv & 0x6) == 0x6 && (b & bit_AVX2)) {
+                cache |= CACHE_AVX2;
+            }
+            /* OPMASK, ZMM and YMM state are all enabled by the OS */
+            if ((bv & 0xe6) == 0xe6 && (b & bit_AVX512F) &&
+                (b & bit_AVX512BW)) {
+                cache |= CACHE_AVX512BW;
+            }
+        }
+    }
+    cpuid_cache = cache;
+    init_accel(cache);
+}
+#endif /* CONFIG_AVX512BW_OPT || CONFIG_AVX2_OPT */
+
+bool test_xbzrle_encode_next_accel(void)
+{
+    /*
+     * If no bits set, we just tested xbzrle_encode_buffer_int, and there
+     * are no more acceleration options to test.
+     */
+    if (cpuid_cache == 0) {
+        return false;
+    }
+    /* Disable the accelerator we used before and select a new one.  */
+    cpuid_cache &= cpuid_cache - 1;
+    init_accel(cpuid_cache);
+    return true;
+}
+
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_accel(old_buf, new_buf, slen, dst, dlen);
+}
+
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
 {
     int i = 0, d = 0;
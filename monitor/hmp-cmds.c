@@ -40,6 +40,7 @@
 #include "qapi/qapi-commands-pci.h"
 #include "qapi/qapi-commands-rocker.h"
 #include "qapi/qapi-commands-run-state.h"
+#include "qapi/qapi-commands-stats.h"
 #include "qapi/qapi-commands-tpm.h"
 #include "qapi/qapi-commands-ui.h"
 #include "qapi/qapi-visit-net.h"
@@ -364,6 +365,18 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->vfio->transferred >> 10);
     }
 
+    if (info->has_device_downtime) {
+        MigrationDeviceDowntimeList *dev;
+
+        monitor_printf(mon, "device downtime: [\n");
+        for (dev = info->device_downtime; dev; dev = dev->next) {
+            monitor_printf(mon, "\t%s (%" PRIu32 "): %" PRId64 " us\n",
+                           dev->value->name, dev->value->instance_id,
+                           dev->value->time);
+        }
+        monitor_printf(mon, "]\n");
+    }
+
     qapi_free_MigrationInfo(info);
 }
 
@@ -435,6 +448,10 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "%s: %s\n",
             MigrationParameter_str(MIGRATION_PARAMETER_CPU_THROTTLE_TAILSLOW),
             params->cpu_throttle_tailslow ? "on" : "off");
+        assert(params->has_cpu_throttle_per_vcpu);
+        monitor_printf(mon, "%s: %s\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_CPU_THROTTLE_PER_VCPU),
+            params->cpu_throttle_per_vcpu ? "on" : "off");
         assert(params->has_max_cpu_throttle);
         monitor_printf(mon, "%s: %u\n",
             MigrationParameter_str(MIGRATION_PARAMETER_MAX_CPU_THROTTLE),
@@ -478,6 +495,14 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "%s: '%s'\n",
             MigrationParameter_str(MIGRATION_PARAMETER_TLS_AUTHZ),
             params->tls_authz);
+        assert(params->has_direct_io);
+        monitor_printf(mon, "%s: %s\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_DIRECT_IO),
+            params->direct_io ? "on" : "off");
+        assert(params->has_postcopy_fault_around);
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_POSTCOPY_FAULT_AROUND),
+            params->postcopy_fault_around);
 
         if (params->has_block_bitmap_mapping) {
             const BitmapMigrationNodeAliasList *bmnal;
@@ -962,12 +987,20 @@ void hmp_sync_profile(Monitor *mon, const QDict *qdict)
 
     if (op == NULL) {
         bool on = qsp_is_enabled();
+        unsigned int period = qsp_get_sample_period();
 
-        monitor_printf(mon, "sync-profile is %s\n", on ? "on" : "off");
+        if (period) {
+            monitor_printf(mon, "sync-profile is sampled (1 in %u)\n",
+                           period);
+        } else {
+            monitor_printf(mon, "sync-profile is %s\n", on ? "on" : "off");
+        }
         return;
     }
     if (!strcmp(op, "on")) {
         qsp_enable();
+    } else if (!strcmp(op, "sampled")) {
+        qsp_enable_sampled(QSP_DEFAULT_SAMPLE_PERIOD);
     } else if (!strcmp(op, "off")) {
         qsp_disable();
     } else if (!strcmp(op, "reset")) {
@@ -1323,6 +1356,10 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
         p->has_cpu_throttle_tailslow = true;
         visit_type_bool(v, param, &p->cpu_throttle_tailslow, &err);
         break;
+    case MIGRATION_PARAMETER_CPU_THROTTLE_PER_VCPU:
+        p->has_cpu_throttle_per_vcpu = true;
+        visit_type_bool(v, param, &p->cpu_throttle_per_vcpu, &err);
+        break;
     case MIGRATION_PARAMETER_MAX_CPU_THROTTLE:
         p->has_max_cpu_throttle = true;
         visit_type_int(v, param, &p->max_cpu_throttle, &err);
@@ -1388,6 +1425,10 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
         p->has_multifd_zstd_level = true;
         visit_type_int(v, param, &p->multifd_zstd_level, &err);
         break;
+    case MIGRATION_PARAMETER_MULTIFD_QATZIP_LEVEL:
+        p->has_multifd_qatzip_level = true;
+        visit_type_int(v, param, &p->multifd_qatzip_level, &err);
+        break;
     case MIGRATION_PARAMETER_XBZRLE_CACHE_SIZE:
         p->has_xbzrle_cache_size = true;
         if (!visit_type_size(v, param, &cache_size, &err)) {
@@ -1419,6 +1460,14 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
         p->has_announce_step = true;
         visit_type_size(v, param, &p->announce_step, &err);
         break;
+    case MIGRATION_PARAMETER_DIRECT_IO:
+        p->has_direct_io = true;
+        visit_type_bool(v, param, &p->direct_io, &err);
+        break;
+    case MIGRATION_PARAMETER_POSTCOPY_FAULT_AROUND:
+        p->has_postcopy_fault_around = true;
+        visit_type_uint8(v, param, &p->postcopy_fault_around, &err);
+        break;
     case MIGRATION_PARAMETER_BLOCK_BITMAP_MAPPING:
         error_setg(&err, "The block-bitmap-mapping parameter can only be set "
                    "through QMP");
@@ -1926,19 +1975,77 @@ void hmp_info_iothreads(Monitor *mon, const QDict *qdict)
     IOThreadInfoList *info_list = qmp_query_iothreads(NULL);
     IOThreadInfoList *info;
     IOThreadInfo *value;
+    IOThreadStats *stats;
 
     for (info = info_list; info; info = info->next) {
         value = info->value;
+        stats = value->stats;
         monitor_printf(mon, "%s:\n", value->id);
         monitor_printf(mon, "  thread_id=%" PRId64 "\n", value->thread_id);
         monitor_printf(mon, "  poll-max-ns=%" PRId64 "\n", value->poll_max_ns);
         monitor_printf(mon, "  poll-grow=%" PRId64 "\n", value->poll_grow);
         monitor_printf(mon, "  poll-shrink=%" PRId64 "\n", value->poll_shrink);
+        monitor_printf(mon, "  loop-iterations=%" PRIu64 "\n",
+                       stats->loop_iterations);
+        monitor_printf(mon, "  poll-hits=%" PRIu64 "/%" PRIu64 "\n",
+                       stats->poll_hits, stats->poll_attempts);
+        monitor_printf(mon, "  blocking-waits=%" PRIu64 "\n",
+                       stats->blocking_waits);
+        monitor_printf(mon, "  bh-calls=%" PRIu64 "\n", stats->bh_calls);
+        monitor_printf(mon, "  time (ns): poll %" PRIu64 ", wait %" PRIu64
+                       ", dispatch %" PRIu64 "\n", stats->poll_time_ns,
+                       stats->wait_time_ns, stats->dispatch_time_ns);
+        monitor_printf(mon, "  dispatch latency (ns): count %" PRIu64
+                       ", mean %" PRIu64 ", p99 %" PRIu64 ", max %" PRIu64
+                       "\n", stats->dispatch_latency->count,
+                       stats->dispatch_latency->mean,
+                       stats->dispatch_latency->p99,
+                       stats->dispatch_latency->max);
     }
 
     qapi_free_IOThreadInfoList(info_list);
 }
 
+void hmp_info_stats(Monitor *mon, const QDict *qdict)
+{
+    const char *target = qdict_get_try_str(qdict, "target");
+    StatsFilter filter = {};
+    StatsResultList *list, *l;
+    StatsList *s;
+    Error *err = NULL;
+
+    if (target) {
+        filter.has_target = true;
+        filter.target = qapi_enum_parse(&StatsTarget_lookup, target, -1, &err);
+        if (err) {
+            hmp_handle_error(mon, err);
+            return;
+        }
+    }
+
+    list = qmp_query_stats(&filter, &err);
+    if (err) {
+        hmp_handle_error(mon, err);
+        return;
+    }
+
+    for (l = list; l; l = l->next) {
+        StatsResult *result = l->value;
+
+        monitor_printf(mon, "%s %s%s%s:\n",
+                       StatsProvider_str(result->provider),
+                       StatsTarget_str(result->target),
+                       result->has_id ? " " : "",
+                       result->has_id ? result->id : "");
+        for (s = result->stats; s; s = s->next) {
+            monitor_printf(mon, "  %s=%" PRIu64 "\n",
+                           s->value->name, s->value->value);
+        }
+    }
+
+    qapi_free_StatsResultList(list);
+}
+
 void hmp_rocker(Monitor *mon, const QDict *qdict)
 {
     const char *name = qdict_get_str(qdict, "name");
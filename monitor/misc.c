@@ -60,6 +60,9 @@
 #ifdef CONFIG_TRACE_SIMPLE
 #include "trace/simple.h"
 #endif
+#ifdef CONFIG_TRACE_RING
+#include "trace/ring.h"
+#endif
 #include "exec/memory.h"
 #include "exec/exec-all.h"
 #include "qemu/option.h"
@@ -195,7 +198,30 @@ static void hmp_trace_event(Monitor *mon, const QDict *qdict)
     }
 }
 
-#ifdef CONFIG_TRACE_SIMPLE
+#if defined(CONFIG_TRACE_RING)
+static void hmp_trace_file(Monitor *mon, const QDict *qdict)
+{
+    const char *op = qdict_get_try_str(qdict, "op");
+    const char *arg = qdict_get_try_str(qdict, "arg");
+
+    if (!op) {
+        ring_trace_print_file_status();
+    } else if (!strcmp(op, "on")) {
+        ring_trace_set_file_enabled(true);
+    } else if (!strcmp(op, "off")) {
+        ring_trace_set_file_enabled(false);
+    } else if (!strcmp(op, "flush")) {
+        ring_trace_flush();
+    } else if (!strcmp(op, "set")) {
+        if (arg) {
+            ring_trace_set_file(arg);
+        }
+    } else {
+        monitor_printf(mon, "unexpected argument \"%s\"\n", op);
+        help_cmd(mon, "trace-file");
+    }
+}
+#elif defined(CONFIG_TRACE_SIMPLE)
 static void hmp_trace_file(Monitor *mon, const QDict *qdict)
 {
     const char *op = qdict_get_try_str(qdict, "op");
@@ -30,6 +30,7 @@
 #include "qapi/qapi-visit-control.h"
 #include "qapi/qmp/qdict.h"
 #include "qapi/qmp/qstring.h"
+#include "qemu/cutils.h"
 #include "qemu/error-report.h"
 #include "qemu/option.h"
 #include "sysemu/qtest.h"
@@ -216,23 +217,23 @@ void monitor_flush(Monitor *mon)
 /* flush at every end of line */
 int monitor_puts(Monitor *mon, const char *str)
 {
-    int i;
-    char c;
+    const char *p = str;
+    const char *nl;
 
     qemu_mutex_lock(&mon->mon_lock);
-    for (i = 0; str[i]; i++) {
-        c = str[i];
-        if (c == '\n') {
-            qstring_append_chr(mon->outbuf, '\r');
-        }
-        qstring_append_chr(mon->outbuf, c);
-        if (c == '\n') {
+    while (*p) {
+        nl = qemu_strchrnul(p, '\n');
+        qstring_append_len(mon->outbuf, p, nl - p);
+        p = nl;
+        if (*p == '\n') {
+            qstring_append(mon->outbuf, "\r\n");
             monitor_flush_locked(mon);
+            p++;
         }
     }
     qemu_mutex_unlock(&mon->mon_lock);
 
-    return i;
+    return p - str;
 }
 
 int monitor_vprintf(Monitor *mon, const char *fmt, va_list ap)
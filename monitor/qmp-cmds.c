@@ -17,6 +17,7 @@
 #include "qemu-common.h"
 #include "qemu/cutils.h"
 #include "qemu/option.h"
+#include "qemu/rcu.h"
 #include "monitor/monitor.h"
 #include "sysemu/sysemu.h"
 #include "qemu/config-file.h"
@@ -37,6 +38,7 @@
 #include "qapi/qapi-commands-misc.h"
 #include "qapi/qapi-commands-ui.h"
 #include "qapi/qmp/qerror.h"
+#include "qapi/util.h"
 #include "hw/mem/memory-device.h"
 #include "hw/acpi/acpi_dev_interface.h"
 
@@ -401,3 +403,67 @@ MemoryInfo *qmp_query_memory_size_summary(Error **errp)
 
     return mem_info;
 }
+
+RcuInfo *qmp_x_query_rcu(Error **errp)
+{
+    RcuInfo *info = g_new0(RcuInfo, 1);
+    RCUStats stats;
+
+    rcu_get_stats(&stats);
+    info->grace_periods = stats.grace_periods;
+    info->shared_grace_periods = stats.shared_grace_periods;
+    info->grace_period_total_ns = stats.total_ns;
+    info->grace_period_max_ns = stats.max_ns;
+    info->pending_callbacks = stats.pending_callbacks;
+    return info;
+}
+
+void qmp_x_sync_profile(bool enable, bool has_sample_period,
+                        uint32_t sample_period, bool has_reset, bool reset,
+                        Error **errp)
+{
+    if (!enable) {
+        qsp_disable();
+    } else if (has_sample_period) {
+        qsp_enable_sampled(sample_period);
+    } else {
+        qsp_enable();
+    }
+    if (has_reset && reset) {
+        qsp_reset();
+    }
+}
+
+static void qmp_sync_profile_entry(const QSPStats *stats, void *opaque)
+{
+    SyncProfileEntryList ***tail = opaque;
+    SyncProfileEntryList *elem = g_new0(SyncProfileEntryList, 1);
+    SyncProfileEntry *entry = g_new0(SyncProfileEntry, 1);
+    int i;
+
+    entry->type = g_strdup(stats->type);
+    entry->call_site = g_strdup(stats->callsite);
+    entry->objects = stats->n_objs;
+    entry->acquisitions = stats->n_acqs;
+    entry->wait_ns = stats->ns;
+    for (i = QSP_HIST_BUCKETS - 1; i >= 0; i--) {
+        QAPI_LIST_PREPEND(entry->histogram, stats->hist[i]);
+    }
+
+    elem->value = entry;
+    **tail = elem;
+    *tail = &elem->next;
+}
+
+SyncProfileInfo *qmp_x_query_sync_profile(bool has_max, uint32_t max,
+                                          Error **errp)
+{
+    SyncProfileInfo *info = g_new0(SyncProfileInfo, 1);
+    SyncProfileEntryList **tail = &info->entries;
+
+    info->enabled = qsp_is_enabled();
+    info->sample_period = qsp_get_sample_period();
+    qsp_foreach(has_max ? max : 100, QSP_SORT_BY_TOTAL_WAIT_TIME,
+                qmp_sync_profile_entry, &tail);
+    return info;
+}
@@ -81,6 +81,7 @@ struct NBDRequestData {
     NBDClient *client;
     uint8_t *data;
     bool complete;
+    uint32_t zero_copy_seq; /* Zero copy sends that may still use @data */
 };
 
 struct NBDExport {
@@ -97,6 +98,7 @@ struct NBDExport {
     Notifier eject_notifier;
 
     bool allocation_depth;
+    bool zero_copy;
     BdrvDirtyBitmap **export_bitmaps;
     size_t nr_export_bitmaps;
 };
@@ -141,6 +143,9 @@ struct NBDClient {
     bool structured_reply;
     NBDExportMetaContexts export_meta;
 
+    /* Finished requests whose data may still be used for zero copy sends */
+    QSIMPLEQ_HEAD(, NBDRequestData) zero_copy_reqs;
+
     uint32_t opt; /* Current option being negotiated */
     uint32_t optlen; /* remaining length of data in ioc for the option being
                         negotiated now */
@@ -1397,6 +1402,25 @@ void nbd_client_get(NBDClient *client)
     client->refcount++;
 }
 
+/*
+ * Free the requests on @client->zero_copy_reqs whose data the kernel does
+ * not need any more.  @all frees them regardless: this is only safe when
+ * the socket has been shut down, because the kernel keeps its own reference
+ * to the pages and the data sent from reused memory does not matter then.
+ */
+static void nbd_client_free_zero_copy(NBDClient *client, bool all)
+{
+    NBDRequestData *req;
+
+    while ((req = QSIMPLEQ_FIRST(&client->zero_copy_reqs)) &&
+           (all || qio_channel_socket_zero_copy_done(client->sioc,
+                                                     req->zero_copy_seq))) {
+        QSIMPLEQ_REMOVE_HEAD(&client->zero_copy_reqs, entry);
+        qemu_vfree(req->data);
+        g_free(req);
+    }
+}
+
 void nbd_client_put(NBDClient *client)
 {
     if (--client->refcount == 0) {
@@ -1412,6 +1436,7 @@ void nbd_client_put(NBDClient *client)
             object_unref(OBJECT(client->tlscreds));
         }
         g_free(client->tlsauthz);
+        nbd_client_free_zero_copy(client, true);
         if (client->exp) {
             QTAILQ_REMOVE(&client->exp->clients, client, next);
             blk_exp_unref(&client->exp->common);
@@ -1457,11 +1482,21 @@ static NBDRequestData *nbd_request_get(NBDClient *client)
 static void nbd_request_put(NBDRequestData *req)
 {
     NBDClient *client = req->client;
+    QIOChannelSocket *sioc = client->sioc;
 
-    if (req->data) {
-        qemu_vfree(req->data);
+    if (req->data && sioc->zero_copy &&
+        !qio_channel_socket_zero_copy_done(sioc, sioc->zero_copy_queued))
+    {
+        /* The reply may have been sent from req->data without copying */
+        req->zero_copy_seq = sioc->zero_copy_queued;
+        QSIMPLEQ_INSERT_TAIL(&client->zero_copy_reqs, req, entry);
+    } else {
+        if (req->data) {
+            qemu_vfree(req->data);
+        }
+        g_free(req);
     }
-    g_free(req);
+    nbd_client_free_zero_copy(client, false);
 
     client->nb_requests--;
     nbd_client_receive_next_request(client);
@@ -1642,6 +1677,7 @@ static int nbd_export_create(BlockExport *blk_exp, BlockExportOptions *exp_args,
     }
 
     exp->allocation_depth = arg->allocation_depth;
+    exp->zero_copy = arg->zero_copy;
 
     blk_add_aio_context_notifier(blk, blk_aio_attached, blk_aio_detach, exp);
 
@@ -1748,6 +1784,40 @@ static int coroutine_fn nbd_co_send_iov(NBDClient *client, struct iovec *iov,
     return ret;
 }
 
+/*
+ * Like nbd_co_send_iov(), but the last element of @iov is request data that
+ * nbd_request_put() keeps until the kernel is done with it.  Only this data
+ * may be sent without copying; the headers before it are on the stack.
+ */
+static int coroutine_fn nbd_co_send_iov_data(NBDClient *client,
+                                             struct iovec *iov,
+                                             unsigned niov, Error **errp)
+{
+    int ret;
+
+    if (!client->sioc->zero_copy) {
+        return nbd_co_send_iov(client, iov, niov, errp);
+    }
+
+    g_assert(qemu_in_coroutine());
+    qemu_co_mutex_lock(&client->send_lock);
+    client->send_coroutine = qemu_coroutine_self();
+
+    qio_channel_set_cork(client->ioc, true);
+    ret = qio_channel_writev_all(client->ioc, iov, niov - 1, errp);
+    if (ret == 0) {
+        ret = qio_channel_socket_writev_zero_copy_all(client->sioc,
+                                                      &iov[niov - 1], 1,
+                                                      errp);
+    }
+    qio_channel_set_cork(client->ioc, false);
+
+    client->send_coroutine = NULL;
+    qemu_co_mutex_unlock(&client->send_lock);
+
+    return ret < 0 ? -EIO : 0;
+}
+
 static inline void set_be_simple_reply(NBDSimpleReply *reply, uint64_t error,
                                        uint64_t handle)
 {
@@ -1774,7 +1844,10 @@ static int nbd_co_send_simple_reply(NBDClient *client,
                                    len);
     set_be_simple_reply(&reply, nbd_err, handle);
 
-    return nbd_co_send_iov(client, iov, len ? 2 : 1, errp);
+    if (!len) {
+        return nbd_co_send_iov(client, iov, 1, errp);
+    }
+    return nbd_co_send_iov_data(client, iov, 2, errp);
 }
 
 static inline void set_be_chunk(NBDStructuredReplyChunk *chunk, uint16_t flags,
@@ -1823,7 +1896,7 @@ static int coroutine_fn nbd_co_send_structured_read(NBDClient *client,
                  sizeof(chunk) - sizeof(chunk.h) + size);
     stq_be_p(&chunk.offset, offset);
 
-    return nbd_co_send_iov(client, iov, 2, errp);
+    return nbd_co_send_iov_data(client, iov, 2, errp);
 }
 
 static int coroutine_fn nbd_co_send_structured_error(NBDClient *client,
@@ -2587,6 +2660,16 @@ static coroutine_fn void nbd_co_client_start(void *opaque)
         return;
     }
 
+    /* Zero copy is not possible when TLS encrypts the data into its own
+     * buffers, and not supported for UNIX sockets */
+    if (client->exp->zero_copy && client->ioc == QIO_CHANNEL(client->sioc)) {
+        if (qio_channel_socket_set_zero_copy(client->sioc, &local_err) < 0) {
+            trace_nbd_co_client_start_zero_copy_failed(
+                error_get_pretty(local_err));
+            error_free(local_err);
+        }
+    }
+
     nbd_client_receive_next_request(client);
 }
 
@@ -2613,6 +2696,7 @@ void nbd_client_new(QIOChannelSocket *sioc,
     client->sioc = sioc;
     object_ref(OBJECT(client->sioc));
     client->ioc = QIO_CHANNEL(sioc);
+    QSIMPLEQ_INIT(&client->zero_copy_reqs);
     object_ref(OBJECT(client->ioc));
     client->close_fn = close_fn;
 
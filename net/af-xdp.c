@@ -0,0 +1,541 @@
+/*
+ * AF_XDP network backend
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Each queue of the netdev is an AF_XDP socket bound to one queue of the
+ * host interface.  All the sockets of a netdev share a single UMEM, the
+ * packet buffer area registered with the kernel, which is split in equal
+ * parts between the queues: a queue hands its frames to the kernel through
+ * its fill (receive) and TX rings, and gets them back through its RX and
+ * completion rings.  The kernel picks zero-copy whenever the driver
+ * supports it, in which case the NIC DMAs straight into the UMEM.
+ */
+
+#include "qemu/osdep.h"
+#include <net/if.h>
+#include <linux/if_link.h>
+#include <bpf/libbpf.h>
+#include <bpf/xsk.h>
+
+#include "net/net.h"
+#include "clients.h"
+#include "qapi/error.h"
+#include "qemu/error-report.h"
+#include "qemu/iov.h"
+#include "qemu/cutils.h"
+#include "qemu/main-loop.h"
+#include "block/aio.h"
+
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+#define AF_XDP_RING_SIZE    XSK_RING_CONS__DEFAULT_NUM_DESCS
+#define AF_XDP_FRAME_SIZE   XSK_UMEM__DEFAULT_FRAME_SIZE
+
+/* One fill ring worth of frames for receive, one TX ring for transmit */
+#define AF_XDP_NUM_FRAMES   (2 * AF_XDP_RING_SIZE)
+
+/* Maximum number of packets read from the RX ring in one go */
+#define AF_XDP_BATCH_SIZE   64
+
+typedef struct AFXDPUmem {
+    unsigned int        refcnt;
+    struct xsk_umem     *umem;
+    void                *buffer;
+    size_t              size;
+    unsigned int        ifindex;
+    uint32_t            xdp_flags;
+    bool                detach_prog;
+} AFXDPUmem;
+
+typedef struct AFXDPState {
+    NetClientState      nc;
+    AFXDPUmem           *umem;
+    struct xsk_socket   *xsk;
+    struct xsk_ring_cons rx;
+    struct xsk_ring_prod tx;
+    struct xsk_ring_prod fq;
+    struct xsk_ring_cons cq;
+    AioContext          *ctx;
+    uint64_t            *pool;          /* Free frames of this queue */
+    uint32_t            n_pool;
+    uint32_t            outstanding_tx; /* Frames not completed yet */
+    bool                read_poll;
+    bool                write_poll;
+    char                ifname[IFNAMSIZ];
+} AFXDPState;
+
+static void af_xdp_send(void *opaque);
+static void af_xdp_writable(void *opaque);
+
+/* Set the event-loop handlers for the AF_XDP backend. */
+static void af_xdp_update_fd_handler(AFXDPState *s)
+{
+    int fd = xsk_socket__fd(s->xsk);
+
+    if (s->ctx) {
+        aio_set_fd_handler(s->ctx, fd, true,
+                           s->read_poll ? af_xdp_send : NULL,
+                           s->write_poll ? af_xdp_writable : NULL,
+                           NULL, s);
+    } else {
+        qemu_set_fd_handler(fd,
+                            s->read_poll ? af_xdp_send : NULL,
+                            s->write_poll ? af_xdp_writable : NULL,
+                            s);
+    }
+}
+
+/* Update the read handler. */
+static void af_xdp_read_poll(AFXDPState *s, bool enable)
+{
+    if (s->read_poll != enable) {
+        s->read_poll = enable;
+        af_xdp_update_fd_handler(s);
+    }
+}
+
+/* Update the write handler. */
+static void af_xdp_write_poll(AFXDPState *s, bool enable)
+{
+    if (s->write_poll != enable) {
+        s->write_poll = enable;
+        af_xdp_update_fd_handler(s);
+    }
+}
+
+static void af_xdp_poll(NetClientState *nc, bool enable)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+
+    if (s->read_poll != enable || s->write_poll != enable) {
+        s->read_poll = enable;
+        s->write_poll = enable;
+        af_xdp_update_fd_handler(s);
+    }
+}
+
+static void af_xdp_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+    int fd = xsk_socket__fd(s->xsk);
+
+    if (ctx == s->ctx) {
+        return;
+    }
+    if (s->ctx) {
+        aio_set_fd_handler(s->ctx, fd, true, NULL, NULL, NULL, NULL);
+    } else {
+        qemu_set_fd_handler(fd, NULL, NULL, NULL);
+    }
+    s->ctx = ctx;
+    af_xdp_update_fd_handler(s);
+}
+
+/* Give back to the pool the frames whose transmission is complete. */
+static void af_xdp_complete_tx(AFXDPState *s)
+{
+    uint32_t idx = 0;
+    uint32_t i, done;
+
+    done = xsk_ring_cons__peek(&s->cq, s->outstanding_tx, &idx);
+    for (i = 0; i < done; i++) {
+        s->pool[s->n_pool++] = *xsk_ring_cons__comp_addr(&s->cq, idx++);
+    }
+    xsk_ring_cons__release(&s->cq, done);
+    s->outstanding_tx -= done;
+}
+
+/* Post up to @n free frames to the fill ring, for the kernel to receive in. */
+static void af_xdp_refill(AFXDPState *s, uint32_t n)
+{
+    uint32_t idx = 0;
+    uint32_t i;
+
+    n = MIN(n, s->n_pool);
+    if (!n || xsk_ring_prod__reserve(&s->fq, n, &idx) != n) {
+        return;
+    }
+    for (i = 0; i < n; i++) {
+        *xsk_ring_prod__fill_addr(&s->fq, idx++) = s->pool[--s->n_pool];
+    }
+    xsk_ring_prod__submit(&s->fq, n);
+
+    if (xsk_ring_prod__needs_wakeup(&s->fq)) {
+        recvfrom(xsk_socket__fd(s->xsk), NULL, 0, MSG_DONTWAIT, NULL, NULL);
+    }
+}
+
+/*
+ * The fd_write() callback, invoked if the fd is marked as
+ * writable after a poll. Unregister the handler and flush any
+ * buffered packets.
+ */
+static void af_xdp_writable(void *opaque)
+{
+    AFXDPState *s = opaque;
+
+    af_xdp_write_poll(s, false);
+    qemu_flush_queued_packets(&s->nc);
+}
+
+static ssize_t af_xdp_receive_iov(NetClientState *nc,
+                                  const struct iovec *iov, int iovcnt)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+    size_t size = iov_size(iov, iovcnt);
+    struct xdp_desc *desc;
+    uint32_t idx;
+
+    if (size > AF_XDP_FRAME_SIZE) {
+        /* Does not fit in a frame and cannot be sent, drop it. */
+        return size;
+    }
+
+    /*
+     * Completions are only collected when the pool runs dry, so that
+     * they are processed in batches.
+     */
+    if (!s->n_pool) {
+        af_xdp_complete_tx(s);
+    }
+    if (!s->n_pool || xsk_ring_prod__reserve(&s->tx, 1, &idx) != 1) {
+        /*
+         * No frame or no TX slot available; the packet is queued until
+         * the kernel makes progress and the fd becomes writable.
+         */
+        af_xdp_write_poll(s, true);
+        return 0;
+    }
+
+    desc = xsk_ring_prod__tx_desc(&s->tx, idx);
+    desc->addr = s->pool[--s->n_pool];
+    desc->len = iov_to_buf(iov, iovcnt, 0,
+                           xsk_umem__get_data(s->umem->buffer, desc->addr),
+                           size);
+    xsk_ring_prod__submit(&s->tx, 1);
+    s->outstanding_tx++;
+
+    /*
+     * The kernel asks for a kick only when it is not already processing
+     * the TX ring, so a burst of packets costs a single system call.
+     */
+    if (xsk_ring_prod__needs_wakeup(&s->tx)) {
+        sendto(xsk_socket__fd(s->xsk), NULL, 0, MSG_DONTWAIT, NULL, 0);
+    }
+
+    return size;
+}
+
+static ssize_t af_xdp_receive(NetClientState *nc,
+                              const uint8_t *buf, size_t size)
+{
+    struct iovec iov;
+
+    iov.iov_base = (void *)buf;
+    iov.iov_len = size;
+
+    return af_xdp_receive_iov(nc, &iov, 1);
+}
+
+/*
+ * Complete a previous send (backend --> guest) and enable the
+ * fd_read callback.
+ */
+static void af_xdp_send_completed(NetClientState *nc, ssize_t len)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+
+    af_xdp_read_poll(s, true);
+}
+
+static void af_xdp_send(void *opaque)
+{
+    AFXDPState *s = opaque;
+    uint32_t idx = 0;
+    uint32_t i, n_rx;
+
+    n_rx = xsk_ring_cons__peek(&s->rx, AF_XDP_BATCH_SIZE, &idx);
+    if (!n_rx) {
+        return;
+    }
+
+    qemu_send_batch_begin(&s->nc);
+    for (i = 0; i < n_rx; i++) {
+        const struct xdp_desc *desc = xsk_ring_cons__rx_desc(&s->rx, idx++);
+        ssize_t ret;
+
+        ret = qemu_send_packet_async(&s->nc,
+                                     xsk_umem__get_data(s->umem->buffer,
+                                                        desc->addr),
+                                     desc->len, af_xdp_send_completed);
+
+        /*
+         * The packet has been copied by the peer or by the queue, so
+         * the frame can go back to the pool.  In aligned mode the frame
+         * address is the descriptor address rounded down.
+         */
+        s->pool[s->n_pool++] = desc->addr & ~(uint64_t)(AF_XDP_FRAME_SIZE - 1);
+
+        if (ret == 0) {
+            /*
+             * The peer does not receive anymore.  The rest of the batch
+             * is queued as well, then stop reading from the backend
+             * until af_xdp_send_completed().
+             */
+            af_xdp_read_poll(s, false);
+        }
+    }
+
+    qemu_send_batch_end(&s->nc);
+
+    xsk_ring_cons__release(&s->rx, n_rx);
+    af_xdp_refill(s, n_rx);
+}
+
+static void af_xdp_umem_unref(AFXDPUmem *umem)
+{
+    if (--umem->refcnt) {
+        return;
+    }
+    if (umem->umem) {
+        xsk_umem__delete(umem->umem);
+    }
+    if (umem->detach_prog) {
+        bpf_set_link_xdp_fd(umem->ifindex, -1, umem->xdp_flags);
+    }
+    qemu_vfree(umem->buffer);
+    g_free(umem);
+}
+
+/* Flush and close. */
+static void af_xdp_cleanup(NetClientState *nc)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+
+    qemu_purge_queued_packets(nc);
+
+    if (s->xsk) {
+        af_xdp_poll(nc, false);
+        xsk_socket__delete(s->xsk);
+        s->xsk = NULL;
+    }
+    g_free(s->pool);
+    s->pool = NULL;
+    if (s->umem) {
+        af_xdp_umem_unref(s->umem);
+        s->umem = NULL;
+    }
+}
+
+/* NetClientInfo methods */
+static NetClientInfo net_af_xdp_info = {
+    .type = NET_CLIENT_DRIVER_AF_XDP,
+    .size = sizeof(AFXDPState),
+    .receive = af_xdp_receive,
+    .receive_iov = af_xdp_receive_iov,
+    .poll = af_xdp_poll,
+    .cleanup = af_xdp_cleanup,
+    .set_aio_context = af_xdp_set_aio_context,
+};
+
+static int af_xdp_try_socket(AFXDPState *s, bool first, uint32_t queue_id,
+                             uint32_t xdp_flags, uint16_t bind_flags)
+{
+    AFXDPUmem *umem = s->umem;
+    struct xsk_socket_config cfg = {
+        .rx_size = AF_XDP_RING_SIZE,
+        .tx_size = AF_XDP_RING_SIZE,
+        .xdp_flags = xdp_flags | XDP_FLAGS_UPDATE_IF_NOEXIST,
+        .bind_flags = bind_flags,
+    };
+    uint32_t prog_id = 0;
+    int ret;
+
+    if (!first) {
+        /* The program was attached or found by the first queue. */
+        return xsk_socket__create_shared(&s->xsk, s->ifname, queue_id,
+                                         umem->umem, &s->rx, &s->tx,
+                                         &s->fq, &s->cq, &cfg);
+    }
+
+    /* Only remove the program on cleanup if libbpf attaches it now. */
+    if (bpf_get_link_xdp_id(umem->ifindex, &prog_id, xdp_flags)) {
+        prog_id = 1;
+    }
+    ret = xsk_socket__create_shared(&s->xsk, s->ifname, queue_id,
+                                    umem->umem, &s->rx, &s->tx,
+                                    &s->fq, &s->cq, &cfg);
+    if (ret) {
+        if (!prog_id) {
+            bpf_set_link_xdp_fd(umem->ifindex, -1, xdp_flags);
+        }
+        return ret;
+    }
+    umem->xdp_flags = xdp_flags;
+    umem->detach_prog = !prog_id;
+    return 0;
+}
+
+static int af_xdp_socket_create(AFXDPState *s, const NetdevAFXDPOptions *opts,
+                                unsigned int index, uint32_t queue_id,
+                                Error **errp)
+{
+    AFXDPUmem *umem = s->umem;
+    uint16_t bind_flags = XDP_USE_NEED_WAKEUP;
+    uint32_t base;
+    int ret;
+
+    if (opts->has_force_copy && opts->force_copy) {
+        bind_flags |= XDP_COPY;
+    }
+
+    if (!umem->umem) {
+        struct xsk_umem_config cfg = {
+            .fill_size = AF_XDP_RING_SIZE,
+            .comp_size = AF_XDP_RING_SIZE,
+            .frame_size = AF_XDP_FRAME_SIZE,
+        };
+
+        /* The first queue uses the fill and completion rings of the UMEM. */
+        ret = xsk_umem__create(&umem->umem, umem->buffer, umem->size,
+                               &s->fq, &s->cq, &cfg);
+        if (ret) {
+            umem->umem = NULL;
+            error_setg_errno(errp, -ret, "failed to create UMEM");
+            return -1;
+        }
+    }
+
+    if (index) {
+        ret = af_xdp_try_socket(s, false, queue_id, umem->xdp_flags,
+                                bind_flags);
+    } else if (opts->has_mode) {
+        ret = af_xdp_try_socket(s, true, queue_id,
+                                opts->mode == AFXDP_MODE_NATIVE ?
+                                XDP_FLAGS_DRV_MODE : XDP_FLAGS_SKB_MODE,
+                                bind_flags);
+    } else {
+        ret = af_xdp_try_socket(s, true, queue_id, XDP_FLAGS_DRV_MODE,
+                                bind_flags);
+        if (ret) {
+            ret = af_xdp_try_socket(s, true, queue_id, XDP_FLAGS_SKB_MODE,
+                                    bind_flags);
+        }
+    }
+    if (ret) {
+        s->xsk = NULL;
+        error_setg_errno(errp, -ret,
+                         "failed to create AF_XDP socket for %s queue %u",
+                         s->ifname, queue_id);
+        return -1;
+    }
+
+    /* Hand all the receive frames of this queue to the kernel. */
+    s->pool = g_new(uint64_t, AF_XDP_NUM_FRAMES);
+    base = index * AF_XDP_NUM_FRAMES;
+    for (s->n_pool = 0; s->n_pool < AF_XDP_NUM_FRAMES; s->n_pool++) {
+        s->pool[s->n_pool] = (uint64_t)(base + s->n_pool) * AF_XDP_FRAME_SIZE;
+    }
+    af_xdp_refill(s, AF_XDP_RING_SIZE);
+
+    return 0;
+}
+
+static bool af_xdp_zero_copy(AFXDPState *s)
+{
+#ifdef XDP_OPTIONS
+    struct xdp_options opts;
+    socklen_t len = sizeof(opts);
+
+    if (getsockopt(xsk_socket__fd(s->xsk), SOL_XDP, XDP_OPTIONS,
+                   &opts, &len)) {
+        return false;
+    }
+    return opts.flags & XDP_OPTIONS_ZEROCOPY;
+#else
+    return false;
+#endif
+}
+
+/*
+ * The exported init function
+ *
+ * ... -netdev af-xdp,ifname="...",queues=n
+ */
+int net_init_af_xdp(const Netdev *netdev,
+                    const char *name, NetClientState *peer, Error **errp)
+{
+    const NetdevAFXDPOptions *opts = &netdev->u.af_xdp;
+    int64_t queues = opts->has_queues ? opts->queues : 1;
+    int64_t start = opts->has_start_queue ? opts->start_queue : 0;
+    NetClientState *nc, *nc0 = NULL;
+    unsigned int ifindex;
+    AFXDPUmem *umem;
+    AFXDPState *s;
+    int i;
+
+    if (queues < 1 || queues > MAX_QUEUE_NUM) {
+        error_setg(errp, "af-xdp: queues must be between 1 and %d",
+                   MAX_QUEUE_NUM);
+        return -1;
+    }
+    if (start < 0 || start + queues > UINT32_MAX) {
+        error_setg(errp, "af-xdp: invalid start-queue %" PRId64, start);
+        return -1;
+    }
+    /* QEMU hubs do not support multiqueue, in this case peer is set. */
+    if (peer && queues > 1) {
+        error_setg(errp, "Multiqueue af-xdp cannot be used with hubs");
+        return -1;
+    }
+    if (strlen(opts->ifname) >= IFNAMSIZ) {
+        error_setg(errp, "af-xdp: interface name '%s' is too long",
+                   opts->ifname);
+        return -1;
+    }
+    ifindex = if_nametoindex(opts->ifname);
+    if (!ifindex) {
+        error_setg_errno(errp, errno, "af-xdp: no interface '%s'",
+                         opts->ifname);
+        return -1;
+    }
+
+    /* The reference held here is dropped once all queues are set up. */
+    umem = g_new0(AFXDPUmem, 1);
+    umem->refcnt = 1;
+    umem->ifindex = ifindex;
+    umem->size = (size_t)queues * AF_XDP_NUM_FRAMES * AF_XDP_FRAME_SIZE;
+    umem->buffer = qemu_memalign(qemu_real_host_page_size, umem->size);
+
+    for (i = 0; i < queues; i++) {
+        nc = qemu_new_net_client(&net_af_xdp_info, peer, "af-xdp", name);
+        s = DO_UPCAST(AFXDPState, nc, nc);
+        pstrcpy(s->ifname, sizeof(s->ifname), opts->ifname);
+        s->umem = umem;
+        umem->refcnt++;
+        if (!nc0) {
+            nc0 = nc;
+        }
+
+        if (af_xdp_socket_create(s, opts, i, start + i, errp)) {
+            /* This deletes all the queues created so far. */
+            qemu_del_net_client(nc0);
+            af_xdp_umem_unref(umem);
+            return -1;
+        }
+
+        snprintf(nc->info_str, sizeof(nc->info_str),
+                 "ifname=%s,queue=%" PRId64 ",mode=%s,%s", s->ifname,
+                 start + i,
+                 umem->xdp_flags & XDP_FLAGS_SKB_MODE ? "skb" : "native",
+                 af_xdp_zero_copy(s) ? "zero-copy" : "copy");
+        af_xdp_read_poll(s, true); /* Initially only poll for reads. */
+    }
+
+    af_xdp_umem_unref(umem);
+    return 0;
+}
@@ -8,6 +8,8 @@
 
 #include "qemu/osdep.h"
 #include "qemu-common.h"
+#include "block/aio.h"
+#include "block/aio-wait.h"
 #include "net/announce.h"
 #include "net/net.h"
 #include "qapi/clone-visitor.h"
@@ -121,11 +123,24 @@ static int announce_self_create(uint8_t *buf,
     return 60; /* len (FCS will be added by hardware) */
 }
 
+typedef struct AnnounceSend {
+    NetClientState *nc;
+    uint8_t buf[60];
+    int len;
+} AnnounceSend;
+
+static void qemu_announce_send_bh(void *opaque)
+{
+    AnnounceSend *send = opaque;
+
+    qemu_send_packet_raw(send->nc, send->buf, send->len);
+}
+
 static void qemu_announce_self_iter(NICState *nic, void *opaque)
 {
     AnnounceTimer *timer = opaque;
-    uint8_t buf[60];
-    int len;
+    AnnounceSend send = { .nc = qemu_get_queue(nic) };
+    AioContext *ctx;
     bool skip;
 
     if (timer->params.has_interfaces) {
@@ -150,9 +165,17 @@ static void qemu_announce_self_iter(NICState *nic, void *opaque)
                                   qemu_ether_ntoa(&nic->conf->macaddr), skip);
 
     if (!skip) {
-        len = announce_self_create(buf, nic->conf->macaddr.a);
-
-        qemu_send_packet_raw(qemu_get_queue(nic), buf, len);
+        send.len = announce_self_create(send.buf, nic->conf->macaddr.a);
+
+        /* Don't race with an IOThread that is running the queue */
+        ctx = send.nc->peer ? send.nc->peer->aio_context : NULL;
+        if (ctx) {
+            aio_context_acquire(ctx);
+            aio_wait_bh_oneshot(ctx, qemu_announce_send_bh, &send);
+            aio_context_release(ctx);
+        } else {
+            qemu_announce_send_bh(&send);
+        }
 
         /* if the NIC provides it's own announcement support, use it as well */
         if (nic->ncs->info->announce) {
@@ -19,24 +19,107 @@
 #include "net/checksum.h"
 #include "net/eth.h"
 
+/*
+ * The one's complement sum doesn't depend on the byte order, as long as
+ * the result is swapped back at the end, so the data is summed in host
+ * byte order, 16 bytes at a time.  Carries collect in the upper bits of
+ * the accumulators and are folded back in once.
+ */
+#define CSUM_BLOCK 16
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+
+/* Each 32-bit lane grows by at most 2 * 0xffff per block */
+#define CSUM_LANE_BLOCKS 16384
+
+static uint64_t net_checksum_add_blocks(const uint8_t *buf, size_t nblocks)
+{
+    const __m128i zero = _mm_setzero_si128();
+    uint64_t sum = 0;
+
+    while (nblocks) {
+        size_t n = MIN(nblocks, CSUM_LANE_BLOCKS);
+        __m128i acc = zero;
+        uint32_t lanes[4];
+
+        for (nblocks -= n; n; n--, buf += CSUM_BLOCK) {
+            __m128i v = _mm_loadu_si128((const __m128i *)buf);
+
+            acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(v, zero));
+            acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(v, zero));
+        }
+        _mm_storeu_si128((__m128i *)lanes, acc);
+        sum += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+    return sum;
+}
+#elif defined(__aarch64__)
+/* Advanced SIMD is always there on AArch64 */
+#include <arm_neon.h>
+
+/* Each 32-bit lane grows by at most 2 * 0xffff per block */
+#define CSUM_LANE_BLOCKS 16384
+
+static uint64_t net_checksum_add_blocks(const uint8_t *buf, size_t nblocks)
+{
+    uint64_t sum = 0;
+
+    while (nblocks) {
+        size_t n = MIN(nblocks, CSUM_LANE_BLOCKS);
+        uint32x4_t acc = vdupq_n_u32(0);
+
+        for (nblocks -= n; n; n--, buf += CSUM_BLOCK) {
+            acc = vpadalq_u16(acc, vreinterpretq_u16_u8(vld1q_u8(buf)));
+        }
+        sum += vaddlvq_u32(acc);
+    }
+    return sum;
+}
+#else
+static uint64_t net_checksum_add_blocks(const uint8_t *buf, size_t nblocks)
+{
+    uint64_t sum = 0;
+
+    /* 32-bit words are fine too, as 0x10000 is 1 modulo 0xffff */
+    for (; nblocks; nblocks--, buf += CSUM_BLOCK) {
+        sum += (uint64_t)ldl_he_p(buf) + ldl_he_p(buf + 4) +
+               ldl_he_p(buf + 8) + ldl_he_p(buf + 12);
+    }
+    return sum;
+}
+#endif
+
 uint32_t net_checksum_add_cont(int len, uint8_t *buf, int seq)
 {
-    uint32_t sum1 = 0, sum2 = 0;
+    uint64_t sum;
     int i;
 
-    for (i = 0; i < len - 1; i += 2) {
-        sum1 += (uint32_t)buf[i];
-        sum2 += (uint32_t)buf[i + 1];
+    if (len <= 0) {
+        return 0;
     }
-    if (i < len) {
-        sum1 += (uint32_t)buf[i];
+
+    sum = net_checksum_add_blocks(buf, len / CSUM_BLOCK);
+    for (i = len & ~(CSUM_BLOCK - 1); i < len - 1; i += 2) {
+        sum += lduw_he_p(buf + i);
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+#ifndef HOST_WORDS_BIGENDIAN
+    sum = bswap16(sum);
+#endif
+
+    if (len & 1) {
+        sum += (uint32_t)buf[len - 1] << 8;
+        sum = (sum & 0xffff) + (sum >> 16);
     }
 
+    /* Odd bytes are the high halves of the words if seq is odd */
     if (seq & 1) {
-        return sum1 + (sum2 << 8);
-    } else {
-        return sum2 + (sum1 << 8);
+        sum = bswap16(sum);
     }
+    return sum;
 }
 
 uint16_t net_checksum_finish(uint32_t sum)
@@ -194,7 +194,7 @@ static void colo_compare_inconsistency_notify(CompareState *s)
     }
 }
 
-/* Use restricted to colo_insert_packet() */
+/* Use restricted to colo_insert_sorted() */
 static gint seq_sorter(Packet *a, Packet *b, gpointer data)
 {
     return a->tcp_seq - b->tcp_seq;
@@ -217,6 +217,25 @@ static void fill_pkt_tcp_info(void *data, uint32_t *max_ack)
     pkt->flags = tcphd->th_flags;
 }
 
+/*
+ * Insert @pkt in @queue in sequence order, before the packets with the
+ * same sequence number like g_queue_insert_sorted() would.  Segments
+ * mostly arrive in order, so look for the place starting from the tail.
+ */
+static void colo_insert_sorted(GQueue *queue, Packet *pkt)
+{
+    GList *l = queue->tail;
+
+    while (l && seq_sorter(l->data, pkt, NULL) >= 0) {
+        l = l->prev;
+    }
+    if (l) {
+        g_queue_insert_after(queue, l, pkt);
+    } else {
+        g_queue_push_head(queue, pkt);
+    }
+}
+
 /*
  * Return 1 on success, if return 0 means the
  * packet will be dropped
@@ -226,10 +245,7 @@ static int colo_insert_packet(GQueue *queue, Packet *pkt, uint32_t *max_ack)
     if (g_queue_get_length(queue) <= max_queue_size) {
         if (pkt->ip->ip_p == IPPROTO_TCP) {
             fill_pkt_tcp_info(pkt, max_ack);
-            g_queue_insert_sorted(queue,
-                                  pkt,
-                                  (GCompareDataFunc)seq_sorter,
-                                  NULL);
+            colo_insert_sorted(queue, pkt);
         } else {
             g_queue_push_tail(queue, pkt);
         }
@@ -20,6 +20,9 @@
 #include "chardev/char-fe.h"
 #include "qemu/iov.h"
 #include "qemu/sockets.h"
+#include "qemu/lockable.h"
+#include "qemu/units.h"
+#include "migration/colo.h"
 
 #define TYPE_FILTER_MIRROR "filter-mirror"
 typedef struct MirrorState MirrorState;
@@ -32,6 +35,9 @@ DECLARE_INSTANCE_CHECKER(MirrorState, FILTER_REDIRECTOR,
 
 #define REDIRECTOR_MAX_LEN NET_BUFSIZE
 
+/* Mirrored bytes that are buffered before writing them synchronously */
+#define MIRROR_BATCH_MAX (256 * KiB)
+
 struct MirrorState {
     NetFilterState parent_obj;
     char *indev;
@@ -40,28 +46,26 @@ struct MirrorState {
     CharBackend chr_out;
     SocketReadState rs;
     bool vnet_hdr;
+
+    /*
+     * filter-mirror only: frames that are written to chr_out at the end
+     * of the main loop iteration by flush_bh
+     */
+    QemuMutex outbuf_lock;
+    GByteArray *outbuf;
+    QEMUBH *flush_bh;
 };
 
-static int filter_send(MirrorState *s,
-                       const struct iovec *iov,
-                       int iovcnt)
+/* Append the frame for a packet to @buf */
+static void filter_frame(MirrorState *s, GByteArray *buf,
+                         const struct iovec *iov, int iovcnt, size_t size)
 {
     NetFilterState *nf = NETFILTER(s);
-    int ret = 0;
-    ssize_t size = 0;
-    uint32_t len = 0;
-    char *buf;
-
-    size = iov_size(iov, iovcnt);
-    if (!size) {
-        return 0;
-    }
+    uint32_t len;
+    guint offset;
 
     len = htonl(size);
-    ret = qemu_chr_fe_write_all(&s->chr_out, (uint8_t *)&len, sizeof(len));
-    if (ret != sizeof(len)) {
-        goto err;
-    }
+    g_byte_array_append(buf, (uint8_t *)&len, sizeof(len));
 
     if (s->vnet_hdr) {
         /*
@@ -69,29 +73,93 @@ static int filter_send(MirrorState *s,
          * module(like colo-compare) know how to parse net
          * packet correctly.
          */
-        ssize_t vnet_hdr_len;
+        len = htonl(nf->netdev->vnet_hdr_len);
+        g_byte_array_append(buf, (uint8_t *)&len, sizeof(len));
+    }
 
-        vnet_hdr_len = nf->netdev->vnet_hdr_len;
+    offset = buf->len;
+    g_byte_array_set_size(buf, offset + size);
+    iov_to_buf(iov, iovcnt, 0, buf->data + offset, size);
+}
 
-        len = htonl(vnet_hdr_len);
-        ret = qemu_chr_fe_write_all(&s->chr_out, (uint8_t *)&len, sizeof(len));
-        if (ret != sizeof(len)) {
-            goto err;
-        }
+static int filter_write(MirrorState *s, GByteArray *buf)
+{
+    int ret;
+
+    ret = qemu_chr_fe_write_all(&s->chr_out, buf->data, buf->len);
+    if (ret != buf->len) {
+        return ret < 0 ? ret : -EIO;
     }
+    return 0;
+}
 
-    buf = g_malloc(size);
-    iov_to_buf(iov, iovcnt, 0, buf, size);
-    ret = qemu_chr_fe_write_all(&s->chr_out, (uint8_t *)buf, size);
-    g_free(buf);
-    if (ret != size) {
-        goto err;
+static int filter_send(MirrorState *s,
+                       const struct iovec *iov,
+                       int iovcnt)
+{
+    g_autoptr(GByteArray) buf = NULL;
+    size_t size;
+
+    size = iov_size(iov, iovcnt);
+    if (!size) {
+        return 0;
     }
 
-    return 0;
+    buf = g_byte_array_sized_new(size + 2 * sizeof(uint32_t));
+    filter_frame(s, buf, iov, iovcnt, size);
+    return filter_write(s, buf);
+}
 
-err:
-    return ret < 0 ? ret : -EIO;
+/* Called with outbuf_lock held */
+static int filter_mirror_flush_locked(MirrorState *s)
+{
+    int ret;
+
+    if (!s->outbuf->len) {
+        return 0;
+    }
+    ret = filter_write(s, s->outbuf);
+    g_byte_array_set_size(s->outbuf, 0);
+    return ret;
+}
+
+static void filter_mirror_flush_bh(void *opaque)
+{
+    MirrorState *s = opaque;
+    int ret = 0;
+
+    WITH_QEMU_LOCK_GUARD(&s->outbuf_lock) {
+        ret = filter_mirror_flush_locked(s);
+    }
+    if (ret) {
+        error_report("filter mirror send failed(%s)", strerror(-ret));
+    }
+}
+
+/*
+ * Queue the frame for a packet in outbuf.  Packets that arrive in a
+ * burst are written to the chardev with a single write.
+ */
+static int filter_mirror_send(MirrorState *s,
+                              const struct iovec *iov,
+                              int iovcnt)
+{
+    size_t size;
+
+    size = iov_size(iov, iovcnt);
+    if (!size) {
+        return 0;
+    }
+
+    QEMU_LOCK_GUARD(&s->outbuf_lock);
+    if (!s->outbuf->len) {
+        qemu_bh_schedule(s->flush_bh);
+    }
+    filter_frame(s, s->outbuf, iov, iovcnt, size);
+    if (s->outbuf->len >= MIRROR_BATCH_MAX) {
+        return filter_mirror_flush_locked(s);
+    }
+    return 0;
 }
 
 static void redirector_to_filter(NetFilterState *nf,
@@ -158,7 +226,12 @@ static ssize_t filter_mirror_receive_iov(NetFilterState *nf,
     MirrorState *s = FILTER_MIRROR(nf);
     int ret;
 
-    ret = filter_send(s, iov, iovcnt);
+    /* Nobody is listening, don't bother copying the packet */
+    if (!qemu_chr_fe_backend_open(&s->chr_out)) {
+        return 0;
+    }
+
+    ret = filter_mirror_send(s, iov, iovcnt);
     if (ret) {
         error_report("filter mirror send failed(%s)", strerror(-ret));
     }
@@ -195,7 +268,42 @@ static void filter_mirror_cleanup(NetFilterState *nf)
 {
     MirrorState *s = FILTER_MIRROR(nf);
 
+    if (s->flush_bh) {
+        qemu_bh_delete(s->flush_bh);
+        filter_mirror_flush_bh(s);
+    }
     qemu_chr_fe_deinit(&s->chr_out, false);
+    g_byte_array_unref(s->outbuf);
+    qemu_mutex_destroy(&s->outbuf_lock);
+}
+
+static void filter_mirror_status_changed(NetFilterState *nf, Error **errp)
+{
+    MirrorState *s = FILTER_MIRROR(nf);
+
+    if (!nf->on && s->flush_bh) {
+        filter_mirror_flush_bh(s);
+    }
+}
+
+static void filter_mirror_handle_event(NetFilterState *nf, int event,
+                                       Error **errp)
+{
+    MirrorState *s = FILTER_MIRROR(nf);
+
+    switch (event) {
+    case COLO_EVENT_CHECKPOINT:
+        /* The secondary must see every packet from before the checkpoint */
+        if (s->flush_bh) {
+            filter_mirror_flush_bh(s);
+        }
+        break;
+    case COLO_EVENT_FAILOVER:
+        object_property_set_str(OBJECT(nf), "status", "off", errp);
+        break;
+    default:
+        break;
+    }
 }
 
 static void filter_redirector_cleanup(NetFilterState *nf)
@@ -224,7 +332,10 @@ static void filter_mirror_setup(NetFilterState *nf, Error **errp)
         return;
     }
 
-    qemu_chr_fe_init(&s->chr_out, chr, errp);
+    if (!qemu_chr_fe_init(&s->chr_out, chr, errp)) {
+        return;
+    }
+    s->flush_bh = qemu_bh_new(filter_mirror_flush_bh, s);
 }
 
 static void redirector_rs_finalize(SocketReadState *rs)
@@ -291,6 +402,8 @@ static void filter_mirror_class_init(ObjectClass *oc, void *data)
     nfc->setup = filter_mirror_setup;
     nfc->cleanup = filter_mirror_cleanup;
     nfc->receive_iov = filter_mirror_receive_iov;
+    nfc->status_changed = filter_mirror_status_changed;
+    nfc->handle_event = filter_mirror_handle_event;
 }
 
 static void filter_redirector_class_init(ObjectClass *oc, void *data)
@@ -399,6 +512,9 @@ static void filter_mirror_init(Object *obj)
     object_property_add_bool(obj, "vnet_hdr_support",
                              filter_mirror_get_vnet_hdr,
                              filter_mirror_set_vnet_hdr);
+
+    qemu_mutex_init(&s->outbuf_lock);
+    s->outbuf = g_byte_array_new();
 }
 
 static void filter_redirector_init(Object *obj)
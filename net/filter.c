@@ -139,10 +139,29 @@ static int netfilter_get_direction(Object *obj, Error **errp G_GNUC_UNUSED)
     return nf->direction;
 }
 
+void netfilter_update_active(NetClientState *nc)
+{
+    NetFilterState *nf;
+    bool rx = false, tx = false;
+
+    QTAILQ_FOREACH(nf, &nc->filters, next) {
+        if (!nf->on) {
+            continue;
+        }
+        rx |= nf->direction != NET_FILTER_DIRECTION_TX;
+        tx |= nf->direction != NET_FILTER_DIRECTION_RX;
+    }
+    nc->filters_active[NET_FILTER_DIRECTION_RX] = rx;
+    nc->filters_active[NET_FILTER_DIRECTION_TX] = tx;
+}
+
 static void netfilter_set_direction(Object *obj, int direction, Error **errp)
 {
     NetFilterState *nf = NETFILTER(obj);
     nf->direction = direction;
+    if (nf->netdev && QTAILQ_IN_USE(nf, next)) {
+        netfilter_update_active(nf->netdev);
+    }
 }
 
 static char *netfilter_get_status(Object *obj, Error **errp)
@@ -166,6 +185,9 @@ static void netfilter_set_status(Object *obj, const char *str, Error **errp)
         return;
     }
     nf->on = !nf->on;
+    if (nf->netdev && QTAILQ_IN_USE(nf, next)) {
+        netfilter_update_active(nf->netdev);
+    }
     if (nf->netdev && nfc->status_changed) {
         nfc->status_changed(nf, errp);
     }
@@ -313,6 +335,7 @@ static void netfilter_complete(UserCreatable *uc, Error **errp)
     } else if (!strcmp(nf->position, "tail")) {
         QTAILQ_INSERT_TAIL(&nf->netdev->filters, nf, next);
     }
+    netfilter_update_active(nf->netdev);
 }
 
 static void netfilter_finalize(Object *obj)
@@ -327,6 +350,7 @@ static void netfilter_finalize(Object *obj)
     if (nf->netdev && !QTAILQ_EMPTY(&nf->netdev->filters) &&
         QTAILQ_IN_USE(nf, next)) {
         QTAILQ_REMOVE(&nf->netdev->filters, nf, next);
+        netfilter_update_active(nf->netdev);
     }
     g_free(nf->netdev_id);
     g_free(nf->position);
@@ -47,6 +47,7 @@
 #include "qemu/qemu-print.h"
 #include "qemu/main-loop.h"
 #include "qemu/option.h"
+#include "qemu/stats.h"
 #include "qapi/error.h"
 #include "qapi/opts-visitor.h"
 #include "sysemu/sysemu.h"
@@ -232,6 +233,56 @@ static ssize_t qemu_deliver_packet_iov(NetClientState *sender,
                                        int iovcnt,
                                        void *opaque);
 
+enum {
+    NET_STAT_TX_PACKETS,
+    NET_STAT_TX_BYTES,
+    NET_STAT_RX_PACKETS,
+    NET_STAT_RX_BYTES,
+    NET_STAT__MAX,
+};
+
+static const StatsDesc net_stats_desc[NET_STAT__MAX] = {
+    [NET_STAT_TX_PACKETS] = {
+        .name = "tx_packets", .type = STATS_TYPE_CUMULATIVE },
+    [NET_STAT_TX_BYTES] = {
+        .name = "tx_bytes", .type = STATS_TYPE_CUMULATIVE,
+        .has_unit = true, .unit = STATS_UNIT_BYTES },
+    [NET_STAT_RX_PACKETS] = {
+        .name = "rx_packets", .type = STATS_TYPE_CUMULATIVE },
+    [NET_STAT_RX_BYTES] = {
+        .name = "rx_bytes", .type = STATS_TYPE_CUMULATIVE,
+        .has_unit = true, .unit = STATS_UNIT_BYTES },
+};
+
+static char *net_stats_get_id(void *opaque)
+{
+    NetClientState *nc = opaque;
+
+    if (nc->queue_index) {
+        return g_strdup_printf("%s.%u", nc->name, nc->queue_index);
+    }
+    return g_strdup(nc->name);
+}
+
+static void net_stats_read(void *opaque, uint64_t *values)
+{
+    NetClientState *nc = opaque;
+
+    values[NET_STAT_TX_PACKETS] = stat64_get(&nc->tx_packets);
+    values[NET_STAT_TX_BYTES] = stat64_get(&nc->tx_bytes);
+    values[NET_STAT_RX_PACKETS] = stat64_get(&nc->rx_packets);
+    values[NET_STAT_RX_BYTES] = stat64_get(&nc->rx_bytes);
+}
+
+static const StatsGroup net_stats_group = {
+    .provider = STATS_PROVIDER_NET,
+    .target = STATS_TARGET_NET,
+    .stats = net_stats_desc,
+    .nr_stats = NET_STAT__MAX,
+    .get_id = net_stats_get_id,
+    .read = net_stats_read,
+};
+
 static void qemu_net_client_setup(NetClientState *nc,
                                   NetClientInfo *info,
                                   NetClientState *peer,
@@ -256,7 +307,9 @@ static void qemu_net_client_setup(NetClientState *nc,
 
     nc->incoming_queue = qemu_new_net_queue(qemu_deliver_packet_iov, nc);
     nc->destructor = destructor;
+    nc->is_datapath = true;
     QTAILQ_INIT(&nc->filters);
+    nc->stats_source = stats_register(&net_stats_group, nc);
 }
 
 NetClientState *qemu_new_net_client(NetClientInfo *info,
@@ -344,6 +397,8 @@ static void qemu_cleanup_net_client(NetClientState *nc)
 
 static void qemu_free_net_client(NetClientState *nc)
 {
+    stats_unregister(nc->stats_source);
+    nc->stats_source = NULL;
     if (nc->incoming_queue) {
         qemu_del_net_queue(nc->incoming_queue);
     }
@@ -528,6 +583,47 @@ int qemu_set_vnet_be(NetClientState *nc, bool is_be)
 #endif
 }
 
+bool qemu_can_set_aio_context(NetClientState *nc)
+{
+    return nc && nc->info->set_aio_context;
+}
+
+/*
+ * Move the file descriptor handlers of @nc to @ctx, or back to the main
+ * loop if @ctx is NULL.  The caller must make sure that nothing else uses
+ * @nc concurrently while its handlers run in @ctx.
+ */
+void qemu_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    assert(qemu_can_set_aio_context(nc));
+    nc->info->set_aio_context(nc, ctx);
+    nc->aio_context = ctx;
+}
+
+/*
+ * Bracket a burst of packets sent by @sender, so that the peer can
+ * defer the work it does once per burst (e.g. interrupting the guest)
+ * to qemu_send_batch_end().  Packets that get queued are delivered
+ * later, outside of the batch.
+ */
+void qemu_send_batch_begin(NetClientState *sender)
+{
+    NetClientState *peer = sender->peer;
+
+    if (peer && peer->info->receive_batch) {
+        peer->info->receive_batch(peer, true);
+    }
+}
+
+void qemu_send_batch_end(NetClientState *sender)
+{
+    NetClientState *peer = sender->peer;
+
+    if (peer && peer->info->receive_batch) {
+        peer->info->receive_batch(peer, false);
+    }
+}
+
 int qemu_can_send_packet(NetClientState *sender)
 {
     int vm_running = runstate_is_running();
@@ -560,6 +656,10 @@ static ssize_t filter_receive_iov(NetClientState *nc,
     ssize_t ret = 0;
     NetFilterState *nf = NULL;
 
+    if (!nc->filters_active[direction]) {
+        return 0;
+    }
+
     if (direction == NET_FILTER_DIRECTION_TX) {
         QTAILQ_FOREACH(nf, &nc->filters, next) {
             ret = qemu_netfilter_receive(nf, direction, sender, flags, iov,
@@ -742,6 +842,11 @@ static ssize_t qemu_deliver_packet_iov(NetClientState *sender,
 
     if (ret == 0) {
         nc->receive_disabled = 1;
+    } else if (ret > 0) {
+        stat64_add(&nc->rx_packets, 1);
+        stat64_add(&nc->rx_bytes, ret);
+        stat64_add(&sender->tx_packets, 1);
+        stat64_add(&sender->tx_bytes, ret);
     }
 
     return ret;
@@ -789,6 +894,49 @@ qemu_sendv_packet(NetClientState *nc, const struct iovec *iov, int iovcnt)
     return qemu_sendv_packet_async(nc, iov, iovcnt, NULL);
 }
 
+/*
+ * Send @count packets from @sender at once.  The peer sees them as one
+ * batch, so the caller must not call qemu_send_batch_begin() around it,
+ * and the queue flush is done once for all of them.  Network filters
+ * still see the packets one by one.
+ *
+ * Returns the number of packets that were taken.  If that is less than
+ * @count, the packet at that index was queued and @sent_cb will be
+ * called once it is delivered; the caller must keep the remaining
+ * packets and send them again after that.  Without @sent_cb all the
+ * packets are always taken.
+ */
+int qemu_sendv_batch_async(NetClientState *sender,
+                           const NetPacketIov *pkts, int count,
+                           NetPacketSent *sent_cb)
+{
+    NetClientState *peer = sender->peer;
+    int i;
+
+    if (sender->link_down || !peer) {
+        return count;
+    }
+
+    qemu_send_batch_begin(sender);
+
+    if (!sender->filters_active[NET_FILTER_DIRECTION_TX] &&
+        !peer->filters_active[NET_FILTER_DIRECTION_RX]) {
+        i = qemu_net_queue_send_batch(peer->incoming_queue, sender,
+                                      QEMU_NET_PACKET_FLAG_NONE,
+                                      pkts, count, sent_cb);
+    } else {
+        for (i = 0; i < count; i++) {
+            if (!qemu_sendv_packet_async(sender, pkts[i].iov, pkts[i].iovcnt,
+                                         sent_cb) && sent_cb) {
+                break;
+            }
+        }
+    }
+
+    qemu_send_batch_end(sender);
+    return i;
+}
+
 NetClientState *qemu_find_netdev(const char *id)
 {
     NetClientState *nc;
@@ -964,6 +1112,9 @@ static int (* const net_client_init_fun[NET_CLIENT_DRIVER__MAX])(
 #ifdef CONFIG_NETMAP
         [NET_CLIENT_DRIVER_NETMAP]    = net_init_netmap,
 #endif
+#ifdef CONFIG_AF_XDP
+        [NET_CLIENT_DRIVER_AF_XDP]    = net_init_af_xdp,
+#endif
 #ifdef CONFIG_NET_BRIDGE
         [NET_CLIENT_DRIVER_BRIDGE]    = net_init_bridge,
 #endif
@@ -1052,6 +1203,9 @@ void show_netdevs(void)
 #ifdef CONFIG_NETMAP
         "netmap",
 #endif
+#ifdef CONFIG_AF_XDP
+        "af-xdp",
+#endif
 #ifdef CONFIG_POSIX
         "vhost-user",
 #endif
@@ -1251,6 +1405,60 @@ RxFilterInfoList *qmp_query_rx_filter(bool has_name, const char *name,
     return filter_list;
 }
 
+RscStatsInfoList *qmp_x_query_rsc_stats(bool has_name, const char *name,
+                                       Error **errp)
+{
+    NetClientState *nc;
+    RscStatsInfoList *stats_list = NULL, *last_entry = NULL;
+
+    QTAILQ_FOREACH(nc, &net_clients, next) {
+        RscStatsInfoList *entry;
+
+        if (has_name && strcmp(nc->name, name) != 0) {
+            continue;
+        }
+
+        if (nc->info->type != NET_CLIENT_DRIVER_NIC) {
+            if (has_name) {
+                error_setg(errp, "net client(%s) isn't a NIC", name);
+                return NULL;
+            }
+            continue;
+        }
+
+        /* the coalescing state is shared by all queues of the NIC */
+        if (nc->queue_index != 0) {
+            continue;
+        }
+
+        if (nc->info->query_rsc_stats) {
+            entry = g_malloc0(sizeof(*entry));
+            entry->value = nc->info->query_rsc_stats(nc);
+
+            if (!stats_list) {
+                stats_list = entry;
+            } else {
+                last_entry->next = entry;
+            }
+            last_entry = entry;
+        } else if (has_name) {
+            error_setg(errp, "net client(%s) doesn't support"
+                       " RSC statistics", name);
+            return NULL;
+        }
+
+        if (has_name) {
+            break;
+        }
+    }
+
+    if (stats_list == NULL && has_name) {
+        error_setg(errp, "invalid net client name: %s", name);
+    }
+
+    return stats_list;
+}
+
 void hmp_info_network(Monitor *mon, const QDict *qdict)
 {
     NetClientState *nc, *peer;
@@ -101,6 +101,9 @@ static struct nm_desc *netmap_open(const NetdevNetmapOptions *nm_opts,
     return nmd;
 }
 
+/* Packets passed to the peer at once */
+#define NETMAP_SEND_BATCH 32
+
 static void netmap_send(void *opaque);
 static void netmap_writable(void *opaque);
 
@@ -251,28 +254,62 @@ static void netmap_send(void *opaque)
     NetmapState *s = opaque;
     struct netmap_ring *ring = s->rx;
     unsigned int tail = ring->tail;
+    NetPacketIov pkts[NETMAP_SEND_BATCH];
+    uint32_t next[NETMAP_SEND_BATCH];
 
     /* Keep sending while there are available slots in the netmap
        RX ring and the forwarding path towards the peer is open. */
     while (ring->head != tail) {
         uint32_t i = ring->head;
+        uint32_t j = i;
         uint32_t idx;
-        bool morefrag;
+        bool morefrag = false;
         int iovcnt = 0;
-        int iovsize;
-
-        /* Get a (possibly multi-slot) packet. */
-        do {
-            idx = ring->slot[i].buf_idx;
-            morefrag = (ring->slot[i].flags & NS_MOREFRAG);
-            s->iov[iovcnt].iov_base = (void *)NETMAP_BUF(ring, idx);
-            s->iov[iovcnt].iov_len = ring->slot[i].len;
-            iovcnt++;
-            i = nm_ring_next(ring, i);
-        } while (i != tail && morefrag);
+        int count = 0;
+        int sent;
+
+        /* Get a batch of (possibly multi-slot) packets. */
+        while (j != tail && count < NETMAP_SEND_BATCH) {
+            int first = iovcnt;
+
+            do {
+                idx = ring->slot[j].buf_idx;
+                morefrag = (ring->slot[j].flags & NS_MOREFRAG);
+                s->iov[iovcnt].iov_base = (void *)NETMAP_BUF(ring, idx);
+                s->iov[iovcnt].iov_len = ring->slot[j].len;
+                iovcnt++;
+                j = nm_ring_next(ring, j);
+            } while (j != tail && morefrag && iovcnt < IOV_MAX);
+
+            if (unlikely(morefrag)) {
+                break;
+            }
+            pkts[count].iov = &s->iov[first];
+            pkts[count].iovcnt = iovcnt - first;
+            next[count++] = i = j;
+        }
 
         /* Advance ring->cur to tell the kernel that we have seen the slots. */
-        ring->cur = i;
+        ring->cur = j;
+
+        if (count) {
+            sent = qemu_sendv_batch_async(&s->nc, pkts, count,
+                                          netmap_send_completed);
+            if (sent < count) {
+                /*
+                 * The peer does not receive anymore. Packet number sent is
+                 * queued, release the slots up to it and leave the rest for
+                 * later. Stop reading from the backend until
+                 * netmap_send_completed().
+                 */
+                ring->head = ring->cur = next[sent];
+                netmap_read_poll(s, false);
+                break;
+            }
+
+            /* Release the slots to the kernel. */
+            ring->head = i;
+        }
 
         if (unlikely(morefrag)) {
             /* This is a truncated packet, so we can stop without releasing the
@@ -280,19 +317,6 @@ static void netmap_send(void *opaque)
              * re-read the complete packet the next time we are called. */
             break;
         }
-
-        iovsize = qemu_sendv_packet_async(&s->nc, s->iov, iovcnt,
-                                            netmap_send_completed);
-
-        /* Release the slots to the kernel. */
-        ring->head = i;
-
-        if (iovsize == 0) {
-            /* The peer does not receive anymore. Packet is queued, stop
-             * reading from the backend until netmap_send_completed(). */
-            netmap_read_poll(s, false);
-            break;
-        }
     }
 }
 
@@ -24,6 +24,7 @@
 #include "qemu/osdep.h"
 #include "net/queue.h"
 #include "qemu/queue.h"
+#include "qemu/iov.h"
 #include "net/net.h"
 
 /* The delivery handler may only return zero if it will call
@@ -40,11 +41,20 @@
  * unbounded queueing.
  */
 
+/*
+ * Delivered packets of the minimum size are kept for reuse, so that
+ * a peer that keeps running out of buffers doesn't cost a malloc and a
+ * free per packet.
+ */
+#define NET_PACKET_MIN_ALLOC    2048
+#define NET_QUEUE_FREE_MAX      16
+
 struct NetPacket {
     QTAILQ_ENTRY(NetPacket) entry;
     NetClientState *sender;
     unsigned flags;
     int size;
+    size_t alloc;
     NetPacketSent *sent_cb;
     uint8_t data[];
 };
@@ -56,6 +66,8 @@ struct NetQueue {
     NetQueueDeliverFunc *deliver;
 
     QTAILQ_HEAD(, NetPacket) packets;
+    QTAILQ_HEAD(, NetPacket) free_packets;
+    uint32_t nr_free;
 
     unsigned delivering : 1;
 };
@@ -72,6 +84,7 @@ NetQueue *qemu_new_net_queue(NetQueueDeliverFunc *deliver, void *opaque)
     queue->deliver = deliver;
 
     QTAILQ_INIT(&queue->packets);
+    QTAILQ_INIT(&queue->free_packets);
 
     queue->delivering = 0;
 
@@ -86,10 +99,42 @@ void qemu_del_net_queue(NetQueue *queue)
         QTAILQ_REMOVE(&queue->packets, packet, entry);
         g_free(packet);
     }
+    QTAILQ_FOREACH_SAFE(packet, &queue->free_packets, entry, next) {
+        QTAILQ_REMOVE(&queue->free_packets, packet, entry);
+        g_free(packet);
+    }
 
     g_free(queue);
 }
 
+static NetPacket *qemu_net_packet_alloc(NetQueue *queue, size_t size)
+{
+    NetPacket *packet;
+
+    if (size <= NET_PACKET_MIN_ALLOC && queue->nr_free) {
+        packet = QTAILQ_FIRST(&queue->free_packets);
+        QTAILQ_REMOVE(&queue->free_packets, packet, entry);
+        queue->nr_free--;
+        return packet;
+    }
+
+    size = MAX(size, NET_PACKET_MIN_ALLOC);
+    packet = g_malloc(sizeof(NetPacket) + size);
+    packet->alloc = size;
+    return packet;
+}
+
+static void qemu_net_packet_free(NetQueue *queue, NetPacket *packet)
+{
+    if (packet->alloc == NET_PACKET_MIN_ALLOC &&
+        queue->nr_free < NET_QUEUE_FREE_MAX) {
+        QTAILQ_INSERT_HEAD(&queue->free_packets, packet, entry);
+        queue->nr_free++;
+        return;
+    }
+    g_free(packet);
+}
+
 static void qemu_net_queue_append(NetQueue *queue,
                                   NetClientState *sender,
                                   unsigned flags,
@@ -102,7 +147,7 @@ static void qemu_net_queue_append(NetQueue *queue,
     if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
         return; /* drop if queue full and no callback */
     }
-    packet = g_malloc(sizeof(NetPacket) + size);
+    packet = qemu_net_packet_alloc(queue, size);
     packet->sender = sender;
     packet->flags = flags;
     packet->size = size;
@@ -131,7 +176,7 @@ void qemu_net_queue_append_iov(NetQueue *queue,
         max_len += iov[i].iov_len;
     }
 
-    packet = g_malloc(sizeof(NetPacket) + max_len);
+    packet = qemu_net_packet_alloc(queue, max_len);
     packet->sender = sender;
     packet->sent_cb = sent_cb;
     packet->flags = flags;
@@ -232,6 +277,36 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
     return ret;
 }
 
+int qemu_net_queue_send_batch(NetQueue *queue,
+                              NetClientState *sender,
+                              unsigned flags,
+                              const NetPacketIov *pkts,
+                              int count,
+                              NetPacketSent *sent_cb)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        /* Dropped, like qemu_sendv_packet_async() does */
+        if (iov_size(pkts[i].iov, pkts[i].iovcnt) > NET_BUFSIZE) {
+            continue;
+        }
+        if (queue->delivering || !qemu_can_send_packet(sender) ||
+            qemu_net_queue_deliver_iov(queue, sender, flags, pkts[i].iov,
+                                       pkts[i].iovcnt) == 0) {
+            qemu_net_queue_append_iov(queue, sender, flags, pkts[i].iov,
+                                      pkts[i].iovcnt, sent_cb);
+            if (sent_cb) {
+                return i;
+            }
+        }
+    }
+
+    qemu_net_queue_flush(queue);
+
+    return count;
+}
+
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
 {
     NetPacket *packet, *next;
@@ -243,7 +318,7 @@ void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
             if (packet->sent_cb) {
                 packet->sent_cb(packet->sender, 0);
             }
-            g_free(packet);
+            qemu_net_packet_free(queue, packet);
         }
     }
 }
@@ -276,7 +351,7 @@ bool qemu_net_queue_flush(NetQueue *queue)
             packet->sent_cb(packet->sender, ret);
         }
 
-        g_free(packet);
+        qemu_net_packet_free(queue, packet);
     }
     return true;
 }
@@ -94,6 +94,9 @@ typedef struct SlirpState {
     gchar *smb_dir;
 #endif
     GSList *fwd;
+    /* SO_SNDBUF and SO_RCVBUF for the host sockets, 0 for the default */
+    int sndbuf;
+    int rcvbuf;
 } SlirpState;
 
 static struct slirp_config_str *slirp_configs;
@@ -196,6 +199,19 @@ static void net_slirp_timer_mod(void *timer, int64_t expire_timer,
 
 static void net_slirp_register_poll_fd(int fd, void *opaque)
 {
+    SlirpState *s = opaque;
+
+    /*
+     * libslirp registers every host socket it creates, before it
+     * connects or listens, so that is the place to size its buffers.
+     * Failures are not fatal, the kernel defaults still work.
+     */
+    if (s->sndbuf) {
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &s->sndbuf, sizeof(s->sndbuf));
+    }
+    if (s->rcvbuf) {
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &s->rcvbuf, sizeof(s->rcvbuf));
+    }
     qemu_fd_register(fd);
 }
 
@@ -298,8 +314,11 @@ static void net_slirp_poll_notify(Notifier *notifier, void *data)
         break;
     case MAIN_LOOP_POLL_OK:
     case MAIN_LOOP_POLL_ERR:
+        /* Let the NIC notify the guest once for everything slirp sends */
+        qemu_send_batch_begin(&s->nc);
         slirp_pollfds_poll(s->slirp, poll->state == MAIN_LOOP_POLL_ERR,
                            net_slirp_get_revents, poll->pollfds);
+        qemu_send_batch_end(&s->nc);
         break;
     default:
         g_assert_not_reached();
@@ -357,6 +376,7 @@ static int net_slirp_init(NetClientState *peer, const char *model,
                           const char *smb_export, const char *vsmbserver,
                           const char **dnssearch, const char *vdomainname,
                           const char *tftp_server_name,
+                          uint64_t sndbuf, uint64_t rcvbuf,
                           Error **errp)
 {
     /* default settings according to historic slirp */
@@ -395,6 +415,11 @@ static int net_slirp_init(NetClientState *peer, const char *model,
         return -1;
     }
 
+    if (sndbuf > INT_MAX || rcvbuf > INT_MAX) {
+        error_setg(errp, "sndbuf and rcvbuf must be at most %d", INT_MAX);
+        return -1;
+    }
+
     if (vnetwork) {
         if (get_str_sep(buf, sizeof(buf), &vnetwork, '/') < 0) {
             if (!inet_aton(vnetwork, &net)) {
@@ -558,6 +583,8 @@ static int net_slirp_init(NetClientState *peer, const char *model,
              restricted ? "on" : "off");
 
     s = DO_UPCAST(SlirpState, nc, nc);
+    s->sndbuf = sndbuf;
+    s->rcvbuf = rcvbuf;
 
     s->slirp = slirp_init(restricted, ipv4, net, mask, host,
                           ipv6, ip6_prefix, vprefix6_len, ip6_host,
@@ -1100,7 +1127,9 @@ int net_init_slirp(const Netdev *netdev, const char *name,
                          user->bootfile, user->dhcpstart,
                          user->dns, user->ipv6_dns, user->smb,
                          user->smbserver, dnssearch, user->domainname,
-                         user->tftp_server_name, errp);
+                         user->tftp_server_name,
+                         user->has_sndbuf ? user->sndbuf : 0,
+                         user->has_rcvbuf ? user->rcvbuf : 0, errp);
 
     while (slirp_configs) {
         config = slirp_configs;
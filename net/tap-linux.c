@@ -316,3 +316,15 @@ int tap_fd_get_ifname(int fd, char *ifname)
     pstrcpy(ifname, sizeof(ifr.ifr_name), ifr.ifr_name);
     return 0;
 }
+
+int tap_fd_set_steering_ebpf(int fd, int prog_fd)
+{
+    /* A prog_fd of -1 detaches the program */
+    if (ioctl(fd, TUNSETSTEERINGEBPF, &prog_fd) != 0) {
+        error_report("TUNSETSTEERINGEBPF ioctl() failed: %s",
+                     strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
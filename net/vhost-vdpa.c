@@ -17,14 +17,15 @@
 #include "qemu/config-file.h"
 #include "qemu/error-report.h"
 #include "qemu/option.h"
+#include "qemu/bswap.h"
 #include "qapi/error.h"
 #include <sys/ioctl.h>
+#include <linux/vhost.h>
 #include <err.h>
 #include "standard-headers/linux/virtio_net.h"
 #include "monitor/monitor.h"
 #include "hw/virtio/vhost.h"
 
-/* Todo:need to add the multiqueue support here */
 typedef struct VhostVDPAState {
     NetClientState nc;
     struct vhost_vdpa vhost_vdpa;
@@ -56,6 +57,12 @@ const int vdpa_feature_bits[] = {
     VIRTIO_F_RING_PACKED,
     VIRTIO_NET_F_GUEST_ANNOUNCE,
     VIRTIO_NET_F_STATUS,
+    VIRTIO_NET_F_CTRL_VQ,
+    VIRTIO_NET_F_CTRL_RX,
+    VIRTIO_NET_F_CTRL_VLAN,
+    VIRTIO_NET_F_CTRL_RX_EXTRA,
+    VIRTIO_NET_F_CTRL_MAC_ADDR,
+    VIRTIO_NET_F_MQ,
     VHOST_INVALID_FEATURE_BIT
 };
 
@@ -89,17 +96,7 @@ static int vhost_vdpa_net_check_device_id(struct vhost_net *net)
     return ret;
 }
 
-static void vhost_vdpa_del(NetClientState *ncs)
-{
-    VhostVDPAState *s;
-    assert(ncs->info->type == NET_CLIENT_DRIVER_VHOST_VDPA);
-    s = DO_UPCAST(VhostVDPAState, nc, ncs);
-    if (s->vhost_net) {
-        vhost_net_cleanup(s->vhost_net);
-    }
-}
-
-static int vhost_vdpa_add(NetClientState *ncs, void *be)
+static int vhost_vdpa_add(NetClientState *ncs, void *be, int nvqs)
 {
     VhostNetOptions options;
     struct vhost_net *net = NULL;
@@ -112,6 +109,7 @@ static int vhost_vdpa_add(NetClientState *ncs, void *be)
     options.net_backend = ncs;
     options.opaque      = be;
     options.busyloop_timeout = 0;
+    options.nvqs = nvqs;
 
     net = vhost_net_init(&options);
     if (!net) {
@@ -131,8 +129,9 @@ static int vhost_vdpa_add(NetClientState *ncs, void *be)
 err:
     if (net) {
         vhost_net_cleanup(net);
+        g_free(net);
     }
-    vhost_vdpa_del(ncs);
+    s->vhost_net = NULL;
     return -1;
 }
 
@@ -145,10 +144,11 @@ static void vhost_vdpa_cleanup(NetClientState *nc)
         g_free(s->vhost_net);
         s->vhost_net = NULL;
     }
-     if (s->vhost_vdpa.device_fd >= 0) {
+    /* The device is shared by all queues, the first one owns it */
+    if (s->vhost_vdpa.device_fd >= 0 && s->vhost_vdpa.index == 0) {
         qemu_close(s->vhost_vdpa.device_fd);
-        s->vhost_vdpa.device_fd = -1;
     }
+    s->vhost_vdpa.device_fd = -1;
 }
 
 static bool vhost_vdpa_has_vnet_hdr(NetClientState *nc)
@@ -177,26 +177,61 @@ static NetClientInfo net_vhost_vdpa_info = {
         .has_ufo = vhost_vdpa_has_ufo,
 };
 
-static int net_vhost_vdpa_init(NetClientState *peer, const char *device,
-                               const char *name, const char *vhostdev)
+static NetClientState *net_vhost_vdpa_init(NetClientState *peer,
+                                           const char *device,
+                                           const char *name,
+                                           int vdpa_device_fd,
+                                           int queue_pair_index,
+                                           int nvqs,
+                                           bool is_datapath)
 {
     NetClientState *nc = NULL;
     VhostVDPAState *s;
-    int vdpa_device_fd = -1;
     int ret = 0;
     assert(name);
     nc = qemu_new_net_client(&net_vhost_vdpa_info, peer, device, name);
     snprintf(nc->info_str, sizeof(nc->info_str), TYPE_VHOST_VDPA);
-    nc->queue_index = 0;
+    nc->queue_index = queue_pair_index;
+    nc->is_datapath = is_datapath;
     s = DO_UPCAST(VhostVDPAState, nc, nc);
-    vdpa_device_fd = qemu_open_old(vhostdev, O_RDWR);
-    if (vdpa_device_fd == -1) {
-        return -errno;
-    }
     s->vhost_vdpa.device_fd = vdpa_device_fd;
-    ret = vhost_vdpa_add(nc, (void *)&s->vhost_vdpa);
-    assert(s->vhost_net);
-    return ret;
+    s->vhost_vdpa.index = queue_pair_index;
+    ret = vhost_vdpa_add(nc, (void *)&s->vhost_vdpa, nvqs);
+    if (ret) {
+        /* Also deletes the queues created before this one */
+        qemu_del_net_client(nc);
+        return NULL;
+    }
+    return nc;
+}
+
+static int vhost_vdpa_get_max_queue_pairs(int fd, bool *has_cvq, Error **errp)
+{
+    unsigned long config_size = offsetof(struct vhost_vdpa_config, buf);
+    g_autofree struct vhost_vdpa_config *config = NULL;
+    uint64_t features;
+
+    if (ioctl(fd, VHOST_GET_FEATURES, &features)) {
+        error_setg_errno(errp, errno,
+                         "Could not get the features of the vhost-vdpa device");
+        return -1;
+    }
+
+    *has_cvq = features & (1ULL << VIRTIO_NET_F_CTRL_VQ);
+    if (!(features & (1ULL << VIRTIO_NET_F_MQ))) {
+        return 1;
+    }
+
+    config = g_malloc0(config_size + sizeof(uint16_t));
+    config->off = offsetof(struct virtio_net_config, max_virtqueue_pairs);
+    config->len = sizeof(uint16_t);
+    if (ioctl(fd, VHOST_VDPA_GET_CONFIG, config)) {
+        error_setg_errno(errp, errno,
+                         "Could not get the config of the vhost-vdpa device");
+        return -1;
+    }
+
+    return lduw_le_p(config->buf);
 }
 
 static int net_vhost_check_net(void *opaque, QemuOpts *opts, Error **errp)
@@ -221,6 +256,9 @@ int net_init_vhost_vdpa(const Netdev *netdev, const char *name,
                         NetClientState *peer, Error **errp)
 {
     const NetdevVhostVDPAOptions *opts;
+    NetClientState *nc;
+    int vdpa_device_fd, queue_pairs, i;
+    bool has_cvq;
 
     assert(netdev->type == NET_CLIENT_DRIVER_VHOST_VDPA);
     opts = &netdev->u.vhost_vdpa;
@@ -229,5 +267,43 @@ int net_init_vhost_vdpa(const Netdev *netdev, const char *name,
                           (char *)name, errp)) {
         return -1;
     }
-    return net_vhost_vdpa_init(peer, TYPE_VHOST_VDPA, name, opts->vhostdev);
+
+    vdpa_device_fd = qemu_open_old(opts->vhostdev, O_RDWR);
+    if (vdpa_device_fd == -1) {
+        error_setg_errno(errp, errno, "Could not open '%s'", opts->vhostdev);
+        return -errno;
+    }
+
+    queue_pairs = vhost_vdpa_get_max_queue_pairs(vdpa_device_fd, &has_cvq,
+                                                 errp);
+    if (queue_pairs < 0) {
+        qemu_close(vdpa_device_fd);
+        return -1;
+    }
+    /* The guest sees the device config, so all queue pairs must be used */
+    if (opts->has_queues && opts->queues != queue_pairs) {
+        error_setg(errp, "vhost-vdpa device has %d queue pairs, "
+                   "%" PRId64 " requested", queue_pairs, opts->queues);
+        qemu_close(vdpa_device_fd);
+        return -1;
+    }
+
+    /* From here on the fd is closed with the first queue */
+    for (i = 0; i < queue_pairs; i++) {
+        nc = net_vhost_vdpa_init(peer, TYPE_VHOST_VDPA, name,
+                                 vdpa_device_fd, i, 2, true);
+        if (!nc) {
+            return -1;
+        }
+    }
+
+    if (has_cvq) {
+        nc = net_vhost_vdpa_init(peer, TYPE_VHOST_VDPA, name,
+                                 vdpa_device_fd, i, 1, false);
+        if (!nc) {
+            return -1;
+        }
+    }
+
+    return 0;
 }
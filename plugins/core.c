@@ -194,10 +194,53 @@ plugin_register_cb_udata(qemu_plugin_id_t id, enum qemu_plugin_event ev,
     do_plugin_register_cb(id, ev, func, udata);
 }
 
+/*
+ * Make room for @cpu in all the scoreboards. Inline ops access them
+ * without taking plugin.lock, so other vCPUs must not be running while
+ * they are reallocated. In system mode this can only happen for the
+ * first vCPU, since we then allocate room for max_cpus and all vCPUs are
+ * created before any of them starts running guest code.
+ */
+static void plugin_grow_scoreboards(CPUState *cpu)
+{
+    struct qemu_plugin_scoreboard *score;
+    size_t old_size, new_size;
+
+    if (cpu->cpu_index < qatomic_read(&plugin.scoreboard_alloc_size)) {
+        return;
+    }
+
+#ifdef CONFIG_USER_ONLY
+    start_exclusive();
+#endif
+    qemu_rec_mutex_lock(&plugin.lock);
+    old_size = plugin.scoreboard_alloc_size;
+    if (cpu->cpu_index >= old_size) {
+#ifdef CONFIG_USER_ONLY
+        new_size = pow2ceil(cpu->cpu_index + 1);
+#else
+        new_size = MAX(cpu->cpu_index + 1, qemu_plugin_n_max_vcpus());
+#endif
+        QLIST_FOREACH(score, &plugin.scoreboards, entry) {
+            score->data = g_realloc(score->data,
+                                    new_size * score->element_size);
+            memset((char *)score->data + old_size * score->element_size, 0,
+                   (new_size - old_size) * score->element_size);
+        }
+        qatomic_set(&plugin.scoreboard_alloc_size, new_size);
+    }
+    qemu_rec_mutex_unlock(&plugin.lock);
+#ifdef CONFIG_USER_ONLY
+    end_exclusive();
+#endif
+}
+
 void qemu_plugin_vcpu_init_hook(CPUState *cpu)
 {
     bool success;
 
+    plugin_grow_scoreboards(cpu);
+
     qemu_rec_mutex_lock(&plugin.lock);
     plugin_cpu_update__locked(&cpu->cpu_index, NULL, NULL);
     success = g_hash_table_insert(plugin.cpu_ht, &cpu->cpu_index,
@@ -276,6 +319,28 @@ void plugin_register_inline_op(GArray **arr,
     dyn_cb->rw = rw;
     dyn_cb->inline_insn.op = op;
     dyn_cb->inline_insn.imm = imm;
+    dyn_cb->inline_insn.entry.score = NULL;
+    dyn_cb->inline_insn.entry.offset = 0;
+}
+
+void plugin_register_inline_op_per_vcpu(GArray **arr,
+                                        enum qemu_plugin_mem_rw rw,
+                                        enum qemu_plugin_op op,
+                                        qemu_plugin_u64 entry,
+                                        uint64_t imm)
+{
+    struct qemu_plugin_dyn_cb *dyn_cb;
+
+    g_assert(entry.score);
+    g_assert(entry.offset + sizeof(uint64_t) <= entry.score->element_size);
+
+    dyn_cb = plugin_get_dyn_cb(arr);
+    dyn_cb->userp = NULL;
+    dyn_cb->type = PLUGIN_CB_INLINE;
+    dyn_cb->rw = rw;
+    dyn_cb->inline_insn.op = op;
+    dyn_cb->inline_insn.imm = imm;
+    dyn_cb->inline_insn.entry = entry;
 }
 
 static inline uint32_t cb_to_tcg_flags(enum qemu_plugin_cb_flags flags)
@@ -396,6 +461,67 @@ void qemu_plugin_register_vcpu_resume_cb(qemu_plugin_id_t id,
     plugin_register_cb(id, QEMU_PLUGIN_EV_VCPU_RESUME, cb);
 }
 
+static void plugin_vcpu_sample__async(CPUState *cpu, run_on_cpu_data data)
+{
+    CPUArchState *env = cpu->env_ptr;
+    struct qemu_plugin_cb *cb, *next;
+    target_ulong pc, cs_base;
+    uint32_t flags;
+
+    cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
+    QLIST_FOREACH_SAFE_RCU(cb, &plugin.cb_lists[QEMU_PLUGIN_EV_VCPU_SAMPLE],
+                           entry, next) {
+        qemu_plugin_vcpu_sample_cb_t func = cb->f.vcpu_sample;
+
+        func(cb->ctx->id, cpu->cpu_index, pc);
+    }
+}
+
+/*
+ * Kick the vCPUs that are executing guest code once per period; the
+ * samples are then taken by the vCPUs themselves, at the next TB boundary.
+ */
+static void *plugin_sample_thread(void *arg)
+{
+    CPUState *cpu;
+
+    rcu_register_thread();
+    for (;;) {
+        uint64_t period = qatomic_read(&plugin.sample_period_ns);
+
+        g_usleep(MAX(period / 1000, 1));
+        if (QLIST_EMPTY_RCU(&plugin.cb_lists[QEMU_PLUGIN_EV_VCPU_SAMPLE])) {
+            continue;
+        }
+        WITH_RCU_READ_LOCK_GUARD() {
+            CPU_FOREACH(cpu) {
+                if (qatomic_read(&cpu->running)) {
+                    async_run_on_cpu(cpu, plugin_vcpu_sample__async,
+                                     RUN_ON_CPU_NULL);
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+void qemu_plugin_register_vcpu_sample_cb(qemu_plugin_id_t id,
+                                         uint64_t period_ns,
+                                         qemu_plugin_vcpu_sample_cb_t cb)
+{
+    g_assert(period_ns);
+
+    QEMU_LOCK_GUARD(&plugin.lock);
+    if (!plugin.sample_period_ns) {
+        qatomic_set(&plugin.sample_period_ns, period_ns);
+        qemu_thread_create(&plugin.sample_thread, "plugin-sample",
+                           plugin_sample_thread, NULL, QEMU_THREAD_DETACHED);
+    } else if (period_ns < plugin.sample_period_ns) {
+        qatomic_set(&plugin.sample_period_ns, period_ns);
+    }
+    plugin_register_cb(id, QEMU_PLUGIN_EV_VCPU_SAMPLE, cb);
+}
+
 void qemu_plugin_register_flush_cb(qemu_plugin_id_t id,
                                    qemu_plugin_simple_cb_t cb)
 {
@@ -416,14 +542,24 @@ void qemu_plugin_flush_cb(void)
     plugin_cb__simple(QEMU_PLUGIN_EV_FLUSH);
 }
 
-void exec_inline_op(struct qemu_plugin_dyn_cb *cb)
+void exec_inline_op(struct qemu_plugin_dyn_cb *cb, int cpu_index)
 {
+    qemu_plugin_u64 entry = cb->inline_insn.entry;
     uint64_t *val = cb->userp;
 
+    if (entry.score) {
+        val = (uint64_t *)((char *)entry.score->data +
+                           cpu_index * entry.score->element_size +
+                           entry.offset);
+    }
+
     switch (cb->inline_insn.op) {
     case QEMU_PLUGIN_INLINE_ADD_U64:
         *val += cb->inline_insn.imm;
         break;
+    case QEMU_PLUGIN_INLINE_STORE_U64:
+        *val = cb->inline_insn.imm;
+        break;
     default:
         g_assert_not_reached();
     }
@@ -450,7 +586,7 @@ void qemu_plugin_vcpu_mem_cb(CPUState *cpu, uint64_t vaddr, uint32_t info)
             cb->f.vcpu_mem(cpu->cpu_index, info, vaddr, cb->userp);
             break;
         case PLUGIN_CB_INLINE:
-            exec_inline_op(cb);
+            exec_inline_op(cb, cpu->cpu_index);
             break;
         default:
             g_assert_not_reached();
@@ -496,6 +632,7 @@ static void __attribute__((__constructor__)) plugin_init(void)
     plugin.id_ht = g_hash_table_new(g_int64_hash, g_int64_equal);
     plugin.cpu_ht = g_hash_table_new(g_int_hash, g_int_equal);
     QTAILQ_INIT(&plugin.ctxs);
+    QLIST_INIT(&plugin.scoreboards);
     qht_init(&plugin.dyn_cb_arr_ht, plugin_dyn_cb_arr_cmp, 16,
              QHT_MODE_AUTO_RESIZE);
     atexit(qemu_plugin_atexit_cb);
@@ -43,6 +43,27 @@ struct qemu_plugin_state {
      * the code cache is flushed.
      */
     struct qht dyn_cb_arr_ht;
+    /*
+     * All scoreboards, and the number of vCPU elements allocated in each
+     * of them. Both are protected by @lock; growing the scoreboards also
+     * requires the vCPUs to be stopped, since inline ops access them
+     * without taking any lock.
+     */
+    QLIST_HEAD(, qemu_plugin_scoreboard) scoreboards;
+    size_t scoreboard_alloc_size;
+    /* shortest period registered for QEMU_PLUGIN_EV_VCPU_SAMPLE, or 0 */
+    uint64_t sample_period_ns;
+    QemuThread sample_thread;
+};
+
+struct qemu_plugin_scoreboard {
+    /*
+     * Generated code loads @data on every access, so it can be reallocated
+     * without flushing the code cache.
+     */
+    void *data;
+    size_t element_size;
+    QLIST_ENTRY(qemu_plugin_scoreboard) entry;
 };
 
 
@@ -68,6 +89,12 @@ void plugin_register_inline_op(GArray **arr,
                                enum qemu_plugin_op op, void *ptr,
                                uint64_t imm);
 
+void plugin_register_inline_op_per_vcpu(GArray **arr,
+                                        enum qemu_plugin_mem_rw rw,
+                                        enum qemu_plugin_op op,
+                                        qemu_plugin_u64 entry,
+                                        uint64_t imm);
+
 void plugin_reset_uninstall(qemu_plugin_id_t id,
                             qemu_plugin_simple_cb_t cb,
                             bool reset);
@@ -94,6 +121,6 @@ void plugin_register_vcpu_mem_cb(GArray **arr,
                                  enum qemu_plugin_mem_rw rw,
                                  void *udata);
 
-void exec_inline_op(struct qemu_plugin_dyn_cb *cb);
+void exec_inline_op(struct qemu_plugin_dyn_cb *cb, int cpu_index);
 
 #endif /* _PLUGIN_INTERNAL_H_ */
@@ -33,12 +33,15 @@
 #include "qapi/qobject-output-visitor.h"
 #include "qapi/qmp/qjson.h"
 #include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qlist.h"
+#include "qapi/qmp/qnum.h"
 #include "qapi/qmp/qstring.h"
 #include "qemu/cutils.h"
 #include "qemu/config-file.h"
 #include "qemu/option.h"
 #include "qemu/error-report.h"
 #include "qemu/log.h"
+#include "qemu/log-histogram.h"
 #include "qemu/main-loop.h"
 #include "qemu/module.h"
 #include "qemu/sockets.h"
@@ -83,6 +86,8 @@ enum {
     OPTION_MERGE = 274,
     OPTION_BITMAPS = 275,
     OPTION_FORCE = 276,
+    OPTION_RWMIXREAD = 277,
+    OPTION_RANDOM = 278,
 };
 
 typedef enum OutputFormat {
@@ -212,6 +217,7 @@ static void QEMU_NORETURN help(void)
            "  '-f' first image format\n"
            "  '-F' second image format\n"
            "  '-s' run in Strict mode - fail on different image size or sector allocation\n"
+           "  '-m' number of parallel coroutines (default: 8)\n"
            "\n"
            "Parameters to dd subcommand:\n"
            "  'bs=BYTES' read and write up to BYTES bytes at a time "
@@ -1176,18 +1182,9 @@ done:
  */
 static int64_t find_nonzero(const uint8_t *buf, int64_t n)
 {
-    int64_t i;
-    int64_t end = QEMU_ALIGN_DOWN(n, BDRV_SECTOR_SIZE);
+    int64_t i = buffer_zero_prefix(buf, n);
 
-    for (i = 0; i < end; i += BDRV_SECTOR_SIZE) {
-        if (!buffer_is_zero(buf + i, BDRV_SECTOR_SIZE)) {
-            return i;
-        }
-    }
-    if (i < n && !buffer_is_zero(buf + i, n - end)) {
-        return i;
-    }
-    return -1;
+    return i == n ? -1 : QEMU_ALIGN_DOWN(i, BDRV_SECTOR_SIZE);
 }
 
 /*
@@ -1205,17 +1202,17 @@ static int is_allocated_sectors(const uint8_t *buf, int n, int *pnum,
 {
     bool is_zero;
     int i, tail;
+    size_t len = (size_t)n * BDRV_SECTOR_SIZE;
 
     if (n <= 0) {
         *pnum = 0;
         return 0;
     }
-    is_zero = buffer_is_zero(buf, BDRV_SECTOR_SIZE);
-    for(i = 1; i < n; i++) {
-        buf += BDRV_SECTOR_SIZE;
-        if (is_zero != buffer_is_zero(buf, BDRV_SECTOR_SIZE)) {
-            break;
-        }
+    i = buffer_zero_prefix(buf, len) / BDRV_SECTOR_SIZE;
+    is_zero = i > 0;
+    if (!is_zero) {
+        i = buffer_nonzero_prefix(buf, len, BDRV_SECTOR_SIZE) /
+            BDRV_SECTOR_SIZE;
     }
 
     tail = (sector_num + i) & (alignment - 1);
@@ -1351,6 +1348,201 @@ static int check_empty_sectors(BlockBackend *blk, int64_t offset,
     return 0;
 }
 
+#define MAX_COROUTINES 16
+
+typedef struct ImgCompareState {
+    BlockBackend *blk1, *blk2;
+    const char *filename1, *filename2;
+    int64_t total_size1, total_size2;
+    int64_t total_size;
+    uint64_t progress_base;
+    bool strict;
+    long num_coroutines;
+    int running_coroutines;
+    CoMutex lock;
+    /* Start of the next chunk to be compared; protected by lock */
+    int64_t offset;
+    /*
+     * The difference or error at the lowest offset found so far. Chunks
+     * are handed out in order, so once all coroutines are done this is
+     * what a sequential comparison would have stopped at.
+     */
+    int64_t fail_offset;
+    int fail_ret;
+    char *fail_msg;
+} ImgCompareState;
+
+static void GCC_FMT_ATTR(4, 5)
+compare_set_failure(ImgCompareState *s, int64_t offset, int ret,
+                    const char *fmt, ...)
+{
+    va_list ap;
+
+    if (offset >= s->fail_offset) {
+        return;
+    }
+
+    g_free(s->fail_msg);
+    va_start(ap, fmt);
+    s->fail_msg = g_strdup_vprintf(fmt, ap);
+    va_end(ap);
+    s->fail_offset = offset;
+    s->fail_ret = ret;
+}
+
+/* Coroutine version of check_empty_sectors() */
+static int coroutine_fn compare_co_check_empty(ImgCompareState *s,
+                                               BlockBackend *blk,
+                                               const char *filename,
+                                               int64_t offset, int64_t bytes,
+                                               uint8_t *buf)
+{
+    int64_t idx;
+    int ret;
+
+    ret = blk_co_pread(blk, offset, bytes, buf, 0);
+    if (ret < 0) {
+        compare_set_failure(s, offset, 4, "Error while reading offset %"
+                            PRId64 " of %s: %s",
+                            offset, filename, strerror(-ret));
+        return 4;
+    }
+    idx = find_nonzero(buf, bytes);
+    if (idx >= 0) {
+        compare_set_failure(s, offset + idx, 1,
+                            "Content mismatch at offset %" PRId64 "!",
+                            offset + idx);
+        return 1;
+    }
+
+    return 0;
+}
+
+static int coroutine_fn compare_co_data(ImgCompareState *s, int64_t offset,
+                                        int64_t bytes, uint8_t *buf1,
+                                        uint8_t *buf2)
+{
+    int64_t pnum;
+    int ret;
+
+    ret = blk_co_pread(s->blk1, offset, bytes, buf1, 0);
+    if (ret < 0) {
+        compare_set_failure(s, offset, 4, "Error while reading offset %"
+                            PRId64 " of %s: %s",
+                            offset, s->filename1, strerror(-ret));
+        return 4;
+    }
+    ret = blk_co_pread(s->blk2, offset, bytes, buf2, 0);
+    if (ret < 0) {
+        compare_set_failure(s, offset, 4, "Error while reading offset %"
+                            PRId64 " of %s: %s",
+                            offset, s->filename2, strerror(-ret));
+        return 4;
+    }
+
+    /*
+     * Compare the whole chunk in one go; only look for the first differing
+     * sector if there is a mismatch at all.
+     */
+    if (!memcmp(buf1, buf2, bytes)) {
+        return 0;
+    }
+    ret = compare_buffers(buf1, buf2, bytes, &pnum);
+    assert(ret || pnum != bytes);
+    compare_set_failure(s, offset + (ret ? 0 : pnum), 1,
+                        "Content mismatch at offset %" PRId64 "!",
+                        offset + (ret ? 0 : pnum));
+    return 1;
+}
+
+static void coroutine_fn compare_co_do_compare(void *opaque)
+{
+    ImgCompareState *s = opaque;
+    BlockDriverState *bs1 = blk_bs(s->blk1);
+    BlockDriverState *bs2 = blk_bs(s->blk2);
+    uint8_t *buf1, *buf2;
+
+    s->running_coroutines++;
+    buf1 = blk_blockalign(s->blk1, IO_BUF_SIZE);
+    buf2 = blk_blockalign(s->blk2, IO_BUF_SIZE);
+
+    while (1) {
+        int64_t offset, chunk, pnum1, pnum2;
+        int status1, status2;
+        bool allocated1, allocated2, zero;
+        int ret = 0;
+
+        qemu_co_mutex_lock(&s->lock);
+        if (s->fail_ret || s->offset >= s->total_size) {
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+        offset = s->offset;
+
+        status1 = bdrv_block_status_above(bs1, NULL, offset,
+                                          s->total_size1 - offset, &pnum1,
+                                          NULL, NULL);
+        if (status1 < 0) {
+            compare_set_failure(s, offset, 3,
+                                "Sector allocation test failed for %s",
+                                s->filename1);
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+
+        status2 = bdrv_block_status_above(bs2, NULL, offset,
+                                          s->total_size2 - offset, &pnum2,
+                                          NULL, NULL);
+        if (status2 < 0) {
+            compare_set_failure(s, offset, 3,
+                                "Sector allocation test failed for %s",
+                                s->filename2);
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+
+        if (s->strict && status1 != status2) {
+            compare_set_failure(s, offset, 1, "Strict mode: Offset %" PRId64
+                                " block status mismatch!", offset);
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+
+        assert(pnum1 && pnum2);
+        chunk = MIN(pnum1, pnum2);
+        allocated1 = status1 & BDRV_BLOCK_ALLOCATED;
+        allocated2 = status2 & BDRV_BLOCK_ALLOCATED;
+        zero = (status1 & BDRV_BLOCK_ZERO) && (status2 & BDRV_BLOCK_ZERO);
+        if (!zero && (allocated1 || allocated2)) {
+            chunk = MIN(chunk, IO_BUF_SIZE);
+        }
+        s->offset += chunk;
+        qemu_co_mutex_unlock(&s->lock);
+
+        if (zero) {
+            /* nothing to do */
+        } else if (allocated1 == allocated2) {
+            if (allocated1) {
+                ret = compare_co_data(s, offset, chunk, buf1, buf2);
+            }
+        } else if (allocated1) {
+            ret = compare_co_check_empty(s, s->blk1, s->filename1,
+                                         offset, chunk, buf1);
+        } else {
+            ret = compare_co_check_empty(s, s->blk2, s->filename2,
+                                         offset, chunk, buf1);
+        }
+        if (ret) {
+            break;
+        }
+        qemu_progress_print(((float) chunk / s->progress_base) * 100, 100);
+    }
+
+    qemu_vfree(buf1);
+    qemu_vfree(buf2);
+    s->running_coroutines--;
+}
+
 /*
  * Compares two images. Exit codes:
  *
@@ -1362,11 +1554,8 @@ static int img_compare(int argc, char **argv)
 {
     const char *fmt1 = NULL, *fmt2 = NULL, *cache, *filename1, *filename2;
     BlockBackend *blk1, *blk2;
-    BlockDriverState *bs1, *bs2;
     int64_t total_size1, total_size2;
-    uint8_t *buf1 = NULL, *buf2 = NULL;
-    int64_t pnum1, pnum2;
-    int allocated1, allocated2;
+    uint8_t *buf1 = NULL;
     int ret = 0; /* return value - 0 Ident, 1 Different, >1 Error */
     bool progress = false, quiet = false, strict = false;
     int flags;
@@ -1374,10 +1563,12 @@ static int img_compare(int argc, char **argv)
     int64_t total_size;
     int64_t offset = 0;
     int64_t chunk;
-    int c;
+    int c, i;
     uint64_t progress_base;
     bool image_opts = false;
     bool force_share = false;
+    long num_coroutines = 8;
+    ImgCompareState s;
 
     cache = BDRV_DEFAULT_CACHE;
     for (;;) {
@@ -1388,7 +1579,7 @@ static int img_compare(int argc, char **argv)
             {"force-share", no_argument, 0, 'U'},
             {0, 0, 0, 0}
         };
-        c = getopt_long(argc, argv, ":hf:F:T:pqsU",
+        c = getopt_long(argc, argv, ":hf:F:T:pqsm:U",
                         long_options, NULL);
         if (c == -1) {
             break;
@@ -1421,6 +1612,15 @@ static int img_compare(int argc, char **argv)
         case 's':
             strict = true;
             break;
+        case 'm':
+            if (qemu_strtol(optarg, NULL, 0, &num_coroutines) ||
+                num_coroutines < 1 || num_coroutines > MAX_COROUTINES) {
+                error_report("Invalid number of coroutines. Allowed number of"
+                             " coroutines is between 1 and %d", MAX_COROUTINES);
+                ret = 2;
+                goto out4;
+            }
+            break;
         case 'U':
             force_share = true;
             break;
@@ -1482,11 +1682,8 @@ static int img_compare(int argc, char **argv)
         ret = 2;
         goto out2;
     }
-    bs1 = blk_bs(blk1);
-    bs2 = blk_bs(blk2);
 
     buf1 = blk_blockalign(blk1, IO_BUF_SIZE);
-    buf2 = blk_blockalign(blk2, IO_BUF_SIZE);
     total_size1 = blk_getlength(blk1);
     if (total_size1 < 0) {
         error_report("Can't get size of %s: %s",
@@ -1512,87 +1709,43 @@ static int img_compare(int argc, char **argv)
         goto out;
     }
 
-    while (offset < total_size) {
-        int status1, status2;
-
-        status1 = bdrv_block_status_above(bs1, NULL, offset,
-                                          total_size1 - offset, &pnum1, NULL,
-                                          NULL);
-        if (status1 < 0) {
-            ret = 3;
-            error_report("Sector allocation test failed for %s", filename1);
-            goto out;
-        }
-        allocated1 = status1 & BDRV_BLOCK_ALLOCATED;
-
-        status2 = bdrv_block_status_above(bs2, NULL, offset,
-                                          total_size2 - offset, &pnum2, NULL,
-                                          NULL);
-        if (status2 < 0) {
-            ret = 3;
-            error_report("Sector allocation test failed for %s", filename2);
-            goto out;
-        }
-        allocated2 = status2 & BDRV_BLOCK_ALLOCATED;
-
-        assert(pnum1 && pnum2);
-        chunk = MIN(pnum1, pnum2);
+    s = (ImgCompareState) {
+        .blk1           = blk1,
+        .blk2           = blk2,
+        .filename1      = filename1,
+        .filename2      = filename2,
+        .total_size1    = total_size1,
+        .total_size2    = total_size2,
+        .total_size     = total_size,
+        .progress_base  = progress_base,
+        .strict         = strict,
+        .num_coroutines = num_coroutines,
+        .fail_offset    = INT64_MAX,
+    };
+    qemu_co_mutex_init(&s.lock);
 
-        if (strict) {
-            if (status1 != status2) {
-                ret = 1;
-                qprintf(quiet, "Strict mode: Offset %" PRId64
-                        " block status mismatch!\n", offset);
-                goto out;
-            }
-        }
-        if ((status1 & BDRV_BLOCK_ZERO) && (status2 & BDRV_BLOCK_ZERO)) {
-            /* nothing to do */
-        } else if (allocated1 == allocated2) {
-            if (allocated1) {
-                int64_t pnum;
+    /*
+     * Compare the range covered by both images with several coroutines, so
+     * that reads from the two images (and of consecutive chunks) overlap.
+     */
+    for (i = 0; i < s.num_coroutines; i++) {
+        qemu_coroutine_enter(qemu_coroutine_create(compare_co_do_compare, &s));
+    }
+    while (s.running_coroutines) {
+        main_loop_wait(false);
+    }
 
-                chunk = MIN(chunk, IO_BUF_SIZE);
-                ret = blk_pread(blk1, offset, buf1, chunk);
-                if (ret < 0) {
-                    error_report("Error while reading offset %" PRId64
-                                 " of %s: %s",
-                                 offset, filename1, strerror(-ret));
-                    ret = 4;
-                    goto out;
-                }
-                ret = blk_pread(blk2, offset, buf2, chunk);
-                if (ret < 0) {
-                    error_report("Error while reading offset %" PRId64
-                                 " of %s: %s",
-                                 offset, filename2, strerror(-ret));
-                    ret = 4;
-                    goto out;
-                }
-                ret = compare_buffers(buf1, buf2, chunk, &pnum);
-                if (ret || pnum != chunk) {
-                    qprintf(quiet, "Content mismatch at offset %" PRId64 "!\n",
-                            offset + (ret ? 0 : pnum));
-                    ret = 1;
-                    goto out;
-                }
-            }
+    if (s.fail_ret) {
+        if (s.fail_ret == 1) {
+            qprintf(quiet, "%s\n", s.fail_msg);
         } else {
-            chunk = MIN(chunk, IO_BUF_SIZE);
-            if (allocated1) {
-                ret = check_empty_sectors(blk1, offset, chunk,
-                                          filename1, buf1, quiet);
-            } else {
-                ret = check_empty_sectors(blk2, offset, chunk,
-                                          filename2, buf1, quiet);
-            }
-            if (ret) {
-                goto out;
-            }
+            error_report("%s", s.fail_msg);
         }
-        offset += chunk;
-        qemu_progress_print(((float) chunk / progress_base) * 100, 100);
+        g_free(s.fail_msg);
+        ret = s.fail_ret;
+        goto out;
     }
+    offset = total_size;
 
     if (total_size1 != total_size2) {
         BlockBackend *blk_over;
@@ -1636,7 +1789,6 @@ static int img_compare(int argc, char **argv)
 
 out:
     qemu_vfree(buf1);
-    qemu_vfree(buf2);
     blk_unref(blk2);
 out2:
     blk_unref(blk1);
@@ -1670,9 +1822,11 @@ enum ImgConvertBlockStatus {
     BLK_BACKING_FILE,
 };
 
-#define MAX_COROUTINES 16
 #define CONVERT_THROTTLE_GROUP "img_convert"
 
+/* How often the number of active coroutines is adjusted with -m auto */
+#define CONVERT_AUTO_INTERVAL_NS (250 * SCALE_MS)
+
 typedef struct ImgConvertState {
     BlockBackend **src;
     int64_t *src_sectors;
@@ -1705,6 +1859,21 @@ typedef struct ImgConvertState {
     int64_t wait_sector_num[MAX_COROUTINES];
     CoMutex lock;
     int ret;
+
+    /*
+     * With -m auto, num_coroutines coroutines are created, but only
+     * active_limit of them may process a request at the same time. The
+     * limit is adjusted by comparing the throughput of consecutive
+     * intervals.
+     */
+    bool auto_coroutines;
+    int active_coroutines;
+    int active_limit;
+    int active_step;
+    CoQueue active_queue;
+    int64_t auto_interval_start;
+    int64_t auto_interval_sectors;
+    double auto_last_rate;
 } ImgConvertState;
 
 static void convert_select_part(ImgConvertState *s, int64_t sector_num,
@@ -1974,6 +2143,69 @@ static int coroutine_fn convert_co_copy_range(ImgConvertState *s, int64_t sector
     return 0;
 }
 
+static void coroutine_fn convert_co_wait_active(ImgConvertState *s)
+{
+    if (!s->auto_coroutines) {
+        return;
+    }
+
+    while (s->active_coroutines >= s->active_limit &&
+           s->ret == -EINPROGRESS)
+    {
+        qemu_co_queue_wait(&s->active_queue, NULL);
+    }
+    s->active_coroutines++;
+}
+
+static void convert_adjust_active_limit(ImgConvertState *s)
+{
+    int64_t now = get_clock();
+    int64_t elapsed = now - s->auto_interval_start;
+    double rate;
+    int limit;
+
+    if (elapsed < CONVERT_AUTO_INTERVAL_NS) {
+        return;
+    }
+
+    rate = (double)s->auto_interval_sectors / elapsed;
+    if (rate < s->auto_last_rate) {
+        /* The last adjustment made things worse, so go the other way */
+        s->active_step = -s->active_step;
+    }
+
+    limit = s->active_limit + s->active_step;
+    if (limit < 1 || limit > s->num_coroutines) {
+        s->active_step = -s->active_step;
+        limit = s->active_limit + s->active_step;
+    }
+    s->active_limit = limit;
+
+    s->auto_last_rate = rate;
+    s->auto_interval_start = now;
+    s->auto_interval_sectors = 0;
+}
+
+static void coroutine_fn convert_co_put_active(ImgConvertState *s,
+                                               int64_t sectors)
+{
+    int i;
+
+    if (!s->auto_coroutines) {
+        return;
+    }
+
+    s->active_coroutines--;
+    s->auto_interval_sectors += sectors;
+    convert_adjust_active_limit(s);
+
+    for (i = s->active_coroutines; i < s->active_limit; i++) {
+        if (!qemu_co_queue_next(&s->active_queue)) {
+            break;
+        }
+    }
+}
+
 static void coroutine_fn convert_co_do_copy(void *opaque)
 {
     ImgConvertState *s = opaque;
@@ -1998,6 +2230,7 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
         enum ImgConvertBlockStatus status;
         bool copy_range;
 
+        convert_co_wait_active(s);
         qemu_co_mutex_lock(&s->lock);
         if (s->ret != -EINPROGRESS || s->sector_num >= s->total_sectors) {
             qemu_co_mutex_unlock(&s->lock);
@@ -2082,6 +2315,14 @@ retry:
                 }
             }
         }
+
+        convert_co_put_active(s, status == BLK_DATA ? n : 0);
+    }
+
+    if (s->auto_coroutines) {
+        /* Let the waiting coroutines notice that there is nothing left */
+        s->active_coroutines--;
+        qemu_co_queue_restart_all(&s->active_queue);
     }
 
     qemu_vfree(buf);
@@ -2131,6 +2372,12 @@ static int convert_do_copy(ImgConvertState *s)
     s->ret = -EINPROGRESS;
 
     qemu_co_mutex_init(&s->lock);
+    if (s->auto_coroutines) {
+        qemu_co_queue_init(&s->active_queue);
+        s->active_limit = MIN(8, s->num_coroutines);
+        s->active_step = 1;
+        s->auto_interval_start = get_clock();
+    }
     for (i = 0; i < s->num_coroutines; i++) {
         s->co[i] = qemu_coroutine_create(convert_co_do_copy, s);
         s->wait_sector_num[i] = -1;
@@ -2325,7 +2572,10 @@ static int img_convert(int argc, char **argv)
             skip_create = true;
             break;
         case 'm':
-            if (qemu_strtol(optarg, NULL, 0, &s.num_coroutines) ||
+            s.auto_coroutines = !strcmp(optarg, "auto");
+            if (s.auto_coroutines) {
+                s.num_coroutines = MAX_COROUTINES;
+            } else if (qemu_strtol(optarg, NULL, 0, &s.num_coroutines) ||
                 s.num_coroutines < 1 || s.num_coroutines > MAX_COROUTINES) {
                 error_report("Invalid number of coroutines. Allowed number of"
                              " coroutines is between 1 and %d", MAX_COROUTINES);
@@ -4307,10 +4557,26 @@ out_no_progress:
     return 0;
 }
 
-typedef struct BenchData {
+/* Completed requests of one kind */
+typedef struct BenchStats {
+    LogHistogram latency;
+    uint64_t bytes;
+} BenchStats;
+
+typedef struct BenchData BenchData;
+
+typedef struct BenchRequest {
+    BenchData *b;
+    QEMUIOVector qiov;
+    bool write;
+    int64_t start;
+} BenchRequest;
+
+struct BenchData {
     BlockBackend *blk;
     uint64_t image_size;
-    bool write;
+    int rwmixread;  /* percentage of read requests */
+    bool random_access;
     int bufsize;
     int step;
     int nrreq;
@@ -4318,12 +4584,18 @@ typedef struct BenchData {
     int flush_interval;
     bool drain_on_flush;
     uint8_t *buf;
-    QEMUIOVector *qiov;
+    BenchRequest *reqs;
+    BenchRequest **free_reqs;
+    int nr_free_reqs;
+    GRand *rand;
 
     int in_flight;
     bool in_flush;
     uint64_t offset;
-} BenchData;
+
+    BenchStats read_stats;
+    BenchStats write_stats;
+};
 
 static void bench_undrained_flush_cb(void *opaque, int ret)
 {
@@ -4333,6 +4605,8 @@ static void bench_undrained_flush_cb(void *opaque, int ret)
     }
 }
 
+static void bench_request_cb(void *opaque, int ret);
+
 static void bench_cb(void *opaque, int ret)
 {
     BenchData *b = opaque;
@@ -4378,18 +4652,39 @@ static void bench_cb(void *opaque, int ret)
     }
 
     while (b->n > b->in_flight && b->in_flight < b->nrreq) {
-        int64_t offset = b->offset;
+        int64_t offset;
+        BenchRequest *req;
+
+        if (b->random_access) {
+            uint64_t blocks = b->image_size / b->bufsize;
+            uint64_t r = ((uint64_t)g_rand_int(b->rand) << 32) |
+                         g_rand_int(b->rand);
+
+            offset = (r % blocks) * b->bufsize;
+        } else {
+            offset = b->offset;
+            b->offset += b->step;
+            b->offset %= b->image_size;
+        }
+
+        assert(b->nr_free_reqs > 0);
+        req = b->free_reqs[--b->nr_free_reqs];
+        req->write = b->rwmixread < 100 &&
+                     (b->rwmixread == 0 ||
+                      g_rand_int_range(b->rand, 0, 100) >= b->rwmixread);
+        req->start = get_clock();
+
         /* blk_aio_* might look for completed I/Os and kick bench_cb
          * again, so make sure this operation is counted by in_flight
          * and b->offset is ready for the next submission.
          */
         b->in_flight++;
-        b->offset += b->step;
-        b->offset %= b->image_size;
-        if (b->write) {
-            acb = blk_aio_pwritev(b->blk, offset, b->qiov, 0, bench_cb, b);
+        if (req->write) {
+            acb = blk_aio_pwritev(b->blk, offset, &req->qiov, 0,
+                                  bench_request_cb, req);
         } else {
-            acb = blk_aio_preadv(b->blk, offset, b->qiov, 0, bench_cb, b);
+            acb = blk_aio_preadv(b->blk, offset, &req->qiov, 0,
+                                 bench_request_cb, req);
         }
         if (!acb) {
             error_report("Failed to issue request");
@@ -4398,13 +4693,198 @@ static void bench_cb(void *opaque, int ret)
     }
 }
 
+static void bench_request_cb(void *opaque, int ret)
+{
+    BenchRequest *req = opaque;
+    BenchData *b = req->b;
+
+    if (ret >= 0) {
+        BenchStats *stats = req->write ? &b->write_stats : &b->read_stats;
+
+        log_histogram_add_single_writer(&stats->latency,
+                                        get_clock() - req->start);
+        stats->bytes += b->bufsize;
+    }
+    b->free_reqs[b->nr_free_reqs++] = req;
+
+    bench_cb(b, ret);
+}
+
+static void bench_print_stats(const char *name, BenchStats *s,
+                              double elapsed)
+{
+    LogHistogram *h = &s->latency;
+    uint64_t count = log_histogram_count(h);
+
+    if (!count) {
+        return;
+    }
+
+    printf("%s: %" PRIu64 " requests, %.0f IOPS, %.3f MB/s\n",
+           name, count, count / elapsed, s->bytes / elapsed / MiB);
+    printf("%s latency (us): min %.1f, avg %.1f, p50 %.1f, p99 %.1f, "
+           "p99.9 %.1f, max %.1f\n", name,
+           stat64_get(&h->min) / 1000.0,
+           (double)stat64_get(&h->sum) / count / 1000.0,
+           log_histogram_percentile(h, 500) / 1000.0,
+           log_histogram_percentile(h, 990) / 1000.0,
+           log_histogram_percentile(h, 999) / 1000.0,
+           stat64_get(&h->max) / 1000.0);
+}
+
+static QDict *bench_stats_to_qdict(BenchStats *s, double elapsed)
+{
+    LogHistogram *h = &s->latency;
+    uint64_t count = log_histogram_count(h);
+    QDict *stats = qdict_new();
+    QDict *latency = qdict_new();
+
+    qdict_put_int(stats, "requests", count);
+    qdict_put_int(stats, "bytes", s->bytes);
+    qdict_put(stats, "iops", qnum_from_double(count / elapsed));
+    qdict_put(stats, "bandwidth", qnum_from_double(s->bytes / elapsed));
+
+    if (count) {
+        qdict_put_int(latency, "min", stat64_get(&h->min));
+        qdict_put_int(latency, "mean", stat64_get(&h->sum) / count);
+        qdict_put_int(latency, "p50", log_histogram_percentile(h, 500));
+        qdict_put_int(latency, "p99", log_histogram_percentile(h, 990));
+        qdict_put_int(latency, "p99.9", log_histogram_percentile(h, 999));
+        qdict_put_int(latency, "max", stat64_get(&h->max));
+    }
+    qdict_put(stats, "latency-ns", latency);
+
+    return stats;
+}
+
+/*
+ * Runs the benchmark described by @tmpl on @filename. In JSON mode, the
+ * results are appended to @results instead of being printed.
+ */
+static int bench_image(const BenchData *tmpl, const char *filename,
+                       const char *fmt, int flags, bool writethrough,
+                       bool image_opts, bool quiet, bool force_share,
+                       int pattern, QList *results)
+{
+    BlockBackend *blk;
+    BenchData data;
+    int64_t image_size, t1, t2;
+    double elapsed;
+    size_t buf_size;
+    int i, ret = 0;
+
+    blk = img_open(image_opts, filename, fmt, flags, writethrough, quiet,
+                   force_share);
+    if (!blk) {
+        return -1;
+    }
+
+    image_size = blk_getlength(blk);
+    if (image_size < 0) {
+        ret = image_size;
+        goto out;
+    }
+
+    if (tmpl->random_access && image_size < tmpl->bufsize) {
+        error_report("Image '%s' is smaller than the buffer size, random "
+                     "requests would be past its end", filename);
+        ret = -1;
+        goto out;
+    }
+
+    data = *tmpl;
+    data.blk = blk;
+    data.image_size = image_size;
+    log_histogram_init(&data.read_stats.latency);
+    log_histogram_init(&data.write_stats.latency);
+
+    if (!results) {
+        if (data.rwmixread == 100 || data.rwmixread == 0) {
+            printf("Sending %d %s requests", data.n,
+                   data.rwmixread ? "read" : "write");
+        } else {
+            printf("Sending %d mixed requests (%d%% reads)",
+                   data.n, data.rwmixread);
+        }
+        if (data.random_access) {
+            printf(", %d bytes each, %d in parallel (random offsets)\n",
+                   data.bufsize, data.nrreq);
+        } else {
+            printf(", %d bytes each, %d in parallel "
+                   "(starting at offset %" PRId64 ", step size %d)\n",
+                   data.bufsize, data.nrreq, data.offset, data.step);
+        }
+        if (data.flush_interval) {
+            printf("Sending flush every %d requests\n", data.flush_interval);
+        }
+    }
+
+    buf_size = data.nrreq * data.bufsize;
+    data.buf = blk_blockalign(blk, buf_size);
+    memset(data.buf, pattern, data.nrreq * data.bufsize);
+
+    blk_register_buf(blk, data.buf, buf_size);
+
+    data.reqs = g_new0(BenchRequest, data.nrreq);
+    data.free_reqs = g_new(BenchRequest *, data.nrreq);
+    for (i = 0; i < data.nrreq; i++) {
+        data.reqs[i].b = &data;
+        qemu_iovec_init(&data.reqs[i].qiov, 1);
+        qemu_iovec_add(&data.reqs[i].qiov,
+                       data.buf + i * data.bufsize, data.bufsize);
+        data.free_reqs[i] = &data.reqs[i];
+    }
+    data.nr_free_reqs = data.nrreq;
+    data.rand = g_rand_new_with_seed(1);
+
+    t1 = get_clock();
+    bench_cb(&data, 0);
+
+    while (data.n > 0) {
+        main_loop_wait(false);
+    }
+    t2 = get_clock();
+    elapsed = (double)(t2 - t1) / NANOSECONDS_PER_SECOND;
+
+    if (results) {
+        QDict *result = qdict_new();
+
+        qdict_put_str(result, "filename", filename);
+        qdict_put(result, "elapsed", qnum_from_double(elapsed));
+        qdict_put(result, "read", bench_stats_to_qdict(&data.read_stats,
+                                                       elapsed));
+        qdict_put(result, "write", bench_stats_to_qdict(&data.write_stats,
+                                                        elapsed));
+        qlist_append(results, result);
+    } else {
+        printf("Run completed in %3.3f seconds.\n", elapsed);
+        bench_print_stats("Read", &data.read_stats, elapsed);
+        bench_print_stats("Write", &data.write_stats, elapsed);
+    }
+
+    g_rand_free(data.rand);
+    for (i = 0; i < data.nrreq; i++) {
+        qemu_iovec_destroy(&data.reqs[i].qiov);
+    }
+    g_free(data.reqs);
+    g_free(data.free_reqs);
+    blk_unregister_buf(blk, data.buf);
+    qemu_vfree(data.buf);
+out:
+    blk_unref(blk);
+    return ret;
+}
+
 static int img_bench(int argc, char **argv)
 {
     int c, ret = 0;
-    const char *fmt = NULL, *filename;
+    const char *fmt = NULL;
+    OutputFormat output_format = OFORMAT_HUMAN;
     bool quiet = false;
     bool image_opts = false;
     bool is_write = false;
+    int rwmixread = -1;
+    bool random_access = false;
     int count = 75000;
     int depth = 64;
     int64_t offset = 0;
@@ -4413,15 +4893,12 @@ static int img_bench(int argc, char **argv)
     size_t step = 0;
     int flush_interval = 0;
     bool drain_on_flush = true;
-    int64_t image_size;
-    BlockBackend *blk = NULL;
-    BenchData data = {};
+    BenchData data;
+    QList *results = NULL;
     int flags = 0;
     bool writethrough = false;
-    struct timeval t1, t2;
     int i;
     bool force_share = false;
-    size_t buf_size;
 
     for (;;) {
         static const struct option long_options[] = {
@@ -4430,6 +4907,9 @@ static int img_bench(int argc, char **argv)
             {"image-opts", no_argument, 0, OPTION_IMAGE_OPTS},
             {"pattern", required_argument, 0, OPTION_PATTERN},
             {"no-drain", no_argument, 0, OPTION_NO_DRAIN},
+            {"rwmixread", required_argument, 0, OPTION_RWMIXREAD},
+            {"random", no_argument, 0, OPTION_RANDOM},
+            {"output", required_argument, 0, OPTION_OUTPUT},
             {"force-share", no_argument, 0, 'U'},
             {0, 0, 0, 0}
         };
@@ -4561,92 +5041,97 @@ static int img_bench(int argc, char **argv)
         case OPTION_NO_DRAIN:
             drain_on_flush = false;
             break;
+        case OPTION_RWMIXREAD:
+        {
+            unsigned long res;
+
+            if (qemu_strtoul(optarg, NULL, 0, &res) < 0 || res > 100) {
+                error_report("Invalid read percentage specified");
+                return 1;
+            }
+            rwmixread = res;
+            break;
+        }
+        case OPTION_RANDOM:
+            random_access = true;
+            break;
+        case OPTION_OUTPUT:
+            if (!strcmp(optarg, "json")) {
+                output_format = OFORMAT_JSON;
+            } else if (!strcmp(optarg, "human")) {
+                output_format = OFORMAT_HUMAN;
+            } else {
+                error_report("--output must be used with human or json "
+                             "as argument.");
+                return 1;
+            }
+            break;
         case OPTION_IMAGE_OPTS:
             image_opts = true;
             break;
         }
     }
 
-    if (optind != argc - 1) {
-        error_exit("Expecting one image file name");
+    if (optind >= argc) {
+        error_exit("Expecting at least one image file name");
     }
-    filename = argv[argc - 1];
 
-    if (!is_write && flush_interval) {
-        error_report("--flush-interval is only available in write tests");
+    if (is_write && rwmixread >= 0) {
+        error_report("-w and --rwmixread are mutually exclusive");
         ret = -1;
         goto out;
     }
-    if (flush_interval && flush_interval < depth) {
-        error_report("Flush interval can't be smaller than depth");
-        ret = -1;
-        goto out;
+    if (rwmixread < 0) {
+        rwmixread = is_write ? 0 : 100;
+    }
+    if (rwmixread < 100) {
+        flags |= BDRV_O_RDWR;
     }
 
-    blk = img_open(image_opts, filename, fmt, flags, writethrough, quiet,
-                   force_share);
-    if (!blk) {
+    if (rwmixread == 100 && flush_interval) {
+        error_report("--flush-interval is only available in write tests");
         ret = -1;
         goto out;
     }
-
-    image_size = blk_getlength(blk);
-    if (image_size < 0) {
-        ret = image_size;
+    if (flush_interval && flush_interval < depth) {
+        error_report("Flush interval can't be smaller than depth");
+        ret = -1;
         goto out;
     }
 
     data = (BenchData) {
-        .blk            = blk,
-        .image_size     = image_size,
         .bufsize        = bufsize,
         .step           = step ?: bufsize,
         .nrreq          = depth,
         .n              = count,
         .offset         = offset,
-        .write          = is_write,
+        .rwmixread      = rwmixread,
+        .random_access  = random_access,
         .flush_interval = flush_interval,
         .drain_on_flush = drain_on_flush,
     };
-    printf("Sending %d %s requests, %d bytes each, %d in parallel "
-           "(starting at offset %" PRId64 ", step size %d)\n",
-           data.n, data.write ? "write" : "read", data.bufsize, data.nrreq,
-           data.offset, data.step);
-    if (flush_interval) {
-        printf("Sending flush every %d requests\n", flush_interval);
-    }
-
-    buf_size = data.nrreq * data.bufsize;
-    data.buf = blk_blockalign(blk, buf_size);
-    memset(data.buf, pattern, data.nrreq * data.bufsize);
 
-    blk_register_buf(blk, data.buf, buf_size);
+    if (output_format == OFORMAT_JSON) {
+        results = qlist_new();
+    }
 
-    data.qiov = g_new(QEMUIOVector, data.nrreq);
-    for (i = 0; i < data.nrreq; i++) {
-        qemu_iovec_init(&data.qiov[i], 1);
-        qemu_iovec_add(&data.qiov[i],
-                       data.buf + i * data.bufsize, data.bufsize);
+    for (i = optind; i < argc; i++) {
+        ret = bench_image(&data, argv[i], fmt, flags, writethrough,
+                          image_opts, quiet, force_share, pattern, results);
+        if (ret) {
+            goto out;
+        }
     }
 
-    gettimeofday(&t1, NULL);
-    bench_cb(&data, 0);
+    if (results) {
+        QString *str = qobject_to_json_pretty(QOBJECT(results));
 
-    while (data.n > 0) {
-        main_loop_wait(false);
+        printf("%s\n", qstring_get_str(str));
+        qobject_unref(str);
     }
-    gettimeofday(&t2, NULL);
-
-    printf("Run completed in %3.3f seconds.\n",
-           (t2.tv_sec - t1.tv_sec)
-           + ((double)(t2.tv_usec - t1.tv_usec) / 1000000));
 
 out:
-    if (data.buf) {
-        blk_unregister_buf(blk, data.buf);
-    }
-    qemu_vfree(data.buf);
-    blk_unref(blk);
+    qobject_unref(results);
 
     if (ret) {
         return 1;
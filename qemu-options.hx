@@ -115,8 +115,13 @@ DEF("accel", HAS_ARG, QEMU_OPTION_accel,
     "                igd-passthru=on|off (enable Xen integrated Intel graphics passthrough, default=off)\n"
     "                kernel-irqchip=on|off|split controls accelerated irqchip support (default=on)\n"
     "                kvm-shadow-mem=size of KVM shadow MMU in bytes\n"
+    "                dirty-ring-size=n (KVM dirty ring entries per vCPU, default=0)\n"
     "                tb-size=n (TCG translation block cache size)\n"
-    "                thread=single|multi (enable multi-threaded TCG)\n", QEMU_ARCH_ALL)
+    "                tb-profile=on|off (count TCG translation block executions, default=off)\n"
+    "                perf-map=on|off (write /tmp/perf-<pid>.map for Linux perf, default=off)\n"
+    "                jitdump=on|off (write /tmp/jit-<pid>.dump for Linux perf, default=off)\n"
+    "                thread=single|multi (enable multi-threaded TCG)\n"
+    "                halt-poll-max-ns=n (maximum idle vCPU polling time, default=0)\n", QEMU_ARCH_ALL)
 SRST
 ``-accel name[,prop=value[,...]]``
     This is used to enable an accelerator. Depending on the target
@@ -140,9 +145,34 @@ SRST
     ``kvm-shadow-mem=size``
         Defines the size of the KVM shadow MMU.
 
+    ``dirty-ring-size=n``
+        When the KVM accelerator is used, track dirty pages with a ring
+        of n entries per vCPU instead of the dirty bitmap.  n must be a
+        power of two; the default of 0 keeps the dirty bitmap.  The cost
+        of collecting dirty pages then depends on how many pages were
+        dirtied rather than on the size of guest memory, which helps
+        the migration of large guests.
+
     ``tb-size=n``
         Controls the size (in MiB) of the TCG translation block cache.
 
+    ``tb-profile=on|off``
+        Makes each TCG translation block count how many times it is
+        executed. ``info jit`` then lists the most executed blocks and
+        the blocks they jump to directly. The counts are approximate
+        when TCG is multi-threaded.
+
+    ``perf-map=on|off``
+        Describes the code generated by TCG in ``/tmp/perf-<pid>.map``,
+        so that ``perf report`` attributes the time spent in it to guest
+        symbols, or to guest addresses when the symbols are not known.
+
+    ``jitdump=on|off``
+        Like ``perf-map``, but ``/tmp/jit-<pid>.dump`` records every
+        translation along with its code, so it stays accurate when the
+        translation cache is flushed.  Record with ``perf record -k 1``
+        and merge the dump with ``perf inject --jit``.
+
     ``thread=single|multi``
         Controls number of TCG threads. When the TCG is multi-threaded
         there will be one thread per vCPU therefor taking advantage of
@@ -150,6 +180,16 @@ SRST
         where both the back-end and front-ends support it and no
         incompatible TCG features have been enabled (e.g.
         icount/replay).
+
+    ``halt-poll-max-ns=n``
+        Lets a vCPU thread whose CPU became idle poll for new work for
+        up to n nanoseconds before it goes to sleep, which saves a
+        wakeup when an interrupt follows shortly.  The polling time of
+        each vCPU adapts to how long its CPU stays idle.  It applies to
+        TCG, and to KVM when halts are not handled in the kernel (for
+        example with ``kernel-irqchip=off``); the kernel's own halt
+        polling covers the other cases.  The default of 0 disables
+        polling.
 ERST
 
 DEF("smp", HAS_ARG, QEMU_OPTION_smp,
@@ -1865,7 +1905,8 @@ DEF("spice", HAS_ARG, QEMU_OPTION_spice,
     "       [,image-compression=[auto_glz|auto_lz|quic|glz|lz|off]]\n"
     "       [,jpeg-wan-compression=[auto|never|always]]\n"
     "       [,zlib-glz-wan-compression=[auto|never|always]]\n"
-    "       [,streaming-video=[off|all|filter]][,disable-copy-paste]\n"
+    "       [,streaming-video=[off|all|filter]][,video-codecs=<list>]\n"
+    "       [,disable-copy-paste]\n"
     "       [,disable-agent-file-xfer][,agent-mouse=[on|off]]\n"
     "       [,playback-compression=[on|off]][,seamless-migration=[on|off]]\n"
     "       [,gl=[on|off]][,rendernode=<file>]\n"
@@ -1944,6 +1985,13 @@ SRST
     ``streaming-video=[off|all|filter]``
         Configure video stream detection. Default is off.
 
+    ``video-codecs=<list>``
+        Select the encoders used for the detected video streams, as a
+        ``;`` separated list of ``encoder:codec`` pairs in order of
+        preference, for example ``gstreamer:h264;spice:mjpeg``.  The
+        ``gstreamer`` encoders can use hardware encoding where GStreamer
+        supports it.  Requires spice-server 0.13.2 or later.
+
     ``agent-mouse=[on|off]``
         Enable/disable passing mouse events via vdagent. Default is on.
 
@@ -2189,6 +2237,12 @@ SRST
         bandwidth when playing videos. Disabling adaptive encodings
         restores the original static behavior of encodings like Tight.
 
+        If QEMU is built with GStreamer, ``lossy`` is set, and the client
+        supports the Open H.264 encoding, whole frames are sent as H.264
+        video while a screen region is updated often. A hardware encoder
+        (VA-API) is used when available, and x264 otherwise. The screen is
+        sent again losslessly once the updates stop.
+
     ``share=[allow-exclusive|force-shared|ignore]``
         Set display sharing policy. 'allow-exclusive' allows clients to
         ask for exclusive access. As suggested by the rfb spec this is
@@ -2368,7 +2422,8 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "         [,ipv6[=on|off]][,ipv6-net=addr[/int]][,ipv6-host=addr]\n"
     "         [,restrict=on|off][,hostname=host][,dhcpstart=addr]\n"
     "         [,dns=addr][,ipv6-dns=addr][,dnssearch=domain][,domainname=domain]\n"
-    "         [,tftp=dir][,tftp-server-name=name][,bootfile=f][,hostfwd=rule][,guestfwd=rule]"
+    "         [,tftp=dir][,tftp-server-name=name][,bootfile=f][,hostfwd=rule][,guestfwd=rule]\n"
+    "         [,sndbuf=nbytes][,rcvbuf=nbytes]"
 #ifndef _WIN32
                                              "[,smb=dir[,smbserver=addr]]\n"
 #endif
@@ -2459,6 +2514,12 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "                VALE port (created on the fly) called 'name' ('nmname' is name of the \n"
     "                netmap device, defaults to '/dev/netmap')\n"
 #endif
+#ifdef CONFIG_AF_XDP
+    "-netdev af-xdp,id=str,ifname=name[,mode=native|skb][,force-copy=on|off]\n"
+    "         [,queues=n][,start-queue=m]\n"
+    "                attach to queues 'm' to 'm+n-1' of the existing network\n"
+    "                interface 'name' through AF_XDP sockets\n"
+#endif
 #ifdef CONFIG_POSIX
     "-netdev vhost-user,id=str,chardev=dev[,vhostforce=on|off]\n"
     "                configure a vhost-user network, backed by a chardev 'dev'\n"
@@ -2708,6 +2769,12 @@ SRST
             # and connect the TCP stream to its stdin/stdout
             |qemu_system| -nic  'user,id=n1,guestfwd=tcp:10.0.2.100:1234-cmd:netcat 10.10.1.1 4321'
 
+    ``sndbuf=nbytes``; \ ``rcvbuf=nbytes``
+        Set the send and receive buffer sizes of the host sockets that
+        the user mode network stack opens for the guest's connections.
+        By default the host kernel picks and adjusts them; larger fixed
+        buffers can help bulk transfers over links with a high latency.
+
 ``-netdev tap,id=id[,fd=h][,ifname=name][,script=file][,downscript=dfile][,br=bridge][,helper=helper]``
     Configure a host TAP network backend with ID id.
 
@@ -2727,6 +2794,15 @@ SRST
     ``fd``\ =h can be used to specify the handle of an already opened
     host TAP interface.
 
+    With ``vhost=on``, the virtio-net datapath runs in the vhost-net
+    kernel driver instead of QEMU.  Only vhost-net can transmit without
+    copying the packet data: guest pages are handed to the host network
+    stack and the buffers are returned to the guest when the stack
+    releases them.  This is enabled with the ``experimental_zcopytx=1``
+    parameter of the ``vhost_net`` kernel module, and mostly helps large
+    TSO packets.  Without vhost, QEMU writes the guest buffers to the TAP
+    device directly, but the kernel copies them.
+
     Examples:
 
     .. parsed-literal::
@@ -2926,6 +3002,35 @@ SRST
         # launch QEMU instance
         |qemu_system| linux.img -nic vde,sock=/tmp/myswitch
 
+``-netdev af-xdp,id=str,ifname=name[,mode=native|skb][,force-copy=on|off][,queues=n][,start-queue=m]``
+    Configure an AF_XDP backend to connect to the network interface
+    ``name``.  An XDP program is attached to the interface that
+    redirects the packets of queues ``m`` to ``m+n-1`` (by default,
+    queue 0 only) to one AF_XDP socket each; those packets are not seen
+    by the host network stack anymore.  Each socket is exposed as one
+    queue of the netdev, so ``queues`` should match the number of queues
+    of a multiqueue guest NIC.  The interface should be configured so
+    that the traffic destined to the guest is steered to these queues,
+    for example with ``ethtool -N``.
+
+    ``mode`` selects how the XDP program is attached: ``native`` needs
+    driver support, ``skb`` works with any interface.  By default
+    native mode is tried first.  In native mode the kernel uses
+    zero-copy if the driver supports it, unless ``force-copy=on``.
+    This option needs CAP_NET_ADMIN and CAP_SYS_ADMIN (or
+    CAP_BPF on recent kernels).
+
+    Example:
+
+    .. parsed-literal::
+
+        # steer the traffic for the guest to queues 4-5 of eth0
+        ethtool -L eth0 combined 8
+        ethtool -N eth0 flow-type ether dst 52:54:00:12:34:56 action 4
+        # launch QEMU instance
+        |qemu_system| linux.img -device virtio-net-pci,netdev=n1,mq=on,mac=52:54:00:12:34:56 \\
+            -netdev af-xdp,id=n1,ifname=eth0,queues=2,start-queue=4
+
 ``-netdev vhost-user,chardev=id[,vhostforce=on|off][,queues=n]``
     Establish a vhost-user netdev, backed by a chardev id. The chardev
     should be a unix domain socket backed one. The vhost-user uses a
@@ -2953,6 +3058,17 @@ SRST
     vDPA devices can be both physically located on the hardware or
     emulated by software.
 
+    A netdev is created for each queue pair of the device, and one more
+    for its control virtqueue if it has one; the control virtqueue is
+    then handled by the device rather than by QEMU. To use all the queue
+    pairs, enable multiqueue on the NIC, e.g. for a device with 4 queue
+    pairs:
+
+    .. parsed-literal::
+
+        |qemu_system| -netdev type=vhost-vdpa,id=net0,vhostdev=/dev/vhost-vdpa-0 \
+             -device virtio-net-pci,netdev=net0,mq=on,vectors=10
+
 ``-netdev hubport,id=id,hubid=hubid[,netdev=nd]``
     Create a hub port on the emulated hub with ID hubid.
 
@@ -3101,6 +3217,13 @@ The general form of a character device option is:
     ``logappend`` option controls whether the log file will be truncated
     or appended to when opened.
 
+    Every backend also supports the ``flush-delay=ms`` option. When it
+    is non-zero, data written by the front end is queued for up to
+    ``ms`` milliseconds and then written to the backend at once, which
+    saves system calls when the guest writes a character at a time, for
+    example to a serial console.  The default is 0, which writes data
+    immediately.
+
 The available backends are:
 
 ``-chardev null,id=id``
@@ -3958,12 +4081,12 @@ SRST
 ERST
 
 DEF("icount", HAS_ARG, QEMU_OPTION_icount, \
-    "-icount [shift=N|auto][,align=on|off][,sleep=on|off,rr=record|replay,rrfile=<filename>,rrsnapshot=<snapshot>]\n" \
+    "-icount [shift=N|auto][,align=on|off][,sleep=on|off][,quantum=N,rr=record|replay,rrfile=<filename>,rrsnapshot=<snapshot>,rrsnapshot-period=N]\n" \
     "                enable virtual instruction counter with 2^N clock ticks per\n" \
     "                instruction, enable aligning the host and virtual clocks\n" \
     "                or disable real time cpu sleeping\n", QEMU_ARCH_ALL)
 SRST
-``-icount [shift=N|auto][,rr=record|replay,rrfile=filename,rrsnapshot=snapshot]``
+``-icount [shift=N|auto][,rr=record|replay,rrfile=filename,rrsnapshot=snapshot,rrsnapshot-period=N]``
     Enable virtual instruction counter. The virtual cpu will execute one
     instruction every 2^N ns of virtual time. If ``auto`` is specified
     then the virtual cpu speed will be automatically adjusted to keep
@@ -3993,6 +4116,12 @@ SRST
     Typically this happens when the shift value is high (how high
     depends on the host machine).
 
+    With ``-accel tcg,thread=multi`` every virtual cpu runs in its own
+    thread and counts its own instructions. The virtual cpus then run in
+    lockstep quanta of ``quantum`` instructions (10000 by default):
+    a cpu that reached the end of the quantum waits for the others, so
+    their virtual clocks never drift apart by more than a quantum.
+
     When ``rr`` option is specified deterministic record/replay is
     enabled. Replay log is written into filename file in record mode and
     read from this file in replay mode.
@@ -4000,6 +4129,10 @@ SRST
     Option rrsnapshot is used to create new vm snapshot named snapshot
     at the start of execution recording. In replay mode this option is
     used to load the initial VM state.
+
+    Option rrsnapshot-period makes replay create a vm snapshot every N
+    executed instructions, so that seeking and reverse debugging restart
+    from a nearby snapshot instead of replaying from the start.
 ERST
 
 DEF("watchdog", HAS_ARG, QEMU_OPTION_watchdog, \
@@ -4308,6 +4441,7 @@ ERST
 
 DEF("trace", HAS_ARG, QEMU_OPTION_trace,
     "-trace [[enable=]<pattern>][,events=<file>][,file=<file>]\n"
+    "       [,ring-size=<size>][,flight-recorder=on|off][,ring-file=<file>]\n"
     "                specify tracing options\n",
     QEMU_ARCH_ALL)
 SRST
@@ -4584,7 +4718,7 @@ SRST
         recommended that a persistent set of parameters be generated up
         front and saved.
 
-    ``-object tls-creds-x509,id=id,endpoint=endpoint,dir=/path/to/cred/dir,priority=priority,verify-peer=on|off,passwordid=id``
+    ``-object tls-creds-x509,id=id,endpoint=endpoint,dir=/path/to/cred/dir,priority=priority,verify-peer=on|off,passwordid=id,x-ktls=on|off``
         Creates a TLS anonymous credentials object, which can be used to
         provide TLS support on network backends. The ``id`` parameter is
         a unique ID which network backends will use to access the
@@ -4628,6 +4762,14 @@ SRST
         string as described at
         https://gnutls.org/manual/html_node/Priority-Strings.html.
 
+        The x-ktls parameter, which is also accepted by tls-creds-anon
+        and tls-creds-psk, asks QEMU to hand the encryption of outgoing
+        data over to the Linux kernel once the handshake is completed.
+        This requires a TCP connection, the ``tls`` kernel module, and a
+        session that negotiated TLS 1.2 or 1.3 with AES-GCM. If any of
+        these is missing, QEMU warns and keeps encrypting in userspace.
+        Incoming data is always decrypted by gnutls. The default is off.
+
     ``-object tls-cipher-suites,id=id,priority=priority``
         Creates a TLS cipher suites object, which can be used to control
         the TLS cipher/protocol algorithms that applications are permitted
@@ -5086,7 +5228,7 @@ SRST
 
             CN=laptop.example.com,O=Example Home,L=London,ST=London,C=GB
 
-    ``-object iothread,id=id,poll-max-ns=poll-max-ns,poll-grow=poll-grow,poll-shrink=poll-shrink``
+    ``-object iothread,id=id,poll-max-ns=poll-max-ns,poll-grow=poll-grow,poll-shrink=poll-shrink,io-uring-sqpoll-idle=ms,poll-group=id,thread-pool-min=n,thread-pool-max=n,host-nodes=host-nodes``
         Creates a dedicated event loop thread that devices can be
         assigned to. This is known as an IOThread. By default device
         emulation happens in vCPU threads or the main event loop thread.
@@ -5129,6 +5271,58 @@ SRST
         ::
 
             (qemu) qom-set /objects/iothread1 poll-max-ns 100000
+
+        The ``io-uring-sqpoll-idle`` parameter makes the io_uring instance
+        used by ``aio=io_uring`` drives in this IOThread submit requests
+        through a kernel submission queue polling thread instead of a
+        system call. The value is the number of milliseconds without
+        requests after which the polling thread sleeps; submission then
+        wakes it up again. All IOThreads share one kernel polling thread
+        when the host kernel supports it. If the kernel refuses to create
+        a polling thread, for example due to missing privileges, requests
+        are submitted with system calls as usual. Kernels older than 5.11
+        only allow registered files with submission queue polling, so use
+        it together with the ``io-uring-fixed-file`` drive option there.
+        The default of 0 disables submission queue polling.
+
+        The ``poll-group`` parameter makes the IOThread a member of the
+        ``iothread-poll-group`` object with the given ``id``, which
+        limits how many of its members busy wait at the same time.
+
+        The ``thread-pool-min`` and ``thread-pool-max`` parameters bound
+        the number of worker threads that run blocking requests, such as
+        ``aio=threads`` I/O and qcow2 compression, for the devices in
+        this IOThread. ``thread-pool-min`` workers are started right away
+        and stay alive when idle; the default is 0. The pool never grows
+        beyond ``thread-pool-max`` workers; the default is 64. Workers are
+        created by the IOThread, so they inherit its CPU affinity at that
+        time. Both parameters can be changed at run-time with ``qom-set``.
+
+        The ``host-nodes`` parameter binds the IOThread to the host CPUs
+        of the given host NUMA nodes, for example ``host-nodes=1`` or
+        ``host-nodes=0-1``. The thread is bound before it
+        allocates anything. Requests, bounce buffers and thread pool
+        workers that the IOThread allocates then come from memory local
+        to those nodes, because that is the kernel's default memory
+        policy. This is only supported on Linux hosts.
+
+    ``-object iothread-poll-group,id=id,max-pollers=n``
+        Creates a group of IOThreads that share a polling budget. At
+        most ``max-pollers`` members of the group busy wait for events
+        at any time; when all slots are taken, the other members monitor
+        their file descriptors without polling until a slot is free.
+        This bounds the host CPU time spent polling on hosts with many
+        IOThreads, while the busiest IOThreads keep the latency benefit
+        of polling. The default is 1, and 0 disables polling for the
+        whole group. ``max-pollers`` can be changed at run-time with
+        ``qom-set``.
+
+        ::
+
+            -object iothread-poll-group,id=pg0,max-pollers=2
+            -object iothread,id=iothread0,poll-group=pg0
+            -object iothread,id=iothread1,poll-group=pg0
+            -object iothread,id=iothread2,poll-group=pg0
 ERST
 
 
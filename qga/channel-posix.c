@@ -1,5 +1,6 @@
 #include "qemu/osdep.h"
 #include <termios.h>
+#include <poll.h>
 #include "qapi/error.h"
 #include "qemu/sockets.h"
 #include "channel.h"
@@ -9,6 +10,8 @@
 #endif
 
 #define GA_CHANNEL_BAUDRATE_DEFAULT B38400 /* for isa-serial channels */
+#define GA_CHANNEL_READ_TIMEOUT_MS 10000
+#define GA_CHANNEL_WRITE_TIMEOUT_MS 10000
 
 struct GAChannel {
     GIOChannel *listen_channel;
@@ -16,6 +19,7 @@ struct GAChannel {
     GAChannelMethod method;
     GAChannelCallback event_cb;
     gpointer user_data;
+    int write_timeout_ms;   /* -1 to wait for the client forever */
 };
 
 static int ga_channel_client_add(GAChannel *c, int fd);
@@ -112,8 +116,10 @@ static int ga_channel_client_add(GAChannel *c, int fd)
         g_error_free(err);
         return -1;
     }
-    g_io_add_watch(client_channel, G_IO_IN | G_IO_HUP,
-                   ga_channel_client_event, c);
+    if (c->event_cb) {
+        g_io_add_watch(client_channel, G_IO_IN | G_IO_HUP,
+                       ga_channel_client_event, c);
+    }
     c->client_channel = client_channel;
     return 0;
 }
@@ -234,6 +240,22 @@ static gboolean ga_channel_open(GAChannel *c, const gchar *path,
     return true;
 }
 
+/* Wait until the client channel is ready for @events */
+static bool ga_channel_wait(GAChannel *c, short events, int timeout_ms)
+{
+    struct pollfd pfd = {
+        .fd = g_io_channel_unix_get_fd(c->client_channel),
+        .events = events,
+    };
+    int ret;
+
+    do {
+        ret = poll(&pfd, 1, timeout_ms);
+    } while (ret < 0 && errno == EINTR);
+
+    return ret > 0;
+}
+
 GIOStatus ga_channel_write_all(GAChannel *c, const gchar *buf, gsize size)
 {
     GError *err = NULL;
@@ -250,12 +272,22 @@ GIOStatus ga_channel_write_all(GAChannel *c, const gchar *buf, gsize size)
         } else if (status != G_IO_STATUS_AGAIN) {
             g_warning("error writing to channel: %s", err->message);
             return status;
+        } else if (!ga_channel_wait(c, POLLOUT, c->write_timeout_ms)) {
+            g_warning("timed out writing to channel");
+            return G_IO_STATUS_AGAIN;
         }
     }
 
-    do {
+    for (;;) {
         status = g_io_channel_flush(c->client_channel, &err);
-    } while (status == G_IO_STATUS_AGAIN);
+        if (status != G_IO_STATUS_AGAIN) {
+            break;
+        }
+        if (!ga_channel_wait(c, POLLOUT, c->write_timeout_ms)) {
+            g_warning("timed out flushing channel");
+            return G_IO_STATUS_AGAIN;
+        }
+    }
 
     if (status != G_IO_STATUS_NORMAL) {
         g_warning("error flushing channel: %s", err->message);
@@ -269,11 +301,50 @@ GIOStatus ga_channel_read(GAChannel *c, gchar *buf, gsize size, gsize *count)
     return g_io_channel_read_chars(c->client_channel, buf, size, count, NULL);
 }
 
+GIOStatus ga_channel_read_all(GAChannel *c, gchar *buf, gsize size)
+{
+    GIOStatus status;
+    gsize count;
+
+    while (size) {
+        status = g_io_channel_read_chars(c->client_channel, buf, size,
+                                         &count, NULL);
+        if (status == G_IO_STATUS_NORMAL) {
+            buf += count;
+            size -= count;
+        } else if (status != G_IO_STATUS_AGAIN) {
+            return status;
+        } else if (!ga_channel_wait(c, POLLIN, GA_CHANNEL_READ_TIMEOUT_MS)) {
+            g_warning("timed out reading from channel");
+            return G_IO_STATUS_AGAIN;
+        }
+    }
+
+    return G_IO_STATUS_NORMAL;
+}
+
+bool ga_channel_has_client(GAChannel *c)
+{
+    return c->client_channel != NULL;
+}
+
+void ga_channel_drop_client(GAChannel *c)
+{
+    if (c->listen_channel && c->client_channel) {
+        ga_channel_client_close(c);
+    }
+}
+
 GAChannel *ga_channel_new(GAChannelMethod method, const gchar *path,
                           int listen_fd, GAChannelCallback cb, gpointer opaque)
 {
     GAChannel *c = g_new0(GAChannel, 1);
     c->event_cb = cb;
+    /*
+     * Commands write to the bulk channel synchronously, a client that
+     * stops reading must not hang the agent.
+     */
+    c->write_timeout_ms = cb ? -1 : GA_CHANNEL_WRITE_TIMEOUT_MS;
     c->user_data = opaque;
 
     if (!ga_channel_open(c, path, method, listen_fd)) {
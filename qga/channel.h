@@ -24,6 +24,12 @@ typedef enum {
 
 typedef gboolean (*GAChannelCallback)(GIOCondition condition, gpointer opaque);
 
+/*
+ * If @cb is NULL, the channel is not watched for input; it is only read
+ * with ga_channel_read_all(), and ga_channel_write_all() gives up if the
+ * client doesn't take any data for 10 seconds.  This is supported on POSIX
+ * hosts only.
+ */
 GAChannel *ga_channel_new(GAChannelMethod method, const gchar *path,
                           int listen_fd, GAChannelCallback cb,
                           gpointer opaque);
@@ -31,4 +37,15 @@ void ga_channel_free(GAChannel *c);
 GIOStatus ga_channel_read(GAChannel *c, gchar *buf, gsize size, gsize *count);
 GIOStatus ga_channel_write_all(GAChannel *c, const gchar *buf, gsize size);
 
+#ifndef _WIN32
+/*
+ * Read exactly @size bytes.  Gives up if no data arrives for 10 seconds,
+ * or at end of file.
+ */
+GIOStatus ga_channel_read_all(GAChannel *c, gchar *buf, gsize size);
+bool ga_channel_has_client(GAChannel *c);
+/* In listen mode, disconnect the client and wait for a new one */
+void ga_channel_drop_client(GAChannel *c);
+#endif
+
 #endif
@@ -26,6 +26,8 @@
 #include "qemu/sockets.h"
 #include "qemu/base64.h"
 #include "qemu/cutils.h"
+#include "qemu/bswap.h"
+#include "qemu/units.h"
 #include "commands-common.h"
 
 #ifdef HAVE_UTMPX
@@ -561,6 +563,196 @@ GuestFileWrite *qmp_guest_file_write(int64_t handle, const char *buf_b64,
     return write_data;
 }
 
+/* Size of the chunks that guest-file-read-bulk sends */
+#define QGA_BULK_CHUNK_SIZE (64 * KiB)
+/* Largest chunk that guest-file-write-bulk accepts */
+#define QGA_BULK_CHUNK_MAX  (1 * MiB)
+
+static GAChannel *guest_file_bulk_channel(Error **errp)
+{
+    GAChannel *c = ga_get_bulk_channel(ga_state);
+
+    if (!c) {
+        error_setg(errp, "no bulk channel configured");
+        return NULL;
+    }
+    if (!ga_channel_has_client(c)) {
+        error_setg(errp, "no client connected to the bulk channel");
+        return NULL;
+    }
+    return c;
+}
+
+GuestFileBulk *qmp_guest_file_read_bulk(int64_t handle, bool has_count,
+                                        int64_t count, Error **errp)
+{
+    GuestFileHandle *gfh = guest_file_handle_find(handle, errp);
+    GuestFileBulk *bulk = NULL;
+    g_autofree uint8_t *buf = NULL;
+    GAChannel *c;
+    int64_t total = 0;
+    int read_errno = 0;
+    FILE *fh;
+
+    if (!gfh) {
+        return NULL;
+    }
+    if (has_count && count < 0) {
+        error_setg(errp, "value '%" PRId64 "' is invalid for argument count",
+                   count);
+        return NULL;
+    }
+    c = guest_file_bulk_channel(errp);
+    if (!c) {
+        return NULL;
+    }
+
+    fh = gfh->fh;
+
+    /* explicitly flush when switching from writing to reading */
+    if (gfh->state == RW_STATE_WRITING) {
+        if (fflush(fh) == EOF) {
+            error_setg_errno(errp, errno, "failed to flush file");
+            return NULL;
+        }
+        gfh->state = RW_STATE_NEW;
+    }
+
+    /* each chunk is sent with its length in front, in a single write */
+    buf = g_malloc(sizeof(uint32_t) + QGA_BULK_CHUNK_SIZE);
+    while (!has_count || total < count) {
+        size_t len = QGA_BULK_CHUNK_SIZE;
+        size_t read_count;
+
+        if (has_count) {
+            len = MIN(len, count - total);
+        }
+        read_count = fread(buf + sizeof(uint32_t), 1, len, fh);
+        if (ferror(fh)) {
+            read_errno = errno;
+        }
+        if (!read_count) {
+            break;
+        }
+
+        stl_be_p(buf, read_count);
+        if (ga_channel_write_all(c, (gchar *)buf,
+                                 sizeof(uint32_t) + read_count) !=
+            G_IO_STATUS_NORMAL) {
+            goto channel_error;
+        }
+        total += read_count;
+        if (read_count < len) {
+            break;
+        }
+    }
+
+    stl_be_p(buf, 0);
+    if (ga_channel_write_all(c, (gchar *)buf, sizeof(uint32_t)) !=
+        G_IO_STATUS_NORMAL) {
+        goto channel_error;
+    }
+
+    if (read_errno) {
+        error_setg_errno(errp, read_errno, "failed to read file");
+    } else {
+        bulk = g_new0(GuestFileBulk, 1);
+        bulk->count = total;
+        bulk->eof = feof(fh);
+        gfh->state = RW_STATE_READING;
+    }
+    clearerr(fh);
+    return bulk;
+
+channel_error:
+    error_setg(errp, "failed to write to the bulk channel");
+    ga_channel_drop_client(c);
+    clearerr(fh);
+    return NULL;
+}
+
+GuestFileBulk *qmp_guest_file_write_bulk(int64_t handle, Error **errp)
+{
+    GuestFileHandle *gfh = guest_file_handle_find(handle, errp);
+    GuestFileBulk *bulk = NULL;
+    g_autofree uint8_t *buf = NULL;
+    size_t buf_size = QGA_BULK_CHUNK_SIZE;
+    GAChannel *c;
+    int64_t total = 0;
+    int write_errno = 0;
+    uint32_t len;
+    FILE *fh;
+
+    if (!gfh) {
+        return NULL;
+    }
+    c = guest_file_bulk_channel(errp);
+    if (!c) {
+        return NULL;
+    }
+
+    fh = gfh->fh;
+
+    if (gfh->state == RW_STATE_READING) {
+        if (fseek(fh, 0, SEEK_CUR) == -1) {
+            error_setg_errno(errp, errno, "failed to seek file");
+            return NULL;
+        }
+        gfh->state = RW_STATE_NEW;
+    }
+
+    buf = g_malloc(buf_size);
+    for (;;) {
+        if (ga_channel_read_all(c, (gchar *)buf, sizeof(len)) !=
+            G_IO_STATUS_NORMAL) {
+            goto channel_error;
+        }
+        len = ldl_be_p(buf);
+        if (!len) {
+            break;
+        }
+        if (len > QGA_BULK_CHUNK_MAX) {
+            error_setg(errp, "bulk chunk of %" PRIu32 " bytes is too large",
+                       len);
+            ga_channel_drop_client(c);
+            return NULL;
+        }
+        if (len > buf_size) {
+            buf_size = len;
+            buf = g_realloc(buf, buf_size);
+        }
+        if (ga_channel_read_all(c, (gchar *)buf, len) != G_IO_STATUS_NORMAL) {
+            goto channel_error;
+        }
+
+        /* after an error, keep reading to stay in sync with the client */
+        if (!write_errno) {
+            total += fwrite(buf, 1, len, fh);
+            if (ferror(fh)) {
+                write_errno = errno;
+            }
+        }
+    }
+
+    if (write_errno) {
+        error_setg_errno(errp, write_errno, "failed to write to file");
+        slog("guest-file-write-bulk failed, handle: %" PRId64, handle);
+    } else {
+        bulk = g_new0(GuestFileBulk, 1);
+        bulk->count = total;
+        bulk->eof = feof(fh);
+        gfh->state = RW_STATE_WRITING;
+    }
+    clearerr(fh);
+    return bulk;
+
+channel_error:
+    error_setg(errp, "failed to read from the bulk channel");
+    ga_channel_drop_client(c);
+    clearerr(fh);
+    return NULL;
+}
+
 struct GuestFileSeek *qmp_guest_file_seek(int64_t handle, int64_t offset,
                                           GuestFileWhence *whence_code,
                                           Error **errp)
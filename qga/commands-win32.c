@@ -424,6 +424,19 @@ done:
     return write_data;
 }
 
+GuestFileBulk *qmp_guest_file_read_bulk(int64_t handle, bool has_count,
+                                        int64_t count, Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
+GuestFileBulk *qmp_guest_file_write_bulk(int64_t handle, Error **errp)
+{
+    error_setg(errp, QERR_UNSUPPORTED);
+    return NULL;
+}
+
 GuestFileSeek *qmp_guest_file_seek(int64_t handle, int64_t offset,
                                    GuestFileWhence *whence_code,
                                    Error **errp)
@@ -2048,6 +2061,7 @@ GList *ga_command_blacklist_init(GList *blacklist)
         "guest-set-vcpus",
         "guest-get-memory-blocks", "guest-set-memory-blocks",
         "guest-get-memory-block-size", "guest-get-memory-block-info",
+        "guest-file-read-bulk", "guest-file-write-bulk",
         NULL};
     char **p = (char **)list_unsupported;
 
@@ -15,6 +15,7 @@
 
 #include "qapi/qmp/dispatch.h"
 #include "qga-qapi-types.h"
+#include "channel.h"
 
 #define QGA_READ_COUNT_DEFAULT 4096
 
@@ -43,6 +44,7 @@ void ga_set_frozen(GAState *s);
 void ga_unset_frozen(GAState *s);
 const char *ga_fsfreeze_hook(GAState *s);
 int64_t ga_get_fd_handle(GAState *s, Error **errp);
+GAChannel *ga_get_bulk_channel(GAState *s);
 int ga_parse_whence(GuestFileWhence *whence, Error **errp);
 
 #ifndef _WIN32
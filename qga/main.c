@@ -78,6 +78,7 @@ struct GAState {
     JSONMessageParser parser;
     GMainLoop *main_loop;
     GAChannel *channel;
+    GAChannel *bulk_channel; /* for guest-file-read-bulk and friends */
     bool virtio; /* fastpath to check for virtio to deal with poll() quirks */
     GACommandState *command_state;
     GLogLevelFlags log_level;
@@ -238,6 +239,12 @@ QEMU_COPYRIGHT "\n"
 "                    %s).\n"
 "                    Socket addresses for vsock-listen are written as\n"
 "                    <cid>:<port>.\n"
+#ifndef _WIN32
+"  --bulk-method     transport method for guest-file-read-bulk and\n"
+"                    guest-file-write-bulk, same choices as --method\n"
+"  --bulk-path       device/socket path for the bulk transport. If not\n"
+"                    given, the bulk commands are disabled\n"
+#endif
 "  -l, --logfile     set logfile path, logs to stderr by default\n"
 "  -f, --pidfile     specify pidfile (default is %s)\n"
 #ifdef CONFIG_FSFREEZE
@@ -480,6 +487,11 @@ const char *ga_fsfreeze_hook(GAState *s)
 }
 #endif
 
+GAChannel *ga_get_bulk_channel(GAState *s)
+{
+    return s->bulk_channel;
+}
+
 static void become_daemon(const char *pidfile)
 {
 #ifndef _WIN32
@@ -628,24 +640,34 @@ static gboolean channel_event_cb(GIOCondition condition, gpointer data)
     return true;
 }
 
-static gboolean channel_init(GAState *s, const gchar *method, const gchar *path,
-                             int listen_fd)
+static bool channel_parse_method(const gchar *method,
+                                 GAChannelMethod *channel_method)
 {
-    GAChannelMethod channel_method;
-
     if (strcmp(method, "virtio-serial") == 0) {
-        s->virtio = true; /* virtio requires special handling in some cases */
-        channel_method = GA_CHANNEL_VIRTIO_SERIAL;
+        *channel_method = GA_CHANNEL_VIRTIO_SERIAL;
     } else if (strcmp(method, "isa-serial") == 0) {
-        channel_method = GA_CHANNEL_ISA_SERIAL;
+        *channel_method = GA_CHANNEL_ISA_SERIAL;
     } else if (strcmp(method, "unix-listen") == 0) {
-        channel_method = GA_CHANNEL_UNIX_LISTEN;
+        *channel_method = GA_CHANNEL_UNIX_LISTEN;
     } else if (strcmp(method, "vsock-listen") == 0) {
-        channel_method = GA_CHANNEL_VSOCK_LISTEN;
+        *channel_method = GA_CHANNEL_VSOCK_LISTEN;
     } else {
         g_critical("unsupported channel method/type: %s", method);
         return false;
     }
+    return true;
+}
+
+static gboolean channel_init(GAState *s, const gchar *method, const gchar *path,
+                             int listen_fd)
+{
+    GAChannelMethod channel_method;
+
+    if (!channel_parse_method(method, &channel_method)) {
+        return false;
+    }
+    /* virtio requires special handling in some cases */
+    s->virtio = channel_method == GA_CHANNEL_VIRTIO_SERIAL;
 
     s->channel = ga_channel_new(channel_method, path, listen_fd,
                                 channel_event_cb, s);
@@ -657,6 +679,31 @@ static gboolean channel_init(GAState *s, const gchar *method, const gchar *path,
     return true;
 }
 
+#ifndef _WIN32
+/*
+ * The bulk channel only carries the data of guest-file-read-bulk and
+ * guest-file-write-bulk, which read and write it synchronously, so it is
+ * not watched for input.
+ */
+static gboolean bulk_channel_init(GAState *s, const gchar *method,
+                                  const gchar *path)
+{
+    GAChannelMethod channel_method;
+
+    if (!channel_parse_method(method, &channel_method)) {
+        return false;
+    }
+
+    s->bulk_channel = ga_channel_new(channel_method, path, -1, NULL, NULL);
+    if (!s->bulk_channel) {
+        g_critical("failed to create guest agent bulk channel");
+        return false;
+    }
+
+    return true;
+}
+#endif
+
 #ifdef _WIN32
 DWORD WINAPI handle_serial_device_events(DWORD type, LPVOID data)
 {
@@ -948,6 +995,8 @@ static GList *split_list(const gchar *str, const gchar *delim)
 struct GAConfig {
     char *channel_path;
     char *method;
+    char *bulk_path;
+    char *bulk_method;
     char *log_filepath;
     char *pid_filepath;
 #ifdef CONFIG_FSFREEZE
@@ -988,6 +1037,14 @@ static void config_load(GAConfig *config)
         config->channel_path =
             g_key_file_get_string(keyfile, "general", "path", &gerr);
     }
+    if (g_key_file_has_key(keyfile, "general", "bulk-method", NULL)) {
+        config->bulk_method =
+            g_key_file_get_string(keyfile, "general", "bulk-method", &gerr);
+    }
+    if (g_key_file_has_key(keyfile, "general", "bulk-path", NULL)) {
+        config->bulk_path =
+            g_key_file_get_string(keyfile, "general", "bulk-path", &gerr);
+    }
     if (g_key_file_has_key(keyfile, "general", "logfile", NULL)) {
         config->log_filepath =
             g_key_file_get_string(keyfile, "general", "logfile", &gerr);
@@ -1063,6 +1120,12 @@ static void config_dump(GAConfig *config)
     if (config->channel_path) {
         g_key_file_set_string(keyfile, "general", "path", config->channel_path);
     }
+    if (config->bulk_path) {
+        g_key_file_set_string(keyfile, "general", "bulk-method",
+                              config->bulk_method);
+        g_key_file_set_string(keyfile, "general", "bulk-path",
+                              config->bulk_path);
+    }
     if (config->log_filepath) {
         g_key_file_set_string(keyfile, "general", "logfile",
                               config->log_filepath);
@@ -1095,6 +1158,11 @@ static void config_dump(GAConfig *config)
     g_key_file_free(keyfile);
 }
 
+enum {
+    OPTION_BULK_METHOD = 256,
+    OPTION_BULK_PATH,
+};
+
 static void config_parse(GAConfig *config, int argc, char **argv)
 {
     const char *sopt = "hVvdm:p:l:f:F::b:s:t:Dr";
@@ -1118,6 +1186,10 @@ static void config_parse(GAConfig *config, int argc, char **argv)
 #endif
         { "statedir", 1, NULL, 't' },
         { "retry-path", 0, NULL, 'r' },
+#ifndef _WIN32
+        { "bulk-method", 1, NULL, OPTION_BULK_METHOD },
+        { "bulk-path", 1, NULL, OPTION_BULK_PATH },
+#endif
         { NULL, 0, NULL, 0 }
     };
 
@@ -1131,6 +1203,14 @@ static void config_parse(GAConfig *config, int argc, char **argv)
             g_free(config->channel_path);
             config->channel_path = g_strdup(optarg);
             break;
+        case OPTION_BULK_METHOD:
+            g_free(config->bulk_method);
+            config->bulk_method = g_strdup(optarg);
+            break;
+        case OPTION_BULK_PATH:
+            g_free(config->bulk_path);
+            config->bulk_path = g_strdup(optarg);
+            break;
         case 'l':
             g_free(config->log_filepath);
             config->log_filepath = g_strdup(optarg);
@@ -1221,6 +1301,8 @@ static void config_free(GAConfig *config)
     g_free(config->pid_filepath);
     g_free(config->state_dir);
     g_free(config->channel_path);
+    g_free(config->bulk_method);
+    g_free(config->bulk_path);
     g_free(config->bliststr);
 #ifdef CONFIG_FSFREEZE
     g_free(config->fsfreeze_hook);
@@ -1332,6 +1414,12 @@ static GAState *initialize_agent(GAConfig *config, int socket_activation)
     }
 
     config->blacklist = ga_command_blacklist_init(config->blacklist);
+    if (!config->bulk_path) {
+        config->blacklist = g_list_append(config->blacklist,
+                                          g_strdup("guest-file-read-bulk"));
+        config->blacklist = g_list_append(config->blacklist,
+                                          g_strdup("guest-file-write-bulk"));
+    }
     if (config->blacklist) {
         GList *l = config->blacklist;
         s->blacklist = config->blacklist;
@@ -1397,11 +1485,24 @@ static int run_agent_once(GAState *s)
         return EXIT_FAILURE;
     }
 
+#ifndef _WIN32
+    if (s->config->bulk_path &&
+        !bulk_channel_init(s, s->config->bulk_method, s->config->bulk_path)) {
+        ga_channel_free(s->channel);
+        s->channel = NULL;
+        return EXIT_FAILURE;
+    }
+#endif
+
     g_main_loop_run(ga_state->main_loop);
 
     if (s->channel) {
         ga_channel_free(s->channel);
     }
+    if (s->bulk_channel) {
+        ga_channel_free(s->bulk_channel);
+        s->bulk_channel = NULL;
+    }
 
     return EXIT_SUCCESS;
 }
@@ -1482,6 +1583,9 @@ int main(int argc, char **argv)
     if (config->method == NULL) {
         config->method = g_strdup("virtio-serial");
     }
+    if (config->bulk_method == NULL) {
+        config->bulk_method = g_strdup("virtio-serial");
+    }
 
     socket_activation = check_socket_activation();
     if (socket_activation > 1) {
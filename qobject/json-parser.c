@@ -24,50 +24,42 @@
 #include "qapi/qmp/qstring.h"
 #include "json-parser-int.h"
 
-struct JSONToken {
-    JSONTokenType type;
-    int x;
-    int y;
-    char str[];
-};
-
-typedef struct JSONParserContext
-{
-    Error *err;
-    JSONToken *current;
-    GQueue *buf;
-    va_list *ap;
-} JSONParserContext;
-
-#define BUG_ON(cond) assert(!(cond))
+typedef enum JSONParserState {
+    JSON_PARSER_VALUE,          /* expecting a value */
+    JSON_PARSER_VALUE_OR_END,   /* after '[': a value or ']' */
+    JSON_PARSER_KEY,            /* after ',' in an object: a key */
+    JSON_PARSER_KEY_OR_END,     /* after '{': a key or '}' */
+    JSON_PARSER_COLON,          /* after a key: ':' */
+    JSON_PARSER_COMMA_OR_END,   /* after a member: ',' or the closing token */
+} JSONParserState;
 
-/**
- * TODO
- *
- * 0) make errors meaningful again
- * 1) add geometry information to tokens
- * 3) should we return a parsed size?
- * 4) deal with premature EOI
+/*
+ * One open array or object.  Values are added to it as soon as they
+ * are complete, so no tokens need to be kept around.
  */
+typedef struct JSONParserStackEntry {
+    QObject *container;
+    QString *key;               /* pending key of an object member */
+} JSONParserStackEntry;
 
-static QObject *parse_value(JSONParserContext *ctxt);
+#define BUG_ON(cond) assert(!(cond))
 
 /**
  * Error handler
  */
-static void GCC_FMT_ATTR(3, 4) parse_error(JSONParserContext *ctxt,
-                                           JSONToken *token, const char *msg, ...)
+static void GCC_FMT_ATTR(2, 3) parse_error(JSONParser *parser,
+                                           const char *msg, ...)
 {
     va_list ap;
     char message[1024];
 
-    if (ctxt->err) {
+    if (parser->err) {
         return;
     }
     va_start(ap, msg);
     vsnprintf(message, sizeof(message), msg, ap);
     va_end(ap);
-    error_setg(&ctxt->err, "JSON parse error, %s", message);
+    error_setg(&parser->err, "JSON parse error, %s", message);
 }
 
 static int cvt4hex(const char *s)
@@ -127,9 +119,8 @@ static int cvt4hex(const char *s)
  * - Invalid Unicode characters are rejected.
  * - Control characters \x00..\x1F are rejected by the lexer.
  */
-static QString *parse_string(JSONParserContext *ctxt, JSONToken *token)
+static QString *parse_string(JSONParser *parser, const char *ptr)
 {
-    const char *ptr = token->str;
     QString *str;
     char quote;
     const char *beg;
@@ -144,6 +135,18 @@ static QString *parse_string(JSONParserContext *ctxt, JSONToken *token)
 
     while (*ptr != quote) {
         assert(*ptr);
+
+        /* Copy runs of plain ASCII in one go */
+        beg = ptr;
+        while ((unsigned char)*ptr >= 0x20 && (unsigned char)*ptr < 0x80 &&
+               *ptr != quote && *ptr != '\\' && *ptr != '%') {
+            ptr++;
+        }
+        if (ptr != beg) {
+            qstring_append_len(str, beg, ptr - beg);
+            continue;
+        }
+
         switch (*ptr) {
         case '\\':
             beg = ptr++;
@@ -195,7 +198,7 @@ static QString *parse_string(JSONParserContext *ctxt, JSONToken *token)
                 }
 
                 if (mod_utf8_encode(utf8_buf, sizeof(utf8_buf), cp) < 0) {
-                    parse_error(ctxt, token,
+                    parse_error(parser,
                                 "%.*s is not a valid Unicode character",
                                 (int)(ptr - beg), beg);
                     goto out;
@@ -203,14 +206,14 @@ static QString *parse_string(JSONParserContext *ctxt, JSONToken *token)
                 qstring_append(str, utf8_buf);
                 break;
             default:
-                parse_error(ctxt, token, "invalid escape sequence in string");
+                parse_error(parser, "invalid escape sequence in string");
                 goto out;
             }
             break;
         case '%':
-            if (ctxt->ap) {
+            if (parser->ap) {
                 if (ptr[1] != '%') {
-                    parse_error(ctxt, token, "can't interpolate into string");
+                    parse_error(parser, "can't interpolate into string");
                     goto out;
                 }
                 ptr++;
@@ -219,7 +222,7 @@ static QString *parse_string(JSONParserContext *ctxt, JSONToken *token)
         default:
             cp = mod_utf8_codepoint(ptr, 6, &end);
             if (cp < 0) {
-                parse_error(ctxt, token, "invalid UTF-8 sequence in string");
+                parse_error(parser, "invalid UTF-8 sequence in string");
                 goto out;
             }
             ptr = end;
@@ -236,259 +239,56 @@ out:
     return NULL;
 }
 
-/* Note: the token object returned by parser_context_peek_token or
- * parser_context_pop_token is deleted as soon as parser_context_pop_token
- * is called again.
- */
-static JSONToken *parser_context_pop_token(JSONParserContext *ctxt)
-{
-    g_free(ctxt->current);
-    ctxt->current = g_queue_pop_head(ctxt->buf);
-    return ctxt->current;
-}
-
-static JSONToken *parser_context_peek_token(JSONParserContext *ctxt)
+static QObject *parse_keyword(JSONParser *parser, const char *str)
 {
-    return g_queue_peek_head(ctxt->buf);
-}
-
-/**
- * Parsing rules
- */
-static int parse_pair(JSONParserContext *ctxt, QDict *dict)
-{
-    QObject *key_obj = NULL;
-    QString *key;
-    QObject *value;
-    JSONToken *peek, *token;
-
-    peek = parser_context_peek_token(ctxt);
-    if (peek == NULL) {
-        parse_error(ctxt, NULL, "premature EOI");
-        goto out;
-    }
-
-    key_obj = parse_value(ctxt);
-    key = qobject_to(QString, key_obj);
-    if (!key) {
-        parse_error(ctxt, peek, "key is not a string in object");
-        goto out;
-    }
-
-    token = parser_context_pop_token(ctxt);
-    if (token == NULL) {
-        parse_error(ctxt, NULL, "premature EOI");
-        goto out;
-    }
-
-    if (token->type != JSON_COLON) {
-        parse_error(ctxt, token, "missing : in object pair");
-        goto out;
-    }
-
-    value = parse_value(ctxt);
-    if (value == NULL) {
-        parse_error(ctxt, token, "Missing value in dict");
-        goto out;
-    }
-
-    if (qdict_haskey(dict, qstring_get_str(key))) {
-        parse_error(ctxt, token, "duplicate key");
-        goto out;
-    }
-
-    qdict_put_obj(dict, qstring_get_str(key), value);
-
-    qobject_unref(key_obj);
-    return 0;
-
-out:
-    qobject_unref(key_obj);
-    return -1;
-}
-
-static QObject *parse_object(JSONParserContext *ctxt)
-{
-    QDict *dict = NULL;
-    JSONToken *token, *peek;
-
-    token = parser_context_pop_token(ctxt);
-    assert(token && token->type == JSON_LCURLY);
-
-    dict = qdict_new();
-
-    peek = parser_context_peek_token(ctxt);
-    if (peek == NULL) {
-        parse_error(ctxt, NULL, "premature EOI");
-        goto out;
-    }
-
-    if (peek->type != JSON_RCURLY) {
-        if (parse_pair(ctxt, dict) == -1) {
-            goto out;
-        }
-
-        token = parser_context_pop_token(ctxt);
-        if (token == NULL) {
-            parse_error(ctxt, NULL, "premature EOI");
-            goto out;
-        }
-
-        while (token->type != JSON_RCURLY) {
-            if (token->type != JSON_COMMA) {
-                parse_error(ctxt, token, "expected separator in dict");
-                goto out;
-            }
-
-            if (parse_pair(ctxt, dict) == -1) {
-                goto out;
-            }
-
-            token = parser_context_pop_token(ctxt);
-            if (token == NULL) {
-                parse_error(ctxt, NULL, "premature EOI");
-                goto out;
-            }
-        }
-    } else {
-        (void)parser_context_pop_token(ctxt);
-    }
-
-    return QOBJECT(dict);
-
-out:
-    qobject_unref(dict);
-    return NULL;
-}
-
-static QObject *parse_array(JSONParserContext *ctxt)
-{
-    QList *list = NULL;
-    JSONToken *token, *peek;
-
-    token = parser_context_pop_token(ctxt);
-    assert(token && token->type == JSON_LSQUARE);
-
-    list = qlist_new();
-
-    peek = parser_context_peek_token(ctxt);
-    if (peek == NULL) {
-        parse_error(ctxt, NULL, "premature EOI");
-        goto out;
-    }
-
-    if (peek->type != JSON_RSQUARE) {
-        QObject *obj;
-
-        obj = parse_value(ctxt);
-        if (obj == NULL) {
-            parse_error(ctxt, token, "expecting value");
-            goto out;
-        }
-
-        qlist_append_obj(list, obj);
-
-        token = parser_context_pop_token(ctxt);
-        if (token == NULL) {
-            parse_error(ctxt, NULL, "premature EOI");
-            goto out;
-        }
-
-        while (token->type != JSON_RSQUARE) {
-            if (token->type != JSON_COMMA) {
-                parse_error(ctxt, token, "expected separator in list");
-                goto out;
-            }
-
-            obj = parse_value(ctxt);
-            if (obj == NULL) {
-                parse_error(ctxt, token, "expecting value");
-                goto out;
-            }
-
-            qlist_append_obj(list, obj);
-
-            token = parser_context_pop_token(ctxt);
-            if (token == NULL) {
-                parse_error(ctxt, NULL, "premature EOI");
-                goto out;
-            }
-        }
-    } else {
-        (void)parser_context_pop_token(ctxt);
-    }
-
-    return QOBJECT(list);
-
-out:
-    qobject_unref(list);
-    return NULL;
-}
-
-static QObject *parse_keyword(JSONParserContext *ctxt)
-{
-    JSONToken *token;
-
-    token = parser_context_pop_token(ctxt);
-    assert(token && token->type == JSON_KEYWORD);
-
-    if (!strcmp(token->str, "true")) {
+    if (!strcmp(str, "true")) {
         return QOBJECT(qbool_from_bool(true));
-    } else if (!strcmp(token->str, "false")) {
+    } else if (!strcmp(str, "false")) {
         return QOBJECT(qbool_from_bool(false));
-    } else if (!strcmp(token->str, "null")) {
+    } else if (!strcmp(str, "null")) {
         return QOBJECT(qnull());
     }
-    parse_error(ctxt, token, "invalid keyword '%s'", token->str);
+    parse_error(parser, "invalid keyword '%s'", str);
     return NULL;
 }
 
-static QObject *parse_interpolation(JSONParserContext *ctxt)
+static QObject *parse_interpolation(JSONParser *parser, const char *str)
 {
-    JSONToken *token;
-
-    token = parser_context_pop_token(ctxt);
-    assert(token && token->type == JSON_INTERP);
-
-    if (!strcmp(token->str, "%p")) {
-        return va_arg(*ctxt->ap, QObject *);
-    } else if (!strcmp(token->str, "%i")) {
-        return QOBJECT(qbool_from_bool(va_arg(*ctxt->ap, int)));
-    } else if (!strcmp(token->str, "%d")) {
-        return QOBJECT(qnum_from_int(va_arg(*ctxt->ap, int)));
-    } else if (!strcmp(token->str, "%ld")) {
-        return QOBJECT(qnum_from_int(va_arg(*ctxt->ap, long)));
-    } else if (!strcmp(token->str, "%lld")) {
-        return QOBJECT(qnum_from_int(va_arg(*ctxt->ap, long long)));
-    } else if (!strcmp(token->str, "%" PRId64)) {
-        return QOBJECT(qnum_from_int(va_arg(*ctxt->ap, int64_t)));
-    } else if (!strcmp(token->str, "%u")) {
-        return QOBJECT(qnum_from_uint(va_arg(*ctxt->ap, unsigned int)));
-    } else if (!strcmp(token->str, "%lu")) {
-        return QOBJECT(qnum_from_uint(va_arg(*ctxt->ap, unsigned long)));
-    } else if (!strcmp(token->str, "%llu")) {
-        return QOBJECT(qnum_from_uint(va_arg(*ctxt->ap, unsigned long long)));
-    } else if (!strcmp(token->str, "%" PRIu64)) {
-        return QOBJECT(qnum_from_uint(va_arg(*ctxt->ap, uint64_t)));
-    } else if (!strcmp(token->str, "%s")) {
-        return QOBJECT(qstring_from_str(va_arg(*ctxt->ap, const char *)));
-    } else if (!strcmp(token->str, "%f")) {
-        return QOBJECT(qnum_from_double(va_arg(*ctxt->ap, double)));
+    if (!strcmp(str, "%p")) {
+        return va_arg(*parser->ap, QObject *);
+    } else if (!strcmp(str, "%i")) {
+        return QOBJECT(qbool_from_bool(va_arg(*parser->ap, int)));
+    } else if (!strcmp(str, "%d")) {
+        return QOBJECT(qnum_from_int(va_arg(*parser->ap, int)));
+    } else if (!strcmp(str, "%ld")) {
+        return QOBJECT(qnum_from_int(va_arg(*parser->ap, long)));
+    } else if (!strcmp(str, "%lld")) {
+        return QOBJECT(qnum_from_int(va_arg(*parser->ap, long long)));
+    } else if (!strcmp(str, "%" PRId64)) {
+        return QOBJECT(qnum_from_int(va_arg(*parser->ap, int64_t)));
+    } else if (!strcmp(str, "%u")) {
+        return QOBJECT(qnum_from_uint(va_arg(*parser->ap, unsigned int)));
+    } else if (!strcmp(str, "%lu")) {
+        return QOBJECT(qnum_from_uint(va_arg(*parser->ap, unsigned long)));
+    } else if (!strcmp(str, "%llu")) {
+        return QOBJECT(qnum_from_uint(va_arg(*parser->ap, unsigned long long)));
+    } else if (!strcmp(str, "%" PRIu64)) {
+        return QOBJECT(qnum_from_uint(va_arg(*parser->ap, uint64_t)));
+    } else if (!strcmp(str, "%s")) {
+        return QOBJECT(qstring_from_str(va_arg(*parser->ap, const char *)));
+    } else if (!strcmp(str, "%f")) {
+        return QOBJECT(qnum_from_double(va_arg(*parser->ap, double)));
     }
-    parse_error(ctxt, token, "invalid interpolation '%s'", token->str);
+    parse_error(parser, "invalid interpolation '%s'", str);
     return NULL;
 }
 
-static QObject *parse_literal(JSONParserContext *ctxt)
+static QObject *parse_literal(JSONParser *parser, JSONTokenType type,
+                              const char *str)
 {
-    JSONToken *token;
-
-    token = parser_context_pop_token(ctxt);
-    assert(token);
-
-    switch (token->type) {
+    switch (type) {
     case JSON_STRING:
-        return QOBJECT(parse_string(ctxt, token));
+        return QOBJECT(parse_string(parser, str));
     case JSON_INTEGER: {
         /*
          * Represent JSON_INTEGER as QNUM_I64 if possible, else as
@@ -506,14 +306,14 @@ static QObject *parse_literal(JSONParserContext *ctxt)
         int64_t value;
         uint64_t uvalue;
 
-        ret = qemu_strtoi64(token->str, NULL, 10, &value);
+        ret = qemu_strtoi64(str, NULL, 10, &value);
         if (!ret) {
             return QOBJECT(qnum_from_int(value));
         }
         assert(ret == -ERANGE);
 
-        if (token->str[0] != '-') {
-            ret = qemu_strtou64(token->str, NULL, 10, &uvalue);
+        if (str[0] != '-') {
+            ret = qemu_strtou64(str, NULL, 10, &uvalue);
             if (!ret) {
                 return QOBJECT(qnum_from_uint(uvalue));
             }
@@ -525,67 +325,212 @@ static QObject *parse_literal(JSONParserContext *ctxt)
         /* FIXME dependent on locale; a pervasive issue in QEMU */
         /* FIXME our lexer matches RFC 8259 in forbidding Inf or NaN,
          * but those might be useful extensions beyond JSON */
-        return QOBJECT(qnum_from_double(strtod(token->str, NULL)));
+        return QOBJECT(qnum_from_double(strtod(str, NULL)));
     default:
         abort();
     }
 }
 
-static QObject *parse_value(JSONParserContext *ctxt)
+/*
+ * Parse a token that is a complete value by itself.  Return NULL when
+ * it isn't one, or on error.
+ */
+static QObject *parse_scalar(JSONParser *parser, JSONTokenType type,
+                             const char *str)
 {
-    JSONToken *token;
-
-    token = parser_context_peek_token(ctxt);
-    if (token == NULL) {
-        parse_error(ctxt, NULL, "premature EOI");
-        return NULL;
-    }
-
-    switch (token->type) {
-    case JSON_LCURLY:
-        return parse_object(ctxt);
-    case JSON_LSQUARE:
-        return parse_array(ctxt);
+    switch (type) {
     case JSON_INTERP:
-        return parse_interpolation(ctxt);
+        return parse_interpolation(parser, str);
     case JSON_INTEGER:
     case JSON_FLOAT:
     case JSON_STRING:
-        return parse_literal(ctxt);
+        return parse_literal(parser, type, str);
     case JSON_KEYWORD:
-        return parse_keyword(ctxt);
+        return parse_keyword(parser, str);
     default:
-        parse_error(ctxt, token, "expecting value");
         return NULL;
     }
 }
 
-JSONToken *json_token(JSONTokenType type, int x, int y, GString *tokstr)
+static JSONParserStackEntry *parser_top(JSONParser *parser)
+{
+    assert(parser->stack->len);
+    return &g_array_index(parser->stack, JSONParserStackEntry,
+                          parser->stack->len - 1);
+}
+
+/*
+ * Store a complete value into the innermost open container.  Return
+ * it instead if it is the top-level value, which completes the parse.
+ */
+static QObject *parser_add_value(JSONParser *parser, QObject *value)
+{
+    JSONParserStackEntry *top;
+    QDict *dict;
+
+    if (!parser->stack->len) {
+        parser->state = JSON_PARSER_VALUE;
+        return value;
+    }
+
+    top = parser_top(parser);
+    dict = qobject_to(QDict, top->container);
+    if (dict) {
+        if (qdict_haskey(dict, qstring_get_str(top->key))) {
+            parse_error(parser, "duplicate key");
+            qobject_unref(value);
+            return NULL;
+        }
+        qdict_put_obj(dict, qstring_get_str(top->key), value);
+        qobject_unref(top->key);
+        top->key = NULL;
+    } else {
+        qlist_append_obj(qobject_to(QList, top->container), value);
+    }
+    parser->state = JSON_PARSER_COMMA_OR_END;
+    return NULL;
+}
+
+static void parser_push(JSONParser *parser, QObject *container)
+{
+    JSONParserStackEntry entry = { .container = container };
+
+    g_array_append_val(parser->stack, entry);
+}
+
+static QObject *parser_pop(JSONParser *parser)
 {
-    JSONToken *token = g_malloc(sizeof(JSONToken) + tokstr->len + 1);
-
-    token->type = type;
-    memcpy(token->str, tokstr->str, tokstr->len);
-    token->str[tokstr->len] = 0;
-    token->x = x;
-    token->y = y;
-    return token;
+    QObject *container = parser_top(parser)->container;
+
+    g_array_set_size(parser->stack, parser->stack->len - 1);
+    return parser_add_value(parser, container);
 }
 
-QObject *json_parser_parse(GQueue *tokens, va_list *ap, Error **errp)
+/**
+ * Parsing rules
+ *
+ * Tokens are consumed one at a time as the lexer produces them, and
+ * the QObject is built as we go.  Return the value once its last token
+ * has been fed, else NULL.  After an error, the rest of the message is
+ * ignored until json_parser_reset().
+ */
+QObject *json_parser_feed(JSONParser *parser, JSONTokenType type,
+                          const char *str)
 {
-    JSONParserContext ctxt = { .buf = tokens, .ap = ap };
-    QObject *result;
+    JSONParserStackEntry *top;
+    QObject *value;
+    QString *key;
+    bool is_dict;
+
+    if (parser->err) {
+        return NULL;
+    }
+
+    switch (parser->state) {
+    case JSON_PARSER_VALUE_OR_END:
+        if (type == JSON_RSQUARE) {
+            return parser_pop(parser);
+        }
+        /* fall through */
+    case JSON_PARSER_VALUE:
+        switch (type) {
+        case JSON_LCURLY:
+            parser_push(parser, QOBJECT(qdict_new()));
+            parser->state = JSON_PARSER_KEY_OR_END;
+            return NULL;
+        case JSON_LSQUARE:
+            parser_push(parser, QOBJECT(qlist_new()));
+            parser->state = JSON_PARSER_VALUE_OR_END;
+            return NULL;
+        default:
+            value = parse_scalar(parser, type, str);
+            if (!value) {
+                parse_error(parser, "expecting value");
+                return NULL;
+            }
+            return parser_add_value(parser, value);
+        }
+
+    case JSON_PARSER_KEY_OR_END:
+        if (type == JSON_RCURLY) {
+            return parser_pop(parser);
+        }
+        /* fall through */
+    case JSON_PARSER_KEY:
+        value = parse_scalar(parser, type, str);
+        key = qobject_to(QString, value);
+        if (!key) {
+            qobject_unref(value);
+            parse_error(parser, "key is not a string in object");
+            return NULL;
+        }
+        parser_top(parser)->key = key;
+        parser->state = JSON_PARSER_COLON;
+        return NULL;
+
+    case JSON_PARSER_COLON:
+        if (type != JSON_COLON) {
+            parse_error(parser, "missing : in object pair");
+            return NULL;
+        }
+        parser->state = JSON_PARSER_VALUE;
+        return NULL;
 
-    result = parse_value(&ctxt);
-    assert(ctxt.err || g_queue_is_empty(ctxt.buf));
+    case JSON_PARSER_COMMA_OR_END:
+        top = parser_top(parser);
+        is_dict = qobject_type(top->container) == QTYPE_QDICT;
+        if (type == JSON_COMMA) {
+            parser->state = is_dict ? JSON_PARSER_KEY : JSON_PARSER_VALUE;
+            return NULL;
+        }
+        if (type == (is_dict ? JSON_RCURLY : JSON_RSQUARE)) {
+            return parser_pop(parser);
+        }
+        parse_error(parser, is_dict ? "expected separator in dict"
+                    : "expected separator in list");
+        return NULL;
 
-    error_propagate(errp, ctxt.err);
+    default:
+        abort();
+    }
+}
 
-    while (!g_queue_is_empty(ctxt.buf)) {
-        parser_context_pop_token(&ctxt);
+/*
+ * End the current message.  An error, including a value that was not
+ * complete yet, goes to @errp; pass NULL to discard it.
+ */
+void json_parser_reset(JSONParser *parser, Error **errp)
+{
+    JSONParserStackEntry *entry;
+    guint i;
+
+    if (parser->stack->len) {
+        parse_error(parser, "premature EOI");
+    }
+    for (i = 0; i < parser->stack->len; i++) {
+        entry = &g_array_index(parser->stack, JSONParserStackEntry, i);
+        qobject_unref(entry->container);
+        qobject_unref(entry->key);
+    }
+    g_array_set_size(parser->stack, 0);
+    parser->state = JSON_PARSER_VALUE;
+
+    if (parser->err) {
+        error_propagate(errp, parser->err);
+        parser->err = NULL;
     }
-    g_free(ctxt.current);
+}
 
-    return result;
+void json_parser_init(JSONParser *parser, va_list *ap)
+{
+    parser->err = NULL;
+    parser->ap = ap;
+    parser->stack = g_array_new(false, false, sizeof(JSONParserStackEntry));
+    parser->state = JSON_PARSER_VALUE;
+}
+
+void json_parser_destroy(JSONParser *parser)
+{
+    json_parser_reset(parser, NULL);
+    g_array_free(parser->stack, true);
 }
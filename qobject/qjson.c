@@ -151,6 +151,72 @@ QDict *qdict_from_jsonf_nofail(const char *string, ...)
 
 static void to_json(const QObject *obj, QString *str, int pretty, int indent);
 
+static void json_quote_string(QString *str, const char *ptr)
+{
+    const char *beg;
+    int cp;
+    char buf[16];
+    char *end;
+
+    qstring_append_chr(str, '"');
+
+    while (*ptr) {
+        /* Most member names and values need no escaping at all */
+        beg = ptr;
+        while (*ptr >= 0x20 && *ptr < 0x7F && *ptr != '"' && *ptr != '\\') {
+            ptr++;
+        }
+        if (ptr != beg) {
+            qstring_append_len(str, beg, ptr - beg);
+            continue;
+        }
+
+        cp = mod_utf8_codepoint(ptr, 6, &end);
+        switch (cp) {
+        case '\"':
+            qstring_append(str, "\\\"");
+            break;
+        case '\\':
+            qstring_append(str, "\\\\");
+            break;
+        case '\b':
+            qstring_append(str, "\\b");
+            break;
+        case '\f':
+            qstring_append(str, "\\f");
+            break;
+        case '\n':
+            qstring_append(str, "\\n");
+            break;
+        case '\r':
+            qstring_append(str, "\\r");
+            break;
+        case '\t':
+            qstring_append(str, "\\t");
+            break;
+        default:
+            if (cp < 0) {
+                cp = 0xFFFD; /* replacement character */
+            }
+            if (cp > 0xFFFF) {
+                /* beyond BMP; need a surrogate pair */
+                snprintf(buf, sizeof(buf), "\\u%04X\\u%04X",
+                         0xD800 + ((cp - 0x10000) >> 10),
+                         0xDC00 + ((cp - 0x10000) & 0x3FF));
+            } else if (cp < 0x20 || cp >= 0x7F) {
+                snprintf(buf, sizeof(buf), "\\u%04X", cp);
+            } else {
+                buf[0] = cp;
+                buf[1] = 0;
+            }
+            qstring_append(str, buf);
+        }
+        ptr = end;
+    }
+
+    qstring_append_chr(str, '"');
+}
+
 static void json_pretty_newline(QString *str, bool pretty, int indent)
 {
     int i;
@@ -171,73 +237,32 @@ static void to_json(const QObject *obj, QString *str, int pretty, int indent)
         break;
     case QTYPE_QNUM: {
         QNum *val = qobject_to(QNum, obj);
-        char *buffer = qnum_to_string(val);
-        qstring_append(str, buffer);
-        g_free(buffer);
+        char buffer[32];
+        char *dbl;
+
+        switch (val->kind) {
+        case QNUM_I64:
+            qstring_append_int(str, val->u.i64);
+            break;
+        case QNUM_U64:
+            snprintf(buffer, sizeof(buffer), "%" PRIu64, val->u.u64);
+            qstring_append(str, buffer);
+            break;
+        default:
+            dbl = qnum_to_string(val);
+            qstring_append(str, dbl);
+            g_free(dbl);
+        }
         break;
     }
-    case QTYPE_QSTRING: {
-        QString *val = qobject_to(QString, obj);
-        const char *ptr;
-        int cp;
-        char buf[16];
-        char *end;
-
-        ptr = qstring_get_str(val);
-        qstring_append(str, "\"");
-
-        for (; *ptr; ptr = end) {
-            cp = mod_utf8_codepoint(ptr, 6, &end);
-            switch (cp) {
-            case '\"':
-                qstring_append(str, "\\\"");
-                break;
-            case '\\':
-                qstring_append(str, "\\\\");
-                break;
-            case '\b':
-                qstring_append(str, "\\b");
-                break;
-            case '\f':
-                qstring_append(str, "\\f");
-                break;
-            case '\n':
-                qstring_append(str, "\\n");
-                break;
-            case '\r':
-                qstring_append(str, "\\r");
-                break;
-            case '\t':
-                qstring_append(str, "\\t");
-                break;
-            default:
-                if (cp < 0) {
-                    cp = 0xFFFD; /* replacement character */
-                }
-                if (cp > 0xFFFF) {
-                    /* beyond BMP; need a surrogate pair */
-                    snprintf(buf, sizeof(buf), "\\u%04X\\u%04X",
-                             0xD800 + ((cp - 0x10000) >> 10),
-                             0xDC00 + ((cp - 0x10000) & 0x3FF));
-                } else if (cp < 0x20 || cp >= 0x7F) {
-                    snprintf(buf, sizeof(buf), "\\u%04X", cp);
-                } else {
-                    buf[0] = cp;
-                    buf[1] = 0;
-                }
-                qstring_append(str, buf);
-            }
-        };
-
-        qstring_append(str, "\"");
+    case QTYPE_QSTRING:
+        json_quote_string(str, qstring_get_str(qobject_to(QString, obj)));
         break;
-    }
     case QTYPE_QDICT: {
         QDict *val = qobject_to(QDict, obj);
         const char *comma = pretty ? "," : ", ";
         const char *sep = "";
         const QDictEntry *entry;
-        QString *qkey;
 
         qstring_append(str, "{");
 
@@ -247,9 +272,7 @@ static void to_json(const QObject *obj, QString *str, int pretty, int indent)
             qstring_append(str, sep);
             json_pretty_newline(str, pretty, indent + 1);
 
-            qkey = qstring_from_str(qdict_entry_key(entry));
-            to_json(QOBJECT(qkey), str, pretty, indent + 1);
-            qobject_unref(qkey);
+            json_quote_string(str, qdict_entry_key(entry));
 
             qstring_append(str, ": ");
             to_json(qdict_entry_value(entry), str, pretty, indent + 1);
@@ -98,6 +98,12 @@ extern FILE *replay_file;
 extern uint64_t replay_break_icount;
 /* Timer for the replay breakpoint callback */
 extern QEMUTimer *replay_break_timer;
+/* Instructions between the periodic replay snapshots, 0 if disabled */
+extern uint64_t replay_snapshot_period;
+/* Instruction count of the next periodic snapshot */
+extern uint64_t replay_snapshot_icount;
+/* Timer for creating the periodic snapshot in the main loop */
+extern QEMUTimer *replay_snapshot_timer;
 
 void replay_put_byte(uint8_t byte);
 void replay_put_event(uint8_t event);
@@ -194,5 +200,7 @@ void *replay_event_net_load(void);
    Should be called before virtual devices initialization
    to make cached timers available for post_load functions. */
 void replay_vmstate_register(void);
+/* Sets up creation of the periodic snapshots while replaying. */
+void replay_snapshot_start(void);
 
 #endif
@@ -18,6 +18,11 @@
 #include "qemu/error-report.h"
 #include "migration/vmstate.h"
 #include "migration/snapshot.h"
+#include "qemu/timer.h"
+
+uint64_t replay_snapshot_period;
+uint64_t replay_snapshot_icount = -1ULL;
+QEMUTimer *replay_snapshot_timer;
 
 static int replay_pre_save(void *opaque)
 {
@@ -92,6 +97,54 @@ void replay_vmstate_init(void)
     }
 }
 
+static void replay_snapshot_create(void *opaque)
+{
+    uint64_t icount = replay_get_current_icount();
+    Error *err = NULL;
+    char *name;
+
+    if (!replay_can_snapshot()) {
+        /*
+         * Let the vCPU run until the pending events are processed
+         * and try again a bit later.
+         */
+        replay_snapshot_icount = -1ULL;
+        timer_mod_ns(replay_snapshot_timer,
+                     qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + 10 * SCALE_MS);
+        return;
+    }
+
+    name = g_strdup_printf("replay_%" PRIu64, icount);
+    if (save_snapshot(name, &err) != 0) {
+        error_report_err(err);
+        error_report("Could not create periodic replay snapshot, "
+                     "disabling rrsnapshot-period");
+        replay_snapshot_period = 0;
+        replay_snapshot_icount = -1ULL;
+        g_free(name);
+        return;
+    }
+    g_free(name);
+
+    /*
+     * Going back to an earlier snapshot does not move the target,
+     * so the same interval is never saved twice.
+     */
+    replay_snapshot_icount = icount + replay_snapshot_period;
+}
+
+void replay_snapshot_start(void)
+{
+    if (!replay_snapshot_period) {
+        return;
+    }
+
+    replay_snapshot_timer = timer_new_ns(QEMU_CLOCK_REALTIME,
+                                         replay_snapshot_create, NULL);
+    replay_snapshot_icount = replay_get_current_icount()
+                             + replay_snapshot_period;
+}
+
 bool replay_can_snapshot(void)
 {
     return replay_mode == REPLAY_MODE_NONE
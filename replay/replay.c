@@ -84,6 +84,13 @@ int replay_get_instructions(void)
                 res = replay_break_icount - current;
             }
         }
+        if (replay_snapshot_icount != -1ULL) {
+            uint64_t current = replay_get_current_icount();
+            if (replay_snapshot_icount >= current
+                && current + res > replay_snapshot_icount) {
+                res = replay_snapshot_icount - current;
+            }
+        }
     }
     replay_mutex_unlock();
     return res;
@@ -116,6 +123,11 @@ void replay_account_executed_instructions(void)
                 timer_mod_ns(replay_break_timer,
                     qemu_clock_get_ns(QEMU_CLOCK_REALTIME));
             }
+            /* Time to take the next periodic snapshot */
+            if (replay_state.current_icount >= replay_snapshot_icount) {
+                timer_mod_ns(replay_snapshot_timer,
+                    qemu_clock_get_ns(QEMU_CLOCK_REALTIME));
+            }
         }
     }
 }
@@ -345,6 +357,11 @@ void replay_configure(QemuOpts *opts)
     }
 
     replay_snapshot = g_strdup(qemu_opt_get(opts, "rrsnapshot"));
+    replay_snapshot_period = qemu_opt_get_number(opts, "rrsnapshot-period", 0);
+    if (replay_snapshot_period && mode != REPLAY_MODE_PLAY) {
+        error_report("rrsnapshot-period is only supported in replay mode");
+        exit(1);
+    }
     replay_vmstate_register();
     replay_enable(fname, mode);
 
@@ -367,8 +384,7 @@ void replay_start(void)
         exit(1);
     }
 
-    /* Timer for snapshotting will be set up here. */
-
+    replay_snapshot_start();
     replay_enable_events();
 }
 
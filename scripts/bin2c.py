@@ -0,0 +1,29 @@
+#!/usr/bin/env python3
+#
+# Convert a binary file to a C array
+#
+# This work is licensed under the terms of the GNU GPL, version 2 or later.
+# See the COPYING file in the top-level directory.
+#
+# Usage: bin2c.py NAME INPUT > OUTPUT.h
+
+import sys
+
+
+def main(name, path):
+    with open(path, 'rb') as f:
+        data = f.read()
+
+    print('/* Generated from %s, do not edit */' % path)
+    print('static const unsigned char %s[] = {' % name)
+    for i in range(0, len(data), 12):
+        chunk = data[i:i + 12]
+        print('    ' + ' '.join('0x%02x,' % b for b in chunk))
+    print('};')
+
+
+if __name__ == '__main__':
+    if len(sys.argv) != 3:
+        sys.stderr.write('Usage: %s NAME INPUT\n' % sys.argv[0])
+        sys.exit(1)
+    main(sys.argv[1], sys.argv[2])
@@ -0,0 +1,127 @@
+#!/usr/bin/env python3
+#
+# Take a snapshot of the ring trace backend's ring file
+#
+# This work is licensed under the terms of the GNU GPL, version 2 or later.
+# See the COPYING file in the top-level directory.
+#
+# For help see docs/devel/tracing.txt
+#
+# Usage: ringtrace.py RING-FILE OUTPUT
+#
+# The output is a binary trace in the simple backend's format, which
+# simpletrace.py can format.  QEMU keeps running while the snapshot is
+# taken; sub-buffers that it overwrites meanwhile are left out.
+
+import heapq
+import mmap
+import struct
+import sys
+
+ring_magic = 0x51454d5552494e47
+ring_version = 1
+ring_header_size = 64
+
+header_event_id = 0xffffffffffffffff
+header_magic    = 0xf2b177cb0aa429b4
+header_version  = 4
+dropped_event_id = 0xfffffffffffffffe
+
+record_type_mapping = 0
+record_type_event = 1
+
+file_header_fmt = '=QIIIIIIQQQQ'
+ring_header_fmt = '=QQQI'
+subbuf_header_fmt = '=QI'
+subbuf_header_size = 16
+event_header_fmt = '=QQII'
+event_header_size = struct.calcsize(event_header_fmt)
+
+
+def read_events_table(m, offset, size):
+    """Return the (id, name) pairs of the event table."""
+    events = []
+    end = offset + size
+    while offset < end:
+        event_id, length = struct.unpack_from('=QI', m, offset)
+        offset += 12
+        events.append((event_id, bytes(m[offset:offset + length])))
+        offset += length
+    return events
+
+
+def snapshot_ring(m, base, subbuf_size, nr_subbufs):
+    """Return the complete records of one ring as a list of bytes."""
+    head, tail, dropped, tid = struct.unpack_from(ring_header_fmt, m, base)
+    ring_size = subbuf_size * nr_subbufs
+    data = base + ring_header_size
+    start = max(head - ring_size, 0) // subbuf_size * subbuf_size
+    records = []
+
+    for pos in range(start, head, subbuf_size):
+        sub = data + pos % ring_size
+        lap, used = struct.unpack_from(subbuf_header_fmt, m, sub)
+        if lap != pos // subbuf_size + 1:
+            continue
+        if used <= subbuf_header_size or used > subbuf_size:
+            continue
+        buf = bytes(m[sub + subbuf_header_size:sub + used])
+        if struct.unpack_from('=Q', m, sub)[0] != lap:
+            continue
+
+        off = 0
+        while off + event_header_size <= len(buf):
+            length = struct.unpack_from(event_header_fmt, buf, off)[2]
+            if length < event_header_size or off + length > len(buf):
+                break
+            records.append(buf[off:off + length])
+            off += (length + 7) & ~7
+    return dropped, records
+
+
+def main(args):
+    if len(args) != 3:
+        sys.stderr.write('usage: %s RING-FILE OUTPUT\n' % args[0])
+        sys.exit(1)
+
+    with open(args[1], 'rb') as f:
+        m = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+
+    (magic, version, pid, nr_rings, max_rings, subbuf_size, nr_subbufs,
+     events_offset, events_size, rings_offset,
+     ring_stride) = struct.unpack_from(file_header_fmt, m, 0)
+    if magic != ring_magic or version != ring_version:
+        sys.stderr.write('%s is not a ring trace file\n' % args[1])
+        sys.exit(1)
+
+    rings = []
+    dropped = 0
+    for i in range(min(nr_rings, max_rings)):
+        n, records = snapshot_ring(m, rings_offset + i * ring_stride,
+                                   subbuf_size, nr_subbufs)
+        dropped += n
+        rings.append(records)
+
+    with open(args[2], 'wb') as out:
+        out.write(struct.pack('=QQQ', header_event_id, header_magic,
+                              header_version))
+        for event_id, name in read_events_table(m, events_offset,
+                                                events_size):
+            out.write(struct.pack('=QQI', record_type_mapping, event_id,
+                                  len(name)))
+            out.write(name)
+
+        if dropped:
+            out.write(struct.pack('=Q', record_type_event))
+            out.write(struct.pack(event_header_fmt + 'Q', dropped_event_id,
+                                  0, event_header_size + 8, pid, dropped))
+
+        # Records of one ring are in timestamp order already
+        key = lambda rec: struct.unpack_from('=Q', rec, 8)[0]
+        for rec in heapq.merge(*rings, key=key):
+            out.write(struct.pack('=Q', record_type_event))
+            out.write(rec)
+
+
+if __name__ == '__main__':
+    main(sys.argv)
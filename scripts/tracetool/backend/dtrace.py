@@ -62,7 +62,12 @@ def generate_h_begin(events, group):
             uppername=e.name.upper())
 
 def generate_h(event, group):
-    out('    QEMU_%(uppername)s(%(argnames)s);',
+    # With SystemTap the probes have semaphores that a tracer increments
+    # when it attaches, so the arguments are only evaluated while someone
+    # is listening.
+    out('    if (QEMU_%(uppername)s_ENABLED()) {',
+        '        QEMU_%(uppername)s(%(argnames)s);',
+        '    }',
         uppername=event.name.upper(),
         argnames=", ".join(event.args.names()))
 
@@ -33,6 +33,8 @@
 /* vcpu throttling controls */
 static QEMUTimer *throttle_timer;
 static unsigned int throttle_percentage;
+/* Whether each vcpu uses its own throttle_percentage */
+static bool throttle_per_vcpu;
 
 #define CPU_THROTTLE_PCT_MIN 1
 #define CPU_THROTTLE_PCT_MAX 99
@@ -40,16 +42,25 @@ static unsigned int throttle_percentage;
 
 static void cpu_throttle_thread(CPUState *cpu, run_on_cpu_data opaque)
 {
-    double pct;
+    double pct, vcpu_pct;
     double throttle_ratio;
     int64_t sleeptime_ns, endtime_ns;
 
     if (!cpu_throttle_get_percentage()) {
         return;
     }
+    if (!cpu_throttle_get_vcpu_percentage(cpu)) {
+        qatomic_set(&cpu->throttle_thread_scheduled, 0);
+        return;
+    }
 
+    /*
+     * The timer ticks at the rate of the global percentage, which is the
+     * highest one; sleep for our own share of each period.
+     */
     pct = (double)cpu_throttle_get_percentage() / 100;
-    throttle_ratio = pct / (1 - pct);
+    vcpu_pct = (double)cpu_throttle_get_vcpu_percentage(cpu) / 100;
+    throttle_ratio = vcpu_pct / (1 - pct);
     /* Add 1ns to fix double's rounding error (like 0.9999999...) */
     sleeptime_ns = (int64_t)(throttle_ratio * CPU_THROTTLE_TIMESLICE_NS + 1);
     endtime_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + sleeptime_ns;
@@ -94,14 +105,50 @@ void cpu_throttle_set(int new_throttle_pct)
     new_throttle_pct = MIN(new_throttle_pct, CPU_THROTTLE_PCT_MAX);
     new_throttle_pct = MAX(new_throttle_pct, CPU_THROTTLE_PCT_MIN);
 
+    qatomic_set(&throttle_per_vcpu, false);
     qatomic_set(&throttle_percentage, new_throttle_pct);
 
     timer_mod(throttle_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL_RT) +
                                        CPU_THROTTLE_TIMESLICE_NS);
 }
 
+void cpu_throttle_set_vcpu(CPUState *cpu, int new_throttle_pct)
+{
+    CPUState *other;
+    int max_pct = 0;
+
+    /* Ensure throttle percentage is within valid range */
+    new_throttle_pct = MIN(new_throttle_pct, CPU_THROTTLE_PCT_MAX);
+    new_throttle_pct = MAX(new_throttle_pct, 0);
+
+    if (!qatomic_read(&throttle_per_vcpu)) {
+        CPU_FOREACH(other) {
+            qatomic_set(&other->throttle_percentage, 0);
+        }
+        qatomic_set(&throttle_per_vcpu, true);
+    }
+    qatomic_set(&cpu->throttle_percentage, new_throttle_pct);
+
+    CPU_FOREACH(other) {
+        max_pct = MAX(max_pct, qatomic_read(&other->throttle_percentage));
+    }
+    if (max_pct == cpu_throttle_get_percentage()) {
+        return;
+    }
+    if (!max_pct) {
+        /* The timer stops on its next tick */
+        qatomic_set(&throttle_percentage, 0);
+        return;
+    }
+
+    qatomic_set(&throttle_percentage, max_pct);
+    timer_mod(throttle_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL_RT) +
+                                       CPU_THROTTLE_TIMESLICE_NS);
+}
+
 void cpu_throttle_stop(void)
 {
+    qatomic_set(&throttle_per_vcpu, false);
     qatomic_set(&throttle_percentage, 0);
 }
 
@@ -115,6 +162,14 @@ int cpu_throttle_get_percentage(void)
     return qatomic_read(&throttle_percentage);
 }
 
+int cpu_throttle_get_vcpu_percentage(CPUState *cpu)
+{
+    if (!qatomic_read(&throttle_per_vcpu)) {
+        return cpu_throttle_get_percentage();
+    }
+    return qatomic_read(&cpu->throttle_percentage);
+}
+
 void cpu_throttle_init(void)
 {
     throttle_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL_RT,
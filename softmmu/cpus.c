@@ -43,6 +43,8 @@
 #include "sysemu/cpu-timers.h"
 #include "hw/boards.h"
 #include "hw/hw.h"
+#include "qemu/processor.h"
+#include "trace.h"
 
 #ifdef CONFIG_LINUX
 
@@ -399,18 +401,75 @@ void qemu_wait_io_event_common(CPUState *cpu)
     process_queued_cpu_work(cpu);
 }
 
+/*
+ * Spin for up to @poll_ns nanoseconds, without the BQL, waiting for the
+ * vCPU to have work.  This is only a hint: the caller checks again with
+ * the BQL taken before going to sleep.
+ */
+static bool qemu_cpu_halt_poll(CPUState *cpu, int64_t poll_ns)
+{
+    int64_t deadline = get_clock() + poll_ns;
+    bool woken = false;
+
+    qemu_mutex_unlock_iothread();
+    do {
+        if (!cpu_thread_is_idle(cpu)) {
+            woken = true;
+            break;
+        }
+        cpu_relax();
+    } while (get_clock() < deadline);
+    qemu_mutex_lock_iothread();
+    return woken;
+}
+
+/*
+ * Adapt the polling window to the time the vCPU stayed idle, like
+ * aio_poll() does: keep polling as long as polling catches the wakeups,
+ * give it up entirely when idle periods are longer than @max_ns.
+ */
+static void qemu_cpu_halt_poll_adjust(CPUState *cpu, int64_t block_ns,
+                                      int64_t max_ns)
+{
+    int64_t old = cpu->halt_poll_ns;
+
+    if (block_ns <= cpu->halt_poll_ns) {
+        return;
+    } else if (block_ns > max_ns) {
+        cpu->halt_poll_ns = 0;
+    } else if (cpu->halt_poll_ns) {
+        cpu->halt_poll_ns = MIN(cpu->halt_poll_ns * 2, max_ns);
+    } else {
+        cpu->halt_poll_ns = MIN(4000, max_ns); /* start at 4 microseconds */
+    }
+    trace_qemu_cpu_halt_poll_adjust(cpu->cpu_index, block_ns, old,
+                                    cpu->halt_poll_ns);
+}
+
 void qemu_wait_io_event(CPUState *cpu)
 {
+    int64_t poll_max_ns = current_accel()->halt_poll_max_ns;
+    int64_t start = 0;
     bool slept = false;
 
     while (cpu_thread_is_idle(cpu)) {
         if (!slept) {
             slept = true;
             qemu_plugin_vcpu_idle_cb(cpu);
+            if (poll_max_ns) {
+                start = get_clock();
+                if (cpu->halt_poll_ns &&
+                    qemu_cpu_halt_poll(cpu, cpu->halt_poll_ns)) {
+                    continue;
+                }
+            }
         }
         qemu_cond_wait(cpu->halt_cond, &qemu_global_mutex);
     }
     if (slept) {
+        if (poll_max_ns) {
+            qemu_cpu_halt_poll_adjust(cpu, get_clock() - start, poll_max_ns);
+        }
         qemu_plugin_vcpu_resume_cb(cpu);
     }
 
@@ -50,6 +50,8 @@
 static bool icount_sleep = true;
 /* Arbitrarily pick 1MIPS as the minimum allowable speed.  */
 #define MAX_ICOUNT_SHIFT 10
+/* Default number of instructions per quantum with MTTCG */
+#define ICOUNT_QUANTUM_DEFAULT 10000
 
 /*
  * 0 = Do not count executed instructions.
@@ -89,6 +91,10 @@ static void icount_update_locked(CPUState *cpu)
     int64_t executed = icount_get_executed(cpu);
     cpu->icount_budget -= executed;
 
+    if (qemu_tcg_mttcg_enabled()) {
+        qatomic_set_i64(&cpu->icount_local, cpu->icount_local + executed);
+        return;
+    }
     qatomic_set_i64(&timers_state.qemu_icount,
                     timers_state.qemu_icount + executed);
 }
@@ -100,6 +106,11 @@ static void icount_update_locked(CPUState *cpu)
  */
 void icount_update(CPUState *cpu)
 {
+    if (qemu_tcg_mttcg_enabled()) {
+        /* Only the vCPU thread writes its own count */
+        icount_update_locked(cpu);
+        return;
+    }
     seqlock_write_lock(&timers_state.vm_clock_seqlock,
                        &timers_state.vm_clock_lock);
     icount_update_locked(cpu);
@@ -118,6 +129,9 @@ static int64_t icount_get_raw_locked(void)
         }
         /* Take into account what has run */
         icount_update_locked(cpu);
+        if (qemu_tcg_mttcg_enabled()) {
+            return qatomic_read_i64(&cpu->icount_local);
+        }
     }
     /* The read is protected by the seqlock, but needs atomic64 to avoid UB */
     return qatomic_read_i64(&timers_state.qemu_icount);
@@ -417,11 +431,90 @@ void icount_account_warp_timer(void)
     icount_warp_rt();
 }
 
+/*
+ * Multi-threaded icount
+ *
+ * With MTTCG every vCPU counts its own instructions in icount_local,
+ * and virtual time advances in quanta.  A vCPU may run until the end of
+ * the current quantum, which falls no later than the next
+ * QEMU_CLOCK_VIRTUAL deadline.  Once all vCPUs that are not idle got
+ * there, the last one moves timers_state.qemu_icount to the end of the
+ * quantum and runs the timers that expired.  A vCPU reads the virtual
+ * clock at its own position and the rest of QEMU reads it at the start
+ * of the quantum, so no vCPU gets further than one quantum ahead of
+ * the others.
+ */
+
+/*
+ * Return how many instructions @cpu may execute before the end of the
+ * current quantum.  A vCPU that was idle catches up with the start of
+ * the quantum first.  Called with the BQL taken.
+ */
+int64_t icount_quantum_budget(CPUState *cpu)
+{
+    int64_t start = qatomic_read_i64(&timers_state.qemu_icount);
+
+    if (cpu->icount_local < start) {
+        qatomic_set_i64(&cpu->icount_local, start);
+    }
+    return MAX(timers_state.icount_quantum_end - cpu->icount_local, 0);
+}
+
+/*
+ * Start the next quantum if every vCPU that is not idle reached the end
+ * of the current one.  Return true if it did.  Called by a vCPU thread
+ * with the BQL taken.
+ */
+bool icount_quantum_advance(void)
+{
+    int64_t end = timers_state.icount_quantum_end;
+    int64_t start, deadline, len;
+    bool reached = false;
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        if (qatomic_read_i64(&cpu->icount_local) >= end) {
+            reached = true;
+        } else if (!cpu_thread_is_idle(cpu)) {
+            return false;
+        }
+    }
+    if (!reached) {
+        /* All vCPUs are idle, the warp timer will move time forward */
+        return false;
+    }
+
+    seqlock_write_lock(&timers_state.vm_clock_seqlock,
+                       &timers_state.vm_clock_lock);
+    start = MAX(end, timers_state.qemu_icount);
+    qatomic_set_i64(&timers_state.qemu_icount, start);
+    seqlock_write_unlock(&timers_state.vm_clock_seqlock,
+                         &timers_state.vm_clock_lock);
+
+    qemu_clock_notify(QEMU_CLOCK_VIRTUAL);
+    qemu_clock_run_timers(QEMU_CLOCK_VIRTUAL);
+
+    len = timers_state.icount_quantum;
+    deadline = qemu_clock_deadline_ns_all(QEMU_CLOCK_VIRTUAL,
+                                          QEMU_TIMER_ATTR_ALL);
+    if (deadline >= 0) {
+        len = MIN(len, MAX(icount_round(deadline), 1));
+    }
+    timers_state.icount_quantum_end = start + len;
+
+    CPU_FOREACH(cpu) {
+        qemu_cond_broadcast(cpu->halt_cond);
+    }
+    return true;
+}
+
 void icount_configure(QemuOpts *opts, Error **errp)
 {
     const char *option = qemu_opt_get(opts, "shift");
     bool sleep = qemu_opt_get_bool(opts, "sleep", true);
     bool align = qemu_opt_get_bool(opts, "align", false);
+    uint64_t quantum = qemu_opt_get_number(opts, "quantum",
+                                           ICOUNT_QUANTUM_DEFAULT);
     long time_shift = -1;
 
     if (!option) {
@@ -436,6 +529,11 @@ void icount_configure(QemuOpts *opts, Error **errp)
         return;
     }
 
+    if (quantum == 0 || quantum > INT32_MAX) {
+        error_setg(errp, "icount: Invalid quantum value");
+        return;
+    }
+
     if (strcmp(option, "auto") != 0) {
         if (qemu_strtol(option, NULL, 0, &time_shift) < 0
             || time_shift < 0 || time_shift > MAX_ICOUNT_SHIFT) {
@@ -457,6 +555,7 @@ void icount_configure(QemuOpts *opts, Error **errp)
     }
 
     icount_align_option = align;
+    timers_state.icount_quantum = quantum;
 
     if (time_shift >= 0) {
         timers_state.icount_time_shift = time_shift;
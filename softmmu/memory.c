@@ -16,12 +16,15 @@
 #include "qemu/osdep.h"
 #include "qemu/log.h"
 #include "qapi/error.h"
+#include "qapi/qapi-commands-machine.h"
+#include "qapi/util.h"
 #include "cpu.h"
 #include "exec/memory.h"
 #include "exec/address-spaces.h"
 #include "qapi/visitor.h"
 #include "qemu/bitops.h"
 #include "qemu/error-report.h"
+#include "qemu/lockable.h"
 #include "qemu/main-loop.h"
 #include "qemu/qemu-print.h"
 #include "qom/object.h"
@@ -40,6 +43,12 @@
 
 static unsigned memory_region_transaction_depth;
 static bool memory_region_update_pending;
+/*
+ * Regions changed since the last commit, or NULL if every flat view has
+ * to be rendered again.  Only membership is tested, so the pointers are
+ * never dereferenced.
+ */
+static GHashTable *memory_region_updated;
 static bool ioeventfd_update_pending;
 bool global_dirty_log;
 
@@ -977,6 +986,58 @@ static void address_space_update_topology_pass(AddressSpace *as,
     }
 }
 
+static void memory_region_update_mark(MemoryRegion *mr)
+{
+    if (!memory_region_update_pending) {
+        memory_region_updated = g_hash_table_new(NULL, NULL);
+        memory_region_update_pending = true;
+    }
+    if (memory_region_updated) {
+        g_hash_table_add(memory_region_updated, mr);
+    }
+}
+
+static void memory_region_update_mark_all(void)
+{
+    if (memory_region_updated) {
+        g_hash_table_unref(memory_region_updated);
+        memory_region_updated = NULL;
+    }
+    memory_region_update_pending = true;
+}
+
+/*
+ * Check whether a region that changed in this transaction is reachable from
+ * @mr, either as a subregion or through an alias.  @seen caches the answer
+ * for the regions that were already visited, because the same subtree is
+ * often reachable from many roots.
+ */
+static bool memory_region_tree_updated(MemoryRegion *mr, GHashTable *seen)
+{
+    MemoryRegion *subregion;
+    gpointer value;
+    bool ret = false;
+
+    if (g_hash_table_lookup_extended(seen, mr, NULL, &value)) {
+        return GPOINTER_TO_INT(value);
+    }
+
+    if (g_hash_table_contains(memory_region_updated, mr)) {
+        ret = true;
+    } else if (mr->alias) {
+        ret = memory_region_tree_updated(mr->alias, seen);
+    }
+    QTAILQ_FOREACH(subregion, &mr->subregions, subregions_link) {
+        if (ret) {
+            break;
+        }
+        ret = memory_region_tree_updated(subregion, seen);
+    }
+
+    g_hash_table_insert(seen, mr, GINT_TO_POINTER(ret));
+    return ret;
+}
+
 static void flatviews_init(void)
 {
     static FlatView *empty_view;
@@ -999,24 +1060,43 @@ static void flatviews_init(void)
 
 static void flatviews_reset(void)
 {
+    GHashTable *old_views = flat_views;
+    GHashTable *seen = g_hash_table_new(NULL, NULL);
     AddressSpace *as;
 
-    if (flat_views) {
-        g_hash_table_unref(flat_views);
-        flat_views = NULL;
-    }
+    flat_views = NULL;
     flatviews_init();
 
-    /* Render unique FVs */
+    /*
+     * Render unique FVs.  A flat view only depends on the tree below its
+     * root, so the old one can be kept if nothing in that tree changed;
+     * address_space_set_flatview() then skips the listeners entirely.
+     */
     QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
         MemoryRegion *physmr = memory_region_get_flatview_root(as->root);
+        FlatView *old_view = NULL;
 
         if (g_hash_table_lookup(flat_views, physmr)) {
             continue;
         }
 
+        if (old_views && memory_region_updated) {
+            old_view = g_hash_table_lookup(old_views, physmr);
+        }
+        if (old_view && !memory_region_tree_updated(physmr, seen)) {
+            trace_flatview_reuse(old_view, physmr);
+            flatview_ref(old_view);
+            g_hash_table_replace(flat_views, physmr, old_view);
+            continue;
+        }
+
         generate_memory_topology(physmr);
     }
+
+    g_hash_table_unref(seen);
+    if (old_views) {
+        g_hash_table_unref(old_views);
+    }
 }
 
 static void address_space_set_flatview(AddressSpace *as)
@@ -1100,6 +1180,10 @@ void memory_region_transaction_commit(void)
                 address_space_update_ioeventfds(as);
             }
             memory_region_update_pending = false;
+            if (memory_region_updated) {
+                g_hash_table_unref(memory_region_updated);
+                memory_region_updated = NULL;
+            }
             ioeventfd_update_pending = false;
             MEMORY_LISTENER_CALL_GLOBAL(commit, Forward);
         } else if (ioeventfd_update_pending) {
@@ -1242,6 +1326,7 @@ static void memory_region_initfn(Object *obj)
     mr->ops = &unassigned_mem_ops;
     mr->enabled = true;
     mr->romd_mode = true;
+    mr->global_locking = true;
     mr->destructor = memory_region_destructor_none;
     QTAILQ_INIT(&mr->subregions);
     QTAILQ_INIT(&mr->coalesced);
@@ -1431,6 +1516,132 @@ static MemTxResult memory_region_dispatch_read1(MemoryRegion *mr,
     }
 }
 
+/*
+ * Counts of the accesses that reach a device model, per region and offset.
+ * Under KVM these are the MMIO and PIO exits that were not served by an
+ * ioeventfd, plus the replay of coalesced writes.
+ */
+typedef struct MMIOProfileKey {
+    MemoryRegion *mr;
+    hwaddr addr;
+} MMIOProfileKey;
+
+typedef struct MMIOProfileCount {
+    MMIOProfileKey key;
+    uint64_t reads;
+    uint64_t writes;
+} MMIOProfileCount;
+
+static bool mmio_profile_enabled;
+static QemuMutex mmio_profile_lock;
+static GHashTable *mmio_profile;
+
+static guint mmio_profile_hash(gconstpointer v)
+{
+    const MMIOProfileKey *key = v;
+
+    return g_direct_hash(key->mr) ^ (guint)(key->addr ^ (key->addr >> 32));
+}
+
+static gboolean mmio_profile_equal(gconstpointer a, gconstpointer b)
+{
+    const MMIOProfileKey *ka = a, *kb = b;
+
+    return ka->mr == kb->mr && ka->addr == kb->addr;
+}
+
+static void mmio_profile_account(MemoryRegion *mr, hwaddr addr, bool is_write)
+{
+    MMIOProfileKey key = { .mr = mr, .addr = addr };
+    MMIOProfileCount *cnt;
+
+    QEMU_LOCK_GUARD(&mmio_profile_lock);
+    cnt = g_hash_table_lookup(mmio_profile, &key);
+    if (!cnt) {
+        cnt = g_new0(MMIOProfileCount, 1);
+        cnt->key = key;
+        g_hash_table_insert(mmio_profile, &cnt->key, cnt);
+    }
+    if (is_write) {
+        cnt->writes++;
+    } else {
+        cnt->reads++;
+    }
+}
+
+static gboolean mmio_profile_match_region(gpointer key, gpointer value,
+                                          gpointer opaque)
+{
+    return ((MMIOProfileKey *)key)->mr == opaque;
+}
+
+static void mmio_profile_forget(MemoryRegion *mr)
+{
+    if (!mmio_profile) {
+        return;
+    }
+    WITH_QEMU_LOCK_GUARD(&mmio_profile_lock) {
+        g_hash_table_foreach_remove(mmio_profile, mmio_profile_match_region,
+                                    mr);
+    }
+}
+
+void qmp_x_mmio_profile(bool enable, Error **errp)
+{
+    if (!mmio_profile) {
+        qemu_mutex_init(&mmio_profile_lock);
+        mmio_profile = g_hash_table_new_full(mmio_profile_hash,
+                                             mmio_profile_equal,
+                                             NULL, g_free);
+    }
+    if (enable) {
+        WITH_QEMU_LOCK_GUARD(&mmio_profile_lock) {
+            g_hash_table_remove_all(mmio_profile);
+        }
+    }
+    qatomic_set(&mmio_profile_enabled, enable);
+}
+
+static gint mmio_profile_compare(gconstpointer a, gconstpointer b)
+{
+    const MMIOProfileCount *ca = a, *cb = b;
+    uint64_t ta = ca->reads + ca->writes;
+    uint64_t tb = cb->reads + cb->writes;
+
+    return ta < tb ? -1 : ta > tb;
+}
+
+MMIOProfileEntryList *qmp_x_query_mmio_profile(Error **errp)
+{
+    MMIOProfileEntryList *head = NULL;
+    GList *counts, *it;
+
+    if (!mmio_profile) {
+        return NULL;
+    }
+
+    QEMU_LOCK_GUARD(&mmio_profile_lock);
+    counts = g_list_sort(g_hash_table_get_values(mmio_profile),
+                         mmio_profile_compare);
+    for (it = counts; it; it = it->next) {
+        MMIOProfileCount *cnt = it->data;
+        MemoryRegion *mr = cnt->key.mr;
+        MMIOProfileEntry *entry = g_new0(MMIOProfileEntry, 1);
+
+        entry->region = g_strdup(memory_region_name(mr));
+        if (mr->owner) {
+            entry->has_owner = true;
+            entry->owner = object_get_canonical_path(mr->owner);
+        }
+        entry->offset = cnt->key.addr;
+        entry->reads = cnt->reads;
+        entry->writes = cnt->writes;
+        QAPI_LIST_PREPEND(head, entry);
+    }
+    g_list_free(counts);
+    return head;
+}
+
 MemTxResult memory_region_dispatch_read(MemoryRegion *mr,
                                         hwaddr addr,
                                         uint64_t *pval,
@@ -1440,6 +1651,9 @@ MemTxResult memory_region_dispatch_read(MemoryRegion *mr,
     unsigned size = memop_size(op);
     MemTxResult r;
 
+    if (unlikely(qatomic_read(&mmio_profile_enabled))) {
+        mmio_profile_account(mr, addr, false);
+    }
     fuzz_dma_read_cb(addr, size, mr, false);
     if (!memory_region_access_valid(mr, addr, size, false, attrs)) {
         *pval = unassigned_mem_read(mr, addr, size);
@@ -1485,6 +1699,9 @@ MemTxResult memory_region_dispatch_write(MemoryRegion *mr,
 {
     unsigned size = memop_size(op);
 
+    if (unlikely(qatomic_read(&mmio_profile_enabled))) {
+        mmio_profile_account(mr, addr, true);
+    }
     if (!memory_region_access_valid(mr, addr, size, true, attrs)) {
         unassigned_mem_write(mr, addr, data, size);
         return MEMTX_DECODE_ERROR;
@@ -1754,6 +1971,7 @@ static void memory_region_finalize(Object *obj)
 
     mr->destructor(mr);
     memory_region_clear_coalescing(mr);
+    mmio_profile_forget(mr);
     g_free((char *)mr->name);
     g_free(mr->ioeventfds);
 }
@@ -2034,7 +2252,9 @@ void memory_region_set_log(MemoryRegion *mr, bool log, unsigned client)
 
     memory_region_transaction_begin();
     mr->dirty_log_mask = (mr->dirty_log_mask & ~mask) | (log * mask);
-    memory_region_update_pending |= mr->enabled;
+    if (mr->enabled) {
+        memory_region_update_mark(mr);
+    }
     memory_region_transaction_commit();
 }
 
@@ -2060,6 +2280,11 @@ static void memory_region_sync_dirty_bitmap(MemoryRegion *mr)
      * address space once.
      */
     QTAILQ_FOREACH(listener, &memory_listeners, link) {
+        if (listener->log_sync_global) {
+            /* Nothing finer than a sync of everything is possible */
+            listener->log_sync_global(listener);
+            continue;
+        }
         if (!listener->log_sync) {
             continue;
         }
@@ -2152,7 +2377,9 @@ void memory_region_set_readonly(MemoryRegion *mr, bool readonly)
     if (mr->readonly != readonly) {
         memory_region_transaction_begin();
         mr->readonly = readonly;
-        memory_region_update_pending |= mr->enabled;
+        if (mr->enabled) {
+            memory_region_update_mark(mr);
+        }
         memory_region_transaction_commit();
     }
 }
@@ -2162,7 +2389,9 @@ void memory_region_set_nonvolatile(MemoryRegion *mr, bool nonvolatile)
     if (mr->nonvolatile != nonvolatile) {
         memory_region_transaction_begin();
         mr->nonvolatile = nonvolatile;
-        memory_region_update_pending |= mr->enabled;
+        if (mr->enabled) {
+            memory_region_update_mark(mr);
+        }
         memory_region_transaction_commit();
     }
 }
@@ -2172,7 +2401,9 @@ void memory_region_rom_device_set_romd(MemoryRegion *mr, bool romd_mode)
     if (mr->romd_mode != romd_mode) {
         memory_region_transaction_begin();
         mr->romd_mode = romd_mode;
-        memory_region_update_pending |= mr->enabled;
+        if (mr->enabled) {
+            memory_region_update_mark(mr);
+        }
         memory_region_transaction_commit();
     }
 }
@@ -2329,6 +2560,11 @@ void memory_region_clear_flush_coalesced(MemoryRegion *mr)
     }
 }
 
+void memory_region_clear_global_locking(MemoryRegion *mr)
+{
+    mr->global_locking = false;
+}
+
 static bool userspace_eventfd_warning;
 
 void memory_region_add_eventfd(MemoryRegion *mr,
@@ -2424,7 +2660,9 @@ static void memory_region_update_container_subregions(MemoryRegion *subregion)
     }
     QTAILQ_INSERT_TAIL(&mr->subregions, subregion, subregions_link);
 done:
-    memory_region_update_pending |= mr->enabled && subregion->enabled;
+    if (mr->enabled && subregion->enabled) {
+        memory_region_update_mark(mr);
+    }
     memory_region_transaction_commit();
 }
 
@@ -2463,7 +2701,9 @@ void memory_region_del_subregion(MemoryRegion *mr,
     subregion->container = NULL;
     QTAILQ_REMOVE(&mr->subregions, subregion, subregions_link);
     memory_region_unref(subregion);
-    memory_region_update_pending |= mr->enabled && subregion->enabled;
+    if (mr->enabled && subregion->enabled) {
+        memory_region_update_mark(mr);
+    }
     memory_region_transaction_commit();
 }
 
@@ -2474,7 +2714,7 @@ void memory_region_set_enabled(MemoryRegion *mr, bool enabled)
     }
     memory_region_transaction_begin();
     mr->enabled = enabled;
-    memory_region_update_pending = true;
+    memory_region_update_mark(mr);
     memory_region_transaction_commit();
 }
 
@@ -2490,7 +2730,7 @@ void memory_region_set_size(MemoryRegion *mr, uint64_t size)
     }
     memory_region_transaction_begin();
     mr->size = s;
-    memory_region_update_pending = true;
+    memory_region_update_mark(mr);
     memory_region_transaction_commit();
 }
 
@@ -2527,7 +2767,9 @@ void memory_region_set_alias_offset(MemoryRegion *mr, hwaddr offset)
 
     memory_region_transaction_begin();
     mr->alias_offset = offset;
-    memory_region_update_pending |= mr->enabled;
+    if (mr->enabled) {
+        memory_region_update_mark(mr);
+    }
     memory_region_transaction_commit();
 }
 
@@ -2654,7 +2896,7 @@ void memory_global_dirty_log_start(void)
 
     /* Refresh DIRTY_MEMORY_MIGRATION bit.  */
     memory_region_transaction_begin();
-    memory_region_update_pending = true;
+    memory_region_update_mark_all();
     memory_region_transaction_commit();
 }
 
@@ -2664,7 +2906,7 @@ static void memory_global_dirty_log_do_stop(void)
 
     /* Refresh DIRTY_MEMORY_MIGRATION bit.  */
     memory_region_transaction_begin();
-    memory_region_update_pending = true;
+    memory_region_update_mark_all();
     memory_region_transaction_commit();
 
     MEMORY_LISTENER_CALL_GLOBAL(log_global_stop, Reverse);
@@ -2815,6 +3057,10 @@ void address_space_init(AddressSpace *as, MemoryRegion *root, const char *name)
     as->ioeventfds = NULL;
     QTAILQ_INIT(&as->listeners);
     QTAILQ_INSERT_TAIL(&address_spaces, as, address_spaces_link);
+    as->max_bounce_buffer_size = DEFAULT_MAX_BOUNCE_BUFFER_SIZE;
+    as->bounce_buffer_size = 0;
+    qemu_mutex_init(&as->map_client_list_lock);
+    QLIST_INIT(&as->map_client_list);
     as->name = g_strdup(name ? name : "anonymous");
     address_space_update_topology(as);
     address_space_update_ioeventfds(as);
@@ -2823,6 +3069,9 @@ void address_space_init(AddressSpace *as, MemoryRegion *root, const char *name)
 static void do_address_space_destroy(AddressSpace *as)
 {
     assert(QTAILQ_EMPTY(&as->listeners));
+    assert(qatomic_read(&as->bounce_buffer_size) == 0);
+    assert(QLIST_EMPTY(&as->map_client_list));
+    qemu_mutex_destroy(&as->map_client_list_lock);
 
     flatview_unref(as->current_map);
     g_free(as->name);
@@ -53,6 +53,10 @@ typedef struct TimersState {
     /* Only written by TCG thread */
     int64_t qemu_icount;
 
+    /* MTTCG: quantum length and end, in instructions.  Protected by BQL. */
+    int64_t icount_quantum;
+    int64_t icount_quantum_end;
+
     /* for adjusting icount */
     QEMUTimer *icount_rt_timer;
     QEMUTimer *icount_vm_timer;
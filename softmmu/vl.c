@@ -26,6 +26,7 @@
 #include "qemu-common.h"
 #include "qemu/units.h"
 #include "hw/boards.h"
+#include "exec/memory.h"
 #include "hw/qdev-properties.h"
 #include "qapi/error.h"
 #include "qemu-version.h"
@@ -473,6 +474,12 @@ static QemuOptsList qemu_icount_opts = {
         }, {
             .name = "rrsnapshot",
             .type = QEMU_OPT_STRING,
+        }, {
+            .name = "rrsnapshot-period",
+            .type = QEMU_OPT_NUMBER,
+        }, {
+            .name = "quantum",
+            .type = QEMU_OPT_NUMBER,
         },
         { /* end of list */ }
     },
@@ -2863,6 +2870,22 @@ static char *find_datadir(void)
     return get_relocated_path(CONFIG_QEMU_DATADIR);
 }
 
+/*
+ * Trace how long each phase of qemu_init() takes, as a timeline of the
+ * startup.  Trace backends are only set up once the command line has
+ * been parsed, so the first phase covers everything up to that point.
+ */
+static int64_t init_start_ns, init_phase_ns;
+
+static void qemu_init_phase_done(const char *phase)
+{
+    int64_t now = get_clock();
+
+    trace_vl_init_phase(phase, (now - init_phase_ns) / SCALE_US,
+                        (now - init_start_ns) / SCALE_US);
+    init_phase_ns = now;
+}
+
 void qemu_init(int argc, char **argv, char **envp)
 {
     int i;
@@ -2900,6 +2923,7 @@ void qemu_init(int argc, char **argv, char **envp)
     QemuPluginList plugin_list = QTAILQ_HEAD_INITIALIZER(plugin_list);
     int mem_prealloc = 0; /* force preallocation of physical target memory */
 
+    init_start_ns = init_phase_ns = get_clock();
     os_set_line_buffering();
 
     error_init(argv[0]);
@@ -3939,6 +3963,7 @@ void qemu_init(int argc, char **argv, char **envp)
         exit(1);
     }
     trace_init_file();
+    qemu_init_phase_done("options");
 
     /* Open the logfile at this point and set the log mask if necessary.
      */
@@ -4172,6 +4197,7 @@ void qemu_init(int argc, char **argv, char **envp)
      * after machine_set_property().
      */
     configure_accelerators(argv[0]);
+    qemu_init_phase_done("accel");
 
     /*
      * Beware, QOM objects created before this point miss global and
@@ -4268,9 +4294,16 @@ void qemu_init(int argc, char **argv, char **envp)
         exit(1);
     }
 
+    /*
+     * Preallocate the memory backends concurrently.  Their memory is not
+     * used until the machine is created.
+     */
+    os_mem_prealloc_begin_async(&error_fatal);
     qemu_opts_foreach(qemu_find_opts("object"),
                       user_creatable_add_opts_foreach,
                       object_create_delayed, &error_fatal);
+    os_mem_prealloc_wait(&error_fatal);
+    qemu_init_phase_done("backends");
 
     if (tpm_init() < 0) {
         exit(1);
@@ -4356,9 +4389,11 @@ void qemu_init(int argc, char **argv, char **envp)
     }
 
     parse_numa_opts(current_machine);
+    qemu_init_phase_done("frontends");
 
     /* do monitor/qmp handling at preconfig state if requested */
     qemu_main_loop();
+    qemu_init_phase_done("preconfig");
 
     if (machine_class->default_ram_id && current_machine->ram_size &&
         numa_uses_legacy_mem() && !current_machine->ram_memdev_id) {
@@ -4367,6 +4402,7 @@ void qemu_init(int argc, char **argv, char **envp)
 
     /* from here on runstate is RUN_STATE_PRELAUNCH */
     machine_run_board_init(current_machine);
+    qemu_init_phase_done("board");
 
     /*
      * TODO To drop support for deprecated bogus if=..., move
@@ -4387,6 +4423,14 @@ void qemu_init(int argc, char **argv, char **envp)
     qemu_opts_foreach(qemu_find_opts("fw_cfg"),
                       parse_fw_cfg, fw_cfg_find(), &error_fatal);
 
+    /*
+     * Each device changes the memory map, often more than once, and every
+     * change is rendered and sent to KVM and the other listeners.  Commit
+     * the changes done by -usbdevice and -device together, since nothing
+     * accesses guest memory before the machine is fully created.
+     */
+    memory_region_transaction_begin();
+
     /* init USB devices */
     if (machine_usb(current_machine)) {
         if (foreach_device_config(DEV_USB, usb_parse) < 0)
@@ -4398,6 +4442,9 @@ void qemu_init(int argc, char **argv, char **envp)
     qemu_opts_foreach(qemu_find_opts("device"),
                       device_init_func, NULL, &error_fatal);
 
+    memory_region_transaction_commit();
+    qemu_init_phase_done("devices");
+
     cpu_synchronize_all_post_init();
 
     rom_reset_order_override();
@@ -4442,6 +4489,7 @@ void qemu_init(int argc, char **argv, char **envp)
     if (foreach_device_config(DEV_GDB, gdbserver_start) < 0) {
         exit(1);
     }
+    qemu_init_phase_done("displays");
 
     qdev_machine_creation_done();
 
@@ -4462,6 +4510,7 @@ void qemu_init(int argc, char **argv, char **envp)
         error_report("rom check and register reset failed");
         exit(1);
     }
+    qemu_init_phase_done("machine-done");
 
     replay_start();
 
@@ -4470,6 +4519,7 @@ void qemu_init(int argc, char **argv, char **envp)
        clock values from the log. */
     replay_checkpoint(CHECKPOINT_RESET);
     qemu_system_reset(SHUTDOWN_CAUSE_NONE);
+    qemu_init_phase_done("reset");
     register_global_state();
     if (loadvm) {
         Error *local_err = NULL;
@@ -4503,6 +4553,7 @@ void qemu_init(int argc, char **argv, char **envp)
 
     accel_setup_post(current_machine);
     os_setup_post();
+    qemu_init_phase_done("start");
 
     return;
 }
@@ -97,6 +97,11 @@ static void help(void)
 "                         export the specified block node over NBD\n"
 "                         (requires --nbd-server)\n"
 "\n"
+"  --export [type=]nvme-tcp,id=<id>,node-name=<node-name>,addr.type=inet,\n"
+"           addr.host=<host>,addr.port=<port>[,subnqn=<nqn>]\n"
+"           [,writable=on|off][,num-queues=<n>]\n"
+"                         export the specified block node over NVMe/TCP\n"
+"\n"
 "  --monitor [chardev=]name[,mode=control][,pretty[=on|off]]\n"
 "                         configure a QMP monitor\n"
 "\n"
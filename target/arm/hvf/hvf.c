@@ -777,6 +777,7 @@ int hvf_vcpu_exec(CPUState *cpu)
         }
 
         assert_hvf_ok(hv_vcpu_run(cpu->hvf->fd));
+        hvf_vcpu_stat_inc(cpu, HVF_VCPU_STAT_EXITS);
 
         /* handle VMEXIT */
         uint64_t exit_reason = hvf_exit->reason;
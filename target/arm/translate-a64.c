@@ -14638,9 +14638,13 @@ static void disas_a64_insn(CPUARMState *env, DisasContext *s)
         unallocated_encoding(s);
         break;
     case 0x2:
+        s->sve_pred_keep = false;
         if (!dc_isar_feature(aa64_sve, s) || !disas_sve(s, insn)) {
             unallocated_encoding(s);
         }
+        if (!s->sve_pred_keep) {
+            memset(s->sve_pred_true, 0, sizeof(s->sve_pred_true));
+        }
         break;
     case 0x8: case 0x9: /* Data processing - immediate */
         disas_data_proc_imm(s, insn);
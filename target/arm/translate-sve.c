@@ -291,6 +291,7 @@ const uint64_t pred_esz_masks[4] = {
 
 static bool do_zzz_fn(DisasContext *s, arg_rrr_esz *a, GVecGen3Fn *gvec_fn)
 {
+    s->sve_pred_keep = true;
     if (sve_access_check(s)) {
         gen_gvec_fn_zzz(s, gvec_fn, a->esz, a->rd, a->rn, a->rm);
     }
@@ -355,13 +356,31 @@ static bool trans_UQSUB_zzz(DisasContext *s, arg_rrr_esz *a)
  *** SVE Integer Arithmetic - Binary Predicated Group
  */
 
-static bool do_zpzz_ool(DisasContext *s, arg_rprr_esz *a, gen_helper_gvec_4 *fn)
+/* Return true if every element of size ESZ of predicate PG is active.  */
+static bool pred_all_true(DisasContext *s, int pg, int esz)
+{
+    return extract32(s->sve_pred_true[esz], pg, 1);
+}
+
+/*
+ * When the governing predicate is known to be all true, as it is after
+ * the usual PTRUE that begins a vectorized loop, the merging operation
+ * is the same as the unpredicated one and can be expanded inline with
+ * host vector operations through GVEC_FN, if there is one.
+ */
+static bool do_zpzz_ool(DisasContext *s, arg_rprr_esz *a,
+                        gen_helper_gvec_4 *fn, GVecGen3Fn *gvec_fn)
 {
     if (fn == NULL) {
         return false;
     }
+    s->sve_pred_keep = true;
     if (sve_access_check(s)) {
-        gen_gvec_ool_zzzp(s, fn, a->rd, a->rn, a->rm, a->pg, 0);
+        if (gvec_fn && pred_all_true(s, a->pg, a->esz)) {
+            gen_gvec_fn_zzz(s, gvec_fn, a->esz, a->rd, a->rn, a->rm);
+        } else {
+            gen_gvec_ool_zzzp(s, fn, a->rd, a->rn, a->rm, a->pg, 0);
+        }
     }
     return true;
 }
@@ -378,45 +397,49 @@ static void do_sel_z(DisasContext *s, int rd, int rn, int rm, int pg, int esz)
     gen_gvec_ool_zzzp(s, fns[esz], rd, rn, rm, pg, 0);
 }
 
-#define DO_ZPZZ(NAME, name) \
+#define DO_ZPZZ(NAME, name, gvec_fn) \
 static bool trans_##NAME##_zpzz(DisasContext *s, arg_rprr_esz *a)         \
 {                                                                         \
     static gen_helper_gvec_4 * const fns[4] = {                           \
         gen_helper_sve_##name##_zpzz_b, gen_helper_sve_##name##_zpzz_h,   \
         gen_helper_sve_##name##_zpzz_s, gen_helper_sve_##name##_zpzz_d,   \
     };                                                                    \
-    return do_zpzz_ool(s, a, fns[a->esz]);                                \
+    return do_zpzz_ool(s, a, fns[a->esz], gvec_fn);                       \
 }
 
-DO_ZPZZ(AND, and)
-DO_ZPZZ(EOR, eor)
-DO_ZPZZ(ORR, orr)
-DO_ZPZZ(BIC, bic)
+DO_ZPZZ(AND, and, tcg_gen_gvec_and)
+DO_ZPZZ(EOR, eor, tcg_gen_gvec_xor)
+DO_ZPZZ(ORR, orr, tcg_gen_gvec_or)
+DO_ZPZZ(BIC, bic, tcg_gen_gvec_andc)
 
-DO_ZPZZ(ADD, add)
-DO_ZPZZ(SUB, sub)
+DO_ZPZZ(ADD, add, tcg_gen_gvec_add)
+DO_ZPZZ(SUB, sub, tcg_gen_gvec_sub)
 
-DO_ZPZZ(SMAX, smax)
-DO_ZPZZ(UMAX, umax)
-DO_ZPZZ(SMIN, smin)
-DO_ZPZZ(UMIN, umin)
-DO_ZPZZ(SABD, sabd)
-DO_ZPZZ(UABD, uabd)
+DO_ZPZZ(SMAX, smax, tcg_gen_gvec_smax)
+DO_ZPZZ(UMAX, umax, tcg_gen_gvec_umax)
+DO_ZPZZ(SMIN, smin, tcg_gen_gvec_smin)
+DO_ZPZZ(UMIN, umin, tcg_gen_gvec_umin)
+DO_ZPZZ(SABD, sabd, gen_gvec_sabd)
+DO_ZPZZ(UABD, uabd, gen_gvec_uabd)
 
-DO_ZPZZ(MUL, mul)
-DO_ZPZZ(SMULH, smulh)
-DO_ZPZZ(UMULH, umulh)
+DO_ZPZZ(MUL, mul, tcg_gen_gvec_mul)
+DO_ZPZZ(SMULH, smulh, NULL)
+DO_ZPZZ(UMULH, umulh, NULL)
 
-DO_ZPZZ(ASR, asr)
-DO_ZPZZ(LSR, lsr)
-DO_ZPZZ(LSL, lsl)
+/*
+ * The SVE shifts saturate the shift count, which the gvec variable
+ * shifts do not, so these always use the helpers.
+ */
+DO_ZPZZ(ASR, asr, NULL)
+DO_ZPZZ(LSR, lsr, NULL)
+DO_ZPZZ(LSL, lsl, NULL)
 
 static bool trans_SDIV_zpzz(DisasContext *s, arg_rprr_esz *a)
 {
     static gen_helper_gvec_4 * const fns[4] = {
         NULL, NULL, gen_helper_sve_sdiv_zpzz_s, gen_helper_sve_sdiv_zpzz_d
     };
-    return do_zpzz_ool(s, a, fns[a->esz]);
+    return do_zpzz_ool(s, a, fns[a->esz], NULL);
 }
 
 static bool trans_UDIV_zpzz(DisasContext *s, arg_rprr_esz *a)
@@ -424,7 +447,7 @@ static bool trans_UDIV_zpzz(DisasContext *s, arg_rprr_esz *a)
     static gen_helper_gvec_4 * const fns[4] = {
         NULL, NULL, gen_helper_sve_udiv_zpzz_s, gen_helper_sve_udiv_zpzz_d
     };
-    return do_zpzz_ool(s, a, fns[a->esz]);
+    return do_zpzz_ool(s, a, fns[a->esz], NULL);
 }
 
 static bool trans_SEL_zpzz(DisasContext *s, arg_rprr_esz *a)
@@ -729,7 +752,7 @@ static bool trans_##NAME##_zpzw(DisasContext *s, arg_rprr_esz *a)         \
     if (a->esz < 0 || a->esz >= 3) {                                      \
         return false;                                                     \
     }                                                                     \
-    return do_zpzz_ool(s, a, fns[a->esz]);                                \
+    return do_zpzz_ool(s, a, fns[a->esz], NULL);                          \
 }
 
 DO_ZPZW(ASR, asr)
@@ -1446,6 +1469,15 @@ static bool do_predset(DisasContext *s, int esz, int rd, int pat, bool setflag)
 
 static bool trans_PTRUE(DisasContext *s, arg_PTRUE *a)
 {
+    int esz;
+
+    /* Remember which predicates are all true, for do_zpzz_ool.  */
+    s->sve_pred_keep = true;
+    for (esz = 0; esz < 4; esz++) {
+        bool all = a->pat == 31 && esz >= a->esz;
+        s->sve_pred_true[esz] = deposit32(s->sve_pred_true[esz],
+                                          a->rd, 1, all);
+    }
     return do_predset(s, a->esz, a->rd, a->pat, a->s);
 }
 
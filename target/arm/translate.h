@@ -35,6 +35,13 @@ typedef struct DisasContext {
     int fp_excp_el; /* FP exception EL or 0 if enabled */
     int sve_excp_el; /* SVE exception EL or 0 if enabled */
     int sve_len;     /* SVE vector length in bytes */
+    /*
+     * Bit N of sve_pred_true[esz] is set if Pn is known, from an earlier
+     * PTRUE in this TB, to have every element of size esz active.
+     * Any SVE insn that does not set sve_pred_keep forgets all of it.
+     */
+    uint16_t sve_pred_true[4];
+    bool sve_pred_keep;
     /* Flag indicating that exceptions from secure mode are routed to EL3. */
     bool secure_routed_to_el3;
     bool vfp_enabled; /* FP enabled via FPSCR.EN */
@@ -1611,6 +1611,8 @@ typedef struct CPUX86State {
 #if defined(CONFIG_HVF)
     HVFX86LazyFlags hvf_lflags;
     void *hvf_mmio_buf;
+    /* General purpose registers as of the last load_regs() */
+    target_ulong hvf_loaded_regs[CPU_NB_REGS];
 #endif
 
     uint64_t mcg_cap;
@@ -112,7 +112,8 @@ void hvf_handle_io(CPUArchState *env, uint16_t port, void *buffer,
     }
 }
 
-static bool ept_emulation_fault(hvf_slot *slot, uint64_t gpa, uint64_t ept_qual)
+static bool ept_emulation_fault(CPUState *cpu, hvf_slot *slot, uint64_t gpa,
+                                uint64_t ept_qual)
 {
     int read, write;
 
@@ -130,9 +131,18 @@ static bool ept_emulation_fault(hvf_slot *slot, uint64_t gpa, uint64_t ept_qual)
 
     if (write && slot) {
         if (slot->flags & HVF_SLOT_LOG) {
-            memory_region_set_dirty(slot->region, gpa - slot->start, 1);
-            hv_vm_protect((hv_gpaddr_t)slot->start, (size_t)slot->size,
-                          HV_MEMORY_READ | HV_MEMORY_WRITE);
+            /*
+             * Only make this page writable again, so that writes to other
+             * pages of the slot still fault and get logged until the next
+             * hvf_log_sync() protects the slot again.
+             */
+            uint64_t page = gpa & qemu_real_host_page_mask;
+
+            hvf_vcpu_stat_inc(cpu, HVF_VCPU_STAT_DIRTY_LOG_EXITS);
+            memory_region_set_dirty(slot->region, page - slot->start,
+                                    qemu_real_host_page_size);
+            hv_vm_protect((hv_gpaddr_t)page, qemu_real_host_page_size,
+                          HV_MEMORY_READ | HV_MEMORY_WRITE | HV_MEMORY_EXEC);
         }
     }
 
@@ -319,6 +329,7 @@ int hvf_vcpu_exec(CPUState *cpu)
 
         hv_return_t r  = hv_vcpu_run(cpu->hvf->fd);
         assert_hvf_ok(r);
+        hvf_vcpu_stat_inc(cpu, HVF_VCPU_STAT_EXITS);
 
         /* handle VMEXIT */
         uint64_t exit_reason = rvmcs(cpu->hvf->fd, VMCS_EXIT_REASON);
@@ -340,6 +351,7 @@ int hvf_vcpu_exec(CPUState *cpu)
         ret = 0;
         switch (exit_reason) {
         case EXIT_REASON_HLT: {
+            hvf_vcpu_stat_inc(cpu, HVF_VCPU_STAT_HLT_EXITS);
             macvm_set_rip(cpu, rip + ins_len);
             if (!((cpu->interrupt_request & CPU_INTERRUPT_HARD) &&
                 (env->eflags & IF_MASK))
@@ -369,9 +381,10 @@ int hvf_vcpu_exec(CPUState *cpu)
 
             slot = hvf_find_overlap_slot(gpa, 1);
             /* mmio */
-            if (ept_emulation_fault(slot, gpa, exit_qual)) {
+            if (ept_emulation_fault(cpu, slot, gpa, exit_qual)) {
                 struct x86_decode decode;
 
+                hvf_vcpu_stat_inc(cpu, HVF_VCPU_STAT_MMIO_EXITS);
                 load_regs(cpu);
                 decode_instruction(env, &decode);
                 exec_instruction(env, &decode);
@@ -388,6 +401,7 @@ int hvf_vcpu_exec(CPUState *cpu)
             uint32_t port =  exit_qual >> 16;
             /*uint32_t rep = (exit_qual & 0x20) != 0;*/
 
+            hvf_vcpu_stat_inc(cpu, HVF_VCPU_STAT_IO_EXITS);
             if (!string && in) {
                 uint64_t val = 0;
                 load_regs(cpu);
@@ -453,6 +467,7 @@ int hvf_vcpu_exec(CPUState *cpu)
             break;
         }
         case EXIT_REASON_INTR_WINDOW:
+            hvf_vcpu_stat_inc(cpu, HVF_VCPU_STAT_IRQ_WINDOW_EXITS);
             vmx_clear_int_window_exiting(cpu);
             ret = EXCP_INTERRUPT;
             break;
@@ -516,6 +531,7 @@ int hvf_vcpu_exec(CPUState *cpu)
         case EXIT_REASON_APIC_ACCESS: { /* TODO */
             struct x86_decode decode;
 
+            hvf_vcpu_stat_inc(cpu, HVF_VCPU_STAT_APIC_ACCESS_EXITS);
             load_regs(cpu);
             decode_instruction(env, &decode);
             exec_instruction(env, &decode);
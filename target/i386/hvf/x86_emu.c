@@ -1414,22 +1414,34 @@ static void init_cmd_handler()
     }
 }
 
+static const hv_x86_reg_t hvf_gprs[16] = {
+    [R_EAX] = HV_X86_RAX,
+    [R_ECX] = HV_X86_RCX,
+    [R_EDX] = HV_X86_RDX,
+    [R_EBX] = HV_X86_RBX,
+    [R_ESP] = HV_X86_RSP,
+    [R_EBP] = HV_X86_RBP,
+    [R_ESI] = HV_X86_RSI,
+    [R_EDI] = HV_X86_RDI,
+    [8] = HV_X86_R8,
+    [9] = HV_X86_R9,
+    [10] = HV_X86_R10,
+    [11] = HV_X86_R11,
+    [12] = HV_X86_R12,
+    [13] = HV_X86_R13,
+    [14] = HV_X86_R14,
+    [15] = HV_X86_R15,
+};
+
 void load_regs(struct CPUState *cpu)
 {
     X86CPU *x86_cpu = X86_CPU(cpu);
     CPUX86State *env = &x86_cpu->env;
 
     int i = 0;
-    RRX(env, R_EAX) = rreg(cpu->hvf->fd, HV_X86_RAX);
-    RRX(env, R_EBX) = rreg(cpu->hvf->fd, HV_X86_RBX);
-    RRX(env, R_ECX) = rreg(cpu->hvf->fd, HV_X86_RCX);
-    RRX(env, R_EDX) = rreg(cpu->hvf->fd, HV_X86_RDX);
-    RRX(env, R_ESI) = rreg(cpu->hvf->fd, HV_X86_RSI);
-    RRX(env, R_EDI) = rreg(cpu->hvf->fd, HV_X86_RDI);
-    RRX(env, R_ESP) = rreg(cpu->hvf->fd, HV_X86_RSP);
-    RRX(env, R_EBP) = rreg(cpu->hvf->fd, HV_X86_RBP);
-    for (i = 8; i < 16; i++) {
-        RRX(env, i) = rreg(cpu->hvf->fd, HV_X86_RAX + i);
+    for (i = 0; i < 16; i++) {
+        RRX(env, i) = rreg(cpu->hvf->fd, hvf_gprs[i]);
+        env->hvf_loaded_regs[i] = RRX(env, i);
     }
 
     env->eflags = rreg(cpu->hvf->fd, HV_X86_RFLAGS);
@@ -1442,17 +1454,15 @@ void store_regs(struct CPUState *cpu)
     X86CPU *x86_cpu = X86_CPU(cpu);
     CPUX86State *env = &x86_cpu->env;
 
+    /*
+     * An emulated instruction changes few registers, and each write is a
+     * call into Hypervisor.framework, so only write back what changed.
+     */
     int i = 0;
-    wreg(cpu->hvf->fd, HV_X86_RAX, RAX(env));
-    wreg(cpu->hvf->fd, HV_X86_RBX, RBX(env));
-    wreg(cpu->hvf->fd, HV_X86_RCX, RCX(env));
-    wreg(cpu->hvf->fd, HV_X86_RDX, RDX(env));
-    wreg(cpu->hvf->fd, HV_X86_RSI, RSI(env));
-    wreg(cpu->hvf->fd, HV_X86_RDI, RDI(env));
-    wreg(cpu->hvf->fd, HV_X86_RBP, RBP(env));
-    wreg(cpu->hvf->fd, HV_X86_RSP, RSP(env));
-    for (i = 8; i < 16; i++) {
-        wreg(cpu->hvf->fd, HV_X86_RAX + i, RRX(env, i));
+    for (i = 0; i < 16; i++) {
+        if (RRX(env, i) != env->hvf_loaded_regs[i]) {
+            wreg(cpu->hvf->fd, hvf_gprs[i], RRX(env, i));
+        }
     }
 
     lflags_to_rflags(env);
@@ -594,6 +594,223 @@ static bool swap_commutative2(TCGArg *p1, TCGArg *p2)
     return false;
 }
 
+/*
+ * Values known to be held in env.  A load from env that reads back what
+ * an earlier store or load of the same slot left there is replaced by a
+ * move from the temp holding the value.  The slots whose temp is a global
+ * or a local temp are kept across branches, because those temps keep
+ * their value there; only a label, where control flow merges, forgets
+ * everything.
+ */
+#define ENV_MEM_SLOTS 16
+
+typedef struct EnvMemInfo {
+    TCGTemp *ts;            /* NULL if the slot is free */
+    TCGOpcode ld_opc;       /* load that reads the value of ts back */
+    intptr_t ofs;
+    int size;
+} EnvMemInfo;
+
+typedef struct EnvMemState {
+    EnvMemInfo slot[ENV_MEM_SLOTS];
+    int next;               /* slot to reuse when all of them are taken */
+} EnvMemState;
+
+/* Number of bytes of env accessed by OP, or 0 if it is not a load/store */
+static int env_mem_size(const TCGOp *op)
+{
+    switch (op->opc) {
+    case INDEX_op_ld8u_i32:
+    case INDEX_op_ld8s_i32:
+    case INDEX_op_st8_i32:
+    case INDEX_op_ld8u_i64:
+    case INDEX_op_ld8s_i64:
+    case INDEX_op_st8_i64:
+        return 1;
+    case INDEX_op_ld16u_i32:
+    case INDEX_op_ld16s_i32:
+    case INDEX_op_st16_i32:
+    case INDEX_op_ld16u_i64:
+    case INDEX_op_ld16s_i64:
+    case INDEX_op_st16_i64:
+        return 2;
+    case INDEX_op_ld_i32:
+    case INDEX_op_st_i32:
+    case INDEX_op_ld32u_i64:
+    case INDEX_op_ld32s_i64:
+    case INDEX_op_st32_i64:
+        return 4;
+    case INDEX_op_ld_i64:
+    case INDEX_op_st_i64:
+        return 8;
+    case INDEX_op_st_vec:
+        return 8 << TCGOP_VECL(op);
+    default:
+        return 0;
+    }
+}
+
+static void env_mem_reset(EnvMemState *em)
+{
+    memset(em, 0, sizeof(*em));
+}
+
+/* Forget the slots whose value is held in a temp that dies here */
+static void env_mem_reset_temps(EnvMemState *em)
+{
+    int i;
+
+    for (i = 0; i < ENV_MEM_SLOTS; i++) {
+        TCGTemp *ts = em->slot[i].ts;
+        if (ts && !ts->temp_global && !ts->temp_local) {
+            em->slot[i].ts = NULL;
+        }
+    }
+}
+
+static void env_mem_reset_ts(EnvMemState *em, TCGTemp *ts)
+{
+    int i;
+
+    for (i = 0; i < ENV_MEM_SLOTS; i++) {
+        if (em->slot[i].ts == ts) {
+            em->slot[i].ts = NULL;
+        }
+    }
+}
+
+static void env_mem_reset_range(EnvMemState *em, intptr_t ofs, int size)
+{
+    int i;
+
+    for (i = 0; i < ENV_MEM_SLOTS; i++) {
+        EnvMemInfo *mi = &em->slot[i];
+        if (mi->ts && mi->ofs < ofs + size && ofs < mi->ofs + mi->size) {
+            mi->ts = NULL;
+        }
+    }
+}
+
+static void env_mem_record(EnvMemState *em, TCGTemp *ts, TCGOpcode ld_opc,
+                           intptr_t ofs, int size)
+{
+    EnvMemInfo *mi = NULL;
+    int i;
+
+    for (i = 0; i < ENV_MEM_SLOTS; i++) {
+        if (!em->slot[i].ts) {
+            mi = &em->slot[i];
+            break;
+        }
+    }
+    if (!mi) {
+        mi = &em->slot[em->next];
+        em->next = (em->next + 1) % ENV_MEM_SLOTS;
+    }
+    mi->ts = ts;
+    mi->ld_opc = ld_opc;
+    mi->ofs = ofs;
+    mi->size = size;
+}
+
+static TCGTemp *env_mem_find(EnvMemState *em, TCGOpcode ld_opc, intptr_t ofs)
+{
+    int i;
+
+    for (i = 0; i < ENV_MEM_SLOTS; i++) {
+        EnvMemInfo *mi = &em->slot[i];
+        if (mi->ts && mi->ld_opc == ld_opc && mi->ofs == ofs) {
+            return mi->ts;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Track the effect of OP on the values known to be in env.  Returns true
+ * if OP was a load whose value is already in a temp, in which case it has
+ * been turned into a move from that temp.
+ */
+static bool env_mem_forward(EnvMemState *em, TCGOp *op, int nb_oargs,
+                            struct tcg_temp_info *infos,
+                            TCGTempSet *temps_used)
+{
+    const TCGOpDef *def = &tcg_op_defs[op->opc];
+    TCGOpcode ld_opc;
+    TCGTemp *ts;
+    intptr_t ofs;
+    int i, size;
+
+    if (op->opc == INDEX_op_call) {
+        /*
+         * Helpers may write to env, unless they have no side effects
+         * and do not write globals either.
+         */
+        TCGArg flags = op->args[nb_oargs + TCGOP_CALLI(op) + 1];
+
+        if (!(flags & TCG_CALL_NO_SIDE_EFFECTS) ||
+            !(flags & (TCG_CALL_NO_READ_GLOBALS | TCG_CALL_NO_WRITE_GLOBALS))) {
+            env_mem_reset(em);
+            return false;
+        }
+    } else if (op->opc == INDEX_op_set_label) {
+        env_mem_reset(em);
+        return false;
+    } else if (def->flags & TCG_OPF_BB_END) {
+        env_mem_reset_temps(em);
+        return false;
+    } else if (def->flags & (TCG_OPF_CALL_CLOBBER | TCG_OPF_SIDE_EFFECTS)) {
+        /* Guest memory accesses may call helpers; barriers order env too. */
+        env_mem_reset(em);
+        return false;
+    }
+
+    for (i = 0; i < nb_oargs; i++) {
+        ts = arg_temp(op->args[i]);
+        if (ts) {
+            env_mem_reset_ts(em, ts);
+        }
+    }
+
+    size = env_mem_size(op);
+    if (size == 0) {
+        return false;
+    }
+    if (arg_temp(op->args[1]) != tcgv_ptr_temp(cpu_env)) {
+        /* A store through another pointer may still point into env. */
+        if (def->nb_oargs == 0) {
+            env_mem_reset(em);
+        }
+        return false;
+    }
+    ofs = op->args[2];
+
+    if (def->nb_oargs == 0) {
+        env_mem_reset_range(em, ofs, size);
+        /* Narrower stores would need an extension to read back. */
+        if (op->opc == INDEX_op_st_i32) {
+            ld_opc = INDEX_op_ld_i32;
+        } else if (op->opc == INDEX_op_st_i64) {
+            ld_opc = INDEX_op_ld_i64;
+        } else {
+            return false;
+        }
+        env_mem_record(em, arg_temp(op->args[0]), ld_opc, ofs, size);
+        return false;
+    }
+
+    ts = env_mem_find(em, op->opc, ofs);
+    if (ts) {
+        init_ts_info(infos, temps_used, ts);
+        op->opc = (def->flags & TCG_OPF_64BIT
+                   ? INDEX_op_mov_i64 : INDEX_op_mov_i32);
+        op->args[1] = temp_arg(ts);
+        return true;
+    }
+    env_mem_record(em, arg_temp(op->args[0]), op->opc, ofs, size);
+    return false;
+}
+
 /* Propagate constants and copies, fold constant expressions. */
 void tcg_optimize(TCGContext *s)
 {
@@ -601,6 +818,7 @@ void tcg_optimize(TCGContext *s)
     TCGOp *op, *op_next, *prev_mb = NULL;
     struct tcg_temp_info *infos;
     TCGTempSet temps_used;
+    EnvMemState env_mem;
 
     /* Array VALS has an element for each temp.
        If this temp holds a constant then its value is kept in VALS' element.
@@ -611,6 +829,7 @@ void tcg_optimize(TCGContext *s)
     nb_globals = s->nb_globals;
     bitmap_zero(temps_used.l, nb_temps);
     infos = tcg_malloc(sizeof(struct tcg_temp_info) * nb_temps);
+    env_mem_reset(&env_mem);
 
     QTAILQ_FOREACH_SAFE(op, &s->ops, link, op_next) {
         tcg_target_ulong mask, partmask, affected;
@@ -646,6 +865,12 @@ void tcg_optimize(TCGContext *s)
             }
         }
 
+        /* Replace loads from env of values that are already in a temp */
+        if (env_mem_forward(&env_mem, op, nb_oargs, infos, &temps_used)) {
+            opc = op->opc;
+            def = &tcg_op_defs[opc];
+        }
+
         /* For commutative operations make constant second argument */
         switch (opc) {
         CASE_OP_32_64_VEC(add):
@@ -2719,12 +2719,14 @@ void tcg_gen_goto_tb(unsigned idx)
 void tcg_gen_lookup_and_goto_ptr(void)
 {
     if (TCG_TARGET_HAS_goto_ptr && !qemu_loglevel_mask(CPU_LOG_TB_NOCHAIN)) {
-        TCGv_ptr ptr;
+        TCGv_ptr ptr, site;
 
         plugin_gen_disable_mem_helpers();
         ptr = tcg_temp_new_ptr();
-        gen_helper_lookup_tb_ptr(ptr, cpu_env);
+        site = tcg_const_ptr(tcg_ctx->gen_tb);
+        gen_helper_lookup_tb_ptr(ptr, cpu_env, site);
         tcg_gen_op1i(INDEX_op_goto_ptr, tcgv_ptr_arg(ptr));
+        tcg_temp_free_ptr(site);
         tcg_temp_free_ptr(ptr);
     } else {
         tcg_gen_exit_tb(NULL, 0);
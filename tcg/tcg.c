@@ -63,6 +63,7 @@
 
 #include "elf.h"
 #include "exec/log.h"
+#include "accel/tcg/perf.h"
 #include "sysemu/sysemu.h"
 
 /* Forward declarations for functions declared in tcg-target.c.inc and
@@ -193,6 +194,10 @@ struct tcg_region_state {
     /* fields protected by the lock */
     size_t current; /* current region index */
     size_t agg_size_full; /* aggregate size of full regions */
+    size_t *free; /* evicted regions, to be handed out before .current */
+    size_t n_free;
+    uint64_t *alloc_seq; /* when each region was assigned, 0 if unused */
+    uint64_t seq;
 };
 
 static struct tcg_region_state region;
@@ -406,23 +411,24 @@ static void tcg_region_trees_init(void)
     }
 }
 
-static struct tcg_region_tree *tc_ptr_to_region_tree(const void *cp)
+/* Index of the region containing @p, a pointer in the rw view */
+static size_t tcg_region_index(const void *p)
 {
-    void *p = tcg_splitwx_to_rw(cp);
-    size_t region_idx;
-
     if (p < region.start_aligned) {
-        region_idx = 0;
+        return 0;
     } else {
         ptrdiff_t offset = p - region.start_aligned;
 
         if (offset > region.stride * (region.n - 1)) {
-            region_idx = region.n - 1;
-        } else {
-            region_idx = offset / region.stride;
+            return region.n - 1;
         }
+        return offset / region.stride;
     }
-    return region_trees + region_idx * tree_size;
+}
+
+static struct tcg_region_tree *tc_ptr_to_region_tree(const void *cp)
+{
+    return region_trees + tcg_region_index(tcg_splitwx_to_rw(cp)) * tree_size;
 }
 
 void tcg_tb_insert(TranslationBlock *tb)
@@ -566,11 +572,17 @@ static void tcg_region_assign(TCGContext *s, size_t curr_region)
 
 static bool tcg_region_alloc__locked(TCGContext *s)
 {
-    if (region.current == region.n) {
+    size_t curr_region;
+
+    if (region.n_free) {
+        curr_region = region.free[--region.n_free];
+    } else if (region.current < region.n) {
+        curr_region = region.current++;
+    } else {
         return true;
     }
-    tcg_region_assign(s, region.current);
-    region.current++;
+    tcg_region_assign(s, curr_region);
+    region.alloc_seq[curr_region] = ++region.seq;
     return false;
 }
 
@@ -611,6 +623,8 @@ void tcg_region_reset_all(void)
     qemu_mutex_lock(&region.lock);
     region.current = 0;
     region.agg_size_full = 0;
+    region.n_free = 0;
+    memset(region.alloc_seq, 0, region.n * sizeof(*region.alloc_seq));
 
     for (i = 0; i < n_ctxs; i++) {
         TCGContext *s = qatomic_read(&tcg_ctxs[i]);
@@ -623,6 +637,85 @@ void tcg_region_reset_all(void)
     tcg_region_tree_reset_all();
 }
 
+/* Returns true if a region can be allocated without evicting one */
+bool tcg_region_available(void)
+{
+    bool ret;
+
+    qemu_mutex_lock(&region.lock);
+    ret = region.n_free || region.current < region.n;
+    qemu_mutex_unlock(&region.lock);
+    return ret;
+}
+
+static gboolean tcg_region_tree_evict(gpointer k, gpointer v, gpointer data)
+{
+    TranslationBlock *tb = v;
+
+    tb_phys_invalidate(tb, -1);
+    tb_destroy(tb);
+    return FALSE;
+}
+
+/*
+ * Make room in a full code buffer without flushing all of it: evict the
+ * region that was assigned longest ago among those that no context is
+ * translating into, and hand it out again from tcg_region_alloc().  Its
+ * TBs are invalidated and destroyed.  On success, store the bounds of the
+ * region in @pstart and @pend.  Returns false if no region can be evicted,
+ * which is always the case with a single region.
+ *
+ * Call from a safe-work context.
+ */
+bool tcg_region_evict(void **pstart, void **pend)
+{
+    unsigned int n_ctxs = qatomic_read(&n_tcg_ctxs);
+    struct tcg_region_tree *rt;
+    size_t victim = region.n;
+    size_t i;
+    unsigned int j;
+
+    qemu_mutex_lock(&region.lock);
+    for (i = 0; i < region.n; i++) {
+        if (!region.alloc_seq[i]) {
+            continue;
+        }
+        for (j = 0; j < n_ctxs; j++) {
+            TCGContext *s = qatomic_read(&tcg_ctxs[j]);
+
+            if (tcg_region_index(s->code_gen_buffer) == i) {
+                break;
+            }
+        }
+        if (j < n_ctxs) {
+            continue;
+        }
+        if (victim == region.n ||
+            region.alloc_seq[i] < region.alloc_seq[victim]) {
+            victim = i;
+        }
+    }
+    if (victim == region.n) {
+        qemu_mutex_unlock(&region.lock);
+        return false;
+    }
+    tcg_region_bounds(victim, pstart, pend);
+    /* tcg_region_alloc() accounted for it when its context moved on */
+    region.agg_size_full -= (*pend - *pstart) - TCG_HIGHWATER;
+    region.alloc_seq[victim] = 0;
+    region.free[region.n_free++] = victim;
+    qemu_mutex_unlock(&region.lock);
+
+    rt = region_trees + victim * tree_size;
+    qemu_mutex_lock(&rt->lock);
+    g_tree_foreach(rt->tree, tcg_region_tree_evict, NULL);
+    /* Increment the refcount first so that destroy acts as a reset */
+    g_tree_ref(rt->tree);
+    g_tree_destroy(rt->tree);
+    qemu_mutex_unlock(&rt->lock);
+    return true;
+}
+
 #ifdef CONFIG_USER_ONLY
 static size_t tcg_n_regions(void)
 {
@@ -727,6 +820,8 @@ void tcg_region_init(void)
     region.stride = region_size;
     region.start = buf;
     region.start_aligned = aligned;
+    region.free = g_new(size_t, n_regions);
+    region.alloc_seq = g_new0(uint64_t, n_regions);
     /* page-align the end, since its last page will be a guard page */
     region.end = QEMU_ALIGN_PTR_DOWN(buf + size, page_size);
     /* account for that last guard page */
@@ -1138,6 +1233,8 @@ void tcg_prologue_init(TCGContext *s)
     total_size -= prologue_size;
     s->code_gen_buffer_size = total_size;
 
+    perf_report_prologue(tcg_splitwx_to_rx(buf0), prologue_size);
+
     tcg_register_jit(tcg_splitwx_to_rx(s->code_gen_buffer), total_size);
 
 #ifdef DEBUG_DISAS
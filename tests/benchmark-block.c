@@ -0,0 +1,361 @@
+/*
+ * Block layer request path benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Each test opens a graph of block nodes on top of null-co or null-aio,
+ * so that the time spent per request is the time spent in the block layer
+ * itself, and keeps a number of requests in flight for a fixed time in the
+ * main loop or in one or more IOThreads.  The overhead of a layer is the
+ * difference to the graph without that layer.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "qemu/option.h"
+#include "qemu/timer.h"
+#include "qemu/main-loop.h"
+#include "qemu/module.h"
+#include "qapi/error.h"
+#include "qapi/qmp/qdict.h"
+#include "block/block.h"
+#include "block/qdict.h"
+#include "block/aio-wait.h"
+#include "block/throttle-groups.h"
+#include "sysemu/block-backend.h"
+#include "iothread.h"
+
+#define BENCH_SIZE              (1 * GiB)
+#define BENCH_REQUEST_SIZE      4096
+#define BENCH_DURATION_NS       (500 * SCALE_MS)
+#define BENCH_MAX_IOTHREADS     4
+
+typedef enum BenchParam {
+    BENCH_PARAM_NONE,
+    BENCH_PARAM_THROTTLE_GROUP,
+    BENCH_PARAM_QCOW2_IMAGE,
+} BenchParam;
+
+typedef struct BenchGraph {
+    const char *name;
+    /* The graph that this one adds layers on top of, if any */
+    const char *base;
+    /* Options for blk_new_open(); %s is replaced as given by param */
+    const char *opts;
+    BenchParam param;
+} BenchGraph;
+
+static const BenchGraph bench_graphs[] = {
+    {
+        .name = "null-co",
+        .opts = "driver=null-co,size=1G",
+    }, {
+        .name = "null-aio",
+        .opts = "driver=null-aio,size=1G",
+    }, {
+        .name = "raw",
+        .base = "null-aio",
+        .opts = "driver=raw,file.driver=null-aio,file.size=1G",
+    }, {
+        .name = "throttle",
+        .base = "null-aio",
+        .opts = "driver=throttle,throttle-group=%s,"
+                "file.driver=null-aio,file.size=1G",
+        .param = BENCH_PARAM_THROTTLE_GROUP,
+    }, {
+        .name = "copy-on-read",
+        .base = "null-aio",
+        .opts = "driver=copy-on-read,file.driver=null-aio,file.size=1G",
+    }, {
+        .name = "throttle-cor-raw",
+        .base = "raw",
+        .opts = "driver=throttle,throttle-group=%s,"
+                "file.driver=copy-on-read,file.file.driver=raw,"
+                "file.file.file.driver=null-aio,file.file.file.size=1G",
+        .param = BENCH_PARAM_THROTTLE_GROUP,
+    }, {
+        /*
+         * null-aio cannot hold the qcow2 metadata, so the image is a file
+         * with preallocated metadata and a raw external data file, and the
+         * data file is replaced by null-aio.
+         */
+        .name = "qcow2",
+        .base = "null-aio",
+        .opts = "driver=qcow2,file.driver=file,file.filename=%s,"
+                "file.locking=off,data-file.driver=null-aio,"
+                "data-file.size=1G",
+        .param = BENCH_PARAM_QCOW2_IMAGE,
+    },
+};
+
+typedef struct BenchConfig {
+    const char *name;
+    int iothreads;          /* 0 runs the requests in the main loop */
+    int queue_depth;        /* per BlockBackend */
+} BenchConfig;
+
+static const BenchConfig bench_configs[] = {
+    { "main-loop-qd1", 0, 1 },
+    { "iothread-qd32", 1, 32 },
+    { "iothreads-4-qd32", 4, 32 },
+};
+
+typedef struct BenchTest {
+    const BenchGraph *graph;
+    const BenchConfig *config;
+    bool write;
+    double ns_per_request;
+} BenchTest;
+
+/* One BlockBackend and the requests that run on it */
+typedef struct BenchJob {
+    BlockBackend *blk;
+    ThrottleState *throttle_state;
+    bool write;
+    int queue_depth;
+    int64_t deadline;
+    void *buf;
+    int started;
+    uint64_t requests;
+} BenchJob;
+
+static IOThread *iothreads[BENCH_MAX_IOTHREADS];
+static char *qcow2_images[BENCH_MAX_IOTHREADS];
+static BenchTest *bench_tests;
+static size_t nr_bench_tests;
+static int bench_running;
+
+static const char *bench_get_qcow2_image(int i)
+{
+    char *data_file;
+    int fd;
+
+    if (qcow2_images[i]) {
+        return qcow2_images[i];
+    }
+
+    qcow2_images[i] = g_strdup_printf("%s/qemu-benchmark-block-XXXXXX",
+                                      g_get_tmp_dir());
+    fd = g_mkstemp(qcow2_images[i]);
+    g_assert(fd >= 0);
+    close(fd);
+
+    /*
+     * The image is shared by all tests of a run.  Preallocate it so that
+     * every test sees the same image, with all clusters already mapped,
+     * and the first one doesn't pay for the allocations alone.
+     */
+    data_file = g_strdup_printf("data_file=%s.data,data_file_raw=on,"
+                                "preallocation=metadata", qcow2_images[i]);
+    bdrv_img_create(qcow2_images[i], "qcow2", NULL, NULL, data_file,
+                    BENCH_SIZE, 0, true, &error_abort);
+    g_free(data_file);
+
+    return qcow2_images[i];
+}
+
+static void bench_job_open(BenchJob *job, const BenchGraph *graph, int i,
+                           AioContext *ctx)
+{
+    g_autofree char *tg_name = NULL;
+    g_autofree char *opts = NULL;
+    QDict *options;
+
+    switch (graph->param) {
+    case BENCH_PARAM_NONE:
+        opts = g_strdup(graph->opts);
+        break;
+    case BENCH_PARAM_THROTTLE_GROUP:
+        /* No limits, but all the accounting of the throttle filter */
+        tg_name = g_strdup_printf("bench-tg%d", i);
+        job->throttle_state = throttle_group_incref(tg_name);
+        opts = g_strdup_printf(graph->opts, tg_name);
+        break;
+    case BENCH_PARAM_QCOW2_IMAGE:
+        opts = g_strdup_printf(graph->opts, bench_get_qcow2_image(i));
+        break;
+    default:
+        g_assert_not_reached();
+    }
+
+    options = keyval_parse(opts, NULL, NULL, &error_abort);
+    qdict_flatten(options);
+    job->blk = blk_new_open(NULL, NULL, options, BDRV_O_RDWR, &error_abort);
+    if (ctx != qemu_get_aio_context()) {
+        blk_set_aio_context(job->blk, ctx, &error_abort);
+    }
+    job->buf = blk_blockalign(job->blk, BENCH_REQUEST_SIZE);
+}
+
+static void bench_job_close(BenchJob *job)
+{
+    AioContext *ctx = blk_get_aio_context(job->blk);
+
+    qemu_vfree(job->buf);
+    if (ctx != qemu_get_aio_context()) {
+        aio_context_acquire(ctx);
+        blk_set_aio_context(job->blk, qemu_get_aio_context(), &error_abort);
+        aio_context_release(ctx);
+    }
+    blk_unref(job->blk);
+    if (job->throttle_state) {
+        throttle_group_unref(job->throttle_state);
+    }
+}
+
+static void coroutine_fn bench_co_entry(void *opaque)
+{
+    BenchJob *job = opaque;
+    QEMUIOVector qiov;
+    /* Spread the requests of the coroutines over the disk */
+    int64_t offset = job->started++ * (BENCH_SIZE / job->queue_depth);
+    int ret;
+
+    qemu_iovec_init_buf(&qiov, job->buf, BENCH_REQUEST_SIZE);
+
+    while (get_clock() < job->deadline) {
+        if (job->write) {
+            ret = blk_co_pwritev(job->blk, offset, BENCH_REQUEST_SIZE,
+                                 &qiov, 0);
+        } else {
+            ret = blk_co_preadv(job->blk, offset, BENCH_REQUEST_SIZE,
+                                &qiov, 0);
+        }
+        g_assert_cmpint(ret, ==, 0);
+
+        job->requests++;
+        offset = (offset + BENCH_REQUEST_SIZE) % BENCH_SIZE;
+    }
+
+    qatomic_dec(&bench_running);
+    aio_wait_kick();
+}
+
+static const BenchTest *bench_find_base(const BenchTest *test)
+{
+    size_t i;
+
+    if (!test->graph->base) {
+        return NULL;
+    }
+    for (i = 0; i < nr_bench_tests; i++) {
+        const BenchTest *t = &bench_tests[i];
+
+        if (t->config == test->config && t->write == test->write &&
+            !strcmp(t->graph->name, test->graph->base)) {
+            return t;
+        }
+    }
+    return NULL;
+}
+
+static void test_block_speed(const void *opaque)
+{
+    BenchTest *test = (BenchTest *)opaque;
+    const BenchConfig *config = test->config;
+    int nr_jobs = MAX(config->iothreads, 1);
+    BenchJob *jobs = g_new0(BenchJob, nr_jobs);
+    const BenchTest *base;
+    g_autofree char *overhead = NULL;
+    uint64_t requests = 0;
+    int64_t start, elapsed;
+    int i, j;
+
+    for (i = 0; i < nr_jobs; i++) {
+        AioContext *ctx = config->iothreads ?
+                          iothread_get_aio_context(iothreads[i]) :
+                          qemu_get_aio_context();
+
+        bench_job_open(&jobs[i], test->graph, i, ctx);
+        jobs[i].write = test->write;
+        jobs[i].queue_depth = config->queue_depth;
+    }
+
+    start = get_clock();
+    bench_running = nr_jobs * config->queue_depth;
+    for (i = 0; i < nr_jobs; i++) {
+        jobs[i].deadline = start + BENCH_DURATION_NS;
+        for (j = 0; j < config->queue_depth; j++) {
+            Coroutine *co = qemu_coroutine_create(bench_co_entry, &jobs[i]);
+            aio_co_enter(blk_get_aio_context(jobs[i].blk), co);
+        }
+    }
+    AIO_WAIT_WHILE(NULL, qatomic_read(&bench_running) > 0);
+    elapsed = get_clock() - start;
+
+    for (i = 0; i < nr_jobs; i++) {
+        requests += jobs[i].requests;
+        bench_job_close(&jobs[i]);
+    }
+    g_free(jobs);
+
+    /* Time that one thread spends on one request */
+    test->ns_per_request = (double)elapsed * nr_jobs / MAX(requests, 1);
+    base = bench_find_base(test);
+    if (base) {
+        overhead = g_strdup_printf(", %+.1f ns over %s",
+                                   test->ns_per_request - base->ns_per_request,
+                                   base->graph->name);
+    }
+
+    g_test_message("%s %s %s: %.0f IOPS, %.1f ns/request%s",
+                   test->graph->name, test->write ? "write" : "read",
+                   config->name,
+                   requests * (double)NANOSECONDS_PER_SECOND / elapsed,
+                   test->ns_per_request, overhead ?: "");
+}
+
+int main(int argc, char **argv)
+{
+    size_t i, j, n = 0;
+    int op, ret;
+
+    qemu_init_main_loop(&error_abort);
+    bdrv_init();
+    module_call_init(MODULE_INIT_QOM);
+
+    g_test_init(&argc, &argv, NULL);
+
+    for (i = 0; i < BENCH_MAX_IOTHREADS; i++) {
+        iothreads[i] = iothread_new();
+    }
+
+    nr_bench_tests = ARRAY_SIZE(bench_configs) * 2 * ARRAY_SIZE(bench_graphs);
+    bench_tests = g_new0(BenchTest, nr_bench_tests);
+
+    /* Tests run in this order, so each base is measured before its users */
+    for (i = 0; i < ARRAY_SIZE(bench_configs); i++) {
+        for (op = 0; op < 2; op++) {
+            for (j = 0; j < ARRAY_SIZE(bench_graphs); j++) {
+                BenchTest *t = &bench_tests[n++];
+                g_autofree char *name = NULL;
+
+                t->graph = &bench_graphs[j];
+                t->config = &bench_configs[i];
+                t->write = op;
+
+                name = g_strdup_printf("/block/benchmark/%s/%s/%s",
+                                       t->config->name,
+                                       op ? "write" : "read", t->graph->name);
+                g_test_add_data_func(name, t, test_block_speed);
+            }
+        }
+    }
+
+    ret = g_test_run();
+
+    for (i = 0; i < BENCH_MAX_IOTHREADS; i++) {
+        iothread_join(iothreads[i]);
+        if (qcow2_images[i]) {
+            g_autofree char *data_file = g_strdup_printf("%s.data",
+                                                         qcow2_images[i]);
+            unlink(data_file);
+            unlink(qcow2_images[i]);
+            g_free(qcow2_images[i]);
+        }
+    }
+    g_free(bench_tests);
+
+    return ret;
+}
@@ -0,0 +1,141 @@
+/*
+ * QMP JSON round-trip benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "qapi/error.h"
+#include "qapi/qmp/json-parser.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qjson.h"
+#include "qapi/qmp/qlist.h"
+#include "qapi/qmp/qstring.h"
+
+/* What the monitor reads from its socket in one go */
+#define QJSON_BENCH_CHUNK 4096
+
+static const char *const qjson_bench_stats[] = {
+    "rd_bytes", "wr_bytes", "unmap_bytes", "rd_operations",
+    "wr_operations", "flush_operations", "unmap_operations",
+    "rd_merged", "wr_merged", "unmap_merged", "wr_highest_offset",
+    "rd_total_time_ns", "wr_total_time_ns", "flush_total_time_ns",
+    "unmap_total_time_ns", "idle_time_ns", "failed_rd_operations",
+    "failed_wr_operations", "failed_flush_operations",
+    "failed_unmap_operations", "invalid_rd_operations",
+    "invalid_wr_operations", "invalid_flush_operations",
+    "invalid_unmap_operations",
+};
+
+/* Roughly the shape of a query-blockstats reply */
+static QDict *qjson_bench_response(int nodes)
+{
+    QDict *rsp = qdict_new();
+    QList *list = qlist_new();
+    int i, j;
+
+    for (i = 0; i < nodes; i++) {
+        QDict *node = qdict_new();
+        QDict *stats = qdict_new();
+        char *name = g_strdup_printf("#block%d", i);
+
+        for (j = 0; j < ARRAY_SIZE(qjson_bench_stats); j++) {
+            qdict_put_int(stats, qjson_bench_stats[j],
+                          g_test_rand_int_range(0, INT32_MAX) * (j + 1LL));
+        }
+        qdict_put_bool(stats, "account_invalid", true);
+        qdict_put_bool(stats, "account_failed", true);
+        qdict_put_obj(stats, "timed_stats", QOBJECT(qlist_new()));
+
+        qdict_put_str(node, "node-name", name);
+        qdict_put_str(node, "qdev", "/machine/peripheral/virtio-disk/"
+                      "virtio-backend");
+        qdict_put(node, "stats", stats);
+        qlist_append(list, node);
+        g_free(name);
+    }
+
+    qdict_put(rsp, "return", list);
+    return rsp;
+}
+
+typedef struct QJSONBenchState {
+    QObject *result;
+    int count;
+} QJSONBenchState;
+
+static void qjson_bench_emit(void *opaque, QObject *json, Error *err)
+{
+    QJSONBenchState *s = opaque;
+
+    g_assert(!err);
+    qobject_unref(s->result);
+    s->result = json;
+    s->count++;
+}
+
+static void test_qjson_roundtrip(const void *opaque)
+{
+    int nodes = GPOINTER_TO_INT(opaque);
+    QDict *rsp = qjson_bench_response(nodes);
+    QJSONBenchState state = {};
+    JSONMessageParser parser;
+    double to_json = 0, from_json = 0;
+    QString *json = NULL;
+    const char *str;
+    size_t len, off;
+    int i, iters = 10;
+
+    json_message_parser_init(&parser, qjson_bench_emit, &state, NULL);
+
+    for (i = 0; i < iters; i++) {
+        qobject_unref(json);
+        g_test_timer_start();
+        json = qobject_to_json(QOBJECT(rsp));
+        to_json += g_test_timer_elapsed();
+
+        str = qstring_get_str(json);
+        len = qstring_get_length(json);
+        g_test_timer_start();
+        for (off = 0; off < len; off += QJSON_BENCH_CHUNK) {
+            json_message_parser_feed(&parser, str + off,
+                                     MIN(QJSON_BENCH_CHUNK, len - off));
+        }
+        json_message_parser_flush(&parser);
+        from_json += g_test_timer_elapsed();
+    }
+
+    g_assert_cmpint(state.count, ==, iters);
+    g_assert(qobject_is_equal(state.result, QOBJECT(rsp)));
+
+    g_test_message("%d nodes, %zu bytes: to_json %.2f ms (%.1f MB/sec), "
+                   "parse %.2f ms (%.1f MB/sec)",
+                   nodes, len,
+                   to_json * 1000 / iters, len * iters / to_json / MiB,
+                   from_json * 1000 / iters, len * iters / from_json / MiB);
+
+    json_message_parser_destroy(&parser);
+    qobject_unref(state.result);
+    qobject_unref(json);
+    qobject_unref(rsp);
+}
+
+int main(int argc, char **argv)
+{
+    static const int nodes[] = { 10, 1000, 10000 };
+    char name[64];
+    int i;
+
+    g_test_init(&argc, &argv, NULL);
+
+    for (i = 0; i < ARRAY_SIZE(nodes); i++) {
+        snprintf(name, sizeof(name), "/qjson/benchmark/roundtrip/%d",
+                 nodes[i]);
+        g_test_add_data_func(name, GINT_TO_POINTER(nodes[i]),
+                             test_qjson_roundtrip);
+    }
+
+    return g_test_run();
+}
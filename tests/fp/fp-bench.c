@@ -33,6 +33,10 @@ enum op {
     OP_FMA,
     OP_SQRT,
     OP_CMP,
+    OP_MIN,
+    OP_RINT,
+    OP_CVT,
+    OP_I2F,
     OP_MAX_NR,
 };
 
@@ -44,6 +48,10 @@ static const char * const op_names[] = {
     [OP_FMA] = "mulAdd",
     [OP_SQRT] = "sqrt",
     [OP_CMP] = "cmp",
+    [OP_MIN] = "min",
+    [OP_RINT] = "rint",
+    [OP_CVT] = "cvt",
+    [OP_I2F] = "i2f",
     [OP_MAX_NR] = NULL,
 };
 
@@ -235,6 +243,18 @@ static void bench(enum precision prec, enum op op, int n_ops, bool no_neg)
                 case OP_CMP:
                     res.u64 = isgreater(a, b);
                     break;
+                case OP_MIN:
+                    res.f = fminf(a, b);
+                    break;
+                case OP_RINT:
+                    res.f = rintf(a);
+                    break;
+                case OP_CVT:
+                    res.d = a;
+                    break;
+                case OP_I2F:
+                    res.f = (int32_t)float32_val(ops[0].f32);
+                    break;
                 default:
                     g_assert_not_reached();
                 }
@@ -270,6 +290,18 @@ static void bench(enum precision prec, enum op op, int n_ops, bool no_neg)
                 case OP_CMP:
                     res.u64 = isgreater(a, b);
                     break;
+                case OP_MIN:
+                    res.d = fmin(a, b);
+                    break;
+                case OP_RINT:
+                    res.d = rint(a);
+                    break;
+                case OP_CVT:
+                    res.f = a;
+                    break;
+                case OP_I2F:
+                    res.d = (int64_t)float64_val(ops[0].f64);
+                    break;
                 default:
                     g_assert_not_reached();
                 }
@@ -305,6 +337,18 @@ static void bench(enum precision prec, enum op op, int n_ops, bool no_neg)
                 case OP_CMP:
                     res.u64 = float32_compare_quiet(a, b, &soft_status);
                     break;
+                case OP_MIN:
+                    res.f32 = float32_min(a, b, &soft_status);
+                    break;
+                case OP_RINT:
+                    res.f32 = float32_round_to_int(a, &soft_status);
+                    break;
+                case OP_CVT:
+                    res.f64 = float32_to_float64(a, &soft_status);
+                    break;
+                case OP_I2F:
+                    res.f32 = int32_to_float32(float32_val(a), &soft_status);
+                    break;
                 default:
                     g_assert_not_reached();
                 }
@@ -340,6 +384,18 @@ static void bench(enum precision prec, enum op op, int n_ops, bool no_neg)
                 case OP_CMP:
                     res.u64 = float64_compare_quiet(a, b, &soft_status);
                     break;
+                case OP_MIN:
+                    res.f64 = float64_min(a, b, &soft_status);
+                    break;
+                case OP_RINT:
+                    res.f64 = float64_round_to_int(a, &soft_status);
+                    break;
+                case OP_CVT:
+                    res.f32 = float64_to_float32(a, &soft_status);
+                    break;
+                case OP_I2F:
+                    res.f64 = int64_to_float64(float64_val(a), &soft_status);
+                    break;
                 default:
                     g_assert_not_reached();
                 }
@@ -377,6 +433,10 @@ GEN_BENCH_ALL_TYPES(mul, OP_MUL, 2)
 GEN_BENCH_ALL_TYPES(div, OP_DIV, 2)
 GEN_BENCH_ALL_TYPES(fma, OP_FMA, 3)
 GEN_BENCH_ALL_TYPES(cmp, OP_CMP, 2)
+GEN_BENCH_ALL_TYPES(min, OP_MIN, 2)
+GEN_BENCH_ALL_TYPES(rint, OP_RINT, 1)
+GEN_BENCH_ALL_TYPES(cvt, OP_CVT, 1)
+GEN_BENCH_ALL_TYPES(i2f, OP_I2F, 1)
 #undef GEN_BENCH_ALL_TYPES
 
 #define GEN_BENCH_ALL_TYPES_NO_NEG(name, op, n)                         \
@@ -407,6 +467,10 @@ static const bench_func_t bench_funcs[OP_MAX_NR][PREC_MAX_NR] = {
     GEN_BENCH_FUNCS(fma, OP_FMA),
     GEN_BENCH_FUNCS(sqrt, OP_SQRT),
     GEN_BENCH_FUNCS(cmp, OP_CMP),
+    GEN_BENCH_FUNCS(min, OP_MIN),
+    GEN_BENCH_FUNCS(rint, OP_RINT),
+    GEN_BENCH_FUNCS(cvt, OP_CVT),
+    GEN_BENCH_FUNCS(i2f, OP_I2F),
 };
 
 #undef GEN_BENCH_FUNCS
@@ -60,6 +60,7 @@ static double resize_rate; /* 0.0 to 1.0 */
 static unsigned int n_rz_threads = 1;
 static QemuThread *rz_threads;
 static bool precompute_hash;
+static bool insert_only;
 
 static double update_rate; /* 0.0 to 1.0 */
 static uint64_t update_threshold;
@@ -88,6 +89,7 @@ static const char commands_string[] =
     " -r = update range of keys (will be rounded up to pow2)\n"
     "\n"
     " -u = update rate (0.0 to 100.0), 50/50 split of insertions/removals\n"
+    " -I = updates are insertions only (e.g. -I -k 0 -R to test warm-up)\n"
     "\n"
     " -R = enable auto-resize\n"
     " -S = resize rate (0.0 to 100.0)\n"
@@ -199,7 +201,9 @@ static void do_rw(struct thread_info *info)
                 stats->not_rm++;
             }
         }
-        info->write_op = !info->write_op;
+        if (!insert_only) {
+            info->write_op = !info->write_op;
+        }
     }
 }
 
@@ -281,6 +285,8 @@ static void pr_params(void)
         printf(" # resize threads   %u\n", n_rz_threads);
     }
     printf(" update rate:       %f%%\n", update_rate * 100.0);
+    printf(" update ops:        %s\n",
+           insert_only ? "insertions" : "insertions/removals");
     printf(" offset:            %ld\n", populate_offset);
     printf(" initial key range: %zu\n", init_range);
     printf(" lookup range:      %lu\n", lookup_range);
@@ -389,6 +395,7 @@ static void add_stats(struct thread_stats *s, struct thread_info *info, int n)
 static void pr_stats(void)
 {
     struct thread_stats s = {};
+    struct qht_stats ht_stats;
     double tx;
 
     add_stats(&s, rw_info, n_rw_threads);
@@ -417,6 +424,11 @@ static void pr_stats(void)
     tx = (s.rd + s.not_rd + s.in + s.not_in + s.rm + s.not_rm) / 1e6 / duration;
     printf(" Throughput:        %.2f MT/s\n", tx);
     printf(" Throughput/thread: %.2f MT/s/thread\n", tx / n_rw_threads);
+
+    qht_statistics_init(&ht, &ht_stats);
+    printf(" Final head buckets: %zu (%zu entries)\n",
+           ht_stats.head_buckets, ht_stats.entries);
+    qht_statistics_destroy(&ht_stats);
 }
 
 static void run_test(void)
@@ -444,7 +456,7 @@ static void parse_args(int argc, char *argv[])
     int c;
 
     for (;;) {
-        c = getopt(argc, argv, "d:D:g:k:K:l:hn:N:o:pr:Rs:S:u:");
+        c = getopt(argc, argv, "d:D:g:Ik:K:l:hn:N:o:pr:Rs:S:u:");
         if (c < 0) {
             break;
         }
@@ -465,6 +477,9 @@ static void parse_args(int argc, char *argv[])
         case 'h':
             usage_complete(argc, argv);
             exit(0);
+        case 'I':
+            insert_only = true;
+            break;
         case 'k':
             init_size = atol(optarg);
             break;
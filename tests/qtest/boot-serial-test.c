@@ -109,6 +109,7 @@ typedef struct testdef {
     size_t codesize;        /* Size of the kernel or bios data */
     const uint8_t *kernel;  /* Set in case we use our own mini kernel */
     const uint8_t *bios;    /* Set in case we use our own mini bios */
+    const char *accel;      /* Accelerator options, if not TCG or KVM */
 } testdef_t;
 
 static testdef_t tests[] = {
@@ -156,6 +157,17 @@ static testdef_t tests[] = {
     { NULL }
 };
 
+/*
+ * SeaBIOS starts the APs and waits for timer interrupts, so this only
+ * gets to SGABIOS if the vCPUs go through their icount quanta together.
+ */
+static testdef_t test_icount_mttcg = {
+    .machine = "pc",
+    .extra = "-smp 2 -icount shift=0,quantum=1000 -device sga",
+    .expect = "SGABIOS",
+    .accel = "-accel tcg,thread=multi",
+};
+
 static bool check_guest_output(QTestState *qts, const testdef_t *test, int fd)
 {
     int nbr = 0, pos = 0, ccnt;
@@ -230,9 +242,10 @@ static void test_machine(const void *data)
      */
     qts = qtest_initf("%s %s -M %s -no-shutdown "
                       "-chardev file,id=serial0,path=%s "
-                      "-serial chardev:serial0 -accel tcg -accel kvm %s",
+                      "-serial chardev:serial0 %s %s",
                       codeparam, code ? codetmp : "", test->machine,
-                      serialtmp, test->extra);
+                      serialtmp, test->accel ?: "-accel tcg -accel kvm",
+                      test->extra);
     if (code) {
         unlink(codetmp);
     }
@@ -262,6 +275,12 @@ int main(int argc, char *argv[])
             g_free(name);
         }
     }
+#ifdef CONFIG_TCG
+    if (!strcmp(arch, "i386") || !strcmp(arch, "x86_64")) {
+        qtest_add_data_func("boot-serial/pc/icount-mttcg", &test_icount_mttcg,
+                            test_machine);
+    }
+#endif
 
     return g_test_run();
 }
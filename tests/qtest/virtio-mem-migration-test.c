@@ -0,0 +1,140 @@
+/*
+ * QTest testcase for virtio-mem requests across migration
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * With prealloc=on, a plug request is completed by a worker thread.  If it
+ * is still in flight when the source stops, the request is put back into
+ * the queue and the destination must handle it without another kick.
+ * Either way, the guest gets exactly one response.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "qemu/units.h"
+#include "libqos/libqtest.h"
+#include "libqos/libqos-pc.h"
+#include "libqos/virtio.h"
+#include "libqos/virtio-pci.h"
+#include "standard-headers/linux/virtio_mem.h"
+#include "standard-headers/linux/virtio_ring.h"
+
+#define VIRTIO_MIG_TIMEOUT_US   (30 * 1000 * 1000)
+#define VIRTIO_MEM_SLOT         5
+#define VIRTIO_MEM_SIZE         (256 * MiB)
+
+static char mig_socket[] = "/tmp/qtest-virtio-mem-migration.XXXXXX";
+
+static QOSState *boot_mem(const char *extra)
+{
+    return qtest_pc_boot("-m 128M,maxmem=1G "
+                         "-object memory-backend-ram,id=mem0,size=%" PRId64 " "
+                         "-device virtio-mem-pci,memdev=mem0,addr=%x.0,"
+                         "requested-size=%" PRId64 ",prealloc=on %s",
+                         VIRTIO_MEM_SIZE, VIRTIO_MEM_SLOT, VIRTIO_MEM_SIZE,
+                         extra);
+}
+
+static QVirtioPCIDevice *find_mem(QOSState *qs)
+{
+    QPCIAddress addr = { .devfn = QPCI_DEVFN(VIRTIO_MEM_SLOT, 0) };
+    QVirtioPCIDevice *dev = virtio_pci_new(qs->pcibus, &addr);
+
+    g_assert_nonnull(dev);
+    qvirtio_pci_device_enable(dev);
+    return dev;
+}
+
+static void test_plug_requeue(void)
+{
+    char *uri = g_strdup_printf("unix:%s", mig_socket);
+    char *incoming = g_strdup_printf("-incoming %s", uri);
+    struct virtio_mem_req req = {
+        .type = cpu_to_le16(VIRTIO_MEM_REQ_PLUG),
+    };
+    struct virtio_mem_resp resp;
+    QOSState *src, *dst;
+    QVirtioPCIDevice *src_dev, *dst_dev;
+    QVirtioDevice *vdev;
+    QVirtQueue *vq;
+    uint64_t features, block_size, plugged_size, req_addr;
+    uint32_t free_head;
+    uint16_t type;
+
+    src = boot_mem("");
+    dst = boot_mem(incoming);
+
+    src_dev = find_mem(src);
+    vdev = &src_dev->vdev;
+    qvirtio_start_device(vdev);
+    features = qvirtio_get_features(vdev) &
+               ~(QVIRTIO_F_BAD_FEATURE |
+                 (1u << VIRTIO_RING_F_INDIRECT_DESC) |
+                 (1u << VIRTIO_RING_F_EVENT_IDX));
+    qvirtio_set_features(vdev, features);
+    vq = qvirtqueue_setup(vdev, &src->alloc, 0);
+    qvirtio_set_driver_ok(vdev);
+
+    block_size = qvirtio_config_readq(vdev,
+                    offsetof(struct virtio_mem_config, block_size));
+    req.u.plug.addr = cpu_to_le64(qvirtio_config_readq(vdev,
+                    offsetof(struct virtio_mem_config, addr)));
+    req.u.plug.nb_blocks = cpu_to_le16(VIRTIO_MEM_SIZE / block_size);
+
+    /* Plug the whole device and migrate while the worker preallocates it */
+    req_addr = guest_alloc(&src->alloc, sizeof(req) + sizeof(resp));
+    qtest_memwrite(src->qts, req_addr, &req, sizeof(req));
+    qtest_memset(src->qts, req_addr + sizeof(req), 0xff, sizeof(resp));
+
+    free_head = qvirtqueue_add(src->qts, vq, req_addr, sizeof(req),
+                               false, true);
+    qvirtqueue_add(src->qts, vq, req_addr + sizeof(req), sizeof(resp),
+                   true, false);
+    qvirtqueue_kick(src->qts, vdev, vq, free_head);
+
+    migrate(src, dst, uri);
+
+    /* The request was answered on the source or handled once more here */
+    dst_dev = find_mem(dst);
+    qvirtio_wait_used_elem(dst->qts, &dst_dev->vdev, vq, free_head, NULL,
+                           VIRTIO_MIG_TIMEOUT_US);
+    qtest_memread(dst->qts, req_addr + sizeof(req), &resp, sizeof(resp));
+    type = le16_to_cpu(resp.type);
+
+    plugged_size = qvirtio_config_readq(&dst_dev->vdev,
+                    offsetof(struct virtio_mem_config, plugged_size));
+    if (type == VIRTIO_MEM_RESP_ACK) {
+        g_assert_cmpuint(plugged_size, ==, VIRTIO_MEM_SIZE);
+    } else {
+        /* Requests that race with migration may be refused */
+        g_assert_cmpuint(type, ==, VIRTIO_MEM_RESP_BUSY);
+        g_assert_cmpuint(plugged_size, ==, 0);
+    }
+
+    qvirtio_pci_device_disable(dst_dev);
+    g_free(dst_dev);
+    qvirtio_pci_device_disable(src_dev);
+    g_free(src_dev);
+    qtest_shutdown(src);
+    qtest_shutdown(dst);
+    g_free(incoming);
+    g_free(uri);
+}
+
+int main(int argc, char **argv)
+{
+    int fd, ret;
+
+    g_test_init(&argc, &argv, NULL);
+
+    fd = mkstemp(mig_socket);
+    g_assert(fd != -1);
+    close(fd);
+
+    qtest_add_func("/virtio/mem/migration/plug-requeue", test_plug_requeue);
+
+    ret = g_test_run();
+    unlink(mig_socket);
+    return ret;
+}
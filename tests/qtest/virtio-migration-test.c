@@ -0,0 +1,195 @@
+/*
+ * QTest testcase for virtio device state across migration
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * A virtio-blk device delays its interrupts with notify-coalesce-usecs.
+ * The interrupt for a request that completed just before migration is
+ * still held back when the source stops, and must be pending on the
+ * destination.
+ *
+ * A virtio-balloon device discards reported free pages in its iothread.
+ * Reports still in flight when the source stops are put back into the
+ * queue, and the destination must answer them without another kick.
+ */
+
+#include "qemu/osdep.h"
+#include "libqos/libqtest.h"
+#include "libqos/libqos-pc.h"
+#include "libqos/virtio.h"
+#include "libqos/virtio-pci.h"
+#include "standard-headers/linux/virtio_balloon.h"
+#include "standard-headers/linux/virtio_blk.h"
+#include "standard-headers/linux/virtio_ring.h"
+
+#define VIRTIO_MIG_TIMEOUT_US   (30 * 1000 * 1000)
+#define VIRTIO_BLK_SLOT         4
+#define VIRTIO_BALLOON_SLOT     5
+
+/* Without free page hinting, the reporting queue follows the stats queue */
+#define REPORTING_VQ            3
+#define REPORT_SIZE             (1024 * 1024)
+
+/* Long enough that the timer never fires while the test runs */
+#define COALESCE_USECS          (60 * 1000 * 1000)
+
+static char mig_socket[] = "/tmp/qtest-virtio-migration.XXXXXX";
+
+static QOSState *boot_blk(const char *extra)
+{
+    return qtest_pc_boot("-drive if=none,id=drive0,format=raw,"
+                         "file=null-co://,file.read-zeroes=on "
+                         "-device virtio-blk-pci,drive=drive0,addr=%x.0,"
+                         "notify-coalesce-usecs=%d %s",
+                         VIRTIO_BLK_SLOT, COALESCE_USECS, extra);
+}
+
+static QOSState *boot_balloon(const char *extra)
+{
+    return qtest_pc_boot("-object iothread,id=iothread0 "
+                         "-device virtio-balloon-pci,addr=%x.0,"
+                         "iothread=iothread0,free-page-reporting=on %s",
+                         VIRTIO_BALLOON_SLOT, extra);
+}
+
+static QVirtioPCIDevice *find_dev(QOSState *qs, int slot)
+{
+    QPCIAddress addr = { .devfn = QPCI_DEVFN(slot, 0) };
+    QVirtioPCIDevice *dev = virtio_pci_new(qs->pcibus, &addr);
+
+    g_assert_nonnull(dev);
+    qvirtio_pci_device_enable(dev);
+    return dev;
+}
+
+static void test_coalesced_notify(void)
+{
+    char *uri = g_strdup_printf("unix:%s", mig_socket);
+    char *incoming = g_strdup_printf("-incoming %s", uri);
+    struct virtio_blk_outhdr hdr = { .type = VIRTIO_BLK_T_IN };
+    QOSState *src, *dst;
+    QVirtioPCIDevice *src_dev, *dst_dev;
+    QVirtioDevice *vdev;
+    QVirtQueue *vq;
+    uint64_t features, req_addr;
+    uint32_t free_head;
+    uint8_t status = 0xff;
+
+    src = boot_blk("");
+    dst = boot_blk(incoming);
+
+    src_dev = find_dev(src, VIRTIO_BLK_SLOT);
+    vdev = &src_dev->vdev;
+    qvirtio_start_device(vdev);
+    features = qvirtio_get_features(vdev) &
+               ~(QVIRTIO_F_BAD_FEATURE |
+                 (1u << VIRTIO_RING_F_INDIRECT_DESC) |
+                 (1u << VIRTIO_RING_F_EVENT_IDX) |
+                 (1u << VIRTIO_BLK_F_SCSI));
+    qvirtio_set_features(vdev, features);
+    vq = qvirtqueue_setup(vdev, &src->alloc, 0);
+    qvirtio_set_driver_ok(vdev);
+
+    /* Read sector 0; the request completes, but there is no interrupt */
+    req_addr = guest_alloc(&src->alloc, sizeof(hdr) + 512 + 1);
+    qtest_memwrite(src->qts, req_addr, &hdr, sizeof(hdr));
+    qtest_memwrite(src->qts, req_addr + sizeof(hdr) + 512, &status, 1);
+
+    free_head = qvirtqueue_add(src->qts, vq, req_addr, sizeof(hdr),
+                               false, true);
+    qvirtqueue_add(src->qts, vq, req_addr + sizeof(hdr), 512, true, true);
+    qvirtqueue_add(src->qts, vq, req_addr + sizeof(hdr) + 512, 1,
+                   true, false);
+    qvirtqueue_kick(src->qts, vdev, vq, free_head);
+
+    status = qvirtio_wait_status_byte_no_isr(src->qts, vdev, vq,
+                                             req_addr + sizeof(hdr) + 512,
+                                             VIRTIO_MIG_TIMEOUT_US);
+    g_assert_cmpint(status, ==, VIRTIO_BLK_S_OK);
+
+    migrate(src, dst, uri);
+
+    /* The interrupt was delivered when the source stopped */
+    dst_dev = find_dev(dst, VIRTIO_BLK_SLOT);
+    g_assert(dst_dev->vdev.bus->get_queue_isr_status(&dst_dev->vdev, vq));
+
+    qvirtio_pci_device_disable(dst_dev);
+    g_free(dst_dev);
+    qvirtio_pci_device_disable(src_dev);
+    g_free(src_dev);
+    qtest_shutdown(src);
+    qtest_shutdown(dst);
+    g_free(incoming);
+    g_free(uri);
+}
+
+static void test_report_requeue(void)
+{
+    char *uri = g_strdup_printf("unix:%s", mig_socket);
+    char *incoming = g_strdup_printf("-incoming %s", uri);
+    QOSState *src, *dst;
+    QVirtioPCIDevice *src_dev, *dst_dev;
+    QVirtioDevice *vdev;
+    QVirtQueue *vq;
+    uint64_t features, report_addr;
+    uint32_t free_head, len;
+
+    src = boot_balloon("");
+    dst = boot_balloon(incoming);
+
+    src_dev = find_dev(src, VIRTIO_BALLOON_SLOT);
+    vdev = &src_dev->vdev;
+    qvirtio_start_device(vdev);
+    features = qvirtio_get_features(vdev) &
+               ~(QVIRTIO_F_BAD_FEATURE |
+                 (1u << VIRTIO_RING_F_INDIRECT_DESC) |
+                 (1u << VIRTIO_RING_F_EVENT_IDX) |
+                 (1u << VIRTIO_BALLOON_F_FREE_PAGE_HINT));
+    g_assert(features & (1u << VIRTIO_BALLOON_F_REPORTING));
+    qvirtio_set_features(vdev, features);
+    vq = qvirtqueue_setup(vdev, &src->alloc, REPORTING_VQ);
+    qvirtio_set_driver_ok(vdev);
+
+    /* Report free memory and migrate while the iothread discards it */
+    report_addr = guest_alloc(&src->alloc, REPORT_SIZE);
+    free_head = qvirtqueue_add(src->qts, vq, report_addr, REPORT_SIZE,
+                               true, false);
+    qvirtqueue_kick(src->qts, vdev, vq, free_head);
+
+    migrate(src, dst, uri);
+
+    /* The report was answered on the source or handled once more here */
+    dst_dev = find_dev(dst, VIRTIO_BALLOON_SLOT);
+    qvirtio_wait_used_elem(dst->qts, &dst_dev->vdev, vq, free_head, &len,
+                           VIRTIO_MIG_TIMEOUT_US);
+    g_assert_cmpuint(len, ==, 0);
+
+    qvirtio_pci_device_disable(dst_dev);
+    g_free(dst_dev);
+    qvirtio_pci_device_disable(src_dev);
+    g_free(src_dev);
+    qtest_shutdown(src);
+    qtest_shutdown(dst);
+    g_free(incoming);
+    g_free(uri);
+}
+
+int main(int argc, char **argv)
+{
+    int fd, ret;
+
+    g_test_init(&argc, &argv, NULL);
+
+    fd = mkstemp(mig_socket);
+    g_assert(fd != -1);
+    close(fd);
+
+    qtest_add_func("/virtio/migration/coalesced-notify",
+                   test_coalesced_notify);
+    qtest_add_func("/virtio/migration/report-requeue", test_report_requeue);
+
+    ret = g_test_run();
+    unlink(mig_socket);
+    return ret;
+}
@@ -0,0 +1,295 @@
+/*
+ * Virtqueue processing benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Guest RAM is a shared file that the test maps, so descriptors and ring
+ * indexes are written directly instead of through the qtest protocol.
+ * A batch of requests fills the whole ring, one notification starts it,
+ * and the test spins on the used index until the device has processed
+ * it, so the rate is dominated by virtqueue_pop()/virtqueue_push() and
+ * the device model rather than by qtest.
+ *
+ * The tests are only registered in perf mode (-m perf), and only on x86,
+ * where guest physical addresses are offsets into the RAM file.
+ */
+
+#include "qemu/osdep.h"
+#include "libqtest-single.h"
+#include "qemu/bswap.h"
+#include "qemu/module.h"
+#include "qemu/processor.h"
+#include "standard-headers/linux/virtio_blk.h"
+#include "standard-headers/linux/virtio_net.h"
+#include "standard-headers/linux/virtio_ring.h"
+#include "libqos/qgraph.h"
+#include "libqos/virtio-blk.h"
+#include "libqos/virtio-net.h"
+
+#define PERF_RAM_SIZE           (256 * 1024 * 1024)
+#define PERF_DURATION_US        (1000 * 1000)
+#define PERF_TIMEOUT_US         (30 * 1000 * 1000)
+#define PERF_BLK_REQUEST_SIZE   4096
+#define PERF_NET_FRAME_SIZE     64
+#define PERF_MAX_QUEUE_SIZE     1024
+
+typedef struct PerfRam {
+    char *path;
+    uint8_t *ram;
+} PerfRam;
+
+typedef struct PerfRing {
+    QVirtioDevice *dev;
+    QVirtQueue *vq;
+    struct vring_desc *desc;
+    struct vring_avail *avail;
+    struct vring_used *used;
+    uint16_t avail_idx;
+    /* Heads of the descriptor chains, which are submitted over and over */
+    uint16_t heads[PERF_MAX_QUEUE_SIZE];
+    int nr_heads;
+} PerfRing;
+
+static void *perf_ram_ptr(PerfRam *p, uint64_t gpa, size_t len)
+{
+    g_assert_cmpuint(gpa + len, <=, PERF_RAM_SIZE);
+    return p->ram + gpa;
+}
+
+static void perf_ram_map(PerfRam *p)
+{
+    int fd = open(p->path, O_RDWR);
+
+    g_assert(fd >= 0);
+    p->ram = mmap(NULL, PERF_RAM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+                  fd, 0);
+    g_assert(p->ram != MAP_FAILED);
+    close(fd);
+}
+
+static void perf_ram_cleanup(void *opaque)
+{
+    PerfRam *p = opaque;
+
+    if (p->ram) {
+        munmap(p->ram, PERF_RAM_SIZE);
+    }
+    unlink(p->path);
+    g_free(p->path);
+    g_free(p);
+}
+
+static PerfRam *perf_ram_setup(GString *cmd_line)
+{
+    PerfRam *p = g_new0(PerfRam, 1);
+    int fd;
+
+    p->path = g_strdup_printf("%s/qtest-virtio-perf-XXXXXX", g_get_tmp_dir());
+    fd = g_mkstemp(p->path);
+    g_assert(fd >= 0);
+    close(fd);
+
+    g_string_append_printf(cmd_line,
+                           " -m %d -object memory-backend-file,id=mem,"
+                           "size=%d,mem-path=%s,share=on"
+                           " -numa node,memdev=mem ",
+                           PERF_RAM_SIZE >> 20, PERF_RAM_SIZE, p->path);
+    g_test_queue_destroy(perf_ram_cleanup, p);
+    return p;
+}
+
+static void perf_ring_init(PerfRing *r, PerfRam *p, QVirtioDevice *dev,
+                           QVirtQueue *vq)
+{
+    r->dev = dev;
+    r->vq = vq;
+    r->desc = perf_ram_ptr(p, vq->desc, vq->size * sizeof(*r->desc));
+    r->avail = perf_ram_ptr(p, vq->avail,
+                            sizeof(*r->avail) + vq->size * sizeof(uint16_t));
+    r->used = perf_ram_ptr(p, vq->used, sizeof(*r->used) +
+                           vq->size * sizeof(struct vring_used_elem));
+    r->avail_idx = le16_to_cpu(r->avail->idx);
+    r->nr_heads = 0;
+
+    /* Only the used index is polled, so interrupts are not needed */
+    r->avail->flags = cpu_to_le16(VRING_AVAIL_F_NO_INTERRUPT);
+}
+
+static void perf_ring_add_chain(PerfRing *r, int first, const uint64_t *addr,
+                                const uint32_t *len, const bool *write, int n)
+{
+    int i;
+
+    g_assert_cmpint(first + n, <=, r->vq->size);
+    g_assert_cmpint(r->nr_heads, <, PERF_MAX_QUEUE_SIZE);
+    for (i = 0; i < n; i++) {
+        struct vring_desc *d = &r->desc[first + i];
+        uint16_t flags = write[i] ? VRING_DESC_F_WRITE : 0;
+
+        if (i < n - 1) {
+            flags |= VRING_DESC_F_NEXT;
+        }
+        d->addr = cpu_to_le64(addr[i]);
+        d->len = cpu_to_le32(len[i]);
+        d->flags = cpu_to_le16(flags);
+        d->next = cpu_to_le16(first + i + 1);
+    }
+    r->heads[r->nr_heads++] = first;
+}
+
+/*
+ * Submit every chain once with a single notification and wait until the
+ * device has used all of them.
+ */
+static void perf_ring_run_batch(PerfRing *r)
+{
+    uint16_t end = r->avail_idx + r->nr_heads;
+    gint64 deadline = g_get_monotonic_time() + PERF_TIMEOUT_US;
+    int i;
+
+    for (i = 0; i < r->nr_heads; i++) {
+        r->avail->ring[(r->avail_idx + i) % r->vq->size] =
+            cpu_to_le16(r->heads[i]);
+    }
+    /* Ring entries before the index, as virtqueue_pop() reads them after */
+    smp_wmb();
+    qatomic_set(&r->avail->idx, cpu_to_le16(end));
+    r->avail_idx = end;
+    /* The index must be visible before QEMU handles the notification */
+    smp_mb();
+    r->dev->bus->virtqueue_kick(r->dev, r->vq);
+
+    while (le16_to_cpu(qatomic_read(&r->used->idx)) != end) {
+        g_assert(g_get_monotonic_time() < deadline);
+        cpu_relax();
+    }
+    /* Pairs with the barrier before the used index in virtqueue_flush() */
+    smp_rmb();
+    r->vq->last_used_idx = end;
+}
+
+static void perf_ring_run(PerfRing *r, const char *what)
+{
+    gint64 start = g_get_monotonic_time(), elapsed;
+    uint64_t requests = 0;
+
+    do {
+        perf_ring_run_batch(r);
+        requests += r->nr_heads;
+        elapsed = g_get_monotonic_time() - start;
+    } while (elapsed < PERF_DURATION_US);
+
+    g_test_message("%s: %d requests per notification, %.0f requests/s, "
+                   "%.1f ns/request", what, r->nr_heads,
+                   requests * 1e6 / elapsed, elapsed * 1e3 / requests);
+}
+
+static void *virtio_blk_perf_setup(GString *cmd_line, void *arg)
+{
+    g_string_append(cmd_line,
+                    " -drive if=none,id=drive0,file=null-co://,"
+                    "file.read-zeroes=off,file.size=64M,format=raw ");
+    return perf_ram_setup(cmd_line);
+}
+
+static void virtio_blk_perf(void *obj, void *data, QGuestAllocator *alloc)
+{
+    QVirtioBlk *blk_if = obj;
+    QVirtioDevice *dev = blk_if->vdev;
+    PerfRam *p = data;
+    PerfRing r;
+    QVirtQueue *vq;
+    uint64_t features;
+    int i;
+
+    features = qvirtio_get_features(dev);
+    features &= ~(QVIRTIO_F_BAD_FEATURE |
+                  (1u << VIRTIO_RING_F_INDIRECT_DESC) |
+                  (1u << VIRTIO_RING_F_EVENT_IDX) |
+                  (1u << VIRTIO_BLK_F_SCSI));
+    qvirtio_set_features(dev, features);
+    vq = qvirtqueue_setup(dev, alloc, 0);
+    qvirtio_set_driver_ok(dev);
+
+    perf_ram_map(p);
+    perf_ring_init(&r, p, dev, vq);
+
+    /* Header, data and status of 4 KiB reads spread over the disk */
+    for (i = 0; i + 3 <= vq->size; i += 3) {
+        uint64_t req = guest_alloc(alloc, 16 + PERF_BLK_REQUEST_SIZE + 1);
+        struct virtio_blk_outhdr *hdr = perf_ram_ptr(p, req, sizeof(*hdr));
+        uint64_t addr[] = { req, req + 16, req + 16 + PERF_BLK_REQUEST_SIZE };
+        uint32_t len[] = { 16, PERF_BLK_REQUEST_SIZE, 1 };
+        bool write[] = { false, true, true };
+
+        hdr->type = cpu_to_le32(VIRTIO_BLK_T_IN);
+        hdr->ioprio = 0;
+        hdr->sector = cpu_to_le64((uint64_t)i * PERF_BLK_REQUEST_SIZE / 512);
+        perf_ring_add_chain(&r, i, addr, len, write, 3);
+    }
+
+    perf_ring_run(&r, "virtio-blk read");
+    qvirtqueue_cleanup(dev->bus, vq, alloc);
+}
+
+static void *virtio_net_perf_setup(GString *cmd_line, void *arg)
+{
+    /* A hub port with no other ports drops everything it receives */
+    g_string_append(cmd_line, " -netdev hubport,hubid=0,id=hs0 ");
+    return perf_ram_setup(cmd_line);
+}
+
+static void virtio_net_perf_tx(void *obj, void *data, QGuestAllocator *alloc)
+{
+    QVirtioNet *net_if = obj;
+    QVirtioDevice *dev = net_if->vdev;
+    QVirtQueue *vq = net_if->queues[1];
+    PerfRam *p = data;
+    PerfRing r;
+    size_t hdr_size = sizeof(struct virtio_net_hdr);
+    int i;
+
+    if (dev->features & (1ull << VIRTIO_NET_F_MRG_RXBUF)) {
+        hdr_size = sizeof(struct virtio_net_hdr_mrg_rxbuf);
+    }
+
+    perf_ram_map(p);
+    perf_ring_init(&r, p, dev, vq);
+
+    /* Header and a broadcast frame in a single descriptor */
+    for (i = 0; i < vq->size; i++) {
+        size_t size = hdr_size + PERF_NET_FRAME_SIZE;
+        uint64_t buf = guest_alloc(alloc, size);
+        uint8_t *frame = perf_ram_ptr(p, buf, size);
+        uint64_t addr[] = { buf };
+        uint32_t len[] = { size };
+        bool write[] = { false };
+
+        memset(frame, 0, hdr_size);
+        memset(frame + hdr_size, 0xff, 6);
+        memset(frame + hdr_size + 6, 0x52, PERF_NET_FRAME_SIZE - 6);
+        perf_ring_add_chain(&r, i, addr, len, write, 1);
+    }
+
+    perf_ring_run(&r, "virtio-net tx");
+}
+
+static void register_virtio_perf_test(void)
+{
+    QOSGraphTestOptions opts = { };
+    const char *arch = qtest_get_arch();
+
+    if (!g_test_perf() ||
+        (strcmp(arch, "x86_64") && strcmp(arch, "i386"))) {
+        return;
+    }
+
+    opts.before = virtio_blk_perf_setup;
+    qos_add_test("perf", "virtio-blk", virtio_blk_perf, &opts);
+
+    opts.before = virtio_net_perf_setup;
+    qos_add_test("perf-tx", "virtio-net", virtio_net_perf_tx, &opts);
+}
+
+libqos_init(register_virtio_perf_test);
@@ -58,13 +58,52 @@ static void test_1(void)
     }
 }
 
+static void test_prefix(void)
+{
+    size_t s, a, o, i;
+    size_t sizes[] = { 1, 7, 8, 63, 64, 65, 255, 1000, 4096, 4097, 20000 };
+
+    /* Leading zero runs, for every marker offset close to the ends */
+    for (a = 0; a < 16; a++) {
+        for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+            s = sizes[i];
+            g_assert_cmpuint(buffer_zero_prefix(buffer + a, s), ==, s);
+            for (o = 0; o < s; o = (o < 80 || o + 80 >= s) ? o + 1 : s - 80) {
+                buffer[a + o] = 1;
+                g_assert_cmpuint(buffer_zero_prefix(buffer + a, s), ==, o);
+                buffer[a + o] = 0;
+            }
+        }
+    }
+
+    /* Leading nonzero blocks, with the first zero block at o */
+    for (a = 0; a < 16; a++) {
+        for (o = 0; o <= 12; o++) {
+            for (i = 0; i < 12; i++) {
+                if (i != o) {
+                    buffer[a + i * 512 + (i * 37) % 100] = 1;
+                }
+            }
+            g_assert_cmpuint(buffer_nonzero_prefix(buffer + a, 12 * 512, 512),
+                             ==, MIN(o, 12) * 512);
+            /* A partial last block counts too */
+            g_assert_cmpuint(buffer_nonzero_prefix(buffer + a, 11 * 512 + 100,
+                                                   512),
+                             ==, o < 12 ? o * 512 : 11 * 512 + 100);
+            memset(buffer + a, 0, 12 * 512);
+        }
+    }
+}
+
 static void test_2(void)
 {
     if (g_test_perf()) {
         test_1();
+        test_prefix();
     } else {
         do {
             test_1();
+            test_prefix();
         } while (test_buffer_is_zero_next_accel());
     }
 }
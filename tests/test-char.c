@@ -177,6 +177,42 @@ static void char_ringbuf_test(void)
     qemu_opts_del(opts);
 }
 
+static void char_flush_delay_test(void)
+{
+    QemuOpts *opts;
+    Chardev *chr;
+    CharBackend be;
+    char *data;
+    int ret;
+
+    opts = qemu_opts_create(qemu_find_opts("chardev"), "flush-label",
+                            1, &error_abort);
+    qemu_opt_set(opts, "backend", "ringbuf", &error_abort);
+    qemu_opt_set(opts, "size", "16", &error_abort);
+    qemu_opt_set(opts, "flush-delay", "100000", &error_abort);
+    chr = qemu_chr_new_from_opts(opts, NULL, &error_abort);
+    g_assert_nonnull(chr);
+    qemu_opts_del(opts);
+
+    qemu_chr_fe_init(&be, chr, &error_abort);
+    ret = qemu_chr_fe_write(&be, (void *)"abc", 3);
+    g_assert_cmpint(ret, ==, 3);
+    ret = qemu_chr_fe_write(&be, (void *)"def", 3);
+    g_assert_cmpint(ret, ==, 3);
+
+    /* Still queued */
+    data = qmp_ringbuf_read("flush-label", 16, false, 0, &error_abort);
+    g_assert_cmpstr(data, ==, "");
+    g_free(data);
+
+    qemu_chr_flush(chr);
+    data = qmp_ringbuf_read("flush-label", 16, false, 0, &error_abort);
+    g_assert_cmpstr(data, ==, "abcdef");
+    g_free(data);
+
+    qemu_chr_fe_deinit(&be, true);
+}
+
 static void char_mux_test(void)
 {
     QemuOpts *opts;
@@ -1466,6 +1502,7 @@ int main(int argc, char **argv)
     g_test_add_func("/char/null", char_null_test);
     g_test_add_func("/char/invalid", char_invalid_test);
     g_test_add_func("/char/ringbuf", char_ringbuf_test);
+    g_test_add_func("/char/flush-delay", char_flush_delay_test);
     g_test_add_func("/char/mux", char_mux_test);
 #ifdef _WIN32
     g_test_add_func("/char/console/subprocess", char_console_test_subprocess);
@@ -378,6 +378,20 @@ static void test_hbitmap_reset(TestHBitmapData *data,
     hbitmap_test_set(data, L3 / 2, L3);
 }
 
+static void test_hbitmap_reset_leaves(TestHBitmapData *data,
+                                      const void *unused)
+{
+    /* The last level is allocated in leaves of 512 words */
+    hbitmap_test_init(data, L3 * 4, 0);
+    hbitmap_test_set(data, 0, L3 * 4);
+    hbitmap_test_reset(data, L2 + 1, L3 * 2);
+    hbitmap_test_set(data, L3, L2 * 3);
+    hbitmap_test_check_get(data);
+    hbitmap_test_reset(data, 0, L3 * 4);
+    hbitmap_test_set(data, L3 - 1, 2);
+    hbitmap_test_check_get(data);
+}
+
 static void test_hbitmap_reset_all(TestHBitmapData *data,
                                    const void *unused)
 {
@@ -1061,6 +1075,7 @@ int main(int argc, char **argv)
     hbitmap_test_add("/hbitmap/reset/empty", test_hbitmap_reset_empty);
     hbitmap_test_add("/hbitmap/reset/general", test_hbitmap_reset);
     hbitmap_test_add("/hbitmap/reset/all", test_hbitmap_reset_all);
+    hbitmap_test_add("/hbitmap/reset/leaves", test_hbitmap_reset_leaves);
     hbitmap_test_add("/hbitmap/granularity", test_hbitmap_granularity);
 
     hbitmap_test_add("/hbitmap/truncate/nop", test_hbitmap_truncate_nop);
@@ -0,0 +1,218 @@
+/*
+ * Iterative device state migration test
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * The SaveVMHandlers registered by iterative_state_register() are driven
+ * directly: each pass is written to a file, and the file is then loaded
+ * pass by pass into a second buffer.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/module.h"
+#include "migration/iterative-state.h"
+#include "migration/register.h"
+#include "migration/qemu-file-types.h"
+#include "../migration/qemu-file.h"
+#include "../migration/qemu-file-channel.h"
+#include "io/channel-file.h"
+
+#define STATE_SIZE      10000
+#define CHUNK_SIZE      1024
+#define NB_CHUNKS       DIV_ROUND_UP(STATE_SIZE, CHUNK_SIZE)
+
+static int temp_fd;
+
+static const SaveVMHandlers *handlers;
+static void *handlers_opaque;
+
+/* Stand-ins for savevm.c, which the test doesn't link */
+int register_savevm_live(const char *idstr, uint32_t instance_id,
+                         int version_id, const SaveVMHandlers *ops,
+                         void *opaque)
+{
+    handlers = ops;
+    handlers_opaque = opaque;
+    return 0;
+}
+
+void unregister_savevm(VMStateIf *obj, const char *idstr, void *opaque)
+{
+}
+
+static QEMUFile *open_test_file(bool write)
+{
+    int fd = dup(temp_fd);
+    QIOChannel *ioc;
+    QEMUFile *f;
+
+    lseek(fd, 0, SEEK_SET);
+    if (write) {
+        g_assert_cmpint(ftruncate(fd, 0), ==, 0);
+    }
+    ioc = QIO_CHANNEL(qio_channel_file_new_fd(fd));
+    if (write) {
+        f = qemu_fopen_channel_output(ioc);
+    } else {
+        f = qemu_fopen_channel_input(ioc);
+    }
+    object_unref(OBJECT(ioc));
+    return f;
+}
+
+static IterativeState *register_state(uint8_t *data, void **opaque)
+{
+    IterativeState *is;
+
+    is = iterative_state_register("test", 0, data, STATE_SIZE, CHUNK_SIZE);
+    *opaque = handlers_opaque;
+    return is;
+}
+
+static uint64_t pending(void *opaque)
+{
+    uint64_t precopy = 0, compatible = 0, postcopy = 0;
+
+    handlers->save_live_pending(NULL, opaque, 0, &precopy, &compatible,
+                                &postcopy);
+    g_assert_cmpuint(compatible, ==, 0);
+    g_assert_cmpuint(postcopy, ==, 0);
+    return precopy;
+}
+
+static void load_passes(void *opaque, int passes)
+{
+    QEMUFile *f = open_test_file(false);
+    int i;
+
+    for (i = 0; i < passes; i++) {
+        g_assert_cmpint(handlers->load_state(f, opaque, 1), ==, 0);
+    }
+    qemu_fclose(f);
+}
+
+static void test_migrate(void)
+{
+    g_autofree uint8_t *src = g_malloc(STATE_SIZE);
+    g_autofree uint8_t *dst = g_malloc0(STATE_SIZE);
+    IterativeState *src_is, *dst_is;
+    void *src_opaque, *dst_opaque;
+    QEMUFile *f;
+    int i;
+
+    for (i = 0; i < STATE_SIZE; i++) {
+        src[i] = g_test_rand_int();
+    }
+    src_is = register_state(src, &src_opaque);
+    dst_is = register_state(dst, &dst_opaque);
+
+    f = open_test_file(true);
+    g_assert_cmpint(handlers->save_setup(f, src_opaque), ==, 0);
+    g_assert_cmpuint(pending(src_opaque), ==, NB_CHUNKS * CHUNK_SIZE);
+
+    /* Without a rate limit, a single pass sends everything */
+    g_assert_cmpint(handlers->save_live_iterate(f, src_opaque), ==, 1);
+    g_assert_cmpuint(pending(src_opaque), ==, 0);
+
+    /* The device changes bytes in three chunks while the guest runs */
+    src[CHUNK_SIZE - 1] ^= 0xff;
+    src[CHUNK_SIZE] ^= 0xff;
+    iterative_state_set_dirty(src_is, CHUNK_SIZE - 1, 2);
+    src[STATE_SIZE - 1] ^= 0xff;
+    iterative_state_set_dirty(src_is, STATE_SIZE - 1, 1);
+    g_assert_cmpuint(pending(src_opaque), ==, 3 * CHUNK_SIZE);
+
+    g_assert_cmpint(handlers->save_live_complete_precopy(f, src_opaque),
+                    ==, 0);
+    g_assert_cmpuint(pending(src_opaque), ==, 0);
+    g_assert_cmpint(qemu_file_get_error(f), ==, 0);
+    qemu_fclose(f);
+
+    load_passes(dst_opaque, 3);
+    g_assert_cmpmem(dst, STATE_SIZE, src, STATE_SIZE);
+
+    iterative_state_unregister(dst_is);
+    iterative_state_unregister(src_is);
+}
+
+/* An iteration stops when the stream is over its rate limit */
+static void test_rate_limit(void)
+{
+    g_autofree uint8_t *src = g_malloc(STATE_SIZE);
+    g_autofree uint8_t *dst = g_malloc0(STATE_SIZE);
+    IterativeState *src_is, *dst_is;
+    void *src_opaque, *dst_opaque;
+    QEMUFile *f;
+    int passes = 1;
+
+    memset(src, 0x5a, STATE_SIZE);
+    src_is = register_state(src, &src_opaque);
+    dst_is = register_state(dst, &dst_opaque);
+
+    f = open_test_file(true);
+    g_assert_cmpint(handlers->save_setup(f, src_opaque), ==, 0);
+    qemu_file_set_rate_limit(f, 2 * CHUNK_SIZE);
+
+    while (handlers->save_live_iterate(f, src_opaque) == 0) {
+        g_assert_cmpuint(pending(src_opaque), <, NB_CHUNKS * CHUNK_SIZE);
+        qemu_file_reset_rate_limit(f);
+        passes++;
+    }
+    passes++;
+    g_assert_cmpint(passes, >, 2);
+    g_assert_cmpuint(pending(src_opaque), ==, 0);
+
+    g_assert_cmpint(handlers->save_live_complete_precopy(f, src_opaque),
+                    ==, 0);
+    passes++;
+    qemu_fclose(f);
+
+    load_passes(dst_opaque, passes);
+    g_assert_cmpmem(dst, STATE_SIZE, src, STATE_SIZE);
+
+    iterative_state_unregister(dst_is);
+    iterative_state_unregister(src_is);
+}
+
+/* A chunk index beyond the destination's buffer fails the load */
+static void test_bad_chunk(void)
+{
+    g_autofree uint8_t *dst = g_malloc0(STATE_SIZE);
+    IterativeState *dst_is;
+    void *dst_opaque;
+    QEMUFile *f;
+
+    dst_is = register_state(dst, &dst_opaque);
+
+    f = open_test_file(true);
+    qemu_put_be32(f, NB_CHUNKS);
+    qemu_fclose(f);
+
+    f = open_test_file(false);
+    g_assert_cmpint(handlers->load_state(f, dst_opaque, 1), ==, -EINVAL);
+    qemu_fclose(f);
+
+    iterative_state_unregister(dst_is);
+}
+
+int main(int argc, char **argv)
+{
+    char temp_file[] = "/tmp/test-iterative-state-XXXXXX";
+    int ret;
+
+    temp_fd = mkstemp(temp_file);
+    g_assert(temp_fd >= 0);
+
+    module_call_init(MODULE_INIT_QOM);
+
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/iterative-state/migrate", test_migrate);
+    g_test_add_func("/iterative-state/rate-limit", test_rate_limit);
+    g_test_add_func("/iterative-state/bad-chunk", test_bad_chunk);
+    ret = g_test_run();
+
+    close(temp_fd);
+    unlink(temp_file);
+    return ret;
+}
@@ -0,0 +1,138 @@
+/*
+ * Logarithmic histogram test
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/log-histogram.h"
+
+#define NR_VALUES 10000
+
+static LogHistogram hist;
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void test_empty(void)
+{
+    LatencyPercentiles *p;
+
+    log_histogram_init(&hist);
+    g_assert_cmpuint(log_histogram_count(&hist), ==, 0);
+    g_assert_cmpuint(log_histogram_percentile(&hist, 500), ==, 0);
+    g_assert_cmpuint(log_histogram_percentile(&hist, 1000), ==, 0);
+
+    p = log_histogram_get_percentiles(&hist);
+    g_assert_cmpuint(p->count, ==, 0);
+    g_assert_cmpuint(p->max, ==, 0);
+    qapi_free_LatencyPercentiles(p);
+}
+
+/* Values below LOG_HISTOGRAM_SUB have a bucket each */
+static void test_exact(void)
+{
+    int i;
+
+    log_histogram_init(&hist);
+    for (i = 0; i < LOG_HISTOGRAM_SUB; i++) {
+        log_histogram_add(&hist, i);
+    }
+
+    g_assert_cmpuint(log_histogram_count(&hist), ==, LOG_HISTOGRAM_SUB);
+    for (i = 1; i <= LOG_HISTOGRAM_SUB; i++) {
+        unsigned per_mille = i * 1000 / LOG_HISTOGRAM_SUB;
+
+        g_assert_cmpuint(log_histogram_percentile(&hist, per_mille), ==,
+                         i - 1);
+    }
+}
+
+/* The extremes must not overflow the bucket array */
+static void test_limits(void)
+{
+    log_histogram_init(&hist);
+    log_histogram_add(&hist, 0);
+    log_histogram_add(&hist, UINT64_MAX);
+
+    g_assert_cmpuint(log_histogram_count(&hist), ==, 2);
+    g_assert_cmpuint(stat64_get(&hist.min), ==, 0);
+    g_assert_cmpuint(stat64_get(&hist.max), ==, UINT64_MAX);
+    g_assert_cmpuint(log_histogram_percentile(&hist, 500), ==, 0);
+    g_assert_cmpuint(log_histogram_percentile(&hist, 1000), ==, UINT64_MAX);
+}
+
+static void check_random(bool single_writer)
+{
+    static const unsigned per_mille[] = { 1, 100, 500, 900, 990, 999, 1000 };
+    g_autofree uint64_t *values = g_new(uint64_t, NR_VALUES);
+    LatencyPercentiles *p;
+    uint64_t sum = 0;
+    int i;
+
+    log_histogram_init(&hist);
+    for (i = 0; i < NR_VALUES; i++) {
+        /* Spread the values over many powers of two */
+        values[i] = (uint64_t)g_test_rand_int() >> g_test_rand_int_range(0, 32);
+        sum += values[i];
+        if (single_writer) {
+            log_histogram_add_single_writer(&hist, values[i]);
+        } else {
+            log_histogram_add(&hist, values[i]);
+        }
+    }
+    qsort(values, NR_VALUES, sizeof(values[0]), cmp_u64);
+
+    g_assert_cmpuint(log_histogram_count(&hist), ==, NR_VALUES);
+    g_assert_cmpuint(stat64_get(&hist.sum), ==, sum);
+    g_assert_cmpuint(stat64_get(&hist.min), ==, values[0]);
+    g_assert_cmpuint(stat64_get(&hist.max), ==, values[NR_VALUES - 1]);
+
+    /* Never below the exact percentile, and at most 1/SUB above it */
+    for (i = 0; i < ARRAY_SIZE(per_mille); i++) {
+        uint64_t exact = values[DIV_ROUND_UP(NR_VALUES * per_mille[i],
+                                             1000) - 1];
+        uint64_t value = log_histogram_percentile(&hist, per_mille[i]);
+
+        g_assert_cmpuint(value, >=, exact);
+        g_assert_cmpuint(value, <=, exact + exact / LOG_HISTOGRAM_SUB);
+    }
+
+    p = log_histogram_get_percentiles(&hist);
+    g_assert_cmpuint(p->count, ==, NR_VALUES);
+    g_assert_cmpuint(p->min, ==, values[0]);
+    g_assert_cmpuint(p->mean, ==, sum / NR_VALUES);
+    g_assert_cmpuint(p->p50, ==, log_histogram_percentile(&hist, 500));
+    g_assert_cmpuint(p->p999, ==, log_histogram_percentile(&hist, 999));
+    g_assert_cmpuint(p->max, ==, values[NR_VALUES - 1]);
+    qapi_free_LatencyPercentiles(p);
+}
+
+static void test_random(void)
+{
+    check_random(false);
+}
+
+static void test_random_single_writer(void)
+{
+    check_random(true);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/log-histogram/empty", test_empty);
+    g_test_add_func("/log-histogram/exact", test_exact);
+    g_test_add_func("/log-histogram/limits", test_limits);
+    g_test_add_func("/log-histogram/random", test_random);
+    g_test_add_func("/log-histogram/random-single-writer",
+                    test_random_single_writer);
+
+    return g_test_run();
+}
@@ -0,0 +1,130 @@
+/*
+ * Memory preallocation tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+
+#define NR_PAGES    16
+
+static volatile sig_atomic_t sigbus_count;
+
+static void test_sigbus_handler(int sig, siginfo_t *siginfo, void *ctx)
+{
+    sigbus_count++;
+}
+
+static void install_test_handler(struct sigaction *oldact)
+{
+    struct sigaction act;
+
+    memset(&act, 0, sizeof(act));
+    act.sa_sigaction = test_sigbus_handler;
+    act.sa_flags = SA_SIGINFO;
+    g_assert_cmpint(sigaction(SIGBUS, &act, oldact), ==, 0);
+}
+
+static void check_test_handler(void)
+{
+    struct sigaction act;
+
+    g_assert_cmpint(sigaction(SIGBUS, NULL, &act), ==, 0);
+    g_assert(act.sa_flags & SA_SIGINFO);
+    g_assert(act.sa_sigaction == test_sigbus_handler);
+}
+
+static void test_prealloc_anon(void)
+{
+    size_t size = NR_PAGES * qemu_real_host_page_size;
+    char *area;
+    size_t i;
+
+    area = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    g_assert(area != MAP_FAILED);
+
+    os_mem_prealloc(-1, area, size, 4, &error_abort);
+    for (i = 0; i < size; i++) {
+        g_assert_cmpint(area[i], ==, 0);
+    }
+
+    munmap(area, size);
+}
+
+/* Pages past the end of a file raise SIGBUS when they are touched */
+static void test_prealloc_sigbus(void)
+{
+    size_t size = NR_PAGES * qemu_real_host_page_size;
+    struct sigaction oldact;
+    Error *local_err = NULL;
+    char *path, *area;
+    int fd;
+
+    fd = g_file_open_tmp("test-mem-prealloc-XXXXXX", &path, NULL);
+    g_assert_cmpint(fd, >=, 0);
+    g_assert_cmpint(ftruncate(fd, size / 2), ==, 0);
+    area = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    g_assert(area != MAP_FAILED);
+
+    install_test_handler(&oldact);
+    sigbus_count = 0;
+
+    os_mem_prealloc(fd, area, size, 2, &local_err);
+    g_assert(local_err);
+    error_free(local_err);
+
+    /* The fault was handled by the preallocation, not passed on */
+    g_assert_cmpint(sigbus_count, ==, 0);
+    check_test_handler();
+
+    sigaction(SIGBUS, &oldact, NULL);
+    munmap(area, size);
+    close(fd);
+    unlink(path);
+    g_free(path);
+}
+
+/*
+ * While a preallocation runs in the background, SIGBUS from other threads
+ * goes to the handler that was installed before.
+ */
+static void test_prealloc_sigbus_forward(void)
+{
+    size_t size = NR_PAGES * qemu_real_host_page_size;
+    struct sigaction oldact;
+    char *area;
+
+    area = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    g_assert(area != MAP_FAILED);
+
+    install_test_handler(&oldact);
+    sigbus_count = 0;
+
+    os_mem_prealloc_begin_async(&error_abort);
+    os_mem_prealloc_nodes(-1, area, size, 2, NULL, 0, &error_abort);
+    raise(SIGBUS);
+    g_assert_cmpint(sigbus_count, ==, 1);
+    os_mem_prealloc_wait(&error_abort);
+
+    check_test_handler();
+    raise(SIGBUS);
+    g_assert_cmpint(sigbus_count, ==, 2);
+
+    sigaction(SIGBUS, &oldact, NULL);
+    munmap(area, size);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/mem-prealloc/anon", test_prealloc_anon);
+    g_test_add_func("/mem-prealloc/sigbus", test_prealloc_sigbus);
+    g_test_add_func("/mem-prealloc/sigbus-forward",
+                    test_prealloc_sigbus_forward);
+
+    return g_test_run();
+}
@@ -7,6 +7,8 @@
 #include "qemu/osdep.h"
 
 #define TEST_QHT_STRING "tests/qht-bench 1>/dev/null 2>&1 -R -S0.1 -D10000 -N1 "
+#define TEST_QHT_WARMUP_STRING \
+    "tests/qht-bench 1>/dev/null 2>&1 -R -I -k 0 -s 1 "
 
 static void test_qht(int n_threads, int update_rate, int duration)
 {
@@ -20,6 +22,19 @@ static void test_qht(int n_threads, int update_rate, int duration)
     g_assert_cmpint(rc, ==, 0);
 }
 
+/* start from a tiny table, so that insertions race with many auto-resizes */
+static void test_qht_warmup(int n_threads, int duration)
+{
+    char *str;
+    int rc;
+
+    str = g_strdup_printf(TEST_QHT_WARMUP_STRING "-r 65536 -n %d -u 50 -d %d",
+                          n_threads, duration);
+    rc = system(str);
+    g_free(str);
+    g_assert_cmpint(rc, ==, 0);
+}
+
 static void test_2th0u1s(void)
 {
     test_qht(2, 0, 1);
@@ -40,6 +55,11 @@ static void test_2th20u5s(void)
     test_qht(2, 20, 5);
 }
 
+static void test_4thwarmup1s(void)
+{
+    test_qht_warmup(4, 1);
+}
+
 int main(int argc, char *argv[])
 {
     g_test_init(&argc, &argv, NULL);
@@ -51,5 +71,6 @@ int main(int argc, char *argv[])
         g_test_add_func("/qht/parallel/2threads-0%updates-5s", test_2th0u5s);
         g_test_add_func("/qht/parallel/2threads-20%updates-5s", test_2th20u5s);
     }
+    g_test_add_func("/qht/parallel/4threads-warmup-1s", test_4thwarmup1s);
     return g_test_run();
 }
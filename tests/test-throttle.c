@@ -671,6 +671,37 @@ static void test_accounting(void)
                                 (64.0 / 13)));
 }
 
+static void test_accounting_units(void)
+{
+    ThrottleConfig cfg;
+
+    throttle_config_init(&cfg);
+    cfg.buckets[THROTTLE_BPS_TOTAL].avg = 150;
+    cfg.buckets[THROTTLE_OPS_TOTAL].avg = 150;
+    cfg.op_size = 13 * 512;
+
+    throttle_init(&ts);
+    throttle_timers_init(tt, ctx, QEMU_CLOCK_VIRTUAL,
+                         read_timer_cb, write_timer_cb, &ts);
+    throttle_config(&ts, QEMU_CLOCK_VIRTUAL, &cfg);
+
+    /* small requests count as one operation, jumbo ones are fragmented */
+    g_assert(double_cmp(throttle_units(&ts, 512), 1));
+    g_assert(double_cmp(throttle_units(&ts, 64 * 512), 64.0 / 13));
+
+    /* accounting several requests at once */
+    throttle_account_units(&ts, false, 3, 3 * 512);
+    throttle_account_units(&ts, true, 2.5, 1024);
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_BPS_TOTAL].level, 5 * 512));
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_BPS_READ].level, 3 * 512));
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_BPS_WRITE].level, 1024));
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_OPS_TOTAL].level, 5.5));
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_OPS_READ].level, 3));
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_OPS_WRITE].level, 2.5));
+
+    throttle_timers_destroy(tt);
+}
+
 static void test_groups(void)
 {
     ThrottleConfig cfg1, cfg2;
@@ -764,6 +795,7 @@ int main(int argc, char **argv)
                     test_iops_size_is_missing_limit);
     g_test_add_func("/throttle/config_functions",   test_config_functions);
     g_test_add_func("/throttle/accounting",         test_accounting);
+    g_test_add_func("/throttle/accounting_units",   test_accounting_units);
     g_test_add_func("/throttle/groups",             test_groups);
     return g_test_run();
 }
@@ -174,6 +174,48 @@ static void test_encode_decode(void)
     }
 }
 
+static void test_encode_decode_accel(void)
+{
+    uint8_t *buffer = g_malloc(PAGE_SIZE);
+    uint8_t *test = g_malloc(PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    int i, j, pos, len, dlen;
+
+    /* go through every encoder the host supports */
+    do {
+        for (i = 0; i < 1000; i++) {
+            for (j = 0; j < PAGE_SIZE; j++) {
+                buffer[j] = g_test_rand_int_range(0, 2) ?
+                            g_test_rand_int_range(0, 256) : 0;
+            }
+            memcpy(test, buffer, PAGE_SIZE);
+            for (j = g_test_rand_int_range(0, 64); j > 0; j--) {
+                pos = g_test_rand_int_range(0, PAGE_SIZE);
+                len = MIN(g_test_rand_int_range(0, 40), PAGE_SIZE - pos);
+                while (len--) {
+                    test[pos + len] = g_test_rand_int_range(0, 256);
+                }
+            }
+
+            dlen = xbzrle_encode_buffer(buffer, test, PAGE_SIZE, compressed,
+                                        PAGE_SIZE);
+            if (dlen < 0) {
+                /* overflow */
+                continue;
+            }
+            if (dlen) {
+                g_assert(xbzrle_decode_buffer(compressed, dlen, buffer,
+                                              PAGE_SIZE) <= PAGE_SIZE);
+            }
+            g_assert(memcmp(test, buffer, PAGE_SIZE) == 0);
+        }
+    } while (test_xbzrle_encode_next_accel());
+
+    g_free(buffer);
+    g_free(test);
+    g_free(compressed);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -186,6 +228,8 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    /* goes through the encoders, so this one must be last */
+    g_test_add_func("/xbzrle/encode_decode_accel", test_encode_decode_accel);
 
     return g_test_run();
 }
@@ -0,0 +1,268 @@
+/*
+ * eBPF RSS program for the tap steering hook
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * The program is attached to a multiqueue tap device with
+ * TUNSETSTEERINGEBPF and returns, for each packet sent to the guest, the
+ * index of the tap queue (and thus of the virtio-net receive queue) that
+ * gets it.  It implements the virtio RSS algorithm with the configuration
+ * that virtio-net stores in the three maps below: the Toeplitz hash of the
+ * addresses and ports selected by the hash types indexes the indirection
+ * table.  IPv6 extension header hashing (the _EX hash types) and hash
+ * reporting are left to QEMU, which does not load the program for them.
+ *
+ * It is built with clang as part of QEMU, see ebpf/meson.build.
+ */
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <linux/bpf.h>
+#include <linux/in.h>
+#include <linux/in6.h>
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/tcp.h>
+#include <linux/udp.h>
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_endian.h>
+
+#define INDIRECTION_TABLE_SIZE  128
+#define HASH_INPUT_SIZE         36  /* Two IPv6 addresses and two ports */
+#define MAX_IPV6_EXT_HEADERS    8
+
+/* From the virtio specification */
+#define VIRTIO_NET_RSS_HASH_TYPE_IPv4   (1 << 0)
+#define VIRTIO_NET_RSS_HASH_TYPE_TCPv4  (1 << 1)
+#define VIRTIO_NET_RSS_HASH_TYPE_UDPv4  (1 << 2)
+#define VIRTIO_NET_RSS_HASH_TYPE_IPv6   (1 << 3)
+#define VIRTIO_NET_RSS_HASH_TYPE_TCPv6  (1 << 4)
+#define VIRTIO_NET_RSS_HASH_TYPE_UDPv6  (1 << 5)
+
+/* Must match EBPFRSSConfig in ebpf/ebpf_rss.h */
+struct rss_config_t {
+    __u8 redirect;
+    __u8 populate_hash;
+    __u32 hash_types;
+    __u16 indirections_len;
+    __u16 default_queue;
+} __attribute__((packed));
+
+/* Must match EBPFRSSToeplitzKey in ebpf/ebpf_rss.h */
+struct toeplitz_key_data_t {
+    __u32 leftmost_32_bits;
+    __u8 next_byte[HASH_INPUT_SIZE];
+};
+
+struct bpf_map_def SEC("maps") tap_rss_map_configurations = {
+    .type        = BPF_MAP_TYPE_ARRAY,
+    .key_size    = sizeof(__u32),
+    .value_size  = sizeof(struct rss_config_t),
+    .max_entries = 1,
+};
+
+struct bpf_map_def SEC("maps") tap_rss_map_toeplitz_key = {
+    .type        = BPF_MAP_TYPE_ARRAY,
+    .key_size    = sizeof(__u32),
+    .value_size  = sizeof(struct toeplitz_key_data_t),
+    .max_entries = 1,
+};
+
+struct bpf_map_def SEC("maps") tap_rss_map_indirection_table = {
+    .type        = BPF_MAP_TYPE_ARRAY,
+    .key_size    = sizeof(__u32),
+    .value_size  = sizeof(__u16),
+    .max_entries = INDIRECTION_TABLE_SIZE,
+};
+
+/*
+ * Toeplitz hash of the input.  The whole buffer is hashed, which gives the
+ * same result as hashing only the bytes in use because the unused tail is
+ * zero and zero input bits do not change the hash.
+ */
+static __always_inline __u32
+toeplitz_hash(const __u8 *input, const struct toeplitz_key_data_t *key)
+{
+    __u32 accumulator = 0;
+    __u32 leftmost_32_bits = key->leftmost_32_bits;
+    int byte, bit;
+
+#pragma unroll
+    for (byte = 0; byte < HASH_INPUT_SIZE; byte++) {
+        __u8 input_byte = input[byte];
+        __u8 key_byte = key->next_byte[byte];
+
+#pragma unroll
+        for (bit = 0; bit < 8; bit++) {
+            if (input_byte & 0x80) {
+                accumulator ^= leftmost_32_bits;
+            }
+            leftmost_32_bits = (leftmost_32_bits << 1) | (key_byte >> 7);
+            input_byte <<= 1;
+            key_byte <<= 1;
+        }
+    }
+    return accumulator;
+}
+
+/*
+ * Skip the IPv6 extension headers to find the transport header.  Returns
+ * false if the packet is a fragment or the transport header is not found,
+ * in which case only the addresses can be hashed.
+ */
+static __always_inline bool ipv6_find_l4(struct __sk_buff *skb,
+                                         __u8 *l4_protocol, __u32 *l4_offset)
+{
+    __u8 ext[2];
+    int i;
+
+#pragma unroll
+    for (i = 0; i < MAX_IPV6_EXT_HEADERS; i++) {
+        switch (*l4_protocol) {
+        case IPPROTO_TCP:
+        case IPPROTO_UDP:
+            return true;
+        case IPPROTO_HOPOPTS:
+        case IPPROTO_ROUTING:
+        case IPPROTO_DSTOPTS:
+        case IPPROTO_AH:
+        case IPPROTO_FRAGMENT:
+            break;
+        default:
+            return false;
+        }
+        if (bpf_skb_load_bytes_relative(skb, *l4_offset, ext, sizeof(ext),
+                                        BPF_HDR_START_NET)) {
+            return false;
+        }
+        if (*l4_protocol == IPPROTO_FRAGMENT) {
+            __be16 frag_off;
+
+            if (bpf_skb_load_bytes_relative(skb, *l4_offset + 2, &frag_off,
+                                            sizeof(frag_off),
+                                            BPF_HDR_START_NET)) {
+                return false;
+            }
+            /* Fragment offset or More Fragments set */
+            if (bpf_ntohs(frag_off) & 0xfff9) {
+                return false;
+            }
+            *l4_offset += 8;
+        } else if (*l4_protocol == IPPROTO_AH) {
+            *l4_offset += (ext[1] + 2) * 4;
+        } else {
+            *l4_offset += (ext[1] + 1) * 8;
+        }
+        *l4_protocol = ext[0];
+    }
+    return false;
+}
+
+/* Read the source and destination ports into @ports. */
+static __always_inline bool load_ports(struct __sk_buff *skb, __u8 l4_protocol,
+                                       __u32 l4_offset, __u32 hash_types,
+                                       __u32 tcp_type, __u32 udp_type,
+                                       __u8 *ports)
+{
+    if (l4_protocol == IPPROTO_TCP && (hash_types & tcp_type)) {
+        return !bpf_skb_load_bytes_relative(skb, l4_offset +
+                                            offsetof(struct tcphdr, source),
+                                            ports, 4, BPF_HDR_START_NET);
+    }
+    if (l4_protocol == IPPROTO_UDP && (hash_types & udp_type)) {
+        return !bpf_skb_load_bytes_relative(skb, l4_offset +
+                                            offsetof(struct udphdr, source),
+                                            ports, 4, BPF_HDR_START_NET);
+    }
+    return false;
+}
+
+/*
+ * Fill @input with the fields selected by the hash types.  The layout is
+ * the one of the virtio specification: source address, destination
+ * address, source port, destination port, all in network byte order.
+ */
+static __always_inline bool build_hash_input(struct __sk_buff *skb,
+                                             const struct rss_config_t *config,
+                                             __u8 *input)
+{
+    __u16 l3_protocol = bpf_ntohs(skb->protocol);
+    __u32 hash_types = config->hash_types;
+
+    if (l3_protocol == ETH_P_IP) {
+        struct iphdr ip;
+        bool fragment;
+
+        if (bpf_skb_load_bytes_relative(skb, 0, &ip, sizeof(ip),
+                                        BPF_HDR_START_NET)) {
+            return false;
+        }
+        __builtin_memcpy(&input[0], &ip.saddr, 4);
+        __builtin_memcpy(&input[4], &ip.daddr, 4);
+
+        fragment = bpf_ntohs(ip.frag_off) & 0x3fff;
+        if (!fragment &&
+            load_ports(skb, ip.protocol, ip.ihl * 4, hash_types,
+                       VIRTIO_NET_RSS_HASH_TYPE_TCPv4,
+                       VIRTIO_NET_RSS_HASH_TYPE_UDPv4, &input[8])) {
+            return true;
+        }
+        __builtin_memset(&input[8], 0, 4);
+        return hash_types & VIRTIO_NET_RSS_HASH_TYPE_IPv4;
+    }
+
+    if (l3_protocol == ETH_P_IPV6) {
+        struct ipv6hdr ip6;
+        __u32 l4_offset = sizeof(ip6);
+        __u8 l4_protocol;
+
+        if (bpf_skb_load_bytes_relative(skb, 0, &ip6, sizeof(ip6),
+                                        BPF_HDR_START_NET)) {
+            return false;
+        }
+        __builtin_memcpy(&input[0], &ip6.saddr, 16);
+        __builtin_memcpy(&input[16], &ip6.daddr, 16);
+
+        l4_protocol = ip6.nexthdr;
+        if (ipv6_find_l4(skb, &l4_protocol, &l4_offset) &&
+            load_ports(skb, l4_protocol, l4_offset, hash_types,
+                       VIRTIO_NET_RSS_HASH_TYPE_TCPv6,
+                       VIRTIO_NET_RSS_HASH_TYPE_UDPv6, &input[32])) {
+            return true;
+        }
+        __builtin_memset(&input[32], 0, 4);
+        return hash_types & VIRTIO_NET_RSS_HASH_TYPE_IPv6;
+    }
+
+    return false;
+}
+
+SEC("tun_rss_steering")
+int tun_rss_steering_prog(struct __sk_buff *skb)
+{
+    struct rss_config_t *config;
+    struct toeplitz_key_data_t *key;
+    __u8 input[HASH_INPUT_SIZE] = {};
+    __u32 zero = 0;
+    __u32 index;
+    __u16 *queue;
+
+    config = bpf_map_lookup_elem(&tap_rss_map_configurations, &zero);
+    key = bpf_map_lookup_elem(&tap_rss_map_toeplitz_key, &zero);
+    if (!config || !key) {
+        return 0;
+    }
+
+    if (!config->redirect || !build_hash_input(skb, config, input)) {
+        return config->default_queue;
+    }
+
+    /* The indirection table length is a power of two */
+    index = toeplitz_hash(input, key) & (config->indirections_len - 1);
+    queue = bpf_map_lookup_elem(&tap_rss_map_indirection_table, &index);
+    return queue ? *queue : config->default_queue;
+}
+
+char _license[] SEC("license") = "GPL v2";
@@ -14,6 +14,9 @@
 #ifdef CONFIG_TRACE_SIMPLE
 #include "trace/simple.h"
 #endif
+#ifdef CONFIG_TRACE_RING
+#include "trace/ring.h"
+#endif
 #ifdef CONFIG_TRACE_FTRACE
 #include "trace/ftrace.h"
 #endif
@@ -57,6 +60,18 @@ QemuOptsList qemu_trace_opts = {
             .name = "file",
             .type = QEMU_OPT_STRING,
         },
+#ifdef CONFIG_TRACE_RING
+        {
+            .name = "ring-size",
+            .type = QEMU_OPT_SIZE,
+        },{
+            .name = "flight-recorder",
+            .type = QEMU_OPT_BOOL,
+        },{
+            .name = "ring-file",
+            .type = QEMU_OPT_STRING,
+        },
+#endif
         { /* end of list */ }
     },
 };
@@ -231,6 +246,11 @@ void trace_init_file(void)
     if (init_trace_on_startup) {
         st_set_trace_file_enabled(true);
     }
+#elif defined CONFIG_TRACE_RING
+    ring_trace_set_file(file);
+    if (init_trace_on_startup) {
+        ring_trace_set_file_enabled(true);
+    }
 #elif defined CONFIG_TRACE_LOG
     /*
      * If both the simple and the log backends are enabled, "--trace file"
@@ -277,6 +297,13 @@ bool trace_init_backends(void)
     }
 #endif
 
+#ifdef CONFIG_TRACE_RING
+    if (!ring_trace_init()) {
+        fprintf(stderr, "failed to initialize ring tracing backend.\n");
+        return false;
+    }
+#endif
+
 #ifdef CONFIG_TRACE_FTRACE
     if (!ftrace_init()) {
         fprintf(stderr, "failed to initialize ftrace backend.\n");
@@ -302,6 +329,11 @@ void trace_opt_parse(const char *optarg)
         trace_enable_events(qemu_opt_get(opts, "enable"));
     }
     trace_init_events(qemu_opt_get(opts, "events"));
+#ifdef CONFIG_TRACE_RING
+    ring_trace_opts(qemu_opt_get_size(opts, "ring-size", 0),
+                    qemu_opt_get_bool(opts, "flight-recorder", false),
+                    qemu_opt_get(opts, "ring-file"));
+#endif
     init_trace_on_startup = true;
     qemu_opts_del(opts);
 }
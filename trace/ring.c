@@ -0,0 +1,686 @@
+/*
+ * Per-thread ring buffer trace backend
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <pthread.h>
+#include <sys/mman.h>
+#include "qemu/atomic.h"
+#include "qemu/timer.h"
+#include "trace/control.h"
+#include "trace/ring.h"
+#include "qemu/error-report.h"
+#include "qemu/qemu-print.h"
+
+/*
+ * The trace file uses the same format as the simple backend, so
+ * scripts/simpletrace.py can read it.
+ */
+#define HEADER_EVENT_ID (~(uint64_t)0)
+#define HEADER_MAGIC 0xf2b177cb0aa429b4ULL
+#define HEADER_VERSION 4
+#define DROPPED_EVENT_ID (~(uint64_t)0 - 1)
+#define TRACE_RECORD_TYPE_MAPPING 0
+#define TRACE_RECORD_TYPE_EVENT   1
+
+#define TRACE_RING_SUBBUF_SIZE   (16 * KiB)
+#define TRACE_RING_MIN_SIZE      (4 * TRACE_RING_SUBBUF_SIZE)
+#define TRACE_RING_DEFAULT_SIZE  (1 * MiB)
+#define TRACE_RING_MAX           256
+
+/* How often the writeout thread looks at the rings in streaming mode */
+#define TRACE_RING_WRITEOUT_US   (100 * 1000)
+
+typedef struct {
+    uint64_t event;
+    uint64_t timestamp_ns;
+    uint32_t length;            /* in bytes, without padding */
+    uint32_t pid;
+    uint64_t arguments[];
+} TraceRingEvent;
+
+QEMU_BUILD_BUG_ON(sizeof(TraceRingHeader) > TRACE_RING_HEADER_SIZE);
+
+static TraceRingFileHeader *ring_map;
+static size_t ring_map_size;
+static uint64_t ring_size = TRACE_RING_DEFAULT_SIZE;
+static bool ring_flight_recorder;
+static char *ring_file_name;
+static uint32_t trace_pid;
+static bool ring_enabled;       /* events are being recorded */
+static unsigned ring_lost;      /* events lost because no ring was free */
+
+static pthread_key_t ring_key;
+static __thread TraceRingHeader *ring_hdr;
+static __thread bool ring_busy;
+
+/* Everything below is only used outside of the recording path */
+static GMutex ring_lock;
+static GCond ring_cond;
+static GCond ring_flushed_cond;
+static bool ring_kicked;
+static bool ring_flush_requested;
+static uint64_t ring_flushes;
+static FILE *trace_fp;
+static char *trace_file_name;
+static uint64_t ring_dropped_reported;
+
+static TraceRingHeader *ring_get(uint32_t i)
+{
+    return (TraceRingHeader *)((uint8_t *)ring_map + ring_map->rings_offset +
+                               i * ring_map->ring_stride);
+}
+
+static uint8_t *ring_data(TraceRingHeader *hdr)
+{
+    return (uint8_t *)hdr + TRACE_RING_HEADER_SIZE;
+}
+
+static TraceRingSubbuf *ring_subbuf(TraceRingHeader *hdr, uint64_t pos)
+{
+    return (TraceRingSubbuf *)(ring_data(hdr) +
+                               (QEMU_ALIGN_DOWN(pos, TRACE_RING_SUBBUF_SIZE) &
+                                (ring_size - 1)));
+}
+
+static void ring_release(void *opaque)
+{
+    TraceRingHeader *hdr = opaque;
+
+    ring_hdr = NULL;
+    qatomic_store_release(&hdr->tid, 0);
+}
+
+/*
+ * Hand the calling thread a ring, preferring one that was given back by
+ * a thread that exited.  Its old contents stay readable until they are
+ * overwritten.
+ */
+static TraceRingHeader *ring_claim(void)
+{
+    uint32_t tid = qemu_get_thread_id();
+    TraceRingHeader *hdr;
+    uint32_t i, n;
+
+    for (;;) {
+        n = qatomic_read(&ring_map->nr_rings);
+        for (i = 0; i < n; i++) {
+            hdr = ring_get(i);
+            if (!qatomic_read(&hdr->tid) &&
+                qatomic_cmpxchg(&hdr->tid, 0, tid) == 0) {
+                goto found;
+            }
+        }
+        if (n >= ring_map->max_rings) {
+            return NULL;
+        }
+        if (qatomic_cmpxchg(&ring_map->nr_rings, n, n + 1) != n) {
+            continue;
+        }
+        /* Somebody may have grabbed it in the scan above */
+        hdr = ring_get(n);
+        if (qatomic_cmpxchg(&hdr->tid, 0, tid) == 0) {
+            goto found;
+        }
+    }
+
+found:
+    pthread_setspecific(ring_key, hdr);
+    ring_hdr = hdr;
+    return hdr;
+}
+
+static void ring_kick(void)
+{
+    if (!qatomic_xchg(&ring_kicked, true)) {
+        g_cond_signal(&ring_cond);
+    }
+}
+
+/* Start filling the sub-buffer at @pos, return false if it isn't free */
+static bool ring_subbuf_begin(TraceRingHeader *hdr, uint64_t pos)
+{
+    TraceRingSubbuf *sub = ring_subbuf(hdr, pos);
+    uint64_t tail;
+
+    if (!ring_flight_recorder) {
+        tail = qatomic_read__nocheck(&hdr->tail);
+        smp_rmb(); /* pairs with smp_mb() in ring_writeout() */
+        if (pos - tail >= ring_size / 2) {
+            ring_kick();
+        }
+        if (pos + TRACE_RING_SUBBUF_SIZE - tail > ring_size) {
+            return false;
+        }
+    }
+
+    /*
+     * Readers check lap before and after copying a sub-buffer, so they
+     * either see the new lap or never pick up a stale used.
+     */
+    qatomic_set(&sub->used, 0);
+    smp_wmb(); /* write used before lap */
+    qatomic_set__nocheck(&sub->lap, pos / TRACE_RING_SUBBUF_SIZE + 1);
+    smp_wmb(); /* write lap before the new contents */
+    qatomic_set(&sub->used, sizeof(TraceRingSubbuf));
+    return true;
+}
+
+int ring_trace_record_start(TraceRingRecord *rec, uint32_t event,
+                            size_t datasize)
+{
+    TraceRingHeader *hdr = ring_hdr;
+    uint32_t rec_len = sizeof(TraceRingEvent) + datasize;
+    uint64_t len = ROUND_UP(rec_len, 8);
+    TraceRingEvent *ev;
+    uint64_t head;
+
+    if (!qatomic_read(&ring_enabled)) {
+        return -EAGAIN;
+    }
+    if (unlikely(!hdr)) {
+        hdr = ring_claim();
+        if (!hdr) {
+            qatomic_inc(&ring_lost);
+            return -ENOSPC;
+        }
+    }
+
+    /*
+     * The ring has a single writer.  A signal handler that interrupts
+     * a record on the same thread has to drop its own event.
+     */
+    if (ring_busy || len > TRACE_RING_SUBBUF_SIZE - sizeof(TraceRingSubbuf)) {
+        goto drop;
+    }
+    ring_busy = true;
+    signal_barrier();
+
+    head = qatomic_read__nocheck(&hdr->head);
+    if (!(head % TRACE_RING_SUBBUF_SIZE) ||
+        head % TRACE_RING_SUBBUF_SIZE + len > TRACE_RING_SUBBUF_SIZE) {
+        /* Leave the rest of this sub-buffer empty */
+        head = ROUND_UP(head, TRACE_RING_SUBBUF_SIZE);
+        if (!ring_subbuf_begin(hdr, head)) {
+            signal_barrier();
+            ring_busy = false;
+            goto drop;
+        }
+        head += sizeof(TraceRingSubbuf);
+    }
+
+    rec->subbuf = ring_subbuf(hdr, head);
+    rec->end = head + len;
+    ev = (TraceRingEvent *)(ring_data(hdr) + (head & (ring_size - 1)));
+    ev->event = event;
+    ev->timestamp_ns = get_clock();
+    ev->length = rec_len;
+    ev->pid = trace_pid;
+    rec->ptr = (uint8_t *)ev->arguments;
+    return 0;
+
+drop:
+    qatomic_set__nocheck(&hdr->dropped, hdr->dropped + 1);
+    return -ENOSPC;
+}
+
+void ring_trace_record_finish(TraceRingRecord *rec)
+{
+    TraceRingHeader *hdr = ring_hdr;
+
+    smp_wmb(); /* write the record before used */
+    qatomic_set(&rec->subbuf->used,
+                ((rec->end - 1) & (TRACE_RING_SUBBUF_SIZE - 1)) + 1);
+    smp_wmb(); /* write used before head */
+    qatomic_set__nocheck(&hdr->head, rec->end);
+
+    signal_barrier();
+    ring_busy = false;
+}
+
+/*
+ * Copy the complete records of @hdr from stream position @from on to
+ * the end of @out.  Sub-buffers that the writer overwrites meanwhile
+ * are skipped.  Return where the next read should start.
+ */
+static uint64_t ring_snapshot(TraceRingHeader *hdr, uint64_t from,
+                              GByteArray *out)
+{
+    uint64_t head = qatomic_read__nocheck(&hdr->head);
+    uint64_t pos, lap, last = from;
+    TraceRingSubbuf *sub;
+    uint32_t used, begin;
+    guint len;
+
+    smp_rmb(); /* read head before the sub-buffers */
+    if (head > ring_size && from < head - ring_size) {
+        from = head - ring_size;
+    }
+
+    for (pos = QEMU_ALIGN_DOWN(from, TRACE_RING_SUBBUF_SIZE); pos < head;
+         pos += TRACE_RING_SUBBUF_SIZE) {
+        sub = ring_subbuf(hdr, pos);
+        lap = qatomic_read__nocheck(&sub->lap);
+        if (lap != pos / TRACE_RING_SUBBUF_SIZE + 1) {
+            continue;
+        }
+        smp_rmb(); /* read lap before used */
+        used = qatomic_read(&sub->used);
+        smp_rmb(); /* read used before the contents */
+
+        begin = sizeof(TraceRingSubbuf);
+        if (from > pos + begin) {
+            begin = from - pos;
+        }
+        if (used <= begin || used > TRACE_RING_SUBBUF_SIZE) {
+            continue;
+        }
+
+        len = out->len;
+        g_byte_array_append(out, (uint8_t *)sub + begin, used - begin);
+        smp_rmb(); /* read the contents before checking lap again */
+        if (qatomic_read__nocheck(&sub->lap) != lap) {
+            g_byte_array_set_size(out, len);
+            continue;
+        }
+        last = pos + used;
+    }
+    return last;
+}
+
+static TraceRingEvent *ring_snapshot_next(GByteArray *snap, size_t *off)
+{
+    TraceRingEvent *ev;
+
+    if (*off + sizeof(TraceRingEvent) > snap->len) {
+        return NULL;
+    }
+    ev = (TraceRingEvent *)(snap->data + *off);
+    if (ev->length < sizeof(TraceRingEvent) ||
+        *off + ev->length > snap->len) {
+        return NULL;
+    }
+    return ev;
+}
+
+static void ring_write_header(void)
+{
+    static const uint64_t header[] = {
+        HEADER_EVENT_ID, HEADER_MAGIC, HEADER_VERSION,
+    };
+    uint64_t type = TRACE_RECORD_TYPE_MAPPING;
+    TraceEventIter iter;
+    TraceEvent *ev;
+    size_t unused __attribute__ ((unused));
+
+    unused = fwrite(header, sizeof(header), 1, trace_fp);
+
+    trace_event_iter_init(&iter, NULL);
+    while ((ev = trace_event_iter_next(&iter)) != NULL) {
+        uint64_t id = trace_event_get_id(ev);
+        const char *name = trace_event_get_name(ev);
+        uint32_t len = strlen(name);
+
+        unused = fwrite(&type, sizeof(type), 1, trace_fp);
+        unused = fwrite(&id, sizeof(id), 1, trace_fp);
+        unused = fwrite(&len, sizeof(len), 1, trace_fp);
+        unused = fwrite(name, len, 1, trace_fp);
+    }
+}
+
+/*
+ * Read every ring from @read_pos on and write the records to the
+ * trace file, merged by timestamp.  With a NULL trace file the records
+ * are only consumed.  Called with ring_lock held.
+ */
+static void ring_writeout(uint64_t *read_pos)
+{
+    uint32_t i, n = MIN(qatomic_read(&ring_map->nr_rings),
+                        ring_map->max_rings);
+    g_autofree GByteArray **snap = g_new0(GByteArray *, n);
+    g_autofree size_t *off = g_new0(size_t, n);
+    uint64_t type = TRACE_RECORD_TYPE_EVENT;
+    uint64_t dropped = qatomic_read(&ring_lost);
+    size_t unused __attribute__ ((unused));
+    TraceRingEvent *ev, *best;
+    uint32_t best_ring = 0;
+
+    for (i = 0; i < n; i++) {
+        TraceRingHeader *hdr = ring_get(i);
+
+        snap[i] = g_byte_array_new();
+        read_pos[i] = ring_snapshot(hdr, read_pos[i], snap[i]);
+        if (!ring_flight_recorder) {
+            smp_mb(); /* finish reading before the writer may reuse it */
+            qatomic_set__nocheck(&hdr->tail,
+                                 QEMU_ALIGN_DOWN(read_pos[i],
+                                                 TRACE_RING_SUBBUF_SIZE));
+        }
+        dropped += qatomic_read__nocheck(&hdr->dropped);
+    }
+
+    if (trace_fp && dropped != ring_dropped_reported) {
+        struct {
+            TraceRingEvent ev;
+            uint64_t count;
+        } rec = {
+            .ev.event = DROPPED_EVENT_ID,
+            .ev.timestamp_ns = get_clock(),
+            .ev.length = sizeof(rec),
+            .ev.pid = trace_pid,
+            .count = dropped - ring_dropped_reported,
+        };
+
+        unused = fwrite(&type, sizeof(type), 1, trace_fp);
+        unused = fwrite(&rec, sizeof(rec), 1, trace_fp);
+        ring_dropped_reported = dropped;
+    }
+
+    while (trace_fp) {
+        best = NULL;
+        for (i = 0; i < n; i++) {
+            ev = ring_snapshot_next(snap[i], &off[i]);
+            if (ev && (!best || ev->timestamp_ns < best->timestamp_ns)) {
+                best = ev;
+                best_ring = i;
+            }
+        }
+        if (!best) {
+            break;
+        }
+        unused = fwrite(&type, sizeof(type), 1, trace_fp);
+        unused = fwrite(best, best->length, 1, trace_fp);
+        off[best_ring] += ROUND_UP(best->length, 8);
+    }
+
+    for (i = 0; i < n; i++) {
+        g_byte_array_unref(snap[i]);
+    }
+    if (trace_fp) {
+        fflush(trace_fp);
+    }
+}
+
+static gpointer ring_writeout_thread(gpointer opaque)
+{
+    g_autofree uint64_t *read_pos = g_new0(uint64_t, TRACE_RING_MAX);
+    gint64 end;
+
+    g_mutex_lock(&ring_lock);
+    for (;;) {
+        end = g_get_monotonic_time() + TRACE_RING_WRITEOUT_US;
+        while (!ring_flush_requested && !qatomic_read(&ring_kicked)) {
+            if (!trace_fp) {
+                g_cond_wait(&ring_cond, &ring_lock);
+            } else if (!g_cond_wait_until(&ring_cond, &ring_lock, end)) {
+                break;
+            }
+        }
+        qatomic_set(&ring_kicked, false);
+
+        ring_writeout(read_pos);
+
+        if (ring_flush_requested) {
+            ring_flush_requested = false;
+            ring_flushes++;
+            g_cond_broadcast(&ring_flushed_cond);
+        }
+    }
+    return NULL;
+}
+
+/* Called with ring_lock held */
+static void ring_flush_locked(void)
+{
+    uint64_t flushes = ring_flushes;
+
+    ring_flush_requested = true;
+    g_cond_signal(&ring_cond);
+    while (ring_flushes == flushes) {
+        g_cond_wait(&ring_flushed_cond, &ring_lock);
+    }
+}
+
+/* Write out what is in the rings, or dump them in flight recorder mode */
+void ring_trace_flush(void)
+{
+    g_autofree uint64_t *read_pos = NULL;
+
+    if (!ring_map) {
+        return;
+    }
+
+    g_mutex_lock(&ring_lock);
+    if (!ring_flight_recorder) {
+        ring_flush_locked();
+        g_mutex_unlock(&ring_lock);
+        return;
+    }
+
+    trace_fp = fopen(trace_file_name, "wb");
+    if (!trace_fp) {
+        error_report("cannot open trace file %s: %s", trace_file_name,
+                     strerror(errno));
+    } else {
+        read_pos = g_new0(uint64_t, TRACE_RING_MAX);
+        ring_dropped_reported = 0;
+        ring_write_header();
+        ring_writeout(read_pos);
+        fclose(trace_fp);
+        trace_fp = NULL;
+    }
+    g_mutex_unlock(&ring_lock);
+}
+
+/**
+ * Start / stop recording, return whether it was on.
+ *
+ * In streaming mode this also opens and closes the trace file.  In
+ * flight recorder mode, stopping freezes the rings until they are
+ * dumped with ring_trace_flush().
+ */
+bool ring_trace_set_file_enabled(bool enable)
+{
+    bool was_enabled = qatomic_read(&ring_enabled);
+
+    if (!ring_map || enable == was_enabled) {
+        return was_enabled;
+    }
+
+    if (ring_flight_recorder) {
+        qatomic_set(&ring_enabled, enable);
+        return was_enabled;
+    }
+
+    g_mutex_lock(&ring_lock);
+    if (enable) {
+        trace_fp = fopen(trace_file_name, "wb");
+        if (!trace_fp) {
+            g_mutex_unlock(&ring_lock);
+            return was_enabled;
+        }
+        ring_dropped_reported = 0;
+        ring_write_header();
+        qatomic_set(&ring_enabled, true);
+        g_cond_signal(&ring_cond);
+    } else {
+        qatomic_set(&ring_enabled, false);
+        ring_flush_locked();
+        fclose(trace_fp);
+        trace_fp = NULL;
+    }
+    g_mutex_unlock(&ring_lock);
+    return was_enabled;
+}
+
+/**
+ * Set the name of a trace file
+ *
+ * @file        The trace file name or NULL for the default name-<pid> set at
+ *              config time
+ */
+void ring_trace_set_file(const char *file)
+{
+    bool saved_enable = ring_trace_set_file_enabled(false);
+
+    g_free(trace_file_name);
+    if (!file) {
+        /* Type cast needed for Windows where getpid() returns an int. */
+        trace_file_name = g_strdup_printf(CONFIG_TRACE_FILE, (pid_t)getpid());
+    } else {
+        trace_file_name = g_strdup(file);
+    }
+
+    ring_trace_set_file_enabled(saved_enable);
+}
+
+void ring_trace_print_file_status(void)
+{
+    qemu_printf("Trace file \"%s\" %s%s.\n", trace_file_name,
+                ring_flight_recorder ? "(flight recorder) " : "",
+                qatomic_read(&ring_enabled) ? "on" : "off");
+}
+
+void ring_trace_opts(uint64_t size, bool flight_recorder,
+                     const char *file)
+{
+    if (size) {
+        ring_size = pow2ceil(MAX(size, TRACE_RING_MIN_SIZE));
+    }
+    ring_flight_recorder = flight_recorder;
+    if (file) {
+        g_free(ring_file_name);
+        ring_file_name = g_strdup(file);
+    }
+}
+
+static void ring_trace_exit(void)
+{
+    if (!ring_flight_recorder) {
+        ring_trace_flush();
+    }
+}
+
+/* Lay out the rings, optionally in a file that other processes can map */
+static TraceRingFileHeader *ring_map_create(void)
+{
+    uint64_t events_offset, events_size = 0, rings_offset, stride;
+    TraceRingFileHeader *hdr;
+    TraceEventIter iter;
+    TraceEvent *ev;
+    uint8_t *p;
+    void *map;
+    int fd;
+
+    trace_event_iter_init(&iter, NULL);
+    while ((ev = trace_event_iter_next(&iter)) != NULL) {
+        events_size += sizeof(uint64_t) + sizeof(uint32_t) +
+                       strlen(trace_event_get_name(ev));
+    }
+
+    events_offset = ROUND_UP(sizeof(TraceRingFileHeader), 64);
+    rings_offset = ROUND_UP(events_offset + events_size,
+                            qemu_real_host_page_size);
+    stride = TRACE_RING_HEADER_SIZE + ring_size;
+    ring_map_size = rings_offset + TRACE_RING_MAX * stride;
+
+    if (ring_file_name) {
+        fd = open(ring_file_name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (fd < 0) {
+            error_report("cannot create trace ring file %s: %s",
+                         ring_file_name, strerror(errno));
+            return NULL;
+        }
+        if (ftruncate(fd, ring_map_size) < 0) {
+            error_report("cannot size trace ring file %s: %s",
+                         ring_file_name, strerror(errno));
+            close(fd);
+            return NULL;
+        }
+        map = mmap(NULL, ring_map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   fd, 0);
+        close(fd);
+    } else {
+        map = mmap(NULL, ring_map_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    }
+    if (map == MAP_FAILED) {
+        error_report("cannot map trace rings: %s", strerror(errno));
+        return NULL;
+    }
+
+    hdr = map;
+    hdr->version = TRACE_RING_VERSION;
+    hdr->pid = trace_pid;
+    hdr->max_rings = TRACE_RING_MAX;
+    hdr->subbuf_size = TRACE_RING_SUBBUF_SIZE;
+    hdr->nr_subbufs = ring_size / TRACE_RING_SUBBUF_SIZE;
+    hdr->events_offset = events_offset;
+    hdr->events_size = events_size;
+    hdr->rings_offset = rings_offset;
+    hdr->ring_stride = stride;
+
+    p = (uint8_t *)map + events_offset;
+    trace_event_iter_init(&iter, NULL);
+    while ((ev = trace_event_iter_next(&iter)) != NULL) {
+        uint64_t id = trace_event_get_id(ev);
+        const char *name = trace_event_get_name(ev);
+        uint32_t len = strlen(name);
+
+        memcpy(p, &id, sizeof(id));
+        memcpy(p + sizeof(id), &len, sizeof(len));
+        memcpy(p + sizeof(id) + sizeof(len), name, len);
+        p += sizeof(id) + sizeof(len) + len;
+    }
+
+    /* A consumer only looks at the rest once the magic is there */
+    smp_wmb();
+    hdr->magic = TRACE_RING_MAGIC;
+    return hdr;
+}
+
+/*
+ * Helper function to create a thread with signals blocked, see the
+ * simple backend.
+ */
+static GThread *ring_thread_create(GThreadFunc fn)
+{
+    sigset_t set, oldset;
+    GThread *thread;
+
+    sigfillset(&set);
+    pthread_sigmask(SIG_SETMASK, &set, &oldset);
+    thread = g_thread_new("trace-ring", fn, NULL);
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+    return thread;
+}
+
+bool ring_trace_init(void)
+{
+    TraceRingFileHeader *map;
+
+    trace_pid = getpid();
+
+    if (pthread_key_create(&ring_key, ring_release)) {
+        warn_report("unable to initialize ring trace backend");
+        return false;
+    }
+    map = ring_map_create();
+    if (!map) {
+        return false;
+    }
+
+    if (!ring_flight_recorder && !ring_thread_create(ring_writeout_thread)) {
+        warn_report("unable to initialize ring trace backend");
+        munmap(map, ring_map_size);
+        return false;
+    }
+
+    qatomic_store_release(&ring_map, map);
+    atexit(ring_trace_exit);
+    return true;
+}
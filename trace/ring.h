@@ -0,0 +1,125 @@
+/*
+ * Per-thread ring buffer trace backend
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef TRACE_RING_H
+#define TRACE_RING_H
+
+/*
+ * Every thread that emits an event gets its own ring, so recording an
+ * event takes no lock and touches no shared cache line.  All rings live
+ * in one mapping, which can be backed by a file (-trace ring-file=...)
+ * so that another process can mmap it and take snapshots while QEMU
+ * runs.  scripts/ringtrace.py does that.
+ *
+ * Layout of the mapping, all fields in host byte order:
+ *
+ *   TraceRingFileHeader
+ *   event table at events_offset: for each event, uint64_t id,
+ *     uint32_t length and the name (not NUL-terminated)
+ *   ring i at rings_offset + i * ring_stride:
+ *     TraceRingHeader, padded to TRACE_RING_HEADER_SIZE
+ *     nr_subbufs sub-buffers of subbuf_size bytes each
+ *
+ * A sub-buffer starts with a TraceRingSubbuf and is followed by records
+ * in the simpletrace format (see trace/simple.c), each padded to
+ * 8 bytes.  Records never straddle sub-buffers.  The writer fills
+ * sub-buffers in order; for byte position pos in the ring's stream, the
+ * sub-buffer is (pos / subbuf_size) % nr_subbufs and its lap field holds
+ * pos / subbuf_size + 1 while it holds data from that lap.
+ *
+ * To read a sub-buffer, load lap, then used, copy the bytes between the
+ * sub-buffer header and used, and load lap again.  The copy is only
+ * valid if lap did not change, else the writer overwrote it meanwhile.
+ */
+
+#define TRACE_RING_MAGIC        0x51454d5552494e47ULL  /* "QEMURING" */
+#define TRACE_RING_VERSION      1
+#define TRACE_RING_HEADER_SIZE  64
+
+#define MAX_TRACE_STRLEN 512
+
+typedef struct TraceRingFileHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t pid;
+    uint32_t nr_rings;          /* rings handed out so far */
+    uint32_t max_rings;
+    uint32_t subbuf_size;
+    uint32_t nr_subbufs;        /* per ring */
+    uint64_t events_offset;
+    uint64_t events_size;
+    uint64_t rings_offset;
+    uint64_t ring_stride;
+} TraceRingFileHeader;
+
+typedef struct TraceRingHeader {
+    uint64_t head;              /* end of the last complete record */
+    uint64_t tail;              /* streaming: oldest sub-buffer still unread */
+    uint64_t dropped;           /* events lost because the ring was full */
+    uint32_t tid;               /* owning thread, 0 while unowned */
+    uint32_t padding;
+} TraceRingHeader;
+
+typedef struct TraceRingSubbuf {
+    uint64_t lap;
+    uint32_t used;              /* bytes in use, including this header */
+    uint32_t padding;
+} TraceRingSubbuf;
+
+typedef struct {
+    uint8_t *ptr;
+    TraceRingSubbuf *subbuf;
+    uint64_t end;
+} TraceRingRecord;
+
+void ring_trace_opts(uint64_t ring_size, bool flight_recorder,
+                     const char *ring_file);
+bool ring_trace_init(void);
+void ring_trace_print_file_status(void);
+bool ring_trace_set_file_enabled(bool enable);
+void ring_trace_set_file(const char *file);
+void ring_trace_flush(void);
+
+/**
+ * Claim space in the calling thread's ring for a record
+ *
+ * @arglen  number of bytes required for arguments
+ *
+ * Returns 0 on success, or a negative errno value if the event is
+ * dropped.
+ */
+int ring_trace_record_start(TraceRingRecord *rec, uint32_t id, size_t arglen);
+
+/**
+ * Append a 64-bit argument to a trace record
+ */
+static inline void ring_trace_record_write_u64(TraceRingRecord *rec,
+                                               uint64_t val)
+{
+    memcpy(rec->ptr, &val, sizeof(val));
+    rec->ptr += sizeof(val);
+}
+
+/**
+ * Append a string argument to a trace record
+ */
+static inline void ring_trace_record_write_str(TraceRingRecord *rec,
+                                               const char *s, uint32_t slen)
+{
+    memcpy(rec->ptr, &slen, sizeof(slen));
+    memcpy(rec->ptr + sizeof(slen), s, slen);
+    rec->ptr += sizeof(slen) + slen;
+}
+
+/**
+ * Publish a trace record
+ *
+ * Don't append any more arguments to the trace record after calling this.
+ */
+void ring_trace_record_finish(TraceRingRecord *rec);
+
+#endif /* TRACE_RING_H */
@@ -199,7 +199,7 @@ static void text_console_update_cursor(void *opaque);
 
 static void gui_update(void *opaque)
 {
-    uint64_t interval = GUI_REFRESH_INTERVAL_IDLE;
+    uint64_t interval = GUI_REFRESH_INTERVAL_NONE;
     uint64_t dcl_interval;
     DisplayState *ds = opaque;
     DisplayChangeListener *dcl;
@@ -220,12 +220,24 @@ static void gui_update(void *opaque)
         ds->update_interval = interval;
         QTAILQ_FOREACH(con, &consoles, next) {
             if (con->hw_ops->update_interval) {
-                con->hw_ops->update_interval(con->hw, interval);
+                con->hw_ops->update_interval(con->hw,
+                                             MIN(interval,
+                                                 GUI_REFRESH_INTERVAL_IDLE));
             }
         }
         trace_console_refresh(interval);
     }
     ds->last_update = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+
+    /*
+     * Nobody is watching, so don't poll the device framebuffers at all.
+     * update_displaychangelistener() restarts the timer when a listener
+     * wants updates again.
+     */
+    if (interval == GUI_REFRESH_INTERVAL_NONE) {
+        trace_console_refresh_stop();
+        return;
+    }
     timer_mod(ds->gui_timer, ds->last_update + interval);
 }
 
@@ -251,6 +263,10 @@ static void gui_setup_refresh(DisplayState *ds)
     if (need_timer && ds->gui_timer == NULL) {
         ds->gui_timer = timer_new_ms(QEMU_CLOCK_REALTIME, gui_update, ds);
         timer_mod(ds->gui_timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME));
+    } else if (need_timer && !ds->refreshing &&
+               !timer_pending(ds->gui_timer)) {
+        /* stopped while all listeners were idle, let the new one in */
+        timer_mod(ds->gui_timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME));
     }
     if (!need_timer && ds->gui_timer != NULL) {
         timer_del(ds->gui_timer);
@@ -1518,7 +1534,7 @@ void update_displaychangelistener(DisplayChangeListener *dcl,
     DisplayState *ds = dcl->ds;
 
     dcl->update_interval = interval;
-    if (!ds->refreshing && ds->update_interval > interval) {
+    if (!ds->refreshing && ds->gui_timer && ds->update_interval > interval) {
         timer_mod(ds->gui_timer, ds->last_update + interval);
     }
 }
@@ -0,0 +1,237 @@
+/*
+ * QEMU VNC display driver: Open H.264 encoding
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/error-report.h"
+#include "vnc.h"
+#include "trace.h"
+
+#include <gst/gst.h>
+#include <gst/app/gstappsrc.h>
+#include <gst/app/gstappsink.h>
+
+/*
+ * A frame is sent as H.264 when part of the update comes from a region
+ * that changes at least this many times per second.
+ */
+#define VNC_H264_FREQ_THRESHOLD     15
+
+#define VNC_H264_FLAG_RESET_CONTEXT 1
+
+struct VncH264 {
+    GstElement *pipeline;
+    GstAppSrc *src;
+    GstAppSink *sink;
+    int width;
+    int height;
+    int64_t start;
+    bool reset;
+    bool failed;
+};
+
+/* Tried in order, hardware encoders first */
+static const char *const vnc_h264_encoders[] = {
+    "vaapih264enc",
+    "x264enc tune=zerolatency speed-preset=ultrafast",
+};
+
+static GstElement *vnc_h264_pipeline_new(void)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(vnc_h264_encoders); i++) {
+        const char *enc = vnc_h264_encoders[i];
+        g_autofree char *name = g_strndup(enc, strcspn(enc, " "));
+        g_autofree char *desc = NULL;
+        GstElementFactory *factory;
+        GstElement *pipeline;
+        GError *err = NULL;
+
+        factory = gst_element_factory_find(name);
+        if (!factory) {
+            continue;
+        }
+        gst_object_unref(factory);
+
+        desc = g_strdup_printf("appsrc name=src is-live=true format=time ! "
+                               "videoconvert ! %s ! "
+                               "video/x-h264,profile=constrained-baseline,"
+                               "stream-format=byte-stream,alignment=au ! "
+                               "appsink name=sink sync=false", enc);
+        pipeline = gst_parse_launch(desc, &err);
+        if (err) {
+            trace_vnc_h264_pipeline_error(name, err->message);
+            g_error_free(err);
+            if (pipeline) {
+                gst_object_unref(pipeline);
+            }
+            continue;
+        }
+        trace_vnc_h264_encoder(name);
+        return pipeline;
+    }
+    return NULL;
+}
+
+static void vnc_h264_pipeline_free(VncH264 *h264)
+{
+    if (!h264->pipeline) {
+        return;
+    }
+    gst_element_set_state(h264->pipeline, GST_STATE_NULL);
+    gst_object_unref(h264->src);
+    gst_object_unref(h264->sink);
+    gst_object_unref(h264->pipeline);
+    h264->pipeline = NULL;
+}
+
+static bool vnc_h264_pipeline_init(VncH264 *h264, int width, int height)
+{
+    GError *err = NULL;
+    GstCaps *caps;
+
+    if (!gst_init_check(NULL, NULL, &err)) {
+        warn_report("VNC: cannot initialize GStreamer: %s", err->message);
+        g_error_free(err);
+        return false;
+    }
+
+    h264->pipeline = vnc_h264_pipeline_new();
+    if (!h264->pipeline) {
+        warn_report("VNC: no usable H.264 encoder found");
+        return false;
+    }
+    h264->src = GST_APP_SRC(gst_bin_get_by_name(GST_BIN(h264->pipeline),
+                                                "src"));
+    h264->sink = GST_APP_SINK(gst_bin_get_by_name(GST_BIN(h264->pipeline),
+                                                  "sink"));
+
+    /* VNC_SERVER_FB_FORMAT, as the bytes appear in memory */
+    caps = gst_caps_new_simple("video/x-raw",
+                               "format", G_TYPE_STRING,
+                               G_BYTE_ORDER == G_LITTLE_ENDIAN ?
+                               "BGRx" : "xRGB",
+                               "width", G_TYPE_INT, width,
+                               "height", G_TYPE_INT, height,
+                               "framerate", GST_TYPE_FRACTION, 0, 1,
+                               NULL);
+    gst_app_src_set_caps(h264->src, caps);
+    gst_caps_unref(caps);
+
+    if (gst_element_set_state(h264->pipeline, GST_STATE_PLAYING) ==
+        GST_STATE_CHANGE_FAILURE) {
+        warn_report("VNC: cannot start the H.264 encoder");
+        vnc_h264_pipeline_free(h264);
+        return false;
+    }
+
+    h264->width = width;
+    h264->height = height;
+    h264->start = g_get_monotonic_time();
+    h264->reset = true;
+    return true;
+}
+
+bool vnc_h264_wanted(VncState *vs, int x, int y, int w, int h)
+{
+    if (!vnc_has_feature(vs, VNC_FEATURE_H264) || vs->vd->non_adaptive) {
+        return false;
+    }
+    if (vs->h264 && vs->h264->failed) {
+        return false;
+    }
+    return vnc_update_freq(vs, x, y, w, h) >= VNC_H264_FREQ_THRESHOLD;
+}
+
+/*
+ * Encode the whole server surface as one frame.  A frame always carries
+ * the full screen, so the client's picture stays correct even when the
+ * updates in between were sent with another encoding.  The frame is
+ * marked lossy, and sent again losslessly once the screen settles down.
+ */
+int vnc_h264_send_framebuffer_update(VncState *vs)
+{
+    VncDisplay *vd = vs->vd;
+    int width = pixman_image_get_width(vd->server);
+    int height = pixman_image_get_height(vd->server);
+    VncH264 *h264;
+    GstBuffer *buf;
+    GstSample *sample;
+    GstMapInfo map;
+    uint8_t *row;
+    int i;
+
+    if (!vs->h264) {
+        vs->h264 = g_new0(VncH264, 1);
+    }
+    h264 = vs->h264;
+
+    /* 4:2:0 chroma subsampling needs even dimensions */
+    if (h264->failed || (width | height) & 1) {
+        return -1;
+    }
+    if (h264->pipeline &&
+        (h264->width != width || h264->height != height)) {
+        vnc_h264_pipeline_free(h264);
+    }
+    if (!h264->pipeline && !vnc_h264_pipeline_init(h264, width, height)) {
+        h264->failed = true;
+        return -1;
+    }
+
+    buf = gst_buffer_new_allocate(NULL, width * height * VNC_SERVER_FB_BYTES,
+                                  NULL);
+    gst_buffer_map(buf, &map, GST_MAP_WRITE);
+    row = vnc_server_fb_ptr(vd, 0, 0);
+    for (i = 0; i < height; i++) {
+        memcpy(map.data + i * width * VNC_SERVER_FB_BYTES, row,
+               width * VNC_SERVER_FB_BYTES);
+        row += vnc_server_fb_stride(vd);
+    }
+    gst_buffer_unmap(buf, &map);
+    GST_BUFFER_PTS(buf) = (g_get_monotonic_time() - h264->start) *
+                          GST_USECOND;
+
+    if (gst_app_src_push_buffer(h264->src, buf) != GST_FLOW_OK) {
+        goto fail;
+    }
+    sample = gst_app_sink_try_pull_sample(h264->sink, GST_SECOND);
+    if (!sample) {
+        goto fail;
+    }
+
+    buf = gst_sample_get_buffer(sample);
+    gst_buffer_map(buf, &map, GST_MAP_READ);
+    trace_vnc_h264_frame(vs, width, height, map.size, h264->reset);
+
+    vnc_framebuffer_update(vs, 0, 0, width, height, VNC_ENCODING_H264);
+    vnc_write_u32(vs, map.size);
+    vnc_write_u32(vs, h264->reset ? VNC_H264_FLAG_RESET_CONTEXT : 0);
+    vnc_write(vs, map.data, map.size);
+    h264->reset = false;
+
+    gst_buffer_unmap(buf, &map);
+    gst_sample_unref(sample);
+
+    vnc_sent_lossy_rect(vs, 0, 0, width, height);
+    return 1;
+
+fail:
+    warn_report("VNC: H.264 encoding failed, disabling it for this client");
+    vnc_h264_pipeline_free(h264);
+    h264->failed = true;
+    return -1;
+}
+
+void vnc_h264_clear(VncState *vs)
+{
+    if (vs->h264) {
+        vnc_h264_pipeline_free(vs->h264);
+        g_free(vs->h264);
+        vs->h264 = NULL;
+    }
+}
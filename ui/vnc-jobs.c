@@ -40,22 +40,30 @@
  * - jobs queue lock: for each operation on the queue (push, pop, isEmpty?)
  * - VncDisplay global lock: mainly used for framebuffer updates to avoid
  *                      screen corruption if the framebuffer is updated
- *                      while the worker is doing something.
+ *                      while a worker is doing something.  The workers
+ *                      share it, see vnc_lock_display_shared().
  * - VncState::output lock: used to make sure the output buffer is not corrupted
  *                          if two threads try to write on it at the same time
  *
- * While the VNC worker thread is working, the VncDisplay global lock is held
+ * While a VNC worker thread is working, the VncDisplay global lock is held
  * to avoid screen corruption (this does not block vnc_refresh() because it
  * uses trylock()) but the output lock is not held because the thread works on
  * its own output buffer.
  * When the encoding job is done, the worker thread will hold the output lock
  * and copy its output buffer in vs->output.
+ *
+ * Jobs for different clients are encoded in parallel by a pool of worker
+ * threads.  The encoders keep per-client state (zlib streams, tight and
+ * zrle buffers), so a client only has one job running at a time, and its
+ * jobs run in the order they were pushed.
  */
 
+#define VNC_WORKER_THREADS_MAX 16
+
 struct VncJobQueue {
     QemuCond cond;
     QemuMutex mutex;
-    QemuThread thread;
+    int nb_threads;
     bool exit;
     QTAILQ_HEAD(, VncJob) jobs;
 };
@@ -63,8 +71,7 @@ struct VncJobQueue {
 typedef struct VncJobQueue VncJobQueue;
 
 /*
- * We use a single global queue, but most of the functions are
- * already reentrant, so we can easily add more than one encoding thread
+ * We use a single global queue, shared by all the encoding threads
  */
 static VncJobQueue *queue;
 
@@ -190,6 +197,7 @@ static void vnc_async_encoding_start(VncState *orig, VncState *local)
     local->zlib = orig->zlib;
     local->hextile = orig->hextile;
     local->zrle = orig->zrle;
+    local->h264 = orig->h264;
 }
 
 static void vnc_async_encoding_end(VncState *orig, VncState *local)
@@ -199,9 +207,57 @@ static void vnc_async_encoding_end(VncState *orig, VncState *local)
     orig->zlib = local->zlib;
     orig->hextile = local->hextile;
     orig->zrle = local->zrle;
+    orig->h264 = local->h264;
     orig->lossy_rect = local->lossy_rect;
 }
 
+/*
+ * The first job of a client that has no job running.  Jobs are queued
+ * in order, so this is also the oldest job of that client.
+ */
+static VncJob *vnc_next_job_locked(VncJobQueue *queue)
+{
+    VncJob *job;
+
+    QTAILQ_FOREACH(job, &queue->jobs, next) {
+        if (!job->vs->job_running) {
+            return job;
+        }
+    }
+    return NULL;
+}
+
+#ifdef CONFIG_VNC_H264
+/* Send the whole screen as one H.264 frame if the update has video */
+static int vnc_job_send_h264(VncState *vs, VncJob *job)
+{
+    VncRectEntry *entry, *tmp;
+    bool wanted = false;
+    int n;
+
+    QLIST_FOREACH(entry, &job->rectangles, next) {
+        if (vnc_h264_wanted(vs, entry->rect.x, entry->rect.y,
+                            entry->rect.w, entry->rect.h)) {
+            wanted = true;
+            break;
+        }
+    }
+    if (!wanted) {
+        return 0;
+    }
+
+    n = vnc_h264_send_framebuffer_update(vs);
+    if (n <= 0) {
+        return 0;
+    }
+    QLIST_FOREACH_SAFE(entry, &job->rectangles, next, tmp) {
+        QLIST_REMOVE(entry, next);
+        g_free(entry);
+    }
+    return n;
+}
+#endif
+
 static int vnc_worker_thread_loop(VncJobQueue *queue)
 {
     VncJob *job;
@@ -211,17 +267,16 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
     int saved_offset;
 
     vnc_lock_queue(queue);
-    while (QTAILQ_EMPTY(&queue->jobs) && !queue->exit) {
+    while (!queue->exit && !(job = vnc_next_job_locked(queue))) {
         qemu_cond_wait(&queue->cond, &queue->mutex);
     }
-    /* Here job can only be NULL if queue->exit is true */
-    job = QTAILQ_FIRST(&queue->jobs);
-    vnc_unlock_queue(queue);
-    assert(job->vs->magic == VNC_MAGIC);
-
     if (queue->exit) {
+        vnc_unlock_queue(queue);
         return -1;
     }
+    job->vs->job_running = true;
+    vnc_unlock_queue(queue);
+    assert(job->vs->magic == VNC_MAGIC);
 
     vnc_lock_output(job->vs);
     if (job->vs->ioc == NULL || job->vs->abort == true) {
@@ -249,12 +304,15 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
     saved_offset = vs.output.offset;
     vnc_write_u16(&vs, 0);
 
-    vnc_lock_display(job->vs->vd);
+    vnc_lock_display_shared(job->vs->vd);
+#ifdef CONFIG_VNC_H264
+    n_rectangles += vnc_job_send_h264(&vs, job);
+#endif
     QLIST_FOREACH_SAFE(entry, &job->rectangles, next, tmp) {
         int n;
 
         if (job->vs->ioc == NULL) {
-            vnc_unlock_display(job->vs->vd);
+            vnc_unlock_display_shared(job->vs->vd);
             /* Copy persistent encoding data */
             vnc_async_encoding_end(job->vs, &vs);
             goto disconnected;
@@ -268,7 +326,7 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
         }
         g_free(entry);
     }
-    vnc_unlock_display(job->vs->vd);
+    vnc_unlock_display_shared(job->vs->vd);
 
     /* Put n_rectangles at the beginning of the message */
     vs.output.buffer[saved_offset] = (n_rectangles >> 8) & 0xFF;
@@ -290,6 +348,7 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
 
 disconnected:
     vnc_lock_queue(queue);
+    job->vs->job_running = false;
     QTAILQ_REMOVE(&queue->jobs, job, next);
     vnc_unlock_queue(queue);
     qemu_cond_broadcast(&queue->cond);
@@ -319,11 +378,16 @@ static void vnc_queue_clear(VncJobQueue *q)
 static void *vnc_worker_thread(void *arg)
 {
     VncJobQueue *queue = arg;
-
-    qemu_thread_get_self(&queue->thread);
+    bool last;
 
     while (!vnc_worker_thread_loop(queue)) ;
-    vnc_queue_clear(queue);
+
+    vnc_lock_queue(queue);
+    last = --queue->nb_threads == 0;
+    vnc_unlock_queue(queue);
+    if (last) {
+        vnc_queue_clear(queue);
+    }
     return NULL;
 }
 
@@ -335,12 +399,18 @@ static bool vnc_worker_thread_running(void)
 void vnc_start_worker_thread(void)
 {
     VncJobQueue *q;
+    int i;
 
     if (vnc_worker_thread_running())
         return ;
 
     q = vnc_queue_init();
-    qemu_thread_create(&q->thread, "vnc_worker", vnc_worker_thread, q,
-                       QEMU_THREAD_DETACHED);
+    q->nb_threads = MIN(g_get_num_processors(), VNC_WORKER_THREADS_MAX);
+    for (i = 0; i < q->nb_threads; i++) {
+        QemuThread thread;
+
+        qemu_thread_create(&thread, "vnc_worker", vnc_worker_thread, q,
+                           QEMU_THREAD_DETACHED);
+    }
     queue = q; /* Set global queue */
 }
@@ -52,12 +52,14 @@
 #include "io/dns-resolver.h"
 
 #define VNC_REFRESH_INTERVAL_BASE GUI_REFRESH_INTERVAL_DEFAULT
-#define VNC_REFRESH_INTERVAL_INC  50
 #define VNC_REFRESH_INTERVAL_MAX  GUI_REFRESH_INTERVAL_IDLE
 static const struct timeval VNC_REFRESH_STATS = { 0, 500000 };
 static const struct timeval VNC_REFRESH_LOSSY = { 2, 0 };
 
 #include "vnc_keysym.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "crypto/cipher.h"
 
 static QTAILQ_HEAD(, VncDisplay) vnc_displays =
@@ -1256,6 +1258,9 @@ void vnc_disconnect_finish(VncState *vs)
     vnc_zlib_clear(vs);
     vnc_tight_clear(vs);
     vnc_zrle_clear(vs);
+#ifdef CONFIG_VNC_H264
+    vnc_h264_clear(vs);
+#endif
 
 #ifdef CONFIG_VNC_SASL
     vnc_sasl_client_cleanup(vs);
@@ -2097,6 +2102,17 @@ static void set_encodings(VncState *vs, int32_t *encodings, size_t n_encodings)
             vs->features |= VNC_FEATURE_ZYWRLE_MASK;
             vs->vnc_encoding = enc;
             break;
+#ifdef CONFIG_VNC_H264
+        case VNC_ENCODING_H264:
+            /*
+             * Only used for frames with video in them, the other updates
+             * keep using the best rectangle encoding the client supports.
+             */
+            if (vs->vd->lossy) {
+                vs->features |= VNC_FEATURE_H264_MASK;
+            }
+            break;
+#endif
         case VNC_ENCODING_DESKTOPRESIZE:
             vs->features |= VNC_FEATURE_RESIZE_MASK;
             break;
@@ -2748,8 +2764,8 @@ void vnc_sent_lossy_rect(VncState *vs, int x, int y, int w, int h)
 {
     int i, j;
 
-    w = (x + w) / VNC_STAT_RECT;
-    h = (y + h) / VNC_STAT_RECT;
+    w = (x + w - 1) / VNC_STAT_RECT;
+    h = (y + h - 1) / VNC_STAT_RECT;
     x /= VNC_STAT_RECT;
     y /= VNC_STAT_RECT;
 
@@ -2887,6 +2903,120 @@ static void vnc_rect_updated(VncDisplay *vd, int x, int y, struct timeval * tv)
     rect->updated = true;
 }
 
+/* Size of a full dirty chunk of the server surface */
+#define VNC_DIRTY_CHUNK_BYTES (VNC_DIRTY_PIXELS_PER_BIT * VNC_SERVER_FB_BYTES)
+
+QEMU_BUILD_BUG_ON(VNC_DIRTY_CHUNK_BYTES % 64);
+
+/*
+ * Compare a full chunk and copy it to the server surface if it differs.
+ * This is inlined in the row loop, which is cheaper than a memcmp() and
+ * a memcpy() call for each 64 bytes.
+ */
+static inline bool vnc_update_chunk(uint8_t *server, const uint8_t *guest)
+{
+    int i;
+
+#ifdef __SSE2__
+    for (i = 0; i < VNC_DIRTY_CHUNK_BYTES; i += 64) {
+        __m128i g0 = _mm_loadu_si128((const __m128i *)(guest + i));
+        __m128i g1 = _mm_loadu_si128((const __m128i *)(guest + i + 16));
+        __m128i g2 = _mm_loadu_si128((const __m128i *)(guest + i + 32));
+        __m128i g3 = _mm_loadu_si128((const __m128i *)(guest + i + 48));
+        __m128i eq;
+
+        eq = _mm_and_si128(
+            _mm_and_si128(
+                _mm_cmpeq_epi8(g0, _mm_loadu_si128((__m128i *)(server + i))),
+                _mm_cmpeq_epi8(g1,
+                               _mm_loadu_si128((__m128i *)(server + i + 16)))),
+            _mm_and_si128(
+                _mm_cmpeq_epi8(g2,
+                               _mm_loadu_si128((__m128i *)(server + i + 32))),
+                _mm_cmpeq_epi8(g3,
+                               _mm_loadu_si128((__m128i *)(server + i + 48)))));
+        if (_mm_movemask_epi8(eq) != 0xffff) {
+            break;
+        }
+    }
+#else
+    for (i = 0; i < VNC_DIRTY_CHUNK_BYTES; i += 64) {
+        uint64_t diff = 0;
+        int j;
+
+        for (j = 0; j < 64; j += 8) {
+            diff |= ldq_he_p(guest + i + j) ^ ldq_he_p(server + i + j);
+        }
+        if (diff) {
+            break;
+        }
+    }
+#endif
+    if (i == VNC_DIRTY_CHUNK_BYTES) {
+        return false;
+    }
+    memcpy(server, guest, VNC_DIRTY_CHUNK_BYTES);
+    return true;
+}
+
+/*
+ * Check and copy the dirty chunks of one row, clearing them in @dirty.
+ * The chunks that really changed are set in @changed.
+ */
+static int vnc_refresh_server_row(VncDisplay *vd, unsigned long *dirty,
+                                  unsigned long *changed, int y, int width,
+                                  uint8_t *server_ptr, uint8_t *guest_ptr,
+                                  int cmp_bytes, int line_bytes,
+                                  struct timeval *tv)
+{
+    int nbits = DIV_ROUND_UP(width, VNC_DIRTY_PIXELS_PER_BIT);
+    int has_dirty = 0;
+    int i;
+
+    for (i = 0; i < BITS_TO_LONGS(nbits); i++) {
+        unsigned long bits = dirty[i];
+
+        changed[i] = 0;
+        if (i == BIT_WORD(nbits - 1)) {
+            bits &= BITMAP_LAST_WORD_MASK(nbits);
+        }
+        if (!bits) {
+            continue;
+        }
+        dirty[i] &= ~bits;
+
+        do {
+            int x = i * BITS_PER_LONG + ctzl(bits);
+            uint8_t *server = server_ptr + x * cmp_bytes;
+            uint8_t *guest = guest_ptr + x * cmp_bytes;
+            bool updated;
+
+            bits &= bits - 1;
+            if (cmp_bytes == VNC_DIRTY_CHUNK_BYTES &&
+                (x + 1) * cmp_bytes <= line_bytes) {
+                updated = vnc_update_chunk(server, guest);
+            } else {
+                int _cmp_bytes = MIN(cmp_bytes, line_bytes - x * cmp_bytes);
+
+                assert(_cmp_bytes >= 0);
+                updated = memcmp(server, guest, _cmp_bytes) != 0;
+                if (updated) {
+                    memcpy(server, guest, _cmp_bytes);
+                }
+            }
+            if (!updated) {
+                continue;
+            }
+            if (!vd->non_adaptive) {
+                vnc_rect_updated(vd, x * VNC_DIRTY_PIXELS_PER_BIT, y, tv);
+            }
+            changed[i] |= BIT_MASK(x);
+            has_dirty++;
+        } while (bits);
+    }
+    return has_dirty;
+}
+
 static int vnc_refresh_server_surface(VncDisplay *vd)
 {
     int width = MIN(pixman_image_get_width(vd->guest.fb),
@@ -2930,19 +3060,20 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
     line_bytes = MIN(server_stride, guest_ll);
 
     for (;;) {
-        int x;
+        DECLARE_BITMAP(changed, VNC_DIRTY_BITS);
         uint8_t *guest_ptr, *server_ptr;
         unsigned long offset = find_next_bit((unsigned long *) &vd->guest.dirty,
                                              height * VNC_DIRTY_BPL(&vd->guest),
                                              y * VNC_DIRTY_BPL(&vd->guest));
+        int n;
+
         if (offset == height * VNC_DIRTY_BPL(&vd->guest)) {
             /* no more dirty bits */
             break;
         }
         y = offset / VNC_DIRTY_BPL(&vd->guest);
-        x = offset % VNC_DIRTY_BPL(&vd->guest);
 
-        server_ptr = server_row0 + y * server_stride + x * cmp_bytes;
+        server_ptr = server_row0 + y * server_stride;
 
         if (vd->guest.format != VNC_SERVER_FB_FORMAT) {
             qemu_pixman_linebuf_fill(tmpbuf, vd->guest.fb, width, 0, y);
@@ -2950,30 +3081,17 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
         } else {
             guest_ptr = guest_row0 + y * guest_stride;
         }
-        guest_ptr += x * cmp_bytes;
 
-        for (; x < DIV_ROUND_UP(width, VNC_DIRTY_PIXELS_PER_BIT);
-             x++, guest_ptr += cmp_bytes, server_ptr += cmp_bytes) {
-            int _cmp_bytes = cmp_bytes;
-            if (!test_and_clear_bit(x, vd->guest.dirty[y])) {
-                continue;
-            }
-            if ((x + 1) * cmp_bytes > line_bytes) {
-                _cmp_bytes = line_bytes - x * cmp_bytes;
-            }
-            assert(_cmp_bytes >= 0);
-            if (memcmp(server_ptr, guest_ptr, _cmp_bytes) == 0) {
-                continue;
-            }
-            memcpy(server_ptr, guest_ptr, _cmp_bytes);
-            if (!vd->non_adaptive) {
-                vnc_rect_updated(vd, x * VNC_DIRTY_PIXELS_PER_BIT,
-                                 y, &tv);
-            }
+        n = vnc_refresh_server_row(vd, vd->guest.dirty[y], changed, y, width,
+                                   server_ptr, guest_ptr, cmp_bytes,
+                                   line_bytes, &tv);
+        if (n) {
+            int nbits = DIV_ROUND_UP(width, VNC_DIRTY_PIXELS_PER_BIT);
+
             QTAILQ_FOREACH(vs, &vd->clients, next) {
-                set_bit(x, vs->dirty[y]);
+                bitmap_or(vs->dirty[y], vs->dirty[y], changed, nbits);
             }
-            has_dirty++;
+            has_dirty += n;
         }
 
         y++;
@@ -2989,7 +3107,8 @@ static void vnc_refresh(DisplayChangeListener *dcl)
     int has_dirty, rects = 0;
 
     if (QTAILQ_EMPTY(&vd->clients)) {
-        update_displaychangelistener(&vd->dcl, VNC_REFRESH_INTERVAL_MAX);
+        /* vnc_connect() restarts the refresh for the first client */
+        update_displaychangelistener(&vd->dcl, GUI_REFRESH_INTERVAL_NONE);
         return;
     }
 
@@ -3014,7 +3133,12 @@ static void vnc_refresh(DisplayChangeListener *dcl)
             vd->dcl.update_interval = VNC_REFRESH_INTERVAL_BASE;
         }
     } else {
-        vd->dcl.update_interval += VNC_REFRESH_INTERVAL_INC;
+        /*
+         * Back off geometrically, so a screen that stopped changing
+         * reaches the idle rate after a dozen ticks instead of sixty.
+         * Client input resets the interval, so this doesn't add latency.
+         */
+        vd->dcl.update_interval += vd->dcl.update_interval / 2;
         if (vd->dcl.update_interval > VNC_REFRESH_INTERVAL_MAX) {
             vd->dcl.update_interval = VNC_REFRESH_INTERVAL_MAX;
         }
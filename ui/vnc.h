@@ -157,6 +157,7 @@ struct VncDisplay
     int ledstate;
     QKbdState *kbd;
     QemuMutex mutex;
+    int encoders;       /* workers reading the server surface, under mutex */
 
     QEMUCursor *cursor;
     int cursor_msize;
@@ -216,6 +217,8 @@ typedef struct VncZlib {
     int level;
 } VncZlib;
 
+typedef struct VncH264 VncH264;
+
 typedef struct VncZrle {
     int type;
     Buffer fb;
@@ -334,6 +337,7 @@ struct VncState
     QemuMutex output_mutex;
     QEMUBH *bh;
     Buffer jobs_buffer;
+    bool job_running; /* Protected by the jobs queue lock */
 
     /* Encoding specific, if you add something here, don't forget to
      *  update vnc_async_encoding_start()
@@ -343,6 +347,7 @@ struct VncState
     VncHextile hextile;
     VncZrle *zrle;
     VncZywrle zywrle;
+    VncH264 *h264;
 
     Notifier mouse_mode_notifier;
 
@@ -399,6 +404,7 @@ enum {
 #define VNC_ENCODING_TRLE                 0x0000000f
 #define VNC_ENCODING_ZRLE                 0x00000010
 #define VNC_ENCODING_ZYWRLE               0x00000011
+#define VNC_ENCODING_H264                 0x00000032 /* Open H.264 */
 #define VNC_ENCODING_COMPRESSLEVEL0       0xFFFFFF00 /* -256 */
 #define VNC_ENCODING_QUALITYLEVEL0        0xFFFFFFE0 /* -32  */
 #define VNC_ENCODING_XCURSOR              0xFFFFFF10 /* -240 */
@@ -450,6 +456,7 @@ enum {
 #define VNC_FEATURE_ZRLE                     9
 #define VNC_FEATURE_ZYWRLE                  10
 #define VNC_FEATURE_LED_STATE               11
+#define VNC_FEATURE_H264                    12
 
 #define VNC_FEATURE_RESIZE_MASK              (1 << VNC_FEATURE_RESIZE)
 #define VNC_FEATURE_HEXTILE_MASK             (1 << VNC_FEATURE_HEXTILE)
@@ -463,6 +470,7 @@ enum {
 #define VNC_FEATURE_ZRLE_MASK                (1 << VNC_FEATURE_ZRLE)
 #define VNC_FEATURE_ZYWRLE_MASK              (1 << VNC_FEATURE_ZYWRLE)
 #define VNC_FEATURE_LED_STATE_MASK           (1 << VNC_FEATURE_LED_STATE)
+#define VNC_FEATURE_H264_MASK                (1 << VNC_FEATURE_H264)
 
 
 /* Client -> Server message IDs */
@@ -598,4 +606,10 @@ int vnc_zrle_send_framebuffer_update(VncState *vs, int x, int y, int w, int h);
 int vnc_zywrle_send_framebuffer_update(VncState *vs, int x, int y, int w, int h);
 void vnc_zrle_clear(VncState *vs);
 
+#ifdef CONFIG_VNC_H264
+bool vnc_h264_wanted(VncState *vs, int x, int y, int w, int h);
+int vnc_h264_send_framebuffer_update(VncState *vs);
+void vnc_h264_clear(VncState *vs);
+#endif
+
 #endif /* QEMU_VNC_H */
@@ -87,13 +87,18 @@ static bool aio_remove_fd_handler(AioContext *ctx, AioHandler *node)
     return true;
 }
 
-void aio_set_fd_handler(AioContext *ctx,
-                        int fd,
-                        bool is_external,
-                        IOHandler *io_read,
-                        IOHandler *io_write,
-                        AioPollFn *io_poll,
-                        void *opaque)
+/*
+ * @drains_fd: @io_read reads everything that is pending on @fd, so that
+ * the fd is only reported again when new data arrives
+ */
+static void aio_set_fd_handler_common(AioContext *ctx,
+                                      int fd,
+                                      bool is_external,
+                                      IOHandler *io_read,
+                                      IOHandler *io_write,
+                                      AioPollFn *io_poll,
+                                      void *opaque,
+                                      bool drains_fd)
 {
     AioHandler *node;
     AioHandler *new_node = NULL;
@@ -129,6 +134,7 @@ void aio_set_fd_handler(AioContext *ctx,
         new_node->io_poll = io_poll;
         new_node->opaque = opaque;
         new_node->is_external = is_external;
+        new_node->drains_fd = drains_fd;
 
         if (is_new) {
             new_node->pfd.fd = fd;
@@ -164,6 +170,18 @@ void aio_set_fd_handler(AioContext *ctx,
     }
 }
 
+void aio_set_fd_handler(AioContext *ctx,
+                        int fd,
+                        bool is_external,
+                        IOHandler *io_read,
+                        IOHandler *io_write,
+                        AioPollFn *io_poll,
+                        void *opaque)
+{
+    aio_set_fd_handler_common(ctx, fd, is_external, io_read, io_write,
+                              io_poll, opaque, false);
+}
+
 void aio_set_fd_poll(AioContext *ctx, int fd,
                      IOHandler *io_poll_begin,
                      IOHandler *io_poll_end)
@@ -184,8 +202,10 @@ void aio_set_event_notifier(AioContext *ctx,
                             EventNotifierHandler *io_read,
                             AioPollFn *io_poll)
 {
-    aio_set_fd_handler(ctx, event_notifier_get_fd(notifier), is_external,
-                       (IOHandler *)io_read, NULL, io_poll, notifier);
+    /* EventNotifier handlers clear the notifier, which drains the fd */
+    aio_set_fd_handler_common(ctx, event_notifier_get_fd(notifier),
+                              is_external, (IOHandler *)io_read, NULL,
+                              io_poll, notifier, true);
 }
 
 void aio_set_event_notifier_poll(AioContext *ctx,
@@ -298,6 +318,16 @@ static void aio_free_deleted_handlers(AioContext *ctx)
     qemu_lockcnt_inc_and_unlock(&ctx->list_lock);
 }
 
+static void aio_call_handler(AioContext *ctx, IOHandler *fn, void *opaque)
+{
+    int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+    fn(opaque);
+    log_histogram_add_single_writer(&ctx->dispatch_latency,
+                                    qemu_clock_get_ns(QEMU_CLOCK_REALTIME) -
+                                    start);
+}
+
 static bool aio_dispatch_handler(AioContext *ctx, AioHandler *node)
 {
     bool progress = false;
@@ -326,18 +356,19 @@ static bool aio_dispatch_handler(AioContext *ctx, AioHandler *node)
         (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR)) &&
         aio_node_check(ctx, node->is_external) &&
         node->io_read) {
-        node->io_read(node->opaque);
-
         /* aio_notify() does not count as progress */
         if (node->opaque != &ctx->notifier) {
+            aio_call_handler(ctx, node->io_read, node->opaque);
             progress = true;
+        } else {
+            node->io_read(node->opaque);
         }
     }
     if (!QLIST_IS_INSERTED(node, node_deleted) &&
         (revents & (G_IO_OUT | G_IO_ERR)) &&
         aio_node_check(ctx, node->is_external) &&
         node->io_write) {
-        node->io_write(node->opaque);
+        aio_call_handler(ctx, node->io_write, node->opaque);
         progress = true;
     }
 
@@ -512,6 +543,35 @@ static bool run_poll_handlers(AioContext *ctx, int64_t max_ns, int64_t *timeout)
     return progress;
 }
 
+/* Take one of the polling slots of the context's poll group, if any */
+static bool poll_group_enter(AioContext *ctx)
+{
+    AioPollGroup *group = ctx->poll_group;
+
+    if (!group) {
+        return true;
+    }
+    for (;;) {
+        unsigned pollers = qatomic_read(&group->pollers);
+
+        if (pollers >= qatomic_read(&group->max_pollers)) {
+            trace_poll_group_busy(ctx, group, pollers);
+            return false;
+        }
+        if (qatomic_cmpxchg(&group->pollers, pollers,
+                            pollers + 1) == pollers) {
+            return true;
+        }
+    }
+}
+
+static void poll_group_leave(AioContext *ctx)
+{
+    if (ctx->poll_group) {
+        qatomic_dec(&ctx->poll_group->pollers);
+    }
+}
+
 /* try_poll_mode:
  * @ctx: the AioContext
  * @timeout: timeout for blocking wait, computed by the caller and updated if
@@ -530,10 +590,15 @@ static bool try_poll_mode(AioContext *ctx, int64_t *timeout)
     }
 
     max_ns = qemu_soonest_timeout(*timeout, ctx->poll_ns);
-    if (max_ns && !ctx->fdmon_ops->need_wait(ctx)) {
-        poll_set_started(ctx, true);
+    if (max_ns && !ctx->fdmon_ops->need_wait(ctx) && poll_group_enter(ctx)) {
+        bool progress;
 
-        if (run_poll_handlers(ctx, max_ns, timeout)) {
+        poll_set_started(ctx, true);
+        progress = run_poll_handlers(ctx, max_ns, timeout);
+        poll_group_leave(ctx);
+        stat64_add_single_writer(&ctx->stat_poll_attempts, 1);
+        if (progress) {
+            stat64_add_single_writer(&ctx->stat_poll_hits, 1);
             return true;
         }
     }
@@ -553,7 +618,7 @@ bool aio_poll(AioContext *ctx, bool blocking)
     bool progress;
     bool use_notify_me;
     int64_t timeout;
-    int64_t start = 0;
+    int64_t start, now;
 
     /*
      * There cannot be two concurrent aio_poll calls for the same AioContext (or
@@ -568,15 +633,17 @@ bool aio_poll(AioContext *ctx, bool blocking)
                                       qemu_get_aio_context() : ctx));
 
     qemu_lockcnt_inc(&ctx->list_lock);
+    stat64_add_single_writer(&ctx->stat_aio_polls, 1);
 
-    if (ctx->poll_max_ns) {
-        start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
-    }
+    start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
 
     timeout = blocking ? aio_compute_timeout(ctx) : 0;
     progress = try_poll_mode(ctx, &timeout);
     assert(!(timeout && progress));
 
+    now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    stat64_add_single_writer(&ctx->stat_poll_time_ns, now - start);
+
     /*
      * aio_notify can avoid the expensive event_notifier_set if
      * everything (file descriptors, bottom halves, timers) will
@@ -604,7 +671,15 @@ bool aio_poll(AioContext *ctx, bool blocking)
      * system call---a single round of run_poll_handlers_once suffices.
      */
     if (timeout || ctx->fdmon_ops->need_wait(ctx)) {
+        int64_t wait_start = now;
+
+        if (timeout) {
+            stat64_add_single_writer(&ctx->stat_blocking_waits, 1);
+        }
         ret = ctx->fdmon_ops->wait(ctx, &ready_list, timeout);
+
+        now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        stat64_add_single_writer(&ctx->stat_wait_time_ns, now - wait_start);
     }
 
     if (use_notify_me) {
@@ -617,7 +692,7 @@ bool aio_poll(AioContext *ctx, bool blocking)
 
     /* Adjust polling time */
     if (ctx->poll_max_ns) {
-        int64_t block_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
+        int64_t block_ns = now - start;
 
         if (block_ns <= ctx->poll_ns) {
             /* This is the sweet spot, no adjustment needed */
@@ -668,6 +743,8 @@ bool aio_poll(AioContext *ctx, bool blocking)
 
     progress |= timerlistgroup_run_timers(&ctx->tlg);
 
+    stat64_add_single_writer(&ctx->stat_dispatch_time_ns,
+                             qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - now);
     return progress;
 }
 
@@ -37,6 +37,7 @@ struct AioHandler {
 #endif
     int64_t poll_idle_timeout; /* when to stop userspace polling */
     bool is_external;
+    bool drains_fd; /* io_read consumes all pending input of the fd */
 };
 
 /* Add a handler to a ready list */
@@ -161,6 +161,7 @@ int aio_bh_poll(AioContext *ctx)
             if (!(flags & BH_IDLE)) {
                 ret = 1;
             }
+            stat64_add_single_writer(&ctx->stat_bh_calls, 1);
             aio_bh_call(bh);
         }
         if (flags & (BH_DELETED | BH_ONESHOT)) {
@@ -401,7 +402,7 @@ LuringState *aio_setup_linux_io_uring(AioContext *ctx, Error **errp)
         return ctx->linux_io_uring;
     }
 
-    ctx->linux_io_uring = luring_init(errp);
+    ctx->linux_io_uring = luring_init(ctx->io_uring_sqpoll_idle, errp);
     if (!ctx->linux_io_uring) {
         return NULL;
     }
@@ -417,6 +418,41 @@ LuringState *aio_get_linux_io_uring(AioContext *ctx)
 }
 #endif
 
+void aio_context_set_thread_pool_params(AioContext *ctx, int64_t min,
+                                        int64_t max, Error **errp)
+{
+    if (min < 0 || max <= 0 || min > max || max > INT_MAX) {
+        error_setg(errp, "thread pool limits must satisfy "
+                   "0 <= min <= max, 0 < max <= %d", INT_MAX);
+        return;
+    }
+
+    ctx->thread_pool_min = min;
+    ctx->thread_pool_max = max;
+    if (ctx->thread_pool) {
+        thread_pool_update_params(ctx->thread_pool, ctx);
+    }
+}
+
+void aio_context_set_poll_group(AioContext *ctx, AioPollGroup *group)
+{
+    ctx->poll_group = group;
+}
+
+bool aio_context_set_io_uring_params(AioContext *ctx, int64_t sqpoll_idle,
+                                     Error **errp)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    if (ctx->linux_io_uring && ctx->io_uring_sqpoll_idle != sqpoll_idle) {
+        error_setg(errp, "io_uring parameters cannot be changed once "
+                   "the AioContext has started using io_uring");
+        return false;
+    }
+#endif
+    ctx->io_uring_sqpoll_idle = sqpoll_idle;
+    return true;
+}
+
 void aio_notify(AioContext *ctx)
 {
     /*
@@ -529,6 +565,8 @@ AioContext *aio_context_new(Error **errp)
 #endif
 
     ctx->thread_pool = NULL;
+    ctx->thread_pool_min = 0;
+    ctx->thread_pool_max = THREAD_POOL_MAX_THREADS_DEFAULT;
     qemu_rec_mutex_init(&ctx->lock);
     timerlistgroup_init(&ctx->tlg, aio_timerlist_notify, ctx);
 
@@ -536,6 +574,7 @@ AioContext *aio_context_new(Error **errp)
     ctx->poll_max_ns = 0;
     ctx->poll_grow = 0;
     ctx->poll_shrink = 0;
+    log_histogram_init(&ctx->dispatch_latency);
 
     return ctx;
 fail:
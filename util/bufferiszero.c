@@ -24,6 +24,13 @@
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
 #include "qemu/bswap.h"
+#include "qemu/host-utils.h"
+
+/*
+ * buffer_zero_prefix() checks this many bytes at a time with the
+ * accelerated functions before it looks for the first nonzero byte.
+ */
+#define BUFFER_ZERO_CHUNK 4096
 
 static bool
 buffer_zero_int(const void *buf, size_t len)
@@ -353,3 +360,48 @@ bool buffer_is_zero(const void *buf, size_t len)
        includes a check for an unrolled loop over 64-bit integers.  */
     return select_accel_fn(buf, len);
 }
+
+/* Find the first nonzero byte in a chunk that is known to have one */
+static size_t buffer_find_nonzero_byte(const unsigned char *p, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i + 8 <= len; i += 8) {
+        uint64_t t = ldq_le_p(p + i);
+
+        if (t) {
+            return i + ctz64(t) / 8;
+        }
+    }
+    while (i < len && !p[i]) {
+        i++;
+    }
+    return i;
+}
+
+size_t buffer_zero_prefix(const void *buf, size_t len)
+{
+    size_t done, n;
+
+    for (done = 0; done < len; done += n) {
+        n = MIN(len - done, BUFFER_ZERO_CHUNK);
+        if (!buffer_is_zero(buf + done, n)) {
+            return done + buffer_find_nonzero_byte(buf + done, n);
+        }
+    }
+    return len;
+}
+
+size_t buffer_nonzero_prefix(const void *buf, size_t len, size_t unit)
+{
+    size_t done, n;
+
+    assert(unit);
+    for (done = 0; done < len; done += n) {
+        n = MIN(len - done, unit);
+        if (buffer_is_zero(buf + done, n)) {
+            break;
+        }
+    }
+    return done;
+}
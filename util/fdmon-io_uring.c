@@ -25,7 +25,14 @@
  *
  * File descriptor monitoring is implemented using the following operations:
  *
- * 1. IORING_OP_POLL_ADD - adds a file descriptor to be monitored.
+ * 1. IORING_OP_POLL_ADD - adds a file descriptor to be monitored.  Multishot
+ *    poll is edge-triggered, but AioHandlers expect level-triggered
+ *    monitoring: a handler that leaves data in the fd would never be
+ *    called again.  So the request is one-shot and re-armed after each
+ *    event, except for handlers that always drain their fd, like those of
+ *    EventNotifiers.  When the kernel supports it, their request is
+ *    multishot and stays armed, so busy notifiers need no new sqe after
+ *    each wakeup.
  * 2. IORING_OP_POLL_REMOVE - removes a file descriptor being monitored.  When
  *    the poll mask changes for a file descriptor it is first removed and then
  *    re-added with the new poll mask, so this operation is also used as part
@@ -37,6 +44,9 @@
  * io_uring calls the submission queue the "sq ring" and the completion queue
  * the "cq ring".  Ring entries are called "sqe" and "cqe", respectively.
  *
+ * When there is nothing to submit and nothing to wait for, the cq ring is
+ * read directly without calling io_uring_enter(2).
+ *
  * The code is structured so that sq/cq rings are only modified within
  * fdmon_io_uring_wait().  Changes to AioHandlers are made by enqueuing them on
  * ctx->submit_list so that fdmon_io_uring_wait() can submit IORING_OP_POLL_ADD
@@ -172,6 +182,11 @@ static void add_poll_add_sqe(AioContext *ctx, AioHandler *node)
     int events = poll_events_from_pfd(node->pfd.events);
 
     io_uring_prep_poll_add(sqe, node->pfd.fd, events);
+#ifdef IORING_POLL_ADD_MULTI
+    if (ctx->fdmon_io_uring_multishot && node->drains_fd) {
+        sqe->len |= IORING_POLL_ADD_MULTI;
+    }
+#endif
     io_uring_sqe_set_data(sqe, node);
 }
 
@@ -221,6 +236,7 @@ static bool process_cqe(AioContext *ctx,
                         struct io_uring_cqe *cqe)
 {
     AioHandler *node = io_uring_cqe_get_data(cqe);
+    bool armed = false;
     unsigned flags;
 
     /* poll_timeout and poll_remove have a zero user_data field */
@@ -228,21 +244,45 @@ static bool process_cqe(AioContext *ctx,
         return false;
     }
 
-    /*
-     * Deletion can only happen when IORING_OP_POLL_ADD completes.  If we race
-     * with enqueue() here then we can safely clear the FDMON_IO_URING_REMOVE
-     * bit before IORING_OP_POLL_REMOVE is submitted.
-     */
-    flags = qatomic_fetch_and(&node->flags, ~FDMON_IO_URING_REMOVE);
-    if (flags & FDMON_IO_URING_REMOVE) {
-        QLIST_INSERT_HEAD_RCU(&ctx->deleted_aio_handlers, node, node_deleted);
+#ifdef IORING_CQE_F_MORE
+    /* A multishot IORING_OP_POLL_ADD stays armed until a cqe without F_MORE */
+    armed = cqe->flags & IORING_CQE_F_MORE;
+#endif
+
+    if (!armed) {
+        /*
+         * Deletion can only happen when IORING_OP_POLL_ADD completes.  If we
+         * race with enqueue() here then we can safely clear the
+         * FDMON_IO_URING_REMOVE bit before IORING_OP_POLL_REMOVE is
+         * submitted.
+         */
+        flags = qatomic_fetch_and(&node->flags, ~FDMON_IO_URING_REMOVE);
+        if (flags & FDMON_IO_URING_REMOVE) {
+            QLIST_INSERT_HEAD_RCU(&ctx->deleted_aio_handlers, node,
+                                  node_deleted);
+            return false;
+        }
+    } else if (qatomic_read(&node->flags) & FDMON_IO_URING_REMOVE) {
+        /* The handler is going away, wait for the final cqe */
+        return false;
+    }
+
+    if (cqe->res == -EINVAL && node->drains_fd) {
+        /*
+         * The kernel predates multishot poll, use one-shot requests.  Other
+         * multishot requests that were in flight fail the same way.
+         */
+        ctx->fdmon_io_uring_multishot = false;
+        add_poll_add_sqe(ctx, node);
         return false;
     }
 
     aio_add_ready_handler(ready_list, node, pfd_events_from_poll(cqe->res));
 
-    /* IORING_OP_POLL_ADD is one-shot so we must re-arm it */
-    add_poll_add_sqe(ctx, node);
+    /* One-shot requests and terminated multishot requests must be re-armed */
+    if (!armed) {
+        add_poll_add_sqe(ctx, node);
+    }
     return true;
 }
 
@@ -266,9 +306,20 @@ static int process_cq_ring(AioContext *ctx, AioHandlerList *ready_list)
     return num_ready;
 }
 
+/* Does io_uring_enter(2) have to be called to move completions to the cq? */
+static bool cq_overflowed(AioContext *ctx)
+{
+#ifdef IORING_SQ_CQ_OVERFLOW
+    return qatomic_read(ctx->fdmon_io_uring.sq.kflags) & IORING_SQ_CQ_OVERFLOW;
+#else
+    return false;
+#endif
+}
+
 static int fdmon_io_uring_wait(AioContext *ctx, AioHandlerList *ready_list,
                                int64_t timeout)
 {
+    struct io_uring *ring = &ctx->fdmon_io_uring;
     unsigned wait_nr = 1; /* block until at least one cqe is ready */
     int ret;
 
@@ -277,7 +328,7 @@ static int fdmon_io_uring_wait(AioContext *ctx, AioHandlerList *ready_list,
         return fdmon_poll_ops.wait(ctx, ready_list, timeout);
     }
 
-    if (timeout == 0) {
+    if (timeout == 0 || io_uring_cq_ready(ring)) {
         wait_nr = 0; /* non-blocking */
     } else if (timeout > 0) {
         add_timeout_sqe(ctx, timeout);
@@ -285,11 +336,19 @@ static int fdmon_io_uring_wait(AioContext *ctx, AioHandlerList *ready_list,
 
     fill_sq_ring(ctx);
 
-    do {
-        ret = io_uring_submit_and_wait(&ctx->fdmon_io_uring, wait_nr);
-    } while (ret == -EINTR);
+    /*
+     * The cq ring is shared with the kernel, so only enter it when there are
+     * sqes to submit or cqes to wait for.  Non-blocking iterations that
+     * only see EventNotifier events, as in polling mode, then make no
+     * system call.
+     */
+    if (wait_nr || io_uring_sq_ready(ring) || cq_overflowed(ctx)) {
+        do {
+            ret = io_uring_submit_and_wait(ring, wait_nr);
+        } while (ret == -EINTR);
 
-    assert(ret >= 0);
+        assert(ret >= 0);
+    }
 
     return process_cq_ring(ctx, ready_list);
 }
@@ -331,6 +390,9 @@ bool fdmon_io_uring_setup(AioContext *ctx)
     }
 
     QSLIST_INIT(&ctx->submit_list);
+#ifdef IORING_POLL_ADD_MULTI
+    ctx->fdmon_io_uring_multishot = true;
+#endif
     ctx->fdmon_ops = &fdmon_io_uring_ops;
     return true;
 }
@@ -12,6 +12,7 @@
 #include "qemu/osdep.h"
 #include "qemu/hbitmap.h"
 #include "qemu/host-utils.h"
+#include "qemu/cutils.h"
 #include "trace.h"
 #include "crypto/hash.h"
 
@@ -50,8 +51,27 @@
  * extremely sparse, this is also O(m + m/W + m/W^2 + ...), so the amortized
  * cost of advancing from one bit to the next is usually constant (worst case
  * O(logB n) as in the non-amortized complexity).
+ *
+ * The last level, which takes most of the memory, is split in leaves of
+ * HBITMAP_LEAF_WORDS words.  A leaf is only allocated once it has some bits
+ * set but not all of them: all-zero leaves are NULL and all-one leaves point
+ * to a shared leaf, so a bitmap with a few dirty areas in a huge disk costs
+ * little more than its upper levels (1/64 of the size of a flat bitmap).
+ * Merging and serializing skip empty and full leaves as well.
  */
 
+#define HBITMAP_LEAF_SHIFT 9
+#define HBITMAP_LEAF_WORDS (1 << HBITMAP_LEAF_SHIFT)
+
+static const unsigned long hb_zero_leaf[HBITMAP_LEAF_WORDS];
+static const unsigned long hb_ones_leaf[HBITMAP_LEAF_WORDS] = {
+    [0 ... HBITMAP_LEAF_WORDS - 1] = ~0UL,
+};
+
+/* The shared full leaf, which is never written */
+#define HB_ONES_LEAF ((unsigned long *)hb_ones_leaf)
+#define HB_LEAF_BYTES sizeof(hb_ones_leaf)
+
 struct HBitmap {
     /*
      * Size of the bitmap, as requested in hbitmap_alloc or in hbitmap_truncate.
@@ -94,13 +114,73 @@ struct HBitmap {
      *
      * Note that all bitmaps have the same number of levels.  Even a 1-bit
      * bitmap will still allocate HBITMAP_LEVELS arrays.
+     *
+     * The last level is not in this array but in @leaves, see
+     * hb_word() and hb_elem().
      */
-    unsigned long *levels[HBITMAP_LEVELS];
+    unsigned long *levels[HBITMAP_LEVELS - 1];
+
+    /* The leaves of the last level: NULL, HB_ONES_LEAF or private. */
+    unsigned long **leaves;
 
-    /* The length of each levels[] array. */
+    /* The length of each level, in words. */
     uint64_t sizes[HBITMAP_LEVELS];
 };
 
+static uint64_t hb_leaf_count(const HBitmap *hb)
+{
+    return DIV_ROUND_UP(hb->sizes[HBITMAP_LEVELS - 1], HBITMAP_LEAF_WORDS);
+}
+
+/* Return word @pos of @level. */
+static inline unsigned long hb_word(const HBitmap *hb, int level, uint64_t pos)
+{
+    const unsigned long *leaf;
+
+    if (level < HBITMAP_LEVELS - 1) {
+        return hb->levels[level][pos];
+    }
+    leaf = hb->leaves[pos >> HBITMAP_LEAF_SHIFT];
+    return leaf ? leaf[pos & (HBITMAP_LEAF_WORDS - 1)] : 0;
+}
+
+/* Return a pointer to word @pos of @level, making its leaf private. */
+static unsigned long *hb_elem(HBitmap *hb, int level, uint64_t pos)
+{
+    unsigned long **leaf;
+
+    if (level < HBITMAP_LEVELS - 1) {
+        return &hb->levels[level][pos];
+    }
+    leaf = &hb->leaves[pos >> HBITMAP_LEAF_SHIFT];
+    if (!*leaf) {
+        *leaf = g_new0(unsigned long, HBITMAP_LEAF_WORDS);
+    } else if (*leaf == HB_ONES_LEAF) {
+        *leaf = g_memdup(hb_ones_leaf, HB_LEAF_BYTES);
+    }
+    return &(*leaf)[pos & (HBITMAP_LEAF_WORDS - 1)];
+}
+
+static void hb_set_leaf(HBitmap *hb, uint64_t idx, unsigned long *leaf)
+{
+    if (hb->leaves[idx] != HB_ONES_LEAF) {
+        g_free(hb->leaves[idx]);
+    }
+    hb->leaves[idx] = leaf;
+}
+
+static bool hb_leaf_has(const unsigned long *leaf, unsigned long val)
+{
+    int i;
+
+    for (i = 0; i < HBITMAP_LEAF_WORDS; i++) {
+        if (leaf[i] == val) {
+            return true;
+        }
+    }
+    return false;
+}
+
 /* Advance hbi to the next nonzero word and return it.  hbi->pos
  * is updated.  Returns zero if we reach the end of the bitmap.
  */
@@ -114,7 +194,7 @@ static unsigned long hbitmap_iter_skip_words(HBitmapIter *hbi)
     do {
         i--;
         pos >>= BITS_PER_LEVEL;
-        cur = hbi->cur[i] & hb->levels[i][pos];
+        cur = hbi->cur[i] & hb_word(hb, i, pos);
     } while (cur == 0);
 
     /* Check for end of iteration.  We always use fewer than BITS_PER_LONG
@@ -136,7 +216,7 @@ static unsigned long hbitmap_iter_skip_words(HBitmapIter *hbi)
         hbi->cur[i] = cur & (cur - 1);
 
         /* Set up next level for iteration.  */
-        cur = hb->levels[i + 1][pos];
+        cur = hb_word(hb, i + 1, pos);
     }
 
     hbi->pos = pos;
@@ -149,7 +229,7 @@ static unsigned long hbitmap_iter_skip_words(HBitmapIter *hbi)
 int64_t hbitmap_iter_next(HBitmapIter *hbi)
 {
     unsigned long cur = hbi->cur[HBITMAP_LEVELS - 1] &
-            hbi->hb->levels[HBITMAP_LEVELS - 1][hbi->pos];
+            hb_word(hbi->hb, HBITMAP_LEVELS - 1, hbi->pos);
     int64_t item;
 
     if (cur == 0) {
@@ -182,7 +262,7 @@ void hbitmap_iter_init(HBitmapIter *hbi, const HBitmap *hb, uint64_t first)
         pos >>= BITS_PER_LEVEL;
 
         /* Drop bits representing items before first.  */
-        hbi->cur[i] = hb->levels[i][pos] & ~((1UL << bit) - 1);
+        hbi->cur[i] = hb_word(hb, i, pos) & ~((1UL << bit) - 1);
 
         /* We have already added level i+1, so the lowest set bit has
          * been processed.  Clear it.
@@ -220,8 +300,7 @@ int64_t hbitmap_next_dirty(const HBitmap *hb, int64_t start, int64_t count)
 int64_t hbitmap_next_zero(const HBitmap *hb, int64_t start, int64_t count)
 {
     size_t pos = (start >> hb->granularity) >> BITS_PER_LEVEL;
-    unsigned long *last_lev = hb->levels[HBITMAP_LEVELS - 1];
-    unsigned long cur = last_lev[pos];
+    unsigned long cur;
     unsigned start_bit_offset;
     uint64_t end_bit, sz;
     int64_t res;
@@ -241,19 +320,25 @@ int64_t hbitmap_next_zero(const HBitmap *hb, int64_t start, int64_t count)
      * in them, let's set them.
      */
     start_bit_offset = (start >> hb->granularity) & (BITS_PER_LONG - 1);
+    cur = hb_word(hb, HBITMAP_LEVELS - 1, pos);
     cur |= (1UL << start_bit_offset) - 1;
     assert((start >> hb->granularity) < hb->size);
 
     if (cur == (unsigned long)-1) {
         do {
             pos++;
-        } while (pos < sz && last_lev[pos] == (unsigned long)-1);
+            while (pos < sz && !(pos & (HBITMAP_LEAF_WORDS - 1)) &&
+                   hb->leaves[pos >> HBITMAP_LEAF_SHIFT] == HB_ONES_LEAF) {
+                pos += HBITMAP_LEAF_WORDS;
+            }
+        } while (pos < sz &&
+                 hb_word(hb, HBITMAP_LEVELS - 1, pos) == (unsigned long)-1);
 
         if (pos >= sz) {
             return -1;
         }
 
-        cur = last_lev[pos];
+        cur = hb_word(hb, HBITMAP_LEVELS - 1, pos);
     }
 
     res = (pos << BITS_PER_LEVEL) + ctol(cur);
@@ -393,6 +478,16 @@ static inline bool hb_set_elem(unsigned long *elem, uint64_t start, uint64_t las
     return old != *elem;
 }
 
+/* Like hb_set_elem, but do not unshare full leaves. */
+static bool hb_set_word(HBitmap *hb, int level, uint64_t pos,
+                        uint64_t start, uint64_t last)
+{
+    if (hb_word(hb, level, pos) == ~0UL) {
+        return false;
+    }
+    return hb_set_elem(hb_elem(hb, level, pos), start, last);
+}
+
 /* The recursive workhorse (the depth is limited to HBITMAP_LEVELS)...
  * Returns true if at least one bit is changed. */
 static bool hb_set_between(HBitmap *hb, int level, uint64_t start,
@@ -406,18 +501,36 @@ static bool hb_set_between(HBitmap *hb, int level, uint64_t start,
     i = pos;
     if (i < lastpos) {
         uint64_t next = (start | (BITS_PER_LONG - 1)) + 1;
-        changed |= hb_set_elem(&hb->levels[level][i], start, next - 1);
+        changed |= hb_set_word(hb, level, i, start, next - 1);
         for (;;) {
+            unsigned long *elem;
+
             start = next;
             next += BITS_PER_LONG;
             if (++i == lastpos) {
                 break;
             }
-            changed |= (hb->levels[level][i] == 0);
-            hb->levels[level][i] = ~0UL;
+            if (level == HBITMAP_LEVELS - 1 &&
+                !(i & (HBITMAP_LEAF_WORDS - 1)) &&
+                lastpos - i >= HBITMAP_LEAF_WORDS) {
+                /* The whole leaf is set, switch to the shared one */
+                unsigned long *leaf = hb->leaves[i >> HBITMAP_LEAF_SHIFT];
+
+                changed |= !leaf || (leaf != HB_ONES_LEAF &&
+                                     hb_leaf_has(leaf, 0));
+                hb_set_leaf(hb, i >> HBITMAP_LEAF_SHIFT, HB_ONES_LEAF);
+                i += HBITMAP_LEAF_WORDS - 1;
+                next += (HBITMAP_LEAF_WORDS - 1) * BITS_PER_LONG;
+                continue;
+            }
+            if (hb_word(hb, level, i) != ~0UL) {
+                elem = hb_elem(hb, level, i);
+                changed |= (*elem == 0);
+                *elem = ~0UL;
+            }
         }
     }
-    changed |= hb_set_elem(&hb->levels[level][i], start, last);
+    changed |= hb_set_word(hb, level, i, start, last);
 
     /* If there was any change in this layer, we may have to update
      * the one above.
@@ -471,6 +584,16 @@ static inline bool hb_reset_elem(unsigned long *elem, uint64_t start, uint64_t l
     return blanked;
 }
 
+/* Like hb_reset_elem, but leave absent leaves alone. */
+static bool hb_reset_word(HBitmap *hb, int level, uint64_t pos,
+                          uint64_t start, uint64_t last)
+{
+    if (!hb_word(hb, level, pos)) {
+        return false;
+    }
+    return hb_reset_elem(hb_elem(hb, level, pos), start, last);
+}
+
 /* The recursive workhorse (the depth is limited to HBITMAP_LEVELS)...
  * Returns true if at least one bit is changed. */
 static bool hb_reset_between(HBitmap *hb, int level, uint64_t start,
@@ -490,7 +613,7 @@ static bool hb_reset_between(HBitmap *hb, int level, uint64_t start,
          * unless the lower-level word became entirely zero.  So, remove pos
          * from the upper-level range if bits remain set.
          */
-        if (hb_reset_elem(&hb->levels[level][i], start, next - 1)) {
+        if (hb_reset_word(hb, level, i, start, next - 1)) {
             changed = true;
         } else {
             pos++;
@@ -502,13 +625,28 @@ static bool hb_reset_between(HBitmap *hb, int level, uint64_t start,
             if (++i == lastpos) {
                 break;
             }
-            changed |= (hb->levels[level][i] != 0);
-            hb->levels[level][i] = 0UL;
+            if (level == HBITMAP_LEVELS - 1 &&
+                !(i & (HBITMAP_LEAF_WORDS - 1)) &&
+                lastpos - i >= HBITMAP_LEAF_WORDS) {
+                /* The whole leaf is cleared, free it */
+                unsigned long *leaf = hb->leaves[i >> HBITMAP_LEAF_SHIFT];
+
+                changed |= leaf && (leaf == HB_ONES_LEAF ||
+                                    !buffer_is_zero(leaf, HB_LEAF_BYTES));
+                hb_set_leaf(hb, i >> HBITMAP_LEAF_SHIFT, NULL);
+                i += HBITMAP_LEAF_WORDS - 1;
+                next += (HBITMAP_LEAF_WORDS - 1) * BITS_PER_LONG;
+                continue;
+            }
+            if (hb_word(hb, level, i)) {
+                *hb_elem(hb, level, i) = 0UL;
+                changed = true;
+            }
         }
     }
 
     /* Same as above, this time for lastpos.  */
-    if (hb_reset_elem(&hb->levels[level][i], start, last)) {
+    if (hb_reset_word(hb, level, i, start, last)) {
         changed = true;
     } else {
         lastpos--;
@@ -522,6 +660,33 @@ static bool hb_reset_between(HBitmap *hb, int level, uint64_t start,
 
 }
 
+/*
+ * Free the leaves that cover words @first..@last of the last level and have
+ * become empty.  The level above is up to date, so look at it instead of the
+ * whole leaf.
+ */
+static void hb_trim_leaves(HBitmap *hb, uint64_t first, uint64_t last)
+{
+    const uint64_t n = HBITMAP_LEAF_WORDS >> BITS_PER_LEVEL;
+    const unsigned long *up = hb->levels[HBITMAP_LEVELS - 2];
+    uint64_t i, j;
+
+    last >>= HBITMAP_LEAF_SHIFT;
+    for (i = first >> HBITMAP_LEAF_SHIFT; i <= last; i++) {
+        uint64_t end = MIN((i + 1) * n, hb->sizes[HBITMAP_LEVELS - 2]);
+
+        if (!hb->leaves[i] || hb->leaves[i] == HB_ONES_LEAF) {
+            continue;
+        }
+        for (j = i * n; j < end && !up[j]; j++) {
+            /* nothing */
+        }
+        if (j == end) {
+            hb_set_leaf(hb, i, NULL);
+        }
+    }
+}
+
 void hbitmap_reset(HBitmap *hb, uint64_t start, uint64_t count)
 {
     /* Compute range in the last layer.  */
@@ -544,18 +709,25 @@ void hbitmap_reset(HBitmap *hb, uint64_t start, uint64_t count)
     assert(last < hb->size);
 
     hb->count -= hb_count_between(hb, first, last);
-    if (hb_reset_between(hb, HBITMAP_LEVELS - 1, first, last) &&
-        hb->meta) {
-        hbitmap_set(hb->meta, start, count);
+    if (hb_reset_between(hb, HBITMAP_LEVELS - 1, first, last)) {
+        hb_trim_leaves(hb, first >> BITS_PER_LEVEL, last >> BITS_PER_LEVEL);
+        if (hb->meta) {
+            hbitmap_set(hb->meta, start, count);
+        }
     }
 }
 
 void hbitmap_reset_all(HBitmap *hb)
 {
     unsigned int i;
+    uint64_t j;
+
+    for (j = 0; j < hb_leaf_count(hb); j++) {
+        hb_set_leaf(hb, j, NULL);
+    }
 
     /* Same as hbitmap_alloc() except for memset() instead of malloc() */
-    for (i = HBITMAP_LEVELS; --i >= 1; ) {
+    for (i = HBITMAP_LEVELS - 1; --i >= 1; ) {
         memset(hb->levels[i], 0, hb->sizes[i] * sizeof(unsigned long));
     }
 
@@ -588,7 +760,7 @@ bool hbitmap_get(const HBitmap *hb, uint64_t item)
     unsigned long bit = 1UL << (pos & (BITS_PER_LONG - 1));
     assert(pos < hb->size);
 
-    return (hb->levels[HBITMAP_LEVELS - 1][pos >> BITS_PER_LEVEL] & bit) != 0;
+    return (hb_word(hb, HBITMAP_LEVELS - 1, pos >> BITS_PER_LEVEL) & bit) != 0;
 }
 
 uint64_t hbitmap_serialization_align(const HBitmap *hb)
@@ -605,7 +777,7 @@ uint64_t hbitmap_serialization_align(const HBitmap *hb)
  */
 static void serialization_chunk(const HBitmap *hb,
                                 uint64_t start, uint64_t count,
-                                unsigned long **first_el, uint64_t *el_count)
+                                uint64_t *first_el, uint64_t *el_count)
 {
     uint64_t last = start + count - 1;
     uint64_t gran = hbitmap_serialization_align(hb);
@@ -619,15 +791,38 @@ static void serialization_chunk(const HBitmap *hb,
     start = (start >> hb->granularity) >> BITS_PER_LEVEL;
     last = (last >> hb->granularity) >> BITS_PER_LEVEL;
 
-    *first_el = &hb->levels[HBITMAP_LEVELS - 1][start];
+    *first_el = start;
     *el_count = last - start + 1;
 }
 
+/*
+ * Fill @count words of the last level from @pos with zeroes or ones,
+ * dropping or sharing the leaves that are covered entirely.
+ */
+static void hb_fill_words(HBitmap *hb, uint64_t pos, uint64_t count, bool ones)
+{
+    uint64_t end = pos + count;
+
+    while (pos < end) {
+        if (!(pos & (HBITMAP_LEAF_WORDS - 1)) &&
+            end - pos >= HBITMAP_LEAF_WORDS) {
+            hb_set_leaf(hb, pos >> HBITMAP_LEAF_SHIFT,
+                        ones ? HB_ONES_LEAF : NULL);
+            pos += HBITMAP_LEAF_WORDS;
+            continue;
+        }
+        if (ones || hb->leaves[pos >> HBITMAP_LEAF_SHIFT]) {
+            *hb_elem(hb, HBITMAP_LEVELS - 1, pos) = ones ? ~0UL : 0;
+        }
+        pos++;
+    }
+}
+
 uint64_t hbitmap_serialization_size(const HBitmap *hb,
                                     uint64_t start, uint64_t count)
 {
     uint64_t el_count;
-    unsigned long *cur;
+    uint64_t cur;
 
     if (!count) {
         return 0;
@@ -641,7 +836,7 @@ void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
                             uint64_t start, uint64_t count)
 {
     uint64_t el_count;
-    unsigned long *cur, *end;
+    uint64_t cur, end;
 
     if (!count) {
         return;
@@ -650,9 +845,9 @@ void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
     end = cur + el_count;
 
     while (cur != end) {
-        unsigned long el =
-            (BITS_PER_LONG == 32 ? cpu_to_le32(*cur) : cpu_to_le64(*cur));
+        unsigned long el = hb_word(hb, HBITMAP_LEVELS - 1, cur);
 
+        el = (BITS_PER_LONG == 32 ? cpu_to_le32(el) : cpu_to_le64(el));
         memcpy(buf, &el, sizeof(el));
         buf += sizeof(el);
         cur++;
@@ -664,7 +859,7 @@ void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
                               bool finish)
 {
     uint64_t el_count;
-    unsigned long *cur, *end;
+    uint64_t cur, end;
 
     if (!count) {
         return;
@@ -673,12 +868,17 @@ void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
     end = cur + el_count;
 
     while (cur != end) {
-        memcpy(cur, buf, sizeof(*cur));
+        unsigned long el;
+
+        memcpy(&el, buf, sizeof(el));
 
         if (BITS_PER_LONG == 32) {
-            le32_to_cpus((uint32_t *)cur);
+            le32_to_cpus((uint32_t *)&el);
         } else {
-            le64_to_cpus((uint64_t *)cur);
+            le64_to_cpus((uint64_t *)&el);
+        }
+        if (el || hb->leaves[cur >> HBITMAP_LEAF_SHIFT]) {
+            *hb_elem(hb, HBITMAP_LEVELS - 1, cur) = el;
         }
 
         buf += sizeof(unsigned long);
@@ -693,14 +893,14 @@ void hbitmap_deserialize_zeroes(HBitmap *hb, uint64_t start, uint64_t count,
                                 bool finish)
 {
     uint64_t el_count;
-    unsigned long *first;
+    uint64_t first;
 
     if (!count) {
         return;
     }
     serialization_chunk(hb, start, count, &first, &el_count);
 
-    memset(first, 0, el_count * sizeof(unsigned long));
+    hb_fill_words(hb, first, el_count, false);
     if (finish) {
         hbitmap_deserialize_finish(hb);
     }
@@ -710,14 +910,14 @@ void hbitmap_deserialize_ones(HBitmap *hb, uint64_t start, uint64_t count,
                               bool finish)
 {
     uint64_t el_count;
-    unsigned long *first;
+    uint64_t first;
 
     if (!count) {
         return;
     }
     serialization_chunk(hb, start, count, &first, &el_count);
 
-    memset(first, 0xff, el_count * sizeof(unsigned long));
+    hb_fill_words(hb, first, el_count, true);
     if (finish) {
         hbitmap_deserialize_finish(hb);
     }
@@ -737,7 +937,13 @@ void hbitmap_deserialize_finish(HBitmap *bitmap)
         memset(bitmap->levels[lev], 0, size * sizeof(unsigned long));
 
         for (i = 0; i < prev_size; ++i) {
-            if (bitmap->levels[lev + 1][i]) {
+            if (lev + 1 == HBITMAP_LEVELS - 1 &&
+                !(i & (HBITMAP_LEAF_WORDS - 1)) &&
+                !bitmap->leaves[i >> HBITMAP_LEAF_SHIFT]) {
+                i += HBITMAP_LEAF_WORDS - 1;
+                continue;
+            }
+            if (hb_word(bitmap, lev + 1, i)) {
                 bitmap->levels[lev][i >> BITS_PER_LEVEL] |=
                     1UL << (i & (BITS_PER_LONG - 1));
             }
@@ -751,8 +957,14 @@ void hbitmap_deserialize_finish(HBitmap *bitmap)
 void hbitmap_free(HBitmap *hb)
 {
     unsigned i;
+    uint64_t j;
+
     assert(!hb->meta);
-    for (i = HBITMAP_LEVELS; i-- > 0; ) {
+    for (j = 0; j < hb_leaf_count(hb); j++) {
+        hb_set_leaf(hb, j, NULL);
+    }
+    g_free(hb->leaves);
+    for (i = HBITMAP_LEVELS - 1; i-- > 0; ) {
         g_free(hb->levels[i]);
     }
     g_free(hb);
@@ -775,8 +987,11 @@ HBitmap *hbitmap_alloc(uint64_t size, int granularity)
     for (i = HBITMAP_LEVELS; i-- > 0; ) {
         size = MAX((size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL, 1);
         hb->sizes[i] = size;
-        hb->levels[i] = g_new0(unsigned long, size);
+        if (i < HBITMAP_LEVELS - 1) {
+            hb->levels[i] = g_new0(unsigned long, size);
+        }
     }
+    hb->leaves = g_new0(unsigned long *, hb_leaf_count(hb));
 
     /* We necessarily have free bits in level 0 due to the definition
      * of HBITMAP_LEVELS, so use one for a sentinel.  This speeds up
@@ -829,6 +1044,20 @@ void hbitmap_truncate(HBitmap *hb, uint64_t size)
         }
         old = hb->sizes[i];
         hb->sizes[i] = size;
+        if (i == HBITMAP_LEVELS - 1) {
+            uint64_t j, old_leaves;
+
+            old_leaves = DIV_ROUND_UP(old, HBITMAP_LEAF_WORDS);
+            for (j = hb_leaf_count(hb); j < old_leaves; j++) {
+                hb_set_leaf(hb, j, NULL);
+            }
+            hb->leaves = g_renew(unsigned long *, hb->leaves,
+                                 hb_leaf_count(hb));
+            for (j = old_leaves; j < hb_leaf_count(hb); j++) {
+                hb->leaves[j] = NULL;
+            }
+            continue;
+        }
         hb->levels[i] = g_realloc(hb->levels[i], size * sizeof(unsigned long));
         if (!shrink) {
             memset(&hb->levels[i][old], 0x00,
@@ -864,6 +1093,34 @@ static void hbitmap_sparse_merge(HBitmap *dst, const HBitmap *src)
     }
 }
 
+/* Set leaf @idx of @result to @la | @lb; either may alias the old leaf. */
+static void hb_merge_leaf(HBitmap *result, uint64_t idx,
+                          unsigned long *la, unsigned long *lb)
+{
+    unsigned long *dst = result->leaves[idx];
+    int k;
+
+    if (la == HB_ONES_LEAF || lb == HB_ONES_LEAF) {
+        hb_set_leaf(result, idx, HB_ONES_LEAF);
+        return;
+    }
+    if (!la || !lb) {
+        unsigned long *src = la ? la : lb;
+
+        if (src != dst) {
+            hb_set_leaf(result, idx, src ? g_memdup(src, HB_LEAF_BYTES) : NULL);
+        }
+        return;
+    }
+    if (dst != la && dst != lb) {
+        dst = g_new(unsigned long, HBITMAP_LEAF_WORDS);
+        hb_set_leaf(result, idx, dst);
+    }
+    for (k = 0; k < HBITMAP_LEAF_WORDS; k++) {
+        dst[k] = la[k] | lb[k];
+    }
+}
+
 /**
  * Given HBitmaps A and B, let R := A (BITOR) B.
  * Bitmaps A and B will not be modified,
@@ -905,16 +1162,20 @@ bool hbitmap_merge(const HBitmap *a, const HBitmap *b, HBitmap *result)
         return true;
     }
 
-    /* This merge is O(size), as BITS_PER_LONG and HBITMAP_LEVELS are constant.
-     * It may be possible to improve running times for sparsely populated maps
-     * by using hbitmap_iter_next, but this is suboptimal for dense maps.
+    /*
+     * The upper levels are merged word by word, which is O(size / 64) with
+     * the last level left out; the last level only costs time for the leaves
+     * that are not empty or full.
      */
     assert(a->size == b->size);
-    for (i = HBITMAP_LEVELS - 1; i >= 0; i--) {
+    for (i = HBITMAP_LEVELS - 2; i >= 0; i--) {
         for (j = 0; j < a->sizes[i]; j++) {
             result->levels[i][j] = a->levels[i][j] | b->levels[i][j];
         }
     }
+    for (j = 0; j < hb_leaf_count(a); j++) {
+        hb_merge_leaf(result, j, a->leaves[j], b->leaves[j]);
+    }
 
     /* Recompute the dirty count */
     result->count = hb_count_between(result, 0, result->size - 1);
@@ -925,9 +1186,20 @@ bool hbitmap_merge(const HBitmap *a, const HBitmap *b, HBitmap *result)
 char *hbitmap_sha256(const HBitmap *bitmap, Error **errp)
 {
     size_t size = bitmap->sizes[HBITMAP_LEVELS - 1] * sizeof(unsigned long);
-    char *data = (char *)bitmap->levels[HBITMAP_LEVELS - 1];
+    uint64_t i, n = hb_leaf_count(bitmap);
+    struct iovec *iov = g_new(struct iovec, n);
     char *hash = NULL;
-    qcrypto_hash_digest(QCRYPTO_HASH_ALG_SHA256, data, size, &hash, errp);
+
+    /* Hash the last level as if it was a flat array */
+    for (i = 0; i < n; i++) {
+        const unsigned long *leaf = bitmap->leaves[i];
+
+        iov[i].iov_base = (void *)(leaf ? leaf : hb_zero_leaf);
+        iov[i].iov_len = MIN(size, HB_LEAF_BYTES);
+        size -= iov[i].iov_len;
+    }
+    qcrypto_hash_digestv(QCRYPTO_HASH_ALG_SHA256, iov, n, &hash, errp);
+    g_free(iov);
 
     return hash;
 }
@@ -0,0 +1,120 @@
+/*
+ * Logarithmic histograms
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/host-utils.h"
+#include "qemu/log-histogram.h"
+
+void log_histogram_init(LogHistogram *h)
+{
+    int i;
+
+    stat64_init(&h->sum, 0);
+    stat64_init(&h->min, UINT64_MAX);
+    stat64_init(&h->max, 0);
+    for (i = 0; i < LOG_HISTOGRAM_BUCKETS; i++) {
+        stat64_init(&h->buckets[i], 0);
+    }
+}
+
+static int log_histogram_index(uint64_t value)
+{
+    int shift;
+
+    if (value < LOG_HISTOGRAM_SUB) {
+        return value;
+    }
+
+    shift = 63 - clz64(value) - LOG_HISTOGRAM_SUB_BITS;
+    return (shift + 1) * LOG_HISTOGRAM_SUB + (value >> shift) -
+           LOG_HISTOGRAM_SUB;
+}
+
+/* Returns the largest value that is counted in bucket @index */
+static uint64_t log_histogram_bucket_max(int index)
+{
+    int shift;
+    uint64_t sub;
+
+    if (index < LOG_HISTOGRAM_SUB) {
+        return index;
+    }
+
+    shift = index / LOG_HISTOGRAM_SUB - 1;
+    sub = index % LOG_HISTOGRAM_SUB + LOG_HISTOGRAM_SUB;
+    return (sub << shift) + ((1ULL << shift) - 1);
+}
+
+void log_histogram_add(LogHistogram *h, uint64_t value)
+{
+    stat64_add(&h->buckets[log_histogram_index(value)], 1);
+    stat64_add(&h->sum, value);
+    stat64_min(&h->min, value);
+    stat64_max(&h->max, value);
+}
+
+void log_histogram_add_single_writer(LogHistogram *h, uint64_t value)
+{
+    stat64_add_single_writer(&h->buckets[log_histogram_index(value)], 1);
+    stat64_add_single_writer(&h->sum, value);
+
+    /* These only write when the extremes change, which is rare */
+    stat64_min(&h->min, value);
+    stat64_max(&h->max, value);
+}
+
+uint64_t log_histogram_count(const LogHistogram *h)
+{
+    uint64_t count = 0;
+    int i;
+
+    for (i = 0; i < LOG_HISTOGRAM_BUCKETS; i++) {
+        count += stat64_get(&h->buckets[i]);
+    }
+
+    return count;
+}
+
+uint64_t log_histogram_percentile(const LogHistogram *h, unsigned per_mille)
+{
+    uint64_t count = log_histogram_count(h);
+    uint64_t target, seen = 0;
+    int i;
+
+    assert(per_mille <= 1000);
+    if (!count) {
+        return 0;
+    }
+
+    target = MAX(DIV_ROUND_UP(count * per_mille, 1000), 1);
+    for (i = 0; i < LOG_HISTOGRAM_BUCKETS; i++) {
+        seen += stat64_get(&h->buckets[i]);
+        if (seen >= target) {
+            return MIN(log_histogram_bucket_max(i), stat64_get(&h->max));
+        }
+    }
+
+    return stat64_get(&h->max);
+}
+
+LatencyPercentiles *log_histogram_get_percentiles(const LogHistogram *h)
+{
+    LatencyPercentiles *p = g_new0(LatencyPercentiles, 1);
+
+    p->count = log_histogram_count(h);
+    if (p->count) {
+        p->min = stat64_get(&h->min);
+        p->mean = stat64_get(&h->sum) / p->count;
+        p->max = stat64_get(&h->max);
+        p->p50 = log_histogram_percentile(h, 500);
+        p->p90 = log_histogram_percentile(h, 900);
+        p->p99 = log_histogram_percentile(h, 990);
+        p->p999 = log_histogram_percentile(h, 999);
+    }
+
+    return p;
+}
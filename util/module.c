@@ -20,9 +20,11 @@
 #include "qemu/queue.h"
 #include "qemu/module.h"
 #include "qemu/cutils.h"
+#include "qemu/timer.h"
 #ifdef CONFIG_MODULE_UPGRADES
 #include "qemu-version.h"
 #endif
+#include "trace.h"
 
 typedef struct ModuleEntry
 {
@@ -189,6 +191,42 @@ static const struct {
     { "ui-spice-core",   "ui-opengl"    },
 #endif
 };
+
+/*
+ * Directories to search for modules, in order of preference.  They do not
+ * change while QEMU runs, so they are only computed once.
+ */
+static char *module_dirs[4];
+static int module_n_dirs;
+
+static void module_init_dirs(void)
+{
+    const char *search_dir;
+#ifdef CONFIG_MODULE_UPGRADES
+    g_autofree char *version_dir = NULL;
+#endif
+
+    if (module_n_dirs) {
+        return;
+    }
+
+    search_dir = getenv("QEMU_MODULE_DIR");
+    if (search_dir != NULL) {
+        module_dirs[module_n_dirs++] = g_strdup(search_dir);
+    }
+    module_dirs[module_n_dirs++] = get_relocated_path(CONFIG_QEMU_MODDIR);
+    module_dirs[module_n_dirs++] = g_strdup(qemu_get_exec_dir());
+
+#ifdef CONFIG_MODULE_UPGRADES
+    version_dir = g_strcanon(g_strdup(QEMU_PKGVERSION),
+                             G_CSET_A_2_Z G_CSET_a_2_z G_CSET_DIGITS "+-.~",
+                             '_');
+    module_dirs[module_n_dirs++] = g_strdup_printf("/var/run/qemu/%s",
+                                                   version_dir);
+#endif
+
+    assert(module_n_dirs <= ARRAY_SIZE(module_dirs));
+}
 #endif
 
 bool module_load_one(const char *prefix, const char *lib_name, bool mayfail)
@@ -196,16 +234,12 @@ bool module_load_one(const char *prefix, const char *lib_name, bool mayfail)
     bool success = false;
 
 #ifdef CONFIG_MODULES
-    char *fname = NULL;
-#ifdef CONFIG_MODULE_UPGRADES
-    char *version_dir;
-#endif
-    const char *search_dir;
-    char *dirs[5];
+    char *fname;
     char *module_name;
-    int i = 0, n_dirs = 0;
+    int i;
     int ret, dep;
     bool export_symbols = false;
+    int64_t start;
     static GHashTable *loaded_modules;
 
     if (!g_module_supported()) {
@@ -218,6 +252,10 @@ bool module_load_one(const char *prefix, const char *lib_name, bool mayfail)
     }
 
     module_name = g_strdup_printf("%s%s", prefix, lib_name);
+    if (g_hash_table_contains(loaded_modules, module_name)) {
+        g_free(module_name);
+        return true;
+    }
 
     for (dep = 0; dep < ARRAY_SIZE(module_deps); dep++) {
         if (strcmp(module_name, module_deps[dep].name) == 0) {
@@ -230,49 +268,30 @@ bool module_load_one(const char *prefix, const char *lib_name, bool mayfail)
         }
     }
 
-    if (!g_hash_table_add(loaded_modules, module_name)) {
-        g_free(module_name);
-        return true;
-    }
-
-    search_dir = getenv("QEMU_MODULE_DIR");
-    if (search_dir != NULL) {
-        dirs[n_dirs++] = g_strdup_printf("%s", search_dir);
-    }
-    dirs[n_dirs++] = get_relocated_path(CONFIG_QEMU_MODDIR);
-    dirs[n_dirs++] = g_strdup(qemu_get_exec_dir());
-
-#ifdef CONFIG_MODULE_UPGRADES
-    version_dir = g_strcanon(g_strdup(QEMU_PKGVERSION),
-                             G_CSET_A_2_Z G_CSET_a_2_z G_CSET_DIGITS "+-.~",
-                             '_');
-    dirs[n_dirs++] = g_strdup_printf("/var/run/qemu/%s", version_dir);
-#endif
-
-    assert(n_dirs <= ARRAY_SIZE(dirs));
+    g_hash_table_add(loaded_modules, module_name);
 
-    for (i = 0; i < n_dirs; i++) {
+    module_init_dirs();
+    start = get_clock();
+    for (i = 0; i < module_n_dirs; i++) {
         fname = g_strdup_printf("%s/%s%s",
-                dirs[i], module_name, CONFIG_HOST_DSOSUF);
+                module_dirs[i], module_name, CONFIG_HOST_DSOSUF);
         ret = module_load_file(fname, mayfail, export_symbols);
-        g_free(fname);
-        fname = NULL;
         /* Try loading until loaded a module file */
         if (!ret) {
+            trace_module_load(module_name, fname,
+                              (get_clock() - start) / SCALE_US);
             success = true;
+            g_free(fname);
             break;
         }
+        g_free(fname);
     }
 
     if (!success) {
+        trace_module_load_failed(module_name);
         g_hash_table_remove(loaded_modules, module_name);
         g_free(module_name);
     }
-
-    for (i = 0; i < n_dirs; i++) {
-        g_free(dirs[i]);
-    }
-
 #endif
     return success;
 }
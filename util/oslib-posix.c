@@ -39,8 +39,11 @@
 #include "qemu/thread.h"
 #include <libgen.h>
 #include "qemu/cutils.h"
+#include "qemu/bitops.h"
+#include "qemu/queue.h"
 
 #ifdef CONFIG_LINUX
+#include <sched.h>
 #include <sys/syscall.h>
 #endif
 
@@ -72,22 +75,67 @@
 
 #define MAX_MEM_PREALLOC_THREAD_COUNT 16
 
+typedef struct MemsetContext MemsetContext;
+
 struct MemsetThread {
     char *addr;
     size_t numpages;
     size_t hpagesize;
     QemuThread pgthread;
     sigjmp_buf env;
+    MemsetContext *context;
 };
 typedef struct MemsetThread MemsetThread;
 
-static MemsetThread *memset_thread;
-static int memset_num_threads;
-static bool memset_thread_failed;
+/* The threads that preallocate one area */
+struct MemsetContext {
+    bool all_threads_created;
+    bool any_thread_failed;
+    MemsetThread *threads;
+    int num_threads;
+#ifdef CONFIG_LINUX
+    bool has_cpus;
+    cpu_set_t cpus;             /* Host CPUs the threads are bound to */
+#endif
+    QLIST_ENTRY(MemsetContext) next;
+};
+
+/* Preallocations in progress, only used by the thread that holds memset_lock */
+static QLIST_HEAD(, MemsetContext) memset_contexts =
+    QLIST_HEAD_INITIALIZER(memset_contexts);
+
+/*
+ * Set while the current thread touches pages.  The SIGBUS handler only
+ * looks at this, because it can't safely walk memset_contexts while
+ * another preallocation adds or removes a context.
+ */
+static __thread MemsetThread *memset_thread;
+
+/*
+ * Serializes preallocations from different threads, because they share
+ * the SIGBUS handler.  Held from os_mem_prealloc_begin_async() until
+ * os_mem_prealloc_wait(), so it must be recursive.
+ */
+static QemuRecMutex memset_lock;
+
+/* Set between os_mem_prealloc_begin_async() and os_mem_prealloc_wait() */
+static bool memset_async;
+static struct sigaction memset_oldact;
 
 static QemuMutex page_mutex;
 static QemuCond page_cond;
-static bool threads_created_flag;
+
+static void memset_init(void)
+{
+    static gsize initialized;
+
+    if (g_once_init_enter(&initialized)) {
+        qemu_rec_mutex_init(&memset_lock);
+        qemu_mutex_init(&page_mutex);
+        qemu_cond_init(&page_cond);
+        g_once_init_leave(&initialized, 1);
+    }
+}
 
 int qemu_get_thread_id(void)
 {
@@ -441,21 +489,33 @@ const char *qemu_get_exec_dir(void)
     return exec_dir;
 }
 
-static void sigbus_handler(int signal)
+static void sigbus_handler(int sig, siginfo_t *siginfo, void *ctx)
 {
-    int i;
     if (memset_thread) {
-        for (i = 0; i < memset_num_threads; i++) {
-            if (qemu_thread_is_self(&memset_thread[i].pgthread)) {
-                siglongjmp(memset_thread[i].env, 1);
-            }
-        }
+        siglongjmp(memset_thread->env, 1);
+    }
+
+    /*
+     * Not from a touching thread.  Preallocation can run while the guest
+     * does, for example for virtio-mem or hotplugged memory, so pass the
+     * signal on to the handler it replaced, which handles machine checks
+     * under KVM.
+     */
+    if (memset_oldact.sa_flags & SA_SIGINFO) {
+        memset_oldact.sa_sigaction(sig, siginfo, ctx);
+    } else if (memset_oldact.sa_handler == SIG_DFL) {
+        /* Die as we would have; the signal is delivered once we return */
+        signal(SIGBUS, SIG_DFL);
+        raise(SIGBUS);
+    } else if (memset_oldact.sa_handler != SIG_IGN) {
+        memset_oldact.sa_handler(sig);
     }
 }
 
 static void *do_touch_pages(void *arg)
 {
     MemsetThread *memset_args = (MemsetThread *)arg;
+    MemsetContext *context = memset_args->context;
     sigset_t set, oldset;
 
     /*
@@ -464,23 +524,32 @@ static void *do_touch_pages(void *arg)
      * clearing until all threads have been created.
      */
     qemu_mutex_lock(&page_mutex);
-    while(!threads_created_flag){
+    while (!context->all_threads_created) {
         qemu_cond_wait(&page_cond, &page_mutex);
     }
     qemu_mutex_unlock(&page_mutex);
 
+#ifdef CONFIG_LINUX
+    /* Zero the pages from the node they are allocated on */
+    if (context->has_cpus) {
+        sched_setaffinity(0, sizeof(context->cpus), &context->cpus);
+    }
+#endif
+
     /* unblock SIGBUS */
     sigemptyset(&set);
     sigaddset(&set, SIGBUS);
     pthread_sigmask(SIG_UNBLOCK, &set, &oldset);
 
     if (sigsetjmp(memset_args->env, 1)) {
-        memset_thread_failed = true;
+        context->any_thread_failed = true;
     } else {
         char *addr = memset_args->addr;
         size_t numpages = memset_args->numpages;
         size_t hpagesize = memset_args->hpagesize;
         size_t i;
+
+        memset_thread = memset_args;
         for (i = 0; i < numpages; i++) {
             /*
              * Read & write back the same value, so we don't
@@ -498,6 +567,7 @@ static void *do_touch_pages(void *arg)
             addr += hpagesize;
         }
     }
+    memset_thread = NULL;
     pthread_sigmask(SIG_SETMASK, &oldset, NULL);
     return NULL;
 }
@@ -514,80 +584,219 @@ static inline int get_memset_num_threads(int smp_cpus)
     return ret;
 }
 
-static bool touch_all_pages(char *area, size_t hpagesize, size_t numpages,
-                            int smp_cpus)
+#ifdef CONFIG_LINUX
+/* Add the host CPUs of NUMA node @node to @cpus */
+static void host_node_add_cpus(cpu_set_t *cpus, unsigned long node)
+{
+    g_autofree char *path = NULL;
+    g_autofree char *list = NULL;
+    const char *p;
+    unsigned long first, last;
+
+    path = g_strdup_printf("/sys/devices/system/node/node%lu/cpulist", node);
+    if (!g_file_get_contents(path, &list, NULL, NULL)) {
+        return;
+    }
+
+    /* The format is a comma separated list of CPUs or ranges of CPUs */
+    for (p = list; *p && *p != '\n'; p++) {
+        if (qemu_strtoul(p, &p, 10, &first) < 0) {
+            return;
+        }
+        last = first;
+        if (*p == '-' && qemu_strtoul(p + 1, &p, 10, &last) < 0) {
+            return;
+        }
+        for (; first <= last && first < CPU_SETSIZE; first++) {
+            CPU_SET(first, cpus);
+        }
+        if (*p != ',') {
+            break;
+        }
+    }
+}
+#endif
+
+static MemsetContext *touch_all_pages_start(char *area, size_t hpagesize,
+                                            size_t numpages, int smp_cpus,
+                                            const unsigned long *host_nodes,
+                                            unsigned long maxnode)
 {
-    static gsize initialized = 0;
+    MemsetContext *context = g_new0(MemsetContext, 1);
     size_t numpages_per_thread, leftover;
     char *addr = area;
     int i = 0;
 
-    if (g_once_init_enter(&initialized)) {
-        qemu_mutex_init(&page_mutex);
-        qemu_cond_init(&page_cond);
-        g_once_init_leave(&initialized, 1);
+#ifdef CONFIG_LINUX
+    if (host_nodes) {
+        unsigned long node;
+
+        CPU_ZERO(&context->cpus);
+        for (node = find_first_bit(host_nodes, maxnode); node < maxnode;
+             node = find_next_bit(host_nodes, maxnode, node + 1)) {
+            host_node_add_cpus(&context->cpus, node);
+        }
+        context->has_cpus = CPU_COUNT(&context->cpus) > 0;
     }
+#endif
 
-    memset_thread_failed = false;
-    threads_created_flag = false;
-    memset_num_threads = get_memset_num_threads(smp_cpus);
-    memset_thread = g_new0(MemsetThread, memset_num_threads);
-    numpages_per_thread = numpages / memset_num_threads;
-    leftover = numpages % memset_num_threads;
-    for (i = 0; i < memset_num_threads; i++) {
-        memset_thread[i].addr = addr;
-        memset_thread[i].numpages = numpages_per_thread + (i < leftover);
-        memset_thread[i].hpagesize = hpagesize;
-        qemu_thread_create(&memset_thread[i].pgthread, "touch_pages",
-                           do_touch_pages, &memset_thread[i],
+    context->num_threads = get_memset_num_threads(smp_cpus);
+    context->threads = g_new0(MemsetThread, context->num_threads);
+    QLIST_INSERT_HEAD(&memset_contexts, context, next);
+
+    numpages_per_thread = numpages / context->num_threads;
+    leftover = numpages % context->num_threads;
+    for (i = 0; i < context->num_threads; i++) {
+        context->threads[i].addr = addr;
+        context->threads[i].numpages = numpages_per_thread + (i < leftover);
+        context->threads[i].hpagesize = hpagesize;
+        context->threads[i].context = context;
+        qemu_thread_create(&context->threads[i].pgthread, "touch_pages",
+                           do_touch_pages, &context->threads[i],
                            QEMU_THREAD_JOINABLE);
-        addr += memset_thread[i].numpages * hpagesize;
+        addr += context->threads[i].numpages * hpagesize;
     }
 
     qemu_mutex_lock(&page_mutex);
-    threads_created_flag = true;
+    context->all_threads_created = true;
     qemu_cond_broadcast(&page_cond);
     qemu_mutex_unlock(&page_mutex);
 
-    for (i = 0; i < memset_num_threads; i++) {
-        qemu_thread_join(&memset_thread[i].pgthread);
+    return context;
+}
+
+/* Wait for the threads of @context and free it, return true on failure */
+static bool touch_all_pages_finish(MemsetContext *context)
+{
+    bool failed;
+    int i;
+
+    for (i = 0; i < context->num_threads; i++) {
+        qemu_thread_join(&context->threads[i].pgthread);
     }
-    g_free(memset_thread);
-    memset_thread = NULL;
+    QLIST_REMOVE(context, next);
+    failed = context->any_thread_failed;
+    g_free(context->threads);
+    g_free(context);
 
-    return memset_thread_failed;
+    return failed;
 }
 
-void os_mem_prealloc(int fd, char *area, size_t memory, int smp_cpus,
-                     Error **errp)
+static bool memset_sigbus_install(Error **errp)
 {
-    int ret;
-    struct sigaction act, oldact;
-    size_t hpagesize = qemu_fd_getpagesize(fd);
-    size_t numpages = DIV_ROUND_UP(memory, hpagesize);
+    struct sigaction act;
 
     memset(&act, 0, sizeof(act));
-    act.sa_handler = &sigbus_handler;
-    act.sa_flags = 0;
+    act.sa_sigaction = &sigbus_handler;
+    act.sa_flags = SA_SIGINFO;
 
-    ret = sigaction(SIGBUS, &act, &oldact);
-    if (ret) {
+    if (sigaction(SIGBUS, &act, &memset_oldact)) {
         error_setg_errno(errp, errno,
             "os_mem_prealloc: failed to install signal handler");
-        return;
+        return false;
+    }
+    return true;
+}
+
+static void memset_sigbus_restore(void)
+{
+    if (sigaction(SIGBUS, &memset_oldact, NULL)) {
+        /* Terminate QEMU since it can't recover from error */
+        perror("os_mem_prealloc: failed to reinstall signal handler");
+        exit(1);
+    }
+}
+
+void os_mem_prealloc_nodes(int fd, char *area, size_t memory, int smp_cpus,
+                           const unsigned long *host_nodes,
+                           unsigned long maxnode, Error **errp)
+{
+    size_t hpagesize = qemu_fd_getpagesize(fd);
+    size_t numpages = DIV_ROUND_UP(memory, hpagesize);
+    MemsetContext *context;
+
+    memset_init();
+    qemu_rec_mutex_lock(&memset_lock);
+    if (!memset_async && !memset_sigbus_install(errp)) {
+        goto out;
     }
 
     /* touch pages simultaneously */
-    if (touch_all_pages(area, hpagesize, numpages, smp_cpus)) {
+    context = touch_all_pages_start(area, hpagesize, numpages, smp_cpus,
+                                    host_nodes, maxnode);
+    if (memset_async) {
+        goto out;
+    }
+
+    if (touch_all_pages_finish(context)) {
         error_setg(errp, "os_mem_prealloc: Insufficient free host memory "
             "pages available to allocate guest RAM");
     }
+    memset_sigbus_restore();
+out:
+    qemu_rec_mutex_unlock(&memset_lock);
+}
 
-    ret = sigaction(SIGBUS, &oldact, NULL);
-    if (ret) {
-        /* Terminate QEMU since it can't recover from error */
-        perror("os_mem_prealloc: failed to reinstall signal handler");
-        exit(1);
+void os_mem_prealloc(int fd, char *area, size_t memory, int smp_cpus,
+                     Error **errp)
+{
+    os_mem_prealloc_nodes(fd, area, memory, smp_cpus, NULL, 0, errp);
+}
+
+int os_bind_thread_to_host_nodes(const unsigned long *host_nodes,
+                                 unsigned long maxnode)
+{
+#ifdef CONFIG_LINUX
+    unsigned long node;
+    cpu_set_t cpus;
+
+    CPU_ZERO(&cpus);
+    for (node = find_first_bit(host_nodes, maxnode); node < maxnode;
+         node = find_next_bit(host_nodes, maxnode, node + 1)) {
+        host_node_add_cpus(&cpus, node);
+    }
+    if (!CPU_COUNT(&cpus)) {
+        return -EINVAL;
+    }
+    if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0) {
+        return -errno;
+    }
+    return 0;
+#else
+    return -ENOTSUP;
+#endif
+}
+
+void os_mem_prealloc_begin_async(Error **errp)
+{
+    memset_init();
+    qemu_rec_mutex_lock(&memset_lock);
+    assert(!memset_async);
+    if (memset_sigbus_install(errp)) {
+        memset_async = true;
+    } else {
+        qemu_rec_mutex_unlock(&memset_lock);
+    }
+}
+
+void os_mem_prealloc_wait(Error **errp)
+{
+    bool failed = false;
+
+    if (!memset_async) {
+        return;
+    }
+
+    while (!QLIST_EMPTY(&memset_contexts)) {
+        failed |= touch_all_pages_finish(QLIST_FIRST(&memset_contexts));
+    }
+    memset_async = false;
+    memset_sigbus_restore();
+    qemu_rec_mutex_unlock(&memset_lock);
+
+    if (failed) {
+        error_setg(errp, "os_mem_prealloc: Insufficient free host memory "
+            "pages available to allocate guest RAM");
     }
 }
 
@@ -18,12 +18,22 @@
 #include "qemu/atomic.h"
 #include "qemu/coroutine.h"
 #include "qemu/coroutine_int.h"
+#include "qemu/cutils.h"
 #include "block/aio.h"
 
 enum {
-    POOL_BATCH_SIZE = 64,
+    POOL_INITIAL_BATCH_SIZE = 64,
 };
 
+/*
+ * Grows with the queue depth of the devices that run requests in
+ * coroutines, so that a full queue of requests can be served from the pool.
+ * pool_batch_requested is what the devices asked for, pool_batch_size the
+ * same clamped to pool_batch_max_size().
+ */
+static unsigned int pool_batch_requested = POOL_INITIAL_BATCH_SIZE;
+static unsigned int pool_batch_size = POOL_INITIAL_BATCH_SIZE;
+
 /** Free list to speed up creation */
 static QSLIST_HEAD(, Coroutine) release_pool = QSLIST_HEAD_INITIALIZER(pool);
 static unsigned int release_pool_size;
@@ -49,7 +59,7 @@ Coroutine *qemu_coroutine_create(CoroutineEntry *entry, void *opaque)
     if (CONFIG_COROUTINE_POOL) {
         co = QSLIST_FIRST(&alloc_pool);
         if (!co) {
-            if (release_pool_size > POOL_BATCH_SIZE) {
+            if (release_pool_size > qatomic_read(&pool_batch_size)) {
                 /* Slow path; a good place to register the destructor, too.  */
                 if (!coroutine_pool_cleanup_notifier.notify) {
                     coroutine_pool_cleanup_notifier.notify = coroutine_pool_cleanup;
@@ -86,12 +96,14 @@ static void coroutine_delete(Coroutine *co)
     co->caller = NULL;
 
     if (CONFIG_COROUTINE_POOL) {
-        if (release_pool_size < POOL_BATCH_SIZE * 2) {
+        unsigned int batch_size = qatomic_read(&pool_batch_size);
+
+        if (release_pool_size < batch_size * 2) {
             QSLIST_INSERT_HEAD_ATOMIC(&release_pool, co, pool_next);
             qatomic_inc(&release_pool_size);
             return;
         }
-        if (alloc_pool_size < POOL_BATCH_SIZE) {
+        if (alloc_pool_size < batch_size) {
             QSLIST_INSERT_HEAD(&alloc_pool, co, pool_next);
             alloc_pool_size++;
             return;
@@ -202,3 +214,51 @@ AioContext *coroutine_fn qemu_coroutine_get_aio_context(Coroutine *co)
 {
     return co->ctx;
 }
+
+/*
+ * Each pooled coroutine keeps its stack, which is two mappings with the
+ * guard page, and the process fails to map anything once it has
+ * vm.max_map_count of them.  The release pool holds up to two batches and
+ * every thread's alloc pool one more; leave room for the pools of a few
+ * threads and a fixed amount for everything else in the process.
+ */
+static unsigned int pool_batch_max_size(void)
+{
+    static unsigned int max_size;
+
+#ifdef CONFIG_LINUX
+    if (!max_size) {
+        g_autofree char *contents = NULL;
+        int max_map_count;
+
+        max_size = UINT_MAX;
+        if (g_file_get_contents("/proc/sys/vm/max_map_count", &contents,
+                                NULL, NULL) &&
+            qemu_strtoi(contents, NULL, 10, &max_map_count) == 0 &&
+            max_map_count > 5000) {
+            max_size = (max_map_count - 5000) / 2 / 8;
+        }
+        max_size = MAX(max_size, POOL_INITIAL_BATCH_SIZE);
+    }
+#else
+    max_size = UINT_MAX;
+#endif
+    return max_size;
+}
+
+static void coroutine_pool_update_batch_size(unsigned int requested)
+{
+    qatomic_set(&pool_batch_size, MIN(requested, pool_batch_max_size()));
+}
+
+void qemu_coroutine_increase_pool_batch_size(unsigned int additional_pool_size)
+{
+    coroutine_pool_update_batch_size(
+        qatomic_add_fetch(&pool_batch_requested, additional_pool_size));
+}
+
+void qemu_coroutine_decrease_pool_batch_size(unsigned int removing_pool_size)
+{
+    coroutine_pool_update_batch_size(
+        qatomic_sub_fetch(&pool_batch_requested, removing_pool_size));
+}
@@ -67,7 +67,16 @@ static QEMUClock qemu_clocks[QEMU_CLOCK_MAX];
 struct QEMUTimerList {
     QEMUClock *clock;
     QemuMutex active_timers_lock;
-    QEMUTimer *active_timers;
+    /*
+     * Pending timers, as a binary min-heap with the soonest timer first.
+     * Timers with the same expire time fire in the order they were armed,
+     * thanks to next_seq.  nr_active_timers can be read without the lock
+     * to check for pending timers.
+     */
+    QEMUTimer **active_timers;
+    size_t nr_active_timers;
+    size_t max_active_timers;
+    uint64_t next_seq;
     QLIST_ENTRY(QEMUTimerList) list;
     QEMUTimerListNotifyCB *notify_cb;
     void *notify_opaque;
@@ -118,6 +127,7 @@ void timerlist_free(QEMUTimerList *timer_list)
         QLIST_REMOVE(timer_list, list);
     }
     qemu_mutex_destroy(&timer_list->active_timers_lock);
+    g_free(timer_list->active_timers);
     g_free(timer_list);
 }
 
@@ -172,7 +182,7 @@ void qemu_clock_enable(QEMUClockType type, bool enabled)
 
 bool timerlist_has_timers(QEMUTimerList *timer_list)
 {
-    return !!qatomic_read(&timer_list->active_timers);
+    return !!qatomic_read(&timer_list->nr_active_timers);
 }
 
 bool qemu_clock_has_timers(QEMUClockType type)
@@ -185,15 +195,15 @@ bool timerlist_expired(QEMUTimerList *timer_list)
 {
     int64_t expire_time;
 
-    if (!qatomic_read(&timer_list->active_timers)) {
+    if (!qatomic_read(&timer_list->nr_active_timers)) {
         return false;
     }
 
     WITH_QEMU_LOCK_GUARD(&timer_list->active_timers_lock) {
-        if (!timer_list->active_timers) {
+        if (!timer_list->nr_active_timers) {
             return false;
         }
-        expire_time = timer_list->active_timers->expire_time;
+        expire_time = timer_list->active_timers[0]->expire_time;
     }
 
     return expire_time <= qemu_clock_get_ns(timer_list->clock->type);
@@ -215,7 +225,7 @@ int64_t timerlist_deadline_ns(QEMUTimerList *timer_list)
     int64_t delta;
     int64_t expire_time;
 
-    if (!qatomic_read(&timer_list->active_timers)) {
+    if (!qatomic_read(&timer_list->nr_active_timers)) {
         return -1;
     }
 
@@ -228,10 +238,10 @@ int64_t timerlist_deadline_ns(QEMUTimerList *timer_list)
      * the caller should notice the change and there is no race condition.
      */
     WITH_QEMU_LOCK_GUARD(&timer_list->active_timers_lock) {
-        if (!timer_list->active_timers) {
+        if (!timer_list->nr_active_timers) {
             return -1;
         }
-        expire_time = timer_list->active_timers->expire_time;
+        expire_time = timer_list->active_timers[0]->expire_time;
     }
 
     delta = expire_time - qemu_clock_get_ns(timer_list->clock->type);
@@ -243,6 +253,30 @@ int64_t timerlist_deadline_ns(QEMUTimerList *timer_list)
     return delta;
 }
 
+/*
+ * Return the soonest expire time, or -1, of the timers in the subtree of
+ * the heap at @i whose attributes are all in @attr_mask.  Subtrees whose
+ * root doesn't expire before @best can be skipped.
+ */
+static int64_t timerlist_heap_deadline(QEMUTimerList *timer_list, size_t i,
+                                       int attr_mask, int64_t best)
+{
+    QEMUTimer *ts;
+
+    if (i >= timer_list->nr_active_timers) {
+        return best;
+    }
+    ts = timer_list->active_timers[i];
+    if (best != -1 && ts->expire_time >= best) {
+        return best;
+    }
+    if (!(ts->attributes & ~attr_mask)) {
+        return ts->expire_time;
+    }
+    best = timerlist_heap_deadline(timer_list, 2 * i + 1, attr_mask, best);
+    return timerlist_heap_deadline(timer_list, 2 * i + 2, attr_mask, best);
+}
+
 /* Calculate the soonest deadline across all timerlists attached
  * to the clock. This is used for the icount timeout so we
  * ignore whether or not the clock should be used in deadline
@@ -253,7 +287,6 @@ int64_t qemu_clock_deadline_ns_all(QEMUClockType type, int attr_mask)
     int64_t deadline = -1;
     int64_t delta;
     int64_t expire_time;
-    QEMUTimer *ts;
     QEMUTimerList *timer_list;
     QEMUClock *clock = qemu_clock_ptr(type);
 
@@ -262,18 +295,13 @@ int64_t qemu_clock_deadline_ns_all(QEMUClockType type, int attr_mask)
     }
 
     QLIST_FOREACH(timer_list, &clock->timerlists, list) {
-        qemu_mutex_lock(&timer_list->active_timers_lock);
-        ts = timer_list->active_timers;
         /* Skip all external timers */
-        while (ts && (ts->attributes & ~attr_mask)) {
-            ts = ts->next;
-        }
-        if (!ts) {
-            qemu_mutex_unlock(&timer_list->active_timers_lock);
+        qemu_mutex_lock(&timer_list->active_timers_lock);
+        expire_time = timerlist_heap_deadline(timer_list, 0, attr_mask, -1);
+        qemu_mutex_unlock(&timer_list->active_timers_lock);
+        if (expire_time == -1) {
             continue;
         }
-        expire_time = ts->expire_time;
-        qemu_mutex_unlock(&timer_list->active_timers_lock);
 
         delta = expire_time - qemu_clock_get_ns(type);
         if (delta <= 0) {
@@ -376,43 +404,104 @@ void timer_deinit(QEMUTimer *ts)
     ts->timer_list = NULL;
 }
 
-static void timer_del_locked(QEMUTimerList *timer_list, QEMUTimer *ts)
+static bool timer_before(QEMUTimer *a, QEMUTimer *b)
 {
-    QEMUTimer **pt, *t;
+    return a->expire_time < b->expire_time ||
+           (a->expire_time == b->expire_time && a->seq < b->seq);
+}
 
-    ts->expire_time = -1;
-    pt = &timer_list->active_timers;
-    for(;;) {
-        t = *pt;
-        if (!t)
-            break;
-        if (t == ts) {
-            qatomic_set(pt, t->next);
+static void timerlist_heap_set(QEMUTimerList *timer_list, size_t i,
+                               QEMUTimer *ts)
+{
+    timer_list->active_timers[i] = ts;
+    ts->heap_index = i;
+}
+
+/* Move @ts, which goes to position @i, towards the root of the heap */
+static void timerlist_heap_up(QEMUTimerList *timer_list, size_t i,
+                              QEMUTimer *ts)
+{
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+
+        if (!timer_before(ts, timer_list->active_timers[parent])) {
             break;
         }
-        pt = &t->next;
+        timerlist_heap_set(timer_list, i, timer_list->active_timers[parent]);
+        i = parent;
     }
+    timerlist_heap_set(timer_list, i, ts);
 }
 
-static bool timer_mod_ns_locked(QEMUTimerList *timer_list,
-                                QEMUTimer *ts, int64_t expire_time)
+/* Move @ts, which goes to position @i, towards the leaves of the heap */
+static void timerlist_heap_down(QEMUTimerList *timer_list, size_t i,
+                                QEMUTimer *ts)
 {
-    QEMUTimer **pt, *t;
+    size_t n = timer_list->nr_active_timers;
 
-    /* add the timer in the sorted list */
-    pt = &timer_list->active_timers;
     for (;;) {
-        t = *pt;
-        if (!timer_expired_ns(t, expire_time)) {
+        size_t child = 2 * i + 1;
+
+        if (child >= n) {
+            break;
+        }
+        if (child + 1 < n &&
+            timer_before(timer_list->active_timers[child + 1],
+                         timer_list->active_timers[child])) {
+            child++;
+        }
+        if (!timer_before(timer_list->active_timers[child], ts)) {
             break;
         }
-        pt = &t->next;
+        timerlist_heap_set(timer_list, i, timer_list->active_timers[child]);
+        i = child;
     }
+    timerlist_heap_set(timer_list, i, ts);
+}
+
+static void timer_del_locked(QEMUTimerList *timer_list, QEMUTimer *ts)
+{
+    size_t n = timer_list->nr_active_timers;
+    QEMUTimer *last;
+
+    if (!timer_pending(ts)) {
+        return;
+    }
+    ts->expire_time = -1;
+
+    /* Fill the hole with the last timer and restore the heap order */
+    last = timer_list->active_timers[--n];
+    qatomic_set(&timer_list->nr_active_timers, n);
+    if (last != ts) {
+        if (ts->heap_index > 0 &&
+            timer_before(last,
+                         timer_list->active_timers[(ts->heap_index - 1) / 2])) {
+            timerlist_heap_up(timer_list, ts->heap_index, last);
+        } else {
+            timerlist_heap_down(timer_list, ts->heap_index, last);
+        }
+    }
+}
+
+/* Return true if @ts becomes the first timer to expire */
+static bool timer_mod_ns_locked(QEMUTimerList *timer_list,
+                                QEMUTimer *ts, int64_t expire_time)
+{
+    size_t n = timer_list->nr_active_timers;
+
+    if (n == timer_list->max_active_timers) {
+        timer_list->max_active_timers = MAX(16, n * 2);
+        timer_list->active_timers = g_renew(QEMUTimer *,
+                                            timer_list->active_timers,
+                                            timer_list->max_active_timers);
+    }
+
     ts->expire_time = MAX(expire_time, 0);
-    ts->next = *pt;
-    qatomic_set(pt, ts);
+    ts->seq = timer_list->next_seq++;
+    qatomic_set(&timer_list->nr_active_timers, n + 1);
+    timerlist_heap_up(timer_list, n, ts);
 
-    return pt == &timer_list->active_timers;
+    return ts->heap_index == 0;
 }
 
 static void timerlist_rearm(QEMUTimerList *timer_list)
@@ -504,7 +593,7 @@ bool timerlist_run_timers(QEMUTimerList *timer_list)
     QEMUTimerCB *cb;
     void *opaque;
 
-    if (!qatomic_read(&timer_list->active_timers)) {
+    if (!qatomic_read(&timer_list->nr_active_timers)) {
         return false;
     }
 
@@ -543,7 +632,8 @@ bool timerlist_run_timers(QEMUTimerList *timer_list)
      */
     current_time = qemu_clock_get_ns(timer_list->clock->type);
     qemu_mutex_lock(&timer_list->active_timers_lock);
-    while ((ts = timer_list->active_timers)) {
+    while (timer_list->nr_active_timers) {
+        ts = timer_list->active_timers[0];
         if (!timer_expired_ns(ts, current_time)) {
             /* No expired timers left.  The checkpoint can be skipped
              * if no timers fired or they were all external.
@@ -563,9 +653,7 @@ bool timerlist_run_timers(QEMUTimerList *timer_list)
         }
 
         /* remove timer from the list before calling the callback */
-        timer_list->active_timers = ts->next;
-        ts->next = NULL;
-        ts->expire_time = -1;
+        timer_del_locked(timer_list, ts);
         cb = ts->cb;
         opaque = ts->opaque;
 
@@ -22,8 +22,8 @@
  * - Writes (i.e. insertions/removals) can be concurrent with writes to
  *   different buckets; writes to the same bucket are serialized through a lock.
  * - Optional auto-resizing: the hash table resizes up if the load surpasses
- *   a certain threshold. Resizing is done concurrently with readers; writes
- *   are serialized with the resize operation.
+ *   a certain threshold. Resizing is done concurrently with readers and
+ *   writers; only writes to the bucket being migrated wait for the resize.
  *
  * The key structure is the bucket, which is cacheline-sized. Buckets
  * contain a few hash values and pointers; the u32 hash values are stored in
@@ -43,14 +43,16 @@
  * just-removed entry. This makes lookups slightly faster, since the moment an
  * invalid entry is found, the (failed) lookup is over.
  *
- * Resizing is done by taking all bucket spinlocks (so that no other writers can
- * race with us) and then copying all entries into a new hash map. Then, the
- * ht->map pointer is set, and the old map is freed once no RCU readers can see
- * it anymore.
+ * Resizing migrates the head buckets of the old map one at a time, in order:
+ * with the bucket's spinlock held, its entries are copied into the new map and
+ * the map's count of migrated buckets is bumped. Once all buckets have been
+ * migrated, the ht->map pointer is set, and the old map is freed once no RCU
+ * readers can see it anymore. Resizes are serialized through ht->lock, which
+ * iterators also take so that they never see a partially migrated map.
  *
- * Writers check for concurrent resizes by comparing ht->map before and after
- * acquiring their bucket lock. If they don't match, a resize has occurred
- * while the bucket spinlock was being acquired.
+ * Readers and writers check whether their bucket has already been migrated
+ * (for writers, after acquiring the bucket lock). If so, they move on to the
+ * new map, which is reachable from the old one through map->new.
  *
  * Related Work:
  * - Idea of cacheline-sized buckets with full hashes taken from:
@@ -159,6 +161,9 @@ QEMU_BUILD_BUG_ON(sizeof(struct qht_bucket) > QHT_BUCKET_ALIGN);
  * @n_added_buckets: number of added (i.e. "non-head") buckets
  * @n_added_buckets_threshold: threshold to trigger an upward resize once the
  *                             number of added buckets surpasses it.
+ * @n_migrated: number of head buckets, starting from the first, whose entries
+ *              have been copied into @new during a resize.
+ * @new: the map that this map is being resized to, or NULL.
  *
  * Buckets are tracked in what we call a "map", i.e. this structure.
  */
@@ -168,6 +173,8 @@ struct qht_map {
     size_t n_buckets;
     size_t n_added_buckets;
     size_t n_added_buckets_threshold;
+    size_t n_migrated;
+    struct qht_map *new;
 };
 
 /* trigger a resize when n_added_buckets > n_buckets / div */
@@ -265,13 +272,13 @@ static void qht_map_unlock_buckets(struct qht_map *map)
 }
 
 /*
- * Call with at least a bucket lock held.
- * @map should be the value read before acquiring the lock (or locks).
+ * Whether the entries of head bucket @b have been moved to map->new.
+ * Call with b->lock held, or within a read-side section of b->sequence.
  */
-static inline bool qht_map_is_stale__locked(const struct qht *ht,
-                                            const struct qht_map *map)
+static inline bool qht_bucket_is_migrated(const struct qht_map *map,
+                                          const struct qht_bucket *b)
 {
-    return map != ht->map;
+    return (size_t)(b - map->buckets) < qatomic_read(&map->n_migrated);
 }
 
 /*
@@ -286,21 +293,12 @@ void qht_map_lock_buckets__no_stale(struct qht *ht, struct qht_map **pmap)
 {
     struct qht_map *map;
 
-    map = qatomic_rcu_read(&ht->map);
-    qht_map_lock_buckets(map);
-    if (likely(!qht_map_is_stale__locked(ht, map))) {
-        *pmap = map;
-        return;
-    }
-    qht_map_unlock_buckets(map);
-
-    /* we raced with a resize; acquire ht->lock to see the updated ht->map */
+    /* ht->lock makes us wait for any ongoing resize to complete */
     qht_lock(ht);
     map = ht->map;
     qht_map_lock_buckets(map);
     qht_unlock(ht);
     *pmap = map;
-    return;
 }
 
 /*
@@ -319,23 +317,19 @@ struct qht_bucket *qht_bucket_lock__no_stale(struct qht *ht, uint32_t hash,
     struct qht_map *map;
 
     map = qatomic_rcu_read(&ht->map);
-    b = qht_map_to_bucket(map, hash);
+    for (;;) {
+        b = qht_map_to_bucket(map, hash);
 
-    qemu_spin_lock(&b->lock);
-    if (likely(!qht_map_is_stale__locked(ht, map))) {
-        *pmap = map;
-        return b;
-    }
-    qemu_spin_unlock(&b->lock);
+        qemu_spin_lock(&b->lock);
+        if (likely(!qht_bucket_is_migrated(map, b))) {
+            *pmap = map;
+            return b;
+        }
+        qemu_spin_unlock(&b->lock);
 
-    /* we raced with a resize; acquire ht->lock to see the updated ht->map */
-    qht_lock(ht);
-    map = ht->map;
-    b = qht_map_to_bucket(map, hash);
-    qemu_spin_lock(&b->lock);
-    qht_unlock(ht);
-    *pmap = map;
-    return b;
+        /* we raced with a resize; the bucket now lives in the new map */
+        map = qatomic_rcu_read(&map->new);
+    }
 }
 
 static inline bool qht_map_needs_resize(const struct qht_map *map)
@@ -378,6 +372,8 @@ static struct qht_map *qht_map_create(size_t n_buckets)
     map->n_buckets = n_buckets;
 
     map->n_added_buckets = 0;
+    map->n_migrated = 0;
+    map->new = NULL;
     map->n_added_buckets_threshold = n_buckets /
         QHT_NR_ADDED_BUCKETS_THRESHOLD_DIV;
 
@@ -512,17 +508,29 @@ void *qht_do_lookup(const struct qht_bucket *head, qht_lookup_func_t func,
 }
 
 static __attribute__((noinline))
-void *qht_lookup__slowpath(const struct qht_bucket *b, qht_lookup_func_t func,
+void *qht_lookup__slowpath(const struct qht_map *map, qht_lookup_func_t func,
                            const void *userp, uint32_t hash)
 {
+    const struct qht_bucket *b;
     unsigned int version;
+    bool migrated;
     void *ret;
 
-    do {
-        version = seqlock_read_begin(&b->sequence);
-        ret = qht_do_lookup(b, func, userp, hash);
-    } while (seqlock_read_retry(&b->sequence, version));
-    return ret;
+    for (;;) {
+        b = qht_map_to_bucket(map, hash);
+        do {
+            ret = NULL;
+            version = seqlock_read_begin(&b->sequence);
+            migrated = qht_bucket_is_migrated(map, b);
+            if (!migrated) {
+                ret = qht_do_lookup(b, func, userp, hash);
+            }
+        } while (seqlock_read_retry(&b->sequence, version));
+        if (likely(!migrated)) {
+            return ret;
+        }
+        map = qatomic_rcu_read(&map->new);
+    }
 }
 
 void *qht_lookup_custom(const struct qht *ht, const void *userp, uint32_t hash,
@@ -537,15 +545,17 @@ void *qht_lookup_custom(const struct qht *ht, const void *userp, uint32_t hash,
     b = qht_map_to_bucket(map, hash);
 
     version = seqlock_read_begin(&b->sequence);
-    ret = qht_do_lookup(b, func, userp, hash);
-    if (likely(!seqlock_read_retry(&b->sequence, version))) {
-        return ret;
+    if (likely(!qht_bucket_is_migrated(map, b))) {
+        ret = qht_do_lookup(b, func, userp, hash);
+        if (likely(!seqlock_read_retry(&b->sequence, version))) {
+            return ret;
+        }
     }
     /*
      * Removing the do/while from the fastpath gives a 4% perf. increase when
      * running a 100%-lookup microbenchmark.
      */
-    return qht_lookup__slowpath(b, func, userp, hash);
+    return qht_lookup__slowpath(map, func, userp, hash);
 }
 
 void *qht_lookup(const struct qht *ht, const void *userp, uint32_t hash)
@@ -830,55 +840,75 @@ void qht_iter_remove(struct qht *ht, qht_iter_bool_func_t func, void *userp)
     do_qht_iter(ht, &iter, userp);
 }
 
-struct qht_map_copy_data {
-    struct qht *ht;
-    struct qht_map *new;
-};
-
-static void qht_map_copy(void *p, uint32_t hash, void *userp)
+/*
+ * Copy the entries of the head bucket at @idx in @old into @new, and mark the
+ * bucket as migrated. Only writers to this bucket have to wait for us.
+ */
+static void qht_bucket_migrate(struct qht *ht, struct qht_map *old,
+                               struct qht_map *new, size_t idx)
 {
-    struct qht_map_copy_data *data = userp;
-    struct qht *ht = data->ht;
-    struct qht_map *new = data->new;
-    struct qht_bucket *b = qht_map_to_bucket(new, hash);
+    struct qht_bucket *head = &old->buckets[idx];
+    struct qht_bucket *b = head;
+    int i;
+
+    qemu_spin_lock(&head->lock);
+    do {
+        for (i = 0; i < QHT_BUCKET_ENTRIES; i++) {
+            struct qht_bucket *to;
 
-    /* no need to acquire b->lock because no thread has seen this map yet */
-    qht_insert__locked(ht, new, b, p, hash, NULL);
+            if (b->pointers[i] == NULL) {
+                goto done;
+            }
+            /*
+             * Other buckets of @old might already have been migrated to @to,
+             * so writers can be using it.
+             */
+            to = qht_map_to_bucket(new, b->hashes[i]);
+            qemu_spin_lock(&to->lock);
+            qht_insert__locked(ht, new, to, b->pointers[i], b->hashes[i],
+                               NULL);
+            qht_bucket_debug__locked(to);
+            qemu_spin_unlock(&to->lock);
+        }
+        b = b->next;
+    } while (b);
+ done:
+    /* make readers of this bucket that raced with us retry with @new */
+    seqlock_write_begin(&head->sequence);
+    qatomic_set(&old->n_migrated, idx + 1);
+    seqlock_write_end(&head->sequence);
+    qemu_spin_unlock(&head->lock);
 }
 
 /*
- * Atomically perform a resize and/or reset.
+ * Perform a reset and/or a resize. The resize is atomic with respect to
+ * readers and writers; the reset is performed before it.
  * Call with ht->lock held.
  */
 static void qht_do_resize_reset(struct qht *ht, struct qht_map *new, bool reset)
 {
     struct qht_map *old;
-    const struct qht_iter iter = {
-        .f.retvoid = qht_map_copy,
-        .type = QHT_ITER_VOID,
-    };
-    struct qht_map_copy_data data;
+    size_t i;
 
     old = ht->map;
-    qht_map_lock_buckets(old);
-
     if (reset) {
+        qht_map_lock_buckets(old);
         qht_map_reset__all_locked(old);
+        qht_map_unlock_buckets(old);
     }
 
     if (new == NULL) {
-        qht_map_unlock_buckets(old);
         return;
     }
 
     g_assert(new->n_buckets != old->n_buckets);
-    data.ht = ht;
-    data.new = new;
-    qht_map_iter__all_locked(old, &iter, &data);
-    qht_map_debug__all_locked(new);
+    /* pairs with the qatomic_rcu_read of map->new in readers and writers */
+    qatomic_rcu_set(&old->new, new);
+    for (i = 0; i < old->n_buckets; i++) {
+        qht_bucket_migrate(ht, old, new, i);
+    }
 
     qatomic_rcu_set(&ht->map, new);
-    qht_map_unlock_buckets(old);
     call_rcu(old, qht_map_destroy, rcu);
 }
 
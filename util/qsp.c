@@ -85,6 +85,7 @@ struct QSPEntry {
     const QSPCallSite *callsite;
     uint64_t n_acqs;
     uint64_t ns;
+    uint64_t hist[QSP_HIST_BUCKETS];
     unsigned int n_objs; /* count of coalesced objs; only used for reporting */
 };
 typedef struct QSPEntry QSPEntry;
@@ -107,6 +108,13 @@ static size_t qsp_qemu_path_len;
 /* the address of qsp_thread gives us a unique 'thread ID' */
 static __thread int qsp_thread;
 
+/*
+ * In sampled mode, only one in qsp_period contended acquisitions (or
+ * condvar waits) is measured; qsp_sample_count counts towards the next one.
+ */
+static unsigned int qsp_period;
+static __thread unsigned int qsp_sample_count;
+
 /*
  * Call sites are the same for all threads, so we track them in a separate hash
  * table to save memory.
@@ -348,7 +356,13 @@ static inline void do_qsp_entry_record(QSPEntry *e, int64_t delta, bool acq)
 {
     qatomic_set_u64(&e->ns, e->ns + delta);
     if (acq) {
+        int b = 0;
+
+        if (delta >= 1024) {
+            b = MIN(63 - clz64(delta) - 9, QSP_HIST_BUCKETS - 1);
+        }
         qatomic_set_u64(&e->n_acqs, e->n_acqs + 1);
+        qatomic_set_u64(&e->hist[b], e->hist[b] + 1);
     }
 }
 
@@ -396,6 +410,49 @@ QSP_GEN_VOID(QemuRecMutex, QSP_REC_MUTEX, qsp_rec_mutex_lock,
 QSP_GEN_RET1(QemuRecMutex, QSP_REC_MUTEX, qsp_rec_mutex_trylock,
              qemu_rec_mutex_trylock_impl)
 
+static inline bool qsp_sample(void)
+{
+    if (++qsp_sample_count < qatomic_read(&qsp_period)) {
+        return false;
+    }
+    qsp_sample_count = 0;
+    return true;
+}
+
+/*
+ * Uncontended acquisitions are not measured at all in sampled mode, which
+ * keeps the overhead down to a failed trylock on the slow path.
+ */
+#define QSP_GEN_SAMPLED(type_, qsp_t_, func_, impl_, trylock_impl_)     \
+    static void func_(type_ *obj, const char *file, int line)           \
+    {                                                                   \
+        QSPEntry *e;                                                    \
+        int64_t t0, t1;                                                 \
+                                                                        \
+        if (likely(!trylock_impl_(obj, file, line))) {                  \
+            return;                                                     \
+        }                                                               \
+        if (!qsp_sample()) {                                            \
+            impl_(obj, file, line);                                     \
+            return;                                                     \
+        }                                                               \
+                                                                        \
+        t0 = get_clock();                                               \
+        impl_(obj, file, line);                                         \
+        t1 = get_clock();                                               \
+                                                                        \
+        e = qsp_entry_get(obj, file, line, qsp_t_);                     \
+        qsp_entry_record(e, t1 - t0);                                   \
+    }
+
+QSP_GEN_SAMPLED(QemuMutex, QSP_BQL_MUTEX, qsp_bql_mutex_lock_sampled,
+                qemu_mutex_lock_impl, qemu_mutex_trylock_impl)
+QSP_GEN_SAMPLED(QemuMutex, QSP_MUTEX, qsp_mutex_lock_sampled,
+                qemu_mutex_lock_impl, qemu_mutex_trylock_impl)
+QSP_GEN_SAMPLED(QemuRecMutex, QSP_REC_MUTEX, qsp_rec_mutex_lock_sampled,
+                qemu_rec_mutex_lock_impl, qemu_rec_mutex_trylock_impl)
+
+#undef QSP_GEN_SAMPLED
 #undef QSP_GEN_RET1
 #undef QSP_GEN_VOID
 
@@ -430,13 +487,39 @@ qsp_cond_timedwait(QemuCond *cond, QemuMutex *mutex, int ms,
     return ret;
 }
 
+static void qsp_cond_wait_sampled(QemuCond *cond, QemuMutex *mutex,
+                                  const char *file, int line)
+{
+    if (qsp_sample()) {
+        qsp_cond_wait(cond, mutex, file, line);
+    } else {
+        qemu_cond_wait_impl(cond, mutex, file, line);
+    }
+}
+
+static bool qsp_cond_timedwait_sampled(QemuCond *cond, QemuMutex *mutex,
+                                       int ms, const char *file, int line)
+{
+    if (qsp_sample()) {
+        return qsp_cond_timedwait(cond, mutex, ms, file, line);
+    }
+    return qemu_cond_timedwait_impl(cond, mutex, ms, file, line);
+}
+
 bool qsp_is_enabled(void)
 {
-    return qatomic_read(&qemu_mutex_lock_func) == qsp_mutex_lock;
+    return qatomic_read(&qemu_mutex_lock_func) != qemu_mutex_lock_impl;
+}
+
+/* Returns 0 if profiling is disabled or measures every acquisition */
+unsigned int qsp_get_sample_period(void)
+{
+    return qsp_is_enabled() ? qatomic_read(&qsp_period) : 0;
 }
 
 void qsp_enable(void)
 {
+    qatomic_set(&qsp_period, 0);
     qatomic_set(&qemu_mutex_lock_func, qsp_mutex_lock);
     qatomic_set(&qemu_mutex_trylock_func, qsp_mutex_trylock);
     qatomic_set(&qemu_bql_mutex_lock_func, qsp_bql_mutex_lock);
@@ -446,6 +529,23 @@ void qsp_enable(void)
     qatomic_set(&qemu_cond_timedwait_func, qsp_cond_timedwait);
 }
 
+/*
+ * Only measure one in @period contended lock acquisitions and condvar waits.
+ * Trylocks are not measured.  The overhead is low enough that this mode can
+ * be left enabled on production systems.
+ */
+void qsp_enable_sampled(unsigned int period)
+{
+    qatomic_set(&qsp_period, MAX(period, 1));
+    qatomic_set(&qemu_mutex_lock_func, qsp_mutex_lock_sampled);
+    qatomic_set(&qemu_mutex_trylock_func, qemu_mutex_trylock_impl);
+    qatomic_set(&qemu_bql_mutex_lock_func, qsp_bql_mutex_lock_sampled);
+    qatomic_set(&qemu_rec_mutex_lock_func, qsp_rec_mutex_lock_sampled);
+    qatomic_set(&qemu_rec_mutex_trylock_func, qemu_rec_mutex_trylock_impl);
+    qatomic_set(&qemu_cond_wait_func, qsp_cond_wait_sampled);
+    qatomic_set(&qemu_cond_timedwait_func, qsp_cond_timedwait_sampled);
+}
+
 void qsp_disable(void)
 {
     qatomic_set(&qemu_mutex_lock_func, qemu_mutex_lock_impl);
@@ -531,6 +631,7 @@ static void qsp_aggregate(void *p, uint32_t h, void *up)
     const QSPEntry *e = p;
     QSPEntry *agg;
     uint32_t hash;
+    int i;
 
     hash = qsp_entry_no_thread_hash(e);
     agg = qsp_entry_find(ht, e, hash);
@@ -540,6 +641,9 @@ static void qsp_aggregate(void *p, uint32_t h, void *up)
      */
     agg->ns += qatomic_read_u64(&e->ns);
     agg->n_acqs += qatomic_read_u64(&e->n_acqs);
+    for (i = 0; i < QSP_HIST_BUCKETS; i++) {
+        agg->hist[i] += qatomic_read_u64(&e->hist[i]);
+    }
 }
 
 static void qsp_iter_diff(void *p, uint32_t hash, void *htp)
@@ -547,6 +651,7 @@ static void qsp_iter_diff(void *p, uint32_t hash, void *htp)
     struct qht *ht = htp;
     QSPEntry *old = p;
     QSPEntry *new;
+    int i;
 
     new = qht_lookup(ht, old, hash);
     /* entries are never deleted, so we must have this one */
@@ -557,6 +662,10 @@ static void qsp_iter_diff(void *p, uint32_t hash, void *htp)
 
     new->n_acqs -= old->n_acqs;
     new->ns -= old->ns;
+    for (i = 0; i < QSP_HIST_BUCKETS; i++) {
+        g_assert(new->hist[i] >= old->hist[i]);
+        new->hist[i] -= old->hist[i];
+    }
 
     /* No point in reporting an empty entry */
     if (new->n_acqs == 0 && new->ns == 0) {
@@ -578,6 +687,7 @@ static void qsp_iter_callsite_coalesce(void *p, uint32_t h, void *htp)
     QSPEntry *old = p;
     QSPEntry *e;
     uint32_t hash;
+    int i;
 
     hash = qsp_entry_no_thread_obj_hash(old);
     e = qht_lookup(ht, old, hash);
@@ -589,6 +699,9 @@ static void qsp_iter_callsite_coalesce(void *p, uint32_t h, void *htp)
     }
     e->ns += old->ns;
     e->n_acqs += old->n_acqs;
+    for (i = 0; i < QSP_HIST_BUCKETS; i++) {
+        e->hist[i] += old->hist[i];
+    }
 }
 
 static void qsp_ht_delete(void *p, uint32_t h, void *htp)
@@ -785,6 +898,59 @@ void qsp_report(size_t max, enum QSPSortBy sort_by,
     report_destroy(&rep);
 }
 
+struct QSPForeachState {
+    QSPStatsFunc func;
+    void *opaque;
+    size_t n;
+    size_t max;
+};
+typedef struct QSPForeachState QSPForeachState;
+
+static gboolean qsp_tree_foreach(gpointer key, gpointer value, gpointer udata)
+{
+    const QSPEntry *e = key;
+    QSPForeachState *state = udata;
+    g_autofree char *callsite_at = NULL;
+    QSPStats stats;
+
+    if (state->n == state->max) {
+        return TRUE;
+    }
+    state->n++;
+
+    callsite_at = qsp_at(e->callsite);
+    stats.type = qsp_typenames[e->callsite->type];
+    stats.callsite = callsite_at;
+    stats.n_objs = e->n_objs;
+    stats.n_acqs = e->n_acqs;
+    stats.ns = e->ns;
+    memcpy(stats.hist, e->hist, sizeof(stats.hist));
+    state->func(&stats, state->opaque);
+    return FALSE;
+}
+
+/*
+ * Call @func for the @max call sites with the highest wait times, coalescing
+ * the objects that are waited on at each call site.  The strings in the
+ * QSPStats are only valid until @func returns.
+ */
+void qsp_foreach(size_t max, enum QSPSortBy sort_by,
+                 QSPStatsFunc func, void *opaque)
+{
+    GTree *tree = g_tree_new_full(qsp_tree_cmp, &sort_by, g_free, NULL);
+    QSPForeachState state = {
+        .func = func,
+        .opaque = opaque,
+        .max = max,
+    };
+
+    qsp_init();
+
+    qsp_mktree(tree, true);
+    g_tree_foreach(tree, qsp_tree_foreach, &state);
+    g_tree_destroy(tree);
+}
+
 static void qsp_snapshot_destroy(QSPSnapshot *snap)
 {
     qht_iter(&snap->ht, qsp_ht_delete, NULL);
@@ -32,6 +32,7 @@
 #include "qemu/thread.h"
 #include "qemu/main-loop.h"
 #include "qemu/lockable.h"
+#include "qemu/timer.h"
 #if defined(CONFIG_MALLOC_TRIM)
 #include <malloc.h>
 #endif
@@ -49,6 +50,13 @@ QemuEvent rcu_gp_event;
 static QemuMutex rcu_registry_lock;
 static QemuMutex rcu_sync_lock;
 
+/* Number of grace periods completed.  Written under rcu_sync_lock.  */
+static unsigned long rcu_gp_completed;
+
+/* Kept separate from rcu_sync_lock, which is held for whole grace periods */
+static QemuMutex rcu_stats_lock;
+static RCUStats rcu_stats;
+
 /*
  * Check whether a quiescent state was crossed between the beginning of
  * update_counter_and_wait and now.
@@ -140,16 +148,48 @@ static void wait_for_readers(void)
     QLIST_SWAP(&registry, &qsreaders, node);
 }
 
+static void rcu_account_grace_period(int64_t elapsed)
+{
+    QEMU_LOCK_GUARD(&rcu_stats_lock);
+    if (elapsed < 0) {
+        rcu_stats.shared_grace_periods++;
+        return;
+    }
+    rcu_stats.grace_periods++;
+    rcu_stats.total_ns += elapsed;
+    rcu_stats.max_ns = MAX(rcu_stats.max_ns, elapsed);
+}
+
 void synchronize_rcu(void)
 {
+    unsigned long snap;
+    int64_t start;
+
+    /* Order the caller's updates before the snapshot of rcu_gp_completed */
+    smp_mb();
+    snap = qatomic_read(&rcu_gp_completed);
+
     QEMU_LOCK_GUARD(&rcu_sync_lock);
 
+    /*
+     * Concurrent callers share grace periods.  The one that was running
+     * when the snapshot was taken may have started before the caller's
+     * updates, but once the next one has completed as well, there is
+     * nothing left to wait for.
+     */
+    if ((long)(rcu_gp_completed - snap) >= 2) {
+        rcu_account_grace_period(-1);
+        return;
+    }
+
+    start = get_clock();
+
     /* Write RCU-protected pointers before reading p_rcu_reader->ctr.
      * Pairs with smp_mb_placeholder() in rcu_read_lock().
      */
     smp_mb_global();
 
-    QEMU_LOCK_GUARD(&rcu_registry_lock);
+    qemu_mutex_lock(&rcu_registry_lock);
     if (!QLIST_EMPTY(&registry)) {
         /* In either case, the qatomic_mb_set below blocks stores that free
          * old RCU-protected pointers.
@@ -170,6 +210,10 @@ void synchronize_rcu(void)
 
         wait_for_readers();
     }
+    qemu_mutex_unlock(&rcu_registry_lock);
+
+    qatomic_set(&rcu_gp_completed, rcu_gp_completed + 1);
+    rcu_account_grace_period(get_clock() - start);
 }
 
 
@@ -293,6 +337,14 @@ void call_rcu1(struct rcu_head *node, void (*func)(struct rcu_head *node))
     qemu_event_set(&rcu_call_ready_event);
 }
 
+void rcu_get_stats(RCUStats *stats)
+{
+    WITH_QEMU_LOCK_GUARD(&rcu_stats_lock) {
+        *stats = rcu_stats;
+    }
+    stats->pending_callbacks = MAX(qatomic_read(&rcu_call_count), 0);
+}
+
 
 struct rcu_drain {
     struct rcu_head rcu;
@@ -369,6 +421,7 @@ static void rcu_init_complete(void)
 
     qemu_mutex_init(&rcu_registry_lock);
     qemu_mutex_init(&rcu_sync_lock);
+    qemu_mutex_init(&rcu_stats_lock);
     qemu_event_init(&rcu_gp_event, true);
 
     qemu_event_init(&rcu_call_ready_event, false);
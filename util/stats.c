@@ -0,0 +1,195 @@
+/*
+ * Statistics registry
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/stats.h"
+#include "qemu/queue.h"
+#include "qemu/thread.h"
+#include "qemu/lockable.h"
+#include "qapi/error.h"
+#include "qapi/util.h"
+#include "qapi/qapi-commands-stats.h"
+
+struct StatsSource {
+    const StatsGroup *group;
+    void *opaque;
+    QTAILQ_ENTRY(StatsSource) next;
+};
+
+/* Protects stats_sources and stats_groups */
+static QemuMutex stats_lock;
+static QTAILQ_HEAD(, StatsSource) stats_sources =
+    QTAILQ_HEAD_INITIALIZER(stats_sources);
+
+/* Every group that was ever registered, for query-stats-schemas */
+static GPtrArray *stats_groups;
+
+static void __attribute__((__constructor__)) stats_init(void)
+{
+    qemu_mutex_init(&stats_lock);
+    stats_groups = g_ptr_array_new();
+}
+
+StatsSource *stats_register(const StatsGroup *group, void *opaque)
+{
+    StatsSource *source = g_new0(StatsSource, 1);
+    guint i;
+
+    source->group = group;
+    source->opaque = opaque;
+
+    QEMU_LOCK_GUARD(&stats_lock);
+    for (i = 0; i < stats_groups->len; i++) {
+        if (g_ptr_array_index(stats_groups, i) == group) {
+            break;
+        }
+    }
+    if (i == stats_groups->len) {
+        g_ptr_array_add(stats_groups, (gpointer)group);
+    }
+    QTAILQ_INSERT_TAIL(&stats_sources, source, next);
+    return source;
+}
+
+void stats_unregister(StatsSource *source)
+{
+    if (!source) {
+        return;
+    }
+
+    WITH_QEMU_LOCK_GUARD(&stats_lock) {
+        QTAILQ_REMOVE(&stats_sources, source, next);
+    }
+    g_free(source);
+}
+
+static bool str_in_list(const char *str, strList *list)
+{
+    for (; list; list = list->next) {
+        if (!strcmp(list->value, str)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool stats_filter_match_group(StatsFilter *filter,
+                                     const StatsGroup *group)
+{
+    StatsProviderList *p;
+
+    if (filter->has_target && filter->target != group->target) {
+        return false;
+    }
+    if (!filter->has_providers) {
+        return true;
+    }
+    for (p = filter->providers; p; p = p->next) {
+        if (p->value == group->provider) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static StatsResult *stats_read_source(StatsFilter *filter,
+                                      StatsSource *source)
+{
+    const StatsGroup *group = source->group;
+    g_autofree uint64_t *values = NULL;
+    g_autofree char *id = NULL;
+    StatsResult *result;
+    size_t i;
+
+    if (group->get_id) {
+        id = group->get_id(source->opaque);
+        if (!id) {
+            return NULL;
+        }
+    }
+    if (filter->has_ids && (!id || !str_in_list(id, filter->ids))) {
+        return NULL;
+    }
+
+    values = g_new0(uint64_t, group->nr_stats);
+    group->read(source->opaque, values);
+
+    result = g_new0(StatsResult, 1);
+    result->provider = group->provider;
+    result->target = group->target;
+    result->has_id = !!id;
+    result->id = g_steal_pointer(&id);
+
+    /* Prepend in reverse, so that the order matches the schema */
+    for (i = group->nr_stats; i-- > 0; ) {
+        Stats *stats;
+
+        if (filter->has_names &&
+            !str_in_list(group->stats[i].name, filter->names)) {
+            continue;
+        }
+        stats = g_new0(Stats, 1);
+        stats->name = g_strdup(group->stats[i].name);
+        stats->value = values[i];
+        QAPI_LIST_PREPEND(result->stats, stats);
+    }
+    return result;
+}
+
+StatsResultList *qmp_query_stats(StatsFilter *filter, Error **errp)
+{
+    StatsResultList *head = NULL;
+    StatsSource *source;
+
+    QEMU_LOCK_GUARD(&stats_lock);
+    QTAILQ_FOREACH_REVERSE(source, &stats_sources, next) {
+        StatsResult *result;
+
+        if (!stats_filter_match_group(filter, source->group)) {
+            continue;
+        }
+        result = stats_read_source(filter, source);
+        if (result) {
+            QAPI_LIST_PREPEND(head, result);
+        }
+    }
+    return head;
+}
+
+StatsSchemaList *qmp_query_stats_schemas(bool has_provider,
+                                         StatsProvider provider,
+                                         Error **errp)
+{
+    StatsSchemaList *head = NULL;
+    guint i;
+
+    QEMU_LOCK_GUARD(&stats_lock);
+    for (i = stats_groups->len; i-- > 0; ) {
+        const StatsGroup *group = g_ptr_array_index(stats_groups, i);
+        StatsSchema *schema;
+        size_t j;
+
+        if (has_provider && group->provider != provider) {
+            continue;
+        }
+
+        schema = g_new0(StatsSchema, 1);
+        schema->provider = group->provider;
+        schema->target = group->target;
+        for (j = group->nr_stats; j-- > 0; ) {
+            StatsSchemaValue *value = g_new0(StatsSchemaValue, 1);
+
+            value->name = g_strdup(group->stats[j].name);
+            value->type = group->stats[j].type;
+            value->has_unit = group->stats[j].has_unit;
+            value->unit = group->stats[j].unit;
+            QAPI_LIST_PREPEND(schema->stats, value);
+        }
+        QAPI_LIST_PREPEND(head, schema);
+    }
+    return head;
+}
@@ -14,6 +14,21 @@
 #include <linux/membarrier.h>
 #include <sys/syscall.h>
 
+/*
+ * Added in Linux 4.14; they are enumerators, so they cannot be tested for
+ * with #ifdef and may be missing from older headers.
+ */
+#define QEMU_MEMBARRIER_CMD_PRIVATE_EXPEDITED           (1 << 3)
+#define QEMU_MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED  (1 << 4)
+
+/*
+ * MEMBARRIER_CMD_SHARED waits for a scheduler grace period of the whole
+ * system, which takes milliseconds.  The expedited command interrupts the
+ * CPUs that run threads of this process instead, and returns as soon as
+ * they have executed a memory barrier.
+ */
+static int membarrier_cmd = MEMBARRIER_CMD_SHARED;
+
 static int
 membarrier(int cmd, int flags)
 {
@@ -26,7 +41,7 @@ void smp_mb_global(void)
 #if defined CONFIG_WIN32
     FlushProcessWriteBuffers();
 #elif defined CONFIG_LINUX
-    membarrier(MEMBARRIER_CMD_SHARED, 0);
+    membarrier(membarrier_cmd, 0);
 #else
 #error --enable-membarrier is not supported on this operating system.
 #endif
@@ -41,6 +56,12 @@ void smp_mb_global_init(void)
         error_report("Please upgrade your system to a newer version of Linux");
         exit(1);
     }
+    if ((ret & QEMU_MEMBARRIER_CMD_PRIVATE_EXPEDITED) &&
+        (ret & QEMU_MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED) &&
+        membarrier(QEMU_MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0) == 0) {
+        membarrier_cmd = QEMU_MEMBARRIER_CMD_PRIVATE_EXPEDITED;
+        return;
+    }
     if (!(ret & MEMBARRIER_CMD_SHARED)) {
         error_report("This QEMU binary requires MEMBARRIER_CMD_SHARED support.");
         error_report("Please upgrade your system to a newer version of Linux");
@@ -58,7 +58,6 @@ struct ThreadPool {
     QemuMutex lock;
     QemuCond worker_stopped;
     QemuSemaphore sem;
-    int max_threads;
     QEMUBH *new_thread_bh;
 
     /* The following variables are only accessed from one AioContext. */
@@ -66,6 +65,8 @@ struct ThreadPool {
 
     /* The following variables are protected by lock.  */
     QTAILQ_HEAD(, ThreadPoolElement) request_list;
+    int min_threads;
+    int max_threads;
     int cur_threads;
     int idle_threads;
     int new_threads;     /* backlog of threads we need to create */
@@ -73,6 +74,19 @@ struct ThreadPool {
     bool stopping;
 };
 
+/*
+ * Called with lock taken when the semaphore wait of an idle worker returns.
+ * A worker whose wait timed out keeps waiting if there is work queued (it
+ * raced with the post), if the pool is shrinking (another worker will take
+ * the post and exit) or if the pool must keep min_threads workers alive.
+ */
+static bool back_to_sleep(ThreadPool *pool, int ret)
+{
+    return ret == -1 && (!QTAILQ_EMPTY(&pool->request_list) ||
+                         pool->cur_threads > pool->max_threads ||
+                         pool->cur_threads <= pool->min_threads);
+}
+
 static void *worker_thread(void *opaque)
 {
     ThreadPool *pool = opaque;
@@ -81,7 +95,7 @@ static void *worker_thread(void *opaque)
     pool->pending_threads--;
     do_spawn_thread(pool);
 
-    while (!pool->stopping) {
+    while (!pool->stopping && pool->cur_threads <= pool->max_threads) {
         ThreadPoolElement *req;
         int ret;
 
@@ -91,12 +105,27 @@ static void *worker_thread(void *opaque)
             ret = qemu_sem_timedwait(&pool->sem, 10000);
             qemu_mutex_lock(&pool->lock);
             pool->idle_threads--;
-        } while (ret == -1 && !QTAILQ_EMPTY(&pool->request_list));
+        } while (back_to_sleep(pool, ret));
         if (ret == -1 || pool->stopping) {
             break;
         }
+        if (pool->cur_threads > pool->max_threads) {
+            /* The post may have been for a request, pass it on */
+            if (!QTAILQ_EMPTY(&pool->request_list)) {
+                qemu_sem_post(&pool->sem);
+            }
+            break;
+        }
 
+        /*
+         * thread_pool_update_params() posts without queueing a request to
+         * shrink the pool.  If the workers above max_threads have already
+         * gone, e.g. because their wait timed out, there is nothing to do.
+         */
         req = QTAILQ_FIRST(&pool->request_list);
+        if (!req) {
+            continue;
+        }
         QTAILQ_REMOVE(&pool->request_list, req, reqs);
         req->state = THREAD_ACTIVE;
         qemu_mutex_unlock(&pool->lock);
@@ -306,11 +335,34 @@ static void thread_pool_init_one(ThreadPool *pool, AioContext *ctx)
     qemu_mutex_init(&pool->lock);
     qemu_cond_init(&pool->worker_stopped);
     qemu_sem_init(&pool->sem, 0);
-    pool->max_threads = 64;
     pool->new_thread_bh = aio_bh_new(ctx, spawn_thread_bh_fn, pool);
 
     QLIST_INIT(&pool->head);
     QTAILQ_INIT(&pool->request_list);
+
+    thread_pool_update_params(pool, ctx);
+}
+
+void thread_pool_update_params(ThreadPool *pool, AioContext *ctx)
+{
+    int i;
+
+    QEMU_LOCK_GUARD(&pool->lock);
+
+    pool->min_threads = ctx->thread_pool_min;
+    pool->max_threads = ctx->thread_pool_max;
+
+    /*
+     * Start workers until there are min_threads of them, or wake up as
+     * many workers as exceed max_threads so that they exit.  Otherwise
+     * the pool grows and shrinks on its own between the two limits.
+     */
+    for (i = pool->cur_threads; i < pool->min_threads; i++) {
+        spawn_thread(pool);
+    }
+    for (i = pool->cur_threads; i > pool->max_threads; i--) {
+        qemu_sem_post(&pool->sem);
+    }
 }
 
 ThreadPool *thread_pool_new(AioContext *ctx)
@@ -445,12 +445,39 @@ bool throttle_schedule_timer(ThrottleState *ts,
     return true;
 }
 
+/* return the number of operations a request of @size bytes is accounted as
+ *
+ * @ts:   the throttle state we are working on
+ * @size: the size of the request in bytes
+ */
+double throttle_units(ThrottleState *ts, uint64_t size)
+{
+    /* if cfg.op_size is defined and smaller than size we compute unit count */
+    if (ts->cfg.op_size && size > ts->cfg.op_size) {
+        return (double) size / ts->cfg.op_size;
+    }
+    return 1.0;
+}
+
 /* do the accounting for this operation
  *
  * @is_write: the type of operation (read/write)
  * @size:     the size of the operation
  */
 void throttle_account(ThrottleState *ts, bool is_write, uint64_t size)
+{
+    throttle_account_units(ts, is_write, throttle_units(ts, size), size);
+}
+
+/* account @units operations and @size bytes at once; this can be used to
+ * account several requests in advance
+ *
+ * @is_write: the type of operation (read/write)
+ * @units:    the number of operations
+ * @size:     the number of bytes
+ */
+void throttle_account_units(ThrottleState *ts, bool is_write, double units,
+                            uint64_t size)
 {
     const BucketType bucket_types_size[2][2] = {
         { THROTTLE_BPS_TOTAL, THROTTLE_BPS_READ },
@@ -460,14 +487,8 @@ void throttle_account(ThrottleState *ts, bool is_write, uint64_t size)
         { THROTTLE_OPS_TOTAL, THROTTLE_OPS_READ },
         { THROTTLE_OPS_TOTAL, THROTTLE_OPS_WRITE }
     };
-    double units = 1.0;
     unsigned i;
 
-    /* if cfg.op_size is defined and smaller than size we compute unit count */
-    if (ts->cfg.op_size && size > ts->cfg.op_size) {
-        units = (double) size / ts->cfg.op_size;
-    }
-
     for (i = 0; i < 2; i++) {
         LeakyBucket *bkt;
 